@@ -0,0 +1,156 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup allocstats allocstats
+ * @brief Counting heap allocator for the benchmarks
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file allocstats.c
+
+    Counting heap allocator
+
+    The allocstats module replaces the malloc family of functions in the
+    benchmark executables with thin wrappers around the glibc allocator
+    which count the number of allocations and the number of bytes
+    requested.  The benchmarks sample the counters before and after
+    each run to report allocations/op and bytes/op.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include "allocstats.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! glibc allocator entry points */
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t nmemb, size_t size );
+extern void *__libc_realloc( void *ptr, size_t size );
+extern void __libc_free( void *ptr );
+
+/*==============================================================================
+        Private file scoped variables
+==============================================================================*/
+
+/*! allocation counters */
+static AllocStats stats;
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  AllocStats_Get                                                            */
+/*!
+    Get a snapshot of the allocation counters
+
+    @param[out]
+        pStats
+            pointer to the AllocStats object to populate
+
+==============================================================================*/
+void AllocStats_Get( AllocStats *pStats )
+{
+    if ( pStats != NULL )
+    {
+        pStats->allocs = __atomic_load_n( &stats.allocs, __ATOMIC_RELAXED );
+        pStats->frees = __atomic_load_n( &stats.frees, __ATOMIC_RELAXED );
+        pStats->bytes = __atomic_load_n( &stats.bytes, __ATOMIC_RELAXED );
+    }
+}
+
+/*============================================================================*/
+/*  malloc                                                                    */
+/*!
+    Counting replacement for malloc
+
+==============================================================================*/
+void *malloc( size_t size )
+{
+    __atomic_fetch_add( &stats.allocs, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &stats.bytes, size, __ATOMIC_RELAXED );
+
+    return __libc_malloc( size );
+}
+
+/*============================================================================*/
+/*  calloc                                                                    */
+/*!
+    Counting replacement for calloc
+
+==============================================================================*/
+void *calloc( size_t nmemb, size_t size )
+{
+    __atomic_fetch_add( &stats.allocs, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &stats.bytes, nmemb * size, __ATOMIC_RELAXED );
+
+    return __libc_calloc( nmemb, size );
+}
+
+/*============================================================================*/
+/*  realloc                                                                   */
+/*!
+    Counting replacement for realloc
+
+    Each realloc is counted as one allocation of the new size.
+
+==============================================================================*/
+void *realloc( void *ptr, size_t size )
+{
+    __atomic_fetch_add( &stats.allocs, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &stats.bytes, size, __ATOMIC_RELAXED );
+
+    return __libc_realloc( ptr, size );
+}
+
+/*============================================================================*/
+/*  free                                                                      */
+/*!
+    Counting replacement for free
+
+==============================================================================*/
+void free( void *ptr )
+{
+    if ( ptr != NULL )
+    {
+        __atomic_fetch_add( &stats.frees, 1, __ATOMIC_RELAXED );
+    }
+
+    __libc_free( ptr );
+}
+
+/*! @}
+ * end of allocstats group */
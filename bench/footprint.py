@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+#
+# MIT License
+#
+# Copyright (c) 2023 Trevor Monk
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""iothub footprint report
+
+Compares the binary size and memory use of two iothub builds, normally
+the default build and the minimal-footprint build (IOTHUB_MINIMAL).
+For each build it reports the size of the executable and its sections,
+the shared libraries it loads, and the resident and virtual memory of
+the service when idle and at the end of a message load against the
+local hub stand-in (hubsim).
+
+The hub stand-in and the load generator are taken from the tools
+directory, which defaults to the first build.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+from runbench import free_port, stop
+from soak import hubsim_stats, read_status
+
+# rows of the report: key, label
+ROWS = [
+    ("binary_bytes", "executable bytes"),
+    ("text_bytes", "text bytes"),
+    ("data_bytes", "data+bss bytes"),
+    ("libraries", "shared libraries"),
+    ("library_bytes", "shared library bytes"),
+    ("idle_rss_kb", "idle rss kB"),
+    ("idle_vm_kb", "idle virtual kB"),
+    ("load_rss_kb", "rss after load kB"),
+    ("peak_rss_kb", "peak rss kB"),
+    ("threads", "threads"),
+]
+
+
+def sections(path):
+    """Return the text and data+bss sizes of an executable"""
+    if not shutil.which("size"):
+        return None, None
+
+    out = subprocess.run(["size", path], capture_output=True, text=True)
+    lines = out.stdout.splitlines()
+    if out.returncode != 0 or len(lines) < 2:
+        return None, None
+
+    text, data, bss = (int(v) for v in lines[1].split()[:3])
+    return text, data + bss
+
+
+def libraries(path):
+    """Return the shared libraries an executable loads"""
+    if not shutil.which("ldd"):
+        return []
+
+    out = subprocess.run(["ldd", path], capture_output=True, text=True)
+    libs = []
+    for line in out.stdout.splitlines():
+        parts = line.split("=>")
+        if len(parts) == 2 and parts[1].strip().startswith("/"):
+            libs.append(parts[1].split()[0])
+
+    return libs
+
+
+def measure(build, tools, args):
+    """Measure one iothub build"""
+    binary = os.path.join(build, "iothub")
+    result = {"binary_bytes": os.path.getsize(binary)}
+    result["text_bytes"], result["data_bytes"] = sections(binary)
+
+    libs = libraries(binary)
+    result["libraries"] = len(libs)
+    result["library_bytes"] = sum(os.path.getsize(lib) for lib in libs)
+
+    port = free_port()
+    sim_stats = os.path.join(args.tmp, "hubsim.json")
+    quiet = None if args.verbose else subprocess.DEVNULL
+    hubsim = subprocess.Popen([os.path.join(tools, "hubsim"),
+                               "-p", str(port), "-o", sim_stats],
+                              stdout=subprocess.DEVNULL)
+    iothub = None
+    try:
+        time.sleep(0.2)
+        iothub = subprocess.Popen([binary, "-s", "127.0.0.1:%d" % port]
+                                  + args.iothub_args,
+                                  stdout=subprocess.DEVNULL, stderr=quiet)
+        time.sleep(args.settle)
+        result["idle_rss_kb"] = read_status(iothub.pid, "VmRSS")
+        result["idle_vm_kb"] = read_status(iothub.pid, "VmSize")
+
+        out = subprocess.run([os.path.join(tools, "iotload"), "-j",
+                              "-s", "footprint", "-c", str(args.workers),
+                              "-n", str(args.messages // args.workers),
+                              "-b", args.body, "-p", args.profile],
+                             check=True, capture_output=True, text=True)
+        report = json.loads(out.stdout)
+        time.sleep(args.settle)
+
+        stats = hubsim_stats(hubsim, sim_stats)
+        result["delivered"] = stats["unique"] if stats else 0
+        result["sent"] = report["messages"]
+        result["throughput"] = report["throughput"]
+        result["load_rss_kb"] = read_status(iothub.pid, "VmRSS")
+        result["peak_rss_kb"] = read_status(iothub.pid, "VmHWM")
+        result["threads"] = read_status(iothub.pid, "Threads")
+    finally:
+        stop(iothub)
+        stop(hubsim)
+
+    return result
+
+
+def change(base, cur):
+    """Format the relative change between two values"""
+    if not base or cur is None:
+        return ""
+
+    return "%+.1f%%" % ((cur - base) * 100.0 / base)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--default-build", default="build",
+                        help="directory containing the default build")
+    parser.add_argument("--minimal-build", default="build-minimal",
+                        help="directory containing the minimal build")
+    parser.add_argument("--tools-dir",
+                        help="directory containing hubsim and iotload "
+                             "(default: the default build)")
+    parser.add_argument("--messages", type=int, default=20000,
+                        help="total number of messages to send")
+    parser.add_argument("--workers", type=int, default=4,
+                        help="number of iotload worker processes")
+    parser.add_argument("--body", default="64:1024",
+                        help="iotload body size, or min:max")
+    parser.add_argument("--profile", default="typical",
+                        help="iotload header profile")
+    parser.add_argument("--settle", type=float, default=1.0,
+                        help="seconds to let the service settle")
+    parser.add_argument("--iothub-args", default="",
+                        help="extra arguments for both iothub builds")
+    parser.add_argument("--output", default="footprint.json",
+                        help="file to write the results to")
+    parser.add_argument("--verbose", action="store_true",
+                        help="show the iothub diagnostics")
+    args = parser.parse_args()
+    args.iothub_args = args.iothub_args.split()
+    tools = args.tools_dir or args.default_build
+
+    results = {}
+    with tempfile.TemporaryDirectory() as args.tmp:
+        for name, build in (("default", args.default_build),
+                            ("minimal", args.minimal_build)):
+            results[name] = measure(build, tools, args)
+
+    base = results["default"]
+    cur = results["minimal"]
+    print("%-22s %12s %12s %9s" % ("", "default", "minimal", "change"))
+    for key, label in ROWS:
+        print("%-22s %12s %12s %9s" %
+              (label,
+               "-" if base.get(key) is None else base[key],
+               "-" if cur.get(key) is None else cur[key],
+               change(base.get(key), cur.get(key))))
+
+    for name in ("default", "minimal"):
+        r = results[name]
+        print("%s: %d of %d messages delivered (%.0f msgs/s)" %
+              (name, r["delivered"], r["sent"], r["throughput"]))
+
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2)
+
+    failed = [n for n, r in results.items() if r["delivered"] < r["sent"]]
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,804 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup leakcheck leakcheck
+ * @brief Allocation site tracking allocator for the leak soak
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file leakcheck.c
+
+    Allocation site tracking allocator
+
+    The leakcheck library is preloaded (LD_PRELOAD) into the iothub
+    service by the leak soak runner.  It wraps the malloc family of
+    functions around the glibc allocator and records, for every live
+    allocation, the call stack which made it.  Allocations are grouped
+    into sites by call stack, and each site counts its live allocations
+    and live bytes.
+
+    A reporter thread periodically writes a JSON snapshot of the totals
+    and of every site with live allocations to the file named by the
+    LEAKCHECK_OUTPUT environment variable.  Each stack frame is reported
+    as the module path and the offset of the call within it, so the
+    runner can name the function and source line with addr2line.
+
+    Environment:
+
+        LEAKCHECK_OUTPUT       snapshot file (required for reporting)
+        LEAKCHECK_INTERVAL_MS  snapshot interval (default 1000)
+
+    The tracking tables are allocated with mmap so the library never
+    calls back into the allocator it is wrapping.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <time.h>
+#include <malloc.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! number of caller stack frames recorded per allocation site */
+#define LEAKCHECK_DEPTH ( 6 )
+
+/*! number of wrapper frames skipped at the top of each stack */
+#define LEAKCHECK_SKIP ( 2 )
+
+/*! number of allocation site slots (power of two) */
+#define LEAKCHECK_SITES ( 1 << 16 )
+
+/*! initial number of live allocation slots (power of two) */
+#define LEAKCHECK_LIVE ( 1 << 16 )
+
+/*! default snapshot interval in milliseconds */
+#define LEAKCHECK_INTERVAL_MS ( 1000 )
+
+/*! site used when the site table is full */
+#define OVERFLOW_SITE ( 0 )
+
+/*! allocation site */
+typedef struct site
+{
+    /*! stack hash, or 0 if the slot is unused */
+    uint64_t hash;
+
+    /*! caller return addresses */
+    void *frames[LEAKCHECK_DEPTH];
+
+    /*! number of valid frames */
+    uint32_t depth;
+
+    /*! number of live allocations */
+    uint64_t live;
+
+    /*! number of live bytes */
+    uint64_t liveBytes;
+
+    /*! total number of allocations */
+    uint64_t allocs;
+
+} Site;
+
+/*! live allocation */
+typedef struct live
+{
+    /*! allocated pointer, or NULL if the slot is unused */
+    void *ptr;
+
+    /*! requested size */
+    size_t size;
+
+    /*! index of the allocation site */
+    uint32_t site;
+
+} Live;
+
+/*! glibc allocator entry points */
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t nmemb, size_t size );
+extern void *__libc_realloc( void *ptr, size_t size );
+extern void *__libc_memalign( size_t alignment, size_t size );
+extern void __libc_free( void *ptr );
+
+/*==============================================================================
+        Private file scoped variables
+==============================================================================*/
+
+/*! mutex protecting the tracking tables */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*! allocation site table */
+static Site *sites;
+
+/*! live allocation table */
+static Live *lives;
+
+/*! number of live allocation slots */
+static size_t liveSlots;
+
+/*! number of live allocations */
+static uint64_t liveCount;
+
+/*! number of live bytes */
+static uint64_t liveBytes;
+
+/*! total number of tracked allocations */
+static uint64_t totalAllocs;
+
+/*! true once the tracking tables have been created */
+static bool enabled;
+
+/*! set while the current thread is inside the library, so allocations
+    made by the library itself (or by backtrace) are not tracked */
+static __thread int inHook __attribute__(( tls_model( "initial-exec" ) ));
+
+/*! snapshot file name */
+static const char *output;
+
+/*! snapshot interval in milliseconds */
+static unsigned int interval = LEAKCHECK_INTERVAL_MS;
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static void Init( void ) __attribute__(( constructor ));
+static void *MapTable( size_t size );
+static void Track( void *ptr, size_t size );
+static void Untrack( void *ptr );
+static uint32_t FindSite( void );
+static Live *FindLive( void *ptr );
+static void InsertLive( Live *pLive );
+static void RemoveLive( Live *pLive );
+static bool GrowLive( void );
+static void *Reporter( void *arg );
+static void WriteSnapshot( void );
+static int CompareSites( const void *a, const void *b );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+void *malloc( size_t size )
+{
+    void *p = __libc_malloc( size );
+    Track( p, size );
+    return p;
+}
+
+void *calloc( size_t nmemb, size_t size )
+{
+    void *p = __libc_calloc( nmemb, size );
+    Track( p, nmemb * size );
+    return p;
+}
+
+void *realloc( void *ptr, size_t size )
+{
+    void *p = __libc_realloc( ptr, size );
+
+    if ( ( p != NULL ) || ( size == 0 ) )
+    {
+        Untrack( ptr );
+        Track( p, size );
+    }
+
+    return p;
+}
+
+void free( void *ptr )
+{
+    Untrack( ptr );
+    __libc_free( ptr );
+}
+
+void *memalign( size_t alignment, size_t size )
+{
+    void *p = __libc_memalign( alignment, size );
+    Track( p, size );
+    return p;
+}
+
+void *aligned_alloc( size_t alignment, size_t size )
+{
+    return memalign( alignment, size );
+}
+
+int posix_memalign( void **memptr, size_t alignment, size_t size )
+{
+    void *p = __libc_memalign( alignment, size );
+
+    if ( p == NULL )
+    {
+        return ENOMEM;
+    }
+
+    Track( p, size );
+    *memptr = p;
+
+    return 0;
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Init                                                                      */
+/*!
+    Create the tracking tables and start the reporter thread
+
+==============================================================================*/
+static void Init( void )
+{
+    pthread_t thread;
+    void *frames[LEAKCHECK_DEPTH];
+    const char *p;
+
+    inHook++;
+
+    /* the first backtrace loads the unwinder, which allocates */
+    (void)backtrace( frames, LEAKCHECK_DEPTH );
+
+    sites = MapTable( LEAKCHECK_SITES * sizeof( Site ) );
+    lives = MapTable( LEAKCHECK_LIVE * sizeof( Live ) );
+    liveSlots = LEAKCHECK_LIVE;
+
+    /* reserve the overflow site */
+    if ( sites != NULL )
+    {
+        sites[OVERFLOW_SITE].hash = 1;
+    }
+
+    output = getenv( "LEAKCHECK_OUTPUT" );
+    p = getenv( "LEAKCHECK_INTERVAL_MS" );
+    if ( ( p != NULL ) && ( atoi( p ) > 0 ) )
+    {
+        interval = atoi( p );
+    }
+
+    if ( ( sites != NULL ) && ( lives != NULL ) )
+    {
+        enabled = true;
+
+        if ( ( output != NULL ) &&
+             ( pthread_create( &thread, NULL, Reporter, NULL ) == 0 ) )
+        {
+            pthread_detach( thread );
+        }
+    }
+
+    inHook--;
+}
+
+/*============================================================================*/
+/*  MapTable                                                                  */
+/*!
+    Allocate a zeroed table outside of the heap
+
+    The table is populated up front so the pages it touches later do
+    not show up as resident set growth of the process under test.
+
+    @param[in]
+        size
+            table size in bytes
+
+    @retval pointer to the table
+    @retval NULL out of memory
+
+==============================================================================*/
+static void *MapTable( size_t size )
+{
+    void *p;
+
+    p = mmap( NULL,
+              size,
+              PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+              -1,
+              0 );
+
+    return ( p != MAP_FAILED ) ? p : NULL;
+}
+
+/*============================================================================*/
+/*  Track                                                                     */
+/*!
+    Record a new allocation against its call site
+
+    @param[in]
+        ptr
+            allocated pointer (ignored if NULL)
+
+    @param[in]
+        size
+            requested size
+
+==============================================================================*/
+static void Track( void *ptr, size_t size )
+{
+    Live live;
+
+    if ( ( ptr == NULL ) || ( enabled == false ) || ( inHook > 0 ) )
+    {
+        return;
+    }
+
+    inHook++;
+
+    live.ptr = ptr;
+    live.size = size;
+
+    pthread_mutex_lock( &lock );
+
+    live.site = FindSite();
+
+    if ( ( 2 * ( liveCount + 1 ) <= liveSlots ) || ( GrowLive() == true ) )
+    {
+        InsertLive( &live );
+
+        sites[live.site].live++;
+        sites[live.site].liveBytes += size;
+        sites[live.site].allocs++;
+        liveCount++;
+        liveBytes += size;
+        totalAllocs++;
+    }
+
+    pthread_mutex_unlock( &lock );
+
+    inHook--;
+}
+
+/*============================================================================*/
+/*  Untrack                                                                   */
+/*!
+    Remove a freed allocation from its call site
+
+    Pointers which were not tracked (allocated before the library was
+    initialized, or by the library itself) are ignored.
+
+    @param[in]
+        ptr
+            pointer being freed
+
+==============================================================================*/
+static void Untrack( void *ptr )
+{
+    Live *pLive;
+    Site *pSite;
+
+    if ( ( ptr == NULL ) || ( enabled == false ) )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &lock );
+
+    pLive = FindLive( ptr );
+    if ( pLive != NULL )
+    {
+        pSite = &sites[pLive->site];
+        pSite->live--;
+        pSite->liveBytes -= pLive->size;
+        liveCount--;
+        liveBytes -= pLive->size;
+
+        RemoveLive( pLive );
+    }
+
+    pthread_mutex_unlock( &lock );
+}
+
+/*============================================================================*/
+/*  FindSite                                                                  */
+/*!
+    Find or create the allocation site for the current call stack
+
+    The caller must hold the lock.
+
+    @retval index of the allocation site
+
+==============================================================================*/
+static uint32_t FindSite( void )
+{
+    void *frames[LEAKCHECK_DEPTH + LEAKCHECK_SKIP];
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t depth;
+    uint32_t i;
+    int n;
+
+    n = backtrace( frames, LEAKCHECK_DEPTH + LEAKCHECK_SKIP );
+    depth = ( n > LEAKCHECK_SKIP ) ? (uint32_t)( n - LEAKCHECK_SKIP ) : 0;
+
+    for ( i = 0; i < depth; i++ )
+    {
+        hash = ( hash ^ (uintptr_t)frames[i + LEAKCHECK_SKIP] ) *
+               1099511628211ULL;
+    }
+
+    /* 0 marks an unused slot and 1 is the overflow site */
+    if ( hash <= 1 )
+    {
+        hash += 2;
+    }
+
+    i = hash & ( LEAKCHECK_SITES - 1 );
+    while ( sites[i].hash != 0 )
+    {
+        if ( sites[i].hash == hash )
+        {
+            return i;
+        }
+
+        i = ( i + 1 ) & ( LEAKCHECK_SITES - 1 );
+        if ( i == ( hash & ( LEAKCHECK_SITES - 1 ) ) )
+        {
+            return OVERFLOW_SITE;
+        }
+    }
+
+    sites[i].hash = hash;
+    sites[i].depth = depth;
+    memcpy( sites[i].frames,
+            &frames[LEAKCHECK_SKIP],
+            depth * sizeof( void * ) );
+
+    return i;
+}
+
+/*============================================================================*/
+/*  FindLive                                                                  */
+/*!
+    Find the live allocation record for a pointer
+
+    The caller must hold the lock.
+
+    @param[in]
+        ptr
+            allocated pointer
+
+    @retval pointer to the live allocation record
+    @retval NULL the pointer is not tracked
+
+==============================================================================*/
+static Live *FindLive( void *ptr )
+{
+    size_t i;
+
+    i = ( (uintptr_t)ptr >> 4 ) * 0x9e3779b97f4a7c15ULL & ( liveSlots - 1 );
+    while ( lives[i].ptr != NULL )
+    {
+        if ( lives[i].ptr == ptr )
+        {
+            return &lives[i];
+        }
+
+        i = ( i + 1 ) & ( liveSlots - 1 );
+    }
+
+    return NULL;
+}
+
+/*============================================================================*/
+/*  InsertLive                                                                */
+/*!
+    Insert a live allocation record
+
+    The caller must hold the lock and ensure there is a free slot.
+
+    @param[in]
+        pLive
+            pointer to the record to insert
+
+==============================================================================*/
+static void InsertLive( Live *pLive )
+{
+    size_t i;
+
+    i = ( (uintptr_t)pLive->ptr >> 4 ) * 0x9e3779b97f4a7c15ULL &
+        ( liveSlots - 1 );
+    while ( lives[i].ptr != NULL )
+    {
+        i = ( i + 1 ) & ( liveSlots - 1 );
+    }
+
+    lives[i] = *pLive;
+}
+
+/*============================================================================*/
+/*  RemoveLive                                                                */
+/*!
+    Remove a live allocation record
+
+    Linear probing chains are repaired by shifting later entries back
+    into the vacated slot, so no tombstones are needed.
+
+    The caller must hold the lock.
+
+    @param[in]
+        pLive
+            pointer to the record to remove
+
+==============================================================================*/
+static void RemoveLive( Live *pLive )
+{
+    size_t hole = pLive - lives;
+    size_t i = hole;
+    size_t home;
+
+    while ( true )
+    {
+        i = ( i + 1 ) & ( liveSlots - 1 );
+        if ( lives[i].ptr == NULL )
+        {
+            break;
+        }
+
+        home = ( (uintptr_t)lives[i].ptr >> 4 ) * 0x9e3779b97f4a7c15ULL &
+               ( liveSlots - 1 );
+
+        /* move the entry if its home is not cyclically in (hole, i] */
+        if ( ( ( i > hole ) && ( ( home <= hole ) || ( home > i ) ) ) ||
+             ( ( i < hole ) && ( ( home <= hole ) && ( home > i ) ) ) )
+        {
+            lives[hole] = lives[i];
+            hole = i;
+        }
+    }
+
+    lives[hole].ptr = NULL;
+}
+
+/*============================================================================*/
+/*  GrowLive                                                                  */
+/*!
+    Double the size of the live allocation table
+
+    The caller must hold the lock.
+
+    @retval true the table was grown
+    @retval false out of memory
+
+==============================================================================*/
+static bool GrowLive( void )
+{
+    Live *old = lives;
+    size_t oldSlots = liveSlots;
+    Live *p;
+    size_t i;
+
+    p = MapTable( 2 * liveSlots * sizeof( Live ) );
+    if ( p == NULL )
+    {
+        return false;
+    }
+
+    lives = p;
+    liveSlots *= 2;
+
+    for ( i = 0; i < oldSlots; i++ )
+    {
+        if ( old[i].ptr != NULL )
+        {
+            InsertLive( &old[i] );
+        }
+    }
+
+    munmap( old, oldSlots * sizeof( Live ) );
+
+    return true;
+}
+
+/*============================================================================*/
+/*  Reporter                                                                  */
+/*!
+    Snapshot reporter thread
+
+    @param[in]
+        arg
+            unused
+
+    @retval NULL
+
+==============================================================================*/
+static void *Reporter( void *arg )
+{
+    (void)arg;
+
+    /* nothing allocated by this thread is tracked */
+    inHook++;
+
+    while ( true )
+    {
+        usleep( interval * 1000 );
+        WriteSnapshot();
+    }
+
+    return NULL;
+}
+
+/*============================================================================*/
+/*  WriteSnapshot                                                             */
+/*!
+    Write a JSON snapshot of the live allocations
+
+    The sites with live allocations are copied under the lock, sorted
+    by live bytes, and written to a temporary file which is then
+    renamed over the snapshot file so readers never see a partial
+    snapshot.
+
+==============================================================================*/
+static void WriteSnapshot( void )
+{
+    static Site *snapshot;
+    static char tmpName[4096];
+    struct mallinfo2 mi;
+    struct timespec ts;
+    Dl_info info;
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t allocs;
+    size_t n = 0;
+    size_t i;
+    uint32_t j;
+    FILE *fp;
+    void *addr;
+
+    if ( snapshot == NULL )
+    {
+        snapshot = MapTable( LEAKCHECK_SITES * sizeof( Site ) );
+        snprintf( tmpName, sizeof( tmpName ), "%s.tmp", output );
+        if ( snapshot == NULL )
+        {
+            return;
+        }
+    }
+
+    pthread_mutex_lock( &lock );
+
+    for ( i = 0; i < LEAKCHECK_SITES; i++ )
+    {
+        if ( ( sites[i].hash != 0 ) && ( sites[i].live > 0 ) )
+        {
+            snapshot[n++] = sites[i];
+        }
+    }
+
+    count = liveCount;
+    bytes = liveBytes;
+    allocs = totalAllocs;
+
+    pthread_mutex_unlock( &lock );
+
+    qsort( snapshot, n, sizeof( Site ), CompareSites );
+
+    mi = mallinfo2();
+    clock_gettime( CLOCK_REALTIME, &ts );
+
+    fp = fopen( tmpName, "w" );
+    if ( fp == NULL )
+    {
+        return;
+    }
+
+    fprintf( fp,
+             "{\"time\":%lu.%03lu,\"live_allocs\":%lu,\"live_bytes\":%lu,"
+             "\"total_allocs\":%lu,\"heap_in_use\":%zu,\"sites\":[",
+             (unsigned long)ts.tv_sec,
+             (unsigned long)( ts.tv_nsec / 1000000 ),
+             (unsigned long)count,
+             (unsigned long)bytes,
+             (unsigned long)allocs,
+             mi.uordblks + mi.hblkhd );
+
+    for ( i = 0; i < n; i++ )
+    {
+        fprintf( fp,
+                 "%s\n{\"live_allocs\":%lu,\"live_bytes\":%lu,"
+                 "\"allocs\":%lu,\"stack\":[",
+                 ( i > 0 ) ? "," : "",
+                 (unsigned long)snapshot[i].live,
+                 (unsigned long)snapshot[i].liveBytes,
+                 (unsigned long)snapshot[i].allocs );
+
+        for ( j = 0; j < snapshot[i].depth; j++ )
+        {
+            /* look up the call instruction, not the return address */
+            addr = (char *)snapshot[i].frames[j] - 1;
+
+            if ( ( dladdr( addr, &info ) != 0 ) &&
+                 ( info.dli_fname != NULL ) )
+            {
+                fprintf( fp,
+                         "%s{\"module\":\"%s\",\"offset\":\"0x%lx\","
+                         "\"symbol\":\"%s\"}",
+                         ( j > 0 ) ? "," : "",
+                         info.dli_fname,
+                         (unsigned long)( (char *)addr -
+                                          (char *)info.dli_fbase ),
+                         ( info.dli_sname != NULL ) ? info.dli_sname : "" );
+            }
+            else
+            {
+                fprintf( fp,
+                         "%s{\"module\":\"\",\"offset\":\"%p\","
+                         "\"symbol\":\"\"}",
+                         ( j > 0 ) ? "," : "",
+                         addr );
+            }
+        }
+
+        fprintf( fp, "]}" );
+    }
+
+    fprintf( fp, "]}\n" );
+    fclose( fp );
+
+    rename( tmpName, output );
+}
+
+/*============================================================================*/
+/*  CompareSites                                                              */
+/*!
+    Order allocation sites by descending live bytes
+
+==============================================================================*/
+static int CompareSites( const void *a, const void *b )
+{
+    const Site *pA = a;
+    const Site *pB = b;
+
+    if ( pA->liveBytes != pB->liveBytes )
+    {
+        return ( pA->liveBytes < pB->liveBytes ) ? 1 : -1;
+    }
+
+    return 0;
+}
+
+/*! @}
+ * end of leakcheck group */
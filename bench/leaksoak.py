@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+#
+# MIT License
+#
+# Copyright (c) 2023 Trevor Monk
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""iothub long-run memory stability test
+
+Pushes a large number of messages through the iothub service connected
+to the local hub stand-in (hubsim) with the leakcheck allocator
+preloaded into the service.  While the load runs it samples the
+service's resident set size and the allocator's live bytes and live
+allocations per allocation site against the number of messages
+delivered, and fits the growth per message after a warm-up period.
+
+The test fails when the live heap, the resident set, or any single
+allocation site grows by more than its limit per message.  Each failing
+allocation site is reported with its call stack, resolved to functions
+and source lines with addr2line when it is available, so a leak names
+the code responsible for it.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+from runbench import free_port, stop
+from soak import hubsim_stats, read_json, read_status
+
+
+def slope(points):
+    """Least squares slope of a list of (x, y) points"""
+    n = len(points)
+    if n < 2:
+        return 0.0
+
+    mx = sum(x for x, _ in points) / n
+    my = sum(y for _, y in points) / n
+    sxx = sum((x - mx) ** 2 for x, _ in points)
+    if sxx == 0:
+        return 0.0
+
+    return sum((x - mx) * (y - my) for x, y in points) / sxx
+
+
+def site_key(site):
+    """Identify an allocation site by its module relative call stack"""
+    return tuple((f["module"], f["offset"]) for f in site["stack"])
+
+
+def resolve(frame, cache):
+    """Describe a stack frame as function and source location"""
+    key = (frame["module"], frame["offset"])
+    if key in cache:
+        return cache[key]
+
+    text = "%s+%s" % (frame["symbol"] or os.path.basename(frame["module"])
+                      or "?", frame["offset"])
+    if frame["module"] and shutil.which("addr2line"):
+        try:
+            out = subprocess.run(["addr2line", "-f", "-C", "-e",
+                                  frame["module"], frame["offset"]],
+                                 capture_output=True, text=True, timeout=10)
+            lines = out.stdout.split("\n")
+            if len(lines) >= 2 and lines[0] != "??":
+                text = "%s (%s)" % (lines[0],
+                                    os.path.basename(lines[1]))
+        except (OSError, subprocess.TimeoutExpired):
+            pass
+
+    cache[key] = text
+    return text
+
+
+def run(args, tmp):
+    """Run the load and return the samples and final measurements"""
+    port = free_port()
+    sim_stats = os.path.join(tmp, "hubsim.json")
+    snapshot = os.path.join(tmp, "leakcheck.json")
+    quiet = None if args.verbose else subprocess.DEVNULL
+    build = args.build_dir
+
+    env = dict(os.environ)
+    env["LD_PRELOAD"] = os.path.abspath(os.path.join(build,
+                                                     "libleakcheck.so"))
+    env["LEAKCHECK_OUTPUT"] = snapshot
+    env["LEAKCHECK_INTERVAL_MS"] = str(int(args.interval * 1000))
+
+    hubsim = subprocess.Popen([os.path.join(build, "hubsim"),
+                               "-p", str(port), "-o", sim_stats],
+                              stdout=subprocess.DEVNULL)
+    iothub = None
+    samples = []
+    try:
+        time.sleep(0.2)
+        iothub = subprocess.Popen([os.path.join(build, "iothub"),
+                                   "-s", "127.0.0.1:%d" % port],
+                                  env=env, stdout=subprocess.DEVNULL,
+                                  stderr=quiet)
+
+        per_worker = max(1, args.messages // args.workers)
+        sent = per_worker * args.workers
+        load = subprocess.Popen([os.path.join(build, "iotload"), "-j",
+                                 "-s", "leaksoak", "-c", str(args.workers),
+                                 "-n", str(per_worker), "-b", args.body,
+                                 "-p", args.profile],
+                                stdout=subprocess.PIPE, text=True)
+
+        delivered = 0
+        drain_deadline = None
+        while True:
+            done = load.poll() is not None
+            time.sleep(args.interval)
+            stats = hubsim_stats(hubsim, sim_stats)
+            heap = read_json(snapshot)
+            if stats is not None and heap is not None:
+                delivered = stats["unique"]
+                samples.append({"delivered": delivered,
+                                "rss_kb": read_status(iothub.pid, "VmRSS"),
+                                "heap": heap})
+                if args.verbose:
+                    print("%d delivered, live %d bytes in %d allocations, "
+                          "rss %d kB" % (delivered, heap["live_bytes"],
+                                         heap["live_allocs"],
+                                         samples[-1]["rss_kb"]),
+                          file=sys.stderr)
+
+            if done:
+                if drain_deadline is None:
+                    drain_deadline = time.monotonic() + args.drain_timeout
+                if delivered >= sent or time.monotonic() > drain_deadline:
+                    break
+
+        report = json.loads(load.stdout.read())
+
+        # let the service go idle so in-flight messages are not counted
+        time.sleep(3 * args.interval)
+        final = read_json(snapshot)
+        rss_final = read_status(iothub.pid, "VmRSS")
+    finally:
+        stop(iothub)
+        stop(hubsim)
+
+    return {"sent": report["messages"], "delivered": delivered,
+            "throughput": report["throughput"], "samples": samples,
+            "final": final, "rss_final_kb": rss_final}
+
+
+def analyze(result, args):
+    """Fit the per message growth and return the analysis and failures"""
+    samples = result["samples"]
+    warm = args.warmup * result["delivered"]
+    steady = [s for s in samples if s["delivered"] >= warm]
+    if result["final"] is not None:
+        steady.append({"delivered": result["delivered"],
+                       "rss_kb": result["rss_final_kb"],
+                       "heap": result["final"]})
+
+    live = slope([(s["delivered"], s["heap"]["live_bytes"])
+                  for s in steady])
+    rss = slope([(s["delivered"], s["rss_kb"] * 1024) for s in steady])
+
+    # live allocations of each site over the steady state samples
+    history = {}
+    stacks = {}
+    for i, s in enumerate(steady):
+        for site in s["heap"]["sites"]:
+            key = site_key(site)
+            stacks[key] = site["stack"]
+            history.setdefault(key, {})[i] = site
+
+    cache = {}
+    sites = []
+    failures = []
+    for key, seen in history.items():
+        points = [(s["delivered"], seen[i]["live_allocs"] if i in seen
+                   else 0) for i, s in enumerate(steady)]
+        growth = slope(points)
+        last = seen.get(len(steady) - 1, {"live_allocs": 0,
+                                            "live_bytes": 0})
+        if growth <= 0 and last["live_allocs"] == 0:
+            continue
+
+        stack = [resolve(f, cache) for f in stacks[key]]
+        entry = {"allocs_per_msg": growth,
+                 "live_allocs": last["live_allocs"],
+                 "live_bytes": last["live_bytes"],
+                 "stack": stack}
+        sites.append(entry)
+        if growth > args.max_site_allocs:
+            failures.append("site %s grows %.4f allocations/msg" %
+                            (" <- ".join(stack[:3]), growth))
+
+    sites.sort(key=lambda e: e["allocs_per_msg"], reverse=True)
+
+    if result["delivered"] < result["sent"]:
+        failures.append("only %d of %d messages delivered" %
+                        (result["delivered"], result["sent"]))
+    if live > args.max_bytes:
+        failures.append("live heap grows %.3f bytes/msg" % live)
+    if rss > args.max_rss_bytes:
+        failures.append("rss grows %.3f bytes/msg" % rss)
+
+    return {"live_bytes_per_msg": live, "rss_bytes_per_msg": rss,
+            "sites": sites[:args.top]}, failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--build-dir", default="build",
+                        help="directory containing the built executables")
+    parser.add_argument("--messages", type=int, default=20000000,
+                        help="total number of messages to send")
+    parser.add_argument("--workers", type=int, default=4,
+                        help="number of iotload worker processes")
+    parser.add_argument("--body", default="64:1024",
+                        help="iotload body size, or min:max")
+    parser.add_argument("--profile", default="typical",
+                        help="iotload header profile")
+    parser.add_argument("--interval", type=float, default=2.0,
+                        help="sampling interval in seconds")
+    parser.add_argument("--warmup", type=float, default=0.1,
+                        help="fraction of the messages treated as warm-up")
+    parser.add_argument("--drain-timeout", type=float, default=60.0,
+                        help="seconds to wait for delivery after the load")
+    parser.add_argument("--max-bytes", type=float, default=0.1,
+                        help="live heap growth limit in bytes/msg")
+    parser.add_argument("--max-rss-bytes", type=float, default=1.0,
+                        help="resident set growth limit in bytes/msg")
+    parser.add_argument("--max-site-allocs", type=float, default=0.001,
+                        help="per site growth limit in allocations/msg")
+    parser.add_argument("--top", type=int, default=20,
+                        help="number of allocation sites to report")
+    parser.add_argument("--output", default="leak_results.json",
+                        help="file to write the results to")
+    parser.add_argument("--verbose", action="store_true",
+                        help="show progress and the iothub diagnostics")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        result = run(args, tmp)
+
+    analysis, failures = analyze(result, args)
+
+    print("sent %d delivered %d (%.0f msgs/s): live heap %+.4f bytes/msg, "
+          "rss %+.4f bytes/msg" %
+          (result["sent"], result["delivered"], result["throughput"],
+           analysis["live_bytes_per_msg"], analysis["rss_bytes_per_msg"]))
+    for site in analysis["sites"]:
+        if site["allocs_per_msg"] > args.max_site_allocs:
+            print("  %+.4f allocs/msg, %d live (%d bytes):" %
+                  (site["allocs_per_msg"], site["live_allocs"],
+                   site["live_bytes"]))
+            for frame in site["stack"]:
+                print("      %s" % frame)
+
+    with open(args.output, "w") as f:
+        json.dump({"sent": result["sent"],
+                   "delivered": result["delivered"],
+                   "throughput": result["throughput"],
+                   "analysis": analysis,
+                   "failures": failures,
+                   "samples": [{"delivered": s["delivered"],
+                                "rss_kb": s["rss_kb"],
+                                "live_bytes": s["heap"]["live_bytes"],
+                                "live_allocs": s["heap"]["live_allocs"]}
+                               for s in result["samples"]]},
+                  f, indent=2)
+
+    if failures:
+        print("FAIL: %s" % "; ".join(failures))
+        return 1
+
+    print("ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,548 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+/*!
+ * @defgroup linkbench linkbench
+ * @brief CPU cost benchmark of the uplink connection
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file linkbench.c
+
+    Uplink connection CPU cost benchmark
+
+    The linkbench application links the hub stand-in link (without the
+    iothub service main loop) and sends a fixed number of messages to
+    the local hub stand-in (hubsim) as fast as the send window allows.
+    It reports the throughput and the CPU time the sending process
+    spent per megabyte of message body, split into user and system
+    time, so the cost of user space TLS can be compared with kernel
+    TLS offload and with different socket options.
+
+    The message bodies are random so they cost the same to encrypt as
+    compressed telemetry.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <varserver/varserver.h>
+#include <azureiot/iothub_client.h>
+#include "tlscache.h"
+#include "socktune.h"
+#include "simlink.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! default hub stand-in address */
+#define DEFAULT_ADDRESS "127.0.0.1"
+
+/*! default number of messages to send */
+#define DEFAULT_COUNT ( 20000 )
+
+/*! default message body size in bytes */
+#define DEFAULT_SIZE ( 4096 )
+
+/*! default number of unacknowledged messages */
+#define DEFAULT_WINDOW ( 256 )
+
+/*! benchmark state */
+typedef struct linkBench
+{
+    /*! address of the hub stand-in */
+    const char *address;
+
+    /*! trusted CA certificate file, or NULL for a plain TCP link */
+    const char *caFile;
+
+    /*! socket options of the link */
+    SockTune sockTune;
+
+    /*! number of messages to send */
+    size_t count;
+
+    /*! message body size in bytes */
+    size_t size;
+
+    /*! maximum number of unacknowledged messages */
+    size_t window;
+
+    /*! output the report as a JSON line */
+    bool json;
+
+    /*! mutex protecting the message counts */
+    pthread_mutex_t mutex;
+
+    /*! signalled when a message is confirmed */
+    pthread_cond_t cond;
+
+    /*! number of unacknowledged messages */
+    size_t inFlight;
+
+    /*! number of messages confirmed by the stand-in */
+    size_t confirmed;
+
+    /*! number of messages which failed */
+    size_t failed;
+
+} LinkBench;
+
+/*==============================================================================
+        Private file scoped variables
+==============================================================================*/
+
+/*! benchmark state object */
+static LinkBench state;
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+int main( int argc, char **argv );
+static int ProcessOptions( int argC, char *argV[], LinkBench *pState );
+static void usage( char *cmdname );
+static int RunBenchmark( LinkBench *pState, SimLink *pSimLink );
+static void SendCallback( IOTHUB_CLIENT_CONFIRMATION_RESULT result,
+                          void *userContextCallback );
+static uint64_t GetCpuUs( const struct timeval *tv );
+static uint64_t GetTimeUs( void );
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  main                                                                      */
+/*!
+    Main entry point for the linkbench application
+
+    @param[in]
+        argc
+            number of arguments on the command line
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @retval 0 the benchmark completed
+    @retval 1 the benchmark could not be run
+
+==============================================================================*/
+int main( int argc, char **argv )
+{
+    int result = 1;
+    TlsCache *pTlsCache = NULL;
+    SimLink *pSimLink = NULL;
+
+    state.address = DEFAULT_ADDRESS;
+    state.count = DEFAULT_COUNT;
+    state.size = DEFAULT_SIZE;
+    state.window = DEFAULT_WINDOW;
+    SockTune_Init( &state.sockTune );
+    pthread_mutex_init( &state.mutex, NULL );
+    pthread_cond_init( &state.cond, NULL );
+
+    ProcessOptions( argc, argv, &state );
+
+    /* a lost connection is reported by the write instead of a signal,
+       as in the iothub service */
+    signal( SIGPIPE, SIG_IGN );
+
+    if ( state.caFile != NULL )
+    {
+        pTlsCache = TlsCache_Create( state.caFile, NULL );
+        if ( ( pTlsCache != NULL ) &&
+             ( state.sockTune.ktls ) &&
+             ( TlsCache_SetKtls( pTlsCache, true ) == false ) )
+        {
+            fprintf( stderr, "linkbench: kernel TLS is not supported\n" );
+        }
+    }
+
+    if ( ( state.caFile == NULL ) ||
+         ( pTlsCache != NULL ) )
+    {
+        pSimLink = SimLink_Create( state.address,
+                                   pTlsCache,
+                                   &state.sockTune,
+                                   true );
+    }
+
+    if ( ( pSimLink != NULL ) &&
+         ( state.count > 0 ) &&
+         ( state.window > 0 ) )
+    {
+        if ( RunBenchmark( &state, pSimLink ) == EOK )
+        {
+            result = 0;
+        }
+
+        SimLink_Destroy( pSimLink );
+    }
+    else
+    {
+        fprintf( stderr, "linkbench: initialization failed\n" );
+    }
+
+    TlsCache_Destroy( pTlsCache );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  RunBenchmark                                                              */
+/*!
+    Send the messages and report the cost of sending them
+
+    @param[in]
+        pState
+            pointer to the benchmark state
+
+    @param[in]
+        pSimLink
+            pointer to the connected link
+
+    @retval EOK the benchmark completed
+    @retval ENOMEM the message could not be created
+    @retval EIO messages were not confirmed by the stand-in
+
+==============================================================================*/
+static int RunBenchmark( LinkBench *pState, SimLink *pSimLink )
+{
+    int result = EIO;
+    unsigned char *body;
+    unsigned int seed = 1;
+    IOTHUB_MESSAGE_HANDLE msg = NULL;
+    SimLinkTimings timings;
+    struct rusage start;
+    struct rusage end;
+    uint64_t t0;
+    uint64_t elapsedUs;
+    uint64_t userUs;
+    uint64_t sysUs;
+    double mb;
+    size_t sent;
+    size_t i;
+
+    body = malloc( pState->size );
+    if ( body != NULL )
+    {
+        for ( i = 0; i < pState->size; i++ )
+        {
+            body[i] = (unsigned char)rand_r( &seed );
+        }
+
+        msg = IoTHubMessage_CreateFromByteArray( body, pState->size );
+        free( body );
+    }
+
+    if ( msg == NULL )
+    {
+        return ENOMEM;
+    }
+
+    getrusage( RUSAGE_SELF, &start );
+    t0 = GetTimeUs();
+
+    for ( sent = 0; sent < pState->count; sent++ )
+    {
+        pthread_mutex_lock( &pState->mutex );
+        while ( pState->inFlight >= pState->window )
+        {
+            pthread_cond_wait( &pState->cond, &pState->mutex );
+        }
+        pState->inFlight++;
+        pthread_mutex_unlock( &pState->mutex );
+
+        if ( SimLink_SendEventAsync( pSimLink,
+                                     msg,
+                                     SendCallback,
+                                     pState ) != IOTHUB_CLIENT_OK )
+        {
+            SendCallback( IOTHUB_CLIENT_CONFIRMATION_ERROR, pState );
+        }
+    }
+
+    pthread_mutex_lock( &pState->mutex );
+    while ( pState->inFlight > 0 )
+    {
+        pthread_cond_wait( &pState->cond, &pState->mutex );
+    }
+    pthread_mutex_unlock( &pState->mutex );
+
+    elapsedUs = GetTimeUs() - t0;
+    getrusage( RUSAGE_SELF, &end );
+
+    IoTHubMessage_Destroy( msg );
+
+    userUs = GetCpuUs( &end.ru_utime ) - GetCpuUs( &start.ru_utime );
+    sysUs = GetCpuUs( &end.ru_stime ) - GetCpuUs( &start.ru_stime );
+    mb = (double)pState->confirmed * pState->size / ( 1024.0 * 1024.0 );
+    SimLink_GetTimings( pSimLink, &timings );
+
+    if ( ( elapsedUs > 0 ) &&
+         ( mb > 0.0 ) )
+    {
+        if ( pState->json )
+        {
+            fprintf( stdout,
+                     "{\"name\":\"link\",\"tls\":%s,"
+                     "\"ktls_tx\":%s,\"ktls_rx\":%s,"
+                     "\"messages\":%zu,\"failed\":%zu,\"size\":%zu,"
+                     "\"mb_per_s\":%.2f,\"cpu_ms_per_mb\":%.3f,"
+                     "\"user_ms_per_mb\":%.3f,\"sys_ms_per_mb\":%.3f}\n",
+                     ( pState->caFile != NULL ) ? "true" : "false",
+                     timings.ktlsTx ? "true" : "false",
+                     timings.ktlsRx ? "true" : "false",
+                     pState->confirmed,
+                     pState->failed,
+                     pState->size,
+                     mb * 1000000.0 / elapsedUs,
+                     ( userUs + sysUs ) / 1000.0 / mb,
+                     userUs / 1000.0 / mb,
+                     sysUs / 1000.0 / mb );
+        }
+        else
+        {
+            fprintf( stdout,
+                     "%s%s%s: %zu x %zu bytes (%zu failed) "
+                     "%.2f MB/s, cpu %.3f ms/MB "
+                     "(user %.3f, sys %.3f)\n",
+                     ( pState->caFile != NULL ) ? "tls" : "tcp",
+                     timings.ktlsTx ? ", ktls tx" : "",
+                     timings.ktlsRx ? ", ktls rx" : "",
+                     pState->confirmed,
+                     pState->size,
+                     pState->failed,
+                     mb * 1000000.0 / elapsedUs,
+                     ( userUs + sysUs ) / 1000.0 / mb,
+                     userUs / 1000.0 / mb,
+                     sysUs / 1000.0 / mb );
+        }
+
+        result = ( pState->failed == 0 ) ? EOK : EIO;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SendCallback                                                              */
+/*!
+    Count a confirmed message and open the send window
+
+    @param[in]
+        result
+            confirmation result of the message
+
+    @param[in]
+        userContextCallback
+            pointer to the benchmark state
+
+==============================================================================*/
+static void SendCallback( IOTHUB_CLIENT_CONFIRMATION_RESULT result,
+                          void *userContextCallback )
+{
+    LinkBench *pState = (LinkBench *)userContextCallback;
+
+    pthread_mutex_lock( &pState->mutex );
+    if ( result == IOTHUB_CLIENT_CONFIRMATION_OK )
+    {
+        pState->confirmed++;
+    }
+    else
+    {
+        pState->failed++;
+    }
+
+    pState->inFlight--;
+    pthread_cond_signal( &pState->cond );
+    pthread_mutex_unlock( &pState->mutex );
+}
+
+/*============================================================================*/
+/*  GetCpuUs                                                                  */
+/*!
+    Convert a CPU time to microseconds
+
+    @param[in]
+        tv
+            pointer to the CPU time
+
+==============================================================================*/
+static uint64_t GetCpuUs( const struct timeval *tv )
+{
+    return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/*============================================================================*/
+/*  GetTimeUs                                                                 */
+/*!
+    Get the monotonic time in microseconds
+
+==============================================================================*/
+static uint64_t GetTimeUs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*============================================================================*/
+/*  usage                                                                     */
+/*!
+    Display the application usage
+
+    @param[in]
+       cmdname
+            pointer to the invoked command name
+
+==============================================================================*/
+static void usage( char *cmdname )
+{
+    if( cmdname != NULL )
+    {
+        fprintf(stderr,
+                "usage: %s [-h] [-j] [-s address] [-t cafile] [-n count] "
+                "[-b bytes]\n"
+                "          [-w window] [-N socket option]\n"
+                " [-h] : display this help\n"
+                " [-j] : JSON line output\n"
+                " [-s address] : hub stand-in host:port "
+                "(default 127.0.0.1)\n"
+                " [-t cafile] : trusted CA certificates (PEM).  "
+                "Enables TLS\n"
+                " [-n count] : number of messages (default 20000)\n"
+                " [-b bytes] : message body size (default 4096)\n"
+                " [-w window] : unacknowledged messages (default 256)\n"
+                " [-N socket option] : tune the socket as iothub -N.  "
+                "May be repeated\n",
+                cmdname );
+    }
+}
+
+/*============================================================================*/
+/*  ProcessOptions                                                            */
+/*!
+    Process the command line options
+
+    @param[in]
+        argC
+            number of arguments
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @param[in]
+        pState
+            pointer to the benchmark state object
+
+==============================================================================*/
+static int ProcessOptions( int argC, char *argV[], LinkBench *pState )
+{
+    int c;
+    const char *options = "hjs:t:n:b:w:N:";
+
+    if( ( pState != NULL ) &&
+        ( argV != NULL ) )
+    {
+        while( ( c = getopt( argC, argV, options ) ) != -1 )
+        {
+            switch( c )
+            {
+                case 'h':
+                    usage( argV[0] );
+                    exit( 0 );
+                    break;
+
+                case 'j':
+                    pState->json = true;
+                    break;
+
+                case 's':
+                    pState->address = optarg;
+                    break;
+
+                case 't':
+                    pState->caFile = optarg;
+                    break;
+
+                case 'n':
+                    pState->count = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'b':
+                    pState->size = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'w':
+                    pState->window = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'N':
+                    if ( SockTune_Parse( &pState->sockTune, optarg ) != EOK )
+                    {
+                        fprintf( stderr,
+                                 "linkbench: invalid socket option %s\n",
+                                 optarg );
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*! @}
+ * end of linkbench group */
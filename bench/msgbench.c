@@ -0,0 +1,779 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup msgbench msgbench
+ * @brief Microbenchmarks for the iothub message hot paths
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file msgbench.c
+
+    Message parsing and serialization microbenchmarks
+
+    The msgbench application links the iotmsg module (without the iothub
+    service main loop) and measures the header parsing, property
+    assignment, serialization, and message identifier generation
+    functions against a fixed corpus of realistic message headers
+    and bodies.
+
+    Each benchmark is calibrated to run for at least the requested
+    minimum time and reports ns/op, allocations/op and bytes/op.
+
+    SerializeMsg writes diagnostic output to stdout, so stdout is
+    redirected to /dev/null while the benchmarks run and the report
+    is written to the original stdout.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <varserver/varserver.h>
+#include <azureiot/iothub_client.h>
+#include "iotmsg.h"
+#include "allocstats.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! default minimum run time for each benchmark in milliseconds */
+#define DEFAULT_MIN_TIME_MS ( 500 )
+
+/*! maximum header size used by the benchmarks */
+#define MAX_HEADER_SIZE ( 4096 )
+
+/*! size of the serialization buffer used by AddProperty */
+#define PROPERTY_BUFFER_SIZE ( 8192 )
+
+/*! benchmark operation function */
+typedef void (*BenchFn)( void *arg );
+
+/*! header corpus entry */
+typedef struct headerCorpus
+{
+    /*! corpus name */
+    const char *name;
+
+    /*! header block as sent by a client */
+    const char *headers;
+
+} HeaderCorpus;
+
+/*! body corpus entry */
+typedef struct bodyCorpus
+{
+    /*! corpus name */
+    const char *name;
+
+    /*! body length */
+    size_t len;
+
+    /*! pointer to the generated body */
+    char *body;
+
+} BodyCorpus;
+
+/*! benchmark argument for the message property benchmarks */
+typedef struct propArg
+{
+    /*! header corpus to parse */
+    const HeaderCorpus *pHeader;
+
+    /*! body corpus to build messages from */
+    const BodyCorpus *pBody;
+
+    /*! working copy of the header which is modified by parsing */
+    char work[MAX_HEADER_SIZE];
+
+    /*! parsed property list (reused across iterations like the service) */
+    MsgProp *pMsgProperties;
+
+    /*! prebuilt message used by the serialization benchmark */
+    IOTHUB_MESSAGE_HANDLE msg;
+
+    /*! maximum serialized message length */
+    size_t maxlen;
+
+    /*! property key used by the AddProperty benchmark */
+    const char *key;
+
+    /*! property value used by the AddProperty benchmark */
+    const char *value;
+
+    /*! output buffer used by the AddProperty benchmark */
+    char buf[PROPERTY_BUFFER_SIZE];
+
+} PropArg;
+
+/*! benchmark state */
+typedef struct benchState
+{
+    /*! minimum run time for each benchmark in nanoseconds */
+    uint64_t minTimeNs;
+
+    /*! optional benchmark name filter */
+    const char *filter;
+
+    /*! output the report as JSON lines */
+    bool json;
+
+    /*! report output stream */
+    FILE *out;
+
+} BenchState;
+
+/*==============================================================================
+        Private file scoped variables
+==============================================================================*/
+
+/*! benchmark state object */
+static BenchState state;
+
+/*! header corpus modelled on the headers sent by the iotsend and iotexec
+    clients, from a bare source tag up to a heavily tagged message */
+static const HeaderCorpus headerCorpus[] =
+{
+    {
+        "small",
+        "source:iotsend\n"
+        "\n"
+    },
+    {
+        "typical",
+        "messageId:5f1c2d9e-8a43-4f55-b0a7-2d4c6f1e9b30\n"
+        "correlationId:c0a8e1f2-77d4-4b1e-9e2a-61f3b5d8a4c7\n"
+        "source:iotexec\n"
+        "content-type:application/json\n"
+        "stream:telemetry\n"
+        "units:celsius\n"
+        "\n"
+    },
+    {
+        "large",
+        "messageId:5f1c2d9e-8a43-4f55-b0a7-2d4c6f1e9b30\n"
+        "correlationId:c0a8e1f2-77d4-4b1e-9e2a-61f3b5d8a4c7\n"
+        "source:/usr/bin/gatewaymon\n"
+        "content-type:application/json\n"
+        "content-encoding:utf-8\n"
+        "stream:diagnostics\n"
+        "site:plant-07/line-3/cell-12\n"
+        "asset:compressor-0042\n"
+        "firmware:4.18.2-rc1+build.7731\n"
+        "schema:urn:example:telemetry:compressor:v3\n"
+        "priority:2\n"
+        "sequence:1048576\n"
+        "timestamp:2023-06-14T08:31:27.431Z\n"
+        "units:kPa\n"
+        "sampleRate:100\n"
+        "sampleCount:600\n"
+        "window:60s\n"
+        "alarmState:nominal\n"
+        "operator:shift-b\n"
+        "region:eu-west\n"
+        "tenant:contoso-industrial\n"
+        "tags:vibration,pressure,temperature\n"
+        "\n"
+    },
+};
+
+/*! body corpus sizes, from a single reading to a batched upload */
+static BodyCorpus bodyCorpus[] =
+{
+    { "48B", 48, NULL },
+    { "1KB", 1024, NULL },
+    { "16KB", 16 * 1024, NULL },
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+int main( int argc, char **argv );
+static int ProcessOptions( int argC, char *argV[], BenchState *pState );
+static void usage( char *cmdname );
+static int GenerateBodies( void );
+static uint64_t GetTimeNs( void );
+static void RunBenchmark( BenchState *pState,
+                          const char *name,
+                          BenchFn fn,
+                          void *arg );
+static void BenchBuildMessageProperties( void *arg );
+static void BenchSetMessageProperties( void *arg );
+static void BenchCreateMessage( void *arg );
+static void BenchSerializeMsg( void *arg );
+static void BenchAddProperty( void *arg );
+static void BenchGenerateMessageId( void *arg );
+static void RunPropertyBenchmarks( BenchState *pState, PropArg *pArg );
+static void RunSerializeBenchmarks( BenchState *pState, PropArg *pArg );
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  main                                                                      */
+/*!
+    Main entry point for the msgbench application
+
+    @param[in]
+        argc
+            number of arguments on the command line
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @retval 0 the benchmarks completed
+    @retval 1 the benchmarks could not be run
+
+==============================================================================*/
+int main( int argc, char **argv )
+{
+    int result = 1;
+    int fd;
+    int devnull;
+    PropArg *pArg;
+
+    state.minTimeNs = (uint64_t)DEFAULT_MIN_TIME_MS * 1000000;
+
+    ProcessOptions( argc, argv, &state );
+
+    /* keep the real stdout for the report */
+    fd = dup( STDOUT_FILENO );
+    state.out = ( fd != -1 ) ? fdopen( fd, "w" ) : NULL;
+    devnull = open( "/dev/null", O_WRONLY );
+
+    pArg = calloc( 1, sizeof( PropArg ) );
+
+    if ( ( state.out != NULL ) &&
+         ( devnull != -1 ) &&
+         ( pArg != NULL ) &&
+         ( GenerateBodies() == EOK ) )
+    {
+        /* silence the diagnostic output of the functions under test */
+        fflush( stdout );
+        dup2( devnull, STDOUT_FILENO );
+
+        if ( !state.json )
+        {
+            fprintf( state.out,
+                     "%-44s %12s %12s %12s\n",
+                     "benchmark",
+                     "ns/op",
+                     "allocs/op",
+                     "bytes/op" );
+        }
+
+        RunPropertyBenchmarks( &state, pArg );
+        RunSerializeBenchmarks( &state, pArg );
+
+        fflush( stdout );
+        fclose( state.out );
+        result = 0;
+    }
+    else
+    {
+        fprintf( stderr, "msgbench: initialization failed\n" );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  RunPropertyBenchmarks                                                     */
+/*!
+    Run the header parsing and property assignment benchmarks
+
+    @param[in]
+        pState
+            pointer to the benchmark state
+
+    @param[in]
+        pArg
+            pointer to the benchmark argument object
+
+==============================================================================*/
+static void RunPropertyBenchmarks( BenchState *pState, PropArg *pArg )
+{
+    size_t i;
+    size_t j;
+    char name[128];
+
+    for ( i = 0; i < sizeof( headerCorpus ) / sizeof( headerCorpus[0] ); i++ )
+    {
+        pArg->pHeader = &headerCorpus[i];
+
+        snprintf( name,
+                  sizeof( name ),
+                  "BuildMessageProperties/%s",
+                  headerCorpus[i].name );
+        RunBenchmark( pState, name, BenchBuildMessageProperties, pArg );
+    }
+
+    for ( j = 0; j < sizeof( bodyCorpus ) / sizeof( bodyCorpus[0] ); j++ )
+    {
+        pArg->pBody = &bodyCorpus[j];
+
+        snprintf( name,
+                  sizeof( name ),
+                  "IoTHubMessage_Create+Destroy/%s",
+                  bodyCorpus[j].name );
+        RunBenchmark( pState, name, BenchCreateMessage, pArg );
+
+        for ( i = 0; i < sizeof(headerCorpus) / sizeof(headerCorpus[0]); i++ )
+        {
+            pArg->pHeader = &headerCorpus[i];
+
+            /* parse the header once, the benchmark measures assignment */
+            strcpy( pArg->work, pArg->pHeader->headers );
+            BuildMessageProperties( &pArg->pMsgProperties, pArg->work );
+
+            snprintf( name,
+                      sizeof( name ),
+                      "SetMessageProperties/%s/%s",
+                      headerCorpus[i].name,
+                      bodyCorpus[j].name );
+            RunBenchmark( pState, name, BenchSetMessageProperties, pArg );
+        }
+    }
+
+    RunBenchmark( pState, "GenerateMessageId", BenchGenerateMessageId, pArg );
+}
+
+/*============================================================================*/
+/*  RunSerializeBenchmarks                                                    */
+/*!
+    Run the message serialization benchmarks
+
+    @param[in]
+        pState
+            pointer to the benchmark state
+
+    @param[in]
+        pArg
+            pointer to the benchmark argument object
+
+==============================================================================*/
+static void RunSerializeBenchmarks( BenchState *pState, PropArg *pArg )
+{
+    size_t i;
+    size_t j;
+    char name[128];
+
+    pArg->key = "content-type";
+    pArg->value = "application/json";
+    RunBenchmark( pState, "AddProperty/short", BenchAddProperty, pArg );
+
+    pArg->key = "schema";
+    pArg->value = "urn:example:telemetry:compressor:v3:extended-diagnostics";
+    RunBenchmark( pState, "AddProperty/long", BenchAddProperty, pArg );
+
+    for ( j = 0; j < sizeof( bodyCorpus ) / sizeof( bodyCorpus[0] ); j++ )
+    {
+        for ( i = 0; i < sizeof(headerCorpus) / sizeof(headerCorpus[0]); i++ )
+        {
+            /* build a received message from the corpus */
+            pArg->msg = IoTHubMessage_CreateFromByteArray(
+                            (const unsigned char *)bodyCorpus[j].body,
+                            bodyCorpus[j].len );
+            if ( pArg->msg == NULL )
+            {
+                continue;
+            }
+
+            strcpy( pArg->work, headerCorpus[i].headers );
+            BuildMessageProperties( &pArg->pMsgProperties, pArg->work );
+            SetMessageProperties( pArg->msg, pArg->pMsgProperties );
+
+            /* size the output like a default service message queue,
+               growing it for bodies which would not fit */
+            pArg->maxlen = ( bodyCorpus[j].len < 4096 )
+                           ? 8192
+                           : bodyCorpus[j].len + 8192;
+
+            snprintf( name,
+                      sizeof( name ),
+                      "SerializeMsg/%s/%s",
+                      headerCorpus[i].name,
+                      bodyCorpus[j].name );
+            RunBenchmark( pState, name, BenchSerializeMsg, pArg );
+
+            IoTHubMessage_Destroy( pArg->msg );
+            pArg->msg = NULL;
+        }
+    }
+}
+
+/*============================================================================*/
+/*  RunBenchmark                                                              */
+/*!
+    Calibrate and run a single benchmark
+
+    The RunBenchmark function doubles the iteration count until a run
+    takes at least a tenth of the minimum run time, then scales the
+    iteration count to cover the minimum run time and performs the
+    measured run.  The allocation counters are sampled around the
+    measured run only.
+
+    @param[in]
+        pState
+            pointer to the benchmark state
+
+    @param[in]
+        name
+            name of the benchmark
+
+    @param[in]
+        fn
+            benchmark operation to run
+
+    @param[in]
+        arg
+            argument passed to the benchmark operation
+
+==============================================================================*/
+static void RunBenchmark( BenchState *pState,
+                          const char *name,
+                          BenchFn fn,
+                          void *arg )
+{
+    uint64_t iterations = 1;
+    uint64_t i;
+    uint64_t start;
+    uint64_t elapsed = 0;
+    AllocStats before;
+    AllocStats after;
+
+    if ( ( pState == NULL ) ||
+         ( name == NULL ) ||
+         ( fn == NULL ) )
+    {
+        return;
+    }
+
+    if ( ( pState->filter != NULL ) &&
+         ( strstr( name, pState->filter ) == NULL ) )
+    {
+        return;
+    }
+
+    /* calibrate the iteration count */
+    while ( elapsed < pState->minTimeNs / 10 )
+    {
+        iterations *= 2;
+        start = GetTimeNs();
+        for ( i = 0; i < iterations; i++ )
+        {
+            fn( arg );
+        }
+        elapsed = GetTimeNs() - start;
+    }
+
+    iterations = ( iterations * pState->minTimeNs ) / elapsed + 1;
+
+    /* measured run */
+    AllocStats_Get( &before );
+    start = GetTimeNs();
+    for ( i = 0; i < iterations; i++ )
+    {
+        fn( arg );
+    }
+    elapsed = GetTimeNs() - start;
+    AllocStats_Get( &after );
+
+    fprintf( pState->out,
+             pState->json
+                ? "{\"benchmark\":\"%s\",\"ns_per_op\":%.1f,"
+                  "\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f}\n"
+                : "%-44s %12.1f %12.2f %12.1f\n",
+             name,
+             (double)elapsed / iterations,
+             (double)( after.allocs - before.allocs ) / iterations,
+             (double)( after.bytes - before.bytes ) / iterations );
+    fflush( pState->out );
+}
+
+/*============================================================================*/
+/*  BenchBuildMessageProperties                                               */
+/*!
+    Parse a corpus header into the reused property list
+
+    The header is copied into a working buffer first since parsing
+    modifies it in place.
+
+==============================================================================*/
+static void BenchBuildMessageProperties( void *arg )
+{
+    PropArg *pArg = (PropArg *)arg;
+
+    strcpy( pArg->work, pArg->pHeader->headers );
+    BuildMessageProperties( &pArg->pMsgProperties, pArg->work );
+}
+
+/*============================================================================*/
+/*  BenchCreateMessage                                                        */
+/*!
+    Create and destroy a message from a corpus body
+
+    This is the baseline cost included in the SetMessageProperties
+    benchmarks.
+
+==============================================================================*/
+static void BenchCreateMessage( void *arg )
+{
+    PropArg *pArg = (PropArg *)arg;
+    IOTHUB_MESSAGE_HANDLE msg;
+
+    msg = IoTHubMessage_CreateFromByteArray(
+                (const unsigned char *)pArg->pBody->body,
+                pArg->pBody->len );
+    IoTHubMessage_Destroy( msg );
+}
+
+/*============================================================================*/
+/*  BenchSetMessageProperties                                                 */
+/*!
+    Create a message, assign the parsed properties, and destroy it
+
+==============================================================================*/
+static void BenchSetMessageProperties( void *arg )
+{
+    PropArg *pArg = (PropArg *)arg;
+    IOTHUB_MESSAGE_HANDLE msg;
+
+    msg = IoTHubMessage_CreateFromByteArray(
+                (const unsigned char *)pArg->pBody->body,
+                pArg->pBody->len );
+    SetMessageProperties( msg, pArg->pMsgProperties );
+    IoTHubMessage_Destroy( msg );
+}
+
+/*============================================================================*/
+/*  BenchSerializeMsg                                                         */
+/*!
+    Serialize the prebuilt message and release the output buffer
+
+==============================================================================*/
+static void BenchSerializeMsg( void *arg )
+{
+    PropArg *pArg = (PropArg *)arg;
+    size_t totalLength;
+    char *pMsg;
+
+    pMsg = SerializeMsg( pArg->msg, pArg->maxlen, &totalLength );
+    free( pMsg );
+}
+
+/*============================================================================*/
+/*  BenchAddProperty                                                          */
+/*!
+    Add a single property to an empty serialization buffer
+
+==============================================================================*/
+static void BenchAddProperty( void *arg )
+{
+    PropArg *pArg = (PropArg *)arg;
+    char *p = pArg->buf;
+    size_t left = sizeof( pArg->buf );
+
+    AddProperty( &p, pArg->key, pArg->value, &left );
+}
+
+/*============================================================================*/
+/*  BenchGenerateMessageId                                                    */
+/*!
+    Generate a message identifier
+
+==============================================================================*/
+static void BenchGenerateMessageId( void *arg )
+{
+    char messageId[MESSAGE_ID_SIZE];
+
+    (void)arg;
+    GenerateMessageId( messageId, sizeof( messageId ) );
+}
+
+/*============================================================================*/
+/*  GenerateBodies                                                            */
+/*!
+    Generate the body corpus
+
+    The GenerateBodies function fills each body in the corpus with a
+    JSON array of sensor readings, truncated to the corpus length.
+
+    @retval EOK the bodies were generated
+    @retval ENOMEM memory allocation failed
+
+==============================================================================*/
+static int GenerateBodies( void )
+{
+    int result = EOK;
+    size_t i;
+    size_t n;
+    size_t len;
+    char *p;
+
+    for ( i = 0; i < sizeof( bodyCorpus ) / sizeof( bodyCorpus[0] ); i++ )
+    {
+        len = bodyCorpus[i].len;
+        p = malloc( len + 64 );
+        if ( p == NULL )
+        {
+            result = ENOMEM;
+            break;
+        }
+
+        n = snprintf( p, len + 64, "[" );
+        while ( n < len )
+        {
+            n += snprintf( &p[n],
+                           len + 64 - n,
+                           "{\"t\":%zu,\"v\":%zu.%02zu},",
+                           1686731487 + n,
+                           n % 97,
+                           n % 100 );
+        }
+
+        p[len - 1] = ']';
+        bodyCorpus[i].body = p;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  GetTimeNs                                                                 */
+/*!
+    Get the monotonic time in nanoseconds
+
+==============================================================================*/
+static uint64_t GetTimeNs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*============================================================================*/
+/*  usage                                                                     */
+/*!
+    Display the application usage
+
+    @param[in]
+       cmdname
+            pointer to the invoked command name
+
+==============================================================================*/
+static void usage( char *cmdname )
+{
+    if( cmdname != NULL )
+    {
+        fprintf(stderr,
+                "usage: %s [-h] [-j] [-t ms] [-f filter]\n"
+                " [-h] : display this help\n"
+                " [-j] : JSON lines output\n"
+                " [-t ms] : minimum run time per benchmark\n"
+                " [-f filter] : only run benchmarks containing filter\n",
+                cmdname );
+    }
+}
+
+/*============================================================================*/
+/*  ProcessOptions                                                            */
+/*!
+    Process the command line options
+
+    @param[in]
+        argC
+            number of arguments
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @param[in]
+        pState
+            pointer to the benchmark state object
+
+==============================================================================*/
+static int ProcessOptions( int argC, char *argV[], BenchState *pState )
+{
+    int c;
+    const char *options = "hjt:f:";
+
+    if( ( pState != NULL ) &&
+        ( argV != NULL ) )
+    {
+        while( ( c = getopt( argC, argV, options ) ) != -1 )
+        {
+            switch( c )
+            {
+                case 'h':
+                    usage( argV[0] );
+                    exit( 0 );
+                    break;
+
+                case 'j':
+                    pState->json = true;
+                    break;
+
+                case 't':
+                    pState->minTimeNs = strtoull( optarg, NULL, 0 ) * 1000000;
+                    break;
+
+                case 'f':
+                    pState->filter = optarg;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*! @}
+ * end of msgbench group */
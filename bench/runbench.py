@@ -0,0 +1,294 @@
+#!/usr/bin/env python3
+#
+# MIT License
+#
+# Copyright (c) 2023 Trevor Monk
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""iothub performance regression gate
+
+Runs the msgbench microbenchmarks and the iotload scenarios against the
+iothub service connected to the local hub stand-in (hubsim), writes the
+results as JSON, and compares them with the stored baseline.
+
+Each benchmark is run several times.  A metric regresses when its median
+moves in the bad direction by more than both the relative tolerance for
+that metric and three scaled median absolute deviations of the noisier
+of the baseline and current samples.  Any regression makes the runner
+exit with status 1.
+"""
+
+import argparse
+import json
+import os
+import platform
+import socket
+import statistics
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# metric name -> True if larger values are better
+DIRECTIONS = {
+    "throughput": True,
+    "p99_us": False,
+    "ns_per_op": False,
+}
+
+# number of scaled median absolute deviations treated as noise
+NOISE_SIGMAS = 3.0
+
+# scale factor from median absolute deviation to standard deviation
+MAD_SCALE = 1.4826
+
+
+def summarize(samples):
+    """Return the samples with their median and median absolute deviation"""
+    median = statistics.median(samples)
+    mad = statistics.median([abs(s - median) for s in samples])
+    return {"samples": samples, "median": median, "mad": mad}
+
+
+def free_port():
+    """Return a free TCP port on the loopback interface"""
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def stop(proc, timeout=5):
+    """Terminate a process and wait for it to exit"""
+    if proc is not None and proc.poll() is None:
+        proc.terminate()
+        try:
+            proc.wait(timeout)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+
+
+def run_microbench(build, config, runs):
+    """Run msgbench and return the ns/op summary for each benchmark"""
+    min_time = str(config.get("min_time_ms", 200))
+    samples = {}
+    for _ in range(runs):
+        out = subprocess.run([os.path.join(build, "msgbench"), "-j",
+                              "-t", min_time],
+                             check=True, capture_output=True, text=True)
+        for line in out.stdout.splitlines():
+            result = json.loads(line)
+            samples.setdefault(result["benchmark"], []).append(
+                result["ns_per_op"])
+
+    return {name: {"ns_per_op": summarize(s)} for name, s in samples.items()}
+
+
+def run_scenario(build, scenario, verbose):
+    """Run one iotload scenario against iothub and hubsim
+
+    Returns the parsed iotload JSON report.
+    """
+    port = free_port()
+    hubsim = subprocess.Popen([os.path.join(build, "hubsim"),
+                               "-p", str(port)] + scenario.get("hubsim", []),
+                              stdout=subprocess.DEVNULL)
+    iothub = None
+    try:
+        time.sleep(0.2)
+        iothub = subprocess.Popen([os.path.join(build, "iothub"),
+                                   "-s", "127.0.0.1:%d" % port]
+                                  + scenario.get("iothub", []),
+                                  stdout=subprocess.DEVNULL,
+                                  stderr=None if verbose
+                                  else subprocess.DEVNULL)
+        out = subprocess.run([os.path.join(build, "iotload"), "-j",
+                              "-s", scenario["name"]]
+                             + scenario.get("iotload", []),
+                             check=True, capture_output=True, text=True,
+                             timeout=scenario.get("timeout", 600))
+        return json.loads(out.stdout)
+    finally:
+        stop(iothub)
+        stop(hubsim)
+
+
+def run_scenarios(build, scenarios, runs, only, verbose):
+    """Run each load scenario several times and summarize the results"""
+    results = {}
+    for scenario in scenarios:
+        name = scenario["name"]
+        if only and only not in name:
+            continue
+
+        throughput = []
+        p99 = []
+        for i in range(runs):
+            report = run_scenario(build, scenario, verbose)
+            throughput.append(report["throughput"])
+            p99.append(report["latency_us"]["p99"])
+            print("%s run %d: %.1f msgs/s p99 %d us" %
+                  (name, i + 1, throughput[-1], p99[-1]), file=sys.stderr)
+
+        results[name] = {"throughput": summarize(throughput),
+                         "p99_us": summarize(p99)}
+
+    return results
+
+
+def compare_metric(base, cur, larger_is_better, tolerance):
+    """Compare one metric summary against its baseline
+
+    Returns the relative change and whether it is a regression.
+    """
+    if base["median"] == 0:
+        return 0.0, False
+
+    change = (cur["median"] - base["median"]) / base["median"]
+    worse = -change if larger_is_better else change
+    noise = NOISE_SIGMAS * MAD_SCALE * max(base["mad"], cur["mad"])
+    threshold = max(tolerance * base["median"], noise)
+
+    return change, worse * base["median"] > threshold
+
+
+def compare(baseline, results, tolerances):
+    """Compare the results with the baseline and return the regressions"""
+    regressions = []
+    for group in ("microbench", "scenarios"):
+        for name, metrics in results.get(group, {}).items():
+            base_metrics = baseline.get(group, {}).get(name)
+            if base_metrics is None:
+                print("  %-48s (no baseline)" % name)
+                continue
+
+            for metric, cur in metrics.items():
+                if metric not in base_metrics:
+                    continue
+
+                change, regressed = compare_metric(base_metrics[metric], cur,
+                                                   DIRECTIONS[metric],
+                                                   tolerances[metric])
+                print("  %-48s %-10s %12.1f -> %12.1f %+7.1f%% %s" %
+                      (name, metric, base_metrics[metric]["median"],
+                       cur["median"], change * 100,
+                       "REGRESSION" if regressed else "ok"))
+                if regressed:
+                    regressions.append((name, metric, change))
+
+    return regressions
+
+
+def git_revision():
+    """Return the current git revision, if available"""
+    try:
+        out = subprocess.run(["git", "rev-parse", "--short", "HEAD"],
+                             cwd=HERE, capture_output=True, text=True)
+        return out.stdout.strip()
+    except OSError:
+        return ""
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--build-dir", default="build",
+                        help="directory containing the built executables")
+    parser.add_argument("--scenarios",
+                        default=os.path.join(HERE, "scenarios.json"),
+                        help="scenario definition file")
+    parser.add_argument("--baseline",
+                        default=os.path.join(HERE, "baseline.json"),
+                        help="baseline results file")
+    parser.add_argument("--output", default="bench_results.json",
+                        help="file to write the results to")
+    parser.add_argument("--runs", type=int,
+                        help="override the number of runs per benchmark")
+    parser.add_argument("--only", help="only run matching scenarios")
+    parser.add_argument("--no-microbench", action="store_true",
+                        help="skip the msgbench microbenchmarks")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="store the results as the new baseline")
+    parser.add_argument("--verbose", action="store_true",
+                        help="show the iothub service diagnostics")
+    args = parser.parse_args()
+
+    with open(args.scenarios) as f:
+        config = json.load(f)
+
+    runs = args.runs or config.get("runs", 5)
+    tolerances = dict(config.get("tolerance", {}))
+    tolerances.setdefault("throughput", 0.05)
+    tolerances.setdefault("p99_us", 0.15)
+    tolerances.setdefault("ns_per_op", 0.10)
+
+    results = {
+        "meta": {
+            "host": platform.node(),
+            "machine": platform.machine(),
+            "revision": git_revision(),
+            "time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+            "runs": runs,
+        },
+        "microbench": {},
+        "scenarios": {},
+    }
+
+    if not args.no_microbench:
+        results["microbench"] = run_microbench(args.build_dir,
+                                               config.get("microbench", {}),
+                                               runs)
+
+    results["scenarios"] = run_scenarios(args.build_dir,
+                                         config.get("scenarios", []),
+                                         runs, args.only, args.verbose)
+
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2)
+
+    if args.update_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=2)
+        print("baseline written to %s" % args.baseline)
+        return 0
+
+    if not os.path.exists(args.baseline):
+        print("no baseline at %s: record one on the reference machine "
+              "with --update-baseline" % args.baseline, file=sys.stderr)
+        return 2
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+
+    print("comparing with baseline %s (%s)" %
+          (baseline["meta"].get("revision", "?"),
+           baseline["meta"].get("host", "?")))
+    regressions = compare(baseline, results, tolerances)
+
+    if regressions:
+        print("%d regression(s) detected" % len(regressions))
+        return 1
+
+    print("no regressions")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
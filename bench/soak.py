@@ -0,0 +1,279 @@
+#!/usr/bin/env python3
+#
+# MIT License
+#
+# Copyright (c) 2023 Trevor Monk
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+
+"""iothub soak benchmark over an impaired link
+
+Runs the iothub service against the local hub stand-in (hubsim) through
+the network impairment proxy (iotproxy) while iotload offers a steady
+load, for each scenario in bench/soak.json.  For each scenario it
+reports:
+
+  backlog_max      largest number of messages queued in the iothub
+                   service but not yet delivered to the stand-in
+  recovery_ms      for each outage, the time from the end of the outage
+                   until the backlog is back to its pre-outage level
+  drain_ms         time from the end of the load until every accepted
+                   message has been delivered
+  rss_peak_kb      peak resident set size of the iothub service
+  loss             messages accepted by the iothub service but never
+                   delivered to the stand-in
+  duplicates       messages delivered more than once
+
+A scenario fails when it exceeds one of its configured limits, and the
+runner then exits with status 1.
+"""
+
+import argparse
+import json
+import os
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+from runbench import HERE, free_port, stop
+
+# RSS sampling interval in seconds
+SAMPLE_INTERVAL = 0.1
+
+
+def read_json(path):
+    """Read a JSON statistics file, returning None if it is incomplete"""
+    try:
+        with open(path) as f:
+            return json.load(f)
+    except (OSError, ValueError):
+        return None
+
+
+def read_status(pid, field):
+    """Read a kB field from /proc/<pid>/status"""
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith(field + ":"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+
+def hubsim_stats(hubsim, path):
+    """Ask hubsim for its current statistics"""
+    hubsim.send_signal(signal.SIGUSR1)
+    time.sleep(0.2)
+    return read_json(path)
+
+
+def recovery_times(timeline, proxy_start, outages):
+    """Measure the recovery time after each outage
+
+    The backlog timeline slots are aligned with the proxy outage times
+    using the wall clock start times of hubsim and the proxy.  An outage
+    has recovered when the backlog first returns to the largest backlog
+    seen in the second before the outage began.
+    """
+    interval = timeline["interval_ms"]
+    backlog = timeline["backlog"]
+    offset = (proxy_start - timeline["start"]) / 1000.0
+    per_second = max(1, 1000 // interval)
+    results = []
+
+    for begin, end in outages:
+        first = int((begin + offset) // interval)
+        before = backlog[max(0, first - per_second):first] or [0]
+        level = max(before)
+        last = int((end + offset) // interval)
+        recovered = None
+        for k in range(last, len(backlog)):
+            if backlog[k] <= level:
+                recovered = max(0.0, (k + 1) * interval - (end + offset))
+                break
+        results.append(recovered)
+
+    return results
+
+
+def run_scenario(build, scenario, tmp, verbose):
+    """Run one soak scenario and return its measurements"""
+    name = scenario["name"]
+    sim_port = free_port()
+    proxy_port = free_port()
+    sim_stats = os.path.join(tmp, name + "-hubsim.json")
+    proxy_stats = os.path.join(tmp, name + "-proxy.json")
+    quiet = None if verbose else subprocess.DEVNULL
+
+    hubsim = subprocess.Popen([os.path.join(build, "hubsim"),
+                               "-p", str(sim_port), "-o", sim_stats]
+                              + scenario.get("hubsim", []),
+                              stdout=subprocess.DEVNULL)
+    proxy = None
+    iothub = None
+    try:
+        time.sleep(0.2)
+        proxy = subprocess.Popen([os.path.join(build, "iotproxy"),
+                                  "-u", "127.0.0.1:%d" % sim_port,
+                                  "-p", str(proxy_port), "-o", proxy_stats]
+                                 + scenario.get("proxy", []),
+                                 stdout=subprocess.DEVNULL)
+        time.sleep(0.2)
+        iothub = subprocess.Popen([os.path.join(build, "iothub"),
+                                   "-s", "127.0.0.1:%d" % proxy_port]
+                                  + scenario.get("iothub", []),
+                                  stdout=subprocess.DEVNULL, stderr=quiet)
+
+        load = subprocess.Popen([os.path.join(build, "iotload"), "-j",
+                                 "-s", name, "-n", "0"]
+                                + scenario.get("iotload", []),
+                                stdout=subprocess.PIPE, text=True)
+        rss_max = 0
+        while load.poll() is None:
+            rss_max = max(rss_max, read_status(iothub.pid, "VmRSS"))
+            time.sleep(SAMPLE_INTERVAL)
+        report = json.loads(load.stdout.read())
+        sent = report["messages"]
+
+        # wait for the backlog to drain
+        load_end = time.monotonic()
+        drain_ms = None
+        deadline = load_end + scenario.get("drain_timeout", 120)
+        while time.monotonic() < deadline:
+            rss_max = max(rss_max, read_status(iothub.pid, "VmRSS"))
+            stats = hubsim_stats(hubsim, sim_stats)
+            if stats is not None and stats["unique"] >= sent:
+                drain_ms = (time.monotonic() - load_end) * 1000.0
+                break
+
+        rss_peak = max(rss_max, read_status(iothub.pid, "VmHWM"))
+    finally:
+        stop(iothub)
+        stop(proxy)
+        stop(hubsim)
+
+    stats = read_json(sim_stats)
+    proxy = read_json(proxy_stats)
+    timeline = stats.pop("timeline")
+    recovery = recovery_times(timeline, proxy["start"], proxy["outages_ms"])
+
+    return {
+        "sent": sent,
+        "delivered": stats["unique"],
+        "loss": max(0, sent - stats["unique"]),
+        "duplicates": stats["duplicates"],
+        "throughput": report["throughput"],
+        "p99_us": report["latency_us"]["p99"],
+        "backlog_max": max(timeline["backlog"] or [0]),
+        "delay_max_ms": max(timeline["delay_ms"] or [0]),
+        "recovery_ms": recovery,
+        "drain_ms": drain_ms,
+        "rss_peak_kb": rss_peak,
+        "connections": proxy["connections"],
+        "resets": proxy["resets"],
+        "refused": proxy["refused"],
+    }
+
+
+def check_limits(result, limits):
+    """Return the list of limits the scenario result exceeds"""
+    failures = []
+
+    if result["loss"] > limits.get("max_loss", 0):
+        failures.append("loss %d" % result["loss"])
+
+    if "max_recovery_ms" in limits:
+        for r in result["recovery_ms"]:
+            if r is None or r > limits["max_recovery_ms"]:
+                failures.append("recovery %s ms" % r)
+
+    if result["drain_ms"] is None:
+        failures.append("backlog did not drain")
+
+    if "max_rss_kb" in limits and \
+            result["rss_peak_kb"] > limits["max_rss_kb"]:
+        failures.append("rss %d kB" % result["rss_peak_kb"])
+
+    if "max_backlog" in limits and \
+            result["backlog_max"] > limits["max_backlog"]:
+        failures.append("backlog %d" % result["backlog_max"])
+
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--build-dir", default="build",
+                        help="directory containing the built executables")
+    parser.add_argument("--scenarios",
+                        default=os.path.join(HERE, "soak.json"),
+                        help="soak scenario definition file")
+    parser.add_argument("--output", default="soak_results.json",
+                        help="file to write the results to")
+    parser.add_argument("--only", help="only run matching scenarios")
+    parser.add_argument("--verbose", action="store_true",
+                        help="show the iothub service diagnostics")
+    args = parser.parse_args()
+
+    with open(args.scenarios) as f:
+        config = json.load(f)
+
+    results = {}
+    failed = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        for scenario in config.get("scenarios", []):
+            name = scenario["name"]
+            if args.only and args.only not in name:
+                continue
+
+            result = run_scenario(args.build_dir, scenario, tmp,
+                                  args.verbose)
+            failures = check_limits(result, scenario.get("limits", {}))
+            result["failures"] = failures
+            results[name] = result
+
+            print("%s: sent %d delivered %d loss %d dup %d "
+                  "backlog max %d recovery %s ms drain %s ms "
+                  "rss peak %d kB %s" %
+                  (name, result["sent"], result["delivered"],
+                   result["loss"], result["duplicates"],
+                   result["backlog_max"],
+                   ",".join("-" if r is None else "%.0f" % r
+                            for r in result["recovery_ms"]) or "-",
+                   "-" if result["drain_ms"] is None
+                   else "%.0f" % result["drain_ms"],
+                   result["rss_peak_kb"],
+                   "FAIL (%s)" % "; ".join(failures) if failures
+                   else "ok"))
+            if failures:
+                failed += 1
+
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2)
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
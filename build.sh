@@ -8,7 +8,7 @@ cd azure-iot-sdk-c
 git submodule init
 git submodule update
 sudo apt-get update
-sudo apt-get install -y cmake build-essential curl libcurl4-openssl-dev libssl-dev uuid-dev ca-certificates
+sudo apt-get install -y cmake build-essential curl libcurl4-openssl-dev libssl-dev uuid-dev zlib1g-dev ca-certificates
 mkdir -p cmake && cd cmake
 cmake ..
 cmake --build .
@@ -0,0 +1,83 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! default initial reconnect delay in milliseconds */
+#define BACKOFF_DEFAULT_MIN_MS ( 100 )
+
+/*! default maximum reconnect delay in milliseconds */
+#define BACKOFF_DEFAULT_MAX_MS ( 60000 )
+
+/*! default jitter as a percentage of the delay */
+#define BACKOFF_DEFAULT_JITTER ( 50 )
+
+/*! exponential backoff with jitter */
+typedef struct backoff
+{
+    /*! initial delay in milliseconds */
+    uint32_t minMs;
+
+    /*! maximum delay in milliseconds */
+    uint32_t maxMs;
+
+    /*! percentage of each delay which is randomized */
+    uint32_t jitter;
+
+    /*! delay before jitter for the next attempt, or 0 if the next
+        attempt is the first */
+    uint32_t delayMs;
+
+    /*! random number generator state */
+    unsigned int seed;
+
+} Backoff;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+void Backoff_Init( Backoff *pBackoff,
+                   uint32_t minMs,
+                   uint32_t maxMs,
+                   uint32_t jitter );
+
+int Backoff_Parse( Backoff *pBackoff, const char *spec );
+
+uint32_t Backoff_Next( Backoff *pBackoff );
+
+void Backoff_Reset( Backoff *pBackoff );
+
+#endif
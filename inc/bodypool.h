@@ -0,0 +1,97 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef BODYPOOL_H
+#define BODYPOOL_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! default maximum size of a message body in bytes */
+#define BODYPOOL_DEFAULT_MAX ( 256 * 1024 )
+
+/*! default limit on the free buffers kept by each size class in bytes */
+#define BODYPOOL_DEFAULT_CACHE ( 256 * 1024 )
+
+/*! maximum number of size classes */
+#define BODYPOOL_MAX_CLASSES ( 5 )
+
+/*! opaque handle to a body buffer pool */
+typedef struct bodyPool BodyPool;
+
+/*! body buffer pool statistics */
+typedef struct bodyPoolStats
+{
+    /*! maximum size of a message body in bytes */
+    size_t maxSize;
+
+    /*! number of buffers in use */
+    size_t inUse;
+
+    /*! capacity of the buffers in use in bytes */
+    size_t inUseBytes;
+
+    /*! capacity of the free buffers kept for reuse in bytes */
+    size_t cachedBytes;
+
+    /*! total number of buffers handed out */
+    uint64_t allocs;
+
+    /*! number of buffers handed out from the free lists */
+    uint64_t reused;
+
+} BodyPoolStats;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+BodyPool *BodyPool_Create( size_t maxSize, size_t cacheLimit );
+
+void BodyPool_Destroy( BodyPool *pPool );
+
+char *BodyPool_Alloc( BodyPool *pPool, size_t size, size_t *pCapacity );
+
+char *BodyPool_Grow( BodyPool *pPool,
+                     char *buf,
+                     size_t used,
+                     size_t *pCapacity );
+
+void BodyPool_Free( BodyPool *pPool, char *buf );
+
+void BodyPool_SetCacheLimit( BodyPool *pPool, size_t cacheLimit );
+
+size_t BodyPool_MaxSize( BodyPool *pPool );
+
+void BodyPool_GetStats( BodyPool *pPool, BodyPoolStats *pStats );
+
+#endif
@@ -0,0 +1,145 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef CONNSTATE_H
+#define CONNSTATE_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <azureiot/iothub_client.h>
+#include "backoff.h"
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! connection states */
+typedef enum connStateId
+{
+    /*! the client is establishing its first connection */
+    CONNSTATE_CONNECTING,
+
+    /*! the client is connected and authenticated */
+    CONNSTATE_CONNECTED,
+
+    /*! the connection was lost and the client is retrying */
+    CONNSTATE_RECONNECTING,
+
+    /*! the client has given up, and will be recreated by the service
+        after a backoff delay */
+    CONNSTATE_FAILED,
+
+    /*! the service closed the idle connection, and will connect again
+        when it is next needed */
+    CONNSTATE_SLEEPING
+
+} ConnStateId;
+
+/*! connection metrics */
+typedef struct connMetrics
+{
+    /*! current connection state */
+    ConnStateId state;
+
+    /*! number of times the connection was established */
+    uint64_t connects;
+
+    /*! number of times an established connection was lost */
+    uint64_t disconnects;
+
+    /*! number of times the client gave up and was recreated */
+    uint64_t failures;
+
+    /*! total time not connected, including the current outage,
+        in milliseconds.  Time asleep is not included. */
+    uint64_t disconnectedMs;
+
+    /*! total time connected, including the current connection,
+        in milliseconds */
+    uint64_t connectedMs;
+
+    /*! number of times the service closed the idle connection */
+    uint64_t sleeps;
+
+    /*! total time asleep, including the current sleep, in
+        milliseconds */
+    uint64_t sleepMs;
+
+    /*! time taken to establish the first connection in milliseconds */
+    uint64_t connectMs;
+
+    /*! time from the most recent connection loss until the connection
+        was restored, in milliseconds */
+    uint64_t lastReconnectMs;
+
+    /*! longest time taken to restore a lost connection in milliseconds */
+    uint64_t maxReconnectMs;
+
+    /*! total time taken to restore lost connections in milliseconds */
+    uint64_t totalReconnectMs;
+
+    /*! time since the connection state machine was created
+        in milliseconds */
+    uint64_t uptimeMs;
+
+} ConnMetrics;
+
+/*! opaque handle to a connection state machine */
+typedef struct connState ConnState;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+ConnState *ConnState_Create( const Backoff *pPolicy, bool verbose );
+
+void ConnState_Destroy( ConnState *pConnState );
+
+void ConnState_StatusCallback( IOTHUB_CLIENT_CONNECTION_STATUS status,
+                               IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason,
+                               void *userContextCallback );
+
+void ConnState_Failed( ConnState *pConnState );
+
+void ConnState_Connecting( ConnState *pConnState );
+
+void ConnState_Sleep( ConnState *pConnState );
+
+void ConnState_Resume( ConnState *pConnState );
+
+ConnStateId ConnState_Get( ConnState *pConnState, uint32_t *pRetryMs );
+
+void ConnState_Wake( ConnState *pConnState );
+
+void ConnState_Wait( ConnState *pConnState, uint32_t timeoutMs );
+
+void ConnState_GetMetrics( ConnState *pConnState, ConnMetrics *pMetrics );
+
+const char *ConnState_Name( ConnStateId state );
+
+#endif
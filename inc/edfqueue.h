@@ -0,0 +1,98 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef EDFQUEUE_H
+#define EDFQUEUE_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "trace.h"
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! opaque handle to an earliest-deadline-first message queue */
+typedef struct edfQueue EdfQueue;
+
+/*! earliest-deadline-first queue statistics */
+typedef struct edfQueueStats
+{
+    /*! number of messages in the queue */
+    size_t count;
+
+    /*! size of the messages in the queue in bytes */
+    size_t bytes;
+
+    /*! largest number of messages held in the queue */
+    size_t peak;
+
+    /*! total number of messages queued */
+    uint64_t queued;
+
+    /*! total number of messages moved behind the other messages */
+    uint64_t deferred;
+
+} EdfQueueStats;
+
+/*! function selecting the messages removed by EdfQueue_RemoveIf */
+typedef bool (*EdfQueueMatch)( const TraceRecord *pRecord, void *arg );
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+EdfQueue *EdfQueue_Create( size_t maxCount );
+
+void EdfQueue_Destroy( EdfQueue *pEdfQueue );
+
+int EdfQueue_Put( EdfQueue *pEdfQueue,
+                  TraceRecord *pRecord,
+                  uint64_t deadline );
+
+int EdfQueue_Peek( EdfQueue *pEdfQueue,
+                   TraceRecord *pRecord,
+                   uint64_t *pDeadline );
+
+void EdfQueue_Pop( EdfQueue *pEdfQueue );
+
+void EdfQueue_Defer( EdfQueue *pEdfQueue );
+
+size_t EdfQueue_RemoveIf( EdfQueue *pEdfQueue,
+                          EdfQueueMatch match,
+                          void *arg );
+
+bool EdfQueue_Empty( EdfQueue *pEdfQueue );
+
+bool EdfQueue_Full( EdfQueue *pEdfQueue );
+
+void EdfQueue_GetStats( EdfQueue *pEdfQueue, EdfQueueStats *pStats );
+
+#endif
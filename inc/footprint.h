@@ -0,0 +1,104 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef FOOTPRINT_H
+#define FOOTPRINT_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+#ifdef IOTHUB_MINIMAL
+
+/* The minimal-footprint build for constrained gateways compiles out the
+   verbose diagnostics and places fixed limits on the memory used by
+   each subsystem.  Larger values given on the command line are reduced
+   to these limits. */
+
+/*! verbose diagnostics are compiled out */
+#define IOTHUB_VERBOSE( flag ) ( false )
+
+/*! limit on the number of messages buffered in memory */
+#define FOOTPRINT_BUFFER_COUNT ( 64 )
+
+/*! limit on the size of the messages buffered in memory in bytes */
+#define FOOTPRINT_BUFFER_BYTES ( 256 * 1024 )
+
+/*! limit on the number of messages waiting in deadline order */
+#define FOOTPRINT_EDF_COUNT ( 64 )
+
+/*! limit on the size of a message body in bytes */
+#define FOOTPRINT_BODY_MAX ( 64 * 1024 )
+
+/*! limit on the free body buffers kept by each size class in bytes */
+#define FOOTPRINT_BODY_CACHE ( 16 * 1024 )
+
+/*! limit on the number of ingest queues */
+#define FOOTPRINT_QUEUES ( 2 )
+
+/*! limit on the number of parallel hub connections */
+#define FOOTPRINT_CONNECTIONS ( 2 )
+
+/*! stack size of the service threads in bytes */
+#define FOOTPRINT_THREAD_STACK ( 128 * 1024 )
+
+#else
+
+/*! verbose diagnostics are enabled with the -v option */
+#define IOTHUB_VERBOSE( flag ) ( flag )
+
+/*! limit on the number of messages buffered in memory */
+#define FOOTPRINT_BUFFER_COUNT ( SIZE_MAX )
+
+/*! limit on the size of the messages buffered in memory in bytes */
+#define FOOTPRINT_BUFFER_BYTES ( SIZE_MAX )
+
+/*! limit on the number of messages waiting in deadline order */
+#define FOOTPRINT_EDF_COUNT ( SIZE_MAX )
+
+/*! limit on the size of a message body in bytes */
+#define FOOTPRINT_BODY_MAX ( SIZE_MAX )
+
+/*! limit on the free body buffers kept by each size class in bytes */
+#define FOOTPRINT_BODY_CACHE ( SIZE_MAX )
+
+/*! limit on the number of ingest queues */
+#define FOOTPRINT_QUEUES ( SIZE_MAX )
+
+/*! limit on the number of parallel hub connections */
+#define FOOTPRINT_CONNECTIONS ( SIZE_MAX )
+
+/*! stack size of the service threads in bytes, or 0 for the default */
+#define FOOTPRINT_THREAD_STACK ( 0 )
+
+#endif
+
+#endif
@@ -0,0 +1,89 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include "trace.h"
+#include "outbox.h"
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! identifies a handoff state message */
+#define HANDOFF_MAGIC ( 0x48544F49 )
+
+/*! version of the handoff protocol */
+#define HANDOFF_VERSION ( 1 )
+
+/*! time allowed for each step of a handoff, in milliseconds */
+#define HANDOFF_TIMEOUT_MS ( 5000 )
+
+/*! state handed from the running service to its replacement */
+typedef struct handoffState
+{
+    /*! HANDOFF_MAGIC */
+    uint32_t magic;
+
+    /*! HANDOFF_VERSION */
+    uint32_t version;
+
+    /*! read position in the disk outbox */
+    OutboxCursor outbox;
+
+    /*! number of buffered messages which follow the state */
+    uint32_t bufferCount;
+
+    /*! total size of the buffered messages which follow the state */
+    uint64_t bufferBytes;
+
+} HandoffState;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+int Handoff_Listen( const char *path );
+
+int Handoff_Accept( int listenFd );
+
+int Handoff_Request( const char *path, int *pFd );
+
+int Handoff_SendState( int fd, int mqfd, const HandoffState *pState );
+
+int Handoff_RecvState( int fd, int *pMqfd, HandoffState *pState );
+
+int Handoff_SendRecord( int fd, const TraceRecord *pRecord );
+
+int Handoff_RecvRecord( int fd, TraceRecord *pRecord );
+
+int Handoff_WaitClosed( int fd, uint32_t timeoutMs );
+
+#endif
@@ -0,0 +1,109 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef HUBSIM_H
+#define HUBSIM_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! hub stand-in frame and acknowledgement marker ("HSIM") */
+#define HUBSIM_MAGIC ( 0x4d495348 )
+
+/*! default TCP port of the hub stand-in */
+#define HUBSIM_DEFAULT_PORT ( 18800 )
+
+/*! device-to-cloud message frame */
+#define HUBSIM_FRAME_MESSAGE ( 1 )
+
+/*! blob upload block frame.  The properties hold the blob name as
+    "blob:name\n", the body holds the block and the sequence number is
+    the position of the block in the blob, starting at 0 */
+#define HUBSIM_FRAME_BLOCK ( 2 )
+
+/*! blob upload commit frame.  The properties hold the blob name, there
+    is no body, and the sequence number is the number of blocks */
+#define HUBSIM_FRAME_COMMIT ( 3 )
+
+/*! message was accepted by the hub stand-in */
+#define HUBSIM_STATUS_OK ( 0 )
+
+/*! message was rejected by the hub stand-in */
+#define HUBSIM_STATUS_ERROR ( 1 )
+
+/*! Frame sent from the iothub service to the hub stand-in.
+    The frame is followed by headerLength bytes of "key:value\n"
+    message properties and bodyLength bytes of message body.
+    All fields are in host byte order since the stand-in only
+    runs on the local host.  Frames which were not acknowledged
+    before a connection was lost are retransmitted with the same
+    sequence number on the next connection.  Blob uploads are sent
+    on a connection of their own, one block at a time, and are not
+    retransmitted. */
+typedef struct hubSimFrame
+{
+    /*! frame marker: HUBSIM_MAGIC */
+    uint32_t magic;
+
+    /*! frame type: HUBSIM_FRAME_MESSAGE, HUBSIM_FRAME_BLOCK or
+        HUBSIM_FRAME_COMMIT */
+    uint32_t type;
+
+    /*! frame sequence number */
+    uint64_t seq;
+
+    /*! length of the message properties */
+    uint32_t headerLength;
+
+    /*! length of the message body */
+    uint32_t bodyLength;
+
+    /*! wall clock time the message was queued by the iothub service,
+        in microseconds since the epoch */
+    uint64_t queued;
+
+} HubSimFrame;
+
+/*! Acknowledgement sent from the hub stand-in for each frame */
+typedef struct hubSimAck
+{
+    /*! acknowledgement marker: HUBSIM_MAGIC */
+    uint32_t magic;
+
+    /*! delivery status: HUBSIM_STATUS_OK or HUBSIM_STATUS_ERROR */
+    uint32_t status;
+
+    /*! sequence number of the acknowledged frame */
+    uint64_t seq;
+
+} HubSimAck;
+
+#endif
@@ -0,0 +1,104 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef INGEST_H
+#define INGEST_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <mqueue.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! maximum number of ingest queues */
+#define INGEST_MAX_QUEUES ( 8 )
+
+/*! default weight of an ingest queue */
+#define INGEST_DEFAULT_WEIGHT ( 1 )
+
+/*! maximum weight of an ingest queue */
+#define INGEST_MAX_WEIGHT ( 1000 )
+
+/*! opaque handle to a set of ingest queues */
+typedef struct ingest Ingest;
+
+/*! ingest queue statistics */
+typedef struct ingestStats
+{
+    /*! name of the message queue */
+    const char *name;
+
+    /*! share of the messages received while other queues are busy */
+    uint32_t weight;
+
+    /*! maximum number of messages in the queue */
+    long depth;
+
+    /*! maximum size of a message in the queue */
+    long msgsize;
+
+    /*! number of messages waiting in the queue */
+    long pending;
+
+    /*! total number of messages received from the queue */
+    uint64_t received;
+
+} IngestStats;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+Ingest *Ingest_Create( long depth, long msgsize );
+
+void Ingest_Destroy( Ingest *pIngest, bool unlink );
+
+int Ingest_Add( Ingest *pIngest,
+                const char *name,
+                uint32_t weight,
+                mqd_t mq );
+
+int Ingest_Receive( Ingest *pIngest,
+                    char *buf,
+                    size_t len,
+                    size_t *pLength,
+                    unsigned int *pPriority,
+                    uint32_t timeoutMs );
+
+size_t Ingest_MaxMsgSize( Ingest *pIngest );
+
+mqd_t Ingest_Queue( Ingest *pIngest, const char *name );
+
+size_t Ingest_Count( Ingest *pIngest );
+
+int Ingest_GetStats( Ingest *pIngest, size_t idx, IngestStats *pStats );
+
+#endif
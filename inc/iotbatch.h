@@ -0,0 +1,76 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef IOTBATCH_H
+#define IOTBATCH_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! preamble of a batch header frame */
+#define IOTBATCH_PREAMBLE "IOTB"
+
+/*! maximum number of messages in one batch */
+#define IOTBATCH_MAX_COUNT ( 256 )
+
+/*! batch header frame sent on the iothub message queue.
+
+    A batch frame announces a number of messages which the client writes
+    to its /tmp/iothub_<pid> FIFO in a single transfer.  Each message is
+    written as an IotBatchEntry followed by its header block and its
+    body.  The header block is the NUL terminated block which follows
+    the pid in an IOTC frame. */
+typedef struct iotBatchFrame
+{
+    /*! IOTBATCH_PREAMBLE */
+    char preamble[4];
+
+    /*! process id of the client */
+    uint32_t pid;
+
+    /*! number of messages in the batch */
+    uint32_t count;
+
+} IotBatchFrame;
+
+/*! descriptor preceding each message of a batch in the client FIFO */
+typedef struct iotBatchEntry
+{
+    /*! length of the header block including its NUL terminator */
+    uint32_t headerLength;
+
+    /*! length of the message body */
+    uint32_t bodyLength;
+
+} IotBatchEntry;
+
+#endif
@@ -0,0 +1,78 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef IOTMSG_H
+#define IOTMSG_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <azureiot/iothub_client.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! size of the buffer required to hold a generated message identifier */
+#define MESSAGE_ID_SIZE ( 64 )
+
+/*! Array of message properties for the current message */
+typedef struct msgProp
+{
+    /* pointer to the property name */
+    const char *pKey;
+
+    /* pointer to the property value */
+    const char *pValue;
+
+    /* pointer to the next property in the list */
+    struct msgProp *pNext;
+} MsgProp;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+int BuildMessageProperties( MsgProp **ppProp, char *header );
+
+int SetMessageProperties( IOTHUB_MESSAGE_HANDLE messageHandle,
+                          MsgProp *pMsgProp );
+
+void FreeMessageProperties( MsgProp **ppProp );
+
+char *SerializeMsg( IOTHUB_MESSAGE_HANDLE msg,
+                    size_t maxlen,
+                    size_t *totalLength );
+
+size_t AddProperty( char **p,
+                    const char *key,
+                    const char *value,
+                    size_t *left );
+
+int GenerateMessageId( char *buf, size_t len );
+
+#endif
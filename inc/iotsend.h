@@ -0,0 +1,130 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef IOTSEND_H
+#define IOTSEND_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! default iothub message queue name */
+#define IOTSEND_DEFAULT_QUEUE "/iothub"
+
+/*! default maximum number of messages in a batch */
+#define IOTSEND_DEFAULT_BATCH_COUNT ( 32 )
+
+/*! default maximum size of a batch in bytes */
+#define IOTSEND_DEFAULT_BATCH_BYTES ( 256 * 1024 )
+
+/*! default time a partial batch waits for more messages in microseconds */
+#define IOTSEND_DEFAULT_LINGER_US ( 1000 )
+
+/*! default maximum number of messages waiting to be sent */
+#define IOTSEND_DEFAULT_QUEUE_LIMIT ( 1024 )
+
+/*! time IotSend_Close waits for the queued messages in milliseconds */
+#define IOTSEND_CLOSE_MS ( 5000 )
+
+/*! opaque handle to an asynchronous sender */
+typedef struct iotSend IotSend;
+
+/*! function called once a message has been read by the iothub service,
+    or could not be sent.  It is called on the sender's thread, in the
+    order the messages were submitted, and must not block. */
+typedef void (*IotSendCallback)( void *arg, int result );
+
+/*! sender configuration.  Zero fields take their default values. */
+typedef struct iotSendConfig
+{
+    /*! iothub message queue name */
+    const char *queueName;
+
+    /*! maximum number of messages in a batch */
+    uint32_t batchCount;
+
+    /*! maximum size of a batch in bytes.  A larger message is sent in
+        a batch of its own */
+    size_t batchBytes;
+
+    /*! time a partial batch waits for more messages in microseconds */
+    uint32_t lingerUs;
+
+    /*! maximum number of messages waiting to be sent */
+    uint32_t queueLimit;
+
+} IotSendConfig;
+
+/*! sender statistics */
+typedef struct iotSendStats
+{
+    /*! number of messages submitted */
+    uint64_t submitted;
+
+    /*! number of messages read by the iothub service */
+    uint64_t completed;
+
+    /*! number of messages which could not be sent */
+    uint64_t failed;
+
+    /*! number of batch frames sent */
+    uint64_t batches;
+
+    /*! number of bytes written to the FIFO */
+    uint64_t bytes;
+
+    /*! number of messages waiting to be sent or read */
+    uint32_t pending;
+
+} IotSendStats;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+IotSend *IotSend_Open( const IotSendConfig *pConfig );
+
+int IotSend_Message( IotSend *pSend,
+                     unsigned int priority,
+                     const char *headers,
+                     const void *body,
+                     size_t len,
+                     IotSendCallback callback,
+                     void *arg );
+
+int IotSend_Flush( IotSend *pSend, uint32_t timeoutMs );
+
+void IotSend_Close( IotSend *pSend );
+
+void IotSend_GetStats( IotSend *pSend, IotSendStats *pStats );
+
+#endif
@@ -0,0 +1,101 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "trace.h"
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! default maximum number of buffered messages */
+#define MSGBUF_DEFAULT_COUNT ( 256 )
+
+/*! default maximum size of the buffered messages in bytes */
+#define MSGBUF_DEFAULT_BYTES ( 4 * 1024 * 1024 )
+
+/*! opaque handle to a message buffer */
+typedef struct msgBuffer MsgBuffer;
+
+/*! message buffer statistics */
+typedef struct msgBufferStats
+{
+    /*! number of messages in the buffer */
+    size_t count;
+
+    /*! size of the messages in the buffer in bytes */
+    size_t bytes;
+
+    /*! largest number of messages held in the buffer */
+    size_t peak;
+
+    /*! total number of messages buffered */
+    uint64_t buffered;
+
+    /*! total number of messages discarded after their expiry time */
+    uint64_t expired;
+
+} MsgBufferStats;
+
+/*! function selecting the messages removed by MsgBuffer_RemoveIf */
+typedef bool (*MsgBufferMatch)( const TraceRecord *pRecord, void *arg );
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+MsgBuffer *MsgBuffer_Create( size_t maxCount, size_t maxBytes );
+
+void MsgBuffer_Destroy( MsgBuffer *pMsgBuffer );
+
+int MsgBuffer_Put( MsgBuffer *pMsgBuffer,
+                   TraceRecord *pRecord,
+                   uint64_t expiry );
+
+int MsgBuffer_Peek( MsgBuffer *pMsgBuffer, TraceRecord *pRecord );
+
+void MsgBuffer_Pop( MsgBuffer *pMsgBuffer );
+
+size_t MsgBuffer_Expire( MsgBuffer *pMsgBuffer, uint64_t now );
+
+size_t MsgBuffer_RemoveIf( MsgBuffer *pMsgBuffer,
+                           MsgBufferMatch match,
+                           void *arg );
+
+bool MsgBuffer_Empty( MsgBuffer *pMsgBuffer );
+
+bool MsgBuffer_Full( MsgBuffer *pMsgBuffer );
+
+void MsgBuffer_GetStats( MsgBuffer *pMsgBuffer, MsgBufferStats *pStats );
+
+#endif
@@ -0,0 +1,96 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "trace.h"
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! default limit on the disk space used by the outbox, in bytes */
+#define OUTBOX_DEFAULT_LIMIT ( 64 * 1024 * 1024 )
+
+/*! opaque handle to a disk outbox */
+typedef struct outbox Outbox;
+
+/*! outbox statistics */
+typedef struct outboxStats
+{
+    /*! disk space used by the outbox in bytes */
+    uint64_t bytes;
+
+    /*! number of segment files in the outbox */
+    uint32_t segments;
+
+    /*! number of messages written to the outbox */
+    uint64_t spilled;
+
+    /*! number of messages read back from the outbox */
+    uint64_t drained;
+
+} OutboxStats;
+
+/*! read position in the outbox */
+typedef struct outboxCursor
+{
+    /*! number of the oldest segment */
+    uint32_t segment;
+
+    /*! number of messages already read from the oldest segment */
+    uint32_t records;
+
+} OutboxCursor;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+Outbox *Outbox_Create( const char *dir, uint64_t limit );
+
+void Outbox_Destroy( Outbox *pOutbox );
+
+int Outbox_Append( Outbox *pOutbox, TraceRecord *pRecord );
+
+int Outbox_Read( Outbox *pOutbox, TraceRecord *pRecord );
+
+int Outbox_Unread( Outbox *pOutbox );
+
+bool Outbox_Empty( Outbox *pOutbox );
+
+void Outbox_GetStats( Outbox *pOutbox, OutboxStats *pStats );
+
+void Outbox_GetCursor( Outbox *pOutbox, OutboxCursor *pCursor );
+
+int Outbox_Seek( Outbox *pOutbox, const OutboxCursor *pCursor );
+
+#endif
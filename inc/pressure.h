@@ -0,0 +1,92 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef PRESSURE_H
+#define PRESSURE_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! pressure stall information for memory */
+#define PRESSURE_FILE "/proc/pressure/memory"
+
+/*! default stall time in a window which signals memory pressure, in
+    milliseconds */
+#define PRESSURE_DEFAULT_STALL_MS ( 200 )
+
+/*! default pressure window in milliseconds.  Unprivileged processes
+    may only use multiples of two seconds. */
+#define PRESSURE_DEFAULT_WINDOW_MS ( 2000 )
+
+/*! number of windows without pressure before the pressure has cleared */
+#define PRESSURE_HOLD_WINDOWS ( 5 )
+
+/*! minimum time between checks for pressure in milliseconds */
+#define PRESSURE_POLL_MS ( 100 )
+
+/*! opaque handle to a memory pressure monitor */
+typedef struct pressure Pressure;
+
+/*! memory pressure statistics */
+typedef struct pressureStats
+{
+    /*! true while memory is under pressure */
+    bool active;
+
+    /*! true if the stall time is polled because a PSI trigger could
+        not be registered */
+    bool polled;
+
+    /*! number of windows in which the stall time was exceeded */
+    uint64_t events;
+
+    /*! number of times memory came under pressure */
+    uint64_t episodes;
+
+} PressureStats;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+Pressure *Pressure_Create( uint32_t stallMs, uint32_t windowMs );
+
+void Pressure_Destroy( Pressure *pPressure );
+
+bool Pressure_Poll( Pressure *pPressure, uint64_t nowMs );
+
+bool Pressure_Active( Pressure *pPressure );
+
+void Pressure_GetStats( Pressure *pPressure, PressureStats *pStats );
+
+#endif
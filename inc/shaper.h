@@ -0,0 +1,195 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef SHAPER_H
+#define SHAPER_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! maximum number of traffic classes */
+#define SHAPER_MAX_CLASSES ( 8 )
+
+/*! time the ceilings may be exceeded by in a burst in milliseconds */
+#define SHAPER_BURST_MS ( 250 )
+
+/*! time between link quality estimates in milliseconds */
+#define SHAPER_SAMPLE_MS ( 1000 )
+
+/*! smallest number of messages left awaiting confirmation */
+#define SHAPER_MIN_WINDOW ( 4 )
+
+/*! default smallest body which is compressed in bytes */
+#define SHAPER_DEFAULT_COMPRESS_MIN ( 256 )
+
+/*! queueing delay above which the link quality is fair in ms */
+#define SHAPER_FAIR_WAIT_MS ( 200 )
+
+/*! queueing delay above which the link quality is poor in ms */
+#define SHAPER_POOR_WAIT_MS ( 1000 )
+
+/*! number of better samples before the link quality improves */
+#define SHAPER_RECOVER_SAMPLES ( 3 )
+
+/*! opaque handle to a bandwidth shaper */
+typedef struct shaper Shaper;
+
+/*! estimated quality of the uplink */
+typedef enum shaperQuality
+{
+    /*! the uplink keeps up with the messages */
+    SHAPER_GOOD = 0,
+
+    /*! messages are queueing */
+    SHAPER_FAIR,
+
+    /*! the backlog is growing or messages wait long for confirmation */
+    SHAPER_POOR,
+
+    /*! number of quality levels */
+    SHAPER_QUALITIES
+
+} ShaperQuality;
+
+/*! link measurements used to estimate the available bandwidth */
+typedef struct shaperSample
+{
+    /*! total size of the confirmed messages in bytes */
+    uint64_t confirmedBytes;
+
+    /*! size of the messages held by the service in bytes */
+    uint64_t backlogBytes;
+
+    /*! number of messages awaiting confirmation */
+    uint32_t inFlight;
+
+    /*! smoothed time from sending a message to its confirmation in ms */
+    uint32_t waitMs;
+
+} ShaperSample;
+
+/*! bandwidth shaper statistics */
+typedef struct shaperStats
+{
+    /*! link ceiling in bytes per second, or 0 if there is none */
+    uint64_t ceiling;
+
+    /*! estimated available bandwidth in bytes per second */
+    uint64_t estimate;
+
+    /*! rate the backlog shrank at over the last sample in bytes per
+        second, or 0 if it grew */
+    uint64_t drainRate;
+
+    /*! lowest smoothed confirmation time in milliseconds */
+    uint32_t baseWaitMs;
+
+    /*! estimated link quality */
+    ShaperQuality quality;
+
+    /*! current compression level, 0 when not compressing */
+    int level;
+
+    /*! current limit on the messages awaiting confirmation, or 0 for
+        no limit */
+    uint32_t window;
+
+    /*! number of times the link ceiling held messages back */
+    uint64_t delays;
+
+    /*! number of compressed messages */
+    uint64_t compressed;
+
+    /*! size of the compressed message bodies before compression */
+    uint64_t rawBytes;
+
+    /*! size of the compressed message bodies after compression */
+    uint64_t packedBytes;
+
+} ShaperStats;
+
+/*! traffic class statistics */
+typedef struct shaperClass
+{
+    /*! message queue priority of the class */
+    unsigned int priority;
+
+    /*! ceiling in bytes per second */
+    uint64_t ceiling;
+
+    /*! total size of the messages sent in bytes */
+    uint64_t bytes;
+
+    /*! number of times the ceiling held messages back */
+    uint64_t delays;
+
+} ShaperClass;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+Shaper *Shaper_Create( void );
+
+void Shaper_Destroy( Shaper *pShaper );
+
+int Shaper_Add( Shaper *pShaper, const char *spec );
+
+bool Shaper_Enabled( Shaper *pShaper );
+
+bool Shaper_LinkReady( Shaper *pShaper, uint64_t nowMs );
+
+bool Shaper_Ready( Shaper *pShaper, unsigned int priority, uint64_t nowMs );
+
+void Shaper_Consume( Shaper *pShaper, unsigned int priority, size_t bytes );
+
+void Shaper_Update( Shaper *pShaper,
+                    const ShaperSample *pSample,
+                    uint64_t nowMs );
+
+uint32_t Shaper_Window( Shaper *pShaper, uint32_t maxWindow );
+
+int Shaper_Compress( Shaper *pShaper,
+                     const void *body,
+                     size_t len,
+                     const void **packed,
+                     size_t *packedLen );
+
+void Shaper_GetStats( Shaper *pShaper, ShaperStats *pStats );
+
+int Shaper_GetClass( Shaper *pShaper, size_t idx, ShaperClass *pClass );
+
+const char *Shaper_QualityName( ShaperQuality quality );
+
+#endif
@@ -0,0 +1,167 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef SHED_H
+#define SHED_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! maximum number of shedding triggers and rules */
+#define SHED_MAX_POLICIES ( 16 )
+
+/*! maximum number of clients and streams accounted separately */
+#define SHED_MAX_SOURCES ( 64 )
+
+/*! maximum length of a client, stream or key header name */
+#define SHED_MAX_NAME ( 64 )
+
+/*! time between changes of the shedding level in milliseconds */
+#define SHED_STEP_MS ( 1000 )
+
+/*! opaque handle to a load shedding policy */
+typedef struct shed Shed;
+
+/*! reason a message was shed */
+typedef enum shedReason
+{
+    /*! the message was kept */
+    SHED_KEEP = 0,
+
+    /*! the message priority was below the shedding level */
+    SHED_PRIORITY,
+
+    /*! the message was not sampled from its stream */
+    SHED_SAMPLE,
+
+    /*! the message was replaced by a later message with the same key */
+    SHED_LATEST,
+
+    /*! number of reasons */
+    SHED_REASONS
+
+} ShedReason;
+
+/*! load measurements compared with the shedding triggers */
+typedef struct shedLoad
+{
+    /*! size of the messages held by the service in bytes */
+    uint64_t backlogBytes;
+
+    /*! number of messages awaiting confirmation */
+    uint32_t inFlight;
+
+    /*! smoothed time from sending a message to its confirmation in ms */
+    uint32_t waitMs;
+
+} ShedLoad;
+
+/*! load shedding statistics */
+typedef struct shedStats
+{
+    /*! current shedding level, 0 when not shedding */
+    uint32_t level;
+
+    /*! total number of messages shed */
+    uint64_t total;
+
+    /*! number of messages shed for each reason */
+    uint64_t reasons[SHED_REASONS];
+
+    /*! number of messages shed from clients not accounted separately */
+    uint64_t otherClients;
+
+    /*! number of messages shed from streams not accounted separately */
+    uint64_t otherStreams;
+
+} ShedStats;
+
+/*! messages shed from one client or stream */
+typedef struct shedSource
+{
+    /*! process id of the client, or 0 for a stream */
+    uint32_t pid;
+
+    /*! name of the client process or of the stream */
+    char name[SHED_MAX_NAME];
+
+    /*! number of messages shed */
+    uint64_t count;
+
+    /*! size of the messages shed in bytes */
+    uint64_t bytes;
+
+} ShedSource;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+Shed *Shed_Create( void );
+
+void Shed_Destroy( Shed *pShed );
+
+int Shed_Add( Shed *pShed, const char *spec );
+
+bool Shed_Enabled( Shed *pShed );
+
+void Shed_Update( Shed *pShed, const ShedLoad *pLoad, uint64_t nowMs );
+
+bool Shed_Active( Shed *pShed );
+
+ShedReason Shed_Admit( Shed *pShed,
+                       uint32_t pid,
+                       unsigned int priority,
+                       const char *stream,
+                       size_t streamLength,
+                       size_t bytes );
+
+const char *Shed_LatestKey( Shed *pShed );
+
+void Shed_Record( Shed *pShed,
+                  ShedReason reason,
+                  uint32_t pid,
+                  const char *stream,
+                  size_t streamLength,
+                  size_t bytes );
+
+void Shed_GetStats( Shed *pShed, ShedStats *pStats );
+
+int Shed_GetClient( Shed *pShed, size_t idx, ShedSource *pSource );
+
+int Shed_GetStream( Shed *pShed, size_t idx, ShedSource *pSource );
+
+const char *Shed_ReasonName( ShedReason reason );
+
+#endif
@@ -0,0 +1,109 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef SIMLINK_H
+#define SIMLINK_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <azureiot/iothub_client.h>
+#include "tlscache.h"
+#include "backoff.h"
+#include "socktune.h"
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! opaque handle to a hub stand-in link */
+typedef struct simLink SimLink;
+
+/*! time spent in each phase of the most recent connection attempt */
+typedef struct simLinkTimings
+{
+    /*! time spent waiting before redialling, in microseconds */
+    uint64_t backoffUs;
+
+    /*! time spent resolving the stand-in address, in microseconds */
+    uint64_t resolveUs;
+
+    /*! time spent establishing the TCP connection, in microseconds */
+    uint64_t connectUs;
+
+    /*! time spent in the TLS handshake, in microseconds */
+    uint64_t handshakeUs;
+
+    /*! time spent retransmitting unacknowledged messages,
+        in microseconds */
+    uint64_t retransmitUs;
+
+    /*! true if the TLS session was resumed */
+    bool resumed;
+
+    /*! true if the kernel encrypts the TLS records sent */
+    bool ktlsTx;
+
+    /*! true if the kernel decrypts the TLS records received */
+    bool ktlsRx;
+
+} SimLinkTimings;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+SimLink *SimLink_Create( const char *address,
+                         TlsCache *pTlsCache,
+                         const SockTune *pSockTune,
+                         bool verbose );
+
+void SimLink_Destroy( SimLink *pSimLink );
+
+int SimLink_GetTimings( SimLink *pSimLink, SimLinkTimings *pTimings );
+
+IOTHUB_CLIENT_RESULT SimLink_SetConnectionStatusCallback(
+                        SimLink *pSimLink,
+                        IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK callback,
+                        void *userContextCallback );
+
+int SimLink_SetRetryPolicy( SimLink *pSimLink, const Backoff *pPolicy );
+
+IOTHUB_CLIENT_RESULT SimLink_SendEventAsync(
+                        SimLink *pSimLink,
+                        IOTHUB_MESSAGE_HANDLE messageHandle,
+                        IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback,
+                        void *userContextCallback );
+
+IOTHUB_CLIENT_RESULT SimLink_UploadMultipleBlocksToBlobExAsync(
+                        SimLink *pSimLink,
+                        const char *destinationFileName,
+                        IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_CALLBACK_EX
+                            getDataCallbackEx,
+                        void *context );
+
+#endif
@@ -0,0 +1,83 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef SOCKTUNE_H
+#define SOCKTUNE_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! socket options applied to the uplink connection */
+typedef struct sockTune
+{
+    /*! true to disable the Nagle algorithm */
+    bool noDelay;
+
+    /*! socket send buffer size in bytes, or 0 for the system default */
+    uint32_t sndBuf;
+
+    /*! socket receive buffer size in bytes, or 0 for the system default */
+    uint32_t rcvBuf;
+
+    /*! time unacknowledged data may remain unsent before the connection
+        is dropped, in milliseconds, or 0 for the system default */
+    uint32_t userTimeoutMs;
+
+    /*! idle time before the first keepalive probe in seconds,
+        or 0 to disable keepalive */
+    uint32_t keepIdle;
+
+    /*! time between keepalive probes in seconds,
+        or 0 for the system default */
+    uint32_t keepInterval;
+
+    /*! number of unanswered keepalive probes before the connection
+        is dropped, or 0 for the system default */
+    uint32_t keepCount;
+
+    /*! true to move TLS record processing into the kernel */
+    bool ktls;
+
+} SockTune;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+void SockTune_Init( SockTune *pSockTune );
+
+int SockTune_Parse( SockTune *pSockTune, const char *spec );
+
+int SockTune_Apply( const SockTune *pSockTune, int fd );
+
+#endif
@@ -0,0 +1,62 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef TLSCACHE_H
+#define TLSCACHE_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <openssl/ssl.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! opaque handle to a TLS client context cache */
+typedef struct tlsCache TlsCache;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+TlsCache *TlsCache_Create( const char *caFile, const char *sessionFile );
+
+void TlsCache_Destroy( TlsCache *pTlsCache );
+
+const char *TlsCache_GetTrustedCerts( TlsCache *pTlsCache );
+
+bool TlsCache_SetKtls( TlsCache *pTlsCache, bool enable );
+
+void TlsCache_GetKtls( SSL *ssl, bool *pTx, bool *pRx );
+
+SSL *TlsCache_Handshake( TlsCache *pTlsCache,
+                         int fd,
+                         const char *host,
+                         bool *pResumed );
+
+#endif
@@ -0,0 +1,82 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! opaque handle to an ingest trace file */
+typedef struct trace Trace;
+
+/*! A single received client message */
+typedef struct traceRecord
+{
+    /*! arrival time in microseconds since the start of the trace */
+    uint64_t timestamp;
+
+    /*! process id of the client which sent the message */
+    uint32_t pid;
+
+    /*! message queue priority */
+    uint32_t priority;
+
+    /*! pointer to the header frame contents following the pid */
+    const char *headers;
+
+    /*! length of the header frame contents */
+    size_t headerLength;
+
+    /*! pointer to the message body */
+    const char *body;
+
+    /*! length of the message body */
+    size_t bodyLength;
+
+} TraceRecord;
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+Trace *Trace_Create( const char *filename );
+
+Trace *Trace_Open( const char *filename );
+
+int Trace_Write( Trace *pTrace, TraceRecord *pRecord );
+
+int Trace_Read( Trace *pTrace, TraceRecord *pRecord );
+
+void Trace_Close( Trace *pTrace );
+
+#endif
@@ -0,0 +1,82 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <azureiot/iothub_client.h>
+
+/*==============================================================================
+        Public definitions
+==============================================================================*/
+
+/*! default size of the blocks a file is uploaded in */
+#define UPLOAD_DEFAULT_BLOCK_SIZE ( 4 * 1024 * 1024 )
+
+/*! maximum size of the blocks a file is uploaded in */
+#define UPLOAD_MAX_BLOCK_SIZE ( 100 * 1024 * 1024 )
+
+/*! maximum length of a blob name */
+#define UPLOAD_MAX_BLOB_NAME ( 256 )
+
+/*! opaque handle to a file upload */
+typedef struct upload Upload;
+
+/*! function called once an upload has completed or failed, with the
+    number of bytes confirmed by the hub */
+typedef void (*UploadDoneFn)( void *arg, int result, uint64_t bytes );
+
+/*==============================================================================
+        Public function declarations
+==============================================================================*/
+
+int Upload_Create( Upload **ppUpload,
+                   const char *path,
+                   const char *blobName,
+                   const char *replyTo,
+                   uid_t owner,
+                   size_t blockSize,
+                   UploadDoneFn done,
+                   void *arg );
+
+void Upload_Fail( Upload *pUpload, int result );
+
+const char *Upload_BlobName( Upload *pUpload );
+
+uint64_t Upload_Size( Upload *pUpload );
+
+IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_RESULT Upload_GetData(
+                        IOTHUB_CLIENT_FILE_UPLOAD_RESULT result,
+                        unsigned char const **data,
+                        size_t *size,
+                        void *context );
+
+#endif
@@ -0,0 +1,225 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup backoff backoff
+ * @brief Exponential reconnect backoff with jitter
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file backoff.c
+
+    Exponential reconnect backoff with jitter
+
+    The backoff module computes the delays between reconnect attempts.
+    The delay doubles after each failed attempt, from the initial delay
+    up to the maximum delay, and a configurable percentage of each
+    delay is randomized.  With a jitter of 50%, each delay is chosen
+    uniformly between half and all of the exponential delay, so a fleet
+    of devices which lose the hub at the same moment spread their
+    reconnects out instead of returning together.
+
+    A policy is written as min:max:jitter, in milliseconds, milliseconds
+    and percent, eg "100:60000:50".  Trailing fields may be omitted.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <varserver/varserver.h>
+#include "backoff.h"
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Backoff_Init                                                              */
+/*!
+    Initialize a backoff policy
+
+    The random number generator is seeded from the clock and the
+    process id, so devices started at the same moment still choose
+    different delays.
+
+    @param[in]
+        pBackoff
+            pointer to the backoff to initialize
+
+    @param[in]
+        minMs
+            initial delay in milliseconds
+
+    @param[in]
+        maxMs
+            maximum delay in milliseconds
+
+    @param[in]
+        jitter
+            percentage of each delay which is randomized (0-100)
+
+==============================================================================*/
+void Backoff_Init( Backoff *pBackoff,
+                   uint32_t minMs,
+                   uint32_t maxMs,
+                   uint32_t jitter )
+{
+    struct timespec ts;
+
+    if ( pBackoff != NULL )
+    {
+        clock_gettime( CLOCK_REALTIME, &ts );
+
+        pBackoff->minMs = ( minMs > 0 ) ? minMs : 1;
+        pBackoff->maxMs = ( maxMs > pBackoff->minMs ) ? maxMs
+                                                      : pBackoff->minMs;
+        pBackoff->jitter = ( jitter <= 100 ) ? jitter : 100;
+        pBackoff->delayMs = 0;
+        pBackoff->seed = (unsigned int)( ts.tv_nsec ^ ( getpid() << 16 ) );
+    }
+}
+
+/*============================================================================*/
+/*  Backoff_Parse                                                             */
+/*!
+    Initialize a backoff policy from a min:max:jitter specification
+
+    @param[in]
+        pBackoff
+            pointer to the backoff to initialize
+
+    @param[in]
+        spec
+            policy specification.  Omitted fields take their defaults.
+
+    @retval EOK the policy was parsed
+    @retval EINVAL invalid specification
+
+==============================================================================*/
+int Backoff_Parse( Backoff *pBackoff, const char *spec )
+{
+    unsigned long minMs = BACKOFF_DEFAULT_MIN_MS;
+    unsigned long maxMs = BACKOFF_DEFAULT_MAX_MS;
+    unsigned long jitter = BACKOFF_DEFAULT_JITTER;
+    char *p;
+
+    if ( ( pBackoff == NULL ) ||
+         ( spec == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    minMs = strtoul( spec, &p, 0 );
+    if ( *p == ':' )
+    {
+        maxMs = strtoul( p + 1, &p, 0 );
+        if ( *p == ':' )
+        {
+            jitter = strtoul( p + 1, &p, 0 );
+        }
+    }
+
+    if ( ( *p != '\0' ) ||
+         ( minMs == 0 ) ||
+         ( maxMs < minMs ) ||
+         ( jitter > 100 ) )
+    {
+        return EINVAL;
+    }
+
+    Backoff_Init( pBackoff, minMs, maxMs, jitter );
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  Backoff_Next                                                              */
+/*!
+    Get the delay before the next reconnect attempt
+
+    @param[in]
+        pBackoff
+            pointer to the backoff
+
+    @retval delay in milliseconds
+
+==============================================================================*/
+uint32_t Backoff_Next( Backoff *pBackoff )
+{
+    uint32_t delay;
+    uint32_t spread;
+
+    if ( pBackoff == NULL )
+    {
+        return 0;
+    }
+
+    pBackoff->delayMs = ( pBackoff->delayMs == 0 )
+                        ? pBackoff->minMs
+                        : ( pBackoff->delayMs < pBackoff->maxMs / 2 )
+                          ? 2 * pBackoff->delayMs
+                          : pBackoff->maxMs;
+
+    delay = pBackoff->delayMs;
+    spread = (uint32_t)( (uint64_t)delay * pBackoff->jitter / 100 );
+    if ( spread > 0 )
+    {
+        delay -= (uint32_t)( rand_r( &pBackoff->seed ) % ( spread + 1 ) );
+    }
+
+    return delay;
+}
+
+/*============================================================================*/
+/*  Backoff_Reset                                                             */
+/*!
+    Restart the backoff from the initial delay
+
+    The backoff is reset once a connection has been established.
+
+    @param[in]
+        pBackoff
+            pointer to the backoff
+
+==============================================================================*/
+void Backoff_Reset( Backoff *pBackoff )
+{
+    if ( pBackoff != NULL )
+    {
+        pBackoff->delayMs = 0;
+    }
+}
+
+/*! @}
+ * end of backoff group */
@@ -0,0 +1,545 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup bodypool bodypool
+ * @brief Size-class pool of message body buffers
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file bodypool.c
+
+    Body buffer pool
+
+    The bodypool module provides the buffers which client message
+    bodies are read into.  Buffers come in a few size classes (1KB,
+    8KB, 64KB and 256KB, with the largest class sized to the maximum
+    body size), so a small body only occupies a small buffer.  Since
+    the size of a body is not known until it has been read, a body is
+    read into the smallest buffer first and moved to the next class up
+    each time the buffer fills.
+
+    Each class keeps a free list of released buffers for reuse, up to a
+    limit on the bytes held, so a steady stream of messages does not
+    allocate.  Several buffers may be in use at the same time.
+
+    The pool is not thread safe.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <varserver/varserver.h>
+#include "bodypool.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! body buffer */
+typedef struct bodyBuffer
+{
+    /*! next free buffer in the size class */
+    struct bodyBuffer *pNext;
+
+    /*! index of the size class */
+    size_t cls;
+
+    /*! body data */
+    char data[];
+
+} BodyBuffer;
+
+/*! size class */
+typedef struct bodyClass
+{
+    /*! capacity of the buffers in the class */
+    size_t size;
+
+    /*! maximum number of free buffers kept */
+    size_t maxFree;
+
+    /*! number of free buffers kept */
+    size_t numFree;
+
+    /*! free buffers */
+    BodyBuffer *pFree;
+
+} BodyClass;
+
+/*! body buffer pool */
+struct bodyPool
+{
+    /*! number of size classes */
+    size_t numClasses;
+
+    /*! size classes, smallest first */
+    BodyClass classes[BODYPOOL_MAX_CLASSES];
+
+    /*! pool statistics */
+    BodyPoolStats stats;
+};
+
+/*! standard size class capacities */
+static const size_t classSizes[] =
+{
+    1024,
+    8 * 1024,
+    64 * 1024,
+    256 * 1024
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static char *Get( BodyPool *pPool, size_t cls );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  BodyPool_Create                                                           */
+/*!
+    Create a body buffer pool
+
+    The standard size classes smaller than the maximum body size are
+    used, followed by a class holding the maximum body size.
+
+    @param[in]
+        maxSize
+            maximum size of a message body in bytes
+
+    @param[in]
+        cacheLimit
+            limit on the free buffers kept by each size class in bytes.
+            At least one free buffer is kept by each class.
+
+    @retval pointer to the body buffer pool
+    @retval NULL if the pool could not be created
+
+==============================================================================*/
+BodyPool *BodyPool_Create( size_t maxSize, size_t cacheLimit )
+{
+    BodyPool *pPool = NULL;
+    BodyClass *pClass;
+    size_t i;
+
+    if ( maxSize > 0 )
+    {
+        pPool = calloc( 1, sizeof( BodyPool ) );
+    }
+
+    if ( pPool != NULL )
+    {
+        for ( i = 0;
+              ( i < sizeof( classSizes ) / sizeof( classSizes[0] ) ) &&
+              ( classSizes[i] < maxSize );
+              i++ )
+        {
+            pPool->classes[pPool->numClasses++].size = classSizes[i];
+        }
+
+        pPool->classes[pPool->numClasses++].size = maxSize;
+
+        for ( i = 0; i < pPool->numClasses; i++ )
+        {
+            pClass = &pPool->classes[i];
+            pClass->maxFree = cacheLimit / pClass->size;
+            if ( pClass->maxFree == 0 )
+            {
+                pClass->maxFree = 1;
+            }
+        }
+
+        pPool->stats.maxSize = maxSize;
+    }
+
+    return pPool;
+}
+
+/*============================================================================*/
+/*  BodyPool_Destroy                                                          */
+/*!
+    Destroy a body buffer pool
+
+    The free buffers are released.  All buffers must have been returned
+    to the pool.
+
+    @param[in]
+        pPool
+            pointer to the body buffer pool, may be NULL
+
+==============================================================================*/
+void BodyPool_Destroy( BodyPool *pPool )
+{
+    BodyBuffer *pBuffer;
+    size_t i;
+
+    if ( pPool != NULL )
+    {
+        for ( i = 0; i < pPool->numClasses; i++ )
+        {
+            while ( pPool->classes[i].pFree != NULL )
+            {
+                pBuffer = pPool->classes[i].pFree;
+                pPool->classes[i].pFree = pBuffer->pNext;
+                free( pBuffer );
+            }
+        }
+
+        free( pPool );
+    }
+}
+
+/*============================================================================*/
+/*  BodyPool_Alloc                                                            */
+/*!
+    Get a body buffer
+
+    The BodyPool_Alloc function gets a buffer from the smallest size
+    class which can hold the requested size.
+
+    @param[in]
+        pPool
+            pointer to the body buffer pool
+
+    @param[in]
+        size
+            minimum capacity of the buffer in bytes
+
+    @param[out]
+        pCapacity
+            pointer to a location to store the capacity of the buffer
+
+    @retval pointer to the buffer
+    @retval NULL if the size exceeds the maximum body size (errno is
+            EMSGSIZE) or no memory is available
+
+==============================================================================*/
+char *BodyPool_Alloc( BodyPool *pPool, size_t size, size_t *pCapacity )
+{
+    char *buf = NULL;
+    size_t cls;
+
+    if ( ( pPool != NULL ) &&
+         ( pCapacity != NULL ) )
+    {
+        cls = 0;
+        while ( ( cls < pPool->numClasses ) &&
+                ( pPool->classes[cls].size < size ) )
+        {
+            cls++;
+        }
+
+        if ( cls < pPool->numClasses )
+        {
+            buf = Get( pPool, cls );
+            if ( buf != NULL )
+            {
+                *pCapacity = pPool->classes[cls].size;
+            }
+        }
+        else
+        {
+            errno = EMSGSIZE;
+        }
+    }
+    else
+    {
+        errno = EINVAL;
+    }
+
+    return buf;
+}
+
+/*============================================================================*/
+/*  BodyPool_Grow                                                             */
+/*!
+    Move a body to a larger buffer
+
+    The BodyPool_Grow function gets a buffer from the next size class
+    up, copies the body into it, and returns the old buffer to the
+    pool.  The old buffer is kept if a larger buffer cannot be had.
+
+    @param[in]
+        pPool
+            pointer to the body buffer pool
+
+    @param[in]
+        buf
+            buffer holding the body
+
+    @param[in]
+        used
+            number of bytes of the body to copy
+
+    @param[out]
+        pCapacity
+            pointer to a location to store the capacity of the new buffer
+
+    @retval pointer to the new buffer
+    @retval NULL if the buffer is already in the largest size class
+            (errno is EMSGSIZE) or no memory is available
+
+==============================================================================*/
+char *BodyPool_Grow( BodyPool *pPool,
+                     char *buf,
+                     size_t used,
+                     size_t *pCapacity )
+{
+    BodyBuffer *pBuffer;
+    char *newBuf = NULL;
+
+    if ( ( pPool != NULL ) &&
+         ( buf != NULL ) &&
+         ( pCapacity != NULL ) )
+    {
+        pBuffer = (BodyBuffer *)( buf - offsetof( BodyBuffer, data ) );
+        if ( pBuffer->cls + 1 < pPool->numClasses )
+        {
+            newBuf = Get( pPool, pBuffer->cls + 1 );
+            if ( newBuf != NULL )
+            {
+                *pCapacity = pPool->classes[pBuffer->cls + 1].size;
+                memcpy( newBuf, buf, used );
+                BodyPool_Free( pPool, buf );
+            }
+        }
+        else
+        {
+            errno = EMSGSIZE;
+        }
+    }
+    else
+    {
+        errno = EINVAL;
+    }
+
+    return newBuf;
+}
+
+/*============================================================================*/
+/*  BodyPool_Free                                                             */
+/*!
+    Return a body buffer to the pool
+
+    The buffer is kept on the free list of its size class, or released
+    if the free list is full.
+
+    @param[in]
+        pPool
+            pointer to the body buffer pool
+
+    @param[in]
+        buf
+            buffer to return, may be NULL
+
+==============================================================================*/
+void BodyPool_Free( BodyPool *pPool, char *buf )
+{
+    BodyBuffer *pBuffer;
+    BodyClass *pClass;
+
+    if ( ( pPool != NULL ) &&
+         ( buf != NULL ) )
+    {
+        pBuffer = (BodyBuffer *)( buf - offsetof( BodyBuffer, data ) );
+        pClass = &pPool->classes[pBuffer->cls];
+
+        pPool->stats.inUse--;
+        pPool->stats.inUseBytes -= pClass->size;
+
+        if ( pClass->numFree < pClass->maxFree )
+        {
+            pBuffer->pNext = pClass->pFree;
+            pClass->pFree = pBuffer;
+            pClass->numFree++;
+            pPool->stats.cachedBytes += pClass->size;
+        }
+        else
+        {
+            free( pBuffer );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  BodyPool_SetCacheLimit                                                    */
+/*!
+    Change the limit on the free buffers kept by each size class
+
+    Free buffers beyond the new limit are released at once.
+
+    @param[in]
+        pPool
+            pointer to the body buffer pool
+
+    @param[in]
+        cacheLimit
+            limit on the free buffers kept by each size class in bytes.
+            At least one free buffer is kept by each class.
+
+==============================================================================*/
+void BodyPool_SetCacheLimit( BodyPool *pPool, size_t cacheLimit )
+{
+    BodyBuffer *pBuffer;
+    BodyClass *pClass;
+    size_t i;
+
+    if ( pPool != NULL )
+    {
+        for ( i = 0; i < pPool->numClasses; i++ )
+        {
+            pClass = &pPool->classes[i];
+            pClass->maxFree = cacheLimit / pClass->size;
+            if ( pClass->maxFree == 0 )
+            {
+                pClass->maxFree = 1;
+            }
+
+            while ( pClass->numFree > pClass->maxFree )
+            {
+                pBuffer = pClass->pFree;
+                pClass->pFree = pBuffer->pNext;
+                pClass->numFree--;
+                pPool->stats.cachedBytes -= pClass->size;
+                free( pBuffer );
+            }
+        }
+    }
+}
+
+/*============================================================================*/
+/*  BodyPool_MaxSize                                                          */
+/*!
+    Get the maximum size of a message body
+
+    @param[in]
+        pPool
+            pointer to the body buffer pool
+
+    @retval the maximum body size in bytes
+
+==============================================================================*/
+size_t BodyPool_MaxSize( BodyPool *pPool )
+{
+    return ( pPool != NULL ) ? pPool->stats.maxSize : 0;
+}
+
+/*============================================================================*/
+/*  BodyPool_GetStats                                                         */
+/*!
+    Get the body buffer pool statistics
+
+    @param[in]
+        pPool
+            pointer to the body buffer pool, may be NULL
+
+    @param[out]
+        pStats
+            pointer to the statistics to populate
+
+==============================================================================*/
+void BodyPool_GetStats( BodyPool *pPool, BodyPoolStats *pStats )
+{
+    if ( pStats != NULL )
+    {
+        if ( pPool != NULL )
+        {
+            *pStats = pPool->stats;
+        }
+        else
+        {
+            memset( pStats, 0, sizeof( BodyPoolStats ) );
+        }
+    }
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Get                                                                       */
+/*!
+    Get a buffer from a size class
+
+    @param[in]
+        pPool
+            pointer to the body buffer pool
+
+    @param[in]
+        cls
+            index of the size class
+
+    @retval pointer to the buffer data
+    @retval NULL if no memory is available
+
+==============================================================================*/
+static char *Get( BodyPool *pPool, size_t cls )
+{
+    BodyClass *pClass = &pPool->classes[cls];
+    BodyBuffer *pBuffer;
+
+    pBuffer = pClass->pFree;
+    if ( pBuffer != NULL )
+    {
+        pClass->pFree = pBuffer->pNext;
+        pClass->numFree--;
+        pPool->stats.cachedBytes -= pClass->size;
+        pPool->stats.reused++;
+    }
+    else
+    {
+        pBuffer = malloc( sizeof( BodyBuffer ) + pClass->size );
+        if ( pBuffer != NULL )
+        {
+            pBuffer->cls = cls;
+        }
+    }
+
+    if ( pBuffer != NULL )
+    {
+        pPool->stats.allocs++;
+        pPool->stats.inUse++;
+        pPool->stats.inUseBytes += pClass->size;
+    }
+
+    return ( pBuffer != NULL ) ? pBuffer->data : NULL;
+}
+
+/*! @}
+ * end of bodypool group */
@@ -0,0 +1,764 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup connstate connstate
+ * @brief Connection state machine and connection metrics
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file connstate.c
+
+    Connection state machine and connection metrics
+
+    The connstate module tracks the state of the connection to the hub
+    from the connection status callbacks of the hub client.  While the
+    client retries a lost connection itself, the state is RECONNECTING.
+    When the client gives up, or reports an error which retrying cannot
+    fix, the state is FAILED and the service recreates the client once
+    the backoff delay has elapsed.
+
+    The time spent disconnected and the time taken to restore each lost
+    connection are recorded for export by the service.
+
+    The service may also close an idle connection itself, when the
+    state is SLEEPING until the service resumes the connection.  Time
+    asleep is recorded separately, and neither closing the connection
+    nor connecting again counts as an outage.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <varserver/varserver.h>
+#include "connstate.h"
+#include "footprint.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! connection state machine */
+struct connState
+{
+    /*! mutex protecting the state */
+    pthread_mutex_t mutex;
+
+    /*! condition signalled when the state changes */
+    pthread_cond_t cond;
+
+    /*! current state */
+    ConnStateId state;
+
+    /*! number of times waiters have been woken without a state change */
+    uint32_t wakes;
+
+    /*! backoff policy for recreating the client */
+    Backoff backoff;
+
+    /*! monotonic time the client may be recreated, in milliseconds */
+    uint64_t retryAt;
+
+    /*! monotonic time the state machine was created, in milliseconds */
+    uint64_t createdAt;
+
+    /*! monotonic time the current outage or sleep started, in
+        milliseconds */
+    uint64_t downAt;
+
+    /*! monotonic time the current connection was established, in
+        milliseconds */
+    uint64_t upAt;
+
+    /*! true while connecting after a sleep */
+    bool resumed;
+
+    /*! true if the connection has been established at least once */
+    bool everConnected;
+
+    /*! connection metrics */
+    ConnMetrics metrics;
+
+    /*! verbose flag */
+    bool verbose;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static uint64_t GetMonotonicMs( void );
+static void SetState( ConnState *pConnState,
+                      ConnStateId state,
+                      const char *reason );
+static bool IsFatal( IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  ConnState_Create                                                          */
+/*!
+    Create a connection state machine
+
+    The state machine starts in the CONNECTING state.
+
+    @param[in]
+        pPolicy
+            backoff policy used to delay recreating a failed client
+
+    @param[in]
+        verbose
+            true to log state changes
+
+    @retval pointer to the state machine
+    @retval NULL if the state machine could not be created
+
+==============================================================================*/
+ConnState *ConnState_Create( const Backoff *pPolicy, bool verbose )
+{
+    ConnState *pConnState;
+    pthread_condattr_t attr;
+
+    if ( pPolicy == NULL )
+    {
+        return NULL;
+    }
+
+    pConnState = calloc( 1, sizeof( ConnState ) );
+    if ( pConnState != NULL )
+    {
+        pthread_mutex_init( &pConnState->mutex, NULL );
+
+        pthread_condattr_init( &attr );
+        pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+        pthread_cond_init( &pConnState->cond, &attr );
+        pthread_condattr_destroy( &attr );
+
+        pConnState->backoff = *pPolicy;
+        pConnState->state = CONNSTATE_CONNECTING;
+        pConnState->createdAt = GetMonotonicMs();
+        pConnState->downAt = pConnState->createdAt;
+        pConnState->verbose = verbose;
+    }
+
+    return pConnState;
+}
+
+/*============================================================================*/
+/*  ConnState_Destroy                                                         */
+/*!
+    Destroy a connection state machine
+
+    @param[in]
+        pConnState
+            pointer to the state machine to destroy
+
+==============================================================================*/
+void ConnState_Destroy( ConnState *pConnState )
+{
+    if ( pConnState != NULL )
+    {
+        pthread_cond_destroy( &pConnState->cond );
+        pthread_mutex_destroy( &pConnState->mutex );
+        free( pConnState );
+    }
+}
+
+/*============================================================================*/
+/*  ConnState_StatusCallback                                                  */
+/*!
+    Handle a connection status change from the hub client
+
+    This function has the signature of the client connection status
+    callback, and takes the state machine as its context.
+
+    @param[in]
+        status
+            connection status
+
+    @param[in]
+        reason
+            reason for the status change
+
+    @param[in]
+        userContextCallback
+            pointer to the connection state machine
+
+==============================================================================*/
+void ConnState_StatusCallback( IOTHUB_CLIENT_CONNECTION_STATUS status,
+                               IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason,
+                               void *userContextCallback )
+{
+    ConnState *pConnState = (ConnState *)userContextCallback;
+    const char *reasonName;
+    uint32_t delay;
+
+    if ( pConnState == NULL )
+    {
+        return;
+    }
+
+    reasonName = MU_ENUM_TO_STRING( IOTHUB_CLIENT_CONNECTION_STATUS_REASON,
+                                    reason );
+
+    pthread_mutex_lock( &pConnState->mutex );
+
+    if ( pConnState->state == CONNSTATE_SLEEPING )
+    {
+        /* the connection was closed on purpose */
+    }
+    else if ( status == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED )
+    {
+        SetState( pConnState, CONNSTATE_CONNECTED, reasonName );
+        Backoff_Reset( &pConnState->backoff );
+    }
+    else if ( pConnState->state != CONNSTATE_FAILED )
+    {
+        if ( IsFatal( reason ) )
+        {
+            SetState( pConnState, CONNSTATE_FAILED, reasonName );
+
+            delay = Backoff_Next( &pConnState->backoff );
+            pConnState->retryAt = GetMonotonicMs() + delay;
+
+            if ( IOTHUB_VERBOSE( pConnState->verbose ) )
+            {
+                fprintf( stderr,
+                         "iothub: recreating client in %u ms\n",
+                         delay );
+            }
+        }
+        else if ( pConnState->state == CONNSTATE_CONNECTED )
+        {
+            SetState( pConnState, CONNSTATE_RECONNECTING, reasonName );
+        }
+    }
+
+    pthread_mutex_unlock( &pConnState->mutex );
+}
+
+/*============================================================================*/
+/*  ConnState_Failed                                                          */
+/*!
+    Record that the hub client could not be created
+
+    The state changes to FAILED and the next attempt to create the
+    client is scheduled after the backoff delay.
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+==============================================================================*/
+void ConnState_Failed( ConnState *pConnState )
+{
+    uint32_t delay;
+
+    if ( pConnState != NULL )
+    {
+        pthread_mutex_lock( &pConnState->mutex );
+
+        SetState( pConnState, CONNSTATE_FAILED, "CLIENT_CREATE" );
+
+        delay = Backoff_Next( &pConnState->backoff );
+        pConnState->retryAt = GetMonotonicMs() + delay;
+
+        if ( IOTHUB_VERBOSE( pConnState->verbose ) )
+        {
+            fprintf( stderr, "iothub: recreating client in %u ms\n", delay );
+        }
+
+        pthread_mutex_unlock( &pConnState->mutex );
+    }
+}
+
+/*============================================================================*/
+/*  ConnState_Connecting                                                      */
+/*!
+    Record that a new hub client is being created
+
+    The state changes to CONNECTING for the first connection, or to
+    RECONNECTING when a failed client is being replaced.
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+==============================================================================*/
+void ConnState_Connecting( ConnState *pConnState )
+{
+    if ( pConnState != NULL )
+    {
+        pthread_mutex_lock( &pConnState->mutex );
+
+        if ( pConnState->state == CONNSTATE_FAILED )
+        {
+            SetState( pConnState,
+                      pConnState->everConnected ? CONNSTATE_RECONNECTING
+                                                : CONNSTATE_CONNECTING,
+                      "RETRY" );
+        }
+
+        pthread_mutex_unlock( &pConnState->mutex );
+    }
+}
+
+/*============================================================================*/
+/*  ConnState_Sleep                                                           */
+/*!
+    Record that the service closed the idle connection
+
+    The state changes to SLEEPING.  Status changes reported by the
+    client while the state is SLEEPING are ignored.
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+==============================================================================*/
+void ConnState_Sleep( ConnState *pConnState )
+{
+    if ( pConnState != NULL )
+    {
+        pthread_mutex_lock( &pConnState->mutex );
+        SetState( pConnState, CONNSTATE_SLEEPING, "IDLE" );
+        pthread_mutex_unlock( &pConnState->mutex );
+    }
+}
+
+/*============================================================================*/
+/*  ConnState_Resume                                                          */
+/*!
+    Record that the service is connecting again after a sleep
+
+    The state changes from SLEEPING to CONNECTING.  The time taken to
+    connect is not counted as a reconnection.
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+==============================================================================*/
+void ConnState_Resume( ConnState *pConnState )
+{
+    if ( pConnState != NULL )
+    {
+        pthread_mutex_lock( &pConnState->mutex );
+
+        if ( pConnState->state == CONNSTATE_SLEEPING )
+        {
+            pConnState->resumed = true;
+            SetState( pConnState, CONNSTATE_CONNECTING, "RESUME" );
+        }
+
+        pthread_mutex_unlock( &pConnState->mutex );
+    }
+}
+
+/*============================================================================*/
+/*  ConnState_Get                                                             */
+/*!
+    Get the current connection state
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+    @param[out]
+        pRetryMs
+            optional pointer to receive the time in milliseconds until
+            a failed client may be recreated.  It is 0 when the retry
+            is due, or when the state is not FAILED.
+
+    @retval the current connection state
+
+==============================================================================*/
+ConnStateId ConnState_Get( ConnState *pConnState, uint32_t *pRetryMs )
+{
+    ConnStateId state = CONNSTATE_FAILED;
+    uint64_t now;
+
+    if ( pRetryMs != NULL )
+    {
+        *pRetryMs = 0;
+    }
+
+    if ( pConnState != NULL )
+    {
+        pthread_mutex_lock( &pConnState->mutex );
+
+        state = pConnState->state;
+        if ( ( state == CONNSTATE_FAILED ) &&
+             ( pRetryMs != NULL ) )
+        {
+            now = GetMonotonicMs();
+            if ( pConnState->retryAt > now )
+            {
+                *pRetryMs = (uint32_t)( pConnState->retryAt - now );
+            }
+        }
+
+        pthread_mutex_unlock( &pConnState->mutex );
+    }
+
+    return state;
+}
+
+/*============================================================================*/
+/*  ConnState_Wake                                                            */
+/*!
+    Wake the threads waiting for the connection state to change
+
+    The waiting threads return from ConnState_Wait even though the
+    state has not changed, so they can act on other events.
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+==============================================================================*/
+void ConnState_Wake( ConnState *pConnState )
+{
+    if ( pConnState != NULL )
+    {
+        pthread_mutex_lock( &pConnState->mutex );
+        pConnState->wakes++;
+        pthread_cond_broadcast( &pConnState->cond );
+        pthread_mutex_unlock( &pConnState->mutex );
+    }
+}
+
+/*============================================================================*/
+/*  ConnState_Wait                                                            */
+/*!
+    Wait for the connection state to change
+
+    The wait also ends when ConnState_Wake is called or the timeout
+    expires.
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+    @param[in]
+        timeoutMs
+            maximum time to wait in milliseconds
+
+==============================================================================*/
+void ConnState_Wait( ConnState *pConnState, uint32_t timeoutMs )
+{
+    struct timespec ts;
+    ConnStateId state;
+    uint32_t wakes;
+
+    if ( pConnState != NULL )
+    {
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        ts.tv_sec += timeoutMs / 1000;
+        ts.tv_nsec += (long)( timeoutMs % 1000 ) * 1000000L;
+        if ( ts.tv_nsec >= 1000000000L )
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock( &pConnState->mutex );
+
+        state = pConnState->state;
+        wakes = pConnState->wakes;
+        while ( ( pConnState->state == state ) &&
+                ( pConnState->wakes == wakes ) )
+        {
+            if ( pthread_cond_timedwait( &pConnState->cond,
+                                         &pConnState->mutex,
+                                         &ts ) == ETIMEDOUT )
+            {
+                break;
+            }
+        }
+
+        pthread_mutex_unlock( &pConnState->mutex );
+    }
+}
+
+/*============================================================================*/
+/*  ConnState_GetMetrics                                                      */
+/*!
+    Get the connection metrics
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+    @param[out]
+        pMetrics
+            pointer to the metrics to populate
+
+==============================================================================*/
+void ConnState_GetMetrics( ConnState *pConnState, ConnMetrics *pMetrics )
+{
+    uint64_t now;
+
+    if ( ( pConnState != NULL ) &&
+         ( pMetrics != NULL ) )
+    {
+        pthread_mutex_lock( &pConnState->mutex );
+
+        now = GetMonotonicMs();
+        *pMetrics = pConnState->metrics;
+        pMetrics->state = pConnState->state;
+        pMetrics->uptimeMs = now - pConnState->createdAt;
+        if ( pConnState->state == CONNSTATE_CONNECTED )
+        {
+            pMetrics->connectedMs += now - pConnState->upAt;
+        }
+        else if ( pConnState->state == CONNSTATE_SLEEPING )
+        {
+            pMetrics->sleepMs += now - pConnState->downAt;
+        }
+        else
+        {
+            pMetrics->disconnectedMs += now - pConnState->downAt;
+        }
+
+        pthread_mutex_unlock( &pConnState->mutex );
+    }
+}
+
+/*============================================================================*/
+/*  ConnState_Name                                                            */
+/*!
+    Get the name of a connection state
+
+    @param[in]
+        state
+            connection state
+
+    @retval name of the state
+
+==============================================================================*/
+const char *ConnState_Name( ConnStateId state )
+{
+    switch ( state )
+    {
+        case CONNSTATE_CONNECTING:
+            return "CONNECTING";
+
+        case CONNSTATE_CONNECTED:
+            return "CONNECTED";
+
+        case CONNSTATE_RECONNECTING:
+            return "RECONNECTING";
+
+        case CONNSTATE_FAILED:
+            return "FAILED";
+
+        case CONNSTATE_SLEEPING:
+            return "SLEEPING";
+
+        default:
+            return "UNKNOWN";
+    }
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  SetState                                                                  */
+/*!
+    Change the connection state and update the metrics
+
+    The caller must hold the state machine mutex.
+
+    @param[in]
+        pConnState
+            pointer to the state machine
+
+    @param[in]
+        state
+            new connection state
+
+    @param[in]
+        reason
+            reason for the change, for logging
+
+==============================================================================*/
+static void SetState( ConnState *pConnState,
+                      ConnStateId state,
+                      const char *reason )
+{
+    ConnMetrics *pMetrics = &pConnState->metrics;
+    uint64_t now;
+    uint64_t elapsed;
+
+    if ( state == pConnState->state )
+    {
+        return;
+    }
+
+    now = GetMonotonicMs();
+
+    if ( pConnState->state == CONNSTATE_SLEEPING )
+    {
+        /* the sleep is over */
+        pMetrics->sleepMs += now - pConnState->downAt;
+        pConnState->downAt = now;
+    }
+
+    if ( state == CONNSTATE_CONNECTED )
+    {
+        /* the outage, or the initial connection attempt, is over */
+        elapsed = now - pConnState->downAt;
+        pMetrics->disconnectedMs += elapsed;
+        pMetrics->connects++;
+        pConnState->upAt = now;
+
+        if ( pConnState->resumed )
+        {
+            /* connecting after a sleep does not restore a lost
+               connection */
+            pConnState->resumed = false;
+            pConnState->everConnected = true;
+        }
+        else if ( pConnState->everConnected )
+        {
+            pMetrics->lastReconnectMs = elapsed;
+            pMetrics->totalReconnectMs += elapsed;
+            if ( elapsed > pMetrics->maxReconnectMs )
+            {
+                pMetrics->maxReconnectMs = elapsed;
+            }
+        }
+        else
+        {
+            pMetrics->connectMs = elapsed;
+            pConnState->everConnected = true;
+        }
+    }
+    else if ( pConnState->state == CONNSTATE_CONNECTED )
+    {
+        /* a new outage, or a sleep, starts */
+        pConnState->downAt = now;
+        pMetrics->connectedMs += now - pConnState->upAt;
+        if ( state == CONNSTATE_SLEEPING )
+        {
+            pMetrics->sleeps++;
+        }
+        else
+        {
+            pMetrics->disconnects++;
+        }
+    }
+    else if ( state == CONNSTATE_SLEEPING )
+    {
+        /* the service went to sleep before connecting */
+        pMetrics->disconnectedMs += now - pConnState->downAt;
+        pConnState->downAt = now;
+        pMetrics->sleeps++;
+    }
+
+    if ( state == CONNSTATE_FAILED )
+    {
+        pMetrics->failures++;
+    }
+
+    if ( IOTHUB_VERBOSE( pConnState->verbose ) )
+    {
+        fprintf( stderr,
+                 "iothub: connection %s -> %s (%s)\n",
+                 ConnState_Name( pConnState->state ),
+                 ConnState_Name( state ),
+                 reason != NULL ? reason : "" );
+    }
+
+    pConnState->state = state;
+    pthread_cond_broadcast( &pConnState->cond );
+}
+
+/*============================================================================*/
+/*  IsFatal                                                                   */
+/*!
+    Determine if a connection status reason ends the client's retries
+
+    The client stops retrying when its retry timeout expires, and
+    retrying cannot fix a rejected or disabled device identity.  In
+    these cases the client must be recreated.
+
+    @param[in]
+        reason
+            reason for the status change
+
+    @retval true the client must be recreated
+    @retval false the client will retry by itself
+
+==============================================================================*/
+static bool IsFatal( IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason )
+{
+    switch ( reason )
+    {
+        case IOTHUB_CLIENT_CONNECTION_RETRY_EXPIRED:
+        case IOTHUB_CLIENT_CONNECTION_BAD_CREDENTIAL:
+        case IOTHUB_CLIENT_CONNECTION_DEVICE_DISABLED:
+        case IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*============================================================================*/
+/*  GetMonotonicMs                                                            */
+/*!
+    Get the monotonic clock time in milliseconds
+
+    @retval monotonic time in milliseconds
+
+==============================================================================*/
+static uint64_t GetMonotonicMs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)( ts.tv_nsec / 1000000 );
+}
+
+/*! @}
+ * end of connstate group */
@@ -0,0 +1,637 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+/*!
+ * @defgroup edfqueue edfqueue
+ * @brief Earliest-deadline-first message queue
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file edfqueue.c
+
+    Earliest-deadline-first message queue
+
+    The edfqueue module holds copies of the messages waiting for room
+    in the send window, and releases them in order of their delivery
+    deadlines.  Messages without a deadline are released after all of
+    the messages with one, in arrival order.  Messages with the same
+    deadline are also released in arrival order.
+
+    The queue is a binary min-heap ordered by deadline and then by
+    arrival sequence number, with each message in a single allocation
+    holding the NUL terminated headers followed by the body.  A message
+    whose deadline can no longer be met can be deferred: it loses its
+    deadline and is moved behind the messages already queued.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <varserver/varserver.h>
+#include "trace.h"
+#include "edfqueue.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! initial number of entries in the heap */
+#define EDFQUEUE_INITIAL_SIZE ( 16 )
+
+/*! queued message */
+typedef struct edfEntry
+{
+    /*! delivery deadline of the message, or 0 if it has none */
+    uint64_t deadline;
+
+    /*! arrival sequence number of the message */
+    uint64_t seq;
+
+    /*! process id of the client which sent the message */
+    uint32_t pid;
+
+    /*! message queue priority */
+    uint32_t priority;
+
+    /*! length of the headers, excluding the NUL terminator */
+    size_t headerLength;
+
+    /*! length of the body */
+    size_t bodyLength;
+
+    /*! NUL terminated headers followed by the body */
+    char data[];
+
+} EdfEntry;
+
+/*! earliest-deadline-first message queue */
+struct edfQueue
+{
+    /*! maximum number of queued messages */
+    size_t maxCount;
+
+    /*! min-heap of the queued messages */
+    EdfEntry **heap;
+
+    /*! number of entries allocated for the heap */
+    size_t heapSize;
+
+    /*! sequence number of the next message queued */
+    uint64_t seq;
+
+    /*! queue statistics */
+    EdfQueueStats stats;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static bool Before( EdfEntry *pA, EdfEntry *pB );
+static void SiftUp( EdfQueue *pEdfQueue, size_t i );
+static void SiftDown( EdfQueue *pEdfQueue, size_t i );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  EdfQueue_Create                                                           */
+/*!
+    Create an earliest-deadline-first message queue
+
+    @param[in]
+        maxCount
+            maximum number of queued messages
+
+    @retval pointer to the queue
+    @retval NULL if the queue could not be created
+
+==============================================================================*/
+EdfQueue *EdfQueue_Create( size_t maxCount )
+{
+    EdfQueue *pEdfQueue;
+
+    pEdfQueue = calloc( 1, sizeof( EdfQueue ) );
+    if ( pEdfQueue != NULL )
+    {
+        pEdfQueue->maxCount = maxCount;
+    }
+
+    return pEdfQueue;
+}
+
+/*============================================================================*/
+/*  EdfQueue_Destroy                                                          */
+/*!
+    Destroy a queue and discard its messages
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue to destroy
+
+==============================================================================*/
+void EdfQueue_Destroy( EdfQueue *pEdfQueue )
+{
+    size_t i;
+
+    if ( pEdfQueue != NULL )
+    {
+        for ( i = 0; i < pEdfQueue->stats.count; i++ )
+        {
+            free( pEdfQueue->heap[i] );
+        }
+
+        free( pEdfQueue->heap );
+        free( pEdfQueue );
+    }
+}
+
+/*============================================================================*/
+/*  EdfQueue_Put                                                              */
+/*!
+    Add a copy of a message to the queue
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+    @param[in]
+        pRecord
+            pointer to the message to copy.  The timestamp is ignored.
+
+    @param[in]
+        deadline
+            delivery deadline of the message, or 0 if it has none
+
+    @retval EOK the message was queued
+    @retval EINVAL invalid arguments
+    @retval ENOSPC the queue is full
+    @retval ENOMEM out of memory
+
+==============================================================================*/
+int EdfQueue_Put( EdfQueue *pEdfQueue,
+                  TraceRecord *pRecord,
+                  uint64_t deadline )
+{
+    EdfEntry *pEntry;
+    EdfEntry **heap;
+    size_t size;
+
+    if ( ( pEdfQueue == NULL ) ||
+         ( pRecord == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( EdfQueue_Full( pEdfQueue ) )
+    {
+        return ENOSPC;
+    }
+
+    if ( pEdfQueue->stats.count == pEdfQueue->heapSize )
+    {
+        size = ( pEdfQueue->heapSize > 0 ) ? pEdfQueue->heapSize * 2
+                                           : EDFQUEUE_INITIAL_SIZE;
+        heap = realloc( pEdfQueue->heap, size * sizeof( EdfEntry * ) );
+        if ( heap == NULL )
+        {
+            return ENOMEM;
+        }
+
+        pEdfQueue->heap = heap;
+        pEdfQueue->heapSize = size;
+    }
+
+    pEntry = malloc( sizeof( EdfEntry ) +
+                     pRecord->headerLength + 1 +
+                     pRecord->bodyLength );
+    if ( pEntry == NULL )
+    {
+        return ENOMEM;
+    }
+
+    pEntry->deadline = deadline;
+    pEntry->seq = pEdfQueue->seq++;
+    pEntry->pid = pRecord->pid;
+    pEntry->priority = pRecord->priority;
+    pEntry->headerLength = pRecord->headerLength;
+    pEntry->bodyLength = pRecord->bodyLength;
+    memcpy( pEntry->data, pRecord->headers, pRecord->headerLength );
+    pEntry->data[pRecord->headerLength] = '\0';
+    memcpy( &pEntry->data[pRecord->headerLength + 1],
+            pRecord->body,
+            pRecord->bodyLength );
+
+    pEdfQueue->heap[pEdfQueue->stats.count] = pEntry;
+    SiftUp( pEdfQueue, pEdfQueue->stats.count );
+
+    pEdfQueue->stats.count++;
+    pEdfQueue->stats.bytes += pRecord->headerLength + pRecord->bodyLength;
+    pEdfQueue->stats.queued++;
+    if ( pEdfQueue->stats.count > pEdfQueue->stats.peak )
+    {
+        pEdfQueue->stats.peak = pEdfQueue->stats.count;
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  EdfQueue_Peek                                                             */
+/*!
+    Get the message with the earliest deadline
+
+    The header and body pointers in the record remain valid until the
+    message is removed with EdfQueue_Pop.  The headers are NUL
+    terminated.
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+    @param[out]
+        pRecord
+            pointer to the record to populate
+
+    @param[out]
+        pDeadline
+            pointer to a location to store the deadline of the message,
+            or 0 if it has none
+
+    @retval EOK the message was retrieved
+    @retval EINVAL invalid arguments
+    @retval ENOENT the queue is empty
+
+==============================================================================*/
+int EdfQueue_Peek( EdfQueue *pEdfQueue,
+                   TraceRecord *pRecord,
+                   uint64_t *pDeadline )
+{
+    EdfEntry *pEntry;
+
+    if ( ( pEdfQueue == NULL ) ||
+         ( pRecord == NULL ) ||
+         ( pDeadline == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( pEdfQueue->stats.count == 0 )
+    {
+        return ENOENT;
+    }
+
+    pEntry = pEdfQueue->heap[0];
+
+    pRecord->timestamp = 0;
+    pRecord->pid = pEntry->pid;
+    pRecord->priority = pEntry->priority;
+    pRecord->headers = pEntry->data;
+    pRecord->headerLength = pEntry->headerLength;
+    pRecord->body = &pEntry->data[pEntry->headerLength + 1];
+    pRecord->bodyLength = pEntry->bodyLength;
+    *pDeadline = pEntry->deadline;
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  EdfQueue_Pop                                                              */
+/*!
+    Remove the message with the earliest deadline from the queue
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+==============================================================================*/
+void EdfQueue_Pop( EdfQueue *pEdfQueue )
+{
+    EdfEntry *pEntry;
+
+    if ( ( pEdfQueue != NULL ) &&
+         ( pEdfQueue->stats.count > 0 ) )
+    {
+        pEntry = pEdfQueue->heap[0];
+
+        pEdfQueue->stats.count--;
+        pEdfQueue->stats.bytes -= pEntry->headerLength + pEntry->bodyLength;
+
+        pEdfQueue->heap[0] = pEdfQueue->heap[pEdfQueue->stats.count];
+        SiftDown( pEdfQueue, 0 );
+
+        free( pEntry );
+    }
+}
+
+/*============================================================================*/
+/*  EdfQueue_Defer                                                            */
+/*!
+    Move the message with the earliest deadline behind the others
+
+    The EdfQueue_Defer function removes the deadline of the message
+    with the earliest deadline, and queues it again behind all of the
+    messages already in the queue.
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+==============================================================================*/
+void EdfQueue_Defer( EdfQueue *pEdfQueue )
+{
+    EdfEntry *pEntry;
+
+    if ( ( pEdfQueue != NULL ) &&
+         ( pEdfQueue->stats.count > 0 ) )
+    {
+        pEntry = pEdfQueue->heap[0];
+        pEntry->deadline = 0;
+        pEntry->seq = pEdfQueue->seq++;
+        SiftDown( pEdfQueue, 0 );
+
+        pEdfQueue->stats.deferred++;
+    }
+}
+
+/*============================================================================*/
+/*  EdfQueue_RemoveIf                                                         */
+/*!
+    Remove the messages selected by a match function
+
+    The match function is called for each message in no particular
+    order, and the message is removed if it returns true.  The record
+    passed to the match function is only valid during the call.  The
+    heap is rebuilt from the remaining messages.
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+    @param[in]
+        match
+            function returning true for the messages to remove
+
+    @param[in]
+        arg
+            argument passed to the match function
+
+    @retval number of messages removed
+
+==============================================================================*/
+size_t EdfQueue_RemoveIf( EdfQueue *pEdfQueue,
+                          EdfQueueMatch match,
+                          void *arg )
+{
+    EdfEntry *pEntry;
+    TraceRecord record;
+    size_t count;
+    size_t i;
+    size_t j = 0;
+
+    if ( ( pEdfQueue == NULL ) ||
+         ( match == NULL ) )
+    {
+        return 0;
+    }
+
+    count = pEdfQueue->stats.count;
+    for ( i = 0; i < count; i++ )
+    {
+        pEntry = pEdfQueue->heap[i];
+
+        record.timestamp = 0;
+        record.pid = pEntry->pid;
+        record.priority = pEntry->priority;
+        record.headers = pEntry->data;
+        record.headerLength = pEntry->headerLength;
+        record.body = &pEntry->data[pEntry->headerLength + 1];
+        record.bodyLength = pEntry->bodyLength;
+
+        if ( match( &record, arg ) == true )
+        {
+            pEdfQueue->stats.bytes -= pEntry->headerLength +
+                                      pEntry->bodyLength;
+            free( pEntry );
+        }
+        else
+        {
+            pEdfQueue->heap[j++] = pEntry;
+        }
+    }
+
+    pEdfQueue->stats.count = j;
+
+    for ( i = j / 2; i > 0; i-- )
+    {
+        SiftDown( pEdfQueue, i - 1 );
+    }
+
+    return count - j;
+}
+
+/*============================================================================*/
+/*  EdfQueue_Empty                                                            */
+/*!
+    Determine if the queue is empty
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+    @retval true the queue is empty
+    @retval false the queue holds messages
+
+==============================================================================*/
+bool EdfQueue_Empty( EdfQueue *pEdfQueue )
+{
+    return ( pEdfQueue == NULL ) || ( pEdfQueue->stats.count == 0 );
+}
+
+/*============================================================================*/
+/*  EdfQueue_Full                                                             */
+/*!
+    Determine if the queue is full
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+    @retval true no more messages can be queued
+    @retval false the queue has room for another message
+
+==============================================================================*/
+bool EdfQueue_Full( EdfQueue *pEdfQueue )
+{
+    return ( pEdfQueue == NULL ) ||
+           ( pEdfQueue->stats.count >= pEdfQueue->maxCount );
+}
+
+/*============================================================================*/
+/*  EdfQueue_GetStats                                                         */
+/*!
+    Get the queue statistics
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+    @param[out]
+        pStats
+            pointer to the statistics to populate
+
+==============================================================================*/
+void EdfQueue_GetStats( EdfQueue *pEdfQueue, EdfQueueStats *pStats )
+{
+    if ( pStats != NULL )
+    {
+        if ( pEdfQueue != NULL )
+        {
+            *pStats = pEdfQueue->stats;
+        }
+        else
+        {
+            memset( pStats, 0, sizeof( EdfQueueStats ) );
+        }
+    }
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Before                                                                    */
+/*!
+    Determine if one message is released before another
+
+    @param[in]
+        pA
+            pointer to the first message
+
+    @param[in]
+        pB
+            pointer to the second message
+
+    @retval true the first message is released first
+    @retval false the second message is released first
+
+==============================================================================*/
+static bool Before( EdfEntry *pA, EdfEntry *pB )
+{
+    uint64_t a = ( pA->deadline != 0 ) ? pA->deadline : UINT64_MAX;
+    uint64_t b = ( pB->deadline != 0 ) ? pB->deadline : UINT64_MAX;
+
+    return ( a < b ) || ( ( a == b ) && ( pA->seq < pB->seq ) );
+}
+
+/*============================================================================*/
+/*  SiftUp                                                                    */
+/*!
+    Move a message up the heap to its place
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+    @param[in]
+        i
+            position of the message in the heap
+
+==============================================================================*/
+static void SiftUp( EdfQueue *pEdfQueue, size_t i )
+{
+    EdfEntry *pEntry = pEdfQueue->heap[i];
+    size_t parent;
+
+    while ( i > 0 )
+    {
+        parent = ( i - 1 ) / 2;
+        if ( Before( pEntry, pEdfQueue->heap[parent] ) == false )
+        {
+            break;
+        }
+
+        pEdfQueue->heap[i] = pEdfQueue->heap[parent];
+        i = parent;
+    }
+
+    pEdfQueue->heap[i] = pEntry;
+}
+
+/*============================================================================*/
+/*  SiftDown                                                                  */
+/*!
+    Move a message down the heap to its place
+
+    @param[in]
+        pEdfQueue
+            pointer to the queue
+
+    @param[in]
+        i
+            position of the message in the heap
+
+==============================================================================*/
+static void SiftDown( EdfQueue *pEdfQueue, size_t i )
+{
+    EdfEntry *pEntry = pEdfQueue->heap[i];
+    size_t count = pEdfQueue->stats.count;
+    size_t child;
+
+    while ( ( child = 2 * i + 1 ) < count )
+    {
+        if ( ( child + 1 < count ) &&
+             ( Before( pEdfQueue->heap[child + 1],
+                       pEdfQueue->heap[child] ) == true ) )
+        {
+            child++;
+        }
+
+        if ( Before( pEdfQueue->heap[child], pEntry ) == false )
+        {
+            break;
+        }
+
+        pEdfQueue->heap[i] = pEdfQueue->heap[child];
+        i = child;
+    }
+
+    pEdfQueue->heap[i] = pEntry;
+}
+
+/*! @}
+ * end of edfqueue group */
@@ -0,0 +1,793 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup handoff handoff
+ * @brief Hand the message queue over to a replacement service
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file handoff.c
+
+    Service handoff
+
+    The handoff module lets a new iothub service take over from a
+    running one without the /iothub message queue ever disappearing.
+
+    The running service listens on a Unix domain socket.  The new
+    service connects to it and sends a handoff request.  The running
+    service stops reading the message queue, then replies with a
+    HandoffState message which carries the open message queue
+    descriptor as SCM_RIGHTS ancillary data, followed by the messages
+    it was holding in memory.  It then waits for its outstanding sends
+    to be confirmed, disconnects from the hub, and closes the socket to
+    tell the new service it may connect.
+
+    Buffered messages are sent as a fixed header holding the client
+    pid, the queue priority and the header and body lengths, followed
+    by the header and body contents.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <varserver/varserver.h>
+#include "trace.h"
+#include "outbox.h"
+#include "handoff.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! handoff request sent by the new service */
+#define HANDOFF_REQUEST ( 'H' )
+
+/*! buffered message header on the handoff socket */
+typedef struct handoffRecord
+{
+    /*! process id of the client which sent the message */
+    uint32_t pid;
+
+    /*! message queue priority */
+    uint32_t priority;
+
+    /*! length of the header frame contents */
+    uint32_t headerLength;
+
+    /*! length of the message body */
+    uint32_t bodyLength;
+
+} HandoffRecord;
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static int SetAddress( struct sockaddr_un *pAddr, const char *path );
+static int WaitReadable( int fd, int timeoutMs );
+static int WriteAll( int fd, const void *buf, size_t len );
+static int ReadAll( int fd, void *buf, size_t len );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Handoff_Listen                                                            */
+/*!
+    Listen for handoff requests
+
+    Any socket file left at the path by a service which is no longer
+    running is removed first.
+
+    @param[in]
+        path
+            path of the handoff socket
+
+    @retval listening socket descriptor
+    @retval -1 the socket could not be created (errno is set)
+
+==============================================================================*/
+int Handoff_Listen( const char *path )
+{
+    struct sockaddr_un addr;
+    int fd;
+    int result;
+
+    result = SetAddress( &addr, path );
+    if ( result != EOK )
+    {
+        errno = result;
+        return -1;
+    }
+
+    fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd != -1 )
+    {
+        unlink( path );
+
+        if ( ( bind( fd,
+                     (struct sockaddr *)&addr,
+                     sizeof( addr ) ) != 0 ) ||
+             ( listen( fd, 1 ) != 0 ) )
+        {
+            result = errno;
+            close( fd );
+            fd = -1;
+            errno = result;
+        }
+    }
+
+    return fd;
+}
+
+/*============================================================================*/
+/*  Handoff_Accept                                                            */
+/*!
+    Accept a handoff request
+
+    The Handoff_Accept function waits for a new service to connect to
+    the handoff socket and send a handoff request.  Connections which
+    do not send a valid request within HANDOFF_TIMEOUT_MS are closed.
+
+    @param[in]
+        listenFd
+            listening socket returned by Handoff_Listen
+
+    @retval socket connected to the new service
+    @retval -1 the listening socket failed (errno is set)
+
+==============================================================================*/
+int Handoff_Accept( int listenFd )
+{
+    int fd;
+    char request;
+
+    while ( true )
+    {
+        fd = accept4( listenFd, NULL, NULL, SOCK_CLOEXEC );
+        if ( fd == -1 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        if ( ( WaitReadable( fd, HANDOFF_TIMEOUT_MS ) == EOK ) &&
+             ( ReadAll( fd, &request, sizeof( request ) ) == EOK ) &&
+             ( request == HANDOFF_REQUEST ) )
+        {
+            return fd;
+        }
+
+        close( fd );
+    }
+}
+
+/*============================================================================*/
+/*  Handoff_Request                                                           */
+/*!
+    Request a handoff from the running service
+
+    @param[in]
+        path
+            path of the handoff socket
+
+    @param[out]
+        pFd
+            pointer to store the socket connected to the running service
+
+    @retval EOK the handoff was requested
+    @retval ENOENT no service is listening on the handoff socket
+    @retval ECONNREFUSED no service is listening on the handoff socket
+    @retval other error as returned from socket, connect or write
+
+==============================================================================*/
+int Handoff_Request( const char *path, int *pFd )
+{
+    struct sockaddr_un addr;
+    char request = HANDOFF_REQUEST;
+    int result;
+    int fd;
+
+    if ( pFd == NULL )
+    {
+        return EINVAL;
+    }
+
+    result = SetAddress( &addr, path );
+    if ( result != EOK )
+    {
+        return result;
+    }
+
+    fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 )
+    {
+        return errno;
+    }
+
+    if ( connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) != 0 )
+    {
+        result = errno;
+    }
+    else
+    {
+        result = WriteAll( fd, &request, sizeof( request ) );
+    }
+
+    if ( result == EOK )
+    {
+        *pFd = fd;
+    }
+    else
+    {
+        close( fd );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Handoff_SendState                                                         */
+/*!
+    Send the service state and the message queue descriptor
+
+    @param[in]
+        fd
+            socket connected to the new service
+
+    @param[in]
+        mqfd
+            message queue descriptor to hand over
+
+    @param[in]
+        pState
+            pointer to the state to send
+
+    @retval EOK the state was sent
+    @retval EINVAL invalid arguments
+    @retval other error as returned from sendmsg
+
+==============================================================================*/
+int Handoff_SendState( int fd, int mqfd, const HandoffState *pState )
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        char buf[CMSG_SPACE( sizeof( int ) )];
+        struct cmsghdr align;
+    } control;
+    ssize_t n;
+
+    if ( pState == NULL )
+    {
+        return EINVAL;
+    }
+
+    memset( &msg, 0, sizeof( msg ) );
+    memset( &control, 0, sizeof( control ) );
+
+    iov.iov_base = (void *)pState;
+    iov.iov_len = sizeof( HandoffState );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof( control.buf );
+
+    cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+    memcpy( CMSG_DATA( cmsg ), &mqfd, sizeof( int ) );
+
+    do
+    {
+        n = sendmsg( fd, &msg, MSG_NOSIGNAL );
+    } while ( ( n == -1 ) && ( errno == EINTR ) );
+
+    if ( n == -1 )
+    {
+        return errno;
+    }
+
+    /* the descriptor was sent with the first byte */
+    return ( (size_t)n < sizeof( HandoffState ) )
+           ? WriteAll( fd,
+                       (const char *)pState + n,
+                       sizeof( HandoffState ) - n )
+           : EOK;
+}
+
+/*============================================================================*/
+/*  Handoff_RecvState                                                         */
+/*!
+    Receive the service state and the message queue descriptor
+
+    @param[in]
+        fd
+            socket connected to the running service
+
+    @param[out]
+        pMqfd
+            pointer to store the message queue descriptor
+
+    @param[out]
+        pState
+            pointer to the state to populate
+
+    @retval EOK the state was received
+    @retval EINVAL invalid arguments
+    @retval ETIMEDOUT the running service did not respond in time
+    @retval EPROTO the state or the descriptor is missing or invalid
+    @retval other error as returned from recvmsg
+
+==============================================================================*/
+int Handoff_RecvState( int fd, int *pMqfd, HandoffState *pState )
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        char buf[CMSG_SPACE( sizeof( int ) )];
+        struct cmsghdr align;
+    } control;
+    ssize_t n;
+    int mqfd = -1;
+    int result;
+
+    if ( ( pMqfd == NULL ) ||
+         ( pState == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    result = WaitReadable( fd, HANDOFF_TIMEOUT_MS );
+    if ( result != EOK )
+    {
+        return result;
+    }
+
+    memset( &msg, 0, sizeof( msg ) );
+    iov.iov_base = pState;
+    iov.iov_len = sizeof( HandoffState );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof( control.buf );
+
+    do
+    {
+        n = recvmsg( fd, &msg, MSG_CMSG_CLOEXEC );
+    } while ( ( n == -1 ) && ( errno == EINTR ) );
+
+    if ( n == -1 )
+    {
+        return errno;
+    }
+
+    for ( cmsg = CMSG_FIRSTHDR( &msg );
+          cmsg != NULL;
+          cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+    {
+        if ( ( cmsg->cmsg_level == SOL_SOCKET ) &&
+             ( cmsg->cmsg_type == SCM_RIGHTS ) )
+        {
+            memcpy( &mqfd, CMSG_DATA( cmsg ), sizeof( int ) );
+        }
+    }
+
+    if ( ( n > 0 ) && ( (size_t)n < sizeof( HandoffState ) ) )
+    {
+        result = ReadAll( fd,
+                          (char *)pState + n,
+                          sizeof( HandoffState ) - n );
+    }
+    else if ( n == 0 )
+    {
+        result = EPROTO;
+    }
+
+    if ( ( result == EOK ) &&
+         ( ( mqfd == -1 ) ||
+           ( pState->magic != HANDOFF_MAGIC ) ||
+           ( pState->version != HANDOFF_VERSION ) ) )
+    {
+        result = EPROTO;
+    }
+
+    if ( result == EOK )
+    {
+        *pMqfd = mqfd;
+    }
+    else if ( mqfd != -1 )
+    {
+        close( mqfd );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Handoff_SendRecord                                                        */
+/*!
+    Send a buffered message
+
+    @param[in]
+        fd
+            socket connected to the new service
+
+    @param[in]
+        pRecord
+            pointer to the message to send.  The timestamp is ignored.
+
+    @retval EOK the message was sent
+    @retval EINVAL invalid arguments
+    @retval other error as returned from write
+
+==============================================================================*/
+int Handoff_SendRecord( int fd, const TraceRecord *pRecord )
+{
+    HandoffRecord hdr;
+    int result;
+
+    if ( pRecord == NULL )
+    {
+        return EINVAL;
+    }
+
+    hdr.pid = pRecord->pid;
+    hdr.priority = pRecord->priority;
+    hdr.headerLength = pRecord->headerLength;
+    hdr.bodyLength = pRecord->bodyLength;
+
+    result = WriteAll( fd, &hdr, sizeof( hdr ) );
+    if ( result == EOK )
+    {
+        result = WriteAll( fd, pRecord->headers, pRecord->headerLength );
+    }
+
+    if ( result == EOK )
+    {
+        result = WriteAll( fd, pRecord->body, pRecord->bodyLength );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Handoff_RecvRecord                                                        */
+/*!
+    Receive a buffered message
+
+    The headers and body are stored in a single allocation starting at
+    the headers pointer, which the caller must free.  The headers are
+    NUL terminated.
+
+    @param[in]
+        fd
+            socket connected to the running service
+
+    @param[out]
+        pRecord
+            pointer to the record to populate
+
+    @retval EOK the message was received
+    @retval EINVAL invalid arguments
+    @retval ENOMEM out of memory
+    @retval ETIMEDOUT the running service did not send the message in time
+    @retval EPIPE the running service closed the socket
+    @retval other error as returned from read
+
+==============================================================================*/
+int Handoff_RecvRecord( int fd, TraceRecord *pRecord )
+{
+    HandoffRecord hdr;
+    char *data;
+    int result;
+
+    if ( pRecord == NULL )
+    {
+        return EINVAL;
+    }
+
+    result = WaitReadable( fd, HANDOFF_TIMEOUT_MS );
+    if ( result == EOK )
+    {
+        result = ReadAll( fd, &hdr, sizeof( hdr ) );
+    }
+
+    if ( result != EOK )
+    {
+        return result;
+    }
+
+    data = malloc( hdr.headerLength + 1 + hdr.bodyLength );
+    if ( data == NULL )
+    {
+        return ENOMEM;
+    }
+
+    result = ReadAll( fd, data, hdr.headerLength );
+    if ( result == EOK )
+    {
+        data[hdr.headerLength] = '\0';
+        result = ReadAll( fd, &data[hdr.headerLength + 1], hdr.bodyLength );
+    }
+
+    if ( result == EOK )
+    {
+        memset( pRecord, 0, sizeof( TraceRecord ) );
+        pRecord->pid = hdr.pid;
+        pRecord->priority = hdr.priority;
+        pRecord->headers = data;
+        pRecord->headerLength = hdr.headerLength;
+        pRecord->body = &data[hdr.headerLength + 1];
+        pRecord->bodyLength = hdr.bodyLength;
+    }
+    else
+    {
+        free( data );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Handoff_WaitClosed                                                        */
+/*!
+    Wait for the running service to finish
+
+    The running service closes the handoff socket once its outstanding
+    messages have been confirmed and it has disconnected from the hub.
+
+    @param[in]
+        fd
+            socket connected to the running service
+
+    @param[in]
+        timeoutMs
+            maximum time to wait in milliseconds
+
+    @retval EOK the running service has finished
+    @retval ETIMEDOUT the running service did not finish in time
+
+==============================================================================*/
+int Handoff_WaitClosed( int fd, uint32_t timeoutMs )
+{
+    char buf[64];
+    ssize_t n;
+    int result;
+
+    while ( ( result = WaitReadable( fd, timeoutMs ) ) == EOK )
+    {
+        n = read( fd, buf, sizeof( buf ) );
+        if ( ( n == 0 ) ||
+             ( ( n == -1 ) && ( errno != EINTR ) ) )
+        {
+            break;
+        }
+    }
+
+    return result;
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  SetAddress                                                                */
+/*!
+    Build the address of the handoff socket
+
+    @param[out]
+        pAddr
+            pointer to the address to populate
+
+    @param[in]
+        path
+            path of the handoff socket
+
+    @retval EOK the address was built
+    @retval EINVAL invalid path
+    @retval ENAMETOOLONG the path is too long for a socket address
+
+==============================================================================*/
+static int SetAddress( struct sockaddr_un *pAddr, const char *path )
+{
+    if ( path == NULL )
+    {
+        return EINVAL;
+    }
+
+    if ( strlen( path ) >= sizeof( pAddr->sun_path ) )
+    {
+        return ENAMETOOLONG;
+    }
+
+    memset( pAddr, 0, sizeof( struct sockaddr_un ) );
+    pAddr->sun_family = AF_UNIX;
+    strcpy( pAddr->sun_path, path );
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  WaitReadable                                                              */
+/*!
+    Wait for a socket to become readable
+
+    @param[in]
+        fd
+            socket to wait on
+
+    @param[in]
+        timeoutMs
+            maximum time to wait in milliseconds
+
+    @retval EOK the socket is readable or closed
+    @retval ETIMEDOUT the timeout expired
+    @retval other error as returned from poll
+
+==============================================================================*/
+static int WaitReadable( int fd, int timeoutMs )
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    do
+    {
+        n = poll( &pfd, 1, timeoutMs );
+    } while ( ( n == -1 ) && ( errno == EINTR ) );
+
+    if ( n == -1 )
+    {
+        return errno;
+    }
+
+    return ( n == 0 ) ? ETIMEDOUT : EOK;
+}
+
+/*============================================================================*/
+/*  WriteAll                                                                  */
+/*!
+    Write a buffer to a socket
+
+    @param[in]
+        fd
+            socket to write to
+
+    @param[in]
+        buf
+            pointer to the data to write
+
+    @param[in]
+        len
+            number of bytes to write
+
+    @retval EOK the data was written
+    @retval other error as returned from send
+
+==============================================================================*/
+static int WriteAll( int fd, const void *buf, size_t len )
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while ( len > 0 )
+    {
+        n = send( fd, p, len, MSG_NOSIGNAL );
+        if ( n > 0 )
+        {
+            p += n;
+            len -= n;
+        }
+        else if ( errno != EINTR )
+        {
+            return errno;
+        }
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  ReadAll                                                                   */
+/*!
+    Read a buffer from a socket
+
+    @param[in]
+        fd
+            socket to read from
+
+    @param[out]
+        buf
+            pointer to the buffer to fill
+
+    @param[in]
+        len
+            number of bytes to read
+
+    @retval EOK the buffer was filled
+    @retval EPIPE the socket was closed
+    @retval other error as returned from read
+
+==============================================================================*/
+static int ReadAll( int fd, void *buf, size_t len )
+{
+    char *p = buf;
+    ssize_t n;
+
+    while ( len > 0 )
+    {
+        n = read( fd, p, len );
+        if ( n > 0 )
+        {
+            p += n;
+            len -= n;
+        }
+        else if ( n == 0 )
+        {
+            return EPIPE;
+        }
+        else if ( errno != EINTR )
+        {
+            return errno;
+        }
+    }
+
+    return EOK;
+}
+
+/*! @}
+ * end of handoff group */
@@ -0,0 +1,750 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup ingest ingest
+ * @brief Weighted set of client message queues
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file ingest.c
+
+    Ingest queues
+
+    The ingest module receives client messages from one or more POSIX
+    message queues, for example /iothub for normal traffic, /iothub.hi
+    for alarms and /iothub.bulk for bulk uploads.  Each queue has its
+    own depth, so a flood of messages on one queue cannot fill the
+    queues used by other clients.
+
+    Queues with waiting messages are serviced by smooth weighted round
+    robin: while several queues are busy, each receives a share of the
+    messages in proportion to its weight, interleaved rather than in
+    bursts.  An idle queue gives its share to the busy ones.  The
+    queues are opened non-blocking and are waited on together with
+    poll, since a Linux message queue descriptor is a file descriptor.
+
+    The queue depth and maximum message size are set when a queue is
+    created.  A queue which already exists keeps its geometry.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <varserver/varserver.h>
+#include "ingest.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! file holding the default queue depth */
+#define INGEST_DEPTH_DEFAULT_FILE "/proc/sys/fs/mqueue/msg_default"
+
+/*! file holding the default maximum message size */
+#define INGEST_MSGSIZE_DEFAULT_FILE "/proc/sys/fs/mqueue/msgsize_default"
+
+/*! queue depth used if the system default cannot be read */
+#define INGEST_DEPTH_FALLBACK ( 10 )
+
+/*! message size used if the system default cannot be read */
+#define INGEST_MSGSIZE_FALLBACK ( 8192 )
+
+/*! ingest queue */
+typedef struct ingestQueue
+{
+    /*! name of the message queue */
+    char *name;
+
+    /*! message queue descriptor */
+    mqd_t mq;
+
+    /*! share of the messages received while other queues are busy */
+    uint32_t weight;
+
+    /*! current weight for the smooth weighted round robin */
+    int64_t current;
+
+    /*! true if the queue was found empty during the current receive */
+    bool empty;
+
+    /*! maximum number of messages in the queue */
+    long depth;
+
+    /*! maximum size of a message in the queue */
+    long msgsize;
+
+    /*! total number of messages received from the queue */
+    uint64_t received;
+
+} IngestQueue;
+
+/*! set of ingest queues */
+struct ingest
+{
+    /*! depth of the queues created, or 0 for the system default */
+    long depth;
+
+    /*! message size of the queues created, or 0 for the system default */
+    long msgsize;
+
+    /*! number of queues */
+    size_t count;
+
+    /*! ingest queues */
+    IngestQueue queues[INGEST_MAX_QUEUES];
+
+    /*! poll descriptors for the queues */
+    struct pollfd fds[INGEST_MAX_QUEUES];
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static long ReadDefault( const char *path, long fallback );
+static IngestQueue *Select( Ingest *pIngest );
+static int Wait( Ingest *pIngest, struct timespec *pDeadline );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Ingest_Create                                                             */
+/*!
+    Create an empty set of ingest queues
+
+    If only one of the depth and message size is specified, the other
+    is taken from the system default.
+
+    @param[in]
+        depth
+            maximum number of messages in each queue created,
+            or 0 for the system default
+
+    @param[in]
+        msgsize
+            maximum size of a message in each queue created,
+            or 0 for the system default
+
+    @retval pointer to the ingest queue set
+    @retval NULL if the set could not be created
+
+==============================================================================*/
+Ingest *Ingest_Create( long depth, long msgsize )
+{
+    Ingest *pIngest;
+
+    pIngest = calloc( 1, sizeof( Ingest ) );
+    if ( pIngest != NULL )
+    {
+        if ( ( depth != 0 ) || ( msgsize != 0 ) )
+        {
+            if ( depth == 0 )
+            {
+                depth = ReadDefault( INGEST_DEPTH_DEFAULT_FILE,
+                                     INGEST_DEPTH_FALLBACK );
+            }
+
+            if ( msgsize == 0 )
+            {
+                msgsize = ReadDefault( INGEST_MSGSIZE_DEFAULT_FILE,
+                                       INGEST_MSGSIZE_FALLBACK );
+            }
+        }
+
+        pIngest->depth = depth;
+        pIngest->msgsize = msgsize;
+    }
+
+    return pIngest;
+}
+
+/*============================================================================*/
+/*  Ingest_Destroy                                                            */
+/*!
+    Close the ingest queues
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set, may be NULL
+
+    @param[in]
+        unlink
+            true to remove the queues from the system
+
+==============================================================================*/
+void Ingest_Destroy( Ingest *pIngest, bool unlink )
+{
+    IngestQueue *pQueue;
+    size_t i;
+
+    if ( pIngest != NULL )
+    {
+        for ( i = 0; i < pIngest->count; i++ )
+        {
+            pQueue = &pIngest->queues[i];
+
+            mq_close( pQueue->mq );
+            if ( unlink == true )
+            {
+                mq_unlink( pQueue->name );
+            }
+
+            free( pQueue->name );
+        }
+
+        free( pIngest );
+    }
+}
+
+/*============================================================================*/
+/*  Ingest_Add                                                                */
+/*!
+    Add a message queue to the ingest set
+
+    The named queue is created with the geometry of the ingest set,
+    unless it already exists or an open descriptor is supplied, for
+    example one handed over by another service.  The descriptor is
+    made non-blocking.
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set
+
+    @param[in]
+        name
+            name of the message queue
+
+    @param[in]
+        weight
+            share of the messages received while other queues are busy
+
+    @param[in]
+        mq
+            open message queue descriptor, or -1 to open the queue
+
+    @retval EOK the queue was added
+    @retval EINVAL invalid arguments, or the geometry exceeds the
+            system limits
+    @retval EEXIST the queue is already in the set
+    @retval ENOSPC the set is full
+    @retval ENOMEM out of memory
+    @retval other error as returned from mq_open or mq_getattr
+
+==============================================================================*/
+int Ingest_Add( Ingest *pIngest,
+                const char *name,
+                uint32_t weight,
+                mqd_t mq )
+{
+    int result = EINVAL;
+    IngestQueue *pQueue;
+    struct mq_attr attr;
+    size_t i;
+
+    if ( ( pIngest != NULL ) &&
+         ( name != NULL ) &&
+         ( weight > 0 ) &&
+         ( weight <= INGEST_MAX_WEIGHT ) )
+    {
+        result = EOK;
+        for ( i = 0; i < pIngest->count; i++ )
+        {
+            if ( strcmp( pIngest->queues[i].name, name ) == 0 )
+            {
+                result = EEXIST;
+            }
+        }
+
+        if ( ( result == EOK ) &&
+             ( pIngest->count == INGEST_MAX_QUEUES ) )
+        {
+            result = ENOSPC;
+        }
+
+        if ( ( result == EOK ) &&
+             ( mq == (mqd_t)-1 ) )
+        {
+            memset( &attr, 0, sizeof( attr ) );
+            attr.mq_maxmsg = pIngest->depth;
+            attr.mq_msgsize = pIngest->msgsize;
+
+            mq = mq_open( name,
+                          O_RDONLY | O_CREAT | O_NONBLOCK,
+                          S_IRUSR | S_IWUSR,
+                          ( pIngest->depth != 0 ) ? &attr : NULL );
+            if ( mq == (mqd_t)-1 )
+            {
+                result = errno;
+            }
+        }
+
+        if ( result == EOK )
+        {
+            /* the queues are waited on together with poll */
+            memset( &attr, 0, sizeof( attr ) );
+            attr.mq_flags = O_NONBLOCK;
+            if ( ( mq_setattr( mq, &attr, NULL ) == 0 ) &&
+                 ( mq_getattr( mq, &attr ) == 0 ) )
+            {
+                pQueue = &pIngest->queues[pIngest->count];
+                memset( pQueue, 0, sizeof( IngestQueue ) );
+                pQueue->name = strdup( name );
+                if ( pQueue->name != NULL )
+                {
+                    pQueue->mq = mq;
+                    pQueue->weight = weight;
+                    pQueue->depth = attr.mq_maxmsg;
+                    pQueue->msgsize = attr.mq_msgsize;
+
+                    pIngest->fds[pIngest->count].fd = (int)mq;
+                    pIngest->fds[pIngest->count].events = POLLIN;
+                    pIngest->count++;
+                }
+                else
+                {
+                    result = ENOMEM;
+                }
+            }
+            else
+            {
+                result = errno;
+            }
+
+            if ( result != EOK )
+            {
+                mq_close( mq );
+            }
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Ingest_Receive                                                            */
+/*!
+    Receive a message from the ingest queues
+
+    The Ingest_Receive function receives the next message from the
+    queue selected by weighted round robin among the queues with
+    waiting messages, waiting for a message to arrive on any queue if
+    they are all empty.
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set
+
+    @param[in]
+        buf
+            buffer to receive the message into
+
+    @param[in]
+        len
+            size of the buffer, at least Ingest_MaxMsgSize
+
+    @param[out]
+        pLength
+            length of the received message
+
+    @param[out]
+        pPriority
+            message queue priority of the received message
+
+    @param[in]
+        timeoutMs
+            maximum time to wait for a message in milliseconds
+
+    @retval EOK a message was received
+    @retval EINVAL invalid arguments
+    @retval ETIMEDOUT no message arrived before the timeout
+    @retval other error as returned from mq_receive or poll
+
+==============================================================================*/
+int Ingest_Receive( Ingest *pIngest,
+                    char *buf,
+                    size_t len,
+                    size_t *pLength,
+                    unsigned int *pPriority,
+                    uint32_t timeoutMs )
+{
+    int result = EINVAL;
+    IngestQueue *pQueue;
+    struct timespec deadline;
+    ssize_t n;
+    size_t i;
+
+    if ( ( pIngest != NULL ) &&
+         ( pIngest->count > 0 ) &&
+         ( buf != NULL ) &&
+         ( pLength != NULL ) &&
+         ( pPriority != NULL ) )
+    {
+        clock_gettime( CLOCK_MONOTONIC, &deadline );
+        deadline.tv_sec += timeoutMs / 1000;
+        deadline.tv_nsec += (long)( timeoutMs % 1000 ) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L )
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        result = EAGAIN;
+        while ( result == EAGAIN )
+        {
+            for ( i = 0; i < pIngest->count; i++ )
+            {
+                pIngest->queues[i].empty = false;
+            }
+
+            /* try the busy queues in weighted order */
+            while ( ( result == EAGAIN ) &&
+                    ( ( pQueue = Select( pIngest ) ) != NULL ) )
+            {
+                n = mq_receive( pQueue->mq, buf, len, pPriority );
+                if ( n != -1 )
+                {
+                    *pLength = (size_t)n;
+                    pQueue->received++;
+                    result = EOK;
+                }
+                else if ( errno == EAGAIN )
+                {
+                    /* an idle queue does not build up credit */
+                    pQueue->empty = true;
+                    pQueue->current = 0;
+                }
+                else
+                {
+                    result = errno;
+                }
+            }
+
+            if ( result == EAGAIN )
+            {
+                result = Wait( pIngest, &deadline );
+            }
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Ingest_MaxMsgSize                                                         */
+/*!
+    Get the size of the largest message any ingest queue can hold
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set
+
+    @retval the largest message size in bytes
+
+==============================================================================*/
+size_t Ingest_MaxMsgSize( Ingest *pIngest )
+{
+    size_t msgsize = 0;
+    size_t i;
+
+    if ( pIngest != NULL )
+    {
+        for ( i = 0; i < pIngest->count; i++ )
+        {
+            if ( (size_t)pIngest->queues[i].msgsize > msgsize )
+            {
+                msgsize = pIngest->queues[i].msgsize;
+            }
+        }
+    }
+
+    return msgsize;
+}
+
+/*============================================================================*/
+/*  Ingest_Queue                                                              */
+/*!
+    Get the descriptor of an ingest queue
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set
+
+    @param[in]
+        name
+            name of the message queue
+
+    @retval the message queue descriptor
+    @retval -1 if the queue is not in the set
+
+==============================================================================*/
+mqd_t Ingest_Queue( Ingest *pIngest, const char *name )
+{
+    mqd_t mq = (mqd_t)-1;
+    size_t i;
+
+    if ( ( pIngest != NULL ) &&
+         ( name != NULL ) )
+    {
+        for ( i = 0; i < pIngest->count; i++ )
+        {
+            if ( strcmp( pIngest->queues[i].name, name ) == 0 )
+            {
+                mq = pIngest->queues[i].mq;
+            }
+        }
+    }
+
+    return mq;
+}
+
+/*============================================================================*/
+/*  Ingest_Count                                                              */
+/*!
+    Get the number of ingest queues
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set
+
+    @retval the number of queues
+
+==============================================================================*/
+size_t Ingest_Count( Ingest *pIngest )
+{
+    return ( pIngest != NULL ) ? pIngest->count : 0;
+}
+
+/*============================================================================*/
+/*  Ingest_GetStats                                                           */
+/*!
+    Get the statistics of an ingest queue
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set
+
+    @param[in]
+        idx
+            index of the queue, in the order the queues were added
+
+    @param[out]
+        pStats
+            pointer to the statistics to populate
+
+    @retval EOK the statistics were returned
+    @retval EINVAL invalid arguments
+    @retval ENOENT no queue at the index
+
+==============================================================================*/
+int Ingest_GetStats( Ingest *pIngest, size_t idx, IngestStats *pStats )
+{
+    int result = EINVAL;
+    IngestQueue *pQueue;
+    struct mq_attr attr;
+
+    if ( ( pIngest != NULL ) &&
+         ( pStats != NULL ) )
+    {
+        if ( idx < pIngest->count )
+        {
+            pQueue = &pIngest->queues[idx];
+
+            pStats->name = pQueue->name;
+            pStats->weight = pQueue->weight;
+            pStats->depth = pQueue->depth;
+            pStats->msgsize = pQueue->msgsize;
+            pStats->pending = ( mq_getattr( pQueue->mq, &attr ) == 0 )
+                                ? attr.mq_curmsgs
+                                : 0;
+            pStats->received = pQueue->received;
+            result = EOK;
+        }
+        else
+        {
+            result = ENOENT;
+        }
+    }
+
+    return result;
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  ReadDefault                                                               */
+/*!
+    Read a message queue default from the proc file system
+
+    @param[in]
+        path
+            name of the file holding the default
+
+    @param[in]
+        fallback
+            value to use if the file cannot be read
+
+    @retval the default value
+
+==============================================================================*/
+static long ReadDefault( const char *path, long fallback )
+{
+    FILE *fp;
+    long value = fallback;
+
+    fp = fopen( path, "r" );
+    if ( fp != NULL )
+    {
+        if ( ( fscanf( fp, "%ld", &value ) != 1 ) ||
+             ( value <= 0 ) )
+        {
+            value = fallback;
+        }
+
+        fclose( fp );
+    }
+
+    return value;
+}
+
+/*============================================================================*/
+/*  Select                                                                    */
+/*!
+    Select the next queue to receive from
+
+    The Select function implements smooth weighted round robin over the
+    queues not yet found empty: each queue gains its weight in credit,
+    and the queue with the most credit is selected and pays back the
+    total weight of the candidates.
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set
+
+    @retval pointer to the selected queue
+    @retval NULL if all queues were found empty
+
+==============================================================================*/
+static IngestQueue *Select( Ingest *pIngest )
+{
+    IngestQueue *pBest = NULL;
+    IngestQueue *pQueue;
+    int64_t total = 0;
+    size_t i;
+
+    for ( i = 0; i < pIngest->count; i++ )
+    {
+        pQueue = &pIngest->queues[i];
+        if ( pQueue->empty == false )
+        {
+            pQueue->current += pQueue->weight;
+            total += pQueue->weight;
+
+            if ( ( pBest == NULL ) ||
+                 ( pQueue->current > pBest->current ) )
+            {
+                pBest = pQueue;
+            }
+        }
+    }
+
+    if ( pBest != NULL )
+    {
+        pBest->current -= total;
+    }
+
+    return pBest;
+}
+
+/*============================================================================*/
+/*  Wait                                                                      */
+/*!
+    Wait for a message to arrive on any ingest queue
+
+    @param[in]
+        pIngest
+            pointer to the ingest queue set
+
+    @param[in]
+        pDeadline
+            CLOCK_MONOTONIC time to stop waiting at
+
+    @retval EAGAIN a queue may have a message waiting
+    @retval ETIMEDOUT the deadline has passed
+    @retval other error as returned from poll
+
+==============================================================================*/
+static int Wait( Ingest *pIngest, struct timespec *pDeadline )
+{
+    int result;
+    struct timespec now;
+    int64_t waitMs;
+    int n;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    waitMs = ( pDeadline->tv_sec - now.tv_sec ) * 1000L +
+             ( pDeadline->tv_nsec - now.tv_nsec ) / 1000000L;
+    if ( waitMs > 0 )
+    {
+        n = poll( pIngest->fds, pIngest->count, (int)waitMs );
+        if ( n > 0 )
+        {
+            result = EAGAIN;
+        }
+        else if ( n == 0 )
+        {
+            result = ETIMEDOUT;
+        }
+        else
+        {
+            result = ( errno == EINTR ) ? EAGAIN : errno;
+        }
+    }
+    else
+    {
+        result = ETIMEDOUT;
+    }
+
+    return result;
+}
+
+/*! @}
+ * end of ingest group */
@@ -55,16 +55,49 @@ SOFTWARE.
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <mqueue.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#if defined( __GLIBC__ )
+#include <malloc.h>
+#endif
 #include <varserver/varserver.h>
 #include <openssl/ssl.h>
 #include <azureiot/iothub_client.h>
-#include <azureiot/iothubtransportamqp_websockets.h>
 #include <azure_c_shared_utility/threadapi.h>
 #include <azure_c_shared_utility/crt_abstractions.h>
+#include <azure_c_shared_utility/shared_util_options.h>
+#if defined( IOTHUB_TRANSPORT_AMQP )
 #include <azureiot/iothubtransportamqp.h>
+#elif defined( IOTHUB_TRANSPORT_MQTT )
+#include <azureiot/iothubtransportmqtt.h>
+#elif defined( IOTHUB_TRANSPORT_MQTT_WS )
+#include <azureiot/iothubtransportmqtt_websockets.h>
+#elif defined( IOTHUB_TRANSPORT_HTTP )
 #include <azureiot/iothubtransporthttp.h>
+#else
 #include <azureiot/iothubtransportamqp_websockets.h>
-#include <uuid/uuid.h>
+#endif
+#include "iotmsg.h"
+#include "iotbatch.h"
+#include "simlink.h"
+#include "tlscache.h"
+#include "trace.h"
+#include "backoff.h"
+#include "socktune.h"
+#include "connstate.h"
+#include "outbox.h"
+#include "msgbuf.h"
+#include "edfqueue.h"
+#include "handoff.h"
+#include "ingest.h"
+#include "bodypool.h"
+#include "upload.h"
+#include "footprint.h"
+#include "shed.h"
+#include "pressure.h"
+#include "shaper.h"
 
 
 /*==============================================================================
@@ -77,24 +110,159 @@ SOFTWARE.
 /*! connection string size */
 #define CONNECTION_STRING_SIZE  ( 256 )
 
+/*! transport protocol used to connect to the IOT Hub, selected at
+    compile time so only one transport needs to be linked */
+#if defined( IOTHUB_TRANSPORT_AMQP )
+#define IOTHUB_TRANSPORT_PROTOCOL AMQP_Protocol
+#elif defined( IOTHUB_TRANSPORT_MQTT )
+#define IOTHUB_TRANSPORT_PROTOCOL MQTT_Protocol
+#elif defined( IOTHUB_TRANSPORT_MQTT_WS )
+#define IOTHUB_TRANSPORT_PROTOCOL MQTT_WebSocket_Protocol
+#elif defined( IOTHUB_TRANSPORT_HTTP )
+#define IOTHUB_TRANSPORT_PROTOCOL HTTP_Protocol
+#else
+#define IOTHUB_TRANSPORT_PROTOCOL AMQP_Protocol_over_WebSocketsTls
+#endif
+
 /*! message queue name */
 #define MESSAGE_QUEUE_NAME "/iothub"
 
-/*! maximum message size */
-#define MAX_MESSAGE_SIZE ( 256 * 1024 )
+/*! connection metrics variable name */
+#define METRICS_NAME "/sys/iot/metrics"
+
+/*! interval at which the service checks the connection state and
+    writes the metrics file while idle, in milliseconds */
+#define IOTHUB_POLL_MS ( 1000 )
+
+/*! interval at which the service retries sending spilled messages
+    while the send window is full, in milliseconds */
+#define IOTHUB_DRAIN_POLL_MS ( 10 )
+
+/*! maximum number of spilled messages awaiting confirmation */
+#define IOTHUB_DRAIN_WINDOW ( 64 )
+
+/*! maximum number of messages held in memory, awaiting confirmation or
+    waiting to be sent, while memory is under pressure */
+#define IOTHUB_PRESSURE_WINDOW ( 16 )
+
+/*! maximum number of held messages awaiting confirmation during a
+    duty cycle burst */
+#define IOTHUB_BURST_WINDOW ( 256 )
+
+/*! time the connection is kept open after the last confirmation in
+    duty cycle mode, in milliseconds */
+#define IOTHUB_DUTY_LINGER_MS ( 1000 )
+
+/*! time a cellular radio stays powered after the last transfer, which
+    is added to each connection in the radio-on time estimate, in
+    milliseconds */
+#define IOTHUB_RADIO_TAIL_MS ( 5000 )
+
+/*! time allowed for the replacement client to connect when the
+    connection string changes, in milliseconds */
+#define IOTHUB_RELOAD_CONNECT_MS ( 30000 )
+
+/*! time allowed for the replaced client to confirm its messages before
+    it is destroyed, in milliseconds */
+#define IOTHUB_RELOAD_DRAIN_MS ( 30000 )
+
+/*! time allowed for the service to confirm its messages after handing
+    the message queue over to a replacement service, in milliseconds */
+#define IOTHUB_HANDOFF_DRAIN_MS ( 30000 )
+
+/*! maximum number of file uploads in progress */
+#define IOTHUB_MAX_UPLOADS ( 2 )
+
+/*! space for the properties added to the headers of each chunk of a
+    streamed message body, in bytes */
+#define IOTHUB_CHUNK_HEADER_SIZE ( 256 )
+
+/*! space for the expiry property added to the headers of a message
+    with a time to live, in bytes */
+#define IOTHUB_EXPIRY_HEADER_SIZE ( 32 )
+
+/*! space for the deadline time property added to the headers of a
+    message with a delivery deadline, in bytes */
+#define IOTHUB_DEADLINE_HEADER_SIZE ( 40 )
+
+/*! maximum number of parallel connections */
+#define IOTHUB_MAX_CONNECTIONS ( 8 )
+
+struct hubGroup;
+
+/*! one of a group of parallel connections */
+typedef struct hubLane
+{
+    /*! pointer to the group of connections */
+    struct hubGroup *pGroup;
+
+    /*! bit of the connection in the authenticated mask */
+    uint32_t bit;
+
+} HubLane;
+
+/*! connection status of a group of parallel connections.  The group
+    is reported connected while all of its connections are
+    authenticated, and disconnected when any of them is not. */
+typedef struct hubGroup
+{
+    /*! mutex serializing the status notifications */
+    pthread_mutex_t mutex;
+
+    /*! connection status callback of the group, or NULL */
+    IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK callback;
+
+    /*! connection status callback context */
+    void *context;
+
+    /*! mask of the authenticated connections */
+    uint32_t up;
+
+    /*! mask of all the connections */
+    uint32_t all;
+
+    /*! status context of each connection */
+    HubLane lanes[IOTHUB_MAX_CONNECTIONS];
+
+} HubGroup;
+
+/*! connection to the IOT Hub or the local hub stand-in */
+typedef struct hubClient
+{
+    /*! number of parallel connections */
+    size_t count;
+
+    /*! IOT Hub Client Handle of each connection */
+    IOTHUB_CLIENT_HANDLE iotHubClientHandle[IOTHUB_MAX_CONNECTIONS];
+
+    /*! link to the local hub stand-in of each connection */
+    SimLink *pSimLink[IOTHUB_MAX_CONNECTIONS];
+
+    /*! combined status of parallel connections, or NULL for a single
+        connection */
+    HubGroup *pGroup;
+
+} HubClient;
 
-/*! Array of message properties for the current message */
-typedef struct msgProp
+/*! message counts of one of the parallel connections */
+typedef struct hubLaneStats
 {
-    /* pointer to the property name */
-    const char *pKey;
+    /*! number of messages sent */
+    uint32_t sent;
 
-    /* pointer to the property value */
-    const char *pValue;
+    /*! number of messages confirmed */
+    uint32_t ok;
 
-    /* pointer to the next property in the list */
-    struct msgProp *pNext;
-} MsgProp;
+    /*! number of messages which failed */
+    uint32_t err;
+
+    /*! number of messages awaiting confirmation */
+    uint32_t inFlight;
+
+    /*! total size of the confirmed messages in bytes */
+    uint64_t bytes;
+
+} HubLaneStats;
 
 /*! IOTHub state */
 typedef struct iothubState
@@ -112,14 +280,61 @@ typedef struct iothubState
     /*! pointer to the source of the current message */
     const char *pMsgSource;
 
-    /*! message queue descriptor */
+    /*! message queue handed over by the previous service, or -1 */
     mqd_t messageQueue;
 
+    /*! names of the ingest queues, starting with the /iothub queue */
+    const char *queueNames[INGEST_MAX_QUEUES];
+
+    /*! weights of the ingest queues */
+    uint32_t queueWeights[INGEST_MAX_QUEUES];
+
+    /*! number of ingest queues */
+    size_t queueCount;
+
+    /*! depth of the ingest queues, or 0 for the system default */
+    long queueDepth;
+
+    /*! maximum message size of the ingest queues, or 0 for the system
+        default */
+    long queueMsgSize;
+
+    /*! client message queues */
+    Ingest *pIngest;
+
     /*! pointer to the received message headers */
     unsigned char *rxHeaders;
 
-    /*! pointer to the received message body */
-    unsigned char *rxBody;
+    /*! pool of buffers to receive message bodies into */
+    BodyPool *pBodyPool;
+
+    /*! maximum size of a message body in bytes */
+    size_t bodyMax;
+
+    /*! limit on the free body buffers kept by each size class in bytes */
+    size_t bodyCache;
+
+    /*! size of the chunks larger bodies are streamed in, or 0 to
+        truncate bodies at the maximum body size */
+    size_t chunkSize;
+
+    /*! size of the blocks files are uploaded in */
+    size_t uploadBlockSize;
+
+    /*! number of file uploads in progress, protected by metricsMutex */
+    uint32_t uploadsActive;
+
+    /*! number of file uploads requested, protected by metricsMutex */
+    uint32_t countUploads;
+
+    /*! number of file uploads completed, protected by metricsMutex */
+    uint32_t countUploadsOK;
+
+    /*! number of file uploads failed, protected by metricsMutex */
+    uint32_t countUploadsErr;
+
+    /*! number of bytes uploaded, protected by metricsMutex */
+    uint64_t uploadBytes;
 
     /*! maximum length of a received message */
     size_t messageLength;
@@ -127,8 +342,151 @@ typedef struct iothubState
     /*! connection string */
     char connectionString[CONNECTION_STRING_SIZE];
 
-    /*! IOT Hub Client Handle */
-    IOTHUB_CLIENT_HANDLE iotHubClientHandle;
+    /*! connection strings of the identities of the additional
+        parallel connections */
+    const char *identities[IOTHUB_MAX_CONNECTIONS - 1];
+
+    /*! number of additional identities */
+    size_t identityCount;
+
+    /*! number of parallel connections */
+    size_t connectionCount;
+
+    /*! header holding the stream key which assigns messages to the
+        parallel connections, or NULL to assign them by client */
+    const char *streamKey;
+
+    /*! message counts of each connection, protected by the in-flight
+        mutex */
+    HubLaneStats laneStats[IOTHUB_MAX_CONNECTIONS];
+
+    /*! handle to the connection string variable */
+    VAR_HANDLE hConnectionString;
+
+    /*! true if the connection string has been modified */
+    bool reloadRequested;
+
+    /*! client used to send new messages */
+    HubClient client;
+
+    /*! address of the local hub stand-in to use instead of the IOT Hub */
+    const char *simAddress;
+
+    /*! name of the file to capture received messages to */
+    const char *traceFile;
+
+    /*! capture trace of the received messages */
+    Trace *pTrace;
+
+    /*! name of the trusted CA certificate file */
+    const char *caFile;
+
+    /*! name of the file to persist the TLS session to */
+    const char *sessionFile;
+
+    /*! TLS context cache holding the trust store and session */
+    TlsCache *pTlsCache;
+
+    /*! reconnect backoff policy */
+    Backoff backoff;
+
+    /*! socket options of the uplink connection */
+    SockTune sockTune;
+
+    /*! time the hub client retries a lost connection before giving up,
+        in seconds, or 0 to retry forever */
+    size_t retryTimeout;
+
+    /*! connection state machine */
+    ConnState *pConnState;
+
+    /*! name of the directory to spill messages to while disconnected */
+    const char *outboxDir;
+
+    /*! limit on the disk space used by the outbox, in bytes */
+    uint64_t outboxLimit;
+
+    /*! disk outbox for messages received while disconnected */
+    Outbox *pOutbox;
+
+    /*! true if ingest is paused because the outbox is full */
+    bool outboxFull;
+
+    /*! maximum number of messages to buffer while not connected */
+    size_t bufferCount;
+
+    /*! maximum size of the messages to buffer while not connected */
+    size_t bufferBytes;
+
+    /*! in-memory buffer for messages received while not connected */
+    MsgBuffer *pBuffer;
+
+    /*! mutex protecting the hub client and the reload request */
+    pthread_mutex_t clientMutex;
+
+    /*! mutex protecting the in-flight message counts */
+    pthread_mutex_t inFlightMutex;
+
+    /*! signalled when the replaced client has confirmed its messages */
+    pthread_cond_t inFlightCond;
+
+    /*! generation of the client used to send new messages */
+    uint32_t clientGeneration;
+
+    /*! number of messages awaiting confirmation from the current client */
+    uint32_t clientInFlight;
+
+    /*! number of messages awaiting confirmation from the replaced client */
+    uint32_t retiredInFlight;
+
+    /*! number of times the client was replaced after the connection
+        string changed */
+    uint32_t countReloads;
+
+    /*! path of the socket used to hand over to a replacement service */
+    const char *handoffPath;
+
+    /*! socket listening for handoff requests, or -1 */
+    int handoffListenFd;
+
+    /*! socket connected to the replacement service which requested a
+        handoff, or -1.  Protected by the client mutex. */
+    int handoffFd;
+
+    /*! socket connected to the service which handed over to this one
+        until it has finished, or -1 */
+    int predecessorFd;
+
+    /*! true once the message queue has been handed over */
+    bool handedOff;
+
+    /*! name of the file to write the connection metrics to */
+    const char *metricsFile;
+
+    /*! time the metrics file was last written, in microseconds */
+    uint64_t metricsTime;
+
+    /*! handle to the connection metrics variable */
+    VAR_HANDLE hMetrics;
+
+    /*! mutex protecting the statistics snapshots and the counters
+        reported in the metrics */
+    pthread_mutex_t metricsMutex;
+
+    /*! outbox statistics snapshot for the metrics */
+    OutboxStats outboxStats;
+
+    /*! message buffer statistics snapshot for the metrics */
+    MsgBufferStats bufferStats;
+
+    /*! ingest queue statistics snapshot for the metrics */
+    IngestStats queueStats[INGEST_MAX_QUEUES];
+
+    /*! number of ingest queues in the statistics snapshot */
+    size_t queueStatsCount;
+
+    /*! body buffer pool statistics snapshot for the metrics */
+    BodyPoolStats bodyStats;
 
     /* count the number of message transmission attempts */
     uint32_t countTxTotal;
@@ -139,6 +497,108 @@ typedef struct iothubState
     /*! count the number of transmission errors */
     uint32_t countTxErr;
 
+    /*! count the number of message bodies streamed in chunks */
+    uint32_t countStreams;
+
+    /*! count the number of chunks streamed */
+    uint32_t countChunks;
+
+    /*! count the number of message bodies truncated */
+    uint32_t countTruncated;
+
+    /*! count the number of batch frames received */
+    uint32_t countBatches;
+
+    /*! count the number of messages received in batch frames */
+    uint32_t countBatched;
+
+    /*! count the number of batched messages dropped for want of a
+        receive buffer */
+    uint32_t countBatchDropped;
+
+    /*! count the number of messages discarded after their expiry time */
+    uint32_t countExpired;
+
+    /*! messages waiting for the send window in deadline order, or NULL
+        if deadline scheduling is not enabled */
+    EdfQueue *pEdf;
+
+    /*! maximum number of messages waiting in deadline order */
+    size_t edfCount;
+
+    /*! deadline queue statistics */
+    EdfQueueStats edfStats;
+
+    /*! count the number of messages confirmed by their deadline */
+    uint32_t countDeadlineHit;
+
+    /*! count the number of messages not confirmed by their deadline */
+    uint32_t countDeadlineMissed;
+
+    /*! load shedding policy, or NULL if none was given.  Protected by
+        the metrics mutex. */
+    Shed *pShed;
+
+    /*! smoothed time from sending a message to its confirmation, in
+        microseconds */
+    uint64_t confirmWaitUs;
+
+    /*! total size of the confirmed messages as sent, in bytes */
+    uint64_t confirmedBytes;
+
+    /*! uplink bandwidth shaper, or NULL if none was given.  Protected
+        by the metrics mutex. */
+    Shaper *pShaper;
+
+    /*! memory pressure monitor, or NULL if memory is not monitored */
+    Pressure *pPressure;
+
+    /*! stall time in a window which signals memory pressure, in
+        milliseconds, or 0 to not monitor memory */
+    uint32_t pressureStallMs;
+
+    /*! memory pressure window in milliseconds */
+    uint32_t pressureWindowMs;
+
+    /*! memory pressure statistics snapshot for the metrics */
+    PressureStats pressureStats;
+
+    /*! count the number of held messages spilled to the outbox under
+        memory pressure */
+    uint32_t countPressureSpilled;
+
+    /*! interval between scheduled connections in duty cycle mode, in
+        milliseconds, or 0 to stay connected */
+    uint32_t dutyIntervalMs;
+
+    /*! size of the held messages which wakes the connection in duty
+        cycle mode in bytes, or 0 */
+    uint64_t dutyBacklogBytes;
+
+    /*! monotonic time of the next scheduled connection in
+        milliseconds */
+    uint64_t dutyWakeAt;
+
+    /*! monotonic time the connection became idle in milliseconds, or 0
+        while it is busy */
+    uint64_t dutyIdleAt;
+
+    /*! true if an urgent message is waiting for the connection */
+    bool dutyUrgent;
+
+    /*! true while the connection thread waits for a sleeping
+        connection to be resumed.  Protected by the client mutex. */
+    bool connectionIdle;
+
+    /*! count the connections woken by the schedule */
+    uint32_t countWakeSchedule;
+
+    /*! count the connections woken by the backlog */
+    uint32_t countWakeBacklog;
+
+    /*! count the connections woken by an urgent message */
+    uint32_t countWakeUrgent;
+
 } IOTHubState;
 
 /*! The MsgContext structure returned as an argument
@@ -151,8 +611,40 @@ typedef struct msgContext
     /*! pointer to the IOTHubState object */
     IOTHubState *pState;
 
+    /*! generation of the client the message was sent on */
+    uint32_t generation;
+
+    /*! parallel connection the message was sent on */
+    size_t lane;
+
+    /*! delivery deadline in milliseconds since the epoch, or 0 */
+    uint64_t deadline;
+
+    /*! time the message was sent in microseconds */
+    uint64_t sent;
+
+    /*! size of the message as sent in bytes */
+    size_t bytes;
+
 } MsgContext;
 
+/*! held messages replaced by a newer message with the same key */
+typedef struct shedMatch
+{
+    /*! pointer to the IOTHubState object */
+    IOTHubState *pState;
+
+    /*! name of the key header */
+    const char *key;
+
+    /*! value of the key header of the newer message */
+    const char *value;
+
+    /*! length of the key value */
+    size_t length;
+
+} ShedMatch;
+
 /*==============================================================================
         Private file scoped variables
 ==============================================================================*/
@@ -166,54 +658,186 @@ IOTHubState state;
 
 void main(int argc, char **argv);
 static int ProcessOptions( int argC, char *argV[], IOTHubState *pState );
+static void ApplyLimits( IOTHubState *pState );
 static void usage( char *cmdname );
 static void SetupTerminationHandler( void );
 static void TerminationHandler( int signum, siginfo_t *info, void *ptr );
 static int Connect( IOTHubState *pState );
+static int CreateClient( IOTHubState *pState, HubClient *pClient );
+static int CreateConnection( IOTHubState *pState,
+                             const char *connectionString,
+                             IOTHUB_CLIENT_HANDLE *pHandle,
+                             SimLink **ppSimLink );
+static void SetKeepalive( IOTHubState *pState,
+                          IOTHUB_CLIENT_HANDLE iotHubClientHandle );
+static void SetStatusCallback(
+                    HubClient *pClient,
+                    IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK callback,
+                    void *userContextCallback );
+static void LaneStatusCallback(
+                    IOTHUB_CLIENT_CONNECTION_STATUS status,
+                    IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason,
+                    void *userContextCallback );
+static void DestroyClient( HubClient *pClient );
+static void Disconnect( IOTHubState *pState );
+static int ReplaceClient( IOTHubState *pState );
+static int StartConnection( IOTHubState *pState );
+static void *ConnectThread( void *arg );
+static int StartThread( void *(*start)( void * ), void *arg );
+static uint64_t GetTimeUs( void );
+static uint64_t GetEpochMs( void );
 static int LoadSettings( IOTHubState *pState );
-static int ProcessMessage( IOTHubState *pState );
+static int ReloadSettings( IOTHubState *pState );
+static void RequestReload( IOTHubState *pState );
+static int ProcessMessage( IOTHubState *pState, uint32_t timeoutMs );
 static int ProcessMessages( IOTHubState *pState);
+static int ProcessBatch( IOTHubState *pState,
+                         uint32_t pid,
+                         unsigned int priority,
+                         uint32_t count );
+static int ReadBatchBody( IOTHubState *pState,
+                          int fd,
+                          size_t bodyLength,
+                          char **body,
+                          size_t *len );
+static size_t PrepareHeaders( IOTHubState *pState,
+                              char *headers,
+                              size_t length );
+static int SubmitMessage( IOTHubState *pState,
+                          uint32_t pid,
+                          unsigned int priority,
+                          char *headers,
+                          size_t headerLength,
+                          char *body,
+                          size_t len );
+static int CaptureMessage( IOTHubState *pState,
+                           uint32_t pid,
+                           unsigned int priority,
+                           char *headers,
+                           size_t headerLength,
+                           char *body,
+                           size_t len );
+static int ForwardMessage( IOTHubState *pState,
+                           uint32_t pid,
+                           unsigned int priority,
+                           char *headers,
+                           size_t headerLength,
+                           char *body,
+                           size_t len );
 static int GetBody( IOTHubState *pState,
                     uint32_t pid,
+                    int *pFd,
                     char **body,
                     size_t *len );
+static int ReadBody( IOTHubState *pState,
+                     int fd,
+                     size_t limit,
+                     char **body,
+                     size_t *len );
+static int StreamBody( IOTHubState *pState,
+                       int fd,
+                       uint32_t pid,
+                       unsigned int priority,
+                       char *headers,
+                       char *body,
+                       size_t len );
+static int ReadAll( int fd, void *buf, size_t len );
+static int SkipAll( int fd, size_t len );
+static void DiscardFifo( int fd );
+static size_t ChunkHeaders( char *buf,
+                            size_t size,
+                            char *headers,
+                            const char *streamId,
+                            uint32_t seq,
+                            uint32_t count );
+static const char *FindHeader( const char *headers,
+                               const char *key,
+                               size_t *len );
+static void WaitChunkWindow( IOTHubState *pState );
+static size_t AddExpiry( char *headers, size_t length, size_t size );
+static size_t AddDeadline( char *headers, size_t length, size_t size );
+static size_t AppendHeader( char *headers,
+                            size_t size,
+                            const char *key,
+                            unsigned long long value );
+static uint64_t GetDeadline( const char *headers );
+static int RunSchedule( IOTHubState *pState );
+static uint64_t GetExpiry( const char *headers );
+static bool Expired( IOTHubState *pState, const char *headers );
+static void ExpireBacklog( IOTHubState *pState );
+static bool ShedMessage( IOTHubState *pState,
+                         uint32_t pid,
+                         unsigned int priority,
+                         const char *headers,
+                         size_t len );
+static bool Supersede( const TraceRecord *pRecord, void *arg );
+static void UpdateShedding( IOTHubState *pState );
+static int WriteShedMetrics( IOTHubState *pState, int fd );
+static int WriteJsonString( int fd, const char *s );
+static bool Shaped( IOTHubState *pState, unsigned int priority );
+static bool LinkShaped( IOTHubState *pState );
+static void UpdateShaping( IOTHubState *pState );
+static int WriteShaperMetrics( IOTHubState *pState, int fd );
+static int WriteConnectionMetrics( IOTHubState *pState,
+                                   int fd,
+                                   uint64_t connectedMs );
+static int StartUpload( IOTHubState *pState,
+                        uint32_t pid,
+                        const char *headers );
+static void UploadDone( void *arg, int result, uint64_t bytes );
+static int DispatchMessage( IOTHubState *pState,
+                            uint32_t pid,
+                            unsigned int priority,
+                            char *headers,
+                            size_t headerLength,
+                            char *body,
+                            size_t len );
+static int SpillMessage( IOTHubState *pState, TraceRecord *pRecord );
+static int DrainBacklog( IOTHubState *pState );
+static bool IngestPaused( IOTHubState *pState, ConnStateId connState );
+static uint32_t InFlight( IOTHubState *pState );
+static uint32_t SendWindow( IOTHubState *pState );
+static size_t HeldInMemory( IOTHubState *pState );
+static void UpdatePressure( IOTHubState *pState );
+static uint64_t BacklogBytes( IOTHubState *pState );
+static void UpdateDutyCycle( IOTHubState *pState, ConnStateId connState );
+static size_t SpillHeld( IOTHubState *pState );
 
 static int SendMessage( IOTHubState *pState,
+                         uint32_t pid,
+                         unsigned int priority,
                          char *headers,
                          char *body,
                          size_t len );
 
 static void SendCallback( IOTHUB_CLIENT_CONFIRMATION_RESULT result,
                           void* userContextCallback);
+static void ReleaseInFlight( IOTHubState *pState, uint32_t generation );
+static uint32_t SelectConnection( IOTHubState *pState,
+                                  uint32_t pid,
+                                  const char *headers );
 
-static int BuildMessageProperties( MsgProp **ppProp, char *header );
-static void ClearMessageProperties( MsgProp *pProp );
-static int SetMessageProperties( IOTHUB_MESSAGE_HANDLE messageHandle,
-                                 MsgProp *pMsgProp );
-static int SetMessageProperty( IOTHUB_MESSAGE_HANDLE messageHandle,
-                               MAP_HANDLE propMap,
-                               const char *pKey,
-                               const char *pValue );
-static MsgProp **AddMessageProperty( MsgProp **ppProp,
-                                     const char *pKey,
-                                     const char *pValue );
 static int SetupMessageQueue( IOTHubState *pState );
 static void DestroyMessageQueue( IOTHubState *pState );
 
+static int SetupNotifications( IOTHubState *pState );
+static void *VarThread( void *arg );
+static void UpdateMetrics( IOTHubState *pState );
+static int WriteMetrics( IOTHubState *pState, int fd );
+static int WriteMetricsFile( IOTHubState *pState );
+
 static IOTHUBMESSAGE_DISPOSITION_RESULT RxMsgHandler(
                                             IOTHUB_MESSAGE_HANDLE msg,
                                             void *userContext );
 
 static mqd_t GetService( const char *service, size_t *len );
 
-static char *SerializeMsg( IOTHUB_MESSAGE_HANDLE msg,
-                           size_t maxlen,
-                           size_t *totalLength );
-
-static size_t AddProperty( char **p,
-                           const char *key,
-                           const char *value,
-                           size_t *left );
+static int RequestHandoff( IOTHubState *pState, HandoffState *pHandoff );
+static int ReceiveHeldMessages( IOTHubState *pState,
+                                HandoffState *pHandoff );
+static int StartHandoff( IOTHubState *pState );
+static void *HandoffThread( void *arg );
+static int HandOver( IOTHubState *pState, int fd );
 
 /*==============================================================================
         Private function definitions
@@ -241,46 +865,178 @@ static size_t AddProperty( char **p,
 void main(int argc, char **argv)
 {
     int result;
+    pthread_condattr_t condattr;
+    HandoffState handoff;
 
     /* clear the iothub state object */
     memset( &state, 0, sizeof( state ) );
+    pthread_mutex_init( &state.metricsMutex, NULL );
+    pthread_mutex_init( &state.clientMutex, NULL );
+    pthread_mutex_init( &state.inFlightMutex, NULL );
+    pthread_condattr_init( &condattr );
+    pthread_condattr_setclock( &condattr, CLOCK_MONOTONIC );
+    pthread_cond_init( &state.inFlightCond, &condattr );
+    pthread_condattr_destroy( &condattr );
+    Backoff_Init( &state.backoff,
+                  BACKOFF_DEFAULT_MIN_MS,
+                  BACKOFF_DEFAULT_MAX_MS,
+                  BACKOFF_DEFAULT_JITTER );
+    SockTune_Init( &state.sockTune );
+    state.outboxLimit = OUTBOX_DEFAULT_LIMIT;
+    state.bufferCount = MSGBUF_DEFAULT_COUNT;
+    state.bufferBytes = MSGBUF_DEFAULT_BYTES;
+    state.bodyMax = BODYPOOL_DEFAULT_MAX;
+    state.bodyCache = BODYPOOL_DEFAULT_CACHE;
+    state.pressureWindowMs = PRESSURE_DEFAULT_WINDOW_MS;
+    state.uploadBlockSize = UPLOAD_DEFAULT_BLOCK_SIZE;
+    state.messageQueue = (mqd_t)-1;
+    state.queueNames[0] = MESSAGE_QUEUE_NAME;
+    state.queueWeights[0] = INGEST_DEFAULT_WEIGHT;
+    state.queueCount = 1;
+    state.handoffListenFd = -1;
+    state.handoffFd = -1;
+    state.predecessorFd = -1;
+    memset( &handoff, 0, sizeof( handoff ) );
+
+    /* set up an abnormal termination handler */
+    SetupTerminationHandler();
+
+    /* get a handle to the VAR server */
+    state.hVarServer = VARSERVER_Open();
+
+    /* load the IOTHUB settings */
+    LoadSettings( &state );
+
+    /* process the command line options */
+    ProcessOptions( argc, argv, &state );
+
+    /* keep within the memory limits of the build */
+    ApplyLimits( &state );
+
+    /* track the connection state */
+    state.pConnState = ConnState_Create( &state.backoff, state.verbose );
+
+    /* export the connection metrics and watch the connection string
+       before any threads are started */
+    SetupNotifications( &state );
+
+    /* take over the message queue from a running service */
+    if ( state.handoffPath != NULL )
+    {
+        RequestHandoff( &state, &handoff );
+    }
+
+    /* open the disk outbox */
+    if ( state.outboxDir != NULL )
+    {
+        state.pOutbox = Outbox_Create( state.outboxDir,
+                                       state.outboxLimit );
+        if ( state.pOutbox == NULL )
+        {
+            fprintf( stderr,
+                     "iothub: cannot open outbox %s: %s\n",
+                     state.outboxDir,
+                     strerror( errno ) );
+        }
 
-    /* allocate memory for the message body */
-    state.rxBody = calloc( 1, MAX_MESSAGE_SIZE );
-    if ( state.rxBody != NULL )
+        /* continue reading where the previous service stopped */
+        Outbox_Seek( state.pOutbox, &handoff.outbox );
+    }
+
+    /* buffer messages in memory until connected, with room for the
+       messages held by the previous service */
+    state.pBuffer = MsgBuffer_Create(
+                        ( handoff.bufferCount > state.bufferCount )
+                            ? handoff.bufferCount
+                            : state.bufferCount,
+                        ( handoff.bufferBytes > state.bufferBytes )
+                            ? handoff.bufferBytes
+                            : state.bufferBytes );
+
+    /* receive the messages held by the previous service */
+    ReceiveHeldMessages( &state, &handoff );
+
+    /* schedule messages by deadline while the send window is full */
+    if ( state.edfCount > 0 )
     {
-        /* set up an abnormal termination handler */
-        SetupTerminationHandler();
+        state.pEdf = EdfQueue_Create( state.edfCount );
+    }
 
-        /* get a handle to the VAR server */
-        state.hVarServer = VARSERVER_Open();
+    /* give memory back when the system is short of it */
+    if ( state.pressureStallMs > 0 )
+    {
+        state.pPressure = Pressure_Create( state.pressureStallMs,
+                                           state.pressureWindowMs );
+        if ( state.pPressure == NULL )
+        {
+            fprintf( stderr,
+                     "iothub: cannot monitor memory pressure: %s\n",
+                     strerror( errno ) );
+        }
+    }
 
-        /* load the IOTHUB settings */
-        LoadSettings( &state );
+    /* start capturing received messages */
+    if ( state.traceFile != NULL )
+    {
+        state.pTrace = Trace_Create( state.traceFile );
+        if ( state.pTrace == NULL )
+        {
+            fprintf( stderr,
+                     "iothub: cannot create trace %s: %s\n",
+                     state.traceFile,
+                     strerror( errno ) );
+        }
+    }
 
-        /* process the command line options */
-        ProcessOptions( argc, argv, &state );
+    /* set up the message queue */
+    SetupMessageQueue( &state );
 
-        /* connect to the IOT Hub */
-        Connect( &state );
+    /* accept handoff requests from the next service */
+    if ( state.handoffPath != NULL )
+    {
+        StartHandoff( &state );
+    }
 
-        /* set up the message queue */
-        SetupMessageQueue( &state );
+    /* in duty cycle mode, hold messages until the first connection
+       is due */
+    if ( state.dutyIntervalMs > 0 )
+    {
+        state.dutyWakeAt = GetTimeUs() / 1000 + state.dutyIntervalMs;
+        ConnState_Sleep( state.pConnState );
+    }
 
-        /* Process received messages */
-        ProcessMessages( &state );
+    /* connect to the IOT Hub while messages are being accepted */
+    StartConnection( &state );
 
-        /* normally the service will not terminate,
-           so we should not get here */
-        if( state.hVarServer != NULL )
-        {
-            /* close the variable server */
-            VARSERVER_Close( state.hVarServer );
-        }
+    /* Process received messages */
+    ProcessMessages( &state );
 
-        /* destroy the message queue */
-        DestroyMessageQueue( &state );
+    /* normally the service will not terminate, so we only get here
+       after handing over to a replacement service */
+    if( state.hVarServer != NULL )
+    {
+        /* close the variable server */
+        VARSERVER_Close( state.hVarServer );
     }
+
+    /* destroy the message queue */
+    DestroyMessageQueue( &state );
+
+    /* flush the capture trace */
+    Trace_Close( state.pTrace );
+
+    /* keep unsent messages on disk for the next run */
+    Outbox_Destroy( state.pOutbox );
+
+    /* discard the buffered messages */
+    MsgBuffer_Destroy( state.pBuffer );
+    EdfQueue_Destroy( state.pEdf );
+    Shed_Destroy( state.pShed );
+    Shaper_Destroy( state.pShaper );
+    Pressure_Destroy( state.pPressure );
+
+    /* free the message property list */
+    FreeMessageProperties( &state.pMsgProperties );
 }
 
 /*============================================================================*/
@@ -316,85 +1072,47 @@ static int LoadSettings( IOTHubState *pState )
 }
 
 /*============================================================================*/
-/*  Connect                                                                   */
+/*  ReloadSettings                                                            */
 /*!
-    Connect to the IOTHUB
+    Reload the IOTHUB settings
 
-    The Connect function creates connection to the IOTHUB using the
-    connection string specified in the IOTHUBState object.
+    The ReloadSettings function reads the connection string from
+    variable storage again, and keeps it if it has changed.
 
 @param[in]
     pState
-        pointer to the IOTHubState which will contain the newly created message
-        queue
+        pointer to the IOTHubState context
 
-@retval EOK a connection to the IOTHUB was successfully established
-@retval EINVAL invalid arguments
-@retval ENOENT connection to the IOTHUB failed
-@retval EBADF no connection string specified
-@retval ENOTSUP cannot set message callback handler
+@retval EOK the connection string has changed
+@retval EALREADY the connection string has not changed
+@retval other error as returned by VAR_GetStrByName
 
 ==============================================================================*/
-static int Connect( IOTHubState *pState )
+static int ReloadSettings( IOTHubState *pState )
 {
-    int result = EINVAL;
-    IOTHUB_CLIENT_TRANSPORT_PROVIDER transport;
-    IOTHUB_CLIENT_HANDLE iotHubClientHandle;
-    IOTHUB_CLIENT_RESULT icr;
+    int result;
+    char connectionString[CONNECTION_STRING_SIZE];
 
-    if ( pState != NULL )
+    result = VAR_GetStrByName( pState->hVarServer,
+                               CONNECTION_STRING_NAME,
+                               connectionString,
+                               CONNECTION_STRING_SIZE );
+    if ( result == EOK )
     {
-        if( pState->connectionString != NULL )
+        if ( strcmp( connectionString, pState->connectionString ) != 0 )
         {
-            /* initialize the SSL library */
-            SSL_library_init();
-
-            /* select the transport protocol */
-            transport = AMQP_Protocol_over_WebSocketsTls;
-
-            /* create the connection */
-            iotHubClientHandle = IoTHubClient_CreateFromConnectionString(
-                                                    pState->connectionString,
-                                                    transport);
-
-            /* save the IOTHUB client handle */
-            pState->iotHubClientHandle = iotHubClientHandle;
-
-            if ( iotHubClientHandle != NULL )
-            {
-                IoTHubClient_SetOption( iotHubClientHandle,
-                                        "logtrace",
-                                        &(pState->verbose) );
-
-                /* set up the receive message handler */
-                icr = IoTHubClient_SetMessageCallback( iotHubClientHandle,
-                                                       RxMsgHandler,
-                                                       pState );
-                if( icr == IOTHUB_CLIENT_OK )
-                {
-                    if( pState->verbose )
-                    {
-                        fprintf(stdout, "Connected\n");
-                    }
+            memcpy( pState->connectionString,
+                    connectionString,
+                    CONNECTION_STRING_SIZE );
 
-                    result = EOK;
-                }
-                else
-                {
-                    /* cannot set message callback */
-                    result = ENOTSUP;
-                }
-            }
-            else
+            if ( IOTHUB_VERBOSE( pState->verbose ) )
             {
-                /* cannot create IOTHub client */
-                result = ENOENT;
+                fprintf( stdout, "Connection string changed\n" );
             }
         }
         else
         {
-            /* no connection string */
-            result = EBADF;
+            result = EALREADY;
         }
     }
 
@@ -402,63 +1120,67 @@ static int Connect( IOTHubState *pState )
 }
 
 /*============================================================================*/
-/*  SetupMessageQueue                                                         */
+/*  RequestReload                                                             */
+/*!
+    Request a reload of the IOTHUB settings
+
+    The RequestReload function is called when the connection string
+    variable is modified.  The connection thread is woken to reload it.
+
+@param[in]
+    pState
+        pointer to the IOTHubState context
+
+==============================================================================*/
+static void RequestReload( IOTHubState *pState )
+{
+    pthread_mutex_lock( &pState->clientMutex );
+    pState->reloadRequested = true;
+    pthread_mutex_unlock( &pState->clientMutex );
+
+    ConnState_Wake( pState->pConnState );
+}
+
+/*============================================================================*/
+/*  Connect                                                                   */
 /*!
-    Set up the message queue
+    Connect to the IOTHUB
 
-    The SetupMessageQueue function creates a new IOTHUB message queue
-    which will receive messages from clients to send to an external IOTHUB
+    The Connect function creates a connection to the IOTHUB using the
+    connection string specified in the IOTHUBState object, and makes it
+    the client used to send messages.
 
-    This function will create a readonly message queue, and a receive buffer.
+    Connection status changes are reported to the connection state
+    machine.  The SDK client retries lost connections using exponential
+    backoff with jitter for up to the retry timeout, while the hub
+    stand-in link retries forever using the configured backoff policy.
 
 @param[in]
     pState
-        pointer to the IOTHubState which will contain the newly created message
-        queue
+        pointer to the IOTHubState which will contain the new connection
 
-@retval EOK the message queue was successfully created
-@retval EINVAL invalid arguments
-@retval ENOMEM failed to create the receive message buffer
-@retval other error as returned from mq_open
+@retval EOK a connection to the IOTHUB was successfully established
+@retval other error as returned from CreateClient
 
 ==============================================================================*/
-static int SetupMessageQueue( IOTHubState *pState )
+static int Connect( IOTHubState *pState )
 {
     int result = EINVAL;
-    struct mq_attr attr;
+    HubClient client;
 
     if ( pState != NULL )
     {
-        /* initialize the message queue length */
-        pState->messageLength = 0;
-
-        /* create the IOTHub message queue */
-        pState->messageQueue = mq_open( MESSAGE_QUEUE_NAME,
-                                        O_RDONLY | O_CREAT,
-                                        S_IRUSR | S_IWUSR,
-                                        NULL );
-        if ( pState->messageQueue != (mqd_t)-1 )
-        {
-            /* get the attributes */
-            if ( mq_getattr(pState->messageQueue, &attr) != -1 )
-            {
-                pState->rxHeaders = calloc(1, attr.mq_msgsize + 1);
-                if ( pState->rxHeaders != NULL )
-                {
-                    /* set the maximum size of received messages */
-                    pState->messageLength = attr.mq_msgsize;
-                    result = EOK;
-                }
-                else
-                {
-                    result = ENOMEM;
-                }
-            }
-        }
-        else
+        result = CreateClient( pState, &client );
+        if ( result == EOK )
         {
-            result = errno;
-            fprintf(stderr, "%s\n", strerror(result));
+            /* publish the client before its status is reported */
+            pthread_mutex_lock( &pState->clientMutex );
+            pState->client = client;
+            pthread_mutex_unlock( &pState->clientMutex );
+
+            SetStatusCallback( &client,
+                               ConnState_StatusCallback,
+                               pState->pConnState );
         }
     }
 
@@ -466,138 +1188,153 @@ static int SetupMessageQueue( IOTHubState *pState )
 }
 
 /*============================================================================*/
-/*  ProcessMessages                                                           */
+/*  CreateClient                                                              */
 /*!
-    Wait for and process IOTHUB messages
+    Create a hub client
 
-    The ProcessMessages function waits for messages received on the IOTHUB
-    message queue and processes each of them as they arrive.
+    The CreateClient function creates a hub client using the connection
+    string specified in the IOTHUBState object.  If a hub stand-in
+    address was specified, a link to the local hub stand-in is created
+    instead.
+
+    With parallel connections, the first IOT Hub connection uses the
+    connection string and each further connection uses its own
+    additional identity, while each link to the hub stand-in is a
+    separate connection.  The connections are reported as one, which
+    is connected while all of them are authenticated.
+
+    If a trusted CA certificate file was specified, it is read and
+    parsed once into the TLS context cache.  The SDK client is given
+    the trusted certificates from memory, and the hub stand-in link is
+    run over TLS using the cached trust store and session ticket.  The
+    time spent in each phase of the connection is reported in verbose
+    mode.
+
+    The connection status callback is not set.
 
 @param[in]
     pState
-        pointer to the IOTHubState which contains the IOTHUB message queue
-        to wait on.
+        pointer to the IOTHubState object
+
+@param[out]
+    pClient
+        pointer to the HubClient to create
 
+@retval EOK the client was created
 @retval EINVAL invalid arguments
-@retval other error as returned from ProcessMessage
+@retval ENOMEM cannot track the status of the parallel connections
+@retval other error as returned from CreateConnection
 
 ==============================================================================*/
-static int ProcessMessages( IOTHubState *pState)
+static int CreateClient( IOTHubState *pState, HubClient *pClient )
 {
     int result = EINVAL;
+    SimLinkTimings timings;
+    uint64_t t0;
+    uint64_t t1;
+    size_t count;
+    size_t i;
 
-    if ( pState != NULL )
+    if ( ( pState != NULL ) &&
+         ( pClient != NULL ) )
     {
-        while( true )
+        memset( pClient, 0, sizeof( HubClient ) );
+
+        count = ( pState->connectionCount > 0 ) ? pState->connectionCount
+                                                : 1;
+
+        /* load the trust store once */
+        t0 = GetTimeUs();
+        if ( ( pState->caFile != NULL ) &&
+             ( pState->pTlsCache == NULL ) )
         {
-            /* wait for and process a message from the IOTHUB queue */
-            result = ProcessMessage(pState);
-            if( result != EOK )
+            pState->pTlsCache = TlsCache_Create( pState->caFile,
+                                                 pState->sessionFile );
+            if ( ( pState->sockTune.ktls ) &&
+                 ( pState->pTlsCache != NULL ) &&
+                 ( TlsCache_SetKtls( pState->pTlsCache, true ) == false ) )
             {
                 fprintf( stderr,
-                         "iothub: ProcessMessage: %s\n",
-                         strerror( result ) );
+                         "iothub: kernel TLS is not supported, "
+                         "using user space TLS\n" );
             }
         }
-    }
-
-    return result;
-}
-
-/*============================================================================*/
-/*  ProcessMessage                                                            */
-/*!
-    Wait for and process an IOTHUB message
-
-    The ProcessMessage function waits for a single message on the IOTHUB
-    message queue and processes it when it arrives.
-
-@param[in]
-    pState
-        pointer to the IOTHubState which contains the IOTHUB message queue
-        to wait on.
-
-@retval EOK a message was successfully received from the queue and processed
-@retval EINVAL invalid arguments
-@retval other error as returned from mq_receive
+        t1 = GetTimeUs();
 
-==============================================================================*/
-static int ProcessMessage( IOTHubState *pState )
-{
-    int result = EINVAL;
-    mqd_t mq;
-    char *p;
-    size_t len;
-    unsigned int priority;
-    ssize_t n;
-    uint32_t pid;
-    const char *preamble = "IOTC";
-    char *headers;
-    char *body;
-
-    if ( pState != NULL )
-    {
-        mq = pState->messageQueue;
-        p = pState->rxHeaders;
-        len = pState->messageLength;
+        if ( pState->simAddress == NULL )
+        {
+            /* initialize the SSL library */
+            SSL_library_init();
+        }
 
-        /* wait for a message to arrive */
-        n = mq_receive(mq, p, len, &priority);
-        if ( n != -1 )
+        result = EOK;
+        for ( i = 0; ( result == EOK ) && ( i < count ); i++ )
         {
-            /* NUL terminate the message */
-            p[n] = '\0';
+            result = CreateConnection( pState,
+                                       ( i == 0 ) ? pState->connectionString
+                                                  : pState->identities[i - 1],
+                                       &pClient->iotHubClientHandle[i],
+                                       &pClient->pSimLink[i] );
+            pClient->count = i + 1;
+        }
 
-            /* validate the preamble */
-            if( memcmp( p, preamble, 4 ) == 0 )
+        if ( ( result == EOK ) &&
+             ( count > 1 ) )
+        {
+            pClient->pGroup = calloc( 1, sizeof( HubGroup ) );
+            if ( pClient->pGroup != NULL )
             {
-                /* get the client PID */
-                memcpy( &pid, &p[4], 4 );
-
-                /* get the headers */
-                headers = &p[8];
-
-                /* dump the message headers */
-                if ( pState->verbose )
-                {
-                    fprintf(stdout, "headers:\n%s", headers);
-                }
-
-                /* get the message body */
-                result = GetBody( pState, pid, &body, &len );
-                if ( result == EOK )
-                {
-                    /* dump the message body */
-                    if( pState->verbose )
-                    {
-                        fprintf(stdout, "body:\n%.*s\n", (int)len, body);
-                    }
-
-                    /* queue the message for delivery */
-                    result = SendMessage( pState, headers, body, len );
-                    if( result != EOK )
-                    {
-                        fprintf( stderr,
-                                 "ProcessMessage: SendMessage: %s\n",
-                                 strerror( result ) );
-                    }
-                }
-                else
+                pthread_mutex_init( &pClient->pGroup->mutex, NULL );
+                pClient->pGroup->all = ( 1U << count ) - 1;
+                for ( i = 0; i < count; i++ )
                 {
-                    fprintf( stderr,
-                             "ProcessMessage: Cannot get body: %s\n",
-                             strerror( result ) );
+                    pClient->pGroup->lanes[i].pGroup = pClient->pGroup;
+                    pClient->pGroup->lanes[i].bit = 1U << i;
                 }
             }
             else
             {
-                fprintf(stderr, "ProcessMesssage: invalid preamble\n");
+                result = ENOMEM;
             }
         }
-        else
+
+        if ( result != EOK )
         {
-            fprintf(stderr, "ProcessMessage: %s", strerror(errno));
-            result = errno;
+            DestroyClient( pClient );
+        }
+        else if ( IOTHUB_VERBOSE( pState->verbose ) )
+        {
+            if ( pClient->pSimLink[0] != NULL )
+            {
+                SimLink_GetTimings( pClient->pSimLink[0], &timings );
+                fprintf( stdout,
+                         "Connected to %s (trust store %.1f, "
+                         "resolve %.1f, connect %.1f, "
+                         "tls %.1f ms%s%s%s)",
+                         pState->simAddress,
+                         ( t1 - t0 ) / 1000.0,
+                         timings.resolveUs / 1000.0,
+                         timings.connectUs / 1000.0,
+                         timings.handshakeUs / 1000.0,
+                         timings.resumed ? ", resumed" : "",
+                         timings.ktlsTx ? ", ktls tx" : "",
+                         timings.ktlsRx ? ", ktls rx" : "" );
+            }
+            else
+            {
+                fprintf( stdout,
+                         "Connected (trust store %.1f, "
+                         "client %.1f ms)",
+                         ( t1 - t0 ) / 1000.0,
+                         ( GetTimeUs() - t1 ) / 1000.0 );
+            }
+
+            if ( count > 1 )
+            {
+                fprintf( stdout, " with %zu connections", count );
+            }
+
+            fprintf( stdout, "\n" );
         }
     }
 
@@ -605,830 +1342,5698 @@ static int ProcessMessage( IOTHubState *pState )
 }
 
 /*============================================================================*/
-/*  GetBody                                                                   */
+/*  CreateConnection                                                          */
 /*!
-    Get the message body from the client application
+    Create one connection of a hub client
 
-    The GetBody function tries to read the message body from the client
-    application which sent the message headers to the IOT message queue.
-    It does this by reading the client's IOT FIFO.
-
-    Body sizes up to 256KB are supported
+    The CreateConnection function creates a link to the local hub
+    stand-in if a stand-in address was specified, or else an IOT Hub
+    client using the specified connection string.
 
 @param[in]
     pState
-        pointer to the IOTHubState object which provides the message
-        reception buffer
+        pointer to the IOTHubState object
 
 @param[in]
-    pid
-        process id of the client application used to construct the FIFO name
+    connectionString
+        connection string of the identity to connect as
 
 @param[out]
-    body
-        pointer to a location to store the pointer to the received msg body
+    pHandle
+        pointer to a location to store the IOT Hub client handle
 
 @param[out]
-    len
-        pointer to a location to store the received body length
+    ppSimLink
+        pointer to a location to store the hub stand-in link
 
-@retval EOK a message body was successfully retrieved
-@retval EINVAL invalid arguments
-@retval ENOMEM no valid receive buffer is available
-@retval other error as returned from mq_receive
+@retval EOK the connection was created
+@retval ENOENT the client or link could not be created
+@retval ENOTSUP cannot set the message callback
+@retval EBADF no connection string
 
 ==============================================================================*/
-static int GetBody( IOTHubState *pState,
-                    uint32_t pid,
-                    char **body,
-                    size_t *len )
+static int CreateConnection( IOTHubState *pState,
+                             const char *connectionString,
+                             IOTHUB_CLIENT_HANDLE *pHandle,
+                             SimLink **ppSimLink )
 {
-    size_t totalBytes = 0;
-    size_t bytesLeft;
-    int fd;
-    char fifoName[64];
-    int n;
-    char *rxBuf;
-    int result = EINVAL;
-    size_t chunkSize = BUFSIZ;
-    char *p;
+    int result;
+    IOTHUB_CLIENT_TRANSPORT_PROVIDER transport;
+    IOTHUB_CLIENT_HANDLE iotHubClientHandle;
+    IOTHUB_CLIENT_RESULT icr;
+    const char *trustedCerts;
 
-    if ( ( pState != NULL ) &&
-         ( body != NULL ) &&
-         ( len != NULL ) )
+    if ( pState->simAddress != NULL )
     {
-        /* get a pointer to the receive buffer */
-        rxBuf = pState->rxBody;
-        if ( rxBuf != NULL )
+        /* connect to the local hub stand-in */
+        *ppSimLink = SimLink_Create( pState->simAddress,
+                                     pState->pTlsCache,
+                                     &pState->sockTune,
+                                     pState->verbose );
+        if ( *ppSimLink != NULL )
+        {
+            SimLink_SetRetryPolicy( *ppSimLink, &pState->backoff );
+            result = EOK;
+        }
+        else
         {
-            /* construct the FIFO to read the message body from */
-            sprintf(fifoName, "/tmp/iothub_%d", pid );
+            result = ENOENT;
+        }
+    }
+    else if( connectionString != NULL )
+    {
+        /* select the transport protocol */
+        transport = IOTHUB_TRANSPORT_PROTOCOL;
 
-            /* open the FIFO */
-            fd = open( fifoName, O_RDONLY );
-            if ( fd != -1 )
+        /* create the connection */
+        iotHubClientHandle = IoTHubClient_CreateFromConnectionString(
+                                                    connectionString,
+                                                    transport);
+        if ( iotHubClientHandle != NULL )
+        {
+            IoTHubClient_SetOption( iotHubClientHandle,
+                                    "logtrace",
+                                    &(pState->verbose) );
+
+            /* spread out reconnects across the fleet */
+            IoTHubClient_SetRetryPolicy(
+                        iotHubClientHandle,
+                        IOTHUB_CLIENT_RETRY_EXPONENTIAL_BACKOFF_WITH_JITTER,
+                        pState->retryTimeout );
+
+            /* use the trust store from memory */
+            trustedCerts = TlsCache_GetTrustedCerts( pState->pTlsCache );
+            if ( trustedCerts != NULL )
             {
-                /* intialize buffer position */
-                p = rxBuf;
-                bytesLeft = MAX_MESSAGE_SIZE;
-
-                do
-                {
-                    /* try to read a chunk of data */
-                    n = read(fd, p, (bytesLeft < BUFSIZ)
-                                    ? bytesLeft
-                                    : BUFSIZ);
-                    if ( n >= 0 )
-                    {
-                        /* advance the buffer pointer */
-                        p += n;
-
-                        /* update the received bytes */
-                        totalBytes += n;
-
-                        /* update the bytes left */
-                        bytesLeft -= n;
-                    }
-                    else
-                    {
-                        result = errno;
-                    }
-                } while ( ( n > 0 ) && ( totalBytes < MAX_MESSAGE_SIZE ));
+                IoTHubClient_SetOption( iotHubClientHandle,
+                                        OPTION_TRUSTED_CERT,
+                                        trustedCerts );
+            }
 
-                /* close the FIFO */
-                close( fd );
+            /* the SDK socket layer only exposes the keepalive
+               settings of the socket options */
+            SetKeepalive( pState, iotHubClientHandle );
 
-                if ( ( n == 0 ) || ( totalBytes == MAX_MESSAGE_SIZE ) )
-                {
-                    /* read completed without error */
-                    *body = rxBuf;
-                    *len = totalBytes;
-                    result = EOK;
-                }
+            /* set up the receive message handler */
+            icr = IoTHubClient_SetMessageCallback( iotHubClientHandle,
+                                                   RxMsgHandler,
+                                                   pState );
+            if( icr == IOTHUB_CLIENT_OK )
+            {
+                *pHandle = iotHubClientHandle;
+                result = EOK;
             }
             else
             {
-                result = errno;
+                /* cannot set message callback */
+                IoTHubClient_Destroy( iotHubClientHandle );
+                result = ENOTSUP;
             }
         }
         else
         {
-            result = ENOMEM;
+            /* cannot create IOTHub client */
+            result = ENOENT;
         }
     }
+    else
+    {
+        /* no connection string */
+        result = EBADF;
+    }
 
     return result;
 }
 
 /*============================================================================*/
-/*  BuildMessageProperties                                                    */
+/*  SetKeepalive                                                              */
 /*!
-    Build the list of message properties from the specified message header
-
-    The BuildMessageProperties function extracts the message properties
-    from the specified message header.  The properties are expected to
-    be one per line, with the property name and value separated by
-    a colon.  Each line must be separated by a linefeed '\n', and
-    the final property must be terminated with two linefeeds: "\n\n"
-
-    eg
+    Pass the TCP keepalive settings to the IOT Hub client
 
-    property-1:value-1\n
-    property-2:value-2\n
-    ...
-    property-last:value-last\n
-    \n
-
-    The function stores extracted properties into the specified property
-    list, automatically extending the list if its length is exceeded.
-    There is currently no enforced maximum property list length.
+    The SDK socket layer applies the keepalive options to its socket.
+    The other socket options and kernel TLS only apply to the local
+    hub stand-in link.
 
     @param[in]
-        ppProp
-            pointer to a pointer to the message property list.
+        pState
+            pointer to the iothub state
 
     @param[in]
-        header
-            pointer to a NUL terminated string containing the property list
-            as described above
-
-    @retval EOK the property list was populated successfully
-    @retval ENOMEM unable to allocate memory for the property list
-    @retval EINVAL invalid arguments
+        iotHubClientHandle
+            handle to the IOT Hub client
 
 ==============================================================================*/
-static int BuildMessageProperties( MsgProp **ppProp, char *header )
+static void SetKeepalive( IOTHubState *pState,
+                          IOTHUB_CLIENT_HANDLE iotHubClientHandle )
 {
-    int result = EINVAL;
-    const char *pKey;
-    const char *pValue;
-    char *p;
-    const char *pStart;
-    bool done = false;
-    int propertyCount = 0;
-    int state = 0;
-    char c;
-    int rc;
+    int enable = 1;
+    int idle;
+    int interval;
 
-    if ( ( ppProp != NULL ) &&
-         ( header != NULL ) )
+    if ( pState->sockTune.keepIdle != 0 )
     {
-        /* clear out any previous message properties */
-        ClearMessageProperties( *ppProp );
+        idle = (int)pState->sockTune.keepIdle;
+        interval = (int)pState->sockTune.keepInterval;
+
+        IoTHubClient_SetOption( iotHubClientHandle,
+                                "tcp_keepalive",
+                                &enable );
+        IoTHubClient_SetOption( iotHubClientHandle,
+                                "tcp_keepalive_time",
+                                &idle );
+        if ( interval != 0 )
+        {
+            IoTHubClient_SetOption( iotHubClientHandle,
+                                    "tcp_keepalive_interval",
+                                    &interval );
+        }
+    }
+}
 
-        /* initial conditions */
-        p = header;
-        pStart = header;
+/*============================================================================*/
+/*  SetStatusCallback                                                         */
+/*!
+    Set the connection status callback of a hub client
 
-        while( !done && ( ppProp != NULL ) )
-        {
-            c = *p;
+@param[in]
+    pClient
+        pointer to the HubClient
 
-            switch( state )
-            {
-                case 0:
-                default:
-                    /* looking for key */
-                    if ( c == ':' )
-                    {
-                        *p = '\0';
-                        pKey = pStart;
-                        pStart = p+1;
-                        state = 1;
-                    }
-                    else if ( ( c == '\n' ) || ( c == 0 ) )
-                    {
-                        done = true;
-                    }
-                    break;
+@param[in]
+    callback
+        connection status callback, or NULL to remove it
 
-                case 1:
-                    /* looking for value */
-                    if ( ( c == '\n' ) || ( c == 0 ) )
-                    {
-                        pValue = pStart;
+@param[in]
+    userContextCallback
+        context passed to the callback
 
-                        if ( c == 0 )
-                        {
-                            done = true;
-                        }
-                        else
-                        {
-                            *p = '\0';
-                            pStart = p+1;
-                            state = 0;
-                        }
+==============================================================================*/
+static void SetStatusCallback(
+                    HubClient *pClient,
+                    IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK callback,
+                    void *userContextCallback )
+{
+    HubGroup *pGroup = pClient->pGroup;
+    size_t i;
 
-                        /* add message property */
-                        ppProp = AddMessageProperty( ppProp, pKey, pValue );
-                    }
-                    break;
-            }
+    if ( pGroup != NULL )
+    {
+        /* the connections report to the group, which reports their
+           combined status */
+        pthread_mutex_lock( &pGroup->mutex );
+        pGroup->callback = callback;
+        pGroup->context = userContextCallback;
+        pthread_mutex_unlock( &pGroup->mutex );
+
+        callback = ( callback != NULL ) ? LaneStatusCallback : NULL;
+    }
 
-            p++;
+    for ( i = 0; i < pClient->count; i++ )
+    {
+        if ( pGroup != NULL )
+        {
+            userContextCallback = &pGroup->lanes[i];
         }
 
-        /* check for memory allocation failure */
-        result = (ppProp != NULL ) ? EOK : ENOMEM;
+        if ( pClient->pSimLink[i] != NULL )
+        {
+            SimLink_SetConnectionStatusCallback( pClient->pSimLink[i],
+                                                 callback,
+                                                 userContextCallback );
+        }
+        else if ( pClient->iotHubClientHandle[i] != NULL )
+        {
+            IoTHubClient_SetConnectionStatusCallback(
+                                            pClient->iotHubClientHandle[i],
+                                            callback,
+                                            userContextCallback );
+        }
     }
-
-    return result;
 }
 
 /*============================================================================*/
-/*  AddMessageProperty                                                        */
+/*  LaneStatusCallback                                                        */
 /*!
-    Add a message property to the list of IOTHub message properties
-
-    The AddMessageProperty function adds a new message property
-    specified by the property key and value to the specified
-    MsgProp list.  The MsgProp argument points to the pointer to
-    the next MsgProp object to be populated.  If the "next" MsgProp
-    pointer is NULL, then a new MsgProp object is allocated on the
-    heap, populated, and appended at the location specifed by
-    the ppProp argument.
+    Combine the connection status of parallel connections
 
-    @param[in]
-        ppProp
-            pointer to a pointer to the next MsgProp object to
-            be populated.  If the next MsgProp object is NULL,
-            it will be allocated.
+    The LaneStatusCallback function receives the status of one of a
+    group of parallel connections.  The group is reported authenticated
+    once all of its connections are, and every loss of a connection is
+    reported as the loss of the group, so no stream is moved to another
+    connection while its own is down.
 
-    @param[in]
-        pKey
-            pointer to a NUL terminated string containing the
-            property name
+@param[in]
+    status
+        connection status of the connection
 
-    @param[in]
-        pValue
-            pointer to a NUL terminated string containing the
-            property value
+@param[in]
+    reason
+        reason for the status change
 
-    @retval pointer to the pointer to the next MsgProp object to be populated
-    @retval NULL invalid arguments or memory allocation failure
+@param[in]
+    userContextCallback
+        pointer to the HubLane of the connection
 
 ==============================================================================*/
-static MsgProp **AddMessageProperty( MsgProp **ppProp,
-                                     const char *pKey,
-                                     const char *pValue )
+static void LaneStatusCallback( IOTHUB_CLIENT_CONNECTION_STATUS status,
+                                IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason,
+                                void *userContextCallback )
 {
-    MsgProp **result = NULL;
+    HubLane *pLane = (HubLane *)userContextCallback;
+    HubGroup *pGroup;
+    uint32_t up;
 
-    if ( ( ppProp != NULL ) &&
-         ( pKey != NULL ) &&
-         ( pValue != NULL ) )
+    if ( pLane != NULL )
     {
-        if( *ppProp == NULL )
-        {
-            /* allocate memory for a new message property */
-            *ppProp = malloc( sizeof( MsgProp ) );
-            if ( *ppProp != NULL )
-            {
-                /* create a new MsgProp object */
-                (*ppProp)->pKey = pKey;
-                (*ppProp)->pValue = pValue;
-                (*ppProp)->pNext = NULL;
+        pGroup = pLane->pGroup;
 
-                /* return a pointer to the pNext field of the new property */
-                result = &((*ppProp)->pNext);
-            }
+        pthread_mutex_lock( &pGroup->mutex );
+
+        up = pGroup->up;
+        if ( status == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED )
+        {
+            pGroup->up |= pLane->bit;
         }
         else
         {
-            /* fill an existing MsgProp object */
-            (*ppProp)->pKey = pKey;
-            (*ppProp)->pValue = pValue;
+            pGroup->up &= ~pLane->bit;
+        }
 
-            /* return a pointer to the pNext field of the new property */
-            result = &((*ppProp)->pNext);
+        if ( pGroup->callback != NULL )
+        {
+            if ( status != IOTHUB_CLIENT_CONNECTION_AUTHENTICATED )
+            {
+                pGroup->callback( status, reason, pGroup->context );
+            }
+            else if ( ( pGroup->up == pGroup->all ) &&
+                      ( up != pGroup->all ) )
+            {
+                pGroup->callback( status, reason, pGroup->context );
+            }
         }
-    }
 
-    return result;
+        pthread_mutex_unlock( &pGroup->mutex );
+    }
 }
 
 /*============================================================================*/
-/*  ClearMessageProperties                                                    */
+/*  DestroyClient                                                             */
 /*!
-    Clear the specified message properties list
-
-    The ClearMessageProperties function clears the specified message property
-    list by iterating through the list and setting the property key and
-    value pointers to NULL.
-
-    Note, it is not the responsibilty of this function to deallocate any
-    memory on the heap used for these keys and values.
+    Destroy a hub client
 
-    This function returns no results
+    Messages which have not been confirmed are completed with
+    IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY.
 
-    @param[in]
-        pProp
-            pointer to the MsgProp list to clear
-            a pointer to the next MsgProp object to
+@param[in]
+    pClient
+        pointer to the HubClient to destroy
 
 ==============================================================================*/
-static void ClearMessageProperties( MsgProp *pProp )
+static void DestroyClient( HubClient *pClient )
 {
-    while ( pProp != NULL )
+    size_t i;
+
+    for ( i = 0; i < pClient->count; i++ )
     {
-        pProp->pKey = NULL;
-        pProp->pValue = NULL;
+        if ( pClient->iotHubClientHandle[i] != NULL )
+        {
+            IoTHubClient_Destroy( pClient->iotHubClientHandle[i] );
+            pClient->iotHubClientHandle[i] = NULL;
+        }
+
+        if ( pClient->pSimLink[i] != NULL )
+        {
+            SimLink_Destroy( pClient->pSimLink[i] );
+            pClient->pSimLink[i] = NULL;
+        }
+    }
 
-        pProp = pProp->pNext;
+    /* no more status is reported once the connections are destroyed */
+    if ( pClient->pGroup != NULL )
+    {
+        pthread_mutex_destroy( &pClient->pGroup->mutex );
+        free( pClient->pGroup );
+        pClient->pGroup = NULL;
     }
+
+    pClient->count = 0;
 }
 
 /*============================================================================*/
-/*  SetMessageProperties                                                      */
+/*  Disconnect                                                                */
 /*!
-    Set the properties in the IOTHub Message
-
-    The SetMessageProperties function copies the message properties from
-    the specified MsgProp list into the IOTHUB_MESSAGE.
+    Disconnect from the IOTHUB
 
-    @param[in]
-        messageHandle
-            handle to the IOTHUB_MESSAGE to populate
-
-    @param[in]
-        pMsgProp
-            pointer to the MsgProp list to assign to the message
+    The Disconnect function destroys the client used to send messages.
 
-    @retval EOK message properties were assigned successfully
-    @retval EINVAL invalid arguments
+@param[in]
+    pState
+        pointer to the IOTHubState containing the connection
 
 ==============================================================================*/
-static int SetMessageProperties( IOTHUB_MESSAGE_HANDLE messageHandle,
-                                 MsgProp *pMsgProp )
+static void Disconnect( IOTHubState *pState )
 {
-    int result = EINVAL;
-    MAP_HANDLE propMap;
-    int rc;
+    HubClient client;
 
-    if ( ( pMsgProp != NULL ) &&
-         ( messageHandle != NULL ) )
+    if ( pState != NULL )
     {
-        result = EOK;
+        pthread_mutex_lock( &pState->clientMutex );
+        client = pState->client;
+        memset( &pState->client, 0, sizeof( HubClient ) );
+        pthread_mutex_unlock( &pState->clientMutex );
+
+        DestroyClient( &client );
+    }
+}
+
+/*============================================================================*/
+/*  ReplaceClient                                                             */
+/*!
+    Replace the connected client without interrupting message flow
+
+    The ReplaceClient function is called when the connection string
+    changes while connected.  It brings up a new client alongside the
+    current one, and once the new client is authenticated, switches new
+    messages over to it.  The old client is destroyed once it has
+    confirmed the messages it was sent, or after IOTHUB_RELOAD_DRAIN_MS.
+
+    If the new client does not connect within IOTHUB_RELOAD_CONNECT_MS,
+    it is discarded and the current client is kept.
+
+@param[in]
+    pState
+        pointer to the IOTHubState containing the connection
+
+@retval EOK the client was replaced
+@retval ENOMEM cannot track the state of the new client
+@retval ETIMEDOUT the new client did not connect in time
+@retval ECONNREFUSED the new client failed to connect
+@retval other error as returned from CreateClient
+
+==============================================================================*/
+static int ReplaceClient( IOTHubState *pState )
+{
+    int result;
+    ConnState *pNewState;
+    ConnStateId newState;
+    HubClient client;
+    HubClient retired;
+    struct timespec ts;
+    uint64_t t0;
+    uint64_t t1;
+    uint64_t elapsedMs;
+    uint32_t pending;
+
+    pNewState = ConnState_Create( &pState->backoff, false );
+    if ( pNewState == NULL )
+    {
+        return ENOMEM;
+    }
+
+    /* make the new connection */
+    t0 = GetTimeUs();
+    result = CreateClient( pState, &client );
+    if ( result == EOK )
+    {
+        SetStatusCallback( &client, ConnState_StatusCallback, pNewState );
+
+        /* wait for the new client to be authenticated */
+        while ( ( ( newState = ConnState_Get( pNewState, NULL ) ) !=
+                    CONNSTATE_CONNECTED ) &&
+                ( newState != CONNSTATE_FAILED ) &&
+                ( ( elapsedMs = ( GetTimeUs() - t0 ) / 1000 ) <
+                    IOTHUB_RELOAD_CONNECT_MS ) )
+        {
+            ConnState_Wait( pNewState,
+                            IOTHUB_RELOAD_CONNECT_MS - elapsedMs );
+        }
 
-        /* get the property map for the message */
-        propMap = IoTHubMessage_Properties(messageHandle);
-        if( propMap != NULL )
+        if ( newState == CONNSTATE_CONNECTED )
         {
-            while ( pMsgProp != NULL )
+            /* the old client's teardown is not a connection loss */
+            SetStatusCallback( &pState->client, NULL, NULL );
+
+            /* switch new messages over to the new client */
+            t1 = GetTimeUs();
+            pthread_mutex_lock( &pState->clientMutex );
+            retired = pState->client;
+            pState->client = client;
+
+            pthread_mutex_lock( &pState->inFlightMutex );
+            pState->retiredInFlight = pState->clientInFlight;
+            pState->clientInFlight = 0;
+            pState->clientGeneration++;
+            pending = pState->retiredInFlight;
+            pthread_mutex_unlock( &pState->inFlightMutex );
+
+            pthread_mutex_unlock( &pState->clientMutex );
+
+            SetStatusCallback( &client,
+                               ConnState_StatusCallback,
+                               pState->pConnState );
+
+            /* the new client was authenticated before the switch */
+            ConnState_StatusCallback( IOTHUB_CLIENT_CONNECTION_AUTHENTICATED,
+                                      IOTHUB_CLIENT_CONNECTION_OK,
+                                      pState->pConnState );
+
+            /* break the old connection once its messages are confirmed */
+            clock_gettime( CLOCK_MONOTONIC, &ts );
+            ts.tv_sec += IOTHUB_RELOAD_DRAIN_MS / 1000;
+
+            pthread_mutex_lock( &pState->inFlightMutex );
+            while ( pState->retiredInFlight > 0 )
             {
-                if( pMsgProp->pKey != NULL )
+                if ( pthread_cond_timedwait( &pState->inFlightCond,
+                                             &pState->inFlightMutex,
+                                             &ts ) == ETIMEDOUT )
                 {
-                    /* set the message property */
-                    rc = SetMessageProperty( messageHandle,
-                                                propMap,
-                                                pMsgProp->pKey,
-                                                pMsgProp->pValue );
-                    if ( rc != EOK )
-                    {
-                        result = rc;
-                    }
-                }
-                else
-                {
-                    /* no more properties */
                     break;
                 }
+            }
+
+            if ( pState->retiredInFlight > 0 )
+            {
+                fprintf( stderr,
+                         "iothub: %u messages unconfirmed by the "
+                         "replaced client\n",
+                         pState->retiredInFlight );
+            }
+            pthread_mutex_unlock( &pState->inFlightMutex );
 
-                pMsgProp = pMsgProp->pNext;
+            DestroyClient( &retired );
+            pthread_mutex_lock( &pState->metricsMutex );
+            pState->countReloads++;
+            pthread_mutex_unlock( &pState->metricsMutex );
+
+            if ( IOTHUB_VERBOSE( pState->verbose ) )
+            {
+                fprintf( stdout,
+                         "Replaced client (connect %.1f ms, "
+                         "drained %u messages in %.1f ms)\n",
+                         ( t1 - t0 ) / 1000.0,
+                         pending,
+                         ( GetTimeUs() - t1 ) / 1000.0 );
             }
         }
+        else
+        {
+            SetStatusCallback( &client, NULL, NULL );
+            DestroyClient( &client );
+
+            result = ( newState == CONNSTATE_FAILED ) ? ECONNREFUSED
+                                                      : ETIMEDOUT;
+        }
     }
 
+    ConnState_Destroy( pNewState );
+
     return result;
 }
 
 /*============================================================================*/
-/*  SetMessageProperty                                                        */
+/*  StartConnection                                                           */
 /*!
-    Set a property in the IOTHub Message
+    Start connecting to the IOTHUB
 
-    The SetMessageProperty function sets a single message property in the
-    IOTHUB_MESSAGE.
+    The StartConnection function starts the connection thread, so the
+    TLS and transport handshakes run while client messages are already
+    being accepted.
+
+@param[in]
+    pState
+        pointer to the IOTHubState containing the connection
 
-    There are two special cases:
+@retval EOK the connection thread was started
+@retval other error as returned from StartThread
 
-    1) If the message property is 'messageId' then the message identifier
-    is set via the IoTHubMessage_SetMessageId function.
+==============================================================================*/
+static int StartConnection( IOTHubState *pState )
+{
+    int result;
 
-    2) If the message property is 'correlationId' then the correlation
-    identifier is set via the IoTHubMessage_SetCorrelationId function.
+    result = StartThread( ConnectThread, pState );
+    if ( result != EOK )
+    {
+        fprintf( stderr,
+                 "iothub: cannot start connection: %s\n",
+                 strerror( result ) );
+    }
 
-    All other properties are added as user-properties via the Map_AddOrUpdate
-    function.
+    return result;
+}
 
-    @param[in]
-        messageHandle
-            handle to the IOTHUB_MESSAGE to populate
+/*============================================================================*/
+/*  StartThread                                                               */
+/*!
+    Start a detached service thread
 
-    @param[in]
-        propMap
-            handle to the property map for the message
+    The thread is created with the stack size of the build, so the
+    minimal-footprint build does not reserve the default thread stack
+    for each service thread.
 
-    @param[in]
-        pKey
-            pointer to a NUL terminated string containing the property name
+@param[in]
+    start
+        thread function
 
-    @param[in]
-        pValue
-            pointer to a NUL terminated string containing the property value
+@param[in]
+    arg
+        argument passed to the thread function
 
-    @retval EOK the message property was assigned successfully
-    @retval EINVAL invalid arguments
-    @retval ENOTSUP failed to set the message or correlation identifier
-    @retval ENOENT failed to add the custom user property
+@retval EOK the thread was started
+@retval other error as returned from pthread_create
 
 ==============================================================================*/
-static int SetMessageProperty( IOTHUB_MESSAGE_HANDLE messageHandle,
-                               MAP_HANDLE propMap,
-                               const char *pKey,
-                               const char *pValue )
+static int StartThread( void *(*start)( void * ), void *arg )
 {
-    int result = EINVAL;
-    IOTHUB_MESSAGE_RESULT imr = IOTHUB_MESSAGE_INVALID_ARG;
-    MAP_RESULT mr = MAP_INVALIDARG;
+    int result;
+    pthread_attr_t attr;
+    pthread_t thread;
 
-    if ( ( messageHandle != NULL ) &&
-         ( propMap != NULL ) &&
-         ( pKey != NULL ) &&
-         ( pValue != NULL ) )
+    result = pthread_attr_init( &attr );
+    if ( result == EOK )
     {
-        result = EOK;
-
-        if( strncmp( pKey, "correlationId", 13 ) == 0 )
+        pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+        if ( FOOTPRINT_THREAD_STACK > 0 )
         {
-            /* set the message correlation identifier from the
-               supplied property */
-            imr = IoTHubMessage_SetCorrelationId( messageHandle, pValue );
-            if ( imr != IOTHUB_MESSAGE_OK )
-            {
-                result = ENOTSUP;
-            }
-        }
-        else if( strncmp( pKey, "messageId", 9) == 0 )
-        {
-            /* set the message identifier from the supplied property */
-            imr = IoTHubMessage_SetMessageId( messageHandle, pValue );
-            if ( imr != IOTHUB_MESSAGE_OK )
-            {
-                result = ENOTSUP;
-            }
+            result = pthread_attr_setstacksize( &attr,
+                                                FOOTPRINT_THREAD_STACK );
         }
-        else
+
+        if ( result == EOK )
         {
-            /* set custom message properties */
-            mr = Map_AddOrUpdate( propMap, pKey, pValue );
-            if ( mr != MAP_OK )
-            {
-                result = ENOENT;
-            }
+            result = pthread_create( &thread, &attr, start, arg );
         }
+
+        pthread_attr_destroy( &attr );
     }
 
     return result;
 }
 
 /*============================================================================*/
-/*  SendMessage                                                               */
+/*  ConnectThread                                                             */
 /*!
-    Send an IOTHub Message
-
-    The SendMessage function sends the requested message to the IOTHUB service
-
-    It creates the mssage from the specified body.
-    If the (optional) headers are specified they are parsed and added to
-    the message.
-
-    The message is the queued for delivery.
+    Connection thread
 
-    @param[in]
-        pState
-            pointer to the IOTHubState
+    The ConnectThread function connects to the IOTHUB, and recreates
+    the hub client once the backoff delay after a failure has elapsed.
+    A client fails when its retry timeout expires or its credentials
+    are rejected, or when it could not be created at all.
 
-    @param[in]
-        headers
-            pointer to the (optional) headers specified one per line as
-            key:value pairs separated by a colon.  The last header is
-            terminated with two newlines.
+    When the connection string changes, a connected client is replaced
+    without interrupting message flow.  A client which is not connected
+    is recreated immediately with the new connection string.
 
-    @param[in]
-        body
-            pointer to the byte array to send.  This byte array may
-            contain ASCII or binary data and does not need to be NUL
-            terminated
+    After a handoff, the first connection is only made once the
+    previous service has disconnected.
 
-    @param[in]
-        len
-            length of the byte array to send.
+@param[in]
+    arg
+        pointer to the IOTHubState containing the connection
 
-    @retval EOK the message was queued for delivery
-    @retval ENOMEM could not allocate memory for the message headers
-    @retval EIO message could not be queued for delivery
-    @retval EBADMSG could not create IOTHUB message from the byte array
-    @retval EBADF no connection to the IOTHUB
+@retval NULL
 
 ==============================================================================*/
-static int SendMessage( IOTHubState *pState,
-                        char *headers,
-                        char *body,
-                        size_t len )
+static void *ConnectThread( void *arg )
 {
-    IOTHUB_CLIENT_HANDLE iotHubClientHandle;
-    IOTHUB_CLIENT_RESULT icr;
-    IOTHUB_MESSAGE_HANDLE messageHandle;
-    int result = EINVAL;
-    MsgContext *pMsgContext;
-    const char *pMsgId;
-    uuid_t uuid;
-    char messageId[64];
+    IOTHubState *pState = (IOTHubState *)arg;
+    ConnStateId connState;
+    uint32_t retryMs;
+    bool reload;
+    int result;
 
-    char *p;
+    /* only one service may be connected as this device */
+    if ( pState->predecessorFd != -1 )
+    {
+        if ( Handoff_WaitClosed( pState->predecessorFd,
+                                 IOTHUB_HANDOFF_DRAIN_MS +
+                                 HANDOFF_TIMEOUT_MS ) != EOK )
+        {
+            fprintf( stderr, "iothub: previous service did not finish\n" );
+        }
 
-    if( ( pState != NULL ) &&
-        ( body != NULL ) &&
-        ( len > 0 ) )
+        close( pState->predecessorFd );
+        pState->predecessorFd = -1;
+    }
+
+    while ( true )
     {
-        /* create the connection */
-        iotHubClientHandle = pState->iotHubClientHandle;
-        if ( iotHubClientHandle != NULL )
+        /* stay disconnected while the connection is asleep */
+        while ( ConnState_Get( pState->pConnState, NULL ) ==
+                    CONNSTATE_SLEEPING )
         {
-            /* build the message content from the body of the message */
-            messageHandle = IoTHubMessage_CreateFromByteArray( body, len );
-            if( messageHandle != NULL )
+            pthread_mutex_lock( &pState->clientMutex );
+            pState->connectionIdle = true;
+            pthread_mutex_unlock( &pState->clientMutex );
+
+            ConnState_Wait( pState->pConnState, IOTHUB_POLL_MS );
+        }
+
+        pthread_mutex_lock( &pState->clientMutex );
+        pState->connectionIdle = false;
+        pthread_mutex_unlock( &pState->clientMutex );
+
+        if ( Connect( pState ) != EOK )
+        {
+            ConnState_Failed( pState->pConnState );
+        }
+
+        /* wait for the client to fail and the backoff delay to elapse */
+        while ( ( ( connState = ConnState_Get( pState->pConnState,
+                                               &retryMs ) ) !=
+                    CONNSTATE_FAILED ) ||
+                ( retryMs > 0 ) )
+        {
+            /* the service closed the idle connection */
+            if ( connState == CONNSTATE_SLEEPING )
             {
-                if ( headers != NULL )
-                {
-                    p = strdup( headers );
-                    if ( p != NULL )
-                    {
-                        BuildMessageProperties( &pState->pMsgProperties, p );
-                        SetMessageProperties( messageHandle,
-                                              pState->pMsgProperties );
-                        free( p );
-                    }
-                    else
-                    {
-                        result = ENOMEM;
-                    }
-                }
+                break;
+            }
 
-                /* get the message id */
-                pMsgId = IoTHubMessage_GetMessageId( messageHandle );
-                if( pMsgId == NULL )
-                {
-                    uuid_generate( uuid );
-                    uuid_unparse( uuid, messageId );
-                    IoTHubMessage_SetMessageId( messageHandle, messageId );
-                }
+            pthread_mutex_lock( &pState->clientMutex );
+            reload = pState->reloadRequested;
+            pState->reloadRequested = false;
+            pthread_mutex_unlock( &pState->clientMutex );
 
-                if( pState->verbose )
+            if ( ( reload == true ) &&
+                 ( ReloadSettings( pState ) == EOK ) )
+            {
+                if ( connState != CONNSTATE_CONNECTED )
                 {
-                    pMsgId = IoTHubMessage_GetMessageId( messageHandle );
-                    if ( pMsgId != NULL )
-                    {
-                        fprintf( stdout,
-                                 "\x1b[33mSending message: %s\x1b[0m\n",
-                                 pMsgId );
-                    }
-                    else
-                    {
-                        fprintf( stderr,
-                                 "\x1b[31mNo message id\x1b[0m\n");
-                    }
+                    break;
                 }
 
-                /* create a message context object */
-                pMsgContext = malloc( sizeof( MsgContext ) );
-                if( pMsgContext != NULL )
+                result = ReplaceClient( pState );
+                if ( result != EOK )
                 {
-                    pMsgContext->pState = pState;
-                    pMsgContext->messageHandle = messageHandle;
+                    fprintf( stderr,
+                             "iothub: cannot replace client: %s\n",
+                             strerror( result ) );
                 }
 
-                /* send the message back */
-                icr = IoTHubClient_SendEventAsync( iotHubClientHandle,
-                                                   messageHandle,
-                                                   SendCallback,
-                                                   pMsgContext );
-                if ( icr == IOTHUB_CLIENT_OK)
-                {
-                    result = EOK;
-                }
-                else
-                {
-                    result = EIO;
-                }
-            }
-            else
-            {
-                result = EBADMSG;
+                continue;
             }
+
+            ConnState_Wait( pState->pConnState,
+                            ( retryMs > 0 ) ? retryMs : IOTHUB_POLL_MS );
         }
-        else
+
+        if ( connState == CONNSTATE_SLEEPING )
         {
-            result = EBADF;
+            /* closing the idle connection is not a connection loss */
+            pthread_mutex_lock( &pState->clientMutex );
+            SetStatusCallback( &pState->client, NULL, NULL );
+            pthread_mutex_unlock( &pState->clientMutex );
         }
+
+        Disconnect( pState );
+        ConnState_Connecting( pState->pConnState );
     }
 
-    return result;
+    return NULL;
 }
 
 /*============================================================================*/
-/*  SendCallback                                                              */
+/*  GetTimeUs                                                                 */
 /*!
-    Async send callback function
+    Get the monotonic clock time in microseconds
 
-    The SendCallback function is invoked from the IOT SDK framework
-    when a message transmission has completed (successfully or
-    unsuccessfully)
+    @retval current monotonic time in microseconds
 
-    @param[in]
-       result
-            status of the message transfer attempt
+==============================================================================*/
+static uint64_t GetTimeUs( void )
+{
+    struct timespec ts;
 
-    @retval[in]
-        userContextCallback
+    clock_gettime( CLOCK_MONOTONIC, &ts );
 
-    @return none
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*============================================================================*/
+/*  GetEpochMs                                                                */
+/*!
+    Get the wall clock time in milliseconds
+
+    @retval current time in milliseconds since the epoch
 
 ==============================================================================*/
-static void SendCallback( IOTHUB_CLIENT_CONFIRMATION_RESULT result,
-                          void* userContextCallback)
+static uint64_t GetEpochMs( void )
 {
-    IOTHubState *pState;
-    MsgContext *pContext = (MsgContext *)userContextCallback;
-    IOTHUB_MESSAGE_HANDLE messageHandle;
-    const char *pMessageId;
-    const char *red = "\x1b[31m";
-    const char *green = "\x1b[32m";
-    const char *color;
+    struct timespec ts;
 
-    if ( pContext != NULL )
-    {
-        pState = pContext->pState;
-        messageHandle = pContext->messageHandle;
+    clock_gettime( CLOCK_REALTIME, &ts );
 
-        if( ( pState != NULL ) &&
-            ( messageHandle != NULL ) )
-        {
-            /* get the message id */
-            pMessageId = IoTHubMessage_GetMessageId( messageHandle );
-            if( pMessageId == NULL )
-            {
-                pMessageId = "unknown";
-            }
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-            /* set the notification color */
-            color = (result == IOTHUB_CLIENT_OK) ? green : red;
+/*============================================================================*/
+/*  SetupMessageQueue                                                         */
+/*!
+    Set up the message queues
 
-            if( pState->verbose )
-            {
-                fprintf( stdout,
-                         "%s%s: Message Send %s\x1b[0m\n",
-                         color,
-                         pMessageId,
-                         MU_ENUM_TO_STRING( IOTHUB_CLIENT_CONFIRMATION_RESULT,
-                                            result ) );
-            }
+    The SetupMessageQueue function opens the IOTHUB message queue and
+    any additional ingest queues which will receive messages from
+    clients to send to an external IOTHUB, and creates a receive buffer
+    large enough for a message from any of them, and the pool of
+    buffers to receive the message bodies into.
 
-            switch( result )
-            {
-                case IOTHUB_CLIENT_OK:
+    The queues are created with the configured depth and message size.
+    If the IOTHUB message queue was handed over by another service, its
+    descriptor is used instead.  A queue which cannot be opened is
+    reported and left out.
+
+@param[in]
+    pState
+        pointer to the IOTHubState which will contain the newly created
+        message queues
+
+@retval EOK the IOTHUB message queue was successfully opened
+@retval EINVAL invalid arguments
+@retval ENOMEM failed to create the receive message buffer
+@retval other error as returned from Ingest_Add
+
+==============================================================================*/
+static int SetupMessageQueue( IOTHubState *pState )
+{
+    int result = EINVAL;
+    IngestStats stats;
+    size_t i;
+    int rc;
+
+    if ( pState != NULL )
+    {
+        /* initialize the message queue length */
+        pState->messageLength = 0;
+
+        pState->pIngest = Ingest_Create( pState->queueDepth,
+                                         pState->queueMsgSize );
+        result = ( pState->pIngest != NULL ) ? EOK : ENOMEM;
+
+        for ( i = 0;
+              ( pState->pIngest != NULL ) && ( i < pState->queueCount );
+              i++ )
+        {
+            /* the IOTHUB queue may have been handed over */
+            rc = Ingest_Add( pState->pIngest,
+                             pState->queueNames[i],
+                             pState->queueWeights[i],
+                             ( i == 0 ) ? pState->messageQueue
+                                        : (mqd_t)-1 );
+            if ( rc != EOK )
+            {
+                fprintf( stderr,
+                         "iothub: cannot open message queue %s: %s%s\n",
+                         pState->queueNames[i],
+                         strerror( rc ),
+                         ( rc == EINVAL )
+                            ? " (see /proc/sys/fs/mqueue)"
+                            : "" );
+            }
+
+            if ( i == 0 )
+            {
+                pState->messageQueue = (mqd_t)-1;
+                result = rc;
+            }
+        }
+
+        /* an existing queue keeps the geometry it was created with */
+        for ( i = 0;
+              Ingest_GetStats( pState->pIngest, i, &stats ) == EOK;
+              i++ )
+        {
+            if ( ( ( pState->queueDepth != 0 ) &&
+                   ( stats.depth != pState->queueDepth ) ) ||
+                 ( ( pState->queueMsgSize != 0 ) &&
+                   ( stats.msgsize != pState->queueMsgSize ) ) )
+            {
+                fprintf( stderr,
+                         "iothub: message queue %s has depth %ld and "
+                         "message size %ld\n",
+                         stats.name,
+                         stats.depth,
+                         stats.msgsize );
+            }
+        }
+
+        if ( Ingest_Count( pState->pIngest ) > 0 )
+        {
+            pState->messageLength = Ingest_MaxMsgSize( pState->pIngest );
+            pState->rxHeaders = calloc( 1,
+                                        pState->messageLength + 1 +
+                                        IOTHUB_EXPIRY_HEADER_SIZE +
+                                        IOTHUB_DEADLINE_HEADER_SIZE );
+            if ( pState->rxHeaders == NULL )
+            {
+                pState->messageLength = 0;
+                result = ENOMEM;
+            }
+        }
+
+        pState->pBodyPool = BodyPool_Create( pState->bodyMax,
+                                             pState->bodyCache );
+        if ( pState->pBodyPool == NULL )
+        {
+            result = ENOMEM;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ProcessMessages                                                           */
+/*!
+    Wait for and process IOTHUB messages
+
+    The ProcessMessages function waits for messages received on the IOTHUB
+    message queue and processes each of them as they arrive.
+
+    Messages are accepted as soon as the message queue is created,
+    while the connection to the IOTHUB is still being established.
+    Messages received while the IOTHUB is not connected are spilled to
+    the disk outbox if one is configured, or else held in a bounded
+    in-memory buffer.  Ingest is paused and further messages are left
+    in the message queue while the buffer is full.  Spilled and
+    buffered messages are sent in order once connected.
+
+    The function returns once the message queue has been handed over
+    to a replacement service.
+
+@param[in]
+    pState
+        pointer to the IOTHubState which contains the IOTHUB message queue
+        to wait on.
+
+@retval EOK the message queue was handed over
+@retval EINVAL invalid arguments
+
+==============================================================================*/
+static int ProcessMessages( IOTHubState *pState)
+{
+    int result = EINVAL;
+    ConnStateId connState;
+    uint32_t waitMs;
+    int fd;
+
+    if ( pState != NULL )
+    {
+        while( true )
+        {
+            /* stop once a replacement service has taken over */
+            pthread_mutex_lock( &pState->clientMutex );
+            fd = pState->handoffFd;
+            pState->handoffFd = -1;
+            pthread_mutex_unlock( &pState->clientMutex );
+
+            if ( ( fd != -1 ) &&
+                 ( HandOver( pState, fd ) == EOK ) )
+            {
+                result = EOK;
+                break;
+            }
+
+            connState = ConnState_Get( pState->pConnState, NULL );
+            waitMs = IOTHUB_POLL_MS;
+
+            /* make room by discarding the stale buffered messages */
+            ExpireBacklog( pState );
+
+            /* close the idle connection, or connect when needed */
+            UpdateDutyCycle( pState, connState );
+            connState = ConnState_Get( pState->pConnState, NULL );
+
+            /* shrink or restore the memory footprint */
+            UpdatePressure( pState );
+
+            /* send the spilled or buffered messages once connected */
+            if ( ( connState == CONNSTATE_CONNECTED ) &&
+                 ( ( Outbox_Empty( pState->pOutbox ) == false ) ||
+                   ( MsgBuffer_Empty( pState->pBuffer ) == false ) ||
+                   ( EdfQueue_Empty( pState->pEdf ) == false ) ) )
+            {
+                DrainBacklog( pState );
+                waitMs = IOTHUB_DRAIN_POLL_MS;
+            }
+
+            /* confirmations make room for messages under memory
+               pressure */
+            if ( ( connState == CONNSTATE_CONNECTED ) &&
+                 ( Pressure_Active( pState->pPressure ) == true ) &&
+                 ( InFlight( pState ) > 0 ) )
+            {
+                waitMs = IOTHUB_DRAIN_POLL_MS;
+            }
+
+            UpdateMetrics( pState );
+
+            /* shed messages while the uplink cannot keep up */
+            UpdateShedding( pState );
+
+            /* adapt to the estimated uplink quality */
+            UpdateShaping( pState );
+
+            if ( IngestPaused( pState, connState ) == true )
+            {
+                /* leave messages in the queue until there is room */
+                ConnState_Wait( pState->pConnState, waitMs );
+                continue;
+            }
+
+            /* wait for and process a message from the IOTHUB queue */
+            result = ProcessMessage( pState, waitMs );
+            if( ( result != EOK ) &&
+                ( result != ETIMEDOUT ) )
+            {
+                fprintf( stderr,
+                         "iothub: ProcessMessage: %s\n",
+                         strerror( result ) );
+            }
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ProcessMessage                                                            */
+/*!
+    Wait for and process an IOTHUB message
+
+    The ProcessMessage function waits for a single message on the IOTHUB
+    message queues and processes it when it arrives.  When several
+    queues have messages waiting, the next message is taken according
+    to the queue weights.
+
+@param[in]
+    pState
+        pointer to the IOTHubState which contains the IOTHUB message queue
+        to wait on.
+
+@param[in]
+    timeoutMs
+        maximum time to wait for a message in milliseconds
+
+@retval EOK a message was successfully received from the queue and processed
+@retval EINVAL invalid arguments
+@retval ETIMEDOUT no message arrived before the timeout
+@retval other error as returned from Ingest_Receive
+
+==============================================================================*/
+static int ProcessMessage( IOTHubState *pState, uint32_t timeoutMs )
+{
+    int result = EINVAL;
+    char *p;
+    size_t len;
+    unsigned int priority;
+    size_t n;
+    uint32_t pid;
+    uint32_t count;
+    const char *preamble = "IOTC";
+    char *headers;
+    char *body;
+    int fd;
+    size_t length;
+
+    if ( pState != NULL )
+    {
+        p = pState->rxHeaders;
+        len = pState->messageLength;
+
+        /* wait for a message to arrive */
+        result = Ingest_Receive( pState->pIngest,
+                                 p,
+                                 len,
+                                 &n,
+                                 &priority,
+                                 timeoutMs );
+        if ( result == EOK )
+        {
+            /* NUL terminate the message */
+            p[n] = '\0';
+
+            /* validate the preamble */
+            if ( n < 8 )
+            {
+                fprintf( stderr, "ProcessMessage: short frame\n" );
+                result = EBADMSG;
+            }
+            else if( memcmp( p, preamble, 4 ) == 0 )
+            {
+                /* get the client PID */
+                memcpy( &pid, &p[4], 4 );
+
+                /* get the headers */
+                headers = &p[8];
+                n = 8 + PrepareHeaders( pState, headers, n - 8 );
+
+                /* get the message body */
+                result = GetBody( pState, pid, &fd, &body, &len );
+                if ( result == EOK )
+                {
+                    /* dump the message body */
+                    if ( IOTHUB_VERBOSE( pState->verbose ) )
+                    {
+                        fprintf(stdout, "body:\n%.*s\n", (int)len, body);
+                    }
+
+                    if ( ( fd != -1 ) &&
+                         ( FindHeader( headers, "upload", &length ) == NULL ) )
+                    {
+                        /* the rest of the body is sent as it is read */
+                        result = StreamBody( pState,
+                                             fd,
+                                             pid,
+                                             priority,
+                                             headers,
+                                             body,
+                                             len );
+                        close( fd );
+                    }
+                    else
+                    {
+                        if ( fd != -1 )
+                        {
+                            close( fd );
+                        }
+
+                        result = SubmitMessage( pState,
+                                                pid,
+                                                priority,
+                                                headers,
+                                                n - 8,
+                                                body,
+                                                len );
+                    }
+                }
+                else
+                {
+                    fprintf( stderr,
+                             "ProcessMessage: Cannot get body: %s\n",
+                             strerror( result ) );
+                }
+            }
+            else if ( ( n == sizeof( IotBatchFrame ) ) &&
+                      ( memcmp( p, IOTBATCH_PREAMBLE, 4 ) == 0 ) )
+            {
+                /* get the client PID and the number of messages */
+                memcpy( &pid, &p[4], 4 );
+                memcpy( &count, &p[8], 4 );
+
+                result = ProcessBatch( pState, pid, priority, count );
+            }
+            else
+            {
+                fprintf(stderr, "ProcessMesssage: invalid preamble\n");
+                result = EBADMSG;
+            }
+        }
+        else if ( result != ETIMEDOUT )
+        {
+            fprintf(stderr, "ProcessMessage: %s\n", strerror(result));
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ProcessBatch                                                              */
+/*!
+    Receive and process a batch of messages
+
+    The ProcessBatch function reads the messages announced by a batch
+    frame from the client's FIFO, which holds the header block and the
+    body of each message in turn, and processes each of them as if it
+    had arrived in its own IOTC frame.  All the messages of a batch take
+    the message queue priority of the batch frame.
+
+    A batch is read in one pass, so batched bodies are not streamed in
+    chunks.  A body larger than the maximum body size is truncated, and
+    a message for which no receive buffer is available is skipped and
+    dropped.  A message which cannot be processed does not stop the rest
+    of the batch, but the batch is abandoned if it is not framed
+    correctly or cannot be read.  Whatever is left in the FIFO is then
+    discarded, since the client reuses its FIFO for the next batch.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    pid
+        process id of the client which sent the batch
+
+@param[in]
+    priority
+        message queue priority of the batch frame
+
+@param[in]
+    count
+        number of messages in the batch
+
+@retval EOK every message of the batch was processed
+@retval EBADMSG the batch is not framed correctly
+@retval ENOMEM a message was dropped for want of a receive buffer
+@retval other error as returned from open, read or SubmitMessage
+
+==============================================================================*/
+static int ProcessBatch( IOTHubState *pState,
+                         uint32_t pid,
+                         unsigned int priority,
+                         uint32_t count )
+{
+    int result = EBADMSG;
+    int rc;
+    int fd;
+    char fifoName[64];
+    IotBatchEntry entry;
+    char *headers;
+    size_t length;
+    char *body;
+    size_t len;
+    uint32_t i;
+
+    if ( ( count > 0 ) && ( count <= IOTBATCH_MAX_COUNT ) )
+    {
+        /* open the FIFO holding the batch */
+        sprintf( fifoName, "/tmp/iothub_%d", pid );
+        fd = open( fifoName, O_RDONLY );
+        result = ( fd != -1 ) ? EOK : errno;
+
+        /* the headers are read in place of the header frame */
+        headers = (char *)&pState->rxHeaders[8];
+
+        for ( i = 0; ( fd != -1 ) && ( i < count ); i++ )
+        {
+            rc = ReadAll( fd, &entry, sizeof( entry ) );
+            if ( ( rc == EOK ) &&
+                 ( ( entry.headerLength == 0 ) ||
+                   ( entry.headerLength > pState->messageLength - 8 ) ) )
+            {
+                rc = EBADMSG;
+            }
+
+            if ( rc == EOK )
+            {
+                rc = ReadAll( fd, headers, entry.headerLength );
+            }
+
+            if ( rc == EOK )
+            {
+                headers[entry.headerLength] = '\0';
+                rc = ReadBatchBody( pState,
+                                    fd,
+                                    entry.bodyLength,
+                                    &body,
+                                    &len );
+            }
+
+            if ( rc == ENOMEM )
+            {
+                /* the body was skipped, so the batch can go on */
+                pthread_mutex_lock( &pState->metricsMutex );
+                pState->countBatchDropped++;
+                pthread_mutex_unlock( &pState->metricsMutex );
+                fprintf( stderr,
+                         "ProcessMessage: batched message from %u "
+                         "dropped\n",
+                         pid );
+                if ( result == EOK )
+                {
+                    result = rc;
+                }
+
+                continue;
+            }
+
+            if ( rc != EOK )
+            {
+                /* the rest of the batch cannot be found, so it must not
+                   be mistaken for the start of the next batch */
+                fprintf( stderr,
+                         "ProcessMessage: batch from %u: %s\n",
+                         pid,
+                         strerror( rc ) );
+                DiscardFifo( fd );
+                result = rc;
+                break;
+            }
+
+            length = PrepareHeaders( pState, headers, entry.headerLength );
+
+            /* dump the message body */
+            if ( IOTHUB_VERBOSE( pState->verbose ) )
+            {
+                fprintf(stdout, "body:\n%.*s\n", (int)len, body);
+            }
+
+            rc = SubmitMessage( pState,
+                                pid,
+                                priority,
+                                headers,
+                                length,
+                                body,
+                                len );
+            if ( ( rc != EOK ) && ( result == EOK ) )
+            {
+                result = rc;
+            }
+        }
+
+        if ( fd != -1 )
+        {
+            pthread_mutex_lock( &pState->metricsMutex );
+            pState->countBatches++;
+            pState->countBatched += i;
+            pthread_mutex_unlock( &pState->metricsMutex );
+            close( fd );
+        }
+    }
+    else
+    {
+        fprintf( stderr,
+                 "ProcessMessage: batch of %u from %u\n",
+                 count,
+                 pid );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ReadBatchBody                                                             */
+/*!
+    Read the body of a batched message from a client FIFO
+
+    The ReadBatchBody function reads a body of known length into a
+    buffer from the body pool.  The part of a body beyond the maximum
+    body size, or the whole body if no buffer is available, is read and
+    discarded so the next message of the batch can be found.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object which provides the body pool
+
+@param[in]
+    fd
+        FIFO to read the body from
+
+@param[in]
+    bodyLength
+        length of the body in the FIFO
+
+@param[out]
+    body
+        pointer to a location to store the pointer to the received body
+
+@param[out]
+    len
+        pointer to a location to store the received body length
+
+@retval EOK the body was read
+@retval ENOMEM no receive buffer is available, and the body was skipped
+@retval EPIPE the FIFO ended before the body
+@retval other error as returned from read
+
+==============================================================================*/
+static int ReadBatchBody( IOTHubState *pState,
+                          int fd,
+                          size_t bodyLength,
+                          char **body,
+                          size_t *len )
+{
+    int result;
+    char *rxBuf;
+    size_t capacity;
+    size_t received;
+    size_t left;
+
+    received = ( bodyLength < pState->bodyMax ) ? bodyLength
+                                                : pState->bodyMax;
+    rxBuf = BodyPool_Alloc( pState->pBodyPool, received, &capacity );
+    if ( rxBuf != NULL )
+    {
+        result = ReadAll( fd, rxBuf, received );
+
+        /* skip the rest of an oversized body */
+        left = bodyLength - received;
+        if ( ( result == EOK ) && ( left > 0 ) )
+        {
+            pthread_mutex_lock( &pState->metricsMutex );
+            pState->countTruncated++;
+            pthread_mutex_unlock( &pState->metricsMutex );
+            fprintf( stderr,
+                     "iothub: batched body truncated at %zu bytes\n",
+                     received );
+        }
+
+        if ( ( result == EOK ) && ( left > 0 ) )
+        {
+            result = SkipAll( fd, left );
+        }
+
+        if ( result == EOK )
+        {
+            *body = rxBuf;
+            *len = received;
+        }
+        else
+        {
+            BodyPool_Free( pState->pBodyPool, rxBuf );
+        }
+    }
+    else
+    {
+        /* skip the body which cannot be received */
+        result = SkipAll( fd, bodyLength );
+        if ( result == EOK )
+        {
+            result = ENOMEM;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  PrepareHeaders                                                            */
+/*!
+    Prepare the headers of a received message
+
+    The PrepareHeaders function fixes the expiry time and the delivery
+    deadline of a received message, notes an urgent message and dumps
+    the headers in verbose mode.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in,out]
+    headers
+        pointer to the NUL terminated headers following the client pid
+        in the receive buffer
+
+@param[in]
+    length
+        length of the header frame contents
+
+@retval length of the header frame contents
+
+==============================================================================*/
+static size_t PrepareHeaders( IOTHubState *pState,
+                              char *headers,
+                              size_t length )
+{
+    size_t size;
+    size_t n;
+
+    /* fix the expiry time of a message with a time to live */
+    size = pState->messageLength - 8 + 1 +
+           IOTHUB_EXPIRY_HEADER_SIZE +
+           IOTHUB_DEADLINE_HEADER_SIZE;
+    length = AddExpiry( headers, length, size );
+
+    /* fix the delivery deadline of a message */
+    length = AddDeadline( headers, length, size );
+
+    /* an urgent message wakes a sleeping connection */
+    if ( ( pState->dutyIntervalMs > 0 ) &&
+         ( FindHeader( headers, "urgent", &n ) != NULL ) )
+    {
+        pState->dutyUrgent = true;
+    }
+
+    /* dump the message headers */
+    if ( IOTHUB_VERBOSE( pState->verbose ) )
+    {
+        fprintf(stdout, "headers:\n%s", headers);
+    }
+
+    return length;
+}
+
+/*============================================================================*/
+/*  SubmitMessage                                                             */
+/*!
+    Submit a received message for delivery
+
+    The SubmitMessage function starts a file upload for an upload
+    request, drops a message shed under overload, and forwards any
+    other message for delivery.  The body is returned to the body pool.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    pid
+        process id of the client which sent the message
+
+@param[in]
+    priority
+        message queue priority of the header frame
+
+@param[in]
+    headers
+        pointer to the NUL terminated message headers
+
+@param[in]
+    headerLength
+        length of the header frame contents
+
+@param[in]
+    body
+        pointer to the message body taken from the body pool
+
+@param[in]
+    len
+        length of the message body
+
+@retval EOK the message was submitted or shed
+@retval other error as returned from StartUpload or ForwardMessage
+
+==============================================================================*/
+static int SubmitMessage( IOTHubState *pState,
+                          uint32_t pid,
+                          unsigned int priority,
+                          char *headers,
+                          size_t headerLength,
+                          char *body,
+                          size_t len )
+{
+    int result = EOK;
+    size_t length;
+
+    if ( FindHeader( headers, "upload", &length ) != NULL )
+    {
+        /* file upload requests are not sent on */
+        result = StartUpload( pState, pid, headers );
+    }
+    else if ( ShedMessage( pState, pid, priority, headers, len ) == false )
+    {
+        /* shed messages are neither captured nor sent */
+        result = ForwardMessage( pState,
+                                 pid,
+                                 priority,
+                                 headers,
+                                 headerLength,
+                                 body,
+                                 len );
+    }
+
+    /* the body has been copied for delivery */
+    BodyPool_Free( pState->pBodyPool, body );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ForwardMessage                                                            */
+/*!
+    Capture and dispatch a received message
+
+    The ForwardMessage function records a received message, or one
+    chunk of a streamed message, in the capture trace if capture is
+    enabled and queues it for delivery.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    pid
+        process id of the client which sent the message
+
+@param[in]
+    priority
+        message queue priority of the header frame
+
+@param[in]
+    headers
+        pointer to the NUL terminated message headers
+
+@param[in]
+    headerLength
+        length of the message headers
+
+@param[in]
+    body
+        pointer to the message body
+
+@param[in]
+    len
+        length of the message body
+
+@retval EOK the message was sent, spilled or buffered
+@retval other error as returned from DispatchMessage
+
+==============================================================================*/
+static int ForwardMessage( IOTHubState *pState,
+                           uint32_t pid,
+                           unsigned int priority,
+                           char *headers,
+                           size_t headerLength,
+                           char *body,
+                           size_t len )
+{
+    int result;
+
+    /* record the message in the capture trace */
+    if ( pState->pTrace != NULL )
+    {
+        CaptureMessage( pState,
+                        pid,
+                        priority,
+                        headers,
+                        headerLength,
+                        body,
+                        len );
+    }
+
+    /* queue the message for delivery */
+    result = DispatchMessage( pState,
+                              pid,
+                              priority,
+                              headers,
+                              headerLength,
+                              body,
+                              len );
+    if( result != EOK )
+    {
+        fprintf( stderr,
+                 "ProcessMessage: DispatchMessage: %s\n",
+                 strerror( result ) );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  CaptureMessage                                                            */
+/*!
+    Record a received message in the capture trace
+
+    The CaptureMessage function appends the raw header frame and body
+    of a received message to the capture trace so the traffic can be
+    replayed later with the iotload tool.  Capture errors are reported
+    once and the capture is stopped, but do not affect message delivery.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object containing the capture trace
+
+@param[in]
+    pid
+        process id of the client which sent the message
+
+@param[in]
+    priority
+        message queue priority of the header frame
+
+@param[in]
+    headers
+        pointer to the header frame contents following the client pid
+
+@param[in]
+    headerLength
+        length of the header frame contents
+
+@param[in]
+    body
+        pointer to the message body
+
+@param[in]
+    len
+        length of the message body
+
+@retval EOK the message was recorded
+@retval EINVAL invalid arguments
+@retval other error as returned from Trace_Write
+
+==============================================================================*/
+static int CaptureMessage( IOTHubState *pState,
+                           uint32_t pid,
+                           unsigned int priority,
+                           char *headers,
+                           size_t headerLength,
+                           char *body,
+                           size_t len )
+{
+    int result = EINVAL;
+    TraceRecord record;
+
+    if ( pState != NULL )
+    {
+        record.pid = pid;
+        record.priority = priority;
+        record.headers = headers;
+        record.headerLength = headerLength;
+        record.body = body;
+        record.bodyLength = len;
+
+        result = Trace_Write( pState->pTrace, &record );
+        if ( result != EOK )
+        {
+            fprintf( stderr,
+                     "iothub: capture to %s failed: %s\n",
+                     pState->traceFile,
+                     strerror( result ) );
+
+            Trace_Close( pState->pTrace );
+            pState->pTrace = NULL;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  DispatchMessage                                                           */
+/*!
+    Send a received message or hold it until connected
+
+    The DispatchMessage function sends a received message to the IOTHUB
+    if it is connected and no earlier messages are waiting to be sent.
+    Otherwise the message is appended to the disk outbox, or to the
+    in-memory buffer if there is no outbox, so the arrival order is
+    kept.  A message which expired before it was received is discarded.
+
+    With deadline scheduling, a message which cannot be sent at once
+    because the send window is full, or because other messages are
+    waiting for it, is queued to be sent in deadline order instead.
+    If the deadline queue is full the message is sent at once.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    pid
+        process id of the client which sent the message
+
+@param[in]
+    priority
+        message queue priority of the header frame
+
+@param[in]
+    headers
+        pointer to the NUL terminated message headers
+
+@param[in]
+    headerLength
+        length of the header frame contents
+
+@param[in]
+    body
+        pointer to the message body
+
+@param[in]
+    len
+        length of the message body
+
+@retval EOK the message was sent, spilled, buffered or discarded
+@retval EINVAL invalid arguments
+@retval other error as returned from SendMessage, SpillMessage or
+        MsgBuffer_Put
+
+==============================================================================*/
+static int DispatchMessage( IOTHubState *pState,
+                            uint32_t pid,
+                            unsigned int priority,
+                            char *headers,
+                            size_t headerLength,
+                            char *body,
+                            size_t len )
+{
+    int result = EINVAL;
+    TraceRecord record;
+    bool connected;
+
+    if ( ( pState != NULL ) &&
+         ( Expired( pState, headers ) == true ) )
+    {
+        result = EOK;
+    }
+    else if ( pState != NULL )
+    {
+        connected = ( ConnState_Get( pState->pConnState, NULL ) ==
+                      CONNSTATE_CONNECTED );
+
+        record.pid = pid;
+        record.priority = priority;
+        record.headers = headers;
+        record.headerLength = headerLength;
+        record.body = body;
+        record.bodyLength = len;
+
+        if ( ( pState->pEdf != NULL ) &&
+             ( connected == true ) &&
+             ( Outbox_Empty( pState->pOutbox ) == true ) &&
+             ( MsgBuffer_Empty( pState->pBuffer ) == true ) &&
+             ( ( EdfQueue_Empty( pState->pEdf ) == false ) ||
+               ( InFlight( pState ) >= SendWindow( pState ) ) ||
+               ( Shaped( pState, priority ) == true ) ) )
+        {
+            result = EdfQueue_Put( pState->pEdf,
+                                   &record,
+                                   GetDeadline( headers ) );
+            if ( result == EOK )
+            {
+                RunSchedule( pState );
+            }
+            else
+            {
+                result = SendMessage( pState,
+                                      pid,
+                                      priority,
+                                      headers,
+                                      body,
+                                      len );
+            }
+        }
+        else if ( pState->pOutbox != NULL )
+        {
+            result = ( ( connected == true ) &&
+                       ( Outbox_Empty( pState->pOutbox ) == true ) &&
+                       ( Shaped( pState, priority ) == false ) )
+                     ? SendMessage( pState, pid, priority, headers, body, len )
+                     : SpillMessage( pState, &record );
+        }
+        else
+        {
+            result = ( ( connected == true ) &&
+                       ( MsgBuffer_Empty( pState->pBuffer ) == true ) &&
+                       ( Shaped( pState, priority ) == false ) )
+                     ? SendMessage( pState, pid, priority, headers, body, len )
+                     : MsgBuffer_Put( pState->pBuffer,
+                                      &record,
+                                      GetExpiry( headers ) );
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SpillMessage                                                              */
+/*!
+    Append a message to the disk outbox
+
+    The SpillMessage function appends a message to the disk outbox.
+    If the outbox is full, ingest is paused until sending the oldest
+    spilled messages makes room for it.  A message which does not fit
+    in the empty outbox is sent directly once the IOTHUB is connected.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object containing the outbox
+
+@param[in]
+    pRecord
+        pointer to the message to spill
+
+@retval EOK the message was spilled or sent
+@retval other error as returned from Outbox_Append or SendMessage
+
+==============================================================================*/
+static int SpillMessage( IOTHubState *pState, TraceRecord *pRecord )
+{
+    int result;
+    ConnStateId connState;
+    uint32_t waitMs;
+
+    while ( ( result = Outbox_Append( pState->pOutbox, pRecord ) ) == ENOSPC )
+    {
+        if ( pState->outboxFull == false )
+        {
+            fprintf( stderr,
+                     "iothub: outbox %s full: pausing ingest\n",
+                     pState->outboxDir );
+            pState->outboxFull = true;
+        }
+
+        connState = ConnState_Get( pState->pConnState, NULL );
+        waitMs = IOTHUB_POLL_MS;
+        if ( connState == CONNSTATE_CONNECTED )
+        {
+            if ( Outbox_Empty( pState->pOutbox ) == true )
+            {
+                result = SendMessage( pState,
+                                      pRecord->pid,
+                                      pRecord->priority,
+                                      (char *)pRecord->headers,
+                                      (char *)pRecord->body,
+                                      pRecord->bodyLength );
+                break;
+            }
+
+            if ( DrainBacklog( pState ) > 0 )
+            {
+                continue;
+            }
+
+            waitMs = IOTHUB_DRAIN_POLL_MS;
+        }
+
+        UpdateMetrics( pState );
+        ConnState_Wait( pState->pConnState, waitMs );
+    }
+
+    pState->outboxFull = false;
+
+    return result;
+}
+
+/*============================================================================*/
+/*  DrainBacklog                                                              */
+/*!
+    Send the spilled or buffered messages
+
+    The DrainBacklog function sends messages from the disk outbox, or
+    from the in-memory buffer if there is no outbox, oldest first,
+    while the IOTHUB is connected.  At most SendWindow messages are
+    left awaiting confirmation, so the backlog is not moved into
+    the client's memory all at once.  Messages which expired while they
+    were held are discarded instead of being sent.  Messages waiting in
+    the deadline queue are sent first, as they arrived before any of
+    the held messages.
+
+    Draining stops while the bandwidth shaper holds the next message
+    back.  Messages in the outbox are only held back by the link
+    ceiling.
+
+    A message which cannot be sent is kept in the backlog, and draining
+    stops until the next pass.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object containing the backlog
+
+@retval number of messages sent or discarded
+
+==============================================================================*/
+static int DrainBacklog( IOTHubState *pState )
+{
+    int count = 0;
+    TraceRecord record;
+    char *headers;
+    int result;
+
+    ExpireBacklog( pState );
+
+    count = RunSchedule( pState );
+
+    while ( ( InFlight( pState ) < SendWindow( pState ) ) &&
+            ( ConnState_Get( pState->pConnState, NULL ) ==
+                CONNSTATE_CONNECTED ) )
+    {
+        if ( pState->pOutbox != NULL )
+        {
+            /* spilled messages are sent in order, within the link
+               ceiling */
+            if ( ( Outbox_Empty( pState->pOutbox ) == true ) ||
+                 ( LinkShaped( pState ) == true ) ||
+                 ( Outbox_Read( pState->pOutbox, &record ) != EOK ) )
+            {
+                break;
+            }
+
+            headers = strndup( record.headers, record.headerLength );
+            result = ( headers == NULL ) ? ENOMEM
+                     : ( Expired( pState, headers ) == true ) ? EOK
+                     : SendMessage( pState,
+                                    record.pid,
+                                    record.priority,
+                                    headers,
+                                    (char *)record.body,
+                                    record.bodyLength );
+            free( headers );
+
+            if ( result != EOK )
+            {
+                /* keep the message to send on the next pass */
+                Outbox_Unread( pState->pOutbox );
+            }
+        }
+        else
+        {
+            if ( ( MsgBuffer_Peek( pState->pBuffer, &record ) != EOK ) ||
+                 ( Shaped( pState, record.priority ) == true ) )
+            {
+                break;
+            }
+
+            result = SendMessage( pState,
+                                  record.pid,
+                                  record.priority,
+                                  (char *)record.headers,
+                                  (char *)record.body,
+                                  record.bodyLength );
+            if ( result == EOK )
+            {
+                MsgBuffer_Pop( pState->pBuffer );
+            }
+        }
+
+        if ( result != EOK )
+        {
+            fprintf( stderr,
+                     "iothub: cannot send held message: %s\n",
+                     strerror( result ) );
+            break;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+/*============================================================================*/
+/*  RunSchedule                                                               */
+/*!
+    Send the messages waiting in the deadline queue
+
+    The RunSchedule function sends the messages in the deadline queue,
+    earliest deadline first, while the IOTHUB is connected and fewer
+    than SendWindow messages are awaiting confirmation.  A
+    message whose deadline has already passed is downgraded: it loses
+    its deadline and is moved behind the other waiting messages, so it
+    does not delay messages which can still meet theirs.  Expired
+    messages are discarded.  A message which cannot be sent stays in
+    the queue, and scheduling stops until the next pass.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object containing the deadline queue
+
+@retval number of messages sent or discarded
+
+==============================================================================*/
+static int RunSchedule( IOTHubState *pState )
+{
+    int count = 0;
+    TraceRecord record;
+    uint64_t deadline;
+    int result;
+
+    while ( ( InFlight( pState ) < SendWindow( pState ) ) &&
+            ( ConnState_Get( pState->pConnState, NULL ) ==
+                CONNSTATE_CONNECTED ) &&
+            ( EdfQueue_Peek( pState->pEdf, &record, &deadline ) == EOK ) )
+    {
+        if ( ( deadline != 0 ) &&
+             ( deadline < GetEpochMs() ) )
+        {
+            if ( IOTHUB_VERBOSE( pState->verbose ) )
+            {
+                fprintf( stdout,
+                         "\x1b[31mDeadline missed by %lu ms: message from "
+                         "%u downgraded\x1b[0m\n",
+                         (unsigned long)( GetEpochMs() - deadline ),
+                         record.pid );
+            }
+
+            EdfQueue_Defer( pState->pEdf );
+            continue;
+        }
+
+        if ( Expired( pState, record.headers ) == false )
+        {
+            if ( Shaped( pState, record.priority ) == true )
+            {
+                break;
+            }
+
+            result = SendMessage( pState,
+                                  record.pid,
+                                  record.priority,
+                                  (char *)record.headers,
+                                  (char *)record.body,
+                                  record.bodyLength );
+            if ( result != EOK )
+            {
+                /* keep the message to send on the next pass */
+                fprintf( stderr,
+                         "iothub: cannot send scheduled message: %s\n",
+                         strerror( result ) );
+                break;
+            }
+        }
+
+        EdfQueue_Pop( pState->pEdf );
+        count++;
+    }
+
+    return count;
+}
+
+/*============================================================================*/
+/*  IngestPaused                                                              */
+/*!
+    Determine if ingest must pause
+
+    Ingest pauses when a received message could not be sent and there
+    is no room to hold it: the in-memory buffer is full and there is no
+    disk outbox, or the deadline queue is full.  A full outbox pauses
+    ingest in SpillMessage instead.  While memory is under pressure,
+    ingest also pauses while IOTHUB_PRESSURE_WINDOW messages are held
+    in memory, leaving clients blocked on the message queue.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    connState
+        current connection state
+
+@retval true leave messages in the message queue
+@retval false receive the next message
+
+==============================================================================*/
+static bool IngestPaused( IOTHubState *pState, ConnStateId connState )
+{
+    return ( ( pState->pOutbox == NULL ) &&
+             ( ( connState != CONNSTATE_CONNECTED ) ||
+               ( MsgBuffer_Empty( pState->pBuffer ) == false ) ) &&
+             ( MsgBuffer_Full( pState->pBuffer ) == true ) ) ||
+           ( ( pState->pEdf != NULL ) &&
+             ( connState == CONNSTATE_CONNECTED ) &&
+             ( EdfQueue_Full( pState->pEdf ) == true ) ) ||
+           ( ( Pressure_Active( pState->pPressure ) == true ) &&
+             ( HeldInMemory( pState ) >= IOTHUB_PRESSURE_WINDOW ) );
+}
+
+/*============================================================================*/
+/*  InFlight                                                                  */
+/*!
+    Get the number of messages awaiting confirmation
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@retval number of messages sent but not yet confirmed
+
+==============================================================================*/
+static uint32_t InFlight( IOTHubState *pState )
+{
+    uint32_t count;
+
+    /* messages are confirmed on the client threads */
+    pthread_mutex_lock( &pState->inFlightMutex );
+    count = pState->countTxTotal - pState->countTxOK - pState->countTxErr;
+    pthread_mutex_unlock( &pState->inFlightMutex );
+
+    return count;
+}
+
+/*============================================================================*/
+/*  BacklogBytes                                                              */
+/*!
+    Get the size of the held messages
+
+    It is called after UpdateMetrics, so the held message statistics are
+    up to date.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@retval size of the messages in the outbox, the in-memory buffer and
+        the deadline queue in bytes
+
+==============================================================================*/
+static uint64_t BacklogBytes( IOTHubState *pState )
+{
+    uint64_t bytes;
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    bytes = pState->outboxStats.bytes +
+            pState->bufferStats.bytes +
+            pState->edfStats.bytes;
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    return bytes;
+}
+
+/*============================================================================*/
+/*  UpdateDutyCycle                                                           */
+/*!
+    Put the idle connection to sleep, or wake it when it is needed
+
+    In duty cycle mode the connection is closed once every held message
+    has been confirmed and the connection has been idle for
+    IOTHUB_DUTY_LINGER_MS, and messages are held until the connection
+    wakes.  The sleeping connection wakes when an urgent message
+    arrives, when the held messages reach the backlog limit or fill the
+    in-memory buffer, or when the next scheduled connection is due.
+    The backlog is then sent in a burst of up to IOTHUB_BURST_WINDOW
+    messages awaiting confirmation.
+
+    The connection thread closes the connection once it has seen it go
+    to sleep, so a connection is not resumed before then.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    connState
+        current connection state
+
+==============================================================================*/
+static void UpdateDutyCycle( IOTHubState *pState, ConnStateId connState )
+{
+    const char *reason = NULL;
+    uint32_t uploads;
+    uint64_t now;
+    bool idle;
+
+    if ( pState->dutyIntervalMs == 0 )
+    {
+        return;
+    }
+
+    now = GetTimeUs() / 1000;
+
+    if ( connState == CONNSTATE_SLEEPING )
+    {
+        if ( pState->dutyUrgent == true )
+        {
+            reason = "urgent";
+            pthread_mutex_lock( &pState->metricsMutex );
+            pState->countWakeUrgent++;
+            pthread_mutex_unlock( &pState->metricsMutex );
+        }
+        else if ( ( ( pState->dutyBacklogBytes > 0 ) &&
+                    ( BacklogBytes( pState ) >= pState->dutyBacklogBytes ) ) ||
+                  ( MsgBuffer_Full( pState->pBuffer ) == true ) )
+        {
+            reason = "backlog";
+            pthread_mutex_lock( &pState->metricsMutex );
+            pState->countWakeBacklog++;
+            pthread_mutex_unlock( &pState->metricsMutex );
+        }
+        else if ( now >= pState->dutyWakeAt )
+        {
+            reason = "schedule";
+            pthread_mutex_lock( &pState->metricsMutex );
+            pState->countWakeSchedule++;
+            pthread_mutex_unlock( &pState->metricsMutex );
+        }
+
+        pthread_mutex_lock( &pState->clientMutex );
+        idle = pState->connectionIdle;
+        pthread_mutex_unlock( &pState->clientMutex );
+
+        if ( ( reason != NULL ) &&
+             ( idle == true ) )
+        {
+            if ( IOTHUB_VERBOSE( pState->verbose ) )
+            {
+                fprintf( stderr, "iothub: waking connection (%s)\n", reason );
+            }
+
+            pState->dutyUrgent = false;
+            pState->dutyWakeAt = now + pState->dutyIntervalMs;
+            ConnState_Resume( pState->pConnState );
+        }
+    }
+    else if ( connState == CONNSTATE_CONNECTED )
+    {
+        pState->dutyUrgent = false;
+
+        pthread_mutex_lock( &pState->metricsMutex );
+        uploads = pState->uploadsActive;
+        pthread_mutex_unlock( &pState->metricsMutex );
+
+        if ( ( Outbox_Empty( pState->pOutbox ) == false ) ||
+             ( MsgBuffer_Empty( pState->pBuffer ) == false ) ||
+             ( EdfQueue_Empty( pState->pEdf ) == false ) ||
+             ( InFlight( pState ) > 0 ) ||
+             ( uploads > 0 ) )
+        {
+            pState->dutyIdleAt = 0;
+        }
+        else if ( pState->dutyIdleAt == 0 )
+        {
+            pState->dutyIdleAt = now;
+        }
+        else if ( now - pState->dutyIdleAt >= IOTHUB_DUTY_LINGER_MS )
+        {
+            /* the connection thread closes the sleeping connection */
+            ConnState_Sleep( pState->pConnState );
+            pState->dutyIdleAt = 0;
+        }
+    }
+}
+
+/*============================================================================*/
+/*  SendWindow                                                                */
+/*!
+    Get the maximum number of held messages awaiting confirmation
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@retval IOTHUB_PRESSURE_WINDOW while memory is under pressure
+@retval IOTHUB_BURST_WINDOW in duty cycle mode
+@retval IOTHUB_DRAIN_WINDOW otherwise
+@retval a smaller window chosen by the bandwidth shaper for a
+        congested link
+
+==============================================================================*/
+static uint32_t SendWindow( IOTHubState *pState )
+{
+    uint32_t window;
+
+    if ( Pressure_Active( pState->pPressure ) == true )
+    {
+        window = IOTHUB_PRESSURE_WINDOW;
+    }
+    else
+    {
+        window = ( pState->dutyIntervalMs > 0 ) ? IOTHUB_BURST_WINDOW
+                                                : IOTHUB_DRAIN_WINDOW;
+    }
+
+    if ( pState->pShaper != NULL )
+    {
+        pthread_mutex_lock( &pState->metricsMutex );
+        window = Shaper_Window( pState->pShaper, window );
+        pthread_mutex_unlock( &pState->metricsMutex );
+    }
+
+    return window;
+}
+
+/*============================================================================*/
+/*  HeldInMemory                                                              */
+/*!
+    Get the number of messages held in memory
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@retval number of messages awaiting confirmation, buffered, or waiting
+        in the deadline queue
+
+==============================================================================*/
+static size_t HeldInMemory( IOTHubState *pState )
+{
+    MsgBufferStats buffer;
+    EdfQueueStats edf;
+
+    MsgBuffer_GetStats( pState->pBuffer, &buffer );
+    EdfQueue_GetStats( pState->pEdf, &edf );
+
+    return InFlight( pState ) + buffer.count + edf.count;
+}
+
+/*============================================================================*/
+/*  UpdatePressure                                                            */
+/*!
+    Shrink or restore the memory footprint as memory pressure changes
+
+    When memory comes under pressure, the free body buffers are
+    released, the messages held in memory are spilled to the disk
+    outbox if there is one, and the freed memory is returned to the
+    system.  SendWindow and IngestPaused limit the messages held in
+    memory until the pressure clears, when the body buffer cache is
+    restored.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+==============================================================================*/
+static void UpdatePressure( IOTHubState *pState )
+{
+    size_t count;
+
+    if ( Pressure_Poll( pState->pPressure, GetTimeUs() / 1000 ) == false )
+    {
+        return;
+    }
+
+    if ( Pressure_Active( pState->pPressure ) == true )
+    {
+        /* keep a single free body buffer in each size class */
+        BodyPool_SetCacheLimit( pState->pBodyPool, 0 );
+
+        count = SpillHeld( pState );
+        pthread_mutex_lock( &pState->metricsMutex );
+        pState->countPressureSpilled += count;
+        pthread_mutex_unlock( &pState->metricsMutex );
+
+#if defined( __GLIBC__ )
+        malloc_trim( 0 );
+#endif
+
+        fprintf( stderr,
+                 "iothub: memory pressure: %lu held messages spilled\n",
+                 (unsigned long)count );
+    }
+    else
+    {
+        BodyPool_SetCacheLimit( pState->pBodyPool, pState->bodyCache );
+
+        fprintf( stderr, "iothub: memory pressure cleared\n" );
+    }
+}
+
+/*============================================================================*/
+/*  SpillHeld                                                                 */
+/*!
+    Move the messages held in memory to the disk outbox
+
+    The buffered messages are spilled before those in the deadline
+    queue, as they arrived first.  Messages which do not fit in the
+    outbox stay in memory.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@retval number of messages spilled
+
+==============================================================================*/
+static size_t SpillHeld( IOTHubState *pState )
+{
+    TraceRecord record;
+    uint64_t deadline;
+    size_t count = 0;
+
+    if ( pState->pOutbox == NULL )
+    {
+        return 0;
+    }
+
+    while ( ( MsgBuffer_Peek( pState->pBuffer, &record ) == EOK ) &&
+            ( Outbox_Append( pState->pOutbox, &record ) == EOK ) )
+    {
+        MsgBuffer_Pop( pState->pBuffer );
+        count++;
+    }
+
+    while ( ( EdfQueue_Peek( pState->pEdf, &record, &deadline ) == EOK ) &&
+            ( Outbox_Append( pState->pOutbox, &record ) == EOK ) )
+    {
+        EdfQueue_Pop( pState->pEdf );
+        count++;
+    }
+
+    return count;
+}
+
+/*============================================================================*/
+/*  GetBody                                                                   */
+/*!
+    Get the message body from the client application
+
+    The GetBody function tries to read the message body from the client
+    application which sent the message headers to the IOT message queue.
+    It does this by reading the client's IOT FIFO.
+
+    The body is read into a buffer from the body pool by ReadBody.
+    When chunking is enabled, a body which fills the first chunk is
+    left open for StreamBody to send the rest, and its FIFO is returned
+    to the caller.  Otherwise bodies longer than the maximum body size
+    are truncated and counted.  The caller returns the buffer to the
+    pool with BodyPool_Free.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object which provides the body pool
+
+@param[in]
+    pid
+        process id of the client application used to construct the FIFO name
+
+@param[out]
+    pFd
+        pointer to a location to store the open FIFO if the body continues
+        past the first chunk, or -1 if the whole body was read
+
+@param[out]
+    body
+        pointer to a location to store the pointer to the received msg body
+
+@param[out]
+    len
+        pointer to a location to store the received body length
+
+@retval EOK a message body was successfully retrieved
+@retval EINVAL invalid arguments
+@retval ENOMEM no receive buffer is available
+@retval other error as returned from open or read
+
+==============================================================================*/
+static int GetBody( IOTHubState *pState,
+                    uint32_t pid,
+                    int *pFd,
+                    char **body,
+                    size_t *len )
+{
+    int fd;
+    char fifoName[64];
+    size_t limit;
+    char c;
+    int result = EINVAL;
+
+    if ( ( pState != NULL ) &&
+         ( pFd != NULL ) &&
+         ( body != NULL ) &&
+         ( len != NULL ) )
+    {
+        *pFd = -1;
+        limit = ( pState->chunkSize > 0 ) ? pState->chunkSize
+                                          : pState->bodyMax;
+
+        /* construct the FIFO to read the message body from */
+        sprintf(fifoName, "/tmp/iothub_%d", pid );
+
+        /* open the FIFO */
+        fd = open( fifoName, O_RDONLY );
+        if ( fd != -1 )
+        {
+            result = ReadBody( pState, fd, limit, body, len );
+            if ( ( result == EOK ) &&
+                 ( *len == limit ) &&
+                 ( pState->chunkSize > 0 ) )
+            {
+                /* the body may continue in further chunks */
+                *pFd = fd;
+            }
+            else
+            {
+                if ( ( result == EOK ) &&
+                     ( *len == limit ) &&
+                     ( read( fd, &c, 1 ) == 1 ) )
+                {
+                    pthread_mutex_lock( &pState->metricsMutex );
+                    pState->countTruncated++;
+                    pthread_mutex_unlock( &pState->metricsMutex );
+                    fprintf( stderr,
+                             "iothub: body from %u truncated at %zu bytes\n",
+                             pid,
+                             limit );
+                }
+
+                /* close the FIFO */
+                close( fd );
+            }
+        }
+        else
+        {
+            result = errno;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ReadBody                                                                  */
+/*!
+    Read a message body, or one chunk of it, from a client FIFO
+
+    The ReadBody function reads from the FIFO until the end of the body
+    or until the limit is reached.  The body is read into a buffer from
+    the body pool, starting with the smallest size class and moving to
+    the next class up whenever the buffer fills, so small bodies only
+    occupy small buffers.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object which provides the body pool
+
+@param[in]
+    fd
+        FIFO to read the body from
+
+@param[in]
+    limit
+        maximum number of bytes to read.  Must not exceed the maximum
+        body size
+
+@param[out]
+    body
+        pointer to a location to store the pointer to the received body
+
+@param[out]
+    len
+        pointer to a location to store the received length.  It is less
+        than the limit only at the end of the body
+
+@retval EOK the body was read
+@retval ENOMEM no receive buffer is available
+@retval other error as returned from read
+
+==============================================================================*/
+static int ReadBody( IOTHubState *pState,
+                     int fd,
+                     size_t limit,
+                     char **body,
+                     size_t *len )
+{
+    size_t totalBytes = 0;
+    size_t capacity;
+    size_t avail;
+    ssize_t n;
+    char *rxBuf;
+    char *newBuf;
+    int result = ENOMEM;
+
+    /* get a buffer from the smallest size class */
+    rxBuf = BodyPool_Alloc( pState->pBodyPool, 0, &capacity );
+    if ( rxBuf != NULL )
+    {
+        do
+        {
+            /* move to a larger buffer once this one is full */
+            if ( totalBytes == capacity )
+            {
+                newBuf = BodyPool_Grow( pState->pBodyPool,
+                                        rxBuf,
+                                        totalBytes,
+                                        &capacity );
+                if ( newBuf == NULL )
+                {
+                    /* stop at the maximum body size */
+                    n = ( errno == EMSGSIZE ) ? 0 : -1;
+                    result = ENOMEM;
+                    break;
+                }
+
+                rxBuf = newBuf;
+            }
+
+            /* read as much as the buffer can hold */
+            avail = ( capacity < limit ) ? capacity : limit;
+            n = read( fd, &rxBuf[totalBytes], avail - totalBytes );
+            if ( n > 0 )
+            {
+                /* update the received bytes */
+                totalBytes += n;
+            }
+            else if ( n == -1 )
+            {
+                result = errno;
+            }
+        } while ( ( n > 0 ) && ( totalBytes < limit ) );
+
+        if ( n >= 0 )
+        {
+            /* read completed without error */
+            *body = rxBuf;
+            *len = totalBytes;
+            result = EOK;
+        }
+        else
+        {
+            BodyPool_Free( pState->pBodyPool, rxBuf );
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ReadAll                                                                   */
+/*!
+    Read a buffer from a client FIFO
+
+@param[in]
+    fd
+        FIFO to read from
+
+@param[out]
+    buf
+        pointer to the buffer to fill
+
+@param[in]
+    len
+        number of bytes to read
+
+@retval EOK the buffer was filled
+@retval EPIPE the FIFO was closed
+@retval other error as returned from read
+
+==============================================================================*/
+static int ReadAll( int fd, void *buf, size_t len )
+{
+    char *p = buf;
+    ssize_t n;
+
+    while ( len > 0 )
+    {
+        n = read( fd, p, len );
+        if ( n > 0 )
+        {
+            p += n;
+            len -= n;
+        }
+        else if ( n == 0 )
+        {
+            return EPIPE;
+        }
+        else if ( errno != EINTR )
+        {
+            return errno;
+        }
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  SkipAll                                                                   */
+/*!
+    Read and discard bytes from a client FIFO
+
+@param[in]
+    fd
+        FIFO to read from
+
+@param[in]
+    len
+        number of bytes to discard
+
+@retval EOK the bytes were discarded
+@retval EPIPE the FIFO was closed
+@retval other error as returned from read
+
+==============================================================================*/
+static int SkipAll( int fd, size_t len )
+{
+    char discard[512];
+    size_t n;
+    int result = EOK;
+
+    while ( ( result == EOK ) && ( len > 0 ) )
+    {
+        n = ( len < sizeof( discard ) ) ? len : sizeof( discard );
+        result = ReadAll( fd, discard, n );
+        len -= n;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  DiscardFifo                                                               */
+/*!
+    Discard whatever is waiting in a client FIFO
+
+    The DiscardFifo function reads the FIFO without blocking until it
+    is empty, so a client which is stuck does not hold up the service.
+
+@param[in]
+    fd
+        FIFO to empty
+
+==============================================================================*/
+static void DiscardFifo( int fd )
+{
+    char discard[512];
+    ssize_t n;
+    int flags;
+
+    flags = fcntl( fd, F_GETFL );
+    if ( ( flags != -1 ) &&
+         ( fcntl( fd, F_SETFL, flags | O_NONBLOCK ) != -1 ) )
+    {
+        do
+        {
+            n = read( fd, discard, sizeof( discard ) );
+        } while ( ( n > 0 ) || ( ( n == -1 ) && ( errno == EINTR ) ) );
+    }
+}
+
+/*============================================================================*/
+/*  StreamBody                                                                */
+/*!
+    Send a large message body in chunks as it is read
+
+    The StreamBody function sends a body which fills the first chunk as
+    a stream of messages of at most the chunk size, reading one chunk
+    ahead of the chunk being sent so the last chunk can be marked.  At
+    most two chunks are held in memory, and the client writing the body
+    is held back by its FIFO while the send window is full.
+
+    Each chunk carries the client's headers and the properties:
+
+    messageId: the stream identifier followed by '.' and the sequence
+    streamId: the client's messageId, or a generated identifier
+    chunkSeq: the sequence number of the chunk, starting at 0
+    chunkCount: the number of chunks in the stream
+
+    The chunk count is known once the body has been read, so it is
+    always set on the last chunk.  If the client declares the body size
+    in a streamLength header, the count is also set on every other
+    chunk.  A body which ends with the first chunk is sent unchanged.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    fd
+        FIFO to read the rest of the body from
+
+@param[in]
+    pid
+        process id of the client which sent the message
+
+@param[in]
+    priority
+        message queue priority of the header frame
+
+@param[in]
+    headers
+        pointer to the NUL terminated client headers
+
+@param[in]
+    body
+        pointer to the first chunk, which is returned to the body pool
+
+@param[in]
+    len
+        length of the first chunk
+
+@retval EOK every chunk was sent, spilled or buffered
+@retval ENOMEM no memory for the chunk headers
+@retval other error as returned from ReadBody or ForwardMessage
+
+==============================================================================*/
+static int StreamBody( IOTHubState *pState,
+                       int fd,
+                       uint32_t pid,
+                       unsigned int priority,
+                       char *headers,
+                       char *body,
+                       size_t len )
+{
+    int result = EOK;
+    int rc;
+    char streamId[MESSAGE_ID_SIZE];
+    char *chunkHeaders;
+    size_t size;
+    size_t headerLength;
+    const char *p;
+    size_t n;
+    uint32_t declared = 0;
+    uint32_t seq = 0;
+    char *next;
+    size_t nextLen;
+    bool last;
+
+    size = strlen( headers ) + IOTHUB_CHUNK_HEADER_SIZE;
+    chunkHeaders = malloc( size );
+    if ( chunkHeaders == NULL )
+    {
+        BodyPool_Free( pState->pBodyPool, body );
+        return ENOMEM;
+    }
+
+    /* identify the stream by the client's message id if it has one */
+    p = FindHeader( headers, "messageId", &n );
+    if ( ( p != NULL ) && ( n > 0 ) && ( n < sizeof( streamId ) ) )
+    {
+        memcpy( streamId, p, n );
+        streamId[n] = '\0';
+    }
+    else
+    {
+        GenerateMessageId( streamId, sizeof( streamId ) );
+    }
+
+    /* get the chunk count from the declared body size */
+    p = FindHeader( headers, "streamLength", &n );
+    if ( p != NULL )
+    {
+        declared = ( strtoull( p, NULL, 0 ) + pState->chunkSize - 1 ) /
+                   pState->chunkSize;
+    }
+
+    while ( body != NULL )
+    {
+        /* read ahead to find out if this is the last chunk */
+        rc = ReadBody( pState, fd, pState->chunkSize, &next, &nextLen );
+        if ( rc != EOK )
+        {
+            fprintf( stderr,
+                     "iothub: stream %s from %u failed: %s\n",
+                     streamId,
+                     pid,
+                     strerror( rc ) );
+            result = rc;
+            next = NULL;
+        }
+        else if ( nextLen == 0 )
+        {
+            BodyPool_Free( pState->pBodyPool, next );
+            next = NULL;
+        }
+
+        /* a failed stream is never marked complete */
+        last = ( next == NULL ) && ( rc == EOK );
+
+        if ( ( seq == 0 ) && ( last == true ) )
+        {
+            /* the body fitted in a single chunk */
+            rc = ForwardMessage( pState,
+                                 pid,
+                                 priority,
+                                 headers,
+                                 strlen( headers ),
+                                 body,
+                                 len );
+        }
+        else
+        {
+            headerLength = ChunkHeaders( chunkHeaders,
+                                         size,
+                                         headers,
+                                         streamId,
+                                         seq,
+                                         last ? seq + 1 : declared );
+
+            WaitChunkWindow( pState );
+            rc = ForwardMessage( pState,
+                                 pid,
+                                 priority,
+                                 chunkHeaders,
+                                 headerLength,
+                                 body,
+                                 len );
+            pthread_mutex_lock( &pState->metricsMutex );
+            pState->countChunks++;
+            pthread_mutex_unlock( &pState->metricsMutex );
+        }
+
+        if ( ( rc != EOK ) && ( result == EOK ) )
+        {
+            result = rc;
+        }
+
+        /* the chunk has been copied for delivery */
+        BodyPool_Free( pState->pBodyPool, body );
+        body = next;
+        len = nextLen;
+        seq++;
+    }
+
+    if ( seq > 1 )
+    {
+        pthread_mutex_lock( &pState->metricsMutex );
+        pState->countStreams++;
+        pthread_mutex_unlock( &pState->metricsMutex );
+    }
+
+    free( chunkHeaders );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ChunkHeaders                                                              */
+/*!
+    Build the headers of one chunk of a streamed message body
+
+    The ChunkHeaders function copies the client's headers into the
+    buffer and appends the chunk properties described in StreamBody.
+    The chunk messageId follows the client's headers so it replaces
+    any messageId set by the client.
+
+@param[out]
+    buf
+        pointer to the buffer to build the headers in
+
+@param[in]
+    size
+        size of the buffer.  It must hold the client's headers and
+        IOTHUB_CHUNK_HEADER_SIZE more bytes
+
+@param[in]
+    headers
+        pointer to the NUL terminated client headers
+
+@param[in]
+    streamId
+        identifier of the stream
+
+@param[in]
+    seq
+        sequence number of the chunk
+
+@param[in]
+    count
+        number of chunks in the stream, or 0 if it is not yet known
+
+@retval length of the chunk headers
+
+==============================================================================*/
+static size_t ChunkHeaders( char *buf,
+                            size_t size,
+                            char *headers,
+                            const char *streamId,
+                            uint32_t seq,
+                            uint32_t count )
+{
+    const char *end;
+    size_t len;
+    int n;
+
+    /* the client's properties end at the first empty line */
+    end = strstr( headers, "\n\n" );
+    len = ( end != NULL ) ? (size_t)( end - headers ) : strlen( headers );
+    while ( ( len > 0 ) && ( headers[len - 1] == '\n' ) )
+    {
+        len--;
+    }
+
+    n = snprintf( buf,
+                  size,
+                  "%.*s%smessageId:%s.%u\nstreamId:%s\nchunkSeq:%u\n",
+                  (int)len,
+                  headers,
+                  ( len > 0 ) ? "\n" : "",
+                  streamId,
+                  seq,
+                  streamId,
+                  seq );
+    if ( count > 0 )
+    {
+        n += snprintf( &buf[n], size - n, "chunkCount:%u\n", count );
+    }
+
+    n += snprintf( &buf[n], size - n, "\n" );
+
+    return n;
+}
+
+/*============================================================================*/
+/*  FindHeader                                                                */
+/*!
+    Find a property in the client headers
+
+@param[in]
+    headers
+        pointer to the NUL terminated client headers
+
+@param[in]
+    key
+        name of the property to find
+
+@param[out]
+    len
+        pointer to a location to store the length of the property value
+
+@retval pointer to the property value, terminated by a linefeed or NUL
+@retval NULL the property was not found
+
+==============================================================================*/
+static const char *FindHeader( const char *headers,
+                               const char *key,
+                               size_t *len )
+{
+    const char *p = headers;
+    const char *pValue = NULL;
+    size_t keyLen = strlen( key );
+
+    while ( ( p != NULL ) &&
+            ( *p != '\0' ) &&
+            ( *p != '\n' ) )
+    {
+        if ( ( strncmp( p, key, keyLen ) == 0 ) &&
+             ( p[keyLen] == ':' ) )
+        {
+            pValue = &p[keyLen + 1];
+            *len = strcspn( pValue, "\n" );
+            break;
+        }
+
+        p = strchr( p, '\n' );
+        if ( p != NULL )
+        {
+            p++;
+        }
+    }
+
+    return pValue;
+}
+
+/*============================================================================*/
+/*  WaitChunkWindow                                                           */
+/*!
+    Wait for room to send the next chunk of a streamed body
+
+    The WaitChunkWindow function waits while SendWindow messages are
+    awaiting confirmation, or while ingest is paused, so a stream is
+    not moved into the client's memory, or the in-memory buffer, faster
+    than it can be sent.  Held messages are sent first while connected
+    so the chunks stay in order behind them.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+==============================================================================*/
+static void WaitChunkWindow( IOTHubState *pState )
+{
+    ConnStateId connState;
+    uint32_t waitMs;
+    bool wait = true;
+
+    while ( wait == true )
+    {
+        connState = ConnState_Get( pState->pConnState, NULL );
+        waitMs = IOTHUB_POLL_MS;
+        if ( connState == CONNSTATE_CONNECTED )
+        {
+            DrainBacklog( pState );
+            waitMs = IOTHUB_DRAIN_POLL_MS;
+        }
+        else
+        {
+            ExpireBacklog( pState );
+        }
+
+        wait = ( ( connState == CONNSTATE_CONNECTED ) &&
+                 ( InFlight( pState ) >= SendWindow( pState ) ) ) ||
+               ( IngestPaused( pState, connState ) == true );
+        if ( wait == true )
+        {
+            UpdateMetrics( pState );
+            ConnState_Wait( pState->pConnState, waitMs );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  AddExpiry                                                                 */
+/*!
+    Fix the expiry time of a message with a time to live
+
+    A client sets the time to live of a message in seconds with a ttl
+    header, or its expiry time in seconds since the epoch with an expiry
+    header.  The AddExpiry function turns a time to live into an expiry
+    header when the message is received, so the expiry time travels
+    with the message through the outbox, the in-memory buffer and a
+    handoff, and survives a restart.  A message with an expiry header
+    is left unchanged.
+
+@param[in,out]
+    headers
+        pointer to the NUL terminated client headers
+
+@param[in]
+    length
+        length of the header frame contents
+
+@param[in]
+    size
+        size of the headers buffer.  It must hold the client's headers
+        and IOTHUB_EXPIRY_HEADER_SIZE more bytes
+
+@retval length of the header frame contents
+
+==============================================================================*/
+static size_t AddExpiry( char *headers, size_t length, size_t size )
+{
+    const char *pTTL;
+    char *pEnd;
+    unsigned long long ttl;
+    size_t n;
+
+    pTTL = FindHeader( headers, "ttl", &n );
+    if ( ( pTTL == NULL ) ||
+         ( FindHeader( headers, "expiry", &n ) != NULL ) )
+    {
+        return length;
+    }
+
+    ttl = strtoull( pTTL, &pEnd, 10 );
+    if ( ( pEnd == pTTL ) ||
+         ( ( *pEnd != '\n' ) && ( *pEnd != '\0' ) ) )
+    {
+        return length;
+    }
+
+    return AppendHeader( headers,
+                         size,
+                         "expiry",
+                         (unsigned long long)time( NULL ) + ttl );
+}
+
+/*============================================================================*/
+/*  AddDeadline                                                               */
+/*!
+    Fix the deadline of a message with a delivery deadline
+
+    A client sets the delivery deadline of a message in milliseconds
+    with a deadline header.  The AddDeadline function adds a
+    deadlineTime header holding the deadline in milliseconds since the
+    epoch when the message is received, so the deadline is measured
+    from the time the message was received wherever it is held.  A
+    message with a deadlineTime header is left unchanged.
+
+@param[in,out]
+    headers
+        pointer to the NUL terminated client headers
+
+@param[in]
+    length
+        length of the header frame contents
+
+@param[in]
+    size
+        size of the headers buffer.  It must hold the client's headers
+        and IOTHUB_DEADLINE_HEADER_SIZE more bytes
+
+@retval length of the header frame contents
+
+==============================================================================*/
+static size_t AddDeadline( char *headers, size_t length, size_t size )
+{
+    const char *pDeadline;
+    char *pEnd;
+    unsigned long long deadline;
+    size_t n;
+
+    pDeadline = FindHeader( headers, "deadline", &n );
+    if ( ( pDeadline == NULL ) ||
+         ( FindHeader( headers, "deadlineTime", &n ) != NULL ) )
+    {
+        return length;
+    }
+
+    deadline = strtoull( pDeadline, &pEnd, 10 );
+    if ( ( pEnd == pDeadline ) ||
+         ( ( *pEnd != '\n' ) && ( *pEnd != '\0' ) ) )
+    {
+        return length;
+    }
+
+    return AppendHeader( headers,
+                         size,
+                         "deadlineTime",
+                         (unsigned long long)GetEpochMs() + deadline );
+}
+
+/*============================================================================*/
+/*  AppendHeader                                                              */
+/*!
+    Append a numeric property to the client headers
+
+    The property is added after the last of the client's properties,
+    and the headers are terminated with an empty line.
+
+@param[in,out]
+    headers
+        pointer to the NUL terminated client headers
+
+@param[in]
+    size
+        size of the headers buffer
+
+@param[in]
+    key
+        name of the property to add
+
+@param[in]
+    value
+        value of the property
+
+@retval length of the headers
+
+==============================================================================*/
+static size_t AppendHeader( char *headers,
+                            size_t size,
+                            const char *key,
+                            unsigned long long value )
+{
+    const char *end;
+    size_t len;
+
+    /* the client's properties end at the first empty line */
+    end = strstr( headers, "\n\n" );
+    len = ( end != NULL ) ? (size_t)( end - headers ) : strlen( headers );
+    while ( ( len > 0 ) && ( headers[len - 1] == '\n' ) )
+    {
+        len--;
+    }
+
+    len += snprintf( &headers[len],
+                     size - len,
+                     "%s%s:%llu\n\n",
+                     ( len > 0 ) ? "\n" : "",
+                     key,
+                     value );
+
+    return len;
+}
+
+/*============================================================================*/
+/*  GetExpiry                                                                 */
+/*!
+    Get the expiry time of a message
+
+@param[in]
+    headers
+        pointer to the NUL terminated message headers
+
+@retval expiry time of the message in seconds since the epoch
+@retval 0 the message does not expire
+
+==============================================================================*/
+static uint64_t GetExpiry( const char *headers )
+{
+    const char *p;
+    size_t n;
+
+    p = ( headers != NULL ) ? FindHeader( headers, "expiry", &n ) : NULL;
+
+    return ( p != NULL ) ? strtoull( p, NULL, 10 ) : 0;
+}
+
+/*============================================================================*/
+/*  GetDeadline                                                               */
+/*!
+    Get the delivery deadline of a message
+
+@param[in]
+    headers
+        pointer to the NUL terminated message headers
+
+@retval deadline of the message in milliseconds since the epoch
+@retval 0 the message has no deadline
+
+==============================================================================*/
+static uint64_t GetDeadline( const char *headers )
+{
+    const char *p;
+    size_t n;
+
+    p = ( headers != NULL ) ? FindHeader( headers, "deadlineTime", &n )
+                            : NULL;
+
+    return ( p != NULL ) ? strtoull( p, NULL, 10 ) : 0;
+}
+
+/*============================================================================*/
+/*  Expired                                                                   */
+/*!
+    Determine if a message has expired
+
+    A message is kept until the whole second after its expiry time has
+    begun, so it is held for at least its time to live.  Expired
+    messages are counted.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    headers
+        pointer to the NUL terminated message headers
+
+@retval true the message has expired and must be discarded
+@retval false the message can be sent
+
+==============================================================================*/
+static bool Expired( IOTHubState *pState, const char *headers )
+{
+    uint64_t expiry = GetExpiry( headers );
+
+    if ( ( expiry != 0 ) &&
+         ( expiry < (uint64_t)time( NULL ) ) )
+    {
+        pthread_mutex_lock( &pState->metricsMutex );
+        pState->countExpired++;
+        pthread_mutex_unlock( &pState->metricsMutex );
+        return true;
+    }
+
+    return false;
+}
+
+/*============================================================================*/
+/*  ExpireBacklog                                                             */
+/*!
+    Discard the expired messages from the in-memory buffer
+
+    The buffer indexes its messages by expiry time, so this only costs
+    a comparison when no message has expired.  Expired messages in the
+    disk outbox are discarded as they are read back by DrainBacklog.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+==============================================================================*/
+static void ExpireBacklog( IOTHubState *pState )
+{
+    size_t count;
+
+    count = MsgBuffer_Expire( pState->pBuffer, (uint64_t)time( NULL ) );
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    pState->countExpired += count;
+    pthread_mutex_unlock( &pState->metricsMutex );
+}
+
+/*============================================================================*/
+/*  ShedMessage                                                               */
+/*!
+    Apply the load shedding policy to a received message
+
+    While the uplink cannot keep up, the ShedMessage function decides
+    whether a received message is shed for its priority or by sampling
+    its stream.  A message which is kept replaces the held messages
+    with the same value of the key header of the latest rule.  Every
+    shed message is accounted to its client and stream.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    pid
+        process id of the client which sent the message
+
+@param[in]
+    priority
+        message queue priority of the message
+
+@param[in]
+    headers
+        pointer to the NUL terminated message headers
+
+@param[in]
+    len
+        length of the message body
+
+@retval true the message is shed
+@retval false the message is kept
+
+==============================================================================*/
+static bool ShedMessage( IOTHubState *pState,
+                         uint32_t pid,
+                         unsigned int priority,
+                         const char *headers,
+                         size_t len )
+{
+    ShedReason reason;
+    ShedMatch match;
+    const char *stream;
+    size_t streamLength = 0;
+
+    if ( Shed_Enabled( pState->pShed ) == false )
+    {
+        return false;
+    }
+
+    stream = FindHeader( headers, "stream", &streamLength );
+
+    pthread_mutex_lock( &pState->metricsMutex );
+
+    reason = Shed_Admit( pState->pShed,
+                         pid,
+                         priority,
+                         stream,
+                         streamLength,
+                         strlen( headers ) + len );
+
+    match.key = Shed_LatestKey( pState->pShed );
+    if ( ( reason == SHED_KEEP ) &&
+         ( match.key != NULL ) )
+    {
+        match.value = FindHeader( headers, match.key, &match.length );
+        if ( match.value != NULL )
+        {
+            match.pState = pState;
+            MsgBuffer_RemoveIf( pState->pBuffer, Supersede, &match );
+            EdfQueue_RemoveIf( pState->pEdf, Supersede, &match );
+        }
+    }
+
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    if ( ( reason != SHED_KEEP ) &&
+         ( IOTHUB_VERBOSE( pState->verbose ) ) )
+    {
+        fprintf( stdout,
+                 "shed message from %u (%s)\n",
+                 pid,
+                 Shed_ReasonName( reason ) );
+    }
+
+    return ( reason != SHED_KEEP );
+}
+
+/*============================================================================*/
+/*  Supersede                                                                 */
+/*!
+    Select a held message replaced by a newer one
+
+    The Supersede function is called with the metrics mutex held for
+    each message held in memory, and accounts for the messages it
+    selects as shed by the latest rule.
+
+@param[in]
+    pRecord
+        pointer to the held message
+
+@param[in]
+    arg
+        pointer to the ShedMatch describing the newer message
+
+@retval true the held message is replaced
+@retval false the held message is kept
+
+==============================================================================*/
+static bool Supersede( const TraceRecord *pRecord, void *arg )
+{
+    ShedMatch *pMatch = (ShedMatch *)arg;
+    const char *value;
+    const char *stream;
+    size_t length;
+    size_t streamLength = 0;
+
+    value = FindHeader( pRecord->headers, pMatch->key, &length );
+    if ( ( value == NULL ) ||
+         ( length != pMatch->length ) ||
+         ( strncmp( value, pMatch->value, length ) != 0 ) )
+    {
+        return false;
+    }
+
+    stream = FindHeader( pRecord->headers, "stream", &streamLength );
+    Shed_Record( pMatch->pState->pShed,
+                 SHED_LATEST,
+                 pRecord->pid,
+                 stream,
+                 streamLength,
+                 pRecord->headerLength + pRecord->bodyLength );
+
+    if ( IOTHUB_VERBOSE( pMatch->pState->verbose ) )
+    {
+        fprintf( stdout,
+                 "shed message from %u (%s)\n",
+                 pRecord->pid,
+                 Shed_ReasonName( SHED_LATEST ) );
+    }
+
+    return true;
+}
+
+/*============================================================================*/
+/*  UpdateShedding                                                            */
+/*!
+    Update the load shedding level from the current load
+
+    The load is measured by the size of the messages held in memory and
+    on disk, the number of messages awaiting confirmation, and the
+    smoothed confirmation time while messages are awaiting confirmation.
+    It is called after UpdateMetrics, so the held message statistics are
+    up to date.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+==============================================================================*/
+static void UpdateShedding( IOTHubState *pState )
+{
+    ShedLoad load;
+    ShedStats before;
+    ShedStats after;
+
+    if ( Shed_Enabled( pState->pShed ) == false )
+    {
+        return;
+    }
+
+    load.inFlight = InFlight( pState );
+    pthread_mutex_lock( &pState->inFlightMutex );
+    load.waitMs = ( load.inFlight > 0 )
+                  ? (uint32_t)( pState->confirmWaitUs / 1000 )
+                  : 0;
+    pthread_mutex_unlock( &pState->inFlightMutex );
+
+    load.backlogBytes = BacklogBytes( pState );
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    Shed_GetStats( pState->pShed, &before );
+    Shed_Update( pState->pShed, &load, GetTimeUs() / 1000 );
+    Shed_GetStats( pState->pShed, &after );
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    if ( ( after.level != before.level ) &&
+         ( IOTHUB_VERBOSE( pState->verbose ) ) )
+    {
+        fprintf( stdout,
+                 "shedding level %u (backlog %lu bytes, %u in flight, "
+                 "wait %u ms)\n",
+                 after.level,
+                 (unsigned long)load.backlogBytes,
+                 load.inFlight,
+                 load.waitMs );
+    }
+}
+
+/*============================================================================*/
+/*  Shaped                                                                    */
+/*!
+    Determine if the bandwidth shaper holds a message back
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    priority
+        message queue priority of the message
+
+@retval true the message must wait for its link or class ceiling, or
+        for room in the shaper's window on a congested link
+@retval false the message may be sent now
+
+==============================================================================*/
+static bool Shaped( IOTHubState *pState, unsigned int priority )
+{
+    uint32_t inFlight;
+    bool ready;
+
+    if ( pState->pShaper == NULL )
+    {
+        return false;
+    }
+
+    inFlight = InFlight( pState );
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    ready = ( inFlight < Shaper_Window( pState->pShaper, UINT32_MAX ) ) &&
+            ( Shaper_Ready( pState->pShaper,
+                            priority,
+                            GetTimeUs() / 1000 ) == true );
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    return ( ready == false );
+}
+
+/*============================================================================*/
+/*  LinkShaped                                                                */
+/*!
+    Determine if the link ceiling holds messages back
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@retval true messages must wait for the link ceiling
+@retval false a message may be sent now
+
+==============================================================================*/
+static bool LinkShaped( IOTHubState *pState )
+{
+    bool ready;
+
+    if ( pState->pShaper == NULL )
+    {
+        return false;
+    }
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    ready = Shaper_LinkReady( pState->pShaper, GetTimeUs() / 1000 );
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    return ( ready == false );
+}
+
+/*============================================================================*/
+/*  UpdateShaping                                                             */
+/*!
+    Estimate the uplink bandwidth and adapt to the link quality
+
+    The bandwidth shaper is given the confirmed bytes, the backlog and
+    the confirmation time, and chooses the compression level and the
+    number of messages awaiting confirmation for the link quality.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+==============================================================================*/
+static void UpdateShaping( IOTHubState *pState )
+{
+    ShaperSample sample;
+    ShaperStats before;
+    ShaperStats after;
+
+    if ( Shaper_Enabled( pState->pShaper ) == false )
+    {
+        return;
+    }
+
+    sample.inFlight = InFlight( pState );
+    pthread_mutex_lock( &pState->inFlightMutex );
+    sample.confirmedBytes = pState->confirmedBytes;
+    sample.waitMs = ( sample.inFlight > 0 )
+                    ? (uint32_t)( pState->confirmWaitUs / 1000 )
+                    : 0;
+    pthread_mutex_unlock( &pState->inFlightMutex );
+
+    sample.backlogBytes = BacklogBytes( pState );
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    Shaper_GetStats( pState->pShaper, &before );
+    Shaper_Update( pState->pShaper, &sample, GetTimeUs() / 1000 );
+    Shaper_GetStats( pState->pShaper, &after );
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    if ( ( after.quality != before.quality ) &&
+         ( IOTHUB_VERBOSE( pState->verbose ) ) )
+    {
+        fprintf( stdout,
+                 "link quality %s (estimate %lu bytes/s, wait %u ms, "
+                 "compression %d, window %u)\n",
+                 Shaper_QualityName( after.quality ),
+                 (unsigned long)after.estimate,
+                 sample.waitMs,
+                 after.level,
+                 after.window );
+    }
+}
+
+/*============================================================================*/
+/*  StartUpload                                                               */
+/*!
+    Start a file upload requested by a client
+
+    The StartUpload function uploads the file named by the upload header
+    of a client message to the blob named by its blob header, or by the
+    file name if there is none.  A client which names a message queue in
+    a replyTo header receives progress reports on it.  The file is sent
+    in blocks by the SDK's upload thread, or the stand-in's, beside the
+    telemetry connection, so the upload does not hold up messages.
+
+    At most IOTHUB_MAX_UPLOADS uploads run at a time.  Further requests,
+    and requests made while the hub is not connected, are refused and
+    the client is told.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    pid
+        process id of the client which requested the upload.  Only the
+        client's own files can be uploaded unless it runs as root.  The
+        client is identified by the owner of its FIFO, which must also
+        own the process.
+
+@param[in]
+    headers
+        pointer to the NUL terminated request headers
+
+@retval EOK the upload was started
+@retval EINVAL invalid request
+@retval ESRCH the client process does not exist
+@retval EACCES the FIFO and the process have different owners
+@retval EBUSY too many uploads are in progress
+@retval ENOTCONN the hub is not connected
+@retval EIO the upload could not be started
+@retval ENOTSUP the SDK was built without blob uploads
+@retval other error as returned from Upload_Create
+
+==============================================================================*/
+static int StartUpload( IOTHubState *pState,
+                        uint32_t pid,
+                        const char *headers )
+{
+    int result = EINVAL;
+    char path[PATH_MAX];
+    char blobName[UPLOAD_MAX_BLOB_NAME];
+    char replyTo[NAME_MAX];
+    const char *pReplyTo = NULL;
+    char procName[64];
+    const char *p;
+    size_t len;
+    struct stat st;
+    struct stat fifo;
+    bool busy;
+    Upload *pUpload;
+    IOTHUB_CLIENT_RESULT icr = IOTHUB_CLIENT_ERROR;
+
+    p = FindHeader( headers, "upload", &len );
+    if ( ( p == NULL ) || ( len == 0 ) || ( len >= sizeof( path ) ) )
+    {
+        return EINVAL;
+    }
+
+    memcpy( path, p, len );
+    path[len] = '\0';
+
+    p = FindHeader( headers, "blob", &len );
+    if ( ( p == NULL ) || ( len == 0 ) )
+    {
+        p = strrchr( path, '/' );
+        p = ( p != NULL ) ? p + 1 : path;
+        len = strlen( p );
+    }
+
+    snprintf( blobName, sizeof( blobName ), "%.*s", (int)len, p );
+
+    p = FindHeader( headers, "replyTo", &len );
+    if ( p != NULL )
+    {
+        snprintf( replyTo, sizeof( replyTo ), "%.*s", (int)len, p );
+        pReplyTo = replyTo;
+    }
+
+    /* the client may only upload its own files.  The pid in the request
+       is not verified, so the owner is taken from the client's FIFO,
+       which its creator owns, and must match the owner of the process */
+    snprintf( procName, sizeof( procName ), "/tmp/iothub_%u", pid );
+    if ( lstat( procName, &fifo ) == -1 )
+    {
+        return errno;
+    }
+
+    if ( !S_ISFIFO( fifo.st_mode ) )
+    {
+        return EACCES;
+    }
+
+    snprintf( procName, sizeof( procName ), "/proc/%u", pid );
+    if ( stat( procName, &st ) == -1 )
+    {
+        return ESRCH;
+    }
+
+    if ( st.st_uid != fifo.st_uid )
+    {
+        return EACCES;
+    }
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    busy = ( pState->uploadsActive >= IOTHUB_MAX_UPLOADS );
+    pState->uploadsActive++;
+    pState->countUploads++;
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    /* the upload calls UploadDone however it ends */
+    result = Upload_Create( &pUpload,
+                            path,
+                            blobName,
+                            pReplyTo,
+                            fifo.st_uid,
+                            pState->uploadBlockSize,
+                            UploadDone,
+                            pState );
+    if ( ( result == EOK ) && ( busy == true ) )
+    {
+        result = EBUSY;
+        Upload_Fail( pUpload, result );
+    }
+    else if ( result == EOK )
+    {
+        /* files are uploaded by the first connection */
+        pthread_mutex_lock( &pState->clientMutex );
+        if ( pState->client.pSimLink[0] != NULL )
+        {
+            icr = SimLink_UploadMultipleBlocksToBlobExAsync(
+                                        pState->client.pSimLink[0],
+                                        blobName,
+                                        Upload_GetData,
+                                        pUpload );
+            result = ( icr == IOTHUB_CLIENT_OK ) ? EOK : EIO;
+        }
+        else if ( pState->client.iotHubClientHandle[0] != NULL )
+        {
+#ifndef DONT_USE_UPLOADTOBLOB
+            icr = IoTHubClient_UploadMultipleBlocksToBlobExAsync(
+                                        pState->client.iotHubClientHandle[0],
+                                        blobName,
+                                        Upload_GetData,
+                                        pUpload );
+            result = ( icr == IOTHUB_CLIENT_OK ) ? EOK : EIO;
+#else
+            /* the SDK was built without blob uploads */
+            result = ENOTSUP;
+#endif
+        }
+        else
+        {
+            result = ENOTCONN;
+        }
+        pthread_mutex_unlock( &pState->clientMutex );
+
+        if ( result != EOK )
+        {
+            Upload_Fail( pUpload, result );
+        }
+    }
+
+    if ( result != EOK )
+    {
+        fprintf( stderr,
+                 "iothub: cannot upload %s: %s\n",
+                 path,
+                 strerror( result ) );
+    }
+    else if ( IOTHUB_VERBOSE( pState->verbose ) )
+    {
+        fprintf( stdout, "iothub: uploading %s to %s\n", path, blobName );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  UploadDone                                                                */
+/*!
+    Account for a finished file upload
+
+    The UploadDone function is called from the uploader's thread when an
+    upload has completed or failed, or from StartUpload when it could
+    not be started.
+
+@param[in]
+    arg
+        pointer to the IOTHubState object
+
+@param[in]
+    result
+        EOK if the upload completed, otherwise the reason it failed
+
+@param[in]
+    bytes
+        number of bytes uploaded
+
+==============================================================================*/
+static void UploadDone( void *arg, int result, uint64_t bytes )
+{
+    IOTHubState *pState = (IOTHubState *)arg;
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    pState->uploadsActive--;
+    if ( result == EOK )
+    {
+        pState->countUploadsOK++;
+    }
+    else
+    {
+        pState->countUploadsErr++;
+    }
+    pState->uploadBytes += bytes;
+    pthread_mutex_unlock( &pState->metricsMutex );
+}
+
+/*============================================================================*/
+/*  SendMessage                                                               */
+/*!
+    Send an IOTHub Message
+
+    The SendMessage function sends the requested message to the IOTHUB service
+
+    It creates the mssage from the specified body.
+    If the (optional) headers are specified they are parsed and added to
+    the message.
+
+    The message is the queued for delivery.  With parallel connections,
+    all the messages of a stream are sent on the same connection, so
+    they are delivered in order.
+
+    While the uplink is congested the bandwidth shaper may compress the
+    body, and the message is then marked with a gzip content encoding.
+    A message which already has a contentEncoding header is sent as it
+    is.  The size sent is taken from the shaper's ceilings.
+
+    @param[in]
+        pState
+            pointer to the IOTHubState
+
+    @param[in]
+        pid
+            process id of the client which sent the message, which
+            selects the parallel connection it is sent on unless the
+            message has a stream key
+
+    @param[in]
+        priority
+            message queue priority of the message, which selects its
+            bandwidth shaper class
+
+    @param[in]
+        headers
+            pointer to the (optional) headers specified one per line as
+            key:value pairs separated by a colon.  The last header is
+            terminated with two newlines.
+
+    @param[in]
+        body
+            pointer to the byte array to send.  This byte array may
+            contain ASCII or binary data and does not need to be NUL
+            terminated
+
+    @param[in]
+        len
+            length of the byte array to send.
+
+    @retval EOK the message was queued for delivery
+    @retval ENOMEM could not allocate memory for the message headers
+    @retval EIO message could not be queued for delivery
+    @retval EBADMSG could not create IOTHUB message from the byte array
+    @retval EBADF no connection to the IOTHUB
+
+==============================================================================*/
+static int SendMessage( IOTHubState *pState,
+                        uint32_t pid,
+                        unsigned int priority,
+                        char *headers,
+                        char *body,
+                        size_t len )
+{
+    IOTHUB_CLIENT_HANDLE iotHubClientHandle;
+    SimLink *pSimLink;
+    IOTHUB_CLIENT_RESULT icr;
+    IOTHUB_MESSAGE_HANDLE messageHandle;
+    int result = EINVAL;
+    MsgContext *pMsgContext;
+    uint32_t generation = 0;
+    size_t lane;
+    const char *pMsgId;
+    char messageId[MESSAGE_ID_SIZE];
+    bool connected;
+    const void *packed = body;
+    size_t packedLen = len;
+    bool compressed = false;
+    size_t bytes;
+    size_t n;
+
+    char *p;
+
+    if( ( pState != NULL ) &&
+        ( body != NULL ) &&
+        ( len > 0 ) )
+    {
+        /* check for a connection */
+        pthread_mutex_lock( &pState->clientMutex );
+        connected = ( pState->client.count > 0 );
+        pthread_mutex_unlock( &pState->clientMutex );
+
+        if ( connected == true )
+        {
+            /* compress the body while the uplink is congested */
+            if ( ( pState->pShaper != NULL ) &&
+                 ( ( headers == NULL ) ||
+                   ( FindHeader( headers, "contentEncoding", &n ) == NULL ) ) )
+            {
+                pthread_mutex_lock( &pState->metricsMutex );
+                compressed = ( Shaper_Compress( pState->pShaper,
+                                                body,
+                                                len,
+                                                &packed,
+                                                &packedLen ) == EOK );
+                pthread_mutex_unlock( &pState->metricsMutex );
+            }
+
+            /* build the message content from the body of the message */
+            messageHandle = IoTHubMessage_CreateFromByteArray( packed,
+                                                               packedLen );
+            if( messageHandle != NULL )
+            {
+                /* size of the message as sent */
+                bytes = packedLen + ( ( headers != NULL ) ? strlen( headers )
+                                                          : 0 );
+
+                if ( compressed == true )
+                {
+                    IoTHubMessage_SetContentEncodingSystemProperty(
+                                                        messageHandle,
+                                                        "gzip" );
+                }
+
+                if ( headers != NULL )
+                {
+                    p = strdup( headers );
+                    if ( p != NULL )
+                    {
+                        BuildMessageProperties( &pState->pMsgProperties, p );
+                        SetMessageProperties( messageHandle,
+                                              pState->pMsgProperties );
+                        free( p );
+                    }
+                    else
+                    {
+                        result = ENOMEM;
+                    }
+                }
+
+                /* get the message id */
+                pMsgId = IoTHubMessage_GetMessageId( messageHandle );
+                if( pMsgId == NULL )
+                {
+                    GenerateMessageId( messageId, sizeof( messageId ) );
+                    IoTHubMessage_SetMessageId( messageHandle, messageId );
+                }
+
+                if ( IOTHUB_VERBOSE( pState->verbose ) )
+                {
+                    pMsgId = IoTHubMessage_GetMessageId( messageHandle );
+                    if ( pMsgId != NULL )
+                    {
+                        fprintf( stdout,
+                                 "\x1b[33mSending message: %s\x1b[0m\n",
+                                 pMsgId );
+                    }
+                    else
+                    {
+                        fprintf( stderr,
+                                 "\x1b[31mNo message id\x1b[0m\n");
+                    }
+                }
+
+                /* create a message context object */
+                pMsgContext = malloc( sizeof( MsgContext ) );
+                if( pMsgContext != NULL )
+                {
+                    pMsgContext->pState = pState;
+                    pMsgContext->messageHandle = messageHandle;
+                    pMsgContext->deadline = GetDeadline( headers );
+                    pMsgContext->sent = GetTimeUs();
+                    pMsgContext->bytes = bytes;
+                }
+
+                /* send the message back */
+                pthread_mutex_lock( &pState->clientMutex );
+                lane = ( pState->client.count > 1 )
+                       ? SelectConnection( pState, pid, headers )
+                                % pState->client.count
+                       : 0;
+                iotHubClientHandle = pState->client.iotHubClientHandle[lane];
+                pSimLink = pState->client.pSimLink[lane];
+                generation = pState->clientGeneration;
+
+                pthread_mutex_lock( &pState->inFlightMutex );
+                pState->countTxTotal++;
+                if ( pMsgContext != NULL )
+                {
+                    /* count the message against the client and the
+                       connection it is sent on */
+                    pMsgContext->generation = generation;
+                    pMsgContext->lane = lane;
+                    pState->clientInFlight++;
+                    pState->laneStats[lane].sent++;
+                    pState->laneStats[lane].inFlight++;
+                }
+                pthread_mutex_unlock( &pState->inFlightMutex );
+
+                if ( pMsgContext == NULL )
+                {
+                    /* a message without a context can never be confirmed,
+                       so it is not sent */
+                    icr = IOTHUB_CLIENT_ERROR;
+                }
+                else if ( pSimLink != NULL )
+                {
+                    icr = SimLink_SendEventAsync( pSimLink,
+                                                  messageHandle,
+                                                  SendCallback,
+                                                  pMsgContext );
+                }
+                else if ( iotHubClientHandle != NULL )
+                {
+                    icr = IoTHubClient_SendEventAsync( iotHubClientHandle,
+                                                       messageHandle,
+                                                       SendCallback,
+                                                       pMsgContext );
+                }
+                else
+                {
+                    icr = IOTHUB_CLIENT_ERROR;
+                }
+                pthread_mutex_unlock( &pState->clientMutex );
+                if ( icr == IOTHUB_CLIENT_OK)
+                {
+                    result = EOK;
+
+                    if ( pState->pShaper != NULL )
+                    {
+                        pthread_mutex_lock( &pState->metricsMutex );
+                        Shaper_Consume( pState->pShaper, priority, bytes );
+                        pthread_mutex_unlock( &pState->metricsMutex );
+                    }
+                }
+                else
+                {
+                    result = ( pMsgContext == NULL ) ? ENOMEM : EIO;
+
+                    pthread_mutex_lock( &pState->inFlightMutex );
+                    pState->countTxErr++;
+                    if ( pMsgContext != NULL )
+                    {
+                        pState->laneStats[lane].err++;
+                        pState->laneStats[lane].inFlight--;
+                    }
+                    pthread_mutex_unlock( &pState->inFlightMutex );
+
+                    if ( pMsgContext != NULL )
+                    {
+                        ReleaseInFlight( pState, generation );
+                    }
+
+                    /* no callback will release the message */
+                    IoTHubMessage_Destroy( messageHandle );
+                    free( pMsgContext );
+                }
+            }
+            else
+            {
+                result = EBADMSG;
+            }
+        }
+        else
+        {
+            result = EBADF;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SendCallback                                                              */
+/*!
+    Async send callback function
+
+    The SendCallback function is invoked from the IOT SDK framework
+    when a message transmission has completed (successfully or
+    unsuccessfully)
+
+    @param[in]
+       result
+            status of the message transfer attempt
+
+    @retval[in]
+        userContextCallback
+
+    @return none
+
+==============================================================================*/
+static void SendCallback( IOTHUB_CLIENT_CONFIRMATION_RESULT result,
+                          void* userContextCallback)
+{
+    IOTHubState *pState;
+    MsgContext *pContext = (MsgContext *)userContextCallback;
+    IOTHUB_MESSAGE_HANDLE messageHandle;
+    HubLaneStats *lane;
+    const char *pMessageId;
+    const char *red = "\x1b[31m";
+    const char *green = "\x1b[32m";
+    const char *color;
+
+    if ( pContext != NULL )
+    {
+        pState = pContext->pState;
+        messageHandle = pContext->messageHandle;
+
+        if( ( pState != NULL ) &&
+            ( messageHandle != NULL ) )
+        {
+            /* get the message id */
+            pMessageId = IoTHubMessage_GetMessageId( messageHandle );
+            if( pMessageId == NULL )
+            {
+                pMessageId = "unknown";
+            }
+
+            /* set the notification color */
+            color = (result == IOTHUB_CLIENT_CONFIRMATION_OK) ? green : red;
+
+            if ( IOTHUB_VERBOSE( pState->verbose ) )
+            {
+                fprintf( stdout,
+                         "%s%s: Message Send %s\x1b[0m\n",
+                         color,
+                         pMessageId,
+                         MU_ENUM_TO_STRING( IOTHUB_CLIENT_CONFIRMATION_RESULT,
+                                            result ) );
+            }
+
+            /* parallel connections confirm messages concurrently */
+            pthread_mutex_lock( &pState->inFlightMutex );
+
+            lane = &pState->laneStats[pContext->lane];
+            lane->inFlight--;
+
+            switch( result )
+            {
+                case IOTHUB_CLIENT_CONFIRMATION_OK:
                     pState->countTxOK++;
+                    pState->confirmedBytes += pContext->bytes;
+                    lane->ok++;
+                    lane->bytes += pContext->bytes;
+                    break;
+
+                default:
+                    pState->countTxErr++;
+                    lane->err++;
+                    break;
+            }
+
+            /* a message which is not confirmed in time missed its
+               deadline */
+            if ( pContext->deadline != 0 )
+            {
+                if ( ( result == IOTHUB_CLIENT_CONFIRMATION_OK ) &&
+                     ( GetEpochMs() <= pContext->deadline ) )
+                {
+                    pState->countDeadlineHit++;
+                }
+                else
+                {
+                    pState->countDeadlineMissed++;
+                }
+            }
+
+            /* smooth the confirmation time for the load shedding
+               wait trigger */
+            pState->confirmWaitUs = ( 7 * pState->confirmWaitUs +
+                                      GetTimeUs() - pContext->sent ) / 8;
+
+            pthread_mutex_unlock( &pState->inFlightMutex );
+
+            ReleaseInFlight( pState, pContext->generation );
+        }
+
+        /* the client sent its own copy of the message, so release ours */
+        if ( messageHandle != NULL )
+        {
+            IoTHubMessage_Destroy( messageHandle );
+        }
+
+        /* free the memory used for the message context */
+        free( pContext );
+    }
+}
+
+/*============================================================================*/
+/*  ReleaseInFlight                                                           */
+/*!
+    Release a message awaiting confirmation
+
+    The ReleaseInFlight function removes a confirmed or failed message
+    from the in-flight count of the client it was sent on, and signals
+    when a replaced client has no more messages awaiting confirmation.
+
+    @param[in]
+       pState
+            pointer to the IOTHubState object
+
+    @param[in]
+       generation
+            generation of the client the message was sent on
+
+    @return none
+
+==============================================================================*/
+static void ReleaseInFlight( IOTHubState *pState, uint32_t generation )
+{
+    pthread_mutex_lock( &pState->inFlightMutex );
+
+    if ( generation == pState->clientGeneration )
+    {
+        pState->clientInFlight--;
+    }
+    else if ( pState->retiredInFlight > 0 )
+    {
+        pState->retiredInFlight--;
+        if ( pState->retiredInFlight == 0 )
+        {
+            pthread_cond_signal( &pState->inFlightCond );
+        }
+    }
+
+    pthread_mutex_unlock( &pState->inFlightMutex );
+}
+
+/*============================================================================*/
+/*  SelectConnection                                                          */
+/*!
+    Hash a message onto one of the parallel connections
+
+    The SelectConnection function hashes the stream key of a message,
+    or the process id of its client if the message has no stream key,
+    so every message of a stream is sent on the same connection.
+
+    @param[in]
+       pState
+            pointer to the IOTHubState object
+
+    @param[in]
+       pid
+            process id of the client which sent the message
+
+    @param[in]
+       headers
+            pointer to the message headers, or NULL
+
+    @retval hash of the message's stream, to be reduced modulo the
+            number of connections
+
+==============================================================================*/
+static uint32_t SelectConnection( IOTHubState *pState,
+                                  uint32_t pid,
+                                  const char *headers )
+{
+    const unsigned char *p = NULL;
+    uint32_t hash = 2166136261U;
+    size_t n = 0;
+    size_t i;
+
+    if ( ( pState->streamKey != NULL ) &&
+         ( headers != NULL ) )
+    {
+        p = (const unsigned char *)FindHeader( headers,
+                                               pState->streamKey,
+                                               &n );
+    }
+
+    if ( p == NULL )
+    {
+        p = (const unsigned char *)&pid;
+        n = sizeof( pid );
+    }
+
+    /* FNV-1a */
+    for ( i = 0; i < n; i++ )
+    {
+        hash = ( hash ^ p[i] ) * 16777619U;
+    }
+
+    return hash;
+}
+
+/*============================================================================*/
+/*  usage                                                                     */
+/*!
+    Display the application usage
+
+    The usage function dumps the application usage message
+    to stderr.
+
+    @param[in]
+       cmdname
+            pointer to the invoked command name
+
+    @return none
+
+============================================================================*/
+static void usage( char *cmdname )
+{
+    if( cmdname != NULL )
+    {
+        fprintf(stderr,
+                "usage: %s [-v] [-h] [-c connection string] [-s address] "
+                "[-r tracefile]\n"
+                "          [-t cafile] [-k sessionfile] [-B min:max:jitter] "
+                "[-T seconds]\n"
+                "          [-o dir[:limitMB]] [-m metricsfile] "
+                "[-b count[:limitKB]]\n"
+                "          [-H socket] [-q depth[:msgsize]] "
+                "[-Q name[:weight]]\n"
+                "          [-M maxKB[:cacheKB]] [-C chunkKB] [-U blockKB] "
+                "[-E count]\n"
+                "          [-L policy] [-P stallMs[:windowMs]] "
+                "[-d seconds[:backlogKB]]\n"
+                "          [-S shaper] [-N socket option] "
+                "[-n connections[:key]]\n"
+                "          [-I connection string]\n"
+                " [-h] : display this help\n"
+                " [-c connection string] : set the IOTHub connection string\n"
+                " [-s address] : use the local hub stand-in at host:port\n"
+                " [-r tracefile] : capture received messages to tracefile\n"
+                " [-t cafile] : trusted CA certificates (PEM).  Enables TLS "
+                "to the stand-in\n"
+                " [-k sessionfile] : persist the TLS session to sessionfile\n"
+                " [-B min:max:jitter] : reconnect backoff in ms, ms and "
+                "percent\n"
+                "                       (default 100:60000:50)\n"
+                " [-T seconds] : give up reconnecting and recreate the client "
+                "after\n"
+                "                seconds (default 0: never)\n"
+                " [-o dir[:limitMB]] : spill messages to dir while "
+                "disconnected\n"
+                "                      (default limit 64MB)\n"
+                " [-m metricsfile] : write the connection metrics to "
+                "metricsfile\n"
+                " [-b count[:limitKB]] : buffer up to count messages in "
+                "memory while\n"
+                "                        not connected (default 256:4096)\n"
+                " [-H socket] : take over from a running service, and hand "
+                "over\n"
+                "               to the next, via the socket\n"
+                " [-q depth[:msgsize]] : message queue depth and maximum "
+                "message\n"
+                "                        size (default: system default)\n"
+                " [-Q name[:weight]] : also receive messages on queue name, "
+                "serviced\n"
+                "                      by weight (default 1).  May be "
+                "repeated.\n"
+                "                      -Q /iothub:weight sets the weight of "
+                "/iothub\n"
+                " [-M maxKB[:cacheKB]] : maximum message body size, and "
+                "free body\n"
+                "                        buffers kept per size class "
+                "(default 256:256)\n"
+                " [-C chunkKB] : send longer bodies in chunks of chunkKB "
+                "instead of\n"
+                "                truncating them (at most maxKB)\n"
+                " [-U blockKB] : block size of file uploads (default 4096)\n"
+                " [-E count] : queue up to count messages for the send "
+                "window,\n"
+                "              earliest deadline first\n"
+                " [-L policy] : shed messages under sustained overload.  "
+                "May be\n"
+                "               repeated.  Triggers: backlog:KB, "
+                "inflight:count,\n"
+                "               wait:ms.  Rules: priority:N, "
+                "sample:stream:percent,\n"
+                "               latest:key\n"
+                " [-P stallMs[:windowMs]] : reduce memory use while tasks "
+                "stall for\n"
+                "                           stallMs per window waiting for "
+                "memory\n"
+                "                           (default window 2000)\n"
+                " [-d seconds[:backlogKB]] : connect every seconds, or "
+                "when backlogKB\n"
+                "                            is held or an urgent message "
+                "arrives,\n"
+                "                            and disconnect once the "
+                "backlog is sent\n"
+                " [-S shaper] : limit and adapt to the uplink bandwidth.  "
+                "May be\n"
+                "               repeated: link:KB/s, class:priority:KB/s, "
+                "compress[:bytes]\n"
+                " [-N socket option] : tune the uplink socket.  May be "
+                "repeated:\n"
+                "                      nodelay, delay, sndbuf:KB, "
+                "rcvbuf:KB, timeout:ms,\n"
+                "                      keepalive:idle[:intvl[:cnt]], "
+                "ktls\n"
+                " [-n connections[:key]] : send on parallel connections, "
+                "hashing\n"
+                "                          messages by the key header, "
+                "or by client\n"
+                " [-I connection string] : identity of a further "
+                "parallel IOT Hub\n"
+                "                          connection.  May be repeated\n"
+                " [-v] : verbose output\n",
+                cmdname );
+    }
+}
+
+/*============================================================================*/
+/*  ProcessOptions                                                            */
+/*!
+    Process the command line options
+
+    The ProcessOptions function processes the command line options and
+    populates the iothubtate object
+
+    @param[in]
+        argC
+            number of arguments
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @param[in]
+        pState
+            pointer to the iothub state object
+
+    @return none
+
+==============================================================================*/
+static int ProcessOptions( int argC, char *argV[], IOTHubState *pState )
+{
+    int c;
+    int result = EINVAL;
+    const char *options = "hvc:s:r:t:k:B:T:o:m:b:H:q:Q:M:C:U:E:L:P:d:S:N:n:I:";
+    char *p;
+    unsigned long weight;
+    size_t i;
+
+    if( ( pState != NULL ) &&
+        ( argV != NULL ) )
+    {
+        while( ( c = getopt( argC, argV, options ) ) != -1 )
+        {
+            switch( c )
+            {
+                case 'v':
+                    pState->verbose = IOTHUB_VERBOSE( true );
+                    break;
+
+                case 'h':
+                    usage( argV[0] );
+                    break;
+
+                case 'c':
+                    /* get the connection string */
+                    if ( strlen(optarg) < CONNECTION_STRING_SIZE )
+                    {
+                        strcpy( pState->connectionString, optarg );
+                    }
+                    else
+                    {
+                        syslog( LOG_ERR, "invalid connectionstring\n" );
+                    }
+                    break;
+
+                case 's':
+                    /* use the local hub stand-in */
+                    pState->simAddress = optarg;
+                    break;
+
+                case 'r':
+                    /* capture received messages for replay */
+                    pState->traceFile = optarg;
+                    break;
+
+                case 't':
+                    /* trusted CA certificates */
+                    pState->caFile = optarg;
+                    break;
+
+                case 'k':
+                    /* TLS session persistence */
+                    pState->sessionFile = optarg;
+                    break;
+
+                case 'B':
+                    /* reconnect backoff policy */
+                    if ( Backoff_Parse( &pState->backoff, optarg ) != EOK )
+                    {
+                        fprintf( stderr,
+                                 "iothub: invalid backoff %s\n",
+                                 optarg );
+                    }
+                    break;
+
+                case 'T':
+                    /* client retry timeout */
+                    pState->retryTimeout = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'o':
+                    /* disk outbox directory and size limit */
+                    pState->outboxDir = optarg;
+                    p = strrchr( optarg, ':' );
+                    if ( p != NULL )
+                    {
+                        *p++ = '\0';
+                        pState->outboxLimit = strtoull( p, NULL, 0 ) << 20;
+                    }
+                    break;
+
+                case 'm':
+                    /* connection metrics file */
+                    pState->metricsFile = optarg;
+                    break;
+
+                case 'b':
+                    /* in-memory buffer message and size limits */
+                    pState->bufferCount = strtoul( optarg, &p, 0 );
+                    if ( *p == ':' )
+                    {
+                        pState->bufferBytes = strtoul( p + 1, NULL, 0 ) << 10;
+                    }
+                    break;
+
+                case 'H':
+                    /* hand over to and take over from other services */
+                    pState->handoffPath = optarg;
+                    break;
+
+                case 'q':
+                    /* ingest queue depth and message size */
+                    pState->queueDepth = strtol( optarg, &p, 0 );
+                    if ( *p == ':' )
+                    {
+                        pState->queueMsgSize = strtol( p + 1, NULL, 0 );
+                    }
+                    break;
+
+                case 'M':
+                    /* maximum body size and body buffer cache limit */
+                    pState->bodyMax = strtoul( optarg, &p, 0 ) << 10;
+                    if ( *p == ':' )
+                    {
+                        pState->bodyCache = strtoul( p + 1, NULL, 0 ) << 10;
+                    }
+
+                    if ( pState->bodyMax == 0 )
+                    {
+                        fprintf( stderr,
+                                 "iothub: invalid body size %s\n",
+                                 optarg );
+                        pState->bodyMax = BODYPOOL_DEFAULT_MAX;
+                    }
+                    break;
+
+                case 'C':
+                    /* stream longer bodies in chunks */
+                    pState->chunkSize = strtoul( optarg, NULL, 0 ) << 10;
+                    break;
+
+                case 'U':
+                    /* file upload block size */
+                    pState->uploadBlockSize = strtoul( optarg, NULL, 0 ) << 10;
+                    if ( ( pState->uploadBlockSize == 0 ) ||
+                         ( pState->uploadBlockSize > UPLOAD_MAX_BLOCK_SIZE ) )
+                    {
+                        fprintf( stderr,
+                                 "iothub: invalid block size %s\n",
+                                 optarg );
+                        pState->uploadBlockSize = UPLOAD_DEFAULT_BLOCK_SIZE;
+                    }
+                    break;
+
+                case 'E':
+                    /* earliest deadline first scheduling */
+                    pState->edfCount = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'S':
+                    /* bandwidth ceiling or compression */
+                    if ( pState->pShaper == NULL )
+                    {
+                        pState->pShaper = Shaper_Create();
+                    }
+
+                    if ( Shaper_Add( pState->pShaper, optarg ) != EOK )
+                    {
+                        fprintf( stderr,
+                                 "iothub: invalid shaper setting %s\n",
+                                 optarg );
+                    }
+                    break;
+
+                case 'N':
+                    /* uplink socket option */
+                    if ( SockTune_Parse( &pState->sockTune, optarg ) != EOK )
+                    {
+                        fprintf( stderr,
+                                 "iothub: invalid socket option %s\n",
+                                 optarg );
+                    }
+                    break;
+
+                case 'n':
+                    /* parallel connections and stream key */
+                    pState->connectionCount = strtoul( optarg, &p, 0 );
+                    if ( *p == ':' )
+                    {
+                        pState->streamKey = p + 1;
+                    }
+                    break;
+
+                case 'I':
+                    /* identity of a further parallel connection */
+                    if ( ( pState->identityCount <
+                             IOTHUB_MAX_CONNECTIONS - 1 ) &&
+                         ( strlen( optarg ) < CONNECTION_STRING_SIZE ) )
+                    {
+                        pState->identities[pState->identityCount++] =
+                            optarg;
+                    }
+                    else
+                    {
+                        fprintf( stderr,
+                                 "iothub: invalid identity %s\n",
+                                 optarg );
+                    }
+                    break;
+
+                case 'd':
+                    /* duty cycle interval and backlog limit */
+                    pState->dutyIntervalMs = strtoul( optarg, &p, 0 ) * 1000;
+                    if ( *p == ':' )
+                    {
+                        pState->dutyBacklogBytes =
+                            (uint64_t)strtoul( p + 1, NULL, 0 ) << 10;
+                    }
+                    break;
+
+                case 'P':
+                    /* memory pressure stall time and window */
+                    pState->pressureStallMs = strtoul( optarg, &p, 0 );
+                    if ( *p == ':' )
+                    {
+                        pState->pressureWindowMs = strtoul( p + 1, NULL, 0 );
+                    }
+                    break;
+
+                case 'L':
+                    /* load shedding trigger or rule */
+                    if ( pState->pShed == NULL )
+                    {
+                        pState->pShed = Shed_Create();
+                    }
+
+                    if ( Shed_Add( pState->pShed, optarg ) != EOK )
+                    {
+                        fprintf( stderr,
+                                 "iothub: invalid shedding policy %s\n",
+                                 optarg );
+                    }
+                    break;
+
+                case 'Q':
+                    /* additional ingest queue, or the weight of the
+                       IOTHUB queue */
+                    weight = INGEST_DEFAULT_WEIGHT;
+                    p = strrchr( optarg, ':' );
+                    if ( p != NULL )
+                    {
+                        *p++ = '\0';
+                        weight = strtoul( p, NULL, 0 );
+                    }
+
+                    for ( i = 0; i < pState->queueCount; i++ )
+                    {
+                        if ( strcmp( pState->queueNames[i], optarg ) == 0 )
+                        {
+                            break;
+                        }
+                    }
+
+                    if ( ( optarg[0] != '/' ) ||
+                         ( weight == 0 ) ||
+                         ( weight > INGEST_MAX_WEIGHT ) ||
+                         ( i == INGEST_MAX_QUEUES ) ||
+                         ( i == FOOTPRINT_QUEUES ) )
+                    {
+                        fprintf( stderr,
+                                 "iothub: invalid queue %s\n",
+                                 optarg );
+                    }
+                    else
+                    {
+                        pState->queueNames[i] = optarg;
+                        pState->queueWeights[i] = weight;
+                        if ( i == pState->queueCount )
+                        {
+                            pState->queueCount++;
+                        }
+                    }
                     break;
 
                 default:
-                    pState->countTxErr++;
                     break;
+
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  ApplyLimits                                                               */
+/*!
+    Apply the memory limits of the build
+
+    The ApplyLimits function reduces the in-memory buffer, deadline
+    queue and message body settings to the fixed per-subsystem limits
+    of the build.  Only the minimal-footprint build has such limits.
+    The chunk size is then limited to the maximum body size, and the
+    number of parallel IOT Hub connections to the number of identities
+    to connect as.
+
+@param[in]
+    pState
+        pointer to the iothub state object
+
+==============================================================================*/
+static void ApplyLimits( IOTHubState *pState )
+{
+    if ( pState->connectionCount > FOOTPRINT_CONNECTIONS )
+    {
+        pState->connectionCount = FOOTPRINT_CONNECTIONS;
+    }
+
+    if ( pState->connectionCount > IOTHUB_MAX_CONNECTIONS )
+    {
+        pState->connectionCount = IOTHUB_MAX_CONNECTIONS;
+    }
+
+    /* each IOT Hub connection needs its own identity */
+    if ( ( pState->simAddress == NULL ) &&
+         ( pState->connectionCount > pState->identityCount + 1 ) )
+    {
+        fprintf( stderr,
+                 "iothub: %zu identities for %zu connections\n",
+                 pState->identityCount + 1,
+                 pState->connectionCount );
+        pState->connectionCount = pState->identityCount + 1;
+    }
+
+    if ( pState->bufferCount > FOOTPRINT_BUFFER_COUNT )
+    {
+        pState->bufferCount = FOOTPRINT_BUFFER_COUNT;
+    }
+
+    if ( pState->bufferBytes > FOOTPRINT_BUFFER_BYTES )
+    {
+        pState->bufferBytes = FOOTPRINT_BUFFER_BYTES;
+    }
+
+    if ( pState->bodyMax > FOOTPRINT_BODY_MAX )
+    {
+        pState->bodyMax = FOOTPRINT_BODY_MAX;
+    }
+
+    if ( pState->bodyCache > FOOTPRINT_BODY_CACHE )
+    {
+        pState->bodyCache = FOOTPRINT_BODY_CACHE;
+    }
+
+    if ( pState->edfCount > FOOTPRINT_EDF_COUNT )
+    {
+        pState->edfCount = FOOTPRINT_EDF_COUNT;
+    }
+
+    /* chunks are received into body buffers */
+    if ( pState->chunkSize > pState->bodyMax )
+    {
+        pState->chunkSize = pState->bodyMax;
+    }
+}
+
+/*============================================================================*/
+/*  SetupTerminationHandler                                                   */
+/*!
+    Set up an abnormal termination handler
+
+    The SetupTerminationHandler function registers a termination handler
+    function with the kernel in case of an abnormal termination of this
+    process.  SIGPIPE is ignored so a write to a closed connection
+    fails instead of terminating the process.
+
+==============================================================================*/
+static void SetupTerminationHandler( void )
+{
+    static struct sigaction sigact;
+
+    memset( &sigact, 0, sizeof(sigact) );
+
+    sigact.sa_sigaction = TerminationHandler;
+    sigact.sa_flags = SA_SIGINFO;
+
+    sigaction( SIGTERM, &sigact, NULL );
+    sigaction( SIGINT, &sigact, NULL );
+
+    /* a closed hub connection is reported by the failed write */
+    signal( SIGPIPE, SIG_IGN );
+}
+
+/*============================================================================*/
+/*  SetupNotifications                                                        */
+/*!
+    Set up the variable server notifications
+
+    The SetupNotifications function requests print notifications for
+    the connection metrics variable and modified notifications for the
+    connection string variable, and starts a thread to handle them.
+    The variable server signals are blocked first so the thread started
+    here is the only one to receive them.  This function must be called
+    before any other threads are created.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@retval EOK the notifications are set up
+@retval ENOENT neither variable exists
+@retval other error as returned from VAR_Notify or StartThread
+
+==============================================================================*/
+static int SetupNotifications( IOTHubState *pState )
+{
+    int result = ENOENT;
+    sigset_t mask;
+    bool notify = false;
+
+    sigemptyset( &mask );
+    sigaddset( &mask, SIG_VAR_PRINT );
+    sigaddset( &mask, SIG_VAR_MODIFIED );
+    pthread_sigmask( SIG_BLOCK, &mask, NULL );
+
+    /* render the connection metrics */
+    pState->hMetrics = VAR_FindByName( pState->hVarServer, METRICS_NAME );
+    if ( ( pState->hMetrics != VAR_INVALID ) &&
+         ( VAR_Notify( pState->hVarServer,
+                       pState->hMetrics,
+                       NOTIFY_PRINT ) == EOK ) )
+    {
+        notify = true;
+    }
+
+    /* reconnect when the connection string changes */
+    pState->hConnectionString = VAR_FindByName( pState->hVarServer,
+                                                CONNECTION_STRING_NAME );
+    if ( ( pState->hConnectionString != VAR_INVALID ) &&
+         ( VAR_Notify( pState->hVarServer,
+                       pState->hConnectionString,
+                       NOTIFY_MODIFIED ) == EOK ) )
+    {
+        notify = true;
+    }
+
+    if ( notify == true )
+    {
+        result = StartThread( VarThread, pState );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  VarThread                                                                 */
+/*!
+    Variable server notification thread
+
+    The VarThread function renders the connection metrics variable when
+    it is printed, and requests a reload of the settings when the
+    connection string variable is modified.
+
+@param[in]
+    arg
+        pointer to the IOTHubState object
+
+@retval NULL
+
+==============================================================================*/
+static void *VarThread( void *arg )
+{
+    IOTHubState *pState = (IOTHubState *)arg;
+    VAR_HANDLE hVar;
+    int sigval;
+    int sig;
+    int fd;
+
+    while ( true )
+    {
+        sig = VARSERVER_WaitSignal( &sigval );
+        if ( sig == SIG_VAR_MODIFIED )
+        {
+            hVar = (VAR_HANDLE)sigval;
+            if ( hVar == pState->hConnectionString )
+            {
+                RequestReload( pState );
+            }
+        }
+        else if ( ( sig == SIG_VAR_PRINT ) &&
+                  ( VAR_OpenPrintSession( pState->hVarServer,
+                                          sigval,
+                                          &hVar,
+                                          &fd ) == EOK ) )
+        {
+            if ( hVar == pState->hMetrics )
+            {
+                WriteMetrics( pState, fd );
+            }
+
+            VAR_ClosePrintSession( pState->hVarServer, sigval, fd );
+        }
+    }
+
+    return NULL;
+}
+
+/*============================================================================*/
+/*  UpdateMetrics                                                             */
+/*!
+    Update the connection metrics
+
+    The UpdateMetrics function takes a snapshot of the outbox, message
+    buffer, body pool and ingest queue statistics for the metrics
+    variable, and rewrites the metrics file once every IOTHUB_POLL_MS.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+==============================================================================*/
+static void UpdateMetrics( IOTHubState *pState )
+{
+    uint64_t now;
+    size_t i;
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    Outbox_GetStats( pState->pOutbox, &pState->outboxStats );
+    MsgBuffer_GetStats( pState->pBuffer, &pState->bufferStats );
+    EdfQueue_GetStats( pState->pEdf, &pState->edfStats );
+    Pressure_GetStats( pState->pPressure, &pState->pressureStats );
+    BodyPool_GetStats( pState->pBodyPool, &pState->bodyStats );
+    i = 0;
+    while ( ( i < INGEST_MAX_QUEUES ) &&
+            ( Ingest_GetStats( pState->pIngest,
+                               i,
+                               &pState->queueStats[i] ) == EOK ) )
+    {
+        i++;
+    }
+    pState->queueStatsCount = i;
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    if ( pState->metricsFile != NULL )
+    {
+        now = GetTimeUs();
+        if ( now - pState->metricsTime >= IOTHUB_POLL_MS * 1000 )
+        {
+            pState->metricsTime = now;
+            WriteMetricsFile( pState );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  WriteMetrics                                                              */
+/*!
+    Write the connection metrics as a JSON object
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    fd
+        file descriptor to write the metrics to
+
+@retval EOK the metrics were written
+@retval EIO the metrics could not be written
+
+==============================================================================*/
+static int WriteMetrics( IOTHubState *pState, int fd )
+{
+    ConnMetrics metrics;
+    OutboxStats outbox;
+    MsgBufferStats buffer;
+    EdfQueueStats edf;
+    PressureStats pressure;
+    BodyPoolStats bodies;
+    uint32_t uploadsActive;
+    uint32_t uploadsRequested;
+    uint32_t uploadsOK;
+    uint32_t uploadsErr;
+    uint64_t uploadBytes;
+    uint32_t reloads;
+    uint32_t expired;
+    uint32_t truncated;
+    uint32_t streams;
+    uint32_t chunks;
+    uint32_t batches;
+    uint32_t batched;
+    uint32_t batchDropped;
+    uint32_t spilled;
+    uint32_t wakeSchedule;
+    uint32_t wakeBacklog;
+    uint32_t wakeUrgent;
+    IngestStats *queue;
+    size_t i;
+    uint32_t total;
+    uint32_t ok;
+    uint32_t err;
+    uint32_t hit;
+    uint32_t missed;
+    int n;
+
+    ConnState_GetMetrics( pState->pConnState, &metrics );
+
+    pthread_mutex_lock( &pState->inFlightMutex );
+    total = pState->countTxTotal;
+    ok = pState->countTxOK;
+    err = pState->countTxErr;
+    hit = pState->countDeadlineHit;
+    missed = pState->countDeadlineMissed;
+    pthread_mutex_unlock( &pState->inFlightMutex );
+
+    pthread_mutex_lock( &pState->metricsMutex );
+    outbox = pState->outboxStats;
+    buffer = pState->bufferStats;
+    edf = pState->edfStats;
+    pressure = pState->pressureStats;
+    bodies = pState->bodyStats;
+    uploadsActive = pState->uploadsActive;
+    uploadsRequested = pState->countUploads;
+    uploadsOK = pState->countUploadsOK;
+    uploadsErr = pState->countUploadsErr;
+    uploadBytes = pState->uploadBytes;
+    reloads = pState->countReloads;
+    expired = pState->countExpired;
+    truncated = pState->countTruncated;
+    streams = pState->countStreams;
+    chunks = pState->countChunks;
+    batches = pState->countBatches;
+    batched = pState->countBatched;
+    batchDropped = pState->countBatchDropped;
+    spilled = pState->countPressureSpilled;
+    wakeSchedule = pState->countWakeSchedule;
+    wakeBacklog = pState->countWakeBacklog;
+    wakeUrgent = pState->countWakeUrgent;
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    n = dprintf( fd,
+                 "{\"state\":\"%s\",\"uptime_ms\":%lu,"
+                 "\"connects\":%lu,\"disconnects\":%lu,\"failures\":%lu,"
+                 "\"reloads\":%u,"
+                 "\"disconnected_ms\":%lu,\"connect_ms\":%lu,"
+                 "\"connected_ms\":%lu,"
+                 "\"reconnect_ms\":{\"last\":%lu,\"max\":%lu,"
+                 "\"total\":%lu},"
+                 "\"tx\":{\"total\":%u,\"ok\":%u,\"err\":%u},"
+                 "\"expired\":%u,"
+                 "\"outbox\":{\"bytes\":%lu,\"segments\":%u,"
+                 "\"spilled\":%lu,\"drained\":%lu},"
+                 "\"buffer\":{\"messages\":%lu,\"bytes\":%lu,"
+                 "\"peak\":%lu,\"buffered\":%lu,\"expired\":%lu},"
+                 "\"bodies\":{\"max\":%lu,\"in_use\":%lu,"
+                 "\"in_use_bytes\":%lu,\"cached_bytes\":%lu,"
+                 "\"allocs\":%lu,\"reused\":%lu,\"truncated\":%u,"
+                 "\"streams\":%u,\"chunks\":%u},"
+                 "\"batches\":{\"frames\":%u,\"messages\":%u,"
+                 "\"dropped\":%u},"
+                 "\"uploads\":{\"active\":%u,\"requested\":%u,"
+                 "\"ok\":%u,\"err\":%u,\"bytes\":%lu},"
+                 "\"deadlines\":{\"waiting\":%lu,\"peak\":%lu,"
+                 "\"scheduled\":%lu,\"downgraded\":%lu,\"hit\":%u,"
+                 "\"missed\":%u,\"hit_ratio\":%.3f},"
+                 "\"memory\":{\"monitor\":\"%s\",\"pressure\":%s,"
+                 "\"events\":%lu,\"episodes\":%lu,\"spilled\":%u},"
+                 "\"duty\":{\"interval_ms\":%u,\"sleeps\":%lu,"
+                 "\"sleep_ms\":%lu,\"wakes\":{\"schedule\":%u,"
+                 "\"backlog\":%u,\"urgent\":%u},\"connected_ratio\":%.3f,"
+                 "\"radio_on_ms\":%lu},"
+                 "\"queues\":[",
+                 ConnState_Name( metrics.state ),
+                 (unsigned long)metrics.uptimeMs,
+                 (unsigned long)metrics.connects,
+                 (unsigned long)metrics.disconnects,
+                 (unsigned long)metrics.failures,
+                 reloads,
+                 (unsigned long)metrics.disconnectedMs,
+                 (unsigned long)metrics.connectMs,
+                 (unsigned long)metrics.connectedMs,
+                 (unsigned long)metrics.lastReconnectMs,
+                 (unsigned long)metrics.maxReconnectMs,
+                 (unsigned long)metrics.totalReconnectMs,
+                 total,
+                 ok,
+                 err,
+                 expired,
+                 (unsigned long)outbox.bytes,
+                 outbox.segments,
+                 (unsigned long)outbox.spilled,
+                 (unsigned long)outbox.drained,
+                 (unsigned long)buffer.count,
+                 (unsigned long)buffer.bytes,
+                 (unsigned long)buffer.peak,
+                 (unsigned long)buffer.buffered,
+                 (unsigned long)buffer.expired,
+                 (unsigned long)bodies.maxSize,
+                 (unsigned long)bodies.inUse,
+                 (unsigned long)bodies.inUseBytes,
+                 (unsigned long)bodies.cachedBytes,
+                 (unsigned long)bodies.allocs,
+                 (unsigned long)bodies.reused,
+                 truncated,
+                 streams,
+                 chunks,
+                 batches,
+                 batched,
+                 batchDropped,
+                 uploadsActive,
+                 uploadsRequested,
+                 uploadsOK,
+                 uploadsErr,
+                 (unsigned long)uploadBytes,
+                 (unsigned long)edf.count,
+                 (unsigned long)edf.peak,
+                 (unsigned long)edf.queued,
+                 (unsigned long)edf.deferred,
+                 hit,
+                 missed,
+                 ( hit + missed > 0 ) ? (double)hit / ( hit + missed )
+                                      : 0.0,
+                 ( pState->pPressure == NULL ) ? "off"
+                 : ( pressure.polled == true ) ? "poll"
+                 : "trigger",
+                 ( pressure.active == true ) ? "true" : "false",
+                 (unsigned long)pressure.events,
+                 (unsigned long)pressure.episodes,
+                 spilled,
+                 pState->dutyIntervalMs,
+                 (unsigned long)metrics.sleeps,
+                 (unsigned long)metrics.sleepMs,
+                 wakeSchedule,
+                 wakeBacklog,
+                 wakeUrgent,
+                 ( metrics.uptimeMs > 0 )
+                     ? (double)metrics.connectedMs / metrics.uptimeMs
+                     : 0.0,
+                 (unsigned long)( metrics.connectedMs +
+                                  metrics.connects * IOTHUB_RADIO_TAIL_MS ) );
+
+    /* the queue names are only valid while the queues are open */
+    pthread_mutex_lock( &pState->metricsMutex );
+    for ( i = 0; ( n > 0 ) && ( i < pState->queueStatsCount ); i++ )
+    {
+        queue = &pState->queueStats[i];
+        n = dprintf( fd,
+                     "%s{\"name\":\"%s\",\"weight\":%u,\"depth\":%ld,"
+                     "\"msgsize\":%ld,\"pending\":%ld,"
+                     "\"received\":%lu}",
+                     ( i > 0 ) ? "," : "",
+                     queue->name,
+                     queue->weight,
+                     queue->depth,
+                     queue->msgsize,
+                     queue->pending,
+                     (unsigned long)queue->received );
+    }
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    if ( n > 0 )
+    {
+        n = dprintf( fd, "]" );
+    }
+
+    if ( ( n > 0 ) &&
+         ( WriteShedMetrics( pState, fd ) == EOK ) &&
+         ( WriteShaperMetrics( pState, fd ) == EOK ) &&
+         ( WriteConnectionMetrics( pState,
+                                   fd,
+                                   metrics.connectedMs ) == EOK ) )
+    {
+        n = dprintf( fd, "}\n" );
+    }
+
+    return ( n > 0 ) ? EOK : EIO;
+}
+
+/*============================================================================*/
+/*  WriteShedMetrics                                                          */
+/*!
+    Write the load shedding metrics as a JSON member
+
+    The shed member reports the shedding level, the number of messages
+    shed for each reason, and the messages shed from each client and
+    each stream.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@param[in]
+    fd
+        file descriptor to write the metrics to
+
+@retval EOK the metrics were written
+@retval EIO the metrics could not be written
+
+==============================================================================*/
+static int WriteShedMetrics( IOTHubState *pState, int fd )
+{
+    ShedStats stats;
+    ShedSource source;
+    size_t i;
+    int n;
+
+    pthread_mutex_lock( &pState->metricsMutex );
+
+    Shed_GetStats( pState->pShed, &stats );
+    n = dprintf( fd,
+                 ",\"shed\":{\"level\":%u,\"total\":%lu,\"priority\":%lu,"
+                 "\"sample\":%lu,\"latest\":%lu,\"other_clients\":%lu,"
+                 "\"other_streams\":%lu,\"clients\":[",
+                 stats.level,
+                 (unsigned long)stats.total,
+                 (unsigned long)stats.reasons[SHED_PRIORITY],
+                 (unsigned long)stats.reasons[SHED_SAMPLE],
+                 (unsigned long)stats.reasons[SHED_LATEST],
+                 (unsigned long)stats.otherClients,
+                 (unsigned long)stats.otherStreams );
+
+    for ( i = 0;
+          ( n > 0 ) &&
+          ( Shed_GetClient( pState->pShed, i, &source ) == EOK );
+          i++ )
+    {
+        /* client names are set by the clients themselves */
+        n = dprintf( fd,
+                     "%s{\"pid\":%u,\"name\":",
+                     ( i > 0 ) ? "," : "",
+                     source.pid );
+        if ( n > 0 )
+        {
+            n = WriteJsonString( fd, source.name );
+        }
+
+        if ( n > 0 )
+        {
+            n = dprintf( fd,
+                         ",\"shed\":%lu,\"bytes\":%lu}",
+                         (unsigned long)source.count,
+                         (unsigned long)source.bytes );
+        }
+    }
+
+    if ( n > 0 )
+    {
+        n = dprintf( fd, "],\"streams\":[" );
+    }
+
+    for ( i = 0;
+          ( n > 0 ) &&
+          ( Shed_GetStream( pState->pShed, i, &source ) == EOK );
+          i++ )
+    {
+        /* stream names come from the message headers */
+        n = dprintf( fd, "%s{\"name\":", ( i > 0 ) ? "," : "" );
+        if ( n > 0 )
+        {
+            n = WriteJsonString( fd, source.name );
+        }
+
+        if ( n > 0 )
+        {
+            n = dprintf( fd,
+                         ",\"shed\":%lu,\"bytes\":%lu}",
+                         (unsigned long)source.count,
+                         (unsigned long)source.bytes );
+        }
+    }
+
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    if ( n > 0 )
+    {
+        n = dprintf( fd, "]}" );
+    }
+
+    return ( n > 0 ) ? EOK : EIO;
+}
+
+/*============================================================================*/
+/*  WriteJsonString                                                           */
+/*!
+    Write a string as a quoted JSON string
+
+    The WriteJsonString function escapes quotes, backslashes and control
+    characters, so a string supplied by a client cannot break the JSON
+    document it is written into.
+
+@param[in]
+    fd
+        file descriptor to write the string to
+
+@param[in]
+    s
+        NUL terminated string to write
+
+@retval number of characters written
+@retval -1 the string could not be written
+
+==============================================================================*/
+static int WriteJsonString( int fd, const char *s )
+{
+    char buf[128];
+    size_t len = 0;
+    int total = 0;
+    int n = 1;
+    unsigned char c;
+
+    buf[len++] = '"';
+
+    while ( n > 0 )
+    {
+        c = (unsigned char)*s;
+
+        /* flush the buffer when the longest escape would not fit */
+        if ( ( c == '\0' ) || ( len > sizeof( buf ) - 8 ) )
+        {
+            if ( c == '\0' )
+            {
+                buf[len++] = '"';
+            }
+
+            n = write( fd, buf, len );
+            if ( n > 0 )
+            {
+                total += n;
+            }
+
+            if ( ( n != (int)len ) || ( c == '\0' ) )
+            {
+                break;
             }
+
+            len = 0;
+        }
+
+        if ( ( c == '"' ) || ( c == '\\' ) )
+        {
+            buf[len++] = '\\';
+            buf[len++] = c;
+        }
+        else if ( c < 0x20 )
+        {
+            len += sprintf( &buf[len], "\\u%04x", c );
+        }
+        else
+        {
+            buf[len++] = c;
         }
 
-        /* free the memory used for the message context */
-        free( pContext );
+        s++;
     }
+
+    return ( n == (int)len ) ? total : -1;
 }
 
 /*============================================================================*/
-/*  usage                                                                     */
+/*  WriteShaperMetrics                                                        */
 /*!
-    Display the application usage
+    Write the bandwidth shaper metrics as a JSON member
 
-    The usage function dumps the application usage message
-    to stderr.
+@param[in]
+    pState
+        pointer to the IOTHubState object
 
-    @param[in]
-       cmdname
-            pointer to the invoked command name
+@param[in]
+    fd
+        file descriptor to write to
 
-    @return none
+@retval EOK the metrics were written
+@retval EIO the metrics could not be written
 
-============================================================================*/
-static void usage( char *cmdname )
+==============================================================================*/
+static int WriteShaperMetrics( IOTHubState *pState, int fd )
 {
-    if( cmdname != NULL )
+    ShaperStats stats;
+    ShaperClass class;
+    size_t i;
+    int n;
+
+    pthread_mutex_lock( &pState->metricsMutex );
+
+    Shaper_GetStats( pState->pShaper, &stats );
+    n = dprintf( fd,
+                 ",\"shaper\":{\"quality\":\"%s\",\"ceiling\":%lu,"
+                 "\"estimate\":%lu,\"drain\":%lu,\"base_wait_ms\":%u,"
+                 "\"window\":%u,\"level\":%d,\"delays\":%lu,"
+                 "\"compressed\":%lu,\"raw_bytes\":%lu,"
+                 "\"packed_bytes\":%lu,\"classes\":[",
+                 Shaper_QualityName( stats.quality ),
+                 (unsigned long)stats.ceiling,
+                 (unsigned long)stats.estimate,
+                 (unsigned long)stats.drainRate,
+                 stats.baseWaitMs,
+                 stats.window,
+                 stats.level,
+                 (unsigned long)stats.delays,
+                 (unsigned long)stats.compressed,
+                 (unsigned long)stats.rawBytes,
+                 (unsigned long)stats.packedBytes );
+
+    for ( i = 0;
+          ( n > 0 ) &&
+          ( Shaper_GetClass( pState->pShaper, i, &class ) == EOK );
+          i++ )
     {
-        fprintf(stderr,
-                "usage: %s [-v] [-h]\n"
-                " [-h] : display this help\n"
-                " [-c connection string] : set the IOTHub connection string\n"
-                " [-v] : verbose output\n",
-                cmdname );
+        n = dprintf( fd,
+                     "%s{\"priority\":%u,\"ceiling\":%lu,\"bytes\":%lu,"
+                     "\"delays\":%lu}",
+                     ( i > 0 ) ? "," : "",
+                     class.priority,
+                     (unsigned long)class.ceiling,
+                     (unsigned long)class.bytes,
+                     (unsigned long)class.delays );
+    }
+
+    pthread_mutex_unlock( &pState->metricsMutex );
+
+    if ( n > 0 )
+    {
+        n = dprintf( fd, "]}" );
     }
+
+    return ( n > 0 ) ? EOK : EIO;
 }
 
 /*============================================================================*/
-/*  ProcessOptions                                                            */
+/*  WriteConnectionMetrics                                                    */
 /*!
-    Process the command line options
+    Write the parallel connection metrics as JSON members
 
-    The ProcessOptions function processes the command line options and
-    populates the iothubtate object
+    The connections member reports the messages sent, confirmed and
+    awaiting confirmation on each connection, and its throughput over
+    the time the service was connected.  The balance member is the
+    mean number of messages sent per connection divided by the largest
+    number sent on one connection: 1 when the streams are spread
+    evenly, and 1/N when all of them hash to the same connection.
 
-    @param[in]
-        argC
-            number of arguments
-            (including the command itself)
+@param[in]
+    pState
+        pointer to the IOTHubState object
 
-    @param[in]
-        argv
-            array of pointers to the command line arguments
+@param[in]
+    fd
+        file descriptor to write the metrics to
 
-    @param[in]
-        pState
-            pointer to the iothub state object
+@param[in]
+    connectedMs
+        time the service has been connected in milliseconds
 
-    @return none
+@retval EOK the metrics were written
+@retval EIO the metrics could not be written
 
 ==============================================================================*/
-static int ProcessOptions( int argC, char *argV[], IOTHubState *pState )
+static int WriteConnectionMetrics( IOTHubState *pState,
+                                   int fd,
+                                   uint64_t connectedMs )
 {
-    int c;
-    int result = EINVAL;
-    const char *options = "hvc:";
+    HubLaneStats lanes[IOTHUB_MAX_CONNECTIONS];
+    size_t count;
+    uint64_t total = 0;
+    uint32_t max = 0;
+    size_t i;
+    int n;
 
-    if( ( pState != NULL ) &&
-        ( argV != NULL ) )
-    {
-        while( ( c = getopt( argC, argV, options ) ) != -1 )
-        {
-            switch( c )
-            {
-                case 'v':
-                    pState->verbose = true;
-                    break;
+    count = ( pState->connectionCount > 0 ) ? pState->connectionCount : 1;
 
-                case 'h':
-                    usage( argV[0] );
-                    break;
+    pthread_mutex_lock( &pState->inFlightMutex );
+    memcpy( lanes, pState->laneStats, sizeof( lanes ) );
+    pthread_mutex_unlock( &pState->inFlightMutex );
 
-                case 'c':
-                    /* get the connection string */
-                    if ( strlen(optarg) < CONNECTION_STRING_SIZE )
-                    {
-                        strcpy( pState->connectionString, optarg );
-                    }
-                    else
-                    {
-                        syslog( LOG_ERR, "invalid connectionstring\n" );
-                    }
-                    break;
+    n = dprintf( fd, ",\"connections\":[" );
+    for ( i = 0; ( n > 0 ) && ( i < count ); i++ )
+    {
+        total += lanes[i].sent;
+        if ( lanes[i].sent > max )
+        {
+            max = lanes[i].sent;
+        }
 
-                default:
-                    break;
+        n = dprintf( fd,
+                     "%s{\"sent\":%u,\"ok\":%u,\"err\":%u,"
+                     "\"in_flight\":%u,\"bytes\":%lu,"
+                     "\"bytes_per_s\":%lu}",
+                     ( i > 0 ) ? "," : "",
+                     lanes[i].sent,
+                     lanes[i].ok,
+                     lanes[i].err,
+                     lanes[i].inFlight,
+                     (unsigned long)lanes[i].bytes,
+                     ( connectedMs > 0 )
+                         ? (unsigned long)( lanes[i].bytes * 1000 /
+                                            connectedMs )
+                         : 0UL );
+    }
 
-            }
-        }
+    if ( n > 0 )
+    {
+        n = dprintf( fd,
+                     "],\"balance\":%.3f",
+                     ( max > 0 ) ? (double)total / count / max : 1.0 );
     }
 
-    return 0;
+    return ( n > 0 ) ? EOK : EIO;
 }
 
 /*============================================================================*/
-/*  SetupTerminationHandler                                                   */
+/*  WriteMetricsFile                                                          */
 /*!
-    Set up an abnormal termination handler
+    Write the connection metrics file
 
-    The SetupTerminationHandler function registers a termination handler
-    function with the kernel in case of an abnormal termination of this
-    process.
+    The metrics are written to a temporary file which is then renamed,
+    so readers never see a partially written file.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
+
+@retval EOK the metrics file was written
+@retval other error as returned from open, WriteMetrics or rename
 
 ==============================================================================*/
-static void SetupTerminationHandler( void )
+static int WriteMetricsFile( IOTHubState *pState )
 {
-    static struct sigaction sigact;
+    char tmp[PATH_MAX];
+    int result;
+    int fd;
 
-    memset( &sigact, 0, sizeof(sigact) );
+    snprintf( tmp, sizeof( tmp ), "%s.tmp", pState->metricsFile );
 
-    sigact.sa_sigaction = TerminationHandler;
-    sigact.sa_flags = SA_SIGINFO;
+    fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( fd == -1 )
+    {
+        return errno;
+    }
 
-    sigaction( SIGTERM, &sigact, NULL );
-    sigaction( SIGINT, &sigact, NULL );
+    result = WriteMetrics( pState, fd );
+    close( fd );
+
+    if ( ( result == EOK ) &&
+         ( rename( tmp, pState->metricsFile ) != 0 ) )
+    {
+        result = errno;
+    }
+
+    if ( result != EOK )
+    {
+        unlink( tmp );
+    }
 
+    return result;
 }
 
 /*============================================================================*/
@@ -1437,7 +7042,7 @@ static void SetupTerminationHandler( void )
     Destroy the message queue
 
     The DestroyMessageQueue function closes and deletes the IOTHUB
-    message queue.
+    message queues.
 
 @param[in]
     pState
@@ -1460,8 +7065,13 @@ static void DestroyMessageQueue( IOTHubState *pState )
             pState->rxHeaders = NULL;
         }
 
-        /* remove the message queue from the system */
-        mq_unlink( MESSAGE_QUEUE_NAME );
+        BodyPool_Destroy( pState->pBodyPool );
+        pState->pBodyPool = NULL;
+
+        /* remove the message queues from the system, unless they have
+           been handed over to a replacement service */
+        Ingest_Destroy( pState->pIngest, !pState->handedOff );
+        pState->pIngest = NULL;
     }
 }
 
@@ -1493,6 +7103,12 @@ static void TerminationHandler( int signum, siginfo_t *info, void *ptr )
     syslog( LOG_ERR, "Abnormal termination of iothub\n" );
     VARSERVER_Close( state.hVarServer );
 
+    /* flush the capture trace */
+    Trace_Close( state.pTrace );
+
+    /* flush the disk outbox */
+    Outbox_Destroy( state.pOutbox );
+
     /* destroy the message queue */
     DestroyMessageQueue( &state );
 
@@ -1662,235 +7278,373 @@ static mqd_t GetService( const char *service, size_t *len )
 }
 
 /*============================================================================*/
-/*  SerializeMsg                                                              */
+/*  RequestHandoff                                                            */
 /*!
-    Serialize IOTHUB message into a message buffer
-
-    The BuildRxMsg function serializes a received message into a message
-    buffer.  It inserts the special message properties "messageId" and
-    "correlationId".  It inserts all the user properties.
-    Each property is inserted into the message buffer as a "key:value\n"
-    pair.  It then inserts an additional newline "\n" character to
-    separate the message header and message body, and then inserts the
-    message body byte array.
-
-    If the constructed message exceeds the available space in the buffer
-    then the message construction fails and no message is generated.
+    Take over the message queue from a running service
 
-    @param[in]
-        msg
-            handle to the IOTHUB message to serialize
+    The RequestHandoff function asks the service listening on the
+    handoff socket, if any, to hand over its message queue.  The
+    running service stops reading the message queue, flushes its disk
+    outbox, and sends the message queue descriptor and its read
+    position in the outbox.  The messages it holds in memory follow,
+    and are received by ReceiveHeldMessages.
 
-    @param[in]
-        propMap
-            handle to the message's properties
+    If no service is running, or it does not respond, the handoff state
+    is cleared and the service starts normally.
 
-    @param[in]
-        maxlen
-            maximium length of the serialized message
+@param[in]
+    pState
+        pointer to the IOTHubState object
 
-    @param[out]
-        totalLength
-            pointer to a location containing the total length of the
-            serialized message.
+@param[out]
+    pHandoff
+        pointer to the handoff state to populate
 
-    @retval pointer to the serialized message
-    @retval NULL if the message could not be serialized due to lack of space
+@retval EOK the message queue was handed over
+@retval ENOENT no service is listening on the handoff socket
+@retval ECONNREFUSED no service is listening on the handoff socket
+@retval other error as returned from Handoff_Request or Handoff_RecvState
 
 ==============================================================================*/
-static char *SerializeMsg( IOTHUB_MESSAGE_HANDLE msg,
-                           size_t maxlen,
-                           size_t *totalLength )
-
+static int RequestHandoff( IOTHubState *pState, HandoffState *pHandoff )
 {
-    char *pMsg = NULL;
-    char *p;
-    const char *messageId;
-    const char *correlationId;
-    const char*const* keys = NULL;
-    const char*const* values = NULL;
-    const unsigned char *body;
-    size_t left = maxlen;
-    size_t bodySize;
-    size_t propCount = 0;
-    size_t len = 0;
-    MAP_RESULT mr;
-    MAP_HANDLE propMap;
-    IOTHUB_MESSAGE_RESULT imr;
-    IOTHUBMESSAGE_CONTENT_TYPE ct;
+    int result;
+    int fd;
+    int mqfd;
 
-    int i;
+    result = Handoff_Request( pState->handoffPath, &fd );
+    if ( result == EOK )
+    {
+        result = Handoff_RecvState( fd, &mqfd, pHandoff );
+        if ( result == EOK )
+        {
+            pState->messageQueue = (mqd_t)mqfd;
+            pState->predecessorFd = fd;
+
+            if ( IOTHUB_VERBOSE( pState->verbose ) )
+            {
+                fprintf( stdout,
+                         "Took over the message queue with %u held "
+                         "messages\n",
+                         pHandoff->bufferCount );
+            }
+        }
+        else
+        {
+            close( fd );
+        }
+    }
 
-    if ( ( msg != NULL ) &&
-         ( totalLength != NULL ) )
+    if ( result != EOK )
     {
-        printf("Allocating %ld bytes\n",maxlen);
-        pMsg = calloc( 1, maxlen );
-        if( pMsg != NULL )
+        if ( ( result != ENOENT ) &&
+             ( result != ECONNREFUSED ) )
         {
-            p = pMsg;
+            fprintf( stderr,
+                     "iothub: handoff failed: %s\n",
+                     strerror( result ) );
+        }
 
-            /* store the message ID */
-            messageId = IoTHubMessage_GetMessageId( msg );
-            printf("messageId: %s\n", messageId);
-            len += AddProperty( &p,
-                                "messageId",
-                                messageId,
-                                &left );
+        memset( pHandoff, 0, sizeof( HandoffState ) );
+    }
 
-            printf("len=%ld\n", len);
+    return result;
+}
 
-            /* store the correlation ID */
-            correlationId = IoTHubMessage_GetCorrelationId( msg );
-            printf("correlationId:%s\n", correlationId);
-            len += AddProperty( &p,
-                                "correlationId",
-                                correlationId,
-                                &left );
+/*============================================================================*/
+/*  ReceiveHeldMessages                                                       */
+/*!
+    Receive the messages held in memory by the previous service
 
-            printf("len=%ld\n", len);
+    The messages are older than any left in the message queue, so they
+    are spilled to the disk outbox if one is configured, or else added
+    to the in-memory buffer, to be sent first once connected.
 
-            /* store the message properties */
-            propMap = IoTHubMessage_Properties( msg );
-            if ( propMap != NULL )
-            {
-                mr = Map_GetInternals(propMap, &keys, &values, &propCount);
-                if ( mr == MAP_OK )
-                {
-                    for( i = 0; i < propCount; i++ )
-                    {
-                        printf("Adding property: %s\n", keys[i]);
-                        len += AddProperty( &p, keys[i], values[i], &left );
-                        printf("len=%ld\n", len);
-                    }
-                }
-            }
+@param[in]
+    pState
+        pointer to the IOTHubState object
 
-            /* store the message body */
-            printf("Getting Message Body\n");
-            ct = IoTHubMessage_GetContentType( msg );
-            if ( ct == IOTHUBMESSAGE_BYTEARRAY )
-            {
-                imr = IoTHubMessage_GetByteArray( msg, &body, &bodySize );
-                printf("Message type is byte array\n");
-            }
-            else if ( ct == IOTHUBMESSAGE_STRING )
+@param[in]
+    pHandoff
+        pointer to the handoff state received from the previous service
+
+@retval EOK all of the held messages were received
+@retval other error as returned from Handoff_RecvRecord
+
+==============================================================================*/
+static int ReceiveHeldMessages( IOTHubState *pState,
+                                HandoffState *pHandoff )
+{
+    int result = EOK;
+    TraceRecord record;
+    uint32_t i;
+
+    for ( i = 0; ( i < pHandoff->bufferCount ) && ( result == EOK ); i++ )
+    {
+        result = Handoff_RecvRecord( pState->predecessorFd, &record );
+        if ( result == EOK )
+        {
+            result = ( pState->pOutbox != NULL )
+                     ? Outbox_Append( pState->pOutbox, &record )
+                     : MsgBuffer_Put( pState->pBuffer,
+                                      &record,
+                                      GetExpiry( record.headers ) );
+            if ( result != EOK )
             {
-                printf("Message type is string\n");
-                body = IoTHubMessage_GetString( msg );
-                bodySize = strlen( body );
-            } else {
-                /* no message body */
-                body = "{}";
-                bodySize = strlen(body);
+                fprintf( stderr,
+                         "iothub: cannot hold handed over message: %s\n",
+                         strerror( result ) );
+                result = EOK;
             }
 
-            printf("bodySize = %ld\n", bodySize);
-            printf("left = %ld\n", left);
-            printf("body: %.*s\n", (int)bodySize, body);
+            free( (void *)record.headers );
+        }
+        else
+        {
+            fprintf( stderr,
+                     "iothub: %u held messages not received: %s\n",
+                     pHandoff->bufferCount - i,
+                     strerror( result ) );
+        }
+    }
+
+    return result;
+}
 
-            /* check if we have enough room for the message
-               body, a newline, and a NUL terminator */
-            if( left > bodySize + 1 )
-            {
-                /* insert header/body delimeter */
-                *p++ = '\n';
-                len++;
-                printf("len=%ld\n", len);
-                left--;
+/*============================================================================*/
+/*  StartHandoff                                                              */
+/*!
+    Start accepting handoff requests
 
-                /* copy the body */
-                memcpy( p, body, bodySize );
-                len += bodySize;
-                left -= bodySize;
+    The StartHandoff function listens on the handoff socket and starts a
+    thread which waits for a replacement service to request a handoff.
 
-                /* add NUL terminator */
-                p[bodySize] = 0;
-                len++;
+@param[in]
+    pState
+        pointer to the IOTHubState object
 
-                printf("pMsg = %s\n", pMsg);
-                *totalLength = len;
-                printf("*totalLength = %ld\n", *totalLength );
-            }
-            else
-            {
-                /* not enough space for the message body */
-                printf("Not enough space for message body\n");
-                free( pMsg );
-                *totalLength = 0;
-                printf("totalLength=%ld\n", *totalLength);
+@retval EOK handoff requests are being accepted
+@retval other error as returned from Handoff_Listen or StartThread
 
-                pMsg = NULL;
-            }
+==============================================================================*/
+static int StartHandoff( IOTHubState *pState )
+{
+    int result;
+
+    pState->handoffListenFd = Handoff_Listen( pState->handoffPath );
+    if ( pState->handoffListenFd == -1 )
+    {
+        result = errno;
+    }
+    else
+    {
+        result = StartThread( HandoffThread, pState );
+        if ( result != EOK )
+        {
+            close( pState->handoffListenFd );
+            pState->handoffListenFd = -1;
         }
     }
 
-    return pMsg;
+    if ( result != EOK )
+    {
+        fprintf( stderr,
+                 "iothub: cannot listen on %s: %s\n",
+                 pState->handoffPath,
+                 strerror( result ) );
+    }
+
+    return result;
 }
 
 /*============================================================================*/
-/*  AddProperty                                                               */
+/*  HandoffThread                                                             */
 /*!
-    Add a key/value property to a message buffer
+    Handoff request thread
 
-    The AddProperty function adds a key/value message property to a message
-    buffer.  It adds the property using the following format:
+    The HandoffThread function waits for a replacement service to
+    request a handoff.  The handoff socket is removed before the
+    request is passed to the message processing loop, so the
+    replacement service can listen on it for the next handoff.
 
-    key:value\n
+@param[in]
+    arg
+        pointer to the IOTHubState object
 
-    It calculates the length of the property string and ensures there is
-    enough space left in the message buffer and then updates the insertion
-    point of the buffer, and the number of bytes remaining in the buffer.
+@retval NULL
 
-    @param[in,out]
-        p
-            pointer to a pointer to the insertion point in the buffer.
+==============================================================================*/
+static void *HandoffThread( void *arg )
+{
+    IOTHubState *pState = (IOTHubState *)arg;
+    int fd;
 
-    @param[in]
-        key
-            property name string
+    fd = Handoff_Accept( pState->handoffListenFd );
 
-    @param[in]
-        value
-            property value string
+    close( pState->handoffListenFd );
+    pState->handoffListenFd = -1;
+    unlink( pState->handoffPath );
+
+    if ( fd != -1 )
+    {
+        pthread_mutex_lock( &pState->clientMutex );
+        pState->handoffFd = fd;
+        pthread_mutex_unlock( &pState->clientMutex );
+
+        /* stop waiting for ingest to resume */
+        ConnState_Wake( pState->pConnState );
+    }
+    else
+    {
+        fprintf( stderr, "iothub: handoff: %s\n", strerror( errno ) );
+    }
+
+    return NULL;
+}
+
+/*============================================================================*/
+/*  HandOver                                                                  */
+/*!
+    Hand the message queue over to a replacement service
+
+    The HandOver function is called from the message processing loop
+    once a replacement service has requested a handoff, so no message
+    is being received.  It flushes the disk outbox and sends the
+    message queue descriptor and the outbox read position, followed by
+    the messages held in memory.  It then waits up to
+    IOTHUB_HANDOFF_DRAIN_MS for the messages already sent to be
+    confirmed, disconnects, and closes the handoff socket so the
+    replacement service can connect.
+
+    The message queue is not removed, so clients never see it disappear.
+
+    If the state cannot be sent, the handoff is abandoned and the
+    service continues.  If the held messages cannot all be sent, the
+    rest are sent to the IOTHUB before the service finishes.
+
+@param[in]
+    pState
+        pointer to the IOTHubState object
 
-    @param[out]
-        left
-            pointer to a location containing the number of bytes remaining
-            in the buffer
+@param[in]
+    fd
+        socket connected to the replacement service
 
-    @returns the number of bytes added to the buffer
+@retval EOK the message queue was handed over
+@retval other error as returned from Handoff_SendState
 
 ==============================================================================*/
-static size_t AddProperty( char **p,
-                           const char *key,
-                           const char *value,
-                           size_t *left )
+static int HandOver( IOTHubState *pState, int fd )
 {
-    size_t len = 0;
+    int result;
+    HandoffState handoff;
+    MsgBufferStats stats;
+    EdfQueueStats edfStats;
+    TraceRecord record;
+    uint64_t deadline;
+    uint64_t due;
+
+    memset( &handoff, 0, sizeof( handoff ) );
+    handoff.magic = HANDOFF_MAGIC;
+    handoff.version = HANDOFF_VERSION;
+
+    /* flush the outbox so the replacement service can read it */
+    Outbox_GetCursor( pState->pOutbox, &handoff.outbox );
+    Outbox_Destroy( pState->pOutbox );
+    pState->pOutbox = NULL;
+
+    /* drop the expired messages before the held messages are counted */
+    ExpireBacklog( pState );
+
+    MsgBuffer_GetStats( pState->pBuffer, &stats );
+    EdfQueue_GetStats( pState->pEdf, &edfStats );
+    handoff.bufferCount = stats.count + edfStats.count;
+    handoff.bufferBytes = stats.bytes + edfStats.bytes;
+
+    result = Handoff_SendState( fd,
+                                (int)Ingest_Queue( pState->pIngest,
+                                                   MESSAGE_QUEUE_NAME ),
+                                &handoff );
+    if ( result != EOK )
+    {
+        fprintf( stderr, "iothub: handoff failed: %s\n", strerror( result ) );
+        close( fd );
+
+        /* carry on as before */
+        if ( pState->outboxDir != NULL )
+        {
+            pState->pOutbox = Outbox_Create( pState->outboxDir,
+                                             pState->outboxLimit );
+            Outbox_Seek( pState->pOutbox, &handoff.outbox );
+        }
+
+        StartHandoff( pState );
+
+        return result;
+    }
 
-    if ( ( p != NULL ) &&
-         ( *p != NULL ) &&
-         ( key != NULL ) &&
-         ( value != NULL ) &&
-         ( left != NULL ))
+    /* the replacement service now reads the message queues */
+    pthread_mutex_lock( &pState->metricsMutex );
+    pState->queueStatsCount = 0;
+    Ingest_Destroy( pState->pIngest, false );
+    pState->pIngest = NULL;
+    pthread_mutex_unlock( &pState->metricsMutex );
+    pState->handedOff = true;
+
+    /* pass on the messages held in memory, starting with those
+       waiting in deadline order which arrived first */
+    while ( EdfQueue_Peek( pState->pEdf, &record, &due ) == EOK )
     {
-        len = strlen( key ) + strlen ( value ) + 2;
-        if( *left > len )
+        if ( Handoff_SendRecord( fd, &record ) != EOK )
         {
-            if( snprintf(*p, *left, "%s:%s\n", key, value ) == len )
-            {
-                *left -= len;
-                *p += len;
-            }
+            fprintf( stderr, "iothub: sending held messages to the hub\n" );
+            break;
         }
-        else
+
+        EdfQueue_Pop( pState->pEdf );
+    }
+
+    while ( MsgBuffer_Peek( pState->pBuffer, &record ) == EOK )
+    {
+        if ( Handoff_SendRecord( fd, &record ) != EOK )
         {
-            len = 0;
+            fprintf( stderr, "iothub: sending held messages to the hub\n" );
+            break;
         }
+
+        MsgBuffer_Pop( pState->pBuffer );
     }
 
-    return len;
+    /* wait for the messages already sent to be confirmed */
+    deadline = GetTimeUs() + (uint64_t)IOTHUB_HANDOFF_DRAIN_MS * 1000;
+    while ( ( ( InFlight( pState ) > 0 ) ||
+              ( MsgBuffer_Empty( pState->pBuffer ) == false ) ||
+              ( EdfQueue_Empty( pState->pEdf ) == false ) ) &&
+            ( GetTimeUs() < deadline ) )
+    {
+        if ( ConnState_Get( pState->pConnState, NULL ) ==
+                CONNSTATE_CONNECTED )
+        {
+            DrainBacklog( pState );
+        }
+
+        UpdateMetrics( pState );
+        ConnState_Wait( pState->pConnState, IOTHUB_DRAIN_POLL_MS );
+    }
+
+    if ( IOTHUB_VERBOSE( pState->verbose ) )
+    {
+        fprintf( stdout,
+                 "Handed over the message queue (%u messages "
+                 "unconfirmed)\n",
+                 InFlight( pState ) );
+    }
+
+    /* let the replacement service connect */
+    Disconnect( pState );
+    close( fd );
+
+    return EOK;
 }
 
 /*! @}
@@ -0,0 +1,760 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup iotmsg iotmsg
+ * @brief IOTHub message header parsing and serialization
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file iotmsg.c
+
+    IOTHub message header parsing and serialization
+
+    The iotmsg module converts client message headers into IOTHub
+    message properties, and serializes received IOTHub messages into
+    the header/body format expected by the local services.
+
+    It is kept separate from the iothub service so it can be linked
+    into the message benchmarks without the service main loop.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <varserver/varserver.h>
+#include <azureiot/iothub_client.h>
+#include <uuid/uuid.h>
+#include "iotmsg.h"
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static void ClearMessageProperties( MsgProp *pProp );
+static int SetMessageProperty( IOTHUB_MESSAGE_HANDLE messageHandle,
+                               MAP_HANDLE propMap,
+                               const char *pKey,
+                               const char *pValue );
+static MsgProp **AddMessageProperty( MsgProp **ppProp,
+                                     const char *pKey,
+                                     const char *pValue );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+
+/*============================================================================*/
+/*  BuildMessageProperties                                                    */
+/*!
+    Build the list of message properties from the specified message header
+
+    The BuildMessageProperties function extracts the message properties
+    from the specified message header.  The properties are expected to
+    be one per line, with the property name and value separated by
+    a colon.  Each line must be separated by a linefeed '\n', and
+    the final property must be terminated with two linefeeds: "\n\n"
+
+    eg
+
+    property-1:value-1\n
+    property-2:value-2\n
+    ...
+    property-last:value-last\n
+    \n
+
+    The function stores extracted properties into the specified property
+    list, automatically extending the list if its length is exceeded.
+    There is currently no enforced maximum property list length.
+
+    @param[in]
+        ppProp
+            pointer to a pointer to the message property list.
+
+    @param[in]
+        header
+            pointer to a NUL terminated string containing the property list
+            as described above
+
+    @retval EOK the property list was populated successfully
+    @retval ENOMEM unable to allocate memory for the property list
+    @retval EINVAL invalid arguments
+
+==============================================================================*/
+int BuildMessageProperties( MsgProp **ppProp, char *header )
+{
+    int result = EINVAL;
+    const char *pKey;
+    const char *pValue;
+    char *p;
+    const char *pStart;
+    bool done = false;
+    int propertyCount = 0;
+    int state = 0;
+    char c;
+    int rc;
+
+    if ( ( ppProp != NULL ) &&
+         ( header != NULL ) )
+    {
+        /* clear out any previous message properties */
+        ClearMessageProperties( *ppProp );
+
+        /* initial conditions */
+        p = header;
+        pStart = header;
+
+        while( !done && ( ppProp != NULL ) )
+        {
+            c = *p;
+
+            switch( state )
+            {
+                case 0:
+                default:
+                    /* looking for key */
+                    if ( c == ':' )
+                    {
+                        *p = '\0';
+                        pKey = pStart;
+                        pStart = p+1;
+                        state = 1;
+                    }
+                    else if ( ( c == '\n' ) || ( c == 0 ) )
+                    {
+                        done = true;
+                    }
+                    break;
+
+                case 1:
+                    /* looking for value */
+                    if ( ( c == '\n' ) || ( c == 0 ) )
+                    {
+                        pValue = pStart;
+
+                        if ( c == 0 )
+                        {
+                            done = true;
+                        }
+                        else
+                        {
+                            *p = '\0';
+                            pStart = p+1;
+                            state = 0;
+                        }
+
+                        /* add message property */
+                        ppProp = AddMessageProperty( ppProp, pKey, pValue );
+                    }
+                    break;
+            }
+
+            p++;
+        }
+
+        /* check for memory allocation failure */
+        result = (ppProp != NULL ) ? EOK : ENOMEM;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  AddMessageProperty                                                        */
+/*!
+    Add a message property to the list of IOTHub message properties
+
+    The AddMessageProperty function adds a new message property
+    specified by the property key and value to the specified
+    MsgProp list.  The MsgProp argument points to the pointer to
+    the next MsgProp object to be populated.  If the "next" MsgProp
+    pointer is NULL, then a new MsgProp object is allocated on the
+    heap, populated, and appended at the location specifed by
+    the ppProp argument.
+
+    @param[in]
+        ppProp
+            pointer to a pointer to the next MsgProp object to
+            be populated.  If the next MsgProp object is NULL,
+            it will be allocated.
+
+    @param[in]
+        pKey
+            pointer to a NUL terminated string containing the
+            property name
+
+    @param[in]
+        pValue
+            pointer to a NUL terminated string containing the
+            property value
+
+    @retval pointer to the pointer to the next MsgProp object to be populated
+    @retval NULL invalid arguments or memory allocation failure
+
+==============================================================================*/
+static MsgProp **AddMessageProperty( MsgProp **ppProp,
+                                     const char *pKey,
+                                     const char *pValue )
+{
+    MsgProp **result = NULL;
+
+    if ( ( ppProp != NULL ) &&
+         ( pKey != NULL ) &&
+         ( pValue != NULL ) )
+    {
+        if( *ppProp == NULL )
+        {
+            /* allocate memory for a new message property */
+            *ppProp = malloc( sizeof( MsgProp ) );
+            if ( *ppProp != NULL )
+            {
+                /* create a new MsgProp object */
+                (*ppProp)->pKey = pKey;
+                (*ppProp)->pValue = pValue;
+                (*ppProp)->pNext = NULL;
+
+                /* return a pointer to the pNext field of the new property */
+                result = &((*ppProp)->pNext);
+            }
+        }
+        else
+        {
+            /* fill an existing MsgProp object */
+            (*ppProp)->pKey = pKey;
+            (*ppProp)->pValue = pValue;
+
+            /* return a pointer to the pNext field of the new property */
+            result = &((*ppProp)->pNext);
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ClearMessageProperties                                                    */
+/*!
+    Clear the specified message properties list
+
+    The ClearMessageProperties function clears the specified message property
+    list by iterating through the list and setting the property key and
+    value pointers to NULL.
+
+    Note, it is not the responsibilty of this function to deallocate any
+    memory on the heap used for these keys and values.
+
+    This function returns no results
+
+    @param[in]
+        pProp
+            pointer to the MsgProp list to clear
+            a pointer to the next MsgProp object to
+
+==============================================================================*/
+static void ClearMessageProperties( MsgProp *pProp )
+{
+    while ( pProp != NULL )
+    {
+        pProp->pKey = NULL;
+        pProp->pValue = NULL;
+
+        pProp = pProp->pNext;
+    }
+}
+
+/*============================================================================*/
+/*  SetMessageProperties                                                      */
+/*!
+    Set the properties in the IOTHub Message
+
+    The SetMessageProperties function copies the message properties from
+    the specified MsgProp list into the IOTHUB_MESSAGE.
+
+    @param[in]
+        messageHandle
+            handle to the IOTHUB_MESSAGE to populate
+
+    @param[in]
+        pMsgProp
+            pointer to the MsgProp list to assign to the message
+
+    @retval EOK message properties were assigned successfully
+    @retval EINVAL invalid arguments
+
+==============================================================================*/
+int SetMessageProperties( IOTHUB_MESSAGE_HANDLE messageHandle,
+                          MsgProp *pMsgProp )
+{
+    int result = EINVAL;
+    MAP_HANDLE propMap;
+    int rc;
+
+    if ( ( pMsgProp != NULL ) &&
+         ( messageHandle != NULL ) )
+    {
+        result = EOK;
+
+        /* get the property map for the message */
+        propMap = IoTHubMessage_Properties(messageHandle);
+        if( propMap != NULL )
+        {
+            while ( pMsgProp != NULL )
+            {
+                if( pMsgProp->pKey != NULL )
+                {
+                    /* set the message property */
+                    rc = SetMessageProperty( messageHandle,
+                                                propMap,
+                                                pMsgProp->pKey,
+                                                pMsgProp->pValue );
+                    if ( rc != EOK )
+                    {
+                        result = rc;
+                    }
+                }
+                else
+                {
+                    /* no more properties */
+                    break;
+                }
+
+                pMsgProp = pMsgProp->pNext;
+            }
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SetMessageProperty                                                        */
+/*!
+    Set a property in the IOTHub Message
+
+    The SetMessageProperty function sets a single message property in the
+    IOTHUB_MESSAGE.
+
+    There are two special cases:
+
+    1) If the message property is 'messageId' then the message identifier
+    is set via the IoTHubMessage_SetMessageId function.
+
+    2) If the message property is 'correlationId' then the correlation
+    identifier is set via the IoTHubMessage_SetCorrelationId function.
+
+    All other properties are added as user-properties via the Map_AddOrUpdate
+    function.
+
+    @param[in]
+        messageHandle
+            handle to the IOTHUB_MESSAGE to populate
+
+    @param[in]
+        propMap
+            handle to the property map for the message
+
+    @param[in]
+        pKey
+            pointer to a NUL terminated string containing the property name
+
+    @param[in]
+        pValue
+            pointer to a NUL terminated string containing the property value
+
+    @retval EOK the message property was assigned successfully
+    @retval EINVAL invalid arguments
+    @retval ENOTSUP failed to set the message or correlation identifier
+    @retval ENOENT failed to add the custom user property
+
+==============================================================================*/
+static int SetMessageProperty( IOTHUB_MESSAGE_HANDLE messageHandle,
+                               MAP_HANDLE propMap,
+                               const char *pKey,
+                               const char *pValue )
+{
+    int result = EINVAL;
+    IOTHUB_MESSAGE_RESULT imr = IOTHUB_MESSAGE_INVALID_ARG;
+    MAP_RESULT mr = MAP_INVALIDARG;
+
+    if ( ( messageHandle != NULL ) &&
+         ( propMap != NULL ) &&
+         ( pKey != NULL ) &&
+         ( pValue != NULL ) )
+    {
+        result = EOK;
+
+        if( strncmp( pKey, "correlationId", 13 ) == 0 )
+        {
+            /* set the message correlation identifier from the
+               supplied property */
+            imr = IoTHubMessage_SetCorrelationId( messageHandle, pValue );
+            if ( imr != IOTHUB_MESSAGE_OK )
+            {
+                result = ENOTSUP;
+            }
+        }
+        else if( strncmp( pKey, "messageId", 9) == 0 )
+        {
+            /* set the message identifier from the supplied property */
+            imr = IoTHubMessage_SetMessageId( messageHandle, pValue );
+            if ( imr != IOTHUB_MESSAGE_OK )
+            {
+                result = ENOTSUP;
+            }
+        }
+        else
+        {
+            /* set custom message properties */
+            mr = Map_AddOrUpdate( propMap, pKey, pValue );
+            if ( mr != MAP_OK )
+            {
+                result = ENOENT;
+            }
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  FreeMessageProperties                                                     */
+/*!
+    Free a message property list
+
+    The FreeMessageProperties function deallocates every MsgProp object
+    in the specified list and sets the list pointer to NULL.  The
+    property list is reused from message to message and only grows to
+    the largest number of properties seen in a single message, so it
+    only needs to be freed when the service shuts down.
+
+    As with ClearMessageProperties, the keys and values are not owned
+    by the list and are not freed.
+
+    @param[in]
+        ppProp
+            pointer to a pointer to the message property list to free
+
+==============================================================================*/
+void FreeMessageProperties( MsgProp **ppProp )
+{
+    MsgProp *pProp;
+    MsgProp *pNext;
+
+    if ( ppProp != NULL )
+    {
+        pProp = *ppProp;
+        while ( pProp != NULL )
+        {
+            pNext = pProp->pNext;
+            free( pProp );
+            pProp = pNext;
+        }
+
+        *ppProp = NULL;
+    }
+}
+
+
+/*============================================================================*/
+/*  SerializeMsg                                                              */
+/*!
+    Serialize IOTHUB message into a message buffer
+
+    The BuildRxMsg function serializes a received message into a message
+    buffer.  It inserts the special message properties "messageId" and
+    "correlationId".  It inserts all the user properties.
+    Each property is inserted into the message buffer as a "key:value\n"
+    pair.  It then inserts an additional newline "\n" character to
+    separate the message header and message body, and then inserts the
+    message body byte array.
+
+    If the constructed message exceeds the available space in the buffer
+    then the message construction fails and no message is generated.
+
+    @param[in]
+        msg
+            handle to the IOTHUB message to serialize
+
+    @param[in]
+        propMap
+            handle to the message's properties
+
+    @param[in]
+        maxlen
+            maximium length of the serialized message
+
+    @param[out]
+        totalLength
+            pointer to a location containing the total length of the
+            serialized message.
+
+    @retval pointer to the serialized message
+    @retval NULL if the message could not be serialized due to lack of space
+
+==============================================================================*/
+char *SerializeMsg( IOTHUB_MESSAGE_HANDLE msg,
+                    size_t maxlen,
+                    size_t *totalLength )
+
+{
+    char *pMsg = NULL;
+    char *p;
+    const char *messageId;
+    const char *correlationId;
+    const char*const* keys = NULL;
+    const char*const* values = NULL;
+    const unsigned char *body;
+    size_t left = maxlen;
+    size_t bodySize;
+    size_t propCount = 0;
+    size_t len = 0;
+    MAP_RESULT mr;
+    MAP_HANDLE propMap;
+    IOTHUB_MESSAGE_RESULT imr;
+    IOTHUBMESSAGE_CONTENT_TYPE ct;
+
+    int i;
+
+    if ( ( msg != NULL ) &&
+         ( totalLength != NULL ) )
+    {
+        printf("Allocating %ld bytes\n",maxlen);
+        pMsg = calloc( 1, maxlen );
+        if( pMsg != NULL )
+        {
+            p = pMsg;
+
+            /* store the message ID */
+            messageId = IoTHubMessage_GetMessageId( msg );
+            printf("messageId: %s\n", messageId);
+            len += AddProperty( &p,
+                                "messageId",
+                                messageId,
+                                &left );
+
+            printf("len=%ld\n", len);
+
+            /* store the correlation ID */
+            correlationId = IoTHubMessage_GetCorrelationId( msg );
+            printf("correlationId:%s\n", correlationId);
+            len += AddProperty( &p,
+                                "correlationId",
+                                correlationId,
+                                &left );
+
+            printf("len=%ld\n", len);
+
+            /* store the message properties */
+            propMap = IoTHubMessage_Properties( msg );
+            if ( propMap != NULL )
+            {
+                mr = Map_GetInternals(propMap, &keys, &values, &propCount);
+                if ( mr == MAP_OK )
+                {
+                    for( i = 0; i < propCount; i++ )
+                    {
+                        printf("Adding property: %s\n", keys[i]);
+                        len += AddProperty( &p, keys[i], values[i], &left );
+                        printf("len=%ld\n", len);
+                    }
+                }
+            }
+
+            /* store the message body */
+            printf("Getting Message Body\n");
+            ct = IoTHubMessage_GetContentType( msg );
+            if ( ct == IOTHUBMESSAGE_BYTEARRAY )
+            {
+                imr = IoTHubMessage_GetByteArray( msg, &body, &bodySize );
+                printf("Message type is byte array\n");
+            }
+            else if ( ct == IOTHUBMESSAGE_STRING )
+            {
+                printf("Message type is string\n");
+                body = IoTHubMessage_GetString( msg );
+                bodySize = strlen( body );
+            } else {
+                /* no message body */
+                body = "{}";
+                bodySize = strlen(body);
+            }
+
+            printf("bodySize = %ld\n", bodySize);
+            printf("left = %ld\n", left);
+            printf("body: %.*s\n", (int)bodySize, body);
+
+            /* check if we have enough room for the message
+               body, a newline, and a NUL terminator */
+            if( left > bodySize + 1 )
+            {
+                /* insert header/body delimeter */
+                *p++ = '\n';
+                len++;
+                printf("len=%ld\n", len);
+                left--;
+
+                /* copy the body */
+                memcpy( p, body, bodySize );
+                len += bodySize;
+                left -= bodySize;
+
+                /* add NUL terminator */
+                p[bodySize] = 0;
+                len++;
+
+                printf("pMsg = %s\n", pMsg);
+                *totalLength = len;
+                printf("*totalLength = %ld\n", *totalLength );
+            }
+            else
+            {
+                /* not enough space for the message body */
+                printf("Not enough space for message body\n");
+                free( pMsg );
+                *totalLength = 0;
+                printf("totalLength=%ld\n", *totalLength);
+
+                pMsg = NULL;
+            }
+        }
+    }
+
+    return pMsg;
+}
+
+/*============================================================================*/
+/*  AddProperty                                                               */
+/*!
+    Add a key/value property to a message buffer
+
+    The AddProperty function adds a key/value message property to a message
+    buffer.  It adds the property using the following format:
+
+    key:value\n
+
+    It calculates the length of the property string and ensures there is
+    enough space left in the message buffer and then updates the insertion
+    point of the buffer, and the number of bytes remaining in the buffer.
+
+    @param[in,out]
+        p
+            pointer to a pointer to the insertion point in the buffer.
+
+    @param[in]
+        key
+            property name string
+
+    @param[in]
+        value
+            property value string
+
+    @param[out]
+        left
+            pointer to a location containing the number of bytes remaining
+            in the buffer
+
+    @returns the number of bytes added to the buffer
+
+==============================================================================*/
+size_t AddProperty( char **p,
+                    const char *key,
+                    const char *value,
+                    size_t *left )
+{
+    size_t len = 0;
+
+    if ( ( p != NULL ) &&
+         ( *p != NULL ) &&
+         ( key != NULL ) &&
+         ( value != NULL ) &&
+         ( left != NULL ))
+    {
+        len = strlen( key ) + strlen ( value ) + 2;
+        if( *left > len )
+        {
+            if( snprintf(*p, *left, "%s:%s\n", key, value ) == len )
+            {
+                *left -= len;
+                *p += len;
+            }
+        }
+        else
+        {
+            len = 0;
+        }
+    }
+
+    return len;
+}
+/*============================================================================*/
+/*  GenerateMessageId                                                         */
+/*!
+    Generate a unique message identifier
+
+    The GenerateMessageId function generates a new UUID and writes its
+    string representation into the specified buffer.  It is used to
+    assign a message identifier to messages whose headers do not
+    specify one.
+
+    @param[out]
+        buf
+            pointer to the buffer to write the message identifier into
+
+    @param[in]
+        len
+            size of the output buffer.  Must be at least MESSAGE_ID_SIZE
+
+    @retval EOK the message identifier was generated
+    @retval EINVAL invalid arguments
+
+==============================================================================*/
+int GenerateMessageId( char *buf, size_t len )
+{
+    int result = EINVAL;
+    uuid_t uuid;
+
+    if ( ( buf != NULL ) &&
+         ( len >= MESSAGE_ID_SIZE ) )
+    {
+        uuid_generate( uuid );
+        uuid_unparse( uuid, buf );
+        result = EOK;
+    }
+
+    return result;
+}
+
+/*! @}
+ * end of iotmsg group */
@@ -0,0 +1,1310 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup iotsend iotsend
+ * @brief Asynchronous batching client for the iothub service
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file iotsend.c
+
+    Asynchronous batching client
+
+    The iotsend library sends device-to-cloud messages to the iothub
+    service without waiting for each one.  IotSend_Message queues a
+    message and returns at once; a sender thread collects the queued
+    messages into batches and sends each batch as one IOTB frame on the
+    iothub message queue and one write to the client's FIFO (see
+    iotbatch.h).  A batch is sent when it is full, or when its oldest
+    message has waited for the linger time.
+
+    The message queue and the FIFO are opened once and kept for the
+    life of the sender.  The sender holds both ends of its FIFO, so its
+    writes neither wait for the service to open the FIFO nor fail while
+    it is closed, and the FIFO does not have to be replaced after each
+    message: the batch entries give the length of every message, so the
+    service reads exactly one batch and the next batch stays in the
+    FIFO.  Messages written to the FIFO complete once the service has
+    read them, which the sender thread sees from the number of unread
+    bytes left in the FIFO, and their callbacks are then called in the
+    order the messages were submitted.
+
+    The service takes batch frames of different priorities out of order,
+    so a batch with a different priority from the previous one is only
+    sent once the service has read every earlier batch.
+
+    Since the FIFO is named after the process id, a process can open
+    only one sender at a time.  It may be shared by any number of
+    threads.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <mqueue.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <varserver/varserver.h>
+#include "iotbatch.h"
+#include "iotsend.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! interval between checks for messages read by the service in
+    microseconds */
+#define IOTSEND_POLL_US ( 500 )
+
+/*! interval between checks for a stopped sender while blocked in
+    milliseconds */
+#define IOTSEND_BLOCK_MS ( 100 )
+
+/*! a queued message */
+typedef struct iotSendMsg
+{
+    /*! next message in the list */
+    struct iotSendMsg *pNext;
+
+    /*! message queue priority of the message */
+    unsigned int priority;
+
+    /*! function to call when the message completes */
+    IotSendCallback callback;
+
+    /*! argument for the callback */
+    void *arg;
+
+    /*! time the message was queued in microseconds */
+    uint64_t queuedUs;
+
+    /*! FIFO offset of the end of the message once it is written */
+    uint64_t end;
+
+    /*! length of the message data */
+    size_t length;
+
+    /*! batch entry, header block and body */
+    char data[];
+
+} IotSendMsg;
+
+/*! asynchronous sender */
+struct iotSend
+{
+    /*! sender configuration */
+    IotSendConfig config;
+
+    /*! iothub message queue */
+    mqd_t mq;
+
+    /*! FIFO opened for reading and writing */
+    int fd;
+
+    /*! FIFO name */
+    char fifoName[64];
+
+    /*! process id of the client */
+    uint32_t pid;
+
+    /*! largest header block the message queue can carry */
+    size_t maxHeaders;
+
+    /*! sender thread */
+    pthread_t thread;
+
+    /*! protects the fields below */
+    pthread_mutex_t mutex;
+
+    /*! signals the sender thread */
+    pthread_cond_t cond;
+
+    /*! signals completed messages */
+    pthread_cond_t done;
+
+    /*! messages waiting to be sent */
+    IotSendMsg *pHead;
+
+    /*! last message waiting to be sent */
+    IotSendMsg *pTail;
+
+    /*! number of messages waiting to be sent */
+    uint32_t waiting;
+
+    /*! size of the messages waiting to be sent */
+    size_t waitingBytes;
+
+    /*! number of threads waiting in IotSend_Flush */
+    uint32_t flushing;
+
+    /*! no more messages will be submitted */
+    bool closing;
+
+    /*! the remaining messages are abandoned */
+    bool stopping;
+
+    /*! sender statistics */
+    IotSendStats stats;
+
+    /*! messages written to the FIFO and not yet read, used only by
+        the sender thread */
+    IotSendMsg *pSentHead;
+
+    /*! last message written to the FIFO */
+    IotSendMsg *pSentTail;
+
+    /*! total number of bytes written to the FIFO */
+    uint64_t written;
+
+    /*! priority of the last batch sent */
+    unsigned int lastPriority;
+};
+
+/*==============================================================================
+        Private file scoped variables
+==============================================================================*/
+
+/*! protects the open flag */
+static pthread_mutex_t openMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*! a sender is open in this process */
+static bool isOpen = false;
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static void *SendThread( void *arg );
+static uint64_t BatchWait( IotSend *pSend );
+static IotSendMsg *TakeBatch( IotSend *pSend,
+                              uint32_t *pCount,
+                              size_t *pBytes );
+static int SendBatch( IotSend *pSend,
+                      IotSendMsg *pBatch,
+                      uint32_t count,
+                      size_t bytes );
+static int SendFrame( IotSend *pSend, uint32_t count, unsigned int priority );
+static int WriteBatch( IotSend *pSend, IotSendMsg *pBatch, uint32_t count );
+static IotSendMsg *TakeRead( IotSend *pSend );
+static void Complete( IotSend *pSend, IotSendMsg *pMsg, int result );
+static bool Stopping( IotSend *pSend );
+static void WaitCond( IotSend *pSend, pthread_cond_t *pCond, uint64_t us );
+static uint64_t GetTimeUs( void );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  IotSend_Open                                                              */
+/*!
+    Open an asynchronous sender
+
+    The IotSend_Open function opens the iothub message queue, creates
+    the client's FIFO and starts the sender thread.
+
+    @param[in]
+        pConfig
+            pointer to the sender configuration, or NULL for the
+            default configuration
+
+    @retval pointer to the sender
+    @retval NULL the sender could not be opened.  errno is EBUSY if a
+            sender is already open in this process
+
+==============================================================================*/
+IotSend *IotSend_Open( const IotSendConfig *pConfig )
+{
+    IotSend *pSend;
+    struct mq_attr attr;
+    pthread_condattr_t condattr;
+    int result = ENOMEM;
+
+    pthread_mutex_lock( &openMutex );
+    if ( isOpen == true )
+    {
+        pthread_mutex_unlock( &openMutex );
+        errno = EBUSY;
+        return NULL;
+    }
+
+    pSend = calloc( 1, sizeof( IotSend ) );
+    if ( pSend != NULL )
+    {
+        if ( pConfig != NULL )
+        {
+            pSend->config = *pConfig;
+        }
+
+        if ( pSend->config.queueName == NULL )
+        {
+            pSend->config.queueName = IOTSEND_DEFAULT_QUEUE;
+        }
+
+        if ( ( pSend->config.batchCount == 0 ) ||
+             ( pSend->config.batchCount > IOTBATCH_MAX_COUNT ) )
+        {
+            pSend->config.batchCount = ( pSend->config.batchCount == 0 )
+                                       ? IOTSEND_DEFAULT_BATCH_COUNT
+                                       : IOTBATCH_MAX_COUNT;
+        }
+
+        if ( pSend->config.batchBytes == 0 )
+        {
+            pSend->config.batchBytes = IOTSEND_DEFAULT_BATCH_BYTES;
+        }
+
+        if ( pSend->config.lingerUs == 0 )
+        {
+            pSend->config.lingerUs = IOTSEND_DEFAULT_LINGER_US;
+        }
+
+        if ( pSend->config.queueLimit == 0 )
+        {
+            pSend->config.queueLimit = IOTSEND_DEFAULT_QUEUE_LIMIT;
+        }
+
+        pSend->pid = getpid();
+        pSend->fd = -1;
+        snprintf( pSend->fifoName,
+                  sizeof( pSend->fifoName ),
+                  "/tmp/iothub_%u",
+                  pSend->pid );
+
+        /* open the message queue and check the frames fit in it */
+        pSend->mq = mq_open( pSend->config.queueName, O_WRONLY );
+        result = ( pSend->mq != (mqd_t)-1 ) ? EOK : errno;
+        if ( result == EOK )
+        {
+            result = ( mq_getattr( pSend->mq, &attr ) == 0 ) ? EOK : errno;
+        }
+
+        if ( ( result == EOK ) &&
+             ( attr.mq_msgsize < (long)sizeof( IotBatchFrame ) ) )
+        {
+            result = EMSGSIZE;
+        }
+
+        if ( result == EOK )
+        {
+            pSend->maxHeaders = attr.mq_msgsize - 8;
+
+            /* create the FIFO and hold both of its ends */
+            unlink( pSend->fifoName );
+            if ( mkfifo( pSend->fifoName, S_IRUSR | S_IWUSR ) == 0 )
+            {
+                pSend->fd = open( pSend->fifoName,
+                                  O_RDWR | O_NONBLOCK | O_CLOEXEC );
+            }
+
+            result = ( pSend->fd != -1 ) ? EOK : errno;
+        }
+
+        if ( result == EOK )
+        {
+            /* room for a whole batch lets the service read it at once */
+            (void)fcntl( pSend->fd,
+                         F_SETPIPE_SZ,
+                         (int)pSend->config.batchBytes );
+
+            pthread_mutex_init( &pSend->mutex, NULL );
+            pthread_condattr_init( &condattr );
+            pthread_condattr_setclock( &condattr, CLOCK_MONOTONIC );
+            pthread_cond_init( &pSend->cond, &condattr );
+            pthread_cond_init( &pSend->done, &condattr );
+            pthread_condattr_destroy( &condattr );
+
+            result = pthread_create( &pSend->thread,
+                                     NULL,
+                                     SendThread,
+                                     pSend );
+            if ( result != EOK )
+            {
+                pthread_cond_destroy( &pSend->cond );
+                pthread_cond_destroy( &pSend->done );
+                pthread_mutex_destroy( &pSend->mutex );
+            }
+        }
+
+        if ( result != EOK )
+        {
+            if ( pSend->fd != -1 )
+            {
+                close( pSend->fd );
+                unlink( pSend->fifoName );
+            }
+
+            if ( pSend->mq != (mqd_t)-1 )
+            {
+                mq_close( pSend->mq );
+            }
+
+            free( pSend );
+            pSend = NULL;
+        }
+    }
+
+    isOpen = ( pSend != NULL );
+    pthread_mutex_unlock( &openMutex );
+
+    errno = result;
+    return pSend;
+}
+
+/*============================================================================*/
+/*  IotSend_Message                                                           */
+/*!
+    Queue a message to be sent
+
+    The IotSend_Message function copies a message into the send queue
+    and returns without waiting for it to be sent.  While the send
+    queue is full it waits for earlier messages to complete.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[in]
+        priority
+            message queue priority to send the message with
+
+    @param[in]
+        headers
+            message properties as "key:value" lines, or NULL.  The
+            properties are terminated with an empty line if they are
+            not already
+
+    @param[in]
+        body
+            pointer to the message body
+
+    @param[in]
+        len
+            length of the message body
+
+    @param[in]
+        callback
+            function to call when the message completes, or NULL
+
+    @param[in]
+        arg
+            argument for the callback
+
+    @retval EOK the message was queued
+    @retval EINVAL invalid arguments
+    @retval EMSGSIZE the headers do not fit in a message queue frame
+    @retval ENOMEM out of memory
+    @retval ESHUTDOWN the sender is closing
+
+==============================================================================*/
+int IotSend_Message( IotSend *pSend,
+                     unsigned int priority,
+                     const char *headers,
+                     const void *body,
+                     size_t len,
+                     IotSendCallback callback,
+                     void *arg )
+{
+    IotSendMsg *pMsg;
+    IotBatchEntry entry;
+    const char *end;
+    size_t h;
+    size_t n;
+    int result = EINVAL;
+
+    if ( ( pSend == NULL ) ||
+         ( ( body == NULL ) && ( len > 0 ) ) )
+    {
+        return EINVAL;
+    }
+
+    /* terminate the properties with an empty line */
+    h = ( headers != NULL ) ? strlen( headers ) : 0;
+    end = ( h == 0 ) ? "\n"
+        : ( ( h > 1 ) && ( headers[h - 2] == '\n' ) &&
+            ( headers[h - 1] == '\n' ) ) ? ""
+        : ( headers[h - 1] == '\n' ) ? "\n"
+        : "\n\n";
+
+    n = h + strlen( end ) + 1;
+    if ( ( n > pSend->maxHeaders ) || ( len > UINT32_MAX ) )
+    {
+        return EMSGSIZE;
+    }
+
+    pMsg = malloc( sizeof( IotSendMsg ) + sizeof( entry ) + n + len );
+    if ( pMsg == NULL )
+    {
+        return ENOMEM;
+    }
+
+    entry.headerLength = n;
+    entry.bodyLength = len;
+
+    pMsg->pNext = NULL;
+    pMsg->priority = priority;
+    pMsg->callback = callback;
+    pMsg->arg = arg;
+    pMsg->queuedUs = GetTimeUs();
+    pMsg->end = 0;
+    pMsg->length = sizeof( entry ) + n + len;
+    memcpy( pMsg->data, &entry, sizeof( entry ) );
+    if ( h > 0 )
+    {
+        memcpy( &pMsg->data[sizeof( entry )], headers, h );
+    }
+
+    memcpy( &pMsg->data[sizeof( entry ) + h], end, n - h );
+    if ( len > 0 )
+    {
+        memcpy( &pMsg->data[sizeof( entry ) + n], body, len );
+    }
+
+    pthread_mutex_lock( &pSend->mutex );
+
+    /* wait for room in the send queue */
+    while ( ( pSend->stats.pending >= pSend->config.queueLimit ) &&
+            ( pSend->closing == false ) )
+    {
+        WaitCond( pSend, &pSend->done, 0 );
+    }
+
+    if ( pSend->closing == false )
+    {
+        if ( pSend->pTail != NULL )
+        {
+            pSend->pTail->pNext = pMsg;
+        }
+        else
+        {
+            pSend->pHead = pMsg;
+        }
+
+        pSend->pTail = pMsg;
+        pSend->waiting++;
+        pSend->waitingBytes += pMsg->length;
+        pSend->stats.submitted++;
+        pSend->stats.pending++;
+        pthread_cond_signal( &pSend->cond );
+        result = EOK;
+    }
+    else
+    {
+        result = ESHUTDOWN;
+    }
+
+    pthread_mutex_unlock( &pSend->mutex );
+
+    if ( result != EOK )
+    {
+        free( pMsg );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  IotSend_Flush                                                             */
+/*!
+    Wait for the queued messages to complete
+
+    The IotSend_Flush function sends the queued messages without waiting
+    for their batches to fill, and waits until every message submitted
+    has completed.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[in]
+        timeoutMs
+            maximum time to wait in milliseconds
+
+    @retval EOK every message has completed
+    @retval ETIMEDOUT messages are still pending after the timeout
+    @retval EINVAL invalid arguments
+
+==============================================================================*/
+int IotSend_Flush( IotSend *pSend, uint32_t timeoutMs )
+{
+    uint64_t deadline;
+    uint64_t now;
+    int result = EOK;
+
+    if ( pSend == NULL )
+    {
+        return EINVAL;
+    }
+
+    deadline = GetTimeUs() + (uint64_t)timeoutMs * 1000;
+
+    pthread_mutex_lock( &pSend->mutex );
+    pSend->flushing++;
+    pthread_cond_signal( &pSend->cond );
+
+    while ( ( pSend->stats.pending > 0 ) && ( result == EOK ) )
+    {
+        now = GetTimeUs();
+        if ( now >= deadline )
+        {
+            result = ETIMEDOUT;
+        }
+        else
+        {
+            WaitCond( pSend, &pSend->done, deadline - now );
+        }
+    }
+
+    pSend->flushing--;
+    pthread_mutex_unlock( &pSend->mutex );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  IotSend_Close                                                             */
+/*!
+    Close an asynchronous sender
+
+    The IotSend_Close function waits up to IOTSEND_CLOSE_MS for the
+    queued messages to complete, then stops the sender thread, closes
+    the message queue and removes the FIFO.  Messages which have not
+    completed by then complete with ECANCELED.
+
+    @param[in]
+        pSend
+            pointer to the sender to close
+
+==============================================================================*/
+void IotSend_Close( IotSend *pSend )
+{
+    int result;
+
+    if ( pSend != NULL )
+    {
+        result = IotSend_Flush( pSend, IOTSEND_CLOSE_MS );
+
+        pthread_mutex_lock( &pSend->mutex );
+        pSend->closing = true;
+        pSend->stopping = ( result != EOK );
+        pthread_cond_broadcast( &pSend->cond );
+        pthread_cond_broadcast( &pSend->done );
+        pthread_mutex_unlock( &pSend->mutex );
+
+        pthread_join( pSend->thread, NULL );
+
+        close( pSend->fd );
+        unlink( pSend->fifoName );
+        mq_close( pSend->mq );
+
+        pthread_cond_destroy( &pSend->cond );
+        pthread_cond_destroy( &pSend->done );
+        pthread_mutex_destroy( &pSend->mutex );
+        free( pSend );
+
+        pthread_mutex_lock( &openMutex );
+        isOpen = false;
+        pthread_mutex_unlock( &openMutex );
+    }
+}
+
+/*============================================================================*/
+/*  IotSend_GetStats                                                          */
+/*!
+    Get the sender statistics
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[out]
+        pStats
+            pointer to a location to store the statistics
+
+==============================================================================*/
+void IotSend_GetStats( IotSend *pSend, IotSendStats *pStats )
+{
+    if ( ( pSend != NULL ) && ( pStats != NULL ) )
+    {
+        pthread_mutex_lock( &pSend->mutex );
+        *pStats = pSend->stats;
+        pthread_mutex_unlock( &pSend->mutex );
+    }
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  SendThread                                                                */
+/*!
+    Send the queued messages in batches
+
+    The SendThread function sends a batch whenever one is ready, and
+    completes the messages the service has read.  While messages are
+    waiting to be read it checks the FIFO every IOTSEND_POLL_US.  It
+    returns once the sender is closing and every message has completed,
+    or the sender is stopped.
+
+    @param[in]
+        arg
+            pointer to the sender
+
+    @retval NULL
+
+==============================================================================*/
+static void *SendThread( void *arg )
+{
+    IotSend *pSend = arg;
+    IotSendMsg *pMsg;
+    IotSendMsg *pNext;
+    uint32_t count;
+    size_t bytes;
+    uint64_t waitUs;
+    int result;
+
+    pthread_mutex_lock( &pSend->mutex );
+
+    while ( pSend->stopping == false )
+    {
+        if ( pSend->pSentHead != NULL )
+        {
+            /* complete the messages the service has read */
+            pthread_mutex_unlock( &pSend->mutex );
+            Complete( pSend, TakeRead( pSend ), EOK );
+            pthread_mutex_lock( &pSend->mutex );
+        }
+
+        if ( ( pSend->closing == true ) &&
+             ( pSend->pHead == NULL ) &&
+             ( pSend->pSentHead == NULL ) )
+        {
+            break;
+        }
+
+        waitUs = BatchWait( pSend );
+        if ( waitUs == 0 )
+        {
+            pMsg = TakeBatch( pSend, &count, &bytes );
+            pthread_mutex_unlock( &pSend->mutex );
+
+            result = SendBatch( pSend, pMsg, count, bytes );
+            if ( result != EOK )
+            {
+                Complete( pSend, pMsg, result );
+            }
+
+            pthread_mutex_lock( &pSend->mutex );
+        }
+        else
+        {
+            if ( ( pSend->pSentHead != NULL ) &&
+                 ( waitUs > IOTSEND_POLL_US ) )
+            {
+                waitUs = IOTSEND_POLL_US;
+            }
+
+            WaitCond( pSend,
+                      &pSend->cond,
+                      ( waitUs == UINT64_MAX ) ? 0 : waitUs );
+        }
+    }
+
+    /* abandon the messages which are left */
+    pMsg = pSend->pHead;
+    pSend->pHead = NULL;
+    pSend->pTail = NULL;
+    pSend->waiting = 0;
+    pSend->waitingBytes = 0;
+    pthread_mutex_unlock( &pSend->mutex );
+
+    Complete( pSend, pSend->pSentHead, ECANCELED );
+    pSend->pSentHead = NULL;
+    pSend->pSentTail = NULL;
+
+    while ( pMsg != NULL )
+    {
+        pNext = pMsg->pNext;
+        pMsg->pNext = NULL;
+        Complete( pSend, pMsg, ECANCELED );
+        pMsg = pNext;
+    }
+
+    return NULL;
+}
+
+/*============================================================================*/
+/*  BatchWait                                                                 */
+/*!
+    Get the time until the next batch is ready
+
+    A batch is ready when it is full, when its oldest message has waited
+    for the linger time, or when the sender is being flushed or closed.
+    A batch with a different priority from the last batch also waits
+    until the service has read every batch sent before it.  Called with
+    the sender mutex held.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @retval 0 a batch is ready
+    @retval UINT64_MAX no messages are waiting
+    @retval time until the batch is ready in microseconds, or until the
+            FIFO should be checked again
+
+==============================================================================*/
+static uint64_t BatchWait( IotSend *pSend )
+{
+    uint64_t now;
+    uint64_t due;
+
+    if ( pSend->pHead == NULL )
+    {
+        return UINT64_MAX;
+    }
+
+    if ( ( pSend->pHead->priority != pSend->lastPriority ) &&
+         ( pSend->pSentHead != NULL ) )
+    {
+        return IOTSEND_POLL_US;
+    }
+
+    if ( ( pSend->waiting >= pSend->config.batchCount ) ||
+         ( pSend->waitingBytes >= pSend->config.batchBytes ) ||
+         ( pSend->flushing > 0 ) ||
+         ( pSend->closing == true ) )
+    {
+        return 0;
+    }
+
+    now = GetTimeUs();
+    due = pSend->pHead->queuedUs + pSend->config.lingerUs;
+
+    return ( now >= due ) ? 0 : due - now;
+}
+
+/*============================================================================*/
+/*  TakeBatch                                                                 */
+/*!
+    Take the next batch from the send queue
+
+    The TakeBatch function removes the oldest waiting messages which
+    have the same priority, up to the batch count and size.  The first
+    message is always taken, however large it is.  Called with the
+    sender mutex held.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[out]
+        pCount
+            pointer to a location to store the number of messages
+
+    @param[out]
+        pBytes
+            pointer to a location to store the size of the batch
+
+    @retval list of the messages in the batch
+
+==============================================================================*/
+static IotSendMsg *TakeBatch( IotSend *pSend,
+                              uint32_t *pCount,
+                              size_t *pBytes )
+{
+    IotSendMsg *pBatch = pSend->pHead;
+    IotSendMsg *pLast = pBatch;
+    uint32_t count = 1;
+    size_t bytes = pBatch->length;
+
+    while ( ( pLast->pNext != NULL ) &&
+            ( pLast->pNext->priority == pBatch->priority ) &&
+            ( count < pSend->config.batchCount ) &&
+            ( bytes + pLast->pNext->length <= pSend->config.batchBytes ) )
+    {
+        pLast = pLast->pNext;
+        bytes += pLast->length;
+        count++;
+    }
+
+    pSend->pHead = pLast->pNext;
+    if ( pSend->pHead == NULL )
+    {
+        pSend->pTail = NULL;
+    }
+
+    pLast->pNext = NULL;
+    pSend->waiting -= count;
+    pSend->waitingBytes -= bytes;
+
+    *pCount = count;
+    *pBytes = bytes;
+
+    return pBatch;
+}
+
+/*============================================================================*/
+/*  SendBatch                                                                 */
+/*!
+    Send a batch to the iothub service
+
+    The SendBatch function sends the batch frame and writes the batch to
+    the FIFO.  The messages are then held until the service has read
+    them.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[in]
+        pBatch
+            list of the messages in the batch
+
+    @param[in]
+        count
+            number of messages in the batch
+
+    @param[in]
+        bytes
+            size of the batch
+
+    @retval EOK the batch was sent
+    @retval ECANCELED the sender was stopped
+    @retval other error as returned from mq_timedsend or writev
+
+==============================================================================*/
+static int SendBatch( IotSend *pSend,
+                      IotSendMsg *pBatch,
+                      uint32_t count,
+                      size_t bytes )
+{
+    IotSendMsg *pMsg;
+    int result;
+
+    result = SendFrame( pSend, count, pBatch->priority );
+    if ( result == EOK )
+    {
+        result = WriteBatch( pSend, pBatch, count );
+    }
+
+    if ( result == EOK )
+    {
+        /* note where each message ends in the FIFO */
+        for ( pMsg = pBatch; pMsg != NULL; pMsg = pMsg->pNext )
+        {
+            pSend->written += pMsg->length;
+            pMsg->end = pSend->written;
+        }
+
+        if ( pSend->pSentTail != NULL )
+        {
+            pSend->pSentTail->pNext = pBatch;
+        }
+        else
+        {
+            pSend->pSentHead = pBatch;
+        }
+
+        pMsg = pBatch;
+        while ( pMsg->pNext != NULL )
+        {
+            pMsg = pMsg->pNext;
+        }
+
+        pSend->pSentTail = pMsg;
+        pSend->lastPriority = pBatch->priority;
+
+        pthread_mutex_lock( &pSend->mutex );
+        pSend->stats.batches++;
+        pSend->stats.bytes += bytes;
+        pthread_mutex_unlock( &pSend->mutex );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SendFrame                                                                 */
+/*!
+    Send a batch frame on the iothub message queue
+
+    The SendFrame function waits while the message queue is full, until
+    the sender is stopped.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[in]
+        count
+            number of messages in the batch
+
+    @param[in]
+        priority
+            message queue priority of the batch
+
+    @retval EOK the frame was sent
+    @retval ECANCELED the sender was stopped
+    @retval other error as returned from mq_timedsend
+
+==============================================================================*/
+static int SendFrame( IotSend *pSend, uint32_t count, unsigned int priority )
+{
+    IotBatchFrame frame;
+    struct timespec ts;
+    int result;
+
+    memcpy( frame.preamble, IOTBATCH_PREAMBLE, 4 );
+    frame.pid = pSend->pid;
+    frame.count = count;
+
+    do
+    {
+        clock_gettime( CLOCK_REALTIME, &ts );
+        ts.tv_nsec += IOTSEND_BLOCK_MS * 1000000L;
+        if ( ts.tv_nsec >= 1000000000L )
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        result = ( mq_timedsend( pSend->mq,
+                                 (const char *)&frame,
+                                 sizeof( frame ),
+                                 priority,
+                                 &ts ) == 0 ) ? EOK : errno;
+        if ( ( result == ETIMEDOUT ) && ( Stopping( pSend ) == true ) )
+        {
+            result = ECANCELED;
+        }
+    } while ( ( result == ETIMEDOUT ) || ( result == EINTR ) );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  WriteBatch                                                                */
+/*!
+    Write a batch to the FIFO
+
+    The WriteBatch function writes the messages of a batch with as few
+    writev calls as the FIFO allows, waiting while the FIFO is full
+    until the sender is stopped.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[in]
+        pBatch
+            list of the messages in the batch
+
+    @param[in]
+        count
+            number of messages in the batch
+
+    @retval EOK the batch was written
+    @retval ECANCELED the sender was stopped
+    @retval other error as returned from writev
+
+==============================================================================*/
+static int WriteBatch( IotSend *pSend, IotSendMsg *pBatch, uint32_t count )
+{
+    struct iovec iov[IOTBATCH_MAX_COUNT];
+    struct iovec *pIov = iov;
+    struct pollfd pfd;
+    IotSendMsg *pMsg;
+    uint32_t n = 0;
+    ssize_t rc;
+    size_t done;
+    int result = EOK;
+
+    for ( pMsg = pBatch; ( pMsg != NULL ) && ( n < count ); pMsg = pMsg->pNext )
+    {
+        iov[n].iov_base = pMsg->data;
+        iov[n].iov_len = pMsg->length;
+        n++;
+    }
+
+    pfd.fd = pSend->fd;
+    pfd.events = POLLOUT;
+
+    while ( ( n > 0 ) && ( result == EOK ) )
+    {
+        rc = writev( pSend->fd, pIov, n );
+        if ( rc >= 0 )
+        {
+            /* skip what was written */
+            done = rc;
+            while ( ( n > 0 ) && ( done >= pIov->iov_len ) )
+            {
+                done -= pIov->iov_len;
+                pIov++;
+                n--;
+            }
+
+            if ( n > 0 )
+            {
+                pIov->iov_base = (char *)pIov->iov_base + done;
+                pIov->iov_len -= done;
+            }
+        }
+        else if ( errno == EAGAIN )
+        {
+            /* wait for the service to read from the FIFO */
+            if ( ( poll( &pfd, 1, IOTSEND_BLOCK_MS ) == 0 ) &&
+                 ( Stopping( pSend ) == true ) )
+            {
+                result = ECANCELED;
+            }
+        }
+        else if ( errno != EINTR )
+        {
+            result = errno;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  TakeRead                                                                  */
+/*!
+    Take the messages the service has read
+
+    The TakeRead function compares the number of bytes written to the
+    FIFO with the number of bytes still unread to find the messages the
+    service has read, and removes them from the sent list.  Called only
+    by the sender thread.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @retval list of the messages which have been read, or NULL
+
+==============================================================================*/
+static IotSendMsg *TakeRead( IotSend *pSend )
+{
+    IotSendMsg *pRead = NULL;
+    IotSendMsg *pLast = NULL;
+    int unread;
+    uint64_t consumed;
+
+    if ( ioctl( pSend->fd, FIONREAD, &unread ) == 0 )
+    {
+        consumed = pSend->written - (uint64_t)unread;
+
+        while ( ( pSend->pSentHead != NULL ) &&
+                ( pSend->pSentHead->end <= consumed ) )
+        {
+            pLast = pSend->pSentHead;
+            if ( pRead == NULL )
+            {
+                pRead = pLast;
+            }
+
+            pSend->pSentHead = pLast->pNext;
+        }
+
+        if ( pLast != NULL )
+        {
+            pLast->pNext = NULL;
+        }
+
+        if ( pSend->pSentHead == NULL )
+        {
+            pSend->pSentTail = NULL;
+        }
+    }
+
+    return pRead;
+}
+
+/*============================================================================*/
+/*  Complete                                                                  */
+/*!
+    Complete a list of messages
+
+    The Complete function calls the callback of each message, frees it,
+    and updates the statistics.  It is called without the sender mutex
+    held.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[in]
+        pMsg
+            list of the messages to complete, or NULL
+
+    @param[in]
+        result
+            result passed to the callbacks
+
+==============================================================================*/
+static void Complete( IotSend *pSend, IotSendMsg *pMsg, int result )
+{
+    IotSendMsg *pNext;
+    uint32_t n = 0;
+
+    while ( pMsg != NULL )
+    {
+        pNext = pMsg->pNext;
+        if ( pMsg->callback != NULL )
+        {
+            pMsg->callback( pMsg->arg, result );
+        }
+
+        free( pMsg );
+        pMsg = pNext;
+        n++;
+    }
+
+    if ( n > 0 )
+    {
+        pthread_mutex_lock( &pSend->mutex );
+        if ( result == EOK )
+        {
+            pSend->stats.completed += n;
+        }
+        else
+        {
+            pSend->stats.failed += n;
+        }
+
+        pSend->stats.pending -= n;
+        pthread_cond_broadcast( &pSend->done );
+        pthread_mutex_unlock( &pSend->mutex );
+    }
+}
+
+/*============================================================================*/
+/*  Stopping                                                                  */
+/*!
+    Check if the sender has been stopped
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @retval true the remaining messages are to be abandoned
+    @retval false the sender is running
+
+==============================================================================*/
+static bool Stopping( IotSend *pSend )
+{
+    bool stopping;
+
+    pthread_mutex_lock( &pSend->mutex );
+    stopping = pSend->stopping;
+    pthread_mutex_unlock( &pSend->mutex );
+
+    return stopping;
+}
+
+/*============================================================================*/
+/*  WaitCond                                                                  */
+/*!
+    Wait on a condition of the sender
+
+    Called with the sender mutex held.
+
+    @param[in]
+        pSend
+            pointer to the sender
+
+    @param[in]
+        pCond
+            condition to wait on
+
+    @param[in]
+        us
+            maximum time to wait in microseconds, or 0 to wait until
+            the condition is signalled
+
+==============================================================================*/
+static void WaitCond( IotSend *pSend, pthread_cond_t *pCond, uint64_t us )
+{
+    struct timespec ts;
+
+    if ( us == 0 )
+    {
+        pthread_cond_wait( pCond, &pSend->mutex );
+    }
+    else
+    {
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        ts.tv_sec += us / 1000000;
+        ts.tv_nsec += ( us % 1000000 ) * 1000;
+        if ( ts.tv_nsec >= 1000000000L )
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait( pCond, &pSend->mutex, &ts );
+    }
+}
+
+/*============================================================================*/
+/*  GetTimeUs                                                                 */
+/*!
+    Get the monotonic time in microseconds
+
+    @retval monotonic time in microseconds
+
+==============================================================================*/
+static uint64_t GetTimeUs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*! @}
+ * end of iotsend group */
@@ -0,0 +1,751 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup msgbuf msgbuf
+ * @brief Bounded in-memory message buffer
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file msgbuf.c
+
+    Bounded in-memory message buffer
+
+    The msgbuf module holds copies of the messages received while the
+    IOTHUB connection is not ready, so clients can hand off their
+    messages as soon as the service starts.  Messages are kept in
+    arrival order in a linked list, each in a single allocation holding
+    the NUL terminated headers followed by the body.
+
+    The buffer is full once it holds its maximum number of messages or
+    bytes.  The limits are checked before a message is added, so the
+    byte limit may be exceeded by the last message added.
+
+    Messages may be given an expiry time.  The messages which expire
+    are also indexed by a binary min-heap on their expiry time, so
+    MsgBuffer_Expire finds the expired messages without walking the
+    list, and removes each one from wherever it is in the list.  The
+    list is doubly linked for this, and each message records its
+    position in the heap so it can be taken out of the heap when it is
+    removed from the head of the list.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <varserver/varserver.h>
+#include "trace.h"
+#include "msgbuf.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! initial number of entries in the expiry heap */
+#define MSGBUF_HEAP_INITIAL_SIZE ( 16 )
+
+/*! buffered message */
+typedef struct msgEntry
+{
+    /*! pointer to the next buffered message */
+    struct msgEntry *pNext;
+
+    /*! pointer to the previous buffered message */
+    struct msgEntry *pPrev;
+
+    /*! process id of the client which sent the message */
+    uint32_t pid;
+
+    /*! message queue priority */
+    uint32_t priority;
+
+    /*! length of the headers, excluding the NUL terminator */
+    size_t headerLength;
+
+    /*! length of the body */
+    size_t bodyLength;
+
+    /*! expiry time of the message, or 0 if it does not expire */
+    uint64_t expiry;
+
+    /*! position of the message in the expiry heap */
+    size_t heapIndex;
+
+    /*! NUL terminated headers followed by the body */
+    char data[];
+
+} MsgEntry;
+
+/*! bounded message buffer */
+struct msgBuffer
+{
+    /*! maximum number of buffered messages */
+    size_t maxCount;
+
+    /*! maximum size of the buffered messages in bytes */
+    size_t maxBytes;
+
+    /*! oldest buffered message */
+    MsgEntry *pHead;
+
+    /*! newest buffered message */
+    MsgEntry *pTail;
+
+    /*! min-heap of the expiring messages ordered by expiry time */
+    MsgEntry **heap;
+
+    /*! number of messages in the expiry heap */
+    size_t heapCount;
+
+    /*! number of entries allocated for the expiry heap */
+    size_t heapSize;
+
+    /*! buffer statistics */
+    MsgBufferStats stats;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static int HeapReserve( MsgBuffer *pMsgBuffer );
+static void HeapInsert( MsgBuffer *pMsgBuffer, MsgEntry *pEntry );
+static void HeapRemove( MsgBuffer *pMsgBuffer, size_t i );
+static void HeapSet( MsgBuffer *pMsgBuffer, size_t i, MsgEntry *pEntry );
+static void Remove( MsgBuffer *pMsgBuffer, MsgEntry *pEntry );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  MsgBuffer_Create                                                          */
+/*!
+    Create a message buffer
+
+    @param[in]
+        maxCount
+            maximum number of buffered messages
+
+    @param[in]
+        maxBytes
+            maximum size of the buffered messages in bytes
+
+    @retval pointer to the message buffer
+    @retval NULL if the buffer could not be created
+
+==============================================================================*/
+MsgBuffer *MsgBuffer_Create( size_t maxCount, size_t maxBytes )
+{
+    MsgBuffer *pMsgBuffer;
+
+    pMsgBuffer = calloc( 1, sizeof( MsgBuffer ) );
+    if ( pMsgBuffer != NULL )
+    {
+        pMsgBuffer->maxCount = maxCount;
+        pMsgBuffer->maxBytes = maxBytes;
+    }
+
+    return pMsgBuffer;
+}
+
+/*============================================================================*/
+/*  MsgBuffer_Destroy                                                         */
+/*!
+    Destroy a message buffer and discard its messages
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer to destroy
+
+==============================================================================*/
+void MsgBuffer_Destroy( MsgBuffer *pMsgBuffer )
+{
+    if ( pMsgBuffer != NULL )
+    {
+        while ( pMsgBuffer->pHead != NULL )
+        {
+            MsgBuffer_Pop( pMsgBuffer );
+        }
+
+        free( pMsgBuffer->heap );
+        free( pMsgBuffer );
+    }
+}
+
+/*============================================================================*/
+/*  MsgBuffer_Put                                                             */
+/*!
+    Append a copy of a message to the buffer
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[in]
+        pRecord
+            pointer to the message to copy.  The timestamp is ignored.
+
+    @param[in]
+        expiry
+            time after which the message is discarded by MsgBuffer_Expire,
+            or 0 if the message does not expire
+
+    @retval EOK the message was buffered
+    @retval EINVAL invalid arguments
+    @retval ENOSPC the buffer is full
+    @retval ENOMEM out of memory
+
+==============================================================================*/
+int MsgBuffer_Put( MsgBuffer *pMsgBuffer,
+                   TraceRecord *pRecord,
+                   uint64_t expiry )
+{
+    MsgEntry *pEntry;
+
+    if ( ( pMsgBuffer == NULL ) ||
+         ( pRecord == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( MsgBuffer_Full( pMsgBuffer ) )
+    {
+        return ENOSPC;
+    }
+
+    if ( ( expiry != 0 ) &&
+         ( HeapReserve( pMsgBuffer ) != EOK ) )
+    {
+        return ENOMEM;
+    }
+
+    pEntry = malloc( sizeof( MsgEntry ) +
+                     pRecord->headerLength + 1 +
+                     pRecord->bodyLength );
+    if ( pEntry == NULL )
+    {
+        return ENOMEM;
+    }
+
+    pEntry->pNext = NULL;
+    pEntry->pPrev = pMsgBuffer->pTail;
+    pEntry->pid = pRecord->pid;
+    pEntry->priority = pRecord->priority;
+    pEntry->headerLength = pRecord->headerLength;
+    pEntry->bodyLength = pRecord->bodyLength;
+    pEntry->expiry = expiry;
+    memcpy( pEntry->data, pRecord->headers, pRecord->headerLength );
+    pEntry->data[pRecord->headerLength] = '\0';
+    memcpy( &pEntry->data[pRecord->headerLength + 1],
+            pRecord->body,
+            pRecord->bodyLength );
+
+    if ( pMsgBuffer->pTail != NULL )
+    {
+        pMsgBuffer->pTail->pNext = pEntry;
+    }
+    else
+    {
+        pMsgBuffer->pHead = pEntry;
+    }
+
+    pMsgBuffer->pTail = pEntry;
+
+    if ( expiry != 0 )
+    {
+        HeapInsert( pMsgBuffer, pEntry );
+    }
+
+    pMsgBuffer->stats.count++;
+    pMsgBuffer->stats.bytes += pRecord->headerLength + pRecord->bodyLength;
+    pMsgBuffer->stats.buffered++;
+    if ( pMsgBuffer->stats.count > pMsgBuffer->stats.peak )
+    {
+        pMsgBuffer->stats.peak = pMsgBuffer->stats.count;
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  MsgBuffer_Peek                                                            */
+/*!
+    Get the oldest message in the buffer
+
+    The header and body pointers in the record remain valid until the
+    message is removed with MsgBuffer_Pop.  The headers are NUL
+    terminated.
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[out]
+        pRecord
+            pointer to the record to populate
+
+    @retval EOK the oldest message was retrieved
+    @retval EINVAL invalid arguments
+    @retval ENOENT the buffer is empty
+
+==============================================================================*/
+int MsgBuffer_Peek( MsgBuffer *pMsgBuffer, TraceRecord *pRecord )
+{
+    MsgEntry *pEntry;
+
+    if ( ( pMsgBuffer == NULL ) ||
+         ( pRecord == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    pEntry = pMsgBuffer->pHead;
+    if ( pEntry == NULL )
+    {
+        return ENOENT;
+    }
+
+    pRecord->timestamp = 0;
+    pRecord->pid = pEntry->pid;
+    pRecord->priority = pEntry->priority;
+    pRecord->headers = pEntry->data;
+    pRecord->headerLength = pEntry->headerLength;
+    pRecord->body = &pEntry->data[pEntry->headerLength + 1];
+    pRecord->bodyLength = pEntry->bodyLength;
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  MsgBuffer_Pop                                                             */
+/*!
+    Remove the oldest message from the buffer
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+==============================================================================*/
+void MsgBuffer_Pop( MsgBuffer *pMsgBuffer )
+{
+    if ( ( pMsgBuffer != NULL ) &&
+         ( pMsgBuffer->pHead != NULL ) )
+    {
+        Remove( pMsgBuffer, pMsgBuffer->pHead );
+    }
+}
+
+/*============================================================================*/
+/*  MsgBuffer_Expire                                                          */
+/*!
+    Discard the expired messages
+
+    The MsgBuffer_Expire function removes every message whose expiry
+    time is before the specified time, wherever it is in the buffer.
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[in]
+        now
+            current time, on the same clock as the message expiry times
+
+    @retval number of messages discarded
+
+==============================================================================*/
+size_t MsgBuffer_Expire( MsgBuffer *pMsgBuffer, uint64_t now )
+{
+    size_t count = 0;
+
+    if ( pMsgBuffer != NULL )
+    {
+        while ( ( pMsgBuffer->heapCount > 0 ) &&
+                ( pMsgBuffer->heap[0]->expiry < now ) )
+        {
+            Remove( pMsgBuffer, pMsgBuffer->heap[0] );
+            count++;
+        }
+
+        pMsgBuffer->stats.expired += count;
+    }
+
+    return count;
+}
+
+/*============================================================================*/
+/*  MsgBuffer_RemoveIf                                                        */
+/*!
+    Remove the messages selected by a match function
+
+    The match function is called for each message from the oldest to
+    the newest, and the message is removed if it returns true.  The
+    record passed to the match function is only valid during the call.
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[in]
+        match
+            function returning true for the messages to remove
+
+    @param[in]
+        arg
+            argument passed to the match function
+
+    @retval number of messages removed
+
+==============================================================================*/
+size_t MsgBuffer_RemoveIf( MsgBuffer *pMsgBuffer,
+                           MsgBufferMatch match,
+                           void *arg )
+{
+    MsgEntry *pEntry;
+    MsgEntry *pNext;
+    TraceRecord record;
+    size_t count = 0;
+
+    if ( ( pMsgBuffer == NULL ) ||
+         ( match == NULL ) )
+    {
+        return 0;
+    }
+
+    pEntry = pMsgBuffer->pHead;
+    while ( pEntry != NULL )
+    {
+        pNext = pEntry->pNext;
+
+        record.timestamp = 0;
+        record.pid = pEntry->pid;
+        record.priority = pEntry->priority;
+        record.headers = pEntry->data;
+        record.headerLength = pEntry->headerLength;
+        record.body = &pEntry->data[pEntry->headerLength + 1];
+        record.bodyLength = pEntry->bodyLength;
+
+        if ( match( &record, arg ) == true )
+        {
+            Remove( pMsgBuffer, pEntry );
+            count++;
+        }
+
+        pEntry = pNext;
+    }
+
+    return count;
+}
+
+/*============================================================================*/
+/*  MsgBuffer_Empty                                                           */
+/*!
+    Determine if the buffer is empty
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @retval true the buffer is empty
+    @retval false the buffer holds messages
+
+==============================================================================*/
+bool MsgBuffer_Empty( MsgBuffer *pMsgBuffer )
+{
+    return ( pMsgBuffer == NULL ) || ( pMsgBuffer->pHead == NULL );
+}
+
+/*============================================================================*/
+/*  MsgBuffer_Full                                                            */
+/*!
+    Determine if the buffer is full
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @retval true no more messages can be buffered
+    @retval false the buffer has room for another message
+
+==============================================================================*/
+bool MsgBuffer_Full( MsgBuffer *pMsgBuffer )
+{
+    return ( pMsgBuffer == NULL ) ||
+           ( pMsgBuffer->stats.count >= pMsgBuffer->maxCount ) ||
+           ( pMsgBuffer->stats.bytes >= pMsgBuffer->maxBytes );
+}
+
+/*============================================================================*/
+/*  MsgBuffer_GetStats                                                        */
+/*!
+    Get the message buffer statistics
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[out]
+        pStats
+            pointer to the statistics to populate
+
+==============================================================================*/
+void MsgBuffer_GetStats( MsgBuffer *pMsgBuffer, MsgBufferStats *pStats )
+{
+    if ( pStats != NULL )
+    {
+        if ( pMsgBuffer != NULL )
+        {
+            *pStats = pMsgBuffer->stats;
+        }
+        else
+        {
+            memset( pStats, 0, sizeof( MsgBufferStats ) );
+        }
+    }
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Remove                                                                    */
+/*!
+    Remove a message from the buffer
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[in]
+        pEntry
+            pointer to the message to remove and free
+
+==============================================================================*/
+static void Remove( MsgBuffer *pMsgBuffer, MsgEntry *pEntry )
+{
+    if ( pEntry->pPrev != NULL )
+    {
+        pEntry->pPrev->pNext = pEntry->pNext;
+    }
+    else
+    {
+        pMsgBuffer->pHead = pEntry->pNext;
+    }
+
+    if ( pEntry->pNext != NULL )
+    {
+        pEntry->pNext->pPrev = pEntry->pPrev;
+    }
+    else
+    {
+        pMsgBuffer->pTail = pEntry->pPrev;
+    }
+
+    if ( pEntry->expiry != 0 )
+    {
+        HeapRemove( pMsgBuffer, pEntry->heapIndex );
+    }
+
+    pMsgBuffer->stats.count--;
+    pMsgBuffer->stats.bytes -= pEntry->headerLength + pEntry->bodyLength;
+
+    free( pEntry );
+}
+
+/*============================================================================*/
+/*  HeapReserve                                                               */
+/*!
+    Make room for another message in the expiry heap
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @retval EOK the heap has room for another message
+    @retval ENOMEM out of memory
+
+==============================================================================*/
+static int HeapReserve( MsgBuffer *pMsgBuffer )
+{
+    MsgEntry **heap;
+    size_t size;
+
+    if ( pMsgBuffer->heapCount < pMsgBuffer->heapSize )
+    {
+        return EOK;
+    }
+
+    size = ( pMsgBuffer->heapSize > 0 ) ? pMsgBuffer->heapSize * 2
+                                        : MSGBUF_HEAP_INITIAL_SIZE;
+    heap = realloc( pMsgBuffer->heap, size * sizeof( MsgEntry * ) );
+    if ( heap == NULL )
+    {
+        return ENOMEM;
+    }
+
+    pMsgBuffer->heap = heap;
+    pMsgBuffer->heapSize = size;
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  HeapInsert                                                                */
+/*!
+    Add a message to the expiry heap
+
+    The heap must have room for the message, see HeapReserve.
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[in]
+        pEntry
+            pointer to the message to add
+
+==============================================================================*/
+static void HeapInsert( MsgBuffer *pMsgBuffer, MsgEntry *pEntry )
+{
+    size_t i = pMsgBuffer->heapCount++;
+    size_t parent;
+
+    /* move the hole up to the position of the new message */
+    while ( i > 0 )
+    {
+        parent = ( i - 1 ) / 2;
+        if ( pMsgBuffer->heap[parent]->expiry <= pEntry->expiry )
+        {
+            break;
+        }
+
+        HeapSet( pMsgBuffer, i, pMsgBuffer->heap[parent] );
+        i = parent;
+    }
+
+    HeapSet( pMsgBuffer, i, pEntry );
+}
+
+/*============================================================================*/
+/*  HeapRemove                                                                */
+/*!
+    Remove a message from the expiry heap
+
+    The last message in the heap is moved into the vacated position and
+    then sifted up or down to restore the heap order.
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[in]
+        i
+            position of the message to remove
+
+==============================================================================*/
+static void HeapRemove( MsgBuffer *pMsgBuffer, size_t i )
+{
+    MsgEntry *pLast;
+    size_t child;
+    size_t parent;
+
+    pLast = pMsgBuffer->heap[--pMsgBuffer->heapCount];
+    if ( i == pMsgBuffer->heapCount )
+    {
+        return;
+    }
+
+    /* sift up while the moved message expires before its parent */
+    while ( i > 0 )
+    {
+        parent = ( i - 1 ) / 2;
+        if ( pMsgBuffer->heap[parent]->expiry <= pLast->expiry )
+        {
+            break;
+        }
+
+        HeapSet( pMsgBuffer, i, pMsgBuffer->heap[parent] );
+        i = parent;
+    }
+
+    /* sift down while a child expires before the moved message */
+    while ( ( child = 2 * i + 1 ) < pMsgBuffer->heapCount )
+    {
+        if ( ( child + 1 < pMsgBuffer->heapCount ) &&
+             ( pMsgBuffer->heap[child + 1]->expiry <
+                 pMsgBuffer->heap[child]->expiry ) )
+        {
+            child++;
+        }
+
+        if ( pMsgBuffer->heap[child]->expiry >= pLast->expiry )
+        {
+            break;
+        }
+
+        HeapSet( pMsgBuffer, i, pMsgBuffer->heap[child] );
+        i = child;
+    }
+
+    HeapSet( pMsgBuffer, i, pLast );
+}
+
+/*============================================================================*/
+/*  HeapSet                                                                   */
+/*!
+    Store a message at a position in the expiry heap
+
+    @param[in]
+        pMsgBuffer
+            pointer to the message buffer
+
+    @param[in]
+        i
+            position in the heap
+
+    @param[in]
+        pEntry
+            pointer to the message to store
+
+==============================================================================*/
+static void HeapSet( MsgBuffer *pMsgBuffer, size_t i, MsgEntry *pEntry )
+{
+    pMsgBuffer->heap[i] = pEntry;
+    pEntry->heapIndex = i;
+}
+
+/*! @}
+ * end of msgbuf group */
@@ -0,0 +1,706 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup outbox outbox
+ * @brief Disk outbox for messages received while disconnected
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file outbox.c
+
+    Disk outbox
+
+    The outbox module spills the messages received while the hub is
+    unreachable to disk, and reads them back in arrival order once the
+    connection is restored.
+
+    The outbox is a directory of segment files named outbox-NNNNNNNN.trace
+    in the ingest trace format, so a spilled backlog can also be
+    inspected or replayed with the iotload tool.  Messages are appended
+    to the newest segment, and a new segment is started when it reaches
+    OUTBOX_SEGMENT_SIZE.  Segments are read oldest first, and a segment
+    is removed only after all of its messages have been read back.
+    Segments left behind when the service stops are picked up again
+    when it restarts.
+
+    Writes are buffered, so a segment is flushed to disk when it is
+    closed: when it fills, when it is read back, or when the outbox is
+    destroyed.
+
+    The read position can be handed to another process which opens the
+    same directory, so messages read from the oldest segment are not
+    read again.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <varserver/varserver.h>
+#include "trace.h"
+#include "outbox.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! size at which a new segment file is started, in bytes */
+#define OUTBOX_SEGMENT_SIZE ( 1024 * 1024 )
+
+/*! estimated size of a trace file or record header, in bytes */
+#define OUTBOX_HEADER_SIZE ( 16 )
+
+/*! disk outbox */
+struct outbox
+{
+    /*! outbox directory */
+    char *dir;
+
+    /*! limit on the disk space used by the outbox, in bytes */
+    uint64_t limit;
+
+    /*! number of the oldest segment */
+    uint32_t first;
+
+    /*! number of the next segment to create */
+    uint32_t next;
+
+    /*! newest segment, open for writing, or NULL */
+    Trace *pWrite;
+
+    /*! estimated size of the segment being written */
+    uint64_t writeBytes;
+
+    /*! oldest segment, open for reading, or NULL */
+    Trace *pRead;
+
+    /*! size of the segment being read */
+    uint64_t readBytes;
+
+    /*! number of messages read from the oldest segment */
+    uint32_t readCount;
+
+    /*! number of messages to skip when the oldest segment is opened */
+    uint32_t skipCount;
+
+    /*! outbox statistics */
+    OutboxStats stats;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static void SegmentName( Outbox *pOutbox,
+                         uint32_t segment,
+                         char *path,
+                         size_t len );
+static int ScanSegments( Outbox *pOutbox );
+static void CloseWriteSegment( Outbox *pOutbox );
+static void RemoveReadSegment( Outbox *pOutbox );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Outbox_Create                                                             */
+/*!
+    Open a disk outbox
+
+    The outbox directory is created if it does not exist.  Segments
+    left in it by a previous run are read back before any new messages.
+
+    @param[in]
+        dir
+            outbox directory
+
+    @param[in]
+        limit
+            limit on the disk space used by the outbox, in bytes
+
+    @retval pointer to the outbox
+    @retval NULL the outbox could not be opened
+
+==============================================================================*/
+Outbox *Outbox_Create( const char *dir, uint64_t limit )
+{
+    Outbox *pOutbox = NULL;
+
+    if ( ( dir != NULL ) &&
+         ( ( mkdir( dir, S_IRWXU ) == 0 ) || ( errno == EEXIST ) ) )
+    {
+        pOutbox = calloc( 1, sizeof( Outbox ) );
+        if ( pOutbox != NULL )
+        {
+            pOutbox->dir = strdup( dir );
+            pOutbox->limit = limit;
+
+            if ( ( pOutbox->dir == NULL ) ||
+                 ( ScanSegments( pOutbox ) != EOK ) )
+            {
+                free( pOutbox->dir );
+                free( pOutbox );
+                pOutbox = NULL;
+            }
+        }
+    }
+
+    return pOutbox;
+}
+
+/*============================================================================*/
+/*  Outbox_Destroy                                                            */
+/*!
+    Close a disk outbox
+
+    The segment being written is flushed.  Unread messages remain on
+    disk for the next run.  Messages read from the oldest segment are
+    read again by the next run, so they may be delivered twice.
+
+    @param[in]
+        pOutbox
+            pointer to the outbox to close
+
+==============================================================================*/
+void Outbox_Destroy( Outbox *pOutbox )
+{
+    if ( pOutbox != NULL )
+    {
+        CloseWriteSegment( pOutbox );
+        Trace_Close( pOutbox->pRead );
+        free( pOutbox->dir );
+        free( pOutbox );
+    }
+}
+
+/*============================================================================*/
+/*  Outbox_Append                                                             */
+/*!
+    Append a message to the outbox
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @param[in]
+        pRecord
+            pointer to the message to append
+
+    @retval EOK the message was appended
+    @retval EINVAL invalid arguments
+    @retval ENOSPC the outbox is full
+    @retval other error as returned by Trace_Create or Trace_Write
+
+==============================================================================*/
+int Outbox_Append( Outbox *pOutbox, TraceRecord *pRecord )
+{
+    int result = EINVAL;
+    char path[PATH_MAX];
+    uint64_t size;
+
+    if ( ( pOutbox == NULL ) ||
+         ( pRecord == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    size = pRecord->headerLength + pRecord->bodyLength + OUTBOX_HEADER_SIZE;
+    if ( pOutbox->stats.bytes + size + OUTBOX_HEADER_SIZE > pOutbox->limit )
+    {
+        return ENOSPC;
+    }
+
+    if ( ( pOutbox->pWrite != NULL ) &&
+         ( pOutbox->writeBytes >= OUTBOX_SEGMENT_SIZE ) )
+    {
+        CloseWriteSegment( pOutbox );
+    }
+
+    if ( pOutbox->pWrite == NULL )
+    {
+        SegmentName( pOutbox, pOutbox->next, path, sizeof( path ) );
+        pOutbox->pWrite = Trace_Create( path );
+        if ( pOutbox->pWrite == NULL )
+        {
+            return errno;
+        }
+
+        pOutbox->next++;
+        pOutbox->writeBytes = OUTBOX_HEADER_SIZE;
+        pOutbox->stats.bytes += OUTBOX_HEADER_SIZE;
+        pOutbox->stats.segments++;
+    }
+
+    result = Trace_Write( pOutbox->pWrite, pRecord );
+    if ( result == EOK )
+    {
+        pOutbox->writeBytes += size;
+        pOutbox->stats.bytes += size;
+        pOutbox->stats.spilled++;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Outbox_Read                                                               */
+/*!
+    Read the oldest message from the outbox
+
+    The header and body pointers in the record remain valid until the
+    next call to Outbox_Read or Outbox_Destroy.  The segment holding
+    the message is only removed once all of its messages have been
+    read, so a message must be handed on before the next read.
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @param[out]
+        pRecord
+            pointer to the record to populate
+
+    @retval EOK a message was read
+    @retval ENOENT the outbox is empty
+    @retval EINVAL invalid arguments
+
+==============================================================================*/
+int Outbox_Read( Outbox *pOutbox, TraceRecord *pRecord )
+{
+    int result;
+    char path[PATH_MAX];
+    struct stat st;
+
+    if ( ( pOutbox == NULL ) ||
+         ( pRecord == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    while ( pOutbox->first != pOutbox->next )
+    {
+        if ( pOutbox->pRead == NULL )
+        {
+            /* the newest segment must be flushed before it is read */
+            if ( ( pOutbox->pWrite != NULL ) &&
+                 ( pOutbox->first == pOutbox->next - 1 ) )
+            {
+                CloseWriteSegment( pOutbox );
+            }
+
+            SegmentName( pOutbox, pOutbox->first, path, sizeof( path ) );
+            pOutbox->readBytes = ( stat( path, &st ) == 0 ) ? st.st_size : 0;
+            pOutbox->pRead = Trace_Open( path );
+            if ( pOutbox->pRead == NULL )
+            {
+                RemoveReadSegment( pOutbox );
+                continue;
+            }
+
+            /* skip the messages read by the previous owner */
+            pOutbox->readCount = 0;
+            while ( ( pOutbox->readCount < pOutbox->skipCount ) &&
+                    ( Trace_Read( pOutbox->pRead, pRecord ) == EOK ) )
+            {
+                pOutbox->readCount++;
+            }
+
+            pOutbox->skipCount = 0;
+        }
+
+        result = Trace_Read( pOutbox->pRead, pRecord );
+        if ( result == EOK )
+        {
+            pOutbox->readCount++;
+            pOutbox->stats.drained++;
+            return EOK;
+        }
+
+        if ( result != ENOENT )
+        {
+            fprintf( stderr,
+                     "outbox: segment %u: %s\n",
+                     pOutbox->first,
+                     strerror( result ) );
+        }
+
+        Trace_Close( pOutbox->pRead );
+        pOutbox->pRead = NULL;
+        RemoveReadSegment( pOutbox );
+    }
+
+    return ENOENT;
+}
+
+/*============================================================================*/
+/*  Outbox_Unread                                                             */
+/*!
+    Return the last message read to the outbox
+
+    The Outbox_Unread function moves the read position back by one
+    message, so a message which could not be handed on is read again by
+    the next call to Outbox_Read.  The pointers in the record returned
+    by the last read are no longer valid.
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @retval EOK the message will be read again
+    @retval EINVAL invalid arguments
+    @retval ENOENT no message has been read from the oldest segment
+
+==============================================================================*/
+int Outbox_Unread( Outbox *pOutbox )
+{
+    if ( pOutbox == NULL )
+    {
+        return EINVAL;
+    }
+
+    if ( ( pOutbox->pRead == NULL ) ||
+         ( pOutbox->readCount == 0 ) )
+    {
+        return ENOENT;
+    }
+
+    /* the segment is reopened and its earlier messages skipped */
+    Trace_Close( pOutbox->pRead );
+    pOutbox->pRead = NULL;
+    pOutbox->skipCount = pOutbox->readCount - 1;
+    pOutbox->readCount = 0;
+    pOutbox->stats.drained--;
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  Outbox_Empty                                                              */
+/*!
+    Determine if the outbox holds any messages
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @retval true the outbox is empty
+    @retval false the outbox may hold messages
+
+==============================================================================*/
+bool Outbox_Empty( Outbox *pOutbox )
+{
+    return ( pOutbox == NULL ) || ( pOutbox->first == pOutbox->next );
+}
+
+/*============================================================================*/
+/*  Outbox_GetStats                                                           */
+/*!
+    Get the outbox statistics
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @param[out]
+        pStats
+            pointer to the statistics to populate
+
+==============================================================================*/
+void Outbox_GetStats( Outbox *pOutbox, OutboxStats *pStats )
+{
+    if ( pStats != NULL )
+    {
+        if ( pOutbox != NULL )
+        {
+            *pStats = pOutbox->stats;
+        }
+        else
+        {
+            memset( pStats, 0, sizeof( OutboxStats ) );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Outbox_GetCursor                                                          */
+/*!
+    Get the read position in the outbox
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @param[out]
+        pCursor
+            pointer to the cursor to populate
+
+==============================================================================*/
+void Outbox_GetCursor( Outbox *pOutbox, OutboxCursor *pCursor )
+{
+    if ( pCursor != NULL )
+    {
+        memset( pCursor, 0, sizeof( OutboxCursor ) );
+
+        if ( pOutbox != NULL )
+        {
+            pCursor->segment = pOutbox->first;
+            pCursor->records = ( pOutbox->pRead != NULL )
+                               ? pOutbox->readCount
+                               : pOutbox->skipCount;
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Outbox_Seek                                                               */
+/*!
+    Set the read position in the outbox
+
+    The Outbox_Seek function continues reading where another process
+    which owned the outbox directory stopped.  It must be called before
+    the first message is read.
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @param[in]
+        pCursor
+            read position returned by Outbox_GetCursor
+
+    @retval EOK the read position was set
+    @retval EINVAL invalid arguments
+    @retval EBUSY messages have already been read
+
+==============================================================================*/
+int Outbox_Seek( Outbox *pOutbox, const OutboxCursor *pCursor )
+{
+    if ( ( pOutbox == NULL ) ||
+         ( pCursor == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( pOutbox->pRead != NULL )
+    {
+        return EBUSY;
+    }
+
+    /* the messages already read are all in the oldest segment */
+    pOutbox->skipCount = ( pCursor->segment == pOutbox->first )
+                         ? pCursor->records
+                         : 0;
+
+    return EOK;
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  SegmentName                                                               */
+/*!
+    Get the path of a segment file
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @param[in]
+        segment
+            segment number
+
+    @param[out]
+        path
+            buffer to store the path in
+
+    @param[in]
+        len
+            size of the path buffer
+
+==============================================================================*/
+static void SegmentName( Outbox *pOutbox,
+                         uint32_t segment,
+                         char *path,
+                         size_t len )
+{
+    snprintf( path, len, "%s/outbox-%08u.trace", pOutbox->dir, segment );
+}
+
+/*============================================================================*/
+/*  ScanSegments                                                              */
+/*!
+    Find the segments left in the outbox directory
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+    @retval EOK the directory was scanned
+    @retval other error as returned by opendir
+
+==============================================================================*/
+static int ScanSegments( Outbox *pOutbox )
+{
+    DIR *dir;
+    struct dirent *entry;
+    char path[PATH_MAX];
+    struct stat st;
+    unsigned int segment;
+    int n;
+    bool found = false;
+
+    dir = opendir( pOutbox->dir );
+    if ( dir == NULL )
+    {
+        return errno;
+    }
+
+    while ( ( entry = readdir( dir ) ) != NULL )
+    {
+        n = 0;
+        if ( ( sscanf( entry->d_name,
+                       "outbox-%8u.trace%n",
+                       &segment,
+                       &n ) == 1 ) &&
+             ( n > 0 ) &&
+             ( entry->d_name[n] == '\0' ) )
+        {
+            if ( ( found == false ) || ( segment < pOutbox->first ) )
+            {
+                pOutbox->first = segment;
+            }
+
+            if ( ( found == false ) || ( segment >= pOutbox->next ) )
+            {
+                pOutbox->next = segment + 1;
+            }
+
+            found = true;
+
+            SegmentName( pOutbox, segment, path, sizeof( path ) );
+            if ( stat( path, &st ) == 0 )
+            {
+                pOutbox->stats.bytes += st.st_size;
+            }
+
+            pOutbox->stats.segments++;
+        }
+    }
+
+    closedir( dir );
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  CloseWriteSegment                                                         */
+/*!
+    Flush and close the segment being written
+
+    The estimated size of the segment is replaced by its size on disk.
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+==============================================================================*/
+static void CloseWriteSegment( Outbox *pOutbox )
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if ( pOutbox->pWrite != NULL )
+    {
+        Trace_Close( pOutbox->pWrite );
+        pOutbox->pWrite = NULL;
+
+        SegmentName( pOutbox, pOutbox->next - 1, path, sizeof( path ) );
+        if ( stat( path, &st ) == 0 )
+        {
+            pOutbox->stats.bytes += st.st_size;
+        }
+
+        pOutbox->stats.bytes -= pOutbox->writeBytes;
+        pOutbox->writeBytes = 0;
+    }
+}
+
+/*============================================================================*/
+/*  RemoveReadSegment                                                         */
+/*!
+    Remove the oldest segment once it has been read
+
+    @param[in]
+        pOutbox
+            pointer to the outbox
+
+==============================================================================*/
+static void RemoveReadSegment( Outbox *pOutbox )
+{
+    char path[PATH_MAX];
+
+    SegmentName( pOutbox, pOutbox->first, path, sizeof( path ) );
+    if ( unlink( path ) == 0 )
+    {
+        pOutbox->stats.bytes -= ( pOutbox->readBytes < pOutbox->stats.bytes )
+                                ? pOutbox->readBytes
+                                : pOutbox->stats.bytes;
+        if ( pOutbox->stats.segments > 0 )
+        {
+            pOutbox->stats.segments--;
+        }
+    }
+    else if ( errno != ENOENT )
+    {
+        fprintf( stderr,
+                 "outbox: cannot remove %s: %s\n",
+                 path,
+                 strerror( errno ) );
+    }
+
+    pOutbox->readBytes = 0;
+    pOutbox->first++;
+}
+
+/*! @}
+ * end of outbox group */
@@ -0,0 +1,432 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+/*!
+ * @defgroup pressure pressure
+ * @brief Memory pressure monitor
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file pressure.c
+
+    Memory pressure monitor
+
+    The pressure module watches the Linux pressure stall information
+    (PSI) for memory, so the service can give memory back before the
+    system runs out of it.  A PSI trigger is registered on
+    /proc/pressure/memory to signal each window in which tasks were
+    stalled waiting for memory for longer than the stall time.  If the
+    trigger cannot be registered, the total stall time in the file is
+    polled once per window instead.
+
+    Memory comes under pressure at the first window which exceeds the
+    stall time, and the pressure clears after PRESSURE_HOLD_WINDOWS
+    windows without one, so the service does not flap between its
+    normal and reduced footprints.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <varserver/varserver.h>
+#include "pressure.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! size of the buffer used to read the pressure file */
+#define PRESSURE_READ_SIZE ( 256 )
+
+/*! memory pressure monitor */
+struct pressure
+{
+    /*! PSI trigger, or the pressure file when it is polled */
+    int fd;
+
+    /*! stall time in a window which signals pressure, in microseconds */
+    uint32_t stallUs;
+
+    /*! pressure window in milliseconds */
+    uint32_t windowMs;
+
+    /*! time of the last check for pressure in milliseconds */
+    uint64_t pollTime;
+
+    /*! time of the last window which exceeded the stall time */
+    uint64_t eventTime;
+
+    /*! start of the polled window in milliseconds */
+    uint64_t windowTime;
+
+    /*! total stall time at the start of the polled window in
+        microseconds */
+    uint64_t windowStall;
+
+    /*! pressure statistics */
+    PressureStats stats;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static bool CheckTrigger( Pressure *pPressure );
+static bool CheckStall( Pressure *pPressure, uint64_t nowMs );
+static int ReadStall( Pressure *pPressure, uint64_t *pStallUs );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Pressure_Create                                                           */
+/*!
+    Create a memory pressure monitor
+
+    @param[in]
+        stallMs
+            stall time in a window which signals memory pressure, in
+            milliseconds
+
+    @param[in]
+        windowMs
+            pressure window in milliseconds
+
+    @retval pointer to the monitor
+    @retval NULL if the kernel does not provide pressure stall
+            information (errno is set)
+
+==============================================================================*/
+Pressure *Pressure_Create( uint32_t stallMs, uint32_t windowMs )
+{
+    Pressure *pPressure;
+    char trigger[64];
+    int len;
+    int errnum;
+
+    if ( ( stallMs == 0 ) ||
+         ( stallMs > windowMs ) )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pPressure = calloc( 1, sizeof( Pressure ) );
+    if ( pPressure == NULL )
+    {
+        return NULL;
+    }
+
+    pPressure->stallUs = stallMs * 1000;
+    pPressure->windowMs = windowMs;
+
+    /* the trigger is NUL terminated */
+    len = snprintf( trigger,
+                    sizeof( trigger ),
+                    "some %u %u",
+                    pPressure->stallUs,
+                    windowMs * 1000 ) + 1;
+
+    pPressure->fd = open( PRESSURE_FILE, O_RDWR | O_NONBLOCK | O_CLOEXEC );
+    if ( ( pPressure->fd != -1 ) &&
+         ( write( pPressure->fd, trigger, len ) != len ) )
+    {
+        /* poll the stall time instead */
+        close( pPressure->fd );
+        pPressure->fd = open( PRESSURE_FILE, O_RDONLY | O_CLOEXEC );
+        pPressure->stats.polled = true;
+    }
+
+    if ( ( pPressure->fd == -1 ) ||
+         ( ( pPressure->stats.polled == true ) &&
+           ( ReadStall( pPressure, &pPressure->windowStall ) != EOK ) ) )
+    {
+        errnum = errno;
+        Pressure_Destroy( pPressure );
+        errno = errnum;
+        pPressure = NULL;
+    }
+
+    return pPressure;
+}
+
+/*============================================================================*/
+/*  Pressure_Destroy                                                          */
+/*!
+    Destroy a memory pressure monitor
+
+    @param[in]
+        pPressure
+            pointer to the monitor, may be NULL
+
+==============================================================================*/
+void Pressure_Destroy( Pressure *pPressure )
+{
+    if ( pPressure != NULL )
+    {
+        if ( pPressure->fd != -1 )
+        {
+            close( pPressure->fd );
+        }
+
+        free( pPressure );
+    }
+}
+
+/*============================================================================*/
+/*  Pressure_Poll                                                             */
+/*!
+    Check for memory pressure
+
+    The Pressure_Poll function does not block.  It checks for pressure
+    at most once every PRESSURE_POLL_MS.
+
+    @param[in]
+        pPressure
+            pointer to the monitor
+
+    @param[in]
+        nowMs
+            current monotonic time in milliseconds
+
+    @retval true memory came under pressure, or the pressure cleared
+    @retval false the pressure state is unchanged
+
+==============================================================================*/
+bool Pressure_Poll( Pressure *pPressure, uint64_t nowMs )
+{
+    bool event;
+
+    if ( ( pPressure == NULL ) ||
+         ( nowMs - pPressure->pollTime < PRESSURE_POLL_MS ) )
+    {
+        return false;
+    }
+
+    pPressure->pollTime = nowMs;
+
+    event = ( pPressure->stats.polled == true )
+            ? CheckStall( pPressure, nowMs )
+            : CheckTrigger( pPressure );
+    if ( event == true )
+    {
+        pPressure->stats.events++;
+        pPressure->eventTime = nowMs;
+        if ( pPressure->stats.active == false )
+        {
+            pPressure->stats.active = true;
+            pPressure->stats.episodes++;
+            return true;
+        }
+    }
+    else if ( ( pPressure->stats.active == true ) &&
+              ( nowMs - pPressure->eventTime >=
+                    (uint64_t)PRESSURE_HOLD_WINDOWS * pPressure->windowMs ) )
+    {
+        pPressure->stats.active = false;
+        return true;
+    }
+
+    return false;
+}
+
+/*============================================================================*/
+/*  Pressure_Active                                                           */
+/*!
+    Determine if memory is under pressure
+
+    @param[in]
+        pPressure
+            pointer to the monitor
+
+    @retval true memory is under pressure
+    @retval false memory is not under pressure, or is not monitored
+
+==============================================================================*/
+bool Pressure_Active( Pressure *pPressure )
+{
+    return ( pPressure != NULL ) && ( pPressure->stats.active == true );
+}
+
+/*============================================================================*/
+/*  Pressure_GetStats                                                         */
+/*!
+    Get the memory pressure statistics
+
+    @param[in]
+        pPressure
+            pointer to the monitor, may be NULL
+
+    @param[out]
+        pStats
+            pointer to the statistics to populate
+
+==============================================================================*/
+void Pressure_GetStats( Pressure *pPressure, PressureStats *pStats )
+{
+    if ( pStats != NULL )
+    {
+        if ( pPressure != NULL )
+        {
+            *pStats = pPressure->stats;
+        }
+        else
+        {
+            memset( pStats, 0, sizeof( PressureStats ) );
+        }
+    }
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  CheckTrigger                                                              */
+/*!
+    Check the PSI trigger for a window which exceeded the stall time
+
+    @param[in]
+        pPressure
+            pointer to the monitor
+
+    @retval true the trigger fired
+    @retval false the trigger has not fired
+
+==============================================================================*/
+static bool CheckTrigger( Pressure *pPressure )
+{
+    struct pollfd pfd;
+
+    pfd.fd = pPressure->fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+
+    return ( poll( &pfd, 1, 0 ) == 1 ) &&
+           ( ( pfd.revents & POLLERR ) == 0 ) &&
+           ( ( pfd.revents & POLLPRI ) != 0 );
+}
+
+/*============================================================================*/
+/*  CheckStall                                                                */
+/*!
+    Check a polled window for a stall time above the limit
+
+    @param[in]
+        pPressure
+            pointer to the monitor
+
+    @param[in]
+        nowMs
+            current monotonic time in milliseconds
+
+    @retval true the window which has just ended exceeded the stall time
+    @retval false the window has not ended, or did not exceed the stall
+            time
+
+==============================================================================*/
+static bool CheckStall( Pressure *pPressure, uint64_t nowMs )
+{
+    uint64_t stallUs;
+    bool exceeded = false;
+
+    if ( ( nowMs - pPressure->windowTime >= pPressure->windowMs ) &&
+         ( ReadStall( pPressure, &stallUs ) == EOK ) )
+    {
+        exceeded = ( stallUs - pPressure->windowStall >= pPressure->stallUs );
+        pPressure->windowTime = nowMs;
+        pPressure->windowStall = stallUs;
+    }
+
+    return exceeded;
+}
+
+/*============================================================================*/
+/*  ReadStall                                                                 */
+/*!
+    Read the total time some tasks were stalled waiting for memory
+
+    @param[in]
+        pPressure
+            pointer to the monitor
+
+    @param[out]
+        pStallUs
+            pointer to a location to store the total stall time in
+            microseconds
+
+    @retval EOK the stall time was read
+    @retval EBADMSG the pressure file could not be parsed
+    @retval other error as returned from lseek or read
+
+==============================================================================*/
+static int ReadStall( Pressure *pPressure, uint64_t *pStallUs )
+{
+    char buf[PRESSURE_READ_SIZE];
+    ssize_t n;
+    char *p;
+
+    if ( lseek( pPressure->fd, 0, SEEK_SET ) == -1 )
+    {
+        return errno;
+    }
+
+    n = read( pPressure->fd, buf, sizeof( buf ) - 1 );
+    if ( n == -1 )
+    {
+        return errno;
+    }
+
+    /* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 */
+    buf[n] = '\0';
+    p = strstr( buf, "total=" );
+    if ( ( strncmp( buf, "some ", 5 ) != 0 ) ||
+         ( p == NULL ) )
+    {
+        return EBADMSG;
+    }
+
+    *pStallUs = strtoull( p + 6, NULL, 10 );
+
+    return EOK;
+}
+
+/*! @}
+ * end of pressure group */
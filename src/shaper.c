@@ -0,0 +1,1051 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+
+/*!
+ * @defgroup shaper shaper
+ * @brief Uplink bandwidth shaper
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file shaper.c
+
+    Uplink bandwidth shaper
+
+    The shaper module limits the rate the service hands messages to the
+    IOT Hub client, so it leaves room for other traffic sharing a
+    metered or slow uplink, and adapts the way messages are sent to
+    the estimated quality of the link.
+
+    The shaper is configured with a list of entries:
+
+        link:KB         at most KB kilobytes per second in total
+        class:P:KB      at most KB kilobytes per second for messages
+                        with message queue priority P
+        compress[:N]    gzip the bodies of messages of N bytes or more
+                        (256 by default) while the link is congested
+
+    Each ceiling is a token bucket which may be exceeded by a burst of
+    SHAPER_BURST_MS.  A message may be sent while its buckets hold any
+    tokens, and its size is then taken from them, so a message larger
+    than the burst is not held forever.
+
+    Once every SHAPER_SAMPLE_MS the available bandwidth is estimated
+    from the rate messages were confirmed while the link was busy.  The
+    link quality is estimated from the backlog, the rate it drained,
+    and the queueing delay: the time taken to confirm a message above
+    the lowest time seen, or the time needed to send the held and
+    unconfirmed messages at the estimated bandwidth.  While messages
+    queue the quality is fair, and it is poor while the backlog grows
+    or messages queue for more than SHAPER_POOR_WAIT_MS.  The quality drops at once but only improves after
+    SHAPER_RECOVER_SAMPLES better samples.
+
+    On a good link messages are not compressed and the number awaiting
+    confirmation is not limited.  On a fair or poor link the bodies are
+    compressed, faster on a fair link and smaller on a poor one, and
+    the number of messages awaiting confirmation is limited to twice
+    the estimated bandwidth-delay product, so the remaining messages
+    wait in the service in priority and deadline order instead of in
+    the client.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <zlib.h>
+#include <varserver/varserver.h>
+#include "shaper.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! compression level while the link quality is fair */
+#define SHAPER_FAIR_LEVEL ( Z_BEST_SPEED )
+
+/*! compression level while the link quality is poor */
+#define SHAPER_POOR_LEVEL ( 6 )
+
+/*! token bucket limiting the link or a traffic class */
+typedef struct bucket
+{
+    /*! message queue priority of a traffic class */
+    unsigned int priority;
+
+    /*! ceiling in bytes per second */
+    uint64_t rate;
+
+    /*! largest number of tokens held */
+    int64_t burst;
+
+    /*! bytes which may be sent now, negative after a large message */
+    int64_t tokens;
+
+    /*! time the bucket was last filled in milliseconds */
+    uint64_t fillTime;
+
+    /*! true while the bucket is holding messages back */
+    bool blocked;
+
+    /*! total size of the messages sent in bytes */
+    uint64_t bytes;
+
+    /*! number of times the bucket held messages back */
+    uint64_t delays;
+
+} Bucket;
+
+/*! bandwidth shaper */
+struct shaper
+{
+    /*! true if the link has a ceiling */
+    bool limited;
+
+    /*! link ceiling */
+    Bucket link;
+
+    /*! traffic class ceilings */
+    Bucket classes[SHAPER_MAX_CLASSES];
+
+    /*! number of traffic classes */
+    size_t classCount;
+
+    /*! true if bodies are compressed on a congested link */
+    bool compress;
+
+    /*! smallest body which is compressed in bytes */
+    size_t compressMin;
+
+    /*! gzip compression stream */
+    z_stream zs;
+
+    /*! compression level of the stream, or 0 if it is not initialized */
+    int zLevel;
+
+    /*! compressed body buffer */
+    unsigned char *buf;
+
+    /*! size of the compressed body buffer */
+    size_t bufSize;
+
+    /*! time of the last sample in milliseconds */
+    uint64_t sampleTime;
+
+    /*! confirmed bytes at the last sample */
+    uint64_t lastConfirmed;
+
+    /*! backlog at the last sample in bytes */
+    uint64_t lastBacklog;
+
+    /*! smoothed size of the messages sent in bytes */
+    uint64_t avgBytes;
+
+    /*! number of consecutive samples with a better link quality */
+    uint32_t better;
+
+    /*! true if a ceiling held messages back since the last sample */
+    bool held;
+
+    /*! shaper statistics */
+    ShaperStats stats;
+};
+
+/*! names of the link quality levels */
+static const char *qualityNames[SHAPER_QUALITIES] =
+{
+    "good",
+    "fair",
+    "poor"
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static Bucket *FindClass( Shaper *pShaper, unsigned int priority );
+static bool Fill( Bucket *pBucket, uint64_t nowMs );
+static void Take( Bucket *pBucket, size_t bytes );
+static void SetRate( Bucket *pBucket, uint64_t rate );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Shaper_Create                                                             */
+/*!
+    Create a bandwidth shaper with no ceilings
+
+    @retval pointer to the shaper
+    @retval NULL if the shaper could not be created
+
+==============================================================================*/
+Shaper *Shaper_Create( void )
+{
+    return calloc( 1, sizeof( Shaper ) );
+}
+
+/*============================================================================*/
+/*  Shaper_Destroy                                                            */
+/*!
+    Destroy a bandwidth shaper
+
+    @param[in]
+        pShaper
+            pointer to the shaper to destroy
+
+==============================================================================*/
+void Shaper_Destroy( Shaper *pShaper )
+{
+    if ( pShaper != NULL )
+    {
+        if ( pShaper->zLevel != 0 )
+        {
+            deflateEnd( &pShaper->zs );
+        }
+
+        free( pShaper->buf );
+        free( pShaper );
+    }
+}
+
+/*============================================================================*/
+/*  Shaper_Add                                                                */
+/*!
+    Add a ceiling or enable compression
+
+    @param[in]
+        pShaper
+            pointer to the shaper
+
+    @param[in]
+        spec
+            entry: link:KB, class:priority:KB, compress or
+            compress:bytes
+
+    @retval EOK the entry was added
+    @retval EINVAL invalid specification
+    @retval ENOSPC there are too many traffic classes
+
+==============================================================================*/
+int Shaper_Add( Shaper *pShaper, const char *spec )
+{
+    const char *p;
+    char *pEnd;
+    unsigned long priority;
+    unsigned long long value;
+
+    if ( ( pShaper == NULL ) ||
+         ( spec == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( strcmp( spec, "compress" ) == 0 )
+    {
+        pShaper->compress = true;
+        pShaper->compressMin = SHAPER_DEFAULT_COMPRESS_MIN;
+        return EOK;
+    }
+
+    if ( strncmp( spec, "compress:", 9 ) == 0 )
+    {
+        p = &spec[9];
+        value = strtoull( p, &pEnd, 0 );
+        if ( ( pEnd == p ) || ( *pEnd != '\0' ) )
+        {
+            return EINVAL;
+        }
+
+        pShaper->compress = true;
+        pShaper->compressMin = (size_t)value;
+        return EOK;
+    }
+
+    if ( strncmp( spec, "link:", 5 ) == 0 )
+    {
+        p = &spec[5];
+        value = strtoull( p, &pEnd, 0 );
+        if ( ( pEnd == p ) || ( *pEnd != '\0' ) || ( value == 0 ) )
+        {
+            return EINVAL;
+        }
+
+        SetRate( &pShaper->link, (uint64_t)value << 10 );
+        pShaper->limited = true;
+        pShaper->stats.ceiling = pShaper->link.rate;
+        return EOK;
+    }
+
+    if ( strncmp( spec, "class:", 6 ) == 0 )
+    {
+        p = &spec[6];
+        priority = strtoul( p, &pEnd, 0 );
+        if ( ( pEnd == p ) ||
+             ( *pEnd != ':' ) ||
+             ( FindClass( pShaper, (unsigned int)priority ) != NULL ) )
+        {
+            return EINVAL;
+        }
+
+        p = pEnd + 1;
+        value = strtoull( p, &pEnd, 0 );
+        if ( ( pEnd == p ) || ( *pEnd != '\0' ) || ( value == 0 ) )
+        {
+            return EINVAL;
+        }
+
+        if ( pShaper->classCount == SHAPER_MAX_CLASSES )
+        {
+            return ENOSPC;
+        }
+
+        pShaper->classes[pShaper->classCount].priority =
+            (unsigned int)priority;
+        SetRate( &pShaper->classes[pShaper->classCount],
+                 (uint64_t)value << 10 );
+        pShaper->classCount++;
+        return EOK;
+    }
+
+    return EINVAL;
+}
+
+/*============================================================================*/
+/*  Shaper_Enabled                                                            */
+/*!
+    Determine if the shaper has any ceilings or compresses messages
+
+    @param[in]
+        pShaper
+            pointer to the shaper
+
+    @retval true the shaper has a ceiling or compresses messages
+    @retval false the shaper does nothing
+
+==============================================================================*/
+bool Shaper_Enabled( Shaper *pShaper )
+{
+    return ( pShaper != NULL ) &&
+           ( ( pShaper->limited == true ) ||
+             ( pShaper->classCount > 0 ) ||
+             ( pShaper->compress == true ) );
+}
+
+/*============================================================================*/
+/*  Shaper_LinkReady                                                          */
+/*!
+    Determine if the link ceiling allows a message to be sent now
+
+    @param[in]
+        pShaper
+            pointer to the shaper, or NULL
+
+    @param[in]
+        nowMs
+            current monotonic time in milliseconds
+
+    @retval true a message may be sent
+    @retval false messages must wait
+
+==============================================================================*/
+bool Shaper_LinkReady( Shaper *pShaper, uint64_t nowMs )
+{
+    if ( ( pShaper == NULL ) ||
+         ( pShaper->limited == false ) ||
+         ( Fill( &pShaper->link, nowMs ) == true ) )
+    {
+        return true;
+    }
+
+    pShaper->held = true;
+
+    return false;
+}
+
+/*============================================================================*/
+/*  Shaper_Ready                                                              */
+/*!
+    Determine if a message may be sent now
+
+    A message may be sent while the link and the traffic class of its
+    priority, if it has one, are within their ceilings.  Messages of
+    a priority without a class are only limited by the link ceiling.
+
+    @param[in]
+        pShaper
+            pointer to the shaper, or NULL
+
+    @param[in]
+        priority
+            message queue priority of the message
+
+    @param[in]
+        nowMs
+            current monotonic time in milliseconds
+
+    @retval true the message may be sent
+    @retval false the message must wait
+
+==============================================================================*/
+bool Shaper_Ready( Shaper *pShaper, unsigned int priority, uint64_t nowMs )
+{
+    Bucket *pClass;
+    bool ready = true;
+
+    if ( pShaper == NULL )
+    {
+        return true;
+    }
+
+    ready = Shaper_LinkReady( pShaper, nowMs );
+
+    pClass = FindClass( pShaper, priority );
+    if ( ( pClass != NULL ) &&
+         ( Fill( pClass, nowMs ) == false ) )
+    {
+        ready = false;
+    }
+
+    if ( ready == false )
+    {
+        pShaper->held = true;
+    }
+
+    return ready;
+}
+
+/*============================================================================*/
+/*  Shaper_Consume                                                            */
+/*!
+    Take the size of a sent message from its ceilings
+
+    @param[in]
+        pShaper
+            pointer to the shaper, or NULL
+
+    @param[in]
+        priority
+            message queue priority of the message
+
+    @param[in]
+        bytes
+            size of the message as sent in bytes
+
+==============================================================================*/
+void Shaper_Consume( Shaper *pShaper, unsigned int priority, size_t bytes )
+{
+    Bucket *pClass;
+
+    if ( pShaper == NULL )
+    {
+        return;
+    }
+
+    Take( &pShaper->link, bytes );
+
+    pClass = FindClass( pShaper, priority );
+    if ( pClass != NULL )
+    {
+        Take( pClass, bytes );
+    }
+
+    pShaper->avgBytes = ( pShaper->avgBytes == 0 )
+                        ? bytes
+                        : ( 7 * pShaper->avgBytes + bytes ) / 8;
+}
+
+/*============================================================================*/
+/*  Shaper_Update                                                             */
+/*!
+    Update the link estimates and adapt to the link quality
+
+    @param[in]
+        pShaper
+            pointer to the shaper, or NULL
+
+    @param[in]
+        pSample
+            pointer to the current link measurements
+
+    @param[in]
+        nowMs
+            current monotonic time in milliseconds
+
+==============================================================================*/
+void Shaper_Update( Shaper *pShaper,
+                    const ShaperSample *pSample,
+                    uint64_t nowMs )
+{
+    ShaperStats *pStats;
+    ShaperQuality quality = SHAPER_GOOD;
+    uint64_t elapsed;
+    uint64_t rate;
+    uint64_t bdp;
+    uint32_t queueing;
+    uint64_t queueMs = 0;
+    bool busy;
+
+    if ( ( pShaper == NULL ) ||
+         ( pSample == NULL ) )
+    {
+        return;
+    }
+
+    pStats = &pShaper->stats;
+
+    if ( pShaper->sampleTime == 0 )
+    {
+        pShaper->sampleTime = nowMs;
+        pShaper->lastConfirmed = pSample->confirmedBytes;
+        pShaper->lastBacklog = pSample->backlogBytes;
+        return;
+    }
+
+    elapsed = nowMs - pShaper->sampleTime;
+    if ( elapsed < SHAPER_SAMPLE_MS )
+    {
+        return;
+    }
+
+    rate = ( pSample->confirmedBytes - pShaper->lastConfirmed ) * 1000 /
+           elapsed;
+    pStats->drainRate = ( pSample->backlogBytes < pShaper->lastBacklog )
+                        ? ( pShaper->lastBacklog - pSample->backlogBytes ) *
+                          1000 / elapsed
+                        : 0;
+
+    /* the confirmation rate only measures the link while it is busy,
+       and not while the ceilings are holding messages back */
+    busy = ( ( pSample->backlogBytes > 0 ) ||
+             ( ( pStats->window > 0 ) &&
+               ( pSample->inFlight >= pStats->window ) ) ) &&
+           ( pShaper->held == false );
+    if ( ( busy == true ) && ( rate > 0 ) )
+    {
+        pStats->estimate = ( pStats->estimate == 0 )
+                           ? rate
+                           : ( 3 * pStats->estimate + rate ) / 4;
+    }
+    else if ( rate > pStats->estimate )
+    {
+        pStats->estimate = rate;
+    }
+
+    /* the lowest confirmation time drifts up slowly so a route change
+       is followed */
+    if ( pSample->waitMs > 0 )
+    {
+        if ( ( pStats->baseWaitMs == 0 ) ||
+             ( pSample->waitMs < pStats->baseWaitMs ) )
+        {
+            pStats->baseWaitMs = pSample->waitMs;
+        }
+        else
+        {
+            pStats->baseWaitMs += ( pSample->waitMs -
+                                    pStats->baseWaitMs ) / 64;
+        }
+    }
+
+    /* messages queue for the time above the lowest confirmation time,
+       and for the time taken to send the held and unconfirmed messages
+       at the estimated bandwidth */
+    queueing = ( pSample->waitMs > pStats->baseWaitMs )
+               ? pSample->waitMs - pStats->baseWaitMs
+               : 0;
+
+    if ( pStats->estimate > 0 )
+    {
+        queueMs = ( pSample->backlogBytes +
+                    pSample->inFlight * pShaper->avgBytes ) * 1000 /
+                  pStats->estimate;
+    }
+
+    if ( ( ( pSample->backlogBytes > pShaper->lastBacklog ) &&
+           ( pShaper->lastBacklog > 0 ) ) ||
+         ( queueing > SHAPER_POOR_WAIT_MS ) ||
+         ( queueMs > SHAPER_POOR_WAIT_MS ) )
+    {
+        quality = SHAPER_POOR;
+    }
+    else if ( ( pSample->backlogBytes > 0 ) ||
+              ( queueing > SHAPER_FAIR_WAIT_MS ) ||
+              ( queueMs > SHAPER_FAIR_WAIT_MS ) )
+    {
+        quality = SHAPER_FAIR;
+    }
+
+    if ( quality >= pStats->quality )
+    {
+        pStats->quality = quality;
+        pShaper->better = 0;
+    }
+    else if ( ++pShaper->better >= SHAPER_RECOVER_SAMPLES )
+    {
+        pStats->quality = quality;
+        pShaper->better = 0;
+    }
+
+    /* compress harder and keep fewer messages in the client the worse
+       the link is */
+    switch ( pStats->quality )
+    {
+        case SHAPER_FAIR:
+            pStats->level = SHAPER_FAIR_LEVEL;
+            break;
+
+        case SHAPER_POOR:
+            pStats->level = SHAPER_POOR_LEVEL;
+            break;
+
+        default:
+            pStats->level = 0;
+            break;
+    }
+
+    if ( pShaper->compress == false )
+    {
+        pStats->level = 0;
+    }
+
+    pStats->window = 0;
+    if ( ( pStats->quality != SHAPER_GOOD ) &&
+         ( pStats->estimate > 0 ) &&
+         ( pShaper->avgBytes > 0 ) )
+    {
+        bdp = pStats->estimate *
+              ( ( pStats->baseWaitMs > 0 ) ? pStats->baseWaitMs : 1 ) /
+              1000 / pShaper->avgBytes;
+        pStats->window = ( 2 * bdp > SHAPER_MIN_WINDOW )
+                         ? ( ( 2 * bdp < UINT32_MAX ) ? 2 * bdp
+                                                      : UINT32_MAX )
+                         : SHAPER_MIN_WINDOW;
+    }
+
+    pStats->delays = pShaper->link.delays;
+    pShaper->held = false;
+    pShaper->sampleTime = nowMs;
+    pShaper->lastConfirmed = pSample->confirmedBytes;
+    pShaper->lastBacklog = pSample->backlogBytes;
+}
+
+/*============================================================================*/
+/*  Shaper_Window                                                             */
+/*!
+    Get the number of messages which may await confirmation
+
+    @param[in]
+        pShaper
+            pointer to the shaper, or NULL
+
+    @param[in]
+        maxWindow
+            number of messages which may await confirmation without
+            the shaper
+
+    @retval number of messages which may await confirmation
+
+==============================================================================*/
+uint32_t Shaper_Window( Shaper *pShaper, uint32_t maxWindow )
+{
+    if ( ( pShaper == NULL ) ||
+         ( pShaper->stats.window == 0 ) ||
+         ( pShaper->stats.window > maxWindow ) )
+    {
+        return maxWindow;
+    }
+
+    return pShaper->stats.window;
+}
+
+/*============================================================================*/
+/*  Shaper_Compress                                                           */
+/*!
+    Compress a message body for a congested link
+
+    The body is compressed in gzip format at the level chosen for the
+    link quality.  The compressed body remains valid until the next
+    call to Shaper_Compress or Shaper_Destroy.
+
+    @param[in]
+        pShaper
+            pointer to the shaper, or NULL
+
+    @param[in]
+        body
+            pointer to the message body
+
+    @param[in]
+        len
+            length of the message body
+
+    @param[out]
+        packed
+            pointer to the location to store the compressed body
+
+    @param[out]
+        packedLen
+            pointer to the location to store the compressed length
+
+    @retval EOK the body was compressed
+    @retval ENOTSUP the body is not compressed on the current link
+    @retval EMSGSIZE compression would not make the body smaller
+    @retval ENOMEM not enough memory to compress the body
+    @retval EINVAL invalid arguments
+
+==============================================================================*/
+int Shaper_Compress( Shaper *pShaper,
+                     const void *body,
+                     size_t len,
+                     const void **packed,
+                     size_t *packedLen )
+{
+    unsigned char *buf;
+    size_t bound;
+    int level;
+
+    if ( ( body == NULL ) ||
+         ( packed == NULL ) ||
+         ( packedLen == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( ( pShaper == NULL ) ||
+         ( pShaper->stats.level == 0 ) ||
+         ( len < pShaper->compressMin ) )
+    {
+        return ENOTSUP;
+    }
+
+    level = pShaper->stats.level;
+    if ( pShaper->zLevel != level )
+    {
+        if ( pShaper->zLevel != 0 )
+        {
+            deflateEnd( &pShaper->zs );
+            pShaper->zLevel = 0;
+        }
+
+        /* a window of 15 bits with 16 added writes a gzip header */
+        memset( &pShaper->zs, 0, sizeof( z_stream ) );
+        if ( deflateInit2( &pShaper->zs,
+                           level,
+                           Z_DEFLATED,
+                           15 + 16,
+                           8,
+                           Z_DEFAULT_STRATEGY ) != Z_OK )
+        {
+            return ENOMEM;
+        }
+
+        pShaper->zLevel = level;
+    }
+    else
+    {
+        deflateReset( &pShaper->zs );
+    }
+
+    bound = deflateBound( &pShaper->zs, len );
+    if ( bound > pShaper->bufSize )
+    {
+        buf = realloc( pShaper->buf, bound );
+        if ( buf == NULL )
+        {
+            return ENOMEM;
+        }
+
+        pShaper->buf = buf;
+        pShaper->bufSize = bound;
+    }
+
+    pShaper->zs.next_in = (Bytef *)body;
+    pShaper->zs.avail_in = len;
+    pShaper->zs.next_out = pShaper->buf;
+    pShaper->zs.avail_out = pShaper->bufSize;
+
+    if ( ( deflate( &pShaper->zs, Z_FINISH ) != Z_STREAM_END ) ||
+         ( pShaper->zs.total_out >= len ) )
+    {
+        return EMSGSIZE;
+    }
+
+    *packed = pShaper->buf;
+    *packedLen = pShaper->zs.total_out;
+
+    pShaper->stats.compressed++;
+    pShaper->stats.rawBytes += len;
+    pShaper->stats.packedBytes += pShaper->zs.total_out;
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  Shaper_GetStats                                                           */
+/*!
+    Get the bandwidth shaper statistics
+
+    @param[in]
+        pShaper
+            pointer to the shaper
+
+    @param[out]
+        pStats
+            pointer to the statistics to populate
+
+==============================================================================*/
+void Shaper_GetStats( Shaper *pShaper, ShaperStats *pStats )
+{
+    if ( pStats != NULL )
+    {
+        if ( pShaper != NULL )
+        {
+            *pStats = pShaper->stats;
+        }
+        else
+        {
+            memset( pStats, 0, sizeof( ShaperStats ) );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Shaper_GetClass                                                           */
+/*!
+    Get the statistics of a traffic class
+
+    @param[in]
+        pShaper
+            pointer to the shaper
+
+    @param[in]
+        idx
+            index of the class, in the order they were added
+
+    @param[out]
+        pClass
+            pointer to the class record to populate
+
+    @retval EOK the class record was returned
+    @retval EINVAL invalid arguments
+    @retval ENOENT no class at the index
+
+==============================================================================*/
+int Shaper_GetClass( Shaper *pShaper, size_t idx, ShaperClass *pClass )
+{
+    Bucket *pBucket;
+
+    if ( ( pShaper == NULL ) ||
+         ( pClass == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( idx >= pShaper->classCount )
+    {
+        return ENOENT;
+    }
+
+    pBucket = &pShaper->classes[idx];
+    pClass->priority = pBucket->priority;
+    pClass->ceiling = pBucket->rate;
+    pClass->bytes = pBucket->bytes;
+    pClass->delays = pBucket->delays;
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  Shaper_QualityName                                                        */
+/*!
+    Get the name of a link quality level
+
+    @param[in]
+        quality
+            link quality level
+
+    @retval pointer to the name of the level
+
+==============================================================================*/
+const char *Shaper_QualityName( ShaperQuality quality )
+{
+    return ( quality < SHAPER_QUALITIES ) ? qualityNames[quality]
+                                          : "unknown";
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  FindClass                                                                 */
+/*!
+    Find the traffic class of a priority
+
+    @param[in]
+        pShaper
+            pointer to the shaper
+
+    @param[in]
+        priority
+            message queue priority
+
+    @retval pointer to the bucket of the class
+    @retval NULL if the priority has no class
+
+==============================================================================*/
+static Bucket *FindClass( Shaper *pShaper, unsigned int priority )
+{
+    size_t i;
+
+    for ( i = 0; i < pShaper->classCount; i++ )
+    {
+        if ( pShaper->classes[i].priority == priority )
+        {
+            return &pShaper->classes[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*============================================================================*/
+/*  Fill                                                                      */
+/*!
+    Add the tokens earned since the bucket was last filled
+
+    A bucket starts full.  The first time a bucket has no tokens left
+    after sending is counted as a delay.
+
+    @param[in]
+        pBucket
+            pointer to the bucket
+
+    @param[in]
+        nowMs
+            current monotonic time in milliseconds
+
+    @retval true the bucket has tokens
+    @retval false messages must wait
+
+==============================================================================*/
+static bool Fill( Bucket *pBucket, uint64_t nowMs )
+{
+    int64_t earned;
+
+    if ( pBucket->fillTime == 0 )
+    {
+        pBucket->tokens = pBucket->burst;
+        pBucket->fillTime = nowMs;
+    }
+    else if ( nowMs > pBucket->fillTime )
+    {
+        earned = (int64_t)( pBucket->rate * ( nowMs - pBucket->fillTime ) /
+                            1000 );
+        if ( earned > 0 )
+        {
+            pBucket->tokens += earned;
+            if ( pBucket->tokens > pBucket->burst )
+            {
+                pBucket->tokens = pBucket->burst;
+            }
+
+            pBucket->fillTime = nowMs;
+        }
+    }
+
+    if ( pBucket->tokens > 0 )
+    {
+        pBucket->blocked = false;
+        return true;
+    }
+
+    if ( pBucket->blocked == false )
+    {
+        pBucket->blocked = true;
+        pBucket->delays++;
+    }
+
+    return false;
+}
+
+/*============================================================================*/
+/*  Take                                                                      */
+/*!
+    Take the size of a sent message from a bucket
+
+    @param[in]
+        pBucket
+            pointer to the bucket
+
+    @param[in]
+        bytes
+            size of the message in bytes
+
+==============================================================================*/
+static void Take( Bucket *pBucket, size_t bytes )
+{
+    pBucket->tokens -= (int64_t)bytes;
+    pBucket->bytes += bytes;
+}
+
+/*============================================================================*/
+/*  SetRate                                                                   */
+/*!
+    Set the ceiling of a bucket
+
+    @param[in]
+        pBucket
+            pointer to the bucket
+
+    @param[in]
+        rate
+            ceiling in bytes per second
+
+==============================================================================*/
+static void SetRate( Bucket *pBucket, uint64_t rate )
+{
+    pBucket->rate = rate;
+    pBucket->burst = (int64_t)( rate * SHAPER_BURST_MS / 1000 );
+    if ( pBucket->burst == 0 )
+    {
+        pBucket->burst = 1;
+    }
+}
+
+/*! @}
+ * end of shaper group */
@@ -0,0 +1,939 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+/*!
+ * @defgroup shed shed
+ * @brief Load shedding policy
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file shed.c
+
+    Load shedding policy
+
+    The shed module decides which received messages to drop when the
+    ingest rate outruns the uplink for a sustained period, so the
+    service does not fall further and further behind.
+
+    A policy is a list of triggers and rules.  The triggers compare
+    measurements of the load with limits: the size of the messages
+    held by the service, the number of messages awaiting confirmation,
+    and the smoothed time taken to confirm a message.  While any
+    trigger is exceeded the shedding level rises by one every
+    SHED_STEP_MS, starting at 1, up to the highest priority named by a
+    priority rule.  Once no trigger is exceeded the level falls by one
+    every SHED_STEP_MS, and shedding stops when it reaches 0.
+
+    While the level is above 0 the rules are applied to each received
+    message:
+
+        priority:N      shed messages whose priority is below the
+                        level, at most N, so the lowest priorities are
+                        shed first
+        sample:S:P      keep P percent of the messages of stream S, or
+                        of every stream if S is *, chosen at random
+        latest:K        keep only the latest of the held messages with
+                        the same value of the K header
+
+    The latest rule is applied by the caller, which holds the messages.
+    Every shed message is accounted by reason, by client and by stream.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <varserver/varserver.h>
+#include "shed.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! kinds of policy entry */
+typedef enum policyType
+{
+    /*! size of the held messages in kilobytes */
+    POLICY_BACKLOG,
+
+    /*! number of messages awaiting confirmation */
+    POLICY_INFLIGHT,
+
+    /*! smoothed confirmation time in milliseconds */
+    POLICY_WAIT,
+
+    /*! shed the lowest priorities first */
+    POLICY_PRIORITY,
+
+    /*! sample a stream */
+    POLICY_SAMPLE,
+
+    /*! keep the latest message per key */
+    POLICY_LATEST
+
+} PolicyType;
+
+/*! policy entry */
+typedef struct policy
+{
+    /*! kind of entry */
+    PolicyType type;
+
+    /*! trigger limit, highest shed priority or sampled percentage */
+    uint64_t value;
+
+    /*! stream name or key header name */
+    char name[SHED_MAX_NAME];
+
+} Policy;
+
+/*! load shedding policy */
+struct shed
+{
+    /*! triggers and rules */
+    Policy policies[SHED_MAX_POLICIES];
+
+    /*! number of triggers and rules */
+    size_t count;
+
+    /*! number of triggers */
+    size_t triggers;
+
+    /*! number of rules */
+    size_t rules;
+
+    /*! highest shedding level */
+    uint32_t maxLevel;
+
+    /*! time of the last change of the shedding level in milliseconds */
+    uint64_t stepTime;
+
+    /*! sampling random number generator state */
+    uint32_t random;
+
+    /*! key header of the latest rule, or NULL if there is none */
+    const char *latestKey;
+
+    /*! shedding statistics */
+    ShedStats stats;
+
+    /*! messages shed from each client */
+    ShedSource clients[SHED_MAX_SOURCES];
+
+    /*! number of clients accounted */
+    size_t clientCount;
+
+    /*! messages shed from each stream */
+    ShedSource streams[SHED_MAX_SOURCES];
+
+    /*! number of streams accounted */
+    size_t streamCount;
+};
+
+/*! names of the shed reasons */
+static const char *reasonNames[SHED_REASONS] =
+{
+    "kept",
+    "priority",
+    "sample",
+    "latest"
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static uint32_t Random( Shed *pShed );
+static ShedSource *FindClient( Shed *pShed, uint32_t pid );
+static ShedSource *FindStream( Shed *pShed, const char *name, size_t len );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Shed_Create                                                               */
+/*!
+    Create an empty load shedding policy
+
+    @retval pointer to the policy
+    @retval NULL if the policy could not be created
+
+==============================================================================*/
+Shed *Shed_Create( void )
+{
+    Shed *pShed;
+    struct timespec ts;
+
+    pShed = calloc( 1, sizeof( Shed ) );
+    if ( pShed != NULL )
+    {
+        pShed->maxLevel = 1;
+
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        pShed->random = (uint32_t)ts.tv_nsec ^ (uint32_t)getpid();
+        if ( pShed->random == 0 )
+        {
+            pShed->random = 1;
+        }
+    }
+
+    return pShed;
+}
+
+/*============================================================================*/
+/*  Shed_Destroy                                                              */
+/*!
+    Destroy a load shedding policy
+
+    @param[in]
+        pShed
+            pointer to the policy to destroy
+
+==============================================================================*/
+void Shed_Destroy( Shed *pShed )
+{
+    free( pShed );
+}
+
+/*============================================================================*/
+/*  Shed_Add                                                                  */
+/*!
+    Add a trigger or a rule to the policy
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[in]
+        spec
+            trigger or rule: backlog:KB, inflight:count, wait:ms,
+            priority:N, sample:stream:percent or latest:key
+
+    @retval EOK the trigger or rule was added
+    @retval EINVAL invalid specification
+    @retval ENOSPC the policy is full
+
+==============================================================================*/
+int Shed_Add( Shed *pShed, const char *spec )
+{
+    Policy *pPolicy;
+    const char *p;
+    const char *q;
+    char *pEnd;
+    size_t len;
+
+    if ( ( pShed == NULL ) ||
+         ( spec == NULL ) ||
+         ( ( p = strchr( spec, ':' ) ) == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( pShed->count == SHED_MAX_POLICIES )
+    {
+        return ENOSPC;
+    }
+
+    pPolicy = &pShed->policies[pShed->count];
+    memset( pPolicy, 0, sizeof( Policy ) );
+    len = p++ - spec;
+
+    if ( ( len == 6 ) && ( strncmp( spec, "sample", len ) == 0 ) )
+    {
+        /* the stream name is followed by the percentage to keep */
+        q = strrchr( p, ':' );
+        if ( ( q == NULL ) ||
+             ( q == p ) ||
+             ( (size_t)( q - p ) >= SHED_MAX_NAME ) )
+        {
+            return EINVAL;
+        }
+
+        pPolicy->type = POLICY_SAMPLE;
+        memcpy( pPolicy->name, p, q - p );
+        p = q + 1;
+    }
+    else if ( ( len == 6 ) && ( strncmp( spec, "latest", len ) == 0 ) )
+    {
+        if ( ( *p == '\0' ) ||
+             ( strlen( p ) >= SHED_MAX_NAME ) ||
+             ( pShed->latestKey != NULL ) )
+        {
+            return EINVAL;
+        }
+
+        pPolicy->type = POLICY_LATEST;
+        strcpy( pPolicy->name, p );
+        pShed->latestKey = pPolicy->name;
+        pShed->count++;
+        pShed->rules++;
+        return EOK;
+    }
+    else if ( ( len == 7 ) && ( strncmp( spec, "backlog", len ) == 0 ) )
+    {
+        pPolicy->type = POLICY_BACKLOG;
+    }
+    else if ( ( len == 8 ) && ( strncmp( spec, "inflight", len ) == 0 ) )
+    {
+        pPolicy->type = POLICY_INFLIGHT;
+    }
+    else if ( ( len == 4 ) && ( strncmp( spec, "wait", len ) == 0 ) )
+    {
+        pPolicy->type = POLICY_WAIT;
+    }
+    else if ( ( len == 8 ) && ( strncmp( spec, "priority", len ) == 0 ) )
+    {
+        pPolicy->type = POLICY_PRIORITY;
+    }
+    else
+    {
+        return EINVAL;
+    }
+
+    pPolicy->value = strtoull( p, &pEnd, 0 );
+    if ( ( pEnd == p ) ||
+         ( *pEnd != '\0' ) ||
+         ( ( pPolicy->type == POLICY_SAMPLE ) &&
+           ( pPolicy->value > 100 ) ) ||
+         ( ( pPolicy->type == POLICY_PRIORITY ) &&
+           ( ( pPolicy->value == 0 ) || ( pPolicy->value > UINT32_MAX ) ) ) )
+    {
+        return EINVAL;
+    }
+
+    switch ( pPolicy->type )
+    {
+        case POLICY_BACKLOG:
+            pPolicy->value <<= 10;
+            pShed->triggers++;
+            break;
+
+        case POLICY_INFLIGHT:
+        case POLICY_WAIT:
+            pShed->triggers++;
+            break;
+
+        case POLICY_PRIORITY:
+            if ( pPolicy->value > pShed->maxLevel )
+            {
+                pShed->maxLevel = (uint32_t)pPolicy->value;
+            }
+            pShed->rules++;
+            break;
+
+        default:
+            pShed->rules++;
+            break;
+    }
+
+    pShed->count++;
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  Shed_Enabled                                                              */
+/*!
+    Determine if the policy can shed messages
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @retval true the policy has at least one trigger and one rule
+    @retval false the policy never sheds messages
+
+==============================================================================*/
+bool Shed_Enabled( Shed *pShed )
+{
+    return ( pShed != NULL ) &&
+           ( pShed->triggers > 0 ) &&
+           ( pShed->rules > 0 );
+}
+
+/*============================================================================*/
+/*  Shed_Update                                                               */
+/*!
+    Update the shedding level from the current load
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[in]
+        pLoad
+            pointer to the current load measurements
+
+    @param[in]
+        nowMs
+            current monotonic time in milliseconds
+
+==============================================================================*/
+void Shed_Update( Shed *pShed, const ShedLoad *pLoad, uint64_t nowMs )
+{
+    bool exceeded = false;
+    Policy *pPolicy;
+    size_t i;
+
+    if ( ( pShed == NULL ) ||
+         ( pLoad == NULL ) )
+    {
+        return;
+    }
+
+    for ( i = 0; i < pShed->count; i++ )
+    {
+        pPolicy = &pShed->policies[i];
+        switch ( pPolicy->type )
+        {
+            case POLICY_BACKLOG:
+                exceeded |= ( pLoad->backlogBytes > pPolicy->value );
+                break;
+
+            case POLICY_INFLIGHT:
+                exceeded |= ( pLoad->inFlight > pPolicy->value );
+                break;
+
+            case POLICY_WAIT:
+                exceeded |= ( pLoad->waitMs > pPolicy->value );
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if ( ( exceeded == true ) && ( pShed->stats.level == 0 ) )
+    {
+        /* start shedding at once */
+        pShed->stats.level = 1;
+        pShed->stepTime = nowMs;
+    }
+    else if ( nowMs - pShed->stepTime >= SHED_STEP_MS )
+    {
+        pShed->stepTime = nowMs;
+        if ( ( exceeded == true ) &&
+             ( pShed->stats.level < pShed->maxLevel ) )
+        {
+            pShed->stats.level++;
+        }
+        else if ( ( exceeded == false ) &&
+                  ( pShed->stats.level > 0 ) )
+        {
+            pShed->stats.level--;
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Shed_Active                                                               */
+/*!
+    Determine if messages are being shed
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @retval true the shedding level is above 0
+    @retval false no messages are shed
+
+==============================================================================*/
+bool Shed_Active( Shed *pShed )
+{
+    return ( pShed != NULL ) && ( pShed->stats.level > 0 );
+}
+
+/*============================================================================*/
+/*  Shed_Admit                                                                */
+/*!
+    Apply the priority and sample rules to a received message
+
+    A message which is shed is accounted to its client and stream.
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[in]
+        pid
+            process id of the client which sent the message
+
+    @param[in]
+        priority
+            message queue priority of the message
+
+    @param[in]
+        stream
+            pointer to the name of the message's stream, or NULL
+
+    @param[in]
+        streamLength
+            length of the stream name
+
+    @param[in]
+        bytes
+            size of the message in bytes
+
+    @retval SHED_KEEP the message is kept
+    @retval SHED_PRIORITY the message is shed for its priority
+    @retval SHED_SAMPLE the message is shed by sampling its stream
+
+==============================================================================*/
+ShedReason Shed_Admit( Shed *pShed,
+                       uint32_t pid,
+                       unsigned int priority,
+                       const char *stream,
+                       size_t streamLength,
+                       size_t bytes )
+{
+    ShedReason reason = SHED_KEEP;
+    Policy *pPolicy;
+    uint64_t level;
+    size_t i;
+
+    if ( Shed_Active( pShed ) == false )
+    {
+        return SHED_KEEP;
+    }
+
+    for ( i = 0; ( i < pShed->count ) && ( reason == SHED_KEEP ); i++ )
+    {
+        pPolicy = &pShed->policies[i];
+        if ( pPolicy->type == POLICY_PRIORITY )
+        {
+            level = ( pShed->stats.level < pPolicy->value )
+                    ? pShed->stats.level
+                    : pPolicy->value;
+            if ( priority < level )
+            {
+                reason = SHED_PRIORITY;
+            }
+        }
+        else if ( ( pPolicy->type == POLICY_SAMPLE ) &&
+                  ( ( strcmp( pPolicy->name, "*" ) == 0 ) ||
+                    ( ( stream != NULL ) &&
+                      ( strlen( pPolicy->name ) == streamLength ) &&
+                      ( strncmp( pPolicy->name,
+                                 stream,
+                                 streamLength ) == 0 ) ) ) &&
+                  ( Random( pShed ) % 100 >= pPolicy->value ) )
+        {
+            reason = SHED_SAMPLE;
+        }
+    }
+
+    if ( reason != SHED_KEEP )
+    {
+        Shed_Record( pShed, reason, pid, stream, streamLength, bytes );
+    }
+
+    return reason;
+}
+
+/*============================================================================*/
+/*  Shed_LatestKey                                                            */
+/*!
+    Get the key of the latest rule while messages are being shed
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @retval name of the header which identifies messages replaced by
+            later ones
+    @retval NULL messages are not being replaced
+
+==============================================================================*/
+const char *Shed_LatestKey( Shed *pShed )
+{
+    return ( Shed_Active( pShed ) == true ) ? pShed->latestKey : NULL;
+}
+
+/*============================================================================*/
+/*  Shed_Record                                                               */
+/*!
+    Account for a shed message
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[in]
+        reason
+            reason the message was shed
+
+    @param[in]
+        pid
+            process id of the client which sent the message
+
+    @param[in]
+        stream
+            pointer to the name of the message's stream, or NULL
+
+    @param[in]
+        streamLength
+            length of the stream name
+
+    @param[in]
+        bytes
+            size of the message in bytes
+
+==============================================================================*/
+void Shed_Record( Shed *pShed,
+                  ShedReason reason,
+                  uint32_t pid,
+                  const char *stream,
+                  size_t streamLength,
+                  size_t bytes )
+{
+    ShedSource *pSource;
+
+    if ( ( pShed == NULL ) ||
+         ( reason <= SHED_KEEP ) ||
+         ( reason >= SHED_REASONS ) )
+    {
+        return;
+    }
+
+    pShed->stats.total++;
+    pShed->stats.reasons[reason]++;
+
+    pSource = FindClient( pShed, pid );
+    if ( pSource != NULL )
+    {
+        pSource->count++;
+        pSource->bytes += bytes;
+    }
+    else
+    {
+        pShed->stats.otherClients++;
+    }
+
+    if ( stream == NULL )
+    {
+        stream = "";
+        streamLength = 0;
+    }
+
+    pSource = FindStream( pShed, stream, streamLength );
+    if ( pSource != NULL )
+    {
+        pSource->count++;
+        pSource->bytes += bytes;
+    }
+    else
+    {
+        pShed->stats.otherStreams++;
+    }
+}
+
+/*============================================================================*/
+/*  Shed_GetStats                                                             */
+/*!
+    Get the load shedding statistics
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[out]
+        pStats
+            pointer to the statistics to populate
+
+==============================================================================*/
+void Shed_GetStats( Shed *pShed, ShedStats *pStats )
+{
+    if ( pStats != NULL )
+    {
+        if ( pShed != NULL )
+        {
+            *pStats = pShed->stats;
+        }
+        else
+        {
+            memset( pStats, 0, sizeof( ShedStats ) );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Shed_GetClient                                                            */
+/*!
+    Get the messages shed from a client
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[in]
+        idx
+            index of the client, in the order they were first shed from
+
+    @param[out]
+        pSource
+            pointer to the client record to populate
+
+    @retval EOK the client record was returned
+    @retval EINVAL invalid arguments
+    @retval ENOENT no client at the index
+
+==============================================================================*/
+int Shed_GetClient( Shed *pShed, size_t idx, ShedSource *pSource )
+{
+    if ( ( pShed == NULL ) ||
+         ( pSource == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( idx >= pShed->clientCount )
+    {
+        return ENOENT;
+    }
+
+    *pSource = pShed->clients[idx];
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  Shed_GetStream                                                            */
+/*!
+    Get the messages shed from a stream
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[in]
+        idx
+            index of the stream, in the order they were first shed from
+
+    @param[out]
+        pSource
+            pointer to the stream record to populate
+
+    @retval EOK the stream record was returned
+    @retval EINVAL invalid arguments
+    @retval ENOENT no stream at the index
+
+==============================================================================*/
+int Shed_GetStream( Shed *pShed, size_t idx, ShedSource *pSource )
+{
+    if ( ( pShed == NULL ) ||
+         ( pSource == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( idx >= pShed->streamCount )
+    {
+        return ENOENT;
+    }
+
+    *pSource = pShed->streams[idx];
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  Shed_ReasonName                                                           */
+/*!
+    Get the name of a shed reason
+
+    @param[in]
+        reason
+            reason a message was shed
+
+    @retval name of the reason
+
+==============================================================================*/
+const char *Shed_ReasonName( ShedReason reason )
+{
+    return ( ( reason >= SHED_KEEP ) && ( reason < SHED_REASONS ) )
+           ? reasonNames[reason]
+           : "unknown";
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Random                                                                    */
+/*!
+    Get the next sampling random number
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @retval pseudo random number (xorshift32)
+
+==============================================================================*/
+static uint32_t Random( Shed *pShed )
+{
+    uint32_t x = pShed->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pShed->random = x;
+
+    return x;
+}
+
+/*============================================================================*/
+/*  FindClient                                                                */
+/*!
+    Find or add the shed accounting record of a client
+
+    A new record is named after the client's process.
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[in]
+        pid
+            process id of the client
+
+    @retval pointer to the client record
+    @retval NULL there is no room for another client
+
+==============================================================================*/
+static ShedSource *FindClient( Shed *pShed, uint32_t pid )
+{
+    ShedSource *pSource;
+    char path[64];
+    ssize_t n = -1;
+    size_t i;
+    int fd;
+
+    for ( i = 0; i < pShed->clientCount; i++ )
+    {
+        if ( pShed->clients[i].pid == pid )
+        {
+            return &pShed->clients[i];
+        }
+    }
+
+    if ( pShed->clientCount == SHED_MAX_SOURCES )
+    {
+        return NULL;
+    }
+
+    pSource = &pShed->clients[pShed->clientCount++];
+    memset( pSource, 0, sizeof( ShedSource ) );
+    pSource->pid = pid;
+
+    snprintf( path, sizeof( path ), "/proc/%u/comm", pid );
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd != -1 )
+    {
+        n = read( fd, pSource->name, sizeof( pSource->name ) - 1 );
+        close( fd );
+    }
+
+    if ( n > 0 )
+    {
+        pSource->name[strcspn( pSource->name, "\n" )] = '\0';
+    }
+    else
+    {
+        strcpy( pSource->name, "unknown" );
+    }
+
+    return pSource;
+}
+
+/*============================================================================*/
+/*  FindStream                                                                */
+/*!
+    Find or add the shed accounting record of a stream
+
+    @param[in]
+        pShed
+            pointer to the policy
+
+    @param[in]
+        name
+            pointer to the name of the stream
+
+    @param[in]
+        len
+            length of the stream name
+
+    @retval pointer to the stream record
+    @retval NULL there is no room for another stream
+
+==============================================================================*/
+static ShedSource *FindStream( Shed *pShed, const char *name, size_t len )
+{
+    ShedSource *pSource;
+    size_t i;
+
+    if ( len >= SHED_MAX_NAME )
+    {
+        len = SHED_MAX_NAME - 1;
+    }
+
+    for ( i = 0; i < pShed->streamCount; i++ )
+    {
+        if ( ( strlen( pShed->streams[i].name ) == len ) &&
+             ( strncmp( pShed->streams[i].name, name, len ) == 0 ) )
+        {
+            return &pShed->streams[i];
+        }
+    }
+
+    if ( pShed->streamCount == SHED_MAX_SOURCES )
+    {
+        return NULL;
+    }
+
+    pSource = &pShed->streams[pShed->streamCount++];
+    memset( pSource, 0, sizeof( ShedSource ) );
+    memcpy( pSource->name, name, len );
+
+    return pSource;
+}
+
+/*! @}
+ * end of shed group */
@@ -0,0 +1,2120 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup simlink simlink
+ * @brief Link from the iothub service to the local hub stand-in
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file simlink.c
+
+    Hub stand-in link
+
+    The simlink module replaces the Azure IOT SDK client when the iothub
+    service is run against the local hub stand-in (hubsim) for offline
+    testing and benchmarking.  It provides the same asynchronous send
+    and confirmation callback semantics as IoTHubClient_SendEventAsync
+    over a plain TCP connection using the frames defined in hubsim.h.
+
+    Messages are written to the stand-in from the caller's thread.
+    A receive thread reads the acknowledgements and invokes the
+    confirmation callbacks in send order.
+
+    Like the SDK, the link keeps every message until it has been
+    acknowledged.  When the connection is lost the receive thread
+    reconnects with exponential backoff and retransmits the
+    unacknowledged messages in order, so messages accepted while the
+    link is down accumulate as a backlog rather than being failed.
+    Unlike the SDK the link never gives up, so it only reports the
+    AUTHENTICATED/OK and UNAUTHENTICATED/COMMUNICATION_ERROR statuses
+    to its connection status callback.
+
+    If a TlsCache is specified the link runs over TLS.  The socket is
+    then non-blocking and each SSL_read and SSL_write is serialized by
+    the link's SSL mutex, so the sending threads and the receive thread
+    can share the connection.  Reconnects reuse the cached trust store
+    and offer the most recent session ticket, and the time spent in
+    each phase of a reconnect is recorded.
+
+    Blob uploads run in a thread of their own over a separate
+    connection, as the SDK uploads over HTTPS beside its telemetry
+    connection, so a large upload does not hold up messages.  Each
+    block is written straight from the caller's buffer and
+    acknowledged before the next is requested.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <varserver/varserver.h>
+#include <azureiot/iothub_client.h>
+#include <openssl/ssl.h>
+#include "hubsim.h"
+#include "tlscache.h"
+#include "backoff.h"
+#include "socktune.h"
+#include "simlink.h"
+#include "footprint.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! initial size of the frame encoding buffer */
+#define SIMLINK_BUFFER_SIZE ( 8192 )
+
+/*! interval at which a TLS write waiting for incoming data rechecks
+    the connection, in milliseconds */
+#define SIMLINK_TLS_POLL_MS ( 100 )
+
+/*! blob upload in progress */
+typedef struct simUpload
+{
+    /*! pointer to the SimLink the upload belongs to */
+    struct simLink *pSimLink;
+
+    /*! name of the destination blob */
+    char *blobName;
+
+    /*! callback supplying the blocks and receiving the result */
+    IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_CALLBACK_EX callback;
+
+    /*! callback context */
+    void *context;
+
+} SimUpload;
+
+/*! message awaiting acknowledgement from the stand-in */
+typedef struct simPending
+{
+    /*! frame sequence number */
+    uint64_t seq;
+
+    /*! confirmation callback */
+    IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback;
+
+    /*! confirmation callback context */
+    void *userContextCallback;
+
+    /*! encoded frame kept for retransmission */
+    char *frame;
+
+    /*! length of the encoded frame */
+    size_t length;
+
+    /*! pointer to the next pending message */
+    struct simPending *pNext;
+
+} SimPending;
+
+/*! hub stand-in link */
+struct simLink
+{
+    /*! address of the stand-in */
+    char *address;
+
+    /*! host name of the stand-in */
+    char host[256];
+
+    /*! port of the stand-in */
+    char port[16];
+
+    /*! socket connected to the stand-in, or -1 while reconnecting */
+    int fd;
+
+    /*! TLS context cache, or NULL for a plain TCP link */
+    TlsCache *pTlsCache;
+
+    /*! TLS connection to the stand-in, or NULL */
+    SSL *ssl;
+
+    /*! socket options applied to each connection */
+    SockTune sockTune;
+
+    /*! mutex serializing the use of the TLS connection */
+    pthread_mutex_t sslMutex;
+
+    /*! phase timings of the most recent connection */
+    SimLinkTimings timings;
+
+    /*! verbose flag */
+    bool verbose;
+
+    /*! mutex serializing frame writes, sequence numbers and the
+        connection state */
+    pthread_mutex_t txMutex;
+
+    /*! signalled to stop a reconnect backoff wait */
+    pthread_cond_t wake;
+
+    /*! reconnect backoff policy, protected by txMutex */
+    Backoff backoff;
+
+    /*! mutex serializing connection status notifications */
+    pthread_mutex_t statusMutex;
+
+    /*! connection status callback */
+    IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK statusCallback;
+
+    /*! connection status callback context */
+    void *statusContext;
+
+    /*! mutex protecting the pending list */
+    pthread_mutex_t mutex;
+
+    /*! next frame sequence number */
+    uint64_t seq;
+
+    /*! oldest message awaiting acknowledgement */
+    SimPending *pHead;
+
+    /*! newest message awaiting acknowledgement */
+    SimPending *pTail;
+
+    /*! frame encoding buffer */
+    char *buf;
+
+    /*! size of the frame encoding buffer */
+    size_t bufSize;
+
+    /*! acknowledgement receive thread */
+    pthread_t rxThread;
+
+    /*! true if frames can be written to the stand-in */
+    bool connected;
+
+    /*! true if the link is being destroyed */
+    bool stopping;
+
+    /*! number of blob uploads in progress, protected by mutex */
+    uint32_t uploads;
+
+    /*! signalled when the last blob upload has finished */
+    pthread_cond_t uploadDone;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static int ParseAddress( SimLink *pSimLink, const char *address );
+static int Dial( SimLink *pSimLink, SSL **ppSSL, SimLinkTimings *pTimings );
+static void *RxThread( void *arg );
+static uint64_t ReceiveAcks( SimLink *pSimLink, int fd, SSL *ssl );
+static bool Reconnect( SimLink *pSimLink, bool healthy );
+static int Retransmit( SimLink *pSimLink );
+static int ReadAll( int fd, void *buf, size_t len );
+static int WriteFrame( SimLink *pSimLink, char *buf, size_t len );
+static int ReadTls( SimLink *pSimLink,
+                    int fd,
+                    SSL *ssl,
+                    void *buf,
+                    size_t len );
+static int WriteTls( SimLink *pSimLink, char *buf, size_t len );
+static int WaitTls( int fd, int err, int timeout );
+static int EncodeProperties( SimLink *pSimLink,
+                             IOTHUB_MESSAGE_HANDLE messageHandle,
+                             size_t *len );
+static int AppendProperty( SimLink *pSimLink,
+                           size_t *offset,
+                           const char *key,
+                           const char *value );
+static void *UploadThread( void *arg );
+static int UploadSend( int fd,
+                       SSL *ssl,
+                       const void *buf,
+                       size_t len,
+                       int flags );
+static int UploadRecv( int fd, SSL *ssl, void *buf, size_t len );
+static void FailPending( SimLink *pSimLink );
+static void NotifyStatus( SimLink *pSimLink,
+                          IOTHUB_CLIENT_CONNECTION_STATUS status,
+                          IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason );
+static uint64_t GetTimeUs( void );
+static uint64_t GetMonotonicUs( void );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  SimLink_Create                                                            */
+/*!
+    Connect to the hub stand-in
+
+    The SimLink_Create function connects to the hub stand-in at the
+    specified address and starts the acknowledgement receive thread.
+
+    @param[in]
+        address
+            address of the stand-in in host:port form.  If the port is
+            omitted HUBSIM_DEFAULT_PORT is used.
+
+    @param[in]
+        pTlsCache
+            TLS context cache to connect with, or NULL for a plain TCP
+            link.  The cache must outlive the link.
+
+    @param[in]
+        pSockTune
+            socket options to apply to each connection, or NULL for
+            the defaults
+
+    @param[in]
+        verbose
+            true to report link errors on stderr
+
+    @retval pointer to the new SimLink
+    @retval NULL if the link could not be created
+
+==============================================================================*/
+SimLink *SimLink_Create( const char *address,
+                         TlsCache *pTlsCache,
+                         const SockTune *pSockTune,
+                         bool verbose )
+{
+    SimLink *pSimLink = NULL;
+
+    if ( address != NULL )
+    {
+        pSimLink = calloc( 1, sizeof( SimLink ) );
+    }
+
+    if ( pSimLink != NULL )
+    {
+        pSimLink->verbose = verbose;
+        pSimLink->pTlsCache = pTlsCache;
+        if ( pSockTune != NULL )
+        {
+            pSimLink->sockTune = *pSockTune;
+        }
+        else
+        {
+            SockTune_Init( &pSimLink->sockTune );
+        }
+
+        pSimLink->address = strdup( address );
+        pSimLink->bufSize = SIMLINK_BUFFER_SIZE;
+        pSimLink->buf = malloc( pSimLink->bufSize );
+        pthread_mutex_init( &pSimLink->txMutex, NULL );
+        pthread_mutex_init( &pSimLink->mutex, NULL );
+        pthread_mutex_init( &pSimLink->sslMutex, NULL );
+        pthread_mutex_init( &pSimLink->statusMutex, NULL );
+        pthread_cond_init( &pSimLink->wake, NULL );
+        pthread_cond_init( &pSimLink->uploadDone, NULL );
+        Backoff_Init( &pSimLink->backoff,
+                      BACKOFF_DEFAULT_MIN_MS,
+                      BACKOFF_DEFAULT_MAX_MS,
+                      BACKOFF_DEFAULT_JITTER );
+
+        pSimLink->fd = -1;
+        if ( ( pSimLink->buf != NULL ) &&
+             ( pSimLink->address != NULL ) &&
+             ( ParseAddress( pSimLink, address ) == EOK ) )
+        {
+            pSimLink->fd = Dial( pSimLink,
+                                 &pSimLink->ssl,
+                                 &pSimLink->timings );
+            if ( pSimLink->fd != -1 )
+            {
+                pSimLink->connected = true;
+            }
+            else
+            {
+                fprintf( stderr,
+                         "SimLink: cannot connect to %s: %s\n",
+                         address,
+                         strerror( errno ) );
+            }
+        }
+
+        if ( ( pSimLink->fd == -1 ) ||
+             ( pthread_create( &pSimLink->rxThread,
+                               NULL,
+                               RxThread,
+                               pSimLink ) != 0 ) )
+        {
+            if ( pSimLink->fd != -1 )
+            {
+                SSL_free( pSimLink->ssl );
+                close( pSimLink->fd );
+            }
+
+            pthread_mutex_destroy( &pSimLink->txMutex );
+            pthread_mutex_destroy( &pSimLink->mutex );
+            pthread_mutex_destroy( &pSimLink->sslMutex );
+            pthread_mutex_destroy( &pSimLink->statusMutex );
+            pthread_cond_destroy( &pSimLink->wake );
+            pthread_cond_destroy( &pSimLink->uploadDone );
+            free( pSimLink->address );
+            free( pSimLink->buf );
+            free( pSimLink );
+            pSimLink = NULL;
+        }
+    }
+
+    return pSimLink;
+}
+
+/*============================================================================*/
+/*  SimLink_Destroy                                                           */
+/*!
+    Close the link to the hub stand-in
+
+    The SimLink_Destroy function closes the connection to the stand-in
+    and completes any unacknowledged messages with
+    IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY.  Blob uploads in
+    progress fail once their current block has been acknowledged,
+    and the link is destroyed when they have finished.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink to destroy
+
+==============================================================================*/
+void SimLink_Destroy( SimLink *pSimLink )
+{
+    if ( pSimLink != NULL )
+    {
+        /* wake up the receive thread */
+        pthread_mutex_lock( &pSimLink->txMutex );
+        pSimLink->stopping = true;
+        pSimLink->connected = false;
+        if ( pSimLink->fd != -1 )
+        {
+            shutdown( pSimLink->fd, SHUT_RDWR );
+        }
+        pthread_cond_signal( &pSimLink->wake );
+        pthread_mutex_unlock( &pSimLink->txMutex );
+
+        pthread_join( pSimLink->rxThread, NULL );
+
+        /* the uploads stop before their next block */
+        pthread_mutex_lock( &pSimLink->mutex );
+        while ( pSimLink->uploads > 0 )
+        {
+            pthread_cond_wait( &pSimLink->uploadDone, &pSimLink->mutex );
+        }
+        pthread_mutex_unlock( &pSimLink->mutex );
+
+        pthread_mutex_destroy( &pSimLink->txMutex );
+        pthread_mutex_destroy( &pSimLink->mutex );
+        pthread_mutex_destroy( &pSimLink->sslMutex );
+        pthread_mutex_destroy( &pSimLink->statusMutex );
+        pthread_cond_destroy( &pSimLink->wake );
+        pthread_cond_destroy( &pSimLink->uploadDone );
+        free( pSimLink->address );
+        free( pSimLink->buf );
+        free( pSimLink );
+    }
+}
+
+/*============================================================================*/
+/*  SimLink_SetConnectionStatusCallback                                       */
+/*!
+    Set the connection status callback
+
+    The SimLink_SetConnectionStatusCallback function has the semantics
+    of IoTHubClient_SetConnectionStatusCallback.  Since the link is
+    connected when it is created, the callback is invoked immediately
+    with IOTHUB_CLIENT_CONNECTION_AUTHENTICATED if the link is up.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        callback
+            connection status callback, or NULL to remove it
+
+    @param[in]
+        userContextCallback
+            context passed to the callback
+
+    @retval IOTHUB_CLIENT_OK the callback was set
+    @retval IOTHUB_CLIENT_INVALID_ARG invalid arguments
+
+==============================================================================*/
+IOTHUB_CLIENT_RESULT SimLink_SetConnectionStatusCallback(
+                        SimLink *pSimLink,
+                        IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK callback,
+                        void *userContextCallback )
+{
+    bool connected;
+
+    if ( pSimLink == NULL )
+    {
+        return IOTHUB_CLIENT_INVALID_ARG;
+    }
+
+    pthread_mutex_lock( &pSimLink->statusMutex );
+
+    pSimLink->statusCallback = callback;
+    pSimLink->statusContext = userContextCallback;
+
+    pthread_mutex_lock( &pSimLink->txMutex );
+    connected = pSimLink->connected;
+    pthread_mutex_unlock( &pSimLink->txMutex );
+
+    if ( ( connected == true ) &&
+         ( callback != NULL ) )
+    {
+        callback( IOTHUB_CLIENT_CONNECTION_AUTHENTICATED,
+                  IOTHUB_CLIENT_CONNECTION_OK,
+                  userContextCallback );
+    }
+
+    pthread_mutex_unlock( &pSimLink->statusMutex );
+
+    return IOTHUB_CLIENT_OK;
+}
+
+/*============================================================================*/
+/*  SimLink_SetRetryPolicy                                                    */
+/*!
+    Set the reconnect backoff policy
+
+    The SimLink_SetRetryPolicy function replaces the default reconnect
+    backoff of the link.  The link retries until it is destroyed.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        pPolicy
+            pointer to the backoff policy to copy
+
+    @retval EOK the policy was set
+    @retval EINVAL invalid arguments
+
+==============================================================================*/
+int SimLink_SetRetryPolicy( SimLink *pSimLink, const Backoff *pPolicy )
+{
+    int result = EINVAL;
+
+    if ( ( pSimLink != NULL ) &&
+         ( pPolicy != NULL ) )
+    {
+        pthread_mutex_lock( &pSimLink->txMutex );
+        pSimLink->backoff = *pPolicy;
+        Backoff_Reset( &pSimLink->backoff );
+        pthread_mutex_unlock( &pSimLink->txMutex );
+
+        result = EOK;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SimLink_GetTimings                                                        */
+/*!
+    Get the phase timings of the most recent connection
+
+    The SimLink_GetTimings function retrieves the time spent in each
+    phase of the initial connection or of the most recent reconnect.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[out]
+        pTimings
+            pointer to a location to store the timings
+
+    @retval EOK the timings were retrieved
+    @retval EINVAL invalid arguments
+
+==============================================================================*/
+int SimLink_GetTimings( SimLink *pSimLink, SimLinkTimings *pTimings )
+{
+    int result = EINVAL;
+
+    if ( ( pSimLink != NULL ) &&
+         ( pTimings != NULL ) )
+    {
+        pthread_mutex_lock( &pSimLink->txMutex );
+        *pTimings = pSimLink->timings;
+        pthread_mutex_unlock( &pSimLink->txMutex );
+
+        result = EOK;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SimLink_SendEventAsync                                                    */
+/*!
+    Send a message to the hub stand-in
+
+    The SimLink_SendEventAsync function encodes the message properties
+    and body into a hub stand-in frame, queues it for acknowledgement
+    and writes it to the stand-in if it is connected.  Otherwise the
+    frame is sent when the link reconnects.  The callback is invoked
+    from the receive thread when the stand-in acknowledges the frame.
+    The caller retains ownership of the message handle.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink to send the message on
+
+    @param[in]
+        messageHandle
+            handle of the message to send
+
+    @param[in]
+        callback
+            confirmation callback
+
+    @param[in]
+        userContextCallback
+            confirmation callback context
+
+    @retval IOTHUB_CLIENT_OK the message was queued and the callback
+            will be invoked
+    @retval IOTHUB_CLIENT_INVALID_ARG invalid arguments
+    @retval IOTHUB_CLIENT_ERROR the message could not be queued
+
+==============================================================================*/
+IOTHUB_CLIENT_RESULT SimLink_SendEventAsync(
+                        SimLink *pSimLink,
+                        IOTHUB_MESSAGE_HANDLE messageHandle,
+                        IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback,
+                        void *userContextCallback )
+{
+    IOTHUB_CLIENT_RESULT result = IOTHUB_CLIENT_INVALID_ARG;
+    const unsigned char *body;
+    size_t bodySize;
+    size_t len;
+    HubSimFrame frame;
+    SimPending *pPending;
+
+    if ( ( pSimLink != NULL ) &&
+         ( messageHandle != NULL ) )
+    {
+        result = IOTHUB_CLIENT_ERROR;
+
+        if ( IoTHubMessage_GetContentType( messageHandle ) ==
+                IOTHUBMESSAGE_STRING )
+        {
+            body = (const unsigned char *)IoTHubMessage_GetString(
+                                                messageHandle );
+            bodySize = ( body != NULL ) ? strlen( (const char *)body ) : 0;
+        }
+        else if ( IoTHubMessage_GetByteArray( messageHandle,
+                                              &body,
+                                              &bodySize )
+                    != IOTHUB_MESSAGE_OK )
+        {
+            body = NULL;
+            bodySize = 0;
+        }
+
+        pPending = calloc( 1, sizeof( SimPending ) );
+        if ( pPending != NULL )
+        {
+            pPending->callback = callback;
+            pPending->userContextCallback = userContextCallback;
+
+            pthread_mutex_lock( &pSimLink->txMutex );
+
+            if ( ( pSimLink->stopping == false ) &&
+                 ( EncodeProperties( pSimLink,
+                                     messageHandle,
+                                     &len ) == EOK ) )
+            {
+                frame.magic = HUBSIM_MAGIC;
+                frame.type = HUBSIM_FRAME_MESSAGE;
+                frame.seq = pSimLink->seq;
+                frame.headerLength = len;
+                frame.bodyLength = bodySize;
+                frame.queued = GetTimeUs();
+
+                /* keep a copy of the frame for retransmission */
+                pPending->length = sizeof( frame ) + len + bodySize;
+                pPending->frame = malloc( pPending->length );
+            }
+
+            if ( pPending->frame != NULL )
+            {
+                memcpy( pPending->frame, &frame, sizeof( frame ) );
+                memcpy( &pPending->frame[sizeof( frame )],
+                        pSimLink->buf,
+                        len );
+                if ( bodySize > 0 )
+                {
+                    memcpy( &pPending->frame[sizeof( frame ) + len],
+                            body,
+                            bodySize );
+                }
+
+                pSimLink->seq++;
+
+                /* queue the acknowledgement before the frame is written
+                   so a fast acknowledgement always finds it */
+                pPending->seq = frame.seq;
+
+                pthread_mutex_lock( &pSimLink->mutex );
+                if ( pSimLink->pTail != NULL )
+                {
+                    pSimLink->pTail->pNext = pPending;
+                }
+                else
+                {
+                    pSimLink->pHead = pPending;
+                }
+                pSimLink->pTail = pPending;
+                pthread_mutex_unlock( &pSimLink->mutex );
+
+                if ( ( pSimLink->connected == true ) &&
+                     ( WriteFrame( pSimLink,
+                                   pPending->frame,
+                                   pPending->length ) != EOK ) )
+                {
+                    /* the message is already queued, so it is
+                       retransmitted when the receive thread has
+                       reconnected */
+                    pSimLink->connected = false;
+                    shutdown( pSimLink->fd, SHUT_RDWR );
+                }
+
+                pPending = NULL;
+                result = IOTHUB_CLIENT_OK;
+            }
+
+            pthread_mutex_unlock( &pSimLink->txMutex );
+
+            /* not queued */
+            if ( pPending != NULL )
+            {
+                free( pPending->frame );
+                free( pPending );
+            }
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SimLink_UploadMultipleBlocksToBlobExAsync                                 */
+/*!
+    Upload a blob to the stand-in in blocks
+
+    The SimLink_UploadMultipleBlocksToBlobExAsync function has the
+    semantics of IoTHubClient_UploadMultipleBlocksToBlobExAsync.  The
+    upload runs in a thread of its own over a new connection to the
+    stand-in.  The callback is asked for each block in turn until it
+    returns a block size of zero, and is then called once more with
+    NULL data and size pointers and the result of the upload.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        destinationFileName
+            name of the blob to upload
+
+    @param[in]
+        getDataCallbackEx
+            callback supplying the blocks and receiving the result
+
+    @param[in]
+        context
+            context passed to the callback
+
+    @retval IOTHUB_CLIENT_OK the upload was started and the callback
+            will be called with its result
+    @retval IOTHUB_CLIENT_INVALID_ARG invalid arguments
+    @retval IOTHUB_CLIENT_ERROR the upload could not be started
+
+==============================================================================*/
+IOTHUB_CLIENT_RESULT SimLink_UploadMultipleBlocksToBlobExAsync(
+                        SimLink *pSimLink,
+                        const char *destinationFileName,
+                        IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_CALLBACK_EX
+                            getDataCallbackEx,
+                        void *context )
+{
+    IOTHUB_CLIENT_RESULT result = IOTHUB_CLIENT_INVALID_ARG;
+    SimUpload *pUpload;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if ( ( pSimLink == NULL ) ||
+         ( destinationFileName == NULL ) ||
+         ( getDataCallbackEx == NULL ) )
+    {
+        return result;
+    }
+
+    result = IOTHUB_CLIENT_ERROR;
+
+    pUpload = calloc( 1, sizeof( SimUpload ) );
+    if ( pUpload != NULL )
+    {
+        pUpload->pSimLink = pSimLink;
+        pUpload->blobName = strdup( destinationFileName );
+        pUpload->callback = getDataCallbackEx;
+        pUpload->context = context;
+
+        pthread_mutex_lock( &pSimLink->mutex );
+        if ( ( pUpload->blobName != NULL ) &&
+             ( pSimLink->stopping == false ) &&
+             ( pthread_attr_init( &attr ) == 0 ) )
+        {
+            pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+            if ( pthread_create( &thread, &attr, UploadThread, pUpload )
+                    == 0 )
+            {
+                pSimLink->uploads++;
+                pUpload = NULL;
+                result = IOTHUB_CLIENT_OK;
+            }
+
+            pthread_attr_destroy( &attr );
+        }
+        pthread_mutex_unlock( &pSimLink->mutex );
+
+        if ( pUpload != NULL )
+        {
+            free( pUpload->blobName );
+            free( pUpload );
+        }
+    }
+
+    return result;
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  ParseAddress                                                              */
+/*!
+    Split the stand-in address into its host and port
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink to store the host and port in
+
+    @param[in]
+        address
+            address in host:port form
+
+    @retval EOK the address was parsed
+    @retval ENAMETOOLONG the host name is too long
+
+==============================================================================*/
+static int ParseAddress( SimLink *pSimLink, const char *address )
+{
+    const char *p;
+    size_t len;
+
+    p = strrchr( address, ':' );
+    len = ( p != NULL ) ? (size_t)( p - address ) : strlen( address );
+    if ( len >= sizeof( pSimLink->host ) )
+    {
+        return ENAMETOOLONG;
+    }
+
+    memcpy( pSimLink->host, address, len );
+    pSimLink->host[len] = '\0';
+
+    if ( p != NULL )
+    {
+        snprintf( pSimLink->port, sizeof( pSimLink->port ), "%s", p + 1 );
+    }
+    else
+    {
+        snprintf( pSimLink->port,
+                  sizeof( pSimLink->port ),
+                  "%d",
+                  HUBSIM_DEFAULT_PORT );
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  Dial                                                                      */
+/*!
+    Open a connection to the stand-in
+
+    The Dial function resolves the stand-in address, opens a TCP
+    connection to it with the configured socket options and, for a TLS
+    link, performs the TLS handshake.  The time spent in each phase and
+    whether the kernel took over the TLS record processing are
+    recorded.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[out]
+        ppSSL
+            pointer to a location to store the TLS connection
+            (NULL for a plain TCP link)
+
+    @param[out]
+        pTimings
+            pointer to the timings to update
+
+    @retval connected socket descriptor
+    @retval -1 the connection failed
+
+==============================================================================*/
+static int Dial( SimLink *pSimLink, SSL **ppSSL, SimLinkTimings *pTimings )
+{
+    int fd = -1;
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    struct addrinfo *ai;
+    int rc;
+    uint64_t t0;
+    uint64_t t1;
+
+    *ppSSL = NULL;
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    t0 = GetMonotonicUs();
+    if ( getaddrinfo( pSimLink->host, pSimLink->port, &hints, &res ) == 0 )
+    {
+        t1 = GetMonotonicUs();
+        pTimings->resolveUs = t1 - t0;
+
+        for ( ai = res; ai != NULL; ai = ai->ai_next )
+        {
+            fd = socket( ai->ai_family,
+                         ai->ai_socktype | SOCK_CLOEXEC,
+                         ai->ai_protocol );
+            if ( fd != -1 )
+            {
+                /* the buffer sizes must be set before connecting to be
+                   reflected in the TCP window scale */
+                rc = SockTune_Apply( &pSimLink->sockTune, fd );
+                if ( ( rc != EOK ) &&
+                     ( IOTHUB_VERBOSE( pSimLink->verbose ) ) )
+                {
+                    fprintf( stderr,
+                             "SimLink: cannot set socket options: %s\n",
+                             strerror( rc ) );
+                }
+
+                if ( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 )
+                {
+                    break;
+                }
+
+                close( fd );
+                fd = -1;
+            }
+        }
+
+        freeaddrinfo( res );
+
+        t0 = GetMonotonicUs();
+        pTimings->connectUs = t0 - t1;
+    }
+
+    pTimings->handshakeUs = 0;
+    pTimings->resumed = false;
+    pTimings->ktlsTx = false;
+    pTimings->ktlsRx = false;
+
+    if ( ( fd != -1 ) &&
+         ( pSimLink->pTlsCache != NULL ) )
+    {
+        *ppSSL = TlsCache_Handshake( pSimLink->pTlsCache,
+                                     fd,
+                                     pSimLink->host,
+                                     &pTimings->resumed );
+        pTimings->handshakeUs = GetMonotonicUs() - t0;
+        TlsCache_GetKtls( *ppSSL, &pTimings->ktlsTx, &pTimings->ktlsRx );
+
+        if ( ( *ppSSL == NULL ) ||
+             ( fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK )
+                == -1 ) )
+        {
+            SSL_free( *ppSSL );
+            *ppSSL = NULL;
+            close( fd );
+            fd = -1;
+            errno = ECONNREFUSED;
+        }
+    }
+
+    return fd;
+}
+
+/*============================================================================*/
+/*  RxThread                                                                  */
+/*!
+    Acknowledgement receive thread
+
+    The RxThread function reads acknowledgements from the stand-in and
+    completes the pending messages in order.  When the connection is
+    lost it reconnects and retransmits the pending messages.  When the
+    link is destroyed all remaining pending messages are failed.
+
+    The reconnect backoff is only restarted once a connection has
+    proven healthy by acknowledging a message or staying up for the
+    maximum backoff delay.  A connection which is accepted and then
+    dropped straight away, as by a load balancer with no healthy
+    backend, keeps the backoff growing.
+
+    @param[in]
+        arg
+            pointer to the SimLink
+
+    @retval NULL
+
+==============================================================================*/
+static void *RxThread( void *arg )
+{
+    SimLink *pSimLink = (SimLink *)arg;
+    int fd;
+    SSL *ssl;
+    uint64_t start;
+    uint64_t acks;
+    bool healthy;
+
+    do
+    {
+        pthread_mutex_lock( &pSimLink->txMutex );
+        fd = pSimLink->fd;
+        ssl = pSimLink->ssl;
+        pthread_mutex_unlock( &pSimLink->txMutex );
+
+        start = GetMonotonicUs();
+        acks = ReceiveAcks( pSimLink, fd, ssl );
+
+        pthread_mutex_lock( &pSimLink->txMutex );
+        healthy = ( acks > 0 ) ||
+                  ( GetMonotonicUs() - start >=
+                      (uint64_t)pSimLink->backoff.maxMs * 1000 );
+        pSimLink->connected = false;
+        SSL_free( pSimLink->ssl );
+        pSimLink->ssl = NULL;
+        close( pSimLink->fd );
+        pSimLink->fd = -1;
+        pthread_mutex_unlock( &pSimLink->txMutex );
+
+        if ( pSimLink->stopping == false )
+        {
+            if ( IOTHUB_VERBOSE( pSimLink->verbose ) )
+            {
+                fprintf( stderr, "SimLink: connection lost\n" );
+            }
+
+            NotifyStatus( pSimLink,
+                          IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED,
+                          IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR );
+        }
+
+        if ( Reconnect( pSimLink, healthy ) == false )
+        {
+            break;
+        }
+
+        NotifyStatus( pSimLink,
+                      IOTHUB_CLIENT_CONNECTION_AUTHENTICATED,
+                      IOTHUB_CLIENT_CONNECTION_OK );
+
+    } while ( true );
+
+    FailPending( pSimLink );
+
+    return NULL;
+}
+
+/*============================================================================*/
+/*  ReceiveAcks                                                               */
+/*!
+    Receive acknowledgements until the connection is closed
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        fd
+            socket connected to the stand-in
+
+    @param[in]
+        ssl
+            TLS connection to the stand-in, or NULL
+
+    @retval number of acknowledgements received
+
+==============================================================================*/
+static uint64_t ReceiveAcks( SimLink *pSimLink, int fd, SSL *ssl )
+{
+    uint64_t count = 0;
+    HubSimAck ack;
+    SimPending *pPending;
+    IOTHUB_CLIENT_CONFIRMATION_RESULT result;
+
+    while ( ( ( ssl != NULL )
+                ? ReadTls( pSimLink, fd, ssl, &ack, sizeof( ack ) )
+                : ReadAll( fd, &ack, sizeof( ack ) ) ) == EOK )
+    {
+        if ( ack.magic != HUBSIM_MAGIC )
+        {
+            fprintf( stderr, "SimLink: invalid acknowledgement\n" );
+            break;
+        }
+
+        count++;
+
+        result = ( ack.status == HUBSIM_STATUS_OK )
+                 ? IOTHUB_CLIENT_CONFIRMATION_OK
+                 : IOTHUB_CLIENT_CONFIRMATION_ERROR;
+
+        /* acknowledgements arrive in send order */
+        pthread_mutex_lock( &pSimLink->mutex );
+        pPending = pSimLink->pHead;
+        if ( ( pPending != NULL ) &&
+             ( pPending->seq == ack.seq ) )
+        {
+            pSimLink->pHead = pPending->pNext;
+            if ( pSimLink->pHead == NULL )
+            {
+                pSimLink->pTail = NULL;
+            }
+        }
+        else
+        {
+            pPending = NULL;
+        }
+        pthread_mutex_unlock( &pSimLink->mutex );
+
+        if ( pPending != NULL )
+        {
+            if ( pPending->callback != NULL )
+            {
+                pPending->callback( result, pPending->userContextCallback );
+            }
+
+            free( pPending->frame );
+            free( pPending );
+        }
+        else if ( IOTHUB_VERBOSE( pSimLink->verbose ) )
+        {
+            fprintf( stderr,
+                     "SimLink: unexpected acknowledgement %lu\n",
+                     (unsigned long)ack.seq );
+        }
+    }
+
+    return count;
+}
+
+/*============================================================================*/
+/*  Reconnect                                                                 */
+/*!
+    Reconnect to the stand-in
+
+    The Reconnect function redials the stand-in using the link's backoff
+    policy until it succeeds or the link is destroyed.  The first attempt
+    after losing a healthy connection is made immediately, since most
+    connection losses are transient.
+    Once connected, the pending messages are retransmitted before any
+    new message can be written.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        healthy
+            true if the lost connection was healthy, which restarts
+            the backoff
+
+    @retval true the link was reconnected
+    @retval false the link is being destroyed
+
+==============================================================================*/
+static bool Reconnect( SimLink *pSimLink, bool healthy )
+{
+    uint64_t delay;
+    uint64_t start = GetMonotonicUs();
+    uint64_t t0;
+    struct timespec ts;
+    uint64_t deadline;
+    SimLinkTimings timings;
+    bool connected;
+    int fd;
+    SSL *ssl;
+    int count;
+
+    memset( &timings, 0, sizeof( timings ) );
+
+    pthread_mutex_lock( &pSimLink->txMutex );
+
+    if ( healthy == true )
+    {
+        Backoff_Reset( &pSimLink->backoff );
+        delay = 0;
+    }
+    else
+    {
+        delay = Backoff_Next( &pSimLink->backoff );
+    }
+
+    while ( pSimLink->stopping == false )
+    {
+        /* back off before redialling */
+        t0 = GetMonotonicUs();
+        clock_gettime( CLOCK_REALTIME, &ts );
+        deadline = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec +
+                   delay * 1000000;
+        ts.tv_sec = deadline / 1000000000;
+        ts.tv_nsec = deadline % 1000000000;
+
+        while ( pSimLink->stopping == false )
+        {
+            if ( pthread_cond_timedwait( &pSimLink->wake,
+                                         &pSimLink->txMutex,
+                                         &ts ) == ETIMEDOUT )
+            {
+                break;
+            }
+        }
+
+        timings.backoffUs += GetMonotonicUs() - t0;
+
+        if ( pSimLink->stopping == true )
+        {
+            break;
+        }
+
+        /* dial without blocking senders */
+        pthread_mutex_unlock( &pSimLink->txMutex );
+        fd = Dial( pSimLink, &ssl, &timings );
+        pthread_mutex_lock( &pSimLink->txMutex );
+
+        if ( fd != -1 )
+        {
+            pSimLink->fd = fd;
+            pSimLink->ssl = ssl;
+
+            t0 = GetMonotonicUs();
+            count = Retransmit( pSimLink );
+            timings.retransmitUs = GetMonotonicUs() - t0;
+
+            if ( count >= 0 )
+            {
+                pSimLink->connected = true;
+                pSimLink->timings = timings;
+
+                if ( IOTHUB_VERBOSE( pSimLink->verbose ) )
+                {
+                    fprintf( stderr,
+                             "SimLink: reconnected after %.1f ms "
+                             "(backoff %.1f, resolve %.1f, connect %.1f, "
+                             "tls %.1f, retransmit %.1f ms%s%s%s), "
+                             "%d messages retransmitted\n",
+                             ( GetMonotonicUs() - start ) / 1000.0,
+                             timings.backoffUs / 1000.0,
+                             timings.resolveUs / 1000.0,
+                             timings.connectUs / 1000.0,
+                             timings.handshakeUs / 1000.0,
+                             timings.retransmitUs / 1000.0,
+                             timings.resumed ? ", resumed" : "",
+                             timings.ktlsTx ? ", ktls tx" : "",
+                             timings.ktlsRx ? ", ktls rx" : "",
+                             count );
+                }
+
+                break;
+            }
+
+            SSL_free( ssl );
+            pSimLink->ssl = NULL;
+            close( fd );
+            pSimLink->fd = -1;
+        }
+
+        delay = Backoff_Next( &pSimLink->backoff );
+    }
+
+    connected = pSimLink->connected;
+
+    pthread_mutex_unlock( &pSimLink->txMutex );
+
+    return connected;
+}
+
+/*============================================================================*/
+/*  Retransmit                                                                */
+/*!
+    Retransmit the unacknowledged messages in order
+
+    The caller must hold the transmit mutex.  Messages are only removed
+    from the pending list by the receive thread which is performing the
+    retransmission, and only appended while holding the transmit mutex,
+    so the list can be walked safely.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @retval number of messages retransmitted
+    @retval -1 the connection failed during the retransmission
+
+==============================================================================*/
+static int Retransmit( SimLink *pSimLink )
+{
+    SimPending *pPending;
+    int count = 0;
+
+    pthread_mutex_lock( &pSimLink->mutex );
+    pPending = pSimLink->pHead;
+    pthread_mutex_unlock( &pSimLink->mutex );
+
+    while ( pPending != NULL )
+    {
+        if ( WriteFrame( pSimLink,
+                         pPending->frame,
+                         pPending->length ) != EOK )
+        {
+            return -1;
+        }
+
+        count++;
+        pPending = pPending->pNext;
+    }
+
+    return count;
+}
+
+/*============================================================================*/
+/*  FailPending                                                               */
+/*!
+    Fail all messages awaiting acknowledgement
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+==============================================================================*/
+static void FailPending( SimLink *pSimLink )
+{
+    SimPending *pPending;
+
+    pthread_mutex_lock( &pSimLink->mutex );
+    pPending = pSimLink->pHead;
+    pSimLink->pHead = NULL;
+    pSimLink->pTail = NULL;
+    pthread_mutex_unlock( &pSimLink->mutex );
+
+    while ( pPending != NULL )
+    {
+        SimPending *pNext = pPending->pNext;
+
+        if ( pPending->callback != NULL )
+        {
+            pPending->callback( IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY,
+                                pPending->userContextCallback );
+        }
+
+        free( pPending->frame );
+        free( pPending );
+        pPending = pNext;
+    }
+}
+
+/*============================================================================*/
+/*  NotifyStatus                                                              */
+/*!
+    Report a connection status change to the status callback
+
+    Notifications are serialized so the callback sees the status changes
+    in the order they happened.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        status
+            connection status
+
+    @param[in]
+        reason
+            reason for the status change
+
+==============================================================================*/
+static void NotifyStatus( SimLink *pSimLink,
+                          IOTHUB_CLIENT_CONNECTION_STATUS status,
+                          IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason )
+{
+    pthread_mutex_lock( &pSimLink->statusMutex );
+
+    if ( pSimLink->statusCallback != NULL )
+    {
+        pSimLink->statusCallback( status, reason, pSimLink->statusContext );
+    }
+
+    pthread_mutex_unlock( &pSimLink->statusMutex );
+}
+
+/*============================================================================*/
+/*  EncodeProperties                                                          */
+/*!
+    Encode the message properties into the link's frame buffer
+
+    The message identifier, correlation identifier, and all user
+    properties are encoded as "key:value\n" lines.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink containing the frame buffer
+
+    @param[in]
+        messageHandle
+            handle of the message to encode
+
+    @param[out]
+        len
+            pointer to a location to store the encoded length
+
+    @retval EOK the properties were encoded
+    @retval ENOMEM the frame buffer could not be grown
+
+==============================================================================*/
+static int EncodeProperties( SimLink *pSimLink,
+                             IOTHUB_MESSAGE_HANDLE messageHandle,
+                             size_t *len )
+{
+    int result;
+    size_t offset = 0;
+    MAP_HANDLE propMap;
+    const char*const* keys = NULL;
+    const char*const* values = NULL;
+    size_t propCount = 0;
+    size_t i;
+
+    result = AppendProperty( pSimLink,
+                             &offset,
+                             "messageId",
+                             IoTHubMessage_GetMessageId( messageHandle ) );
+
+    if ( result == EOK )
+    {
+        result = AppendProperty(
+                    pSimLink,
+                    &offset,
+                    "correlationId",
+                    IoTHubMessage_GetCorrelationId( messageHandle ) );
+    }
+
+    propMap = IoTHubMessage_Properties( messageHandle );
+    if ( ( result == EOK ) &&
+         ( propMap != NULL ) &&
+         ( Map_GetInternals( propMap,
+                             &keys,
+                             &values,
+                             &propCount ) == MAP_OK ) )
+    {
+        for ( i = 0; ( i < propCount ) && ( result == EOK ); i++ )
+        {
+            result = AppendProperty( pSimLink, &offset, keys[i], values[i] );
+        }
+    }
+
+    *len = offset;
+
+    return result;
+}
+
+/*============================================================================*/
+/*  AppendProperty                                                            */
+/*!
+    Append a "key:value\n" property to the frame buffer
+
+    NULL values are skipped.  The frame buffer is grown as required.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink containing the frame buffer
+
+    @param[in,out]
+        offset
+            pointer to the current length of the encoded properties
+
+    @param[in]
+        key
+            property name
+
+    @param[in]
+        value
+            property value
+
+    @retval EOK the property was appended (or skipped)
+    @retval ENOMEM the frame buffer could not be grown
+
+==============================================================================*/
+static int AppendProperty( SimLink *pSimLink,
+                           size_t *offset,
+                           const char *key,
+                           const char *value )
+{
+    int result = EOK;
+    size_t len;
+    size_t size;
+    char *p;
+
+    if ( ( key != NULL ) &&
+         ( value != NULL ) )
+    {
+        len = strlen( key ) + strlen( value ) + 2;
+
+        if ( *offset + len + 1 > pSimLink->bufSize )
+        {
+            size = 2 * ( pSimLink->bufSize + len );
+            p = realloc( pSimLink->buf, size );
+            if ( p != NULL )
+            {
+                pSimLink->buf = p;
+                pSimLink->bufSize = size;
+            }
+            else
+            {
+                result = ENOMEM;
+            }
+        }
+
+        if ( result == EOK )
+        {
+            snprintf( &pSimLink->buf[*offset],
+                      pSimLink->bufSize - *offset,
+                      "%s:%s\n",
+                      key,
+                      value );
+            *offset += len;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  WriteFrame                                                                */
+/*!
+    Write an encoded frame to the stand-in
+
+    The caller must hold the transmit mutex.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        buf
+            pointer to the encoded frame
+
+    @param[in]
+        len
+            length of the encoded frame
+
+    @retval EOK the frame was written
+    @retval other error as returned by write
+
+==============================================================================*/
+static int WriteFrame( SimLink *pSimLink, char *buf, size_t len )
+{
+    ssize_t n;
+    int result = EOK;
+
+    if ( pSimLink->ssl != NULL )
+    {
+        return WriteTls( pSimLink, buf, len );
+    }
+
+    while ( len > 0 )
+    {
+        n = write( pSimLink->fd, buf, len );
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+            result = errno;
+            break;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ReadAll                                                                   */
+/*!
+    Read exactly len bytes from a descriptor
+
+    @param[in]
+        fd
+            descriptor to read from
+
+    @param[out]
+        buf
+            pointer to the buffer to read into
+
+    @param[in]
+        len
+            number of bytes to read
+
+    @retval EOK the requested bytes were read
+    @retval EPIPE the connection was closed
+    @retval other error as returned by read
+
+==============================================================================*/
+static int ReadAll( int fd, void *buf, size_t len )
+{
+    char *p = buf;
+    ssize_t n;
+    int result = EOK;
+
+    while ( len > 0 )
+    {
+        n = read( fd, p, len );
+        if ( n > 0 )
+        {
+            p += n;
+            len -= n;
+        }
+        else if ( n == 0 )
+        {
+            result = EPIPE;
+            break;
+        }
+        else if ( errno != EINTR )
+        {
+            result = errno;
+            break;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  ReadTls                                                                   */
+/*!
+    Read exactly len bytes from a TLS connection
+
+    The SSL mutex is only held for each SSL_read call, so the sending
+    threads can write while the receive thread waits for data.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        fd
+            non-blocking socket underlying the TLS connection
+
+    @param[in]
+        ssl
+            TLS connection to read from
+
+    @param[out]
+        buf
+            pointer to the buffer to read into
+
+    @param[in]
+        len
+            number of bytes to read
+
+    @retval EOK the requested bytes were read
+    @retval EPIPE the connection was closed or failed
+
+==============================================================================*/
+static int ReadTls( SimLink *pSimLink,
+                    int fd,
+                    SSL *ssl,
+                    void *buf,
+                    size_t len )
+{
+    char *p = buf;
+    int n;
+    int err;
+
+    while ( len > 0 )
+    {
+        pthread_mutex_lock( &pSimLink->sslMutex );
+        n = SSL_read( ssl, p, len );
+        err = ( n > 0 ) ? SSL_ERROR_NONE : SSL_get_error( ssl, n );
+        pthread_mutex_unlock( &pSimLink->sslMutex );
+
+        if ( n > 0 )
+        {
+            p += n;
+            len -= n;
+        }
+        else if ( WaitTls( fd, err, -1 ) != EOK )
+        {
+            return EPIPE;
+        }
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  WriteTls                                                                  */
+/*!
+    Write a buffer to the TLS connection
+
+    The caller must hold the transmit mutex.  The SSL mutex is only
+    held for each SSL_write call, so the receive thread can keep
+    reading acknowledgements while a large frame is written.
+
+    @param[in]
+        pSimLink
+            pointer to the SimLink
+
+    @param[in]
+        buf
+            pointer to the data to write
+
+    @param[in]
+        len
+            number of bytes to write
+
+    @retval EOK the data was written
+    @retval EPIPE the connection was closed or failed
+
+==============================================================================*/
+static int WriteTls( SimLink *pSimLink, char *buf, size_t len )
+{
+    int n;
+    int err;
+
+    while ( len > 0 )
+    {
+        pthread_mutex_lock( &pSimLink->sslMutex );
+        n = SSL_write( pSimLink->ssl, buf, len );
+        err = ( n > 0 )
+              ? SSL_ERROR_NONE
+              : SSL_get_error( pSimLink->ssl, n );
+        pthread_mutex_unlock( &pSimLink->sslMutex );
+
+        if ( n > 0 )
+        {
+            buf += n;
+            len -= n;
+        }
+        else if ( WaitTls( pSimLink->fd,
+                           err,
+                           SIMLINK_TLS_POLL_MS ) != EOK )
+        {
+            return EPIPE;
+        }
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  WaitTls                                                                   */
+/*!
+    Wait until a TLS operation which would block can be retried
+
+    @param[in]
+        fd
+            non-blocking socket underlying the TLS connection
+
+    @param[in]
+        err
+            SSL error returned by the operation
+
+    @param[in]
+        timeout
+            maximum time to wait in milliseconds, or -1 to wait
+            indefinitely.  A write waiting for incoming data uses a
+            timeout because the receive thread may consume that data.
+
+    @retval EOK the operation can be retried
+    @retval EPIPE the connection was closed or failed
+
+==============================================================================*/
+static int WaitTls( int fd, int err, int timeout )
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.revents = 0;
+
+    if ( err == SSL_ERROR_WANT_READ )
+    {
+        pfd.events = POLLIN;
+    }
+    else if ( err == SSL_ERROR_WANT_WRITE )
+    {
+        pfd.events = POLLOUT;
+    }
+    else
+    {
+        return EPIPE;
+    }
+
+    if ( ( poll( &pfd, 1, timeout ) < 0 ) && ( errno != EINTR ) )
+    {
+        return EPIPE;
+    }
+
+    return ( pfd.revents & ( POLLERR | POLLNVAL ) ) ? EPIPE : EOK;
+}
+
+/*============================================================================*/
+/*  UploadThread                                                              */
+/*!
+    Blob upload thread
+
+    The UploadThread function connects to the stand-in and sends the
+    blocks supplied by the upload callback, waiting for each block to
+    be acknowledged before asking for the next.  An empty block is sent
+    as the commit frame which completes the blob.  The callback is then
+    given the result of the upload.
+
+    @param[in]
+        arg
+            pointer to the SimUpload, which is released
+
+    @retval NULL
+
+==============================================================================*/
+static void *UploadThread( void *arg )
+{
+    SimUpload *pUpload = (SimUpload *)arg;
+    SimLink *pSimLink = pUpload->pSimLink;
+    IOTHUB_CLIENT_FILE_UPLOAD_RESULT result = FILE_UPLOAD_ERROR;
+    SimLinkTimings timings;
+    HubSimFrame frame;
+    HubSimAck ack;
+    char props[SIMLINK_BUFFER_SIZE];
+    const unsigned char *data;
+    size_t size;
+    uint64_t seq;
+    bool stopping;
+    SSL *ssl;
+    int fd;
+    int n;
+
+    n = snprintf( props, sizeof( props ), "blob:%s\n", pUpload->blobName );
+
+    fd = Dial( pSimLink, &ssl, &timings );
+    if ( ( fd != -1 ) &&
+         ( n > 0 ) &&
+         ( (size_t)n < sizeof( props ) ) )
+    {
+        for ( seq = 0; ; seq++ )
+        {
+            pthread_mutex_lock( &pSimLink->txMutex );
+            stopping = pSimLink->stopping;
+            pthread_mutex_unlock( &pSimLink->txMutex );
+
+            data = NULL;
+            size = 0;
+            if ( ( stopping == true ) ||
+                 ( pUpload->callback( FILE_UPLOAD_OK,
+                                      &data,
+                                      &size,
+                                      pUpload->context ) !=
+                    IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_OK ) ||
+                 ( ( size > 0 ) && ( data == NULL ) ) ||
+                 ( size > UINT32_MAX ) )
+            {
+                break;
+            }
+
+            frame.magic = HUBSIM_MAGIC;
+            frame.type = ( size > 0 ) ? HUBSIM_FRAME_BLOCK
+                                      : HUBSIM_FRAME_COMMIT;
+            frame.seq = seq;
+            frame.headerLength = n;
+            frame.bodyLength = size;
+            frame.queued = GetTimeUs();
+
+            /* the block is written straight from the caller's buffer */
+            if ( ( UploadSend( fd,
+                               ssl,
+                               &frame,
+                               sizeof( frame ),
+                               MSG_MORE ) != EOK ) ||
+                 ( UploadSend( fd,
+                               ssl,
+                               props,
+                               n,
+                               ( size > 0 ) ? MSG_MORE : 0 ) != EOK ) ||
+                 ( UploadSend( fd, ssl, data, size, 0 ) != EOK ) ||
+                 ( UploadRecv( fd, ssl, &ack, sizeof( ack ) ) != EOK ) ||
+                 ( ack.magic != HUBSIM_MAGIC ) ||
+                 ( ack.seq != seq ) ||
+                 ( ack.status != HUBSIM_STATUS_OK ) )
+            {
+                break;
+            }
+
+            if ( size == 0 )
+            {
+                result = FILE_UPLOAD_OK;
+                break;
+            }
+        }
+    }
+
+    if ( fd != -1 )
+    {
+        SSL_free( ssl );
+        close( fd );
+    }
+
+    if ( ( result != FILE_UPLOAD_OK ) &&
+         ( IOTHUB_VERBOSE( pSimLink->verbose ) ) )
+    {
+        fprintf( stderr,
+                 "SimLink: upload of %s failed\n",
+                 pUpload->blobName );
+    }
+
+    pUpload->callback( result, NULL, NULL, pUpload->context );
+
+    free( pUpload->blobName );
+    free( pUpload );
+
+    pthread_mutex_lock( &pSimLink->mutex );
+    pSimLink->uploads--;
+    if ( pSimLink->uploads == 0 )
+    {
+        pthread_cond_broadcast( &pSimLink->uploadDone );
+    }
+    pthread_mutex_unlock( &pSimLink->mutex );
+
+    return NULL;
+}
+
+/*============================================================================*/
+/*  UploadSend                                                                */
+/*!
+    Write to a blob upload connection
+
+    @param[in]
+        fd
+            socket of the upload connection
+
+    @param[in]
+        ssl
+            TLS connection, or NULL for a plain TCP connection
+
+    @param[in]
+        buf
+            pointer to the data to write
+
+    @param[in]
+        len
+            number of bytes to write
+
+    @param[in]
+        flags
+            send flags for a plain TCP connection
+
+    @retval EOK the data was written
+    @retval EPIPE the connection was closed or failed
+
+==============================================================================*/
+static int UploadSend( int fd,
+                       SSL *ssl,
+                       const void *buf,
+                       size_t len,
+                       int flags )
+{
+    const char *p = buf;
+    ssize_t n;
+    int err;
+
+    while ( len > 0 )
+    {
+        if ( ssl != NULL )
+        {
+            n = SSL_write( ssl, p, len );
+            err = ( n > 0 ) ? SSL_ERROR_NONE : SSL_get_error( ssl, n );
+            if ( ( n <= 0 ) &&
+                 ( WaitTls( fd, err, -1 ) != EOK ) )
+            {
+                return EPIPE;
+            }
+        }
+        else
+        {
+            n = send( fd, p, len, flags | MSG_NOSIGNAL );
+            if ( ( n < 0 ) && ( errno != EINTR ) )
+            {
+                return EPIPE;
+            }
+        }
+
+        if ( n > 0 )
+        {
+            p += n;
+            len -= n;
+        }
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  UploadRecv                                                                */
+/*!
+    Read exactly len bytes from a blob upload connection
+
+    @param[in]
+        fd
+            socket of the upload connection
+
+    @param[in]
+        ssl
+            TLS connection, or NULL for a plain TCP connection
+
+    @param[out]
+        buf
+            pointer to the buffer to read into
+
+    @param[in]
+        len
+            number of bytes to read
+
+    @retval EOK the requested bytes were read
+    @retval EPIPE the connection was closed or failed
+    @retval other error as returned by read
+
+==============================================================================*/
+static int UploadRecv( int fd, SSL *ssl, void *buf, size_t len )
+{
+    char *p = buf;
+    int n;
+    int err;
+
+    if ( ssl == NULL )
+    {
+        return ReadAll( fd, buf, len );
+    }
+
+    while ( len > 0 )
+    {
+        n = SSL_read( ssl, p, len );
+        if ( n > 0 )
+        {
+            p += n;
+            len -= n;
+        }
+        else
+        {
+            err = SSL_get_error( ssl, n );
+            if ( WaitTls( fd, err, -1 ) != EOK )
+            {
+                return EPIPE;
+            }
+        }
+    }
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  GetTimeUs                                                                 */
+/*!
+    Get the wall clock time in microseconds
+
+    The wall clock is used for the frame queue time so the stand-in on
+    the same host can compare it with its own clock.
+
+==============================================================================*/
+static uint64_t GetTimeUs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*============================================================================*/
+/*  GetMonotonicUs                                                            */
+/*!
+    Get the monotonic clock time in microseconds
+
+    The monotonic clock is used to measure the connection phases.
+
+==============================================================================*/
+static uint64_t GetMonotonicUs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*! @}
+ * end of simlink group */
@@ -0,0 +1,398 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+/*!
+ * @defgroup socktune socktune
+ * @brief Socket tuning for the uplink connection
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file socktune.c
+
+    Socket tuning for the uplink connection
+
+    The socktune module holds the socket options applied to the uplink
+    connection and sets them on a socket before it connects, so the
+    buffer sizes are reflected in the negotiated TCP window scale.
+
+    Each setting is parsed from its own specification:
+
+    nodelay                       disable the Nagle algorithm (default)
+    delay                         enable the Nagle algorithm
+    sndbuf:KB                     socket send buffer size
+    rcvbuf:KB                     socket receive buffer size
+    timeout:ms                    TCP_USER_TIMEOUT: drop the connection
+                                  when data stays unacknowledged for ms
+    keepalive:idle[:intvl[:cnt]]  TCP keepalive, in seconds, seconds and
+                                  probes
+    ktls                          move TLS record processing into the
+                                  kernel after the handshake
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <varserver/varserver.h>
+#include "socktune.h"
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static int ParseValue( const char *p, uint32_t *pValue );
+static int SetOption( int fd, int level, int name, int value, int result );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  SockTune_Init                                                             */
+/*!
+    Initialize the socket options to their defaults
+
+    By default the Nagle algorithm is disabled and all other options
+    are left at the system defaults.
+
+    @param[in]
+        pSockTune
+            pointer to the socket options to initialize
+
+==============================================================================*/
+void SockTune_Init( SockTune *pSockTune )
+{
+    if ( pSockTune != NULL )
+    {
+        memset( pSockTune, 0, sizeof( SockTune ) );
+        pSockTune->noDelay = true;
+    }
+}
+
+/*============================================================================*/
+/*  SockTune_Parse                                                            */
+/*!
+    Update the socket options from a setting specification
+
+    @param[in]
+        pSockTune
+            pointer to the socket options to update
+
+    @param[in]
+        spec
+            setting specification, eg "sndbuf:256" or "keepalive:30:10:3"
+
+    @retval EOK the setting was parsed
+    @retval EINVAL invalid specification
+
+==============================================================================*/
+int SockTune_Parse( SockTune *pSockTune, const char *spec )
+{
+    uint32_t value;
+    unsigned long idle;
+    unsigned long interval = 0;
+    unsigned long count = 0;
+    char *p;
+
+    if ( ( pSockTune == NULL ) ||
+         ( spec == NULL ) )
+    {
+        return EINVAL;
+    }
+
+    if ( strcmp( spec, "nodelay" ) == 0 )
+    {
+        pSockTune->noDelay = true;
+        return EOK;
+    }
+
+    if ( strcmp( spec, "delay" ) == 0 )
+    {
+        pSockTune->noDelay = false;
+        return EOK;
+    }
+
+    if ( strcmp( spec, "ktls" ) == 0 )
+    {
+        pSockTune->ktls = true;
+        return EOK;
+    }
+
+    if ( strncmp( spec, "sndbuf:", 7 ) == 0 )
+    {
+        if ( ( ParseValue( &spec[7], &value ) != EOK ) ||
+             ( value == 0 ) ||
+             ( value > ( INT32_MAX >> 10 ) ) )
+        {
+            return EINVAL;
+        }
+
+        pSockTune->sndBuf = value << 10;
+        return EOK;
+    }
+
+    if ( strncmp( spec, "rcvbuf:", 7 ) == 0 )
+    {
+        if ( ( ParseValue( &spec[7], &value ) != EOK ) ||
+             ( value == 0 ) ||
+             ( value > ( INT32_MAX >> 10 ) ) )
+        {
+            return EINVAL;
+        }
+
+        pSockTune->rcvBuf = value << 10;
+        return EOK;
+    }
+
+    if ( strncmp( spec, "timeout:", 8 ) == 0 )
+    {
+        if ( ParseValue( &spec[8], &value ) != EOK )
+        {
+            return EINVAL;
+        }
+
+        pSockTune->userTimeoutMs = value;
+        return EOK;
+    }
+
+    if ( strncmp( spec, "keepalive:", 10 ) == 0 )
+    {
+        idle = strtoul( &spec[10], &p, 0 );
+        if ( *p == ':' )
+        {
+            interval = strtoul( p + 1, &p, 0 );
+            if ( *p == ':' )
+            {
+                count = strtoul( p + 1, &p, 0 );
+            }
+        }
+
+        if ( ( p == &spec[10] ) ||
+             ( *p != '\0' ) ||
+             ( idle == 0 ) ||
+             ( idle > INT32_MAX ) ||
+             ( interval > INT32_MAX ) ||
+             ( count > INT32_MAX ) )
+        {
+            return EINVAL;
+        }
+
+        pSockTune->keepIdle = (uint32_t)idle;
+        pSockTune->keepInterval = (uint32_t)interval;
+        pSockTune->keepCount = (uint32_t)count;
+        return EOK;
+    }
+
+    return EINVAL;
+}
+
+/*============================================================================*/
+/*  SockTune_Apply                                                            */
+/*!
+    Set the socket options on a TCP socket
+
+    The SockTune_Apply function should be called before the socket
+    connects.  Every option is attempted even if an earlier one fails.
+    The kernel TLS setting is not a socket option and is applied by
+    the TLS layer after the handshake.
+
+    @param[in]
+        pSockTune
+            pointer to the socket options, or NULL for the defaults
+
+    @param[in]
+        fd
+            TCP socket
+
+    @retval EOK all options were set
+    @retval other error from the first option which could not be set
+
+==============================================================================*/
+int SockTune_Apply( const SockTune *pSockTune, int fd )
+{
+    SockTune defaults;
+    int result = EOK;
+
+    if ( pSockTune == NULL )
+    {
+        SockTune_Init( &defaults );
+        pSockTune = &defaults;
+    }
+
+    if ( pSockTune->noDelay )
+    {
+        result = SetOption( fd, IPPROTO_TCP, TCP_NODELAY, 1, result );
+    }
+
+    if ( pSockTune->sndBuf != 0 )
+    {
+        result = SetOption( fd,
+                            SOL_SOCKET,
+                            SO_SNDBUF,
+                            (int)pSockTune->sndBuf,
+                            result );
+    }
+
+    if ( pSockTune->rcvBuf != 0 )
+    {
+        result = SetOption( fd,
+                            SOL_SOCKET,
+                            SO_RCVBUF,
+                            (int)pSockTune->rcvBuf,
+                            result );
+    }
+
+    if ( pSockTune->userTimeoutMs != 0 )
+    {
+        result = SetOption( fd,
+                            IPPROTO_TCP,
+                            TCP_USER_TIMEOUT,
+                            (int)pSockTune->userTimeoutMs,
+                            result );
+    }
+
+    if ( pSockTune->keepIdle != 0 )
+    {
+        result = SetOption( fd, SOL_SOCKET, SO_KEEPALIVE, 1, result );
+        result = SetOption( fd,
+                            IPPROTO_TCP,
+                            TCP_KEEPIDLE,
+                            (int)pSockTune->keepIdle,
+                            result );
+
+        if ( pSockTune->keepInterval != 0 )
+        {
+            result = SetOption( fd,
+                                IPPROTO_TCP,
+                                TCP_KEEPINTVL,
+                                (int)pSockTune->keepInterval,
+                                result );
+        }
+
+        if ( pSockTune->keepCount != 0 )
+        {
+            result = SetOption( fd,
+                                IPPROTO_TCP,
+                                TCP_KEEPCNT,
+                                (int)pSockTune->keepCount,
+                                result );
+        }
+    }
+
+    return result;
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  ParseValue                                                                */
+/*!
+    Parse an unsigned 32 bit setting value
+
+    @param[in]
+        p
+            pointer to the NUL terminated value
+
+    @param[out]
+        pValue
+            pointer to a location to store the value
+
+    @retval EOK the value was parsed
+    @retval EINVAL invalid value
+
+==============================================================================*/
+static int ParseValue( const char *p, uint32_t *pValue )
+{
+    unsigned long long value;
+    char *pEnd;
+
+    value = strtoull( p, &pEnd, 0 );
+    if ( ( pEnd == p ) ||
+         ( *pEnd != '\0' ) ||
+         ( value > UINT32_MAX ) )
+    {
+        return EINVAL;
+    }
+
+    *pValue = (uint32_t)value;
+
+    return EOK;
+}
+
+/*============================================================================*/
+/*  SetOption                                                                 */
+/*!
+    Set an integer socket option
+
+    @param[in]
+        fd
+            socket
+
+    @param[in]
+        level
+            protocol level of the option
+
+    @param[in]
+        name
+            option name
+
+    @param[in]
+        value
+            option value
+
+    @param[in]
+        result
+            result of the previous options
+
+    @retval result if the option was set, or it was already an error
+    @retval errno of the failure if this is the first option to fail
+
+==============================================================================*/
+static int SetOption( int fd, int level, int name, int value, int result )
+{
+    if ( ( setsockopt( fd, level, name, &value, sizeof( value ) ) != 0 ) &&
+         ( result == EOK ) )
+    {
+        result = errno;
+    }
+
+    return result;
+}
+
+/*! @}
+ * end of socktune group */
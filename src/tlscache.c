@@ -0,0 +1,626 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup tlscache tlscache
+ * @brief TLS client context cache for fast reconnects
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file tlscache.c
+
+    TLS client context cache
+
+    The tlscache module keeps the state which makes a TLS reconnect
+    cheaper than a cold connect:
+
+    - the trust store is read and parsed once, into a single client
+      SSL_CTX which is shared by every connection, instead of being
+      loaded again for each handshake.  The PEM text is also kept in
+      memory so it can be handed to the Azure IOT SDK client.
+
+    - the most recent session ticket issued by the server is kept and
+      offered on the next handshake so the server can resume the
+      session without sending and verifying its certificate chain.
+      If a session file is specified, the ticket is also written to
+      it, so the session can be resumed after the service restarts.
+
+    Kernel TLS offload may also be enabled on the cached context.  Once
+    the handshake completes, OpenSSL hands the negotiated keys to the
+    kernel TLS module and the record encryption moves into the kernel,
+    saving a copy of each record through user space.  If the kernel or
+    the negotiated cipher does not support it, the connection carries
+    on with user space TLS.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include "tlscache.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! maximum trust store file size */
+#define TLSCACHE_MAX_CA_SIZE ( 1024 * 1024 )
+
+/*! TLS client context cache */
+struct tlsCache
+{
+    /*! client context holding the parsed trust store */
+    SSL_CTX *ctx;
+
+    /*! PEM text of the trust store */
+    char *trustedCerts;
+
+    /*! name of the file to persist the session to, or NULL */
+    char *sessionFile;
+
+    /*! most recent resumable session, or NULL */
+    SSL_SESSION *session;
+
+    /*! mutex protecting the session */
+    pthread_mutex_t mutex;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static char *ReadFile( const char *name );
+static int NewSession( SSL *ssl, SSL_SESSION *session );
+static void LoadSession( TlsCache *pTlsCache );
+static void SaveSession( TlsCache *pTlsCache );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  TlsCache_Create                                                           */
+/*!
+    Create a TLS client context cache
+
+    The TlsCache_Create function reads and parses the trust store and
+    restores the persisted session, if any.
+
+    @param[in]
+        caFile
+            name of the PEM file containing the trusted CA certificates,
+            or NULL to use the system default trust store
+
+    @param[in]
+        sessionFile
+            name of the file used to persist the session across
+            restarts, or NULL to keep it in memory only
+
+    @retval pointer to the new TlsCache
+    @retval NULL if the trust store could not be loaded
+
+==============================================================================*/
+TlsCache *TlsCache_Create( const char *caFile, const char *sessionFile )
+{
+    TlsCache *pTlsCache;
+    X509_STORE *store;
+    STACK_OF(X509_INFO) *certs;
+    X509_INFO *info;
+    BIO *bio;
+    bool ok = false;
+    int i;
+
+    pTlsCache = calloc( 1, sizeof( TlsCache ) );
+    if ( pTlsCache != NULL )
+    {
+        pthread_mutex_init( &pTlsCache->mutex, NULL );
+
+        pTlsCache->ctx = SSL_CTX_new( TLS_client_method() );
+        if ( pTlsCache->ctx != NULL )
+        {
+            SSL_CTX_set_verify( pTlsCache->ctx, SSL_VERIFY_PEER, NULL );
+            SSL_CTX_set_mode( pTlsCache->ctx,
+                              SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+
+            /* sessions are kept by the cache, not by OpenSSL */
+            SSL_CTX_set_session_cache_mode(
+                    pTlsCache->ctx,
+                    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE );
+            SSL_CTX_sess_set_new_cb( pTlsCache->ctx, NewSession );
+            SSL_CTX_set_app_data( pTlsCache->ctx, pTlsCache );
+
+            if ( caFile != NULL )
+            {
+                /* parse the trust store once, from memory */
+                pTlsCache->trustedCerts = ReadFile( caFile );
+                store = SSL_CTX_get_cert_store( pTlsCache->ctx );
+                bio = ( pTlsCache->trustedCerts != NULL )
+                      ? BIO_new_mem_buf( pTlsCache->trustedCerts, -1 )
+                      : NULL;
+                certs = ( bio != NULL )
+                        ? PEM_X509_INFO_read_bio( bio, NULL, NULL, NULL )
+                        : NULL;
+
+                for ( i = 0; i < sk_X509_INFO_num( certs ); i++ )
+                {
+                    info = sk_X509_INFO_value( certs, i );
+                    if ( ( info->x509 != NULL ) &&
+                         ( X509_STORE_add_cert( store, info->x509 ) == 1 ) )
+                    {
+                        ok = true;
+                    }
+                }
+
+                sk_X509_INFO_pop_free( certs, X509_INFO_free );
+                BIO_free( bio );
+            }
+            else
+            {
+                ok = ( SSL_CTX_set_default_verify_paths( pTlsCache->ctx )
+                        == 1 );
+            }
+        }
+
+        if ( ( ok == true ) && ( sessionFile != NULL ) )
+        {
+            pTlsCache->sessionFile = strdup( sessionFile );
+            LoadSession( pTlsCache );
+        }
+
+        if ( ok == false )
+        {
+            fprintf( stderr,
+                     "TlsCache: cannot load trust store %s\n",
+                     ( caFile != NULL ) ? caFile : "(default)" );
+            TlsCache_Destroy( pTlsCache );
+            pTlsCache = NULL;
+        }
+    }
+
+    return pTlsCache;
+}
+
+/*============================================================================*/
+/*  TlsCache_Destroy                                                          */
+/*!
+    Destroy a TLS client context cache
+
+    @param[in]
+        pTlsCache
+            pointer to the TlsCache to destroy
+
+==============================================================================*/
+void TlsCache_Destroy( TlsCache *pTlsCache )
+{
+    if ( pTlsCache != NULL )
+    {
+        SSL_SESSION_free( pTlsCache->session );
+        SSL_CTX_free( pTlsCache->ctx );
+        pthread_mutex_destroy( &pTlsCache->mutex );
+        free( pTlsCache->trustedCerts );
+        free( pTlsCache->sessionFile );
+        free( pTlsCache );
+    }
+}
+
+/*============================================================================*/
+/*  TlsCache_GetTrustedCerts                                                  */
+/*!
+    Get the PEM text of the trust store
+
+    @param[in]
+        pTlsCache
+            pointer to the TlsCache
+
+    @retval pointer to the NUL terminated PEM text
+    @retval NULL the system default trust store is used
+
+==============================================================================*/
+const char *TlsCache_GetTrustedCerts( TlsCache *pTlsCache )
+{
+    return ( pTlsCache != NULL ) ? pTlsCache->trustedCerts : NULL;
+}
+
+/*============================================================================*/
+/*  TlsCache_SetKtls                                                          */
+/*!
+    Enable or disable kernel TLS offload for new connections
+
+    @param[in]
+        pTlsCache
+            pointer to the TlsCache
+
+    @param[in]
+        enable
+            true to offload the record processing of new connections
+            to the kernel where possible
+
+    @retval true the setting was applied
+    @retval false this OpenSSL build does not support kernel TLS
+
+==============================================================================*/
+bool TlsCache_SetKtls( TlsCache *pTlsCache, bool enable )
+{
+    bool result = false;
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if ( pTlsCache != NULL )
+    {
+        if ( enable )
+        {
+            SSL_CTX_set_options( pTlsCache->ctx, SSL_OP_ENABLE_KTLS );
+        }
+        else
+        {
+            SSL_CTX_clear_options( pTlsCache->ctx, SSL_OP_ENABLE_KTLS );
+        }
+
+        result = true;
+    }
+#else
+    (void)pTlsCache;
+    (void)enable;
+#endif
+
+    return result;
+}
+
+/*============================================================================*/
+/*  TlsCache_GetKtls                                                          */
+/*!
+    Get the kernel TLS offload state of a connection
+
+    @param[in]
+        ssl
+            established TLS connection
+
+    @param[out]
+        pTx
+            pointer to a location to store whether the kernel encrypts
+            the records sent on the connection
+
+    @param[out]
+        pRx
+            pointer to a location to store whether the kernel decrypts
+            the records received on the connection
+
+==============================================================================*/
+void TlsCache_GetKtls( SSL *ssl, bool *pTx, bool *pRx )
+{
+    bool tx = false;
+    bool rx = false;
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if ( ssl != NULL )
+    {
+        tx = ( BIO_get_ktls_send( SSL_get_wbio( ssl ) ) == 1 );
+        rx = ( BIO_get_ktls_recv( SSL_get_rbio( ssl ) ) == 1 );
+    }
+#else
+    (void)ssl;
+#endif
+
+    if ( pTx != NULL )
+    {
+        *pTx = tx;
+    }
+
+    if ( pRx != NULL )
+    {
+        *pRx = rx;
+    }
+}
+
+/*============================================================================*/
+/*  TlsCache_Handshake                                                        */
+/*!
+    Perform a TLS client handshake on a connected socket
+
+    The TlsCache_Handshake function performs a blocking TLS handshake
+    on the specified socket, verifying the server certificate against
+    the cached trust store and the specified host name.  The most
+    recent session is offered for resumption.
+
+    @param[in]
+        pTlsCache
+            pointer to the TlsCache
+
+    @param[in]
+        fd
+            connected socket
+
+    @param[in]
+        host
+            server host name or IP address
+
+    @param[out]
+        pResumed
+            pointer to a location to store whether the session was
+            resumed (may be NULL)
+
+    @retval pointer to the established SSL connection
+    @retval NULL the handshake failed
+
+==============================================================================*/
+SSL *TlsCache_Handshake( TlsCache *pTlsCache,
+                         int fd,
+                         const char *host,
+                         bool *pResumed )
+{
+    SSL *ssl = NULL;
+    SSL_SESSION *session = NULL;
+    X509_VERIFY_PARAM *param;
+    unsigned char addr[16];
+    bool isAddress;
+
+    if ( ( pTlsCache != NULL ) &&
+         ( host != NULL ) )
+    {
+        ssl = SSL_new( pTlsCache->ctx );
+    }
+
+    if ( ssl != NULL )
+    {
+        isAddress = ( inet_pton( AF_INET, host, addr ) == 1 ) ||
+                    ( inet_pton( AF_INET6, host, addr ) == 1 );
+
+        param = SSL_get0_param( ssl );
+        if ( isAddress )
+        {
+            X509_VERIFY_PARAM_set1_ip_asc( param, host );
+        }
+        else
+        {
+            SSL_set_tlsext_host_name( ssl, host );
+            X509_VERIFY_PARAM_set1_host( param, host, 0 );
+        }
+
+        /* offer a copy of the cached session, since OpenSSL marks the
+           session of a connection which fails as not resumable */
+        pthread_mutex_lock( &pTlsCache->mutex );
+        if ( ( pTlsCache->session != NULL ) &&
+             ( SSL_SESSION_is_resumable( pTlsCache->session ) == 1 ) )
+        {
+            session = SSL_SESSION_dup( pTlsCache->session );
+        }
+        pthread_mutex_unlock( &pTlsCache->mutex );
+
+        if ( session != NULL )
+        {
+            SSL_set_session( ssl, session );
+            SSL_SESSION_free( session );
+        }
+
+        if ( ( SSL_set_fd( ssl, fd ) != 1 ) ||
+             ( SSL_connect( ssl ) != 1 ) )
+        {
+            fprintf( stderr,
+                     "TlsCache: handshake with %s failed: %s\n",
+                     host,
+                     ERR_reason_error_string( ERR_get_error() ) );
+            ERR_clear_error();
+            SSL_free( ssl );
+            ssl = NULL;
+        }
+        else if ( pResumed != NULL )
+        {
+            *pResumed = ( SSL_session_reused( ssl ) == 1 );
+        }
+    }
+
+    return ssl;
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  ReadFile                                                                  */
+/*!
+    Read a whole file into a NUL terminated buffer
+
+    @param[in]
+        name
+            name of the file to read
+
+    @retval pointer to the allocated buffer
+    @retval NULL the file could not be read
+
+==============================================================================*/
+static char *ReadFile( const char *name )
+{
+    FILE *fp;
+    char *buf = NULL;
+    long size;
+
+    fp = fopen( name, "r" );
+    if ( fp != NULL )
+    {
+        if ( ( fseek( fp, 0, SEEK_END ) == 0 ) &&
+             ( ( size = ftell( fp ) ) > 0 ) &&
+             ( size <= TLSCACHE_MAX_CA_SIZE ) &&
+             ( fseek( fp, 0, SEEK_SET ) == 0 ) )
+        {
+            buf = malloc( size + 1 );
+            if ( ( buf != NULL ) &&
+                 ( fread( buf, 1, size, fp ) == (size_t)size ) )
+            {
+                buf[size] = '\0';
+            }
+            else
+            {
+                free( buf );
+                buf = NULL;
+            }
+        }
+
+        fclose( fp );
+    }
+
+    return buf;
+}
+
+/*============================================================================*/
+/*  NewSession                                                                */
+/*!
+    New session callback
+
+    The NewSession function is invoked by OpenSSL when the server issues
+    a session ticket.  With TLS 1.3 this happens after the handshake,
+    while reading from the connection.  A copy of the newest ticket
+    replaces the cached session, so the cached session is not affected
+    when the connection it was issued on fails.
+
+    @param[in]
+        ssl
+            connection the session was issued on
+
+    @param[in]
+        session
+            the new session
+
+    @retval 0 the session remains owned by OpenSSL
+
+==============================================================================*/
+static int NewSession( SSL *ssl, SSL_SESSION *session )
+{
+    TlsCache *pTlsCache;
+    SSL_SESSION *copy;
+
+    pTlsCache = SSL_CTX_get_app_data( SSL_get_SSL_CTX( ssl ) );
+    if ( ( pTlsCache != NULL ) &&
+         ( SSL_SESSION_is_resumable( session ) == 1 ) )
+    {
+        copy = SSL_SESSION_dup( session );
+        if ( copy != NULL )
+        {
+            pthread_mutex_lock( &pTlsCache->mutex );
+            SSL_SESSION_free( pTlsCache->session );
+            pTlsCache->session = copy;
+            SaveSession( pTlsCache );
+            pthread_mutex_unlock( &pTlsCache->mutex );
+        }
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  LoadSession                                                               */
+/*!
+    Restore the persisted session
+
+    @param[in]
+        pTlsCache
+            pointer to the TlsCache
+
+==============================================================================*/
+static void LoadSession( TlsCache *pTlsCache )
+{
+    FILE *fp;
+
+    fp = fopen( pTlsCache->sessionFile, "r" );
+    if ( fp != NULL )
+    {
+        pTlsCache->session = PEM_read_SSL_SESSION( fp, NULL, NULL, NULL );
+        fclose( fp );
+        ERR_clear_error();
+    }
+}
+
+/*============================================================================*/
+/*  SaveSession                                                               */
+/*!
+    Persist the cached session
+
+    The session is written to a temporary file which is renamed over
+    the session file, so a restart never sees a partial session.  The
+    session file holds the resumption secret and is only readable by
+    its owner.  The caller must hold the cache mutex.
+
+    @param[in]
+        pTlsCache
+            pointer to the TlsCache
+
+==============================================================================*/
+static void SaveSession( TlsCache *pTlsCache )
+{
+    char tmpName[BUFSIZ];
+    FILE *fp;
+    int fd;
+    bool ok = false;
+
+    if ( pTlsCache->sessionFile == NULL )
+    {
+        return;
+    }
+
+    snprintf( tmpName, sizeof( tmpName ), "%s.XXXXXX",
+              pTlsCache->sessionFile );
+
+    /* mkstemp creates the file with mode 0600 */
+    fd = mkstemp( tmpName );
+    if ( fd != -1 )
+    {
+        fp = fdopen( fd, "w" );
+        if ( fp != NULL )
+        {
+            ok = ( PEM_write_SSL_SESSION( fp, pTlsCache->session ) == 1 );
+            ok = ( fclose( fp ) == 0 ) && ok;
+        }
+        else
+        {
+            close( fd );
+        }
+
+        if ( ( ok == false ) ||
+             ( rename( tmpName, pTlsCache->sessionFile ) != 0 ) )
+        {
+            unlink( tmpName );
+        }
+    }
+}
+
+/*! @}
+ * end of tlscache group */
@@ -0,0 +1,497 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup trace trace
+ * @brief Ingest traffic capture and replay trace files
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file trace.c
+
+    Ingest trace files
+
+    The trace module writes and reads the compact binary trace files
+    used to capture the client messages received by the iothub service
+    and replay them with the iotload tool.
+
+    A trace file starts with a 16 byte file header:
+
+        "IOTT" | version (u16) | reserved (u16) | start time (u64)
+
+    where the start time is the wall clock time of the capture in
+    microseconds since the epoch.  It is followed by one record per
+    message:
+
+        timestamp delta | pid | priority | header length | body length |
+        header bytes | body bytes
+
+    where the first five fields are unsigned LEB128 varints and the
+    timestamp delta is the number of microseconds since the previous
+    record.  Typical records therefore carry about 8 bytes of overhead.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <varserver/varserver.h>
+#include "trace.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! trace file marker */
+#define TRACE_MAGIC "IOTT"
+
+/*! trace file format version */
+#define TRACE_VERSION ( 1 )
+
+/*! maximum encoded length of a 64-bit varint */
+#define VARINT_MAX ( 10 )
+
+/*! trace file header */
+typedef struct traceHeader
+{
+    /*! trace file marker: TRACE_MAGIC */
+    char magic[4];
+
+    /*! trace file format version */
+    uint16_t version;
+
+    /*! reserved for future use */
+    uint16_t reserved;
+
+    /*! capture start time in microseconds since the epoch */
+    uint64_t startTime;
+
+} TraceHeader;
+
+/*! ingest trace file */
+struct trace
+{
+    /*! trace file stream */
+    FILE *fp;
+
+    /*! true if the trace is open for writing */
+    bool writing;
+
+    /*! capture start time (monotonic, microseconds) when writing */
+    uint64_t start;
+
+    /*! timestamp of the previous record */
+    uint64_t last;
+
+    /*! record read buffer */
+    char *buf;
+
+    /*! size of the record read buffer */
+    size_t bufSize;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static int PutVarint( FILE *fp, uint64_t value );
+static int GetVarint( FILE *fp, uint64_t *value );
+static uint64_t GetTimeUs( clockid_t clock );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Trace_Create                                                              */
+/*!
+    Create a new trace file for writing
+
+    @param[in]
+        filename
+            name of the trace file to create
+
+    @retval pointer to the new Trace
+    @retval NULL the trace file could not be created
+
+==============================================================================*/
+Trace *Trace_Create( const char *filename )
+{
+    Trace *pTrace = NULL;
+    TraceHeader header;
+    FILE *fp;
+
+    if ( filename != NULL )
+    {
+        fp = fopen( filename, "we" );
+        if ( fp != NULL )
+        {
+            memset( &header, 0, sizeof( header ) );
+            memcpy( header.magic, TRACE_MAGIC, sizeof( header.magic ) );
+            header.version = TRACE_VERSION;
+            header.startTime = GetTimeUs( CLOCK_REALTIME );
+
+            pTrace = calloc( 1, sizeof( Trace ) );
+            if ( ( pTrace != NULL ) &&
+                 ( fwrite( &header, sizeof( header ), 1, fp ) == 1 ) )
+            {
+                pTrace->fp = fp;
+                pTrace->writing = true;
+                pTrace->start = GetTimeUs( CLOCK_MONOTONIC );
+            }
+            else
+            {
+                free( pTrace );
+                pTrace = NULL;
+                fclose( fp );
+            }
+        }
+    }
+
+    return pTrace;
+}
+
+/*============================================================================*/
+/*  Trace_Open                                                                */
+/*!
+    Open an existing trace file for reading
+
+    @param[in]
+        filename
+            name of the trace file to open
+
+    @retval pointer to the opened Trace
+    @retval NULL the file could not be opened or is not a trace file
+
+==============================================================================*/
+Trace *Trace_Open( const char *filename )
+{
+    Trace *pTrace = NULL;
+    TraceHeader header;
+    FILE *fp;
+
+    if ( filename != NULL )
+    {
+        fp = fopen( filename, "re" );
+        if ( fp != NULL )
+        {
+            if ( ( fread( &header, sizeof( header ), 1, fp ) == 1 ) &&
+                 ( memcmp( header.magic,
+                           TRACE_MAGIC,
+                           sizeof( header.magic ) ) == 0 ) &&
+                 ( header.version == TRACE_VERSION ) )
+            {
+                pTrace = calloc( 1, sizeof( Trace ) );
+            }
+
+            if ( pTrace != NULL )
+            {
+                pTrace->fp = fp;
+            }
+            else
+            {
+                fclose( fp );
+            }
+        }
+    }
+
+    return pTrace;
+}
+
+/*============================================================================*/
+/*  Trace_Write                                                               */
+/*!
+    Append a received message to the trace
+
+    The record is timestamped with the current time.  Records are
+    buffered and written to the file when the buffer fills or the
+    trace is closed.
+
+    @param[in]
+        pTrace
+            pointer to the Trace opened with Trace_Create
+
+    @param[in]
+        pRecord
+            pointer to the record to write.  The timestamp is ignored.
+
+    @retval EOK the record was written
+    @retval EINVAL invalid arguments
+    @retval EIO the record could not be written
+
+==============================================================================*/
+int Trace_Write( Trace *pTrace, TraceRecord *pRecord )
+{
+    int result = EINVAL;
+    uint64_t now;
+
+    if ( ( pTrace != NULL ) &&
+         ( pTrace->writing == true ) &&
+         ( pRecord != NULL ) )
+    {
+        now = GetTimeUs( CLOCK_MONOTONIC ) - pTrace->start;
+
+        if ( ( PutVarint( pTrace->fp, now - pTrace->last ) == EOK ) &&
+             ( PutVarint( pTrace->fp, pRecord->pid ) == EOK ) &&
+             ( PutVarint( pTrace->fp, pRecord->priority ) == EOK ) &&
+             ( PutVarint( pTrace->fp, pRecord->headerLength ) == EOK ) &&
+             ( PutVarint( pTrace->fp, pRecord->bodyLength ) == EOK ) &&
+             ( fwrite( pRecord->headers,
+                       1,
+                       pRecord->headerLength,
+                       pTrace->fp ) == pRecord->headerLength ) &&
+             ( fwrite( pRecord->body,
+                       1,
+                       pRecord->bodyLength,
+                       pTrace->fp ) == pRecord->bodyLength ) )
+        {
+            pTrace->last = now;
+            result = EOK;
+        }
+        else
+        {
+            result = EIO;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Trace_Read                                                                */
+/*!
+    Read the next record from the trace
+
+    The header and body pointers in the record refer to a buffer owned
+    by the Trace and remain valid until the next call to Trace_Read or
+    Trace_Close.
+
+    @param[in]
+        pTrace
+            pointer to the Trace opened with Trace_Open
+
+    @param[out]
+        pRecord
+            pointer to the record to populate
+
+    @retval EOK a record was read
+    @retval ENOENT end of trace
+    @retval EINVAL invalid arguments
+    @retval EBADMSG the trace is truncated or corrupt
+    @retval ENOMEM out of memory
+
+==============================================================================*/
+int Trace_Read( Trace *pTrace, TraceRecord *pRecord )
+{
+    int result = EINVAL;
+    uint64_t delta;
+    uint64_t pid;
+    uint64_t priority;
+    uint64_t headerLength;
+    uint64_t bodyLength;
+    size_t len;
+    char *p;
+
+    if ( ( pTrace != NULL ) &&
+         ( pTrace->writing == false ) &&
+         ( pRecord != NULL ) )
+    {
+        result = GetVarint( pTrace->fp, &delta );
+        if ( result == EOK )
+        {
+            if ( ( GetVarint( pTrace->fp, &pid ) != EOK ) ||
+                 ( GetVarint( pTrace->fp, &priority ) != EOK ) ||
+                 ( GetVarint( pTrace->fp, &headerLength ) != EOK ) ||
+                 ( GetVarint( pTrace->fp, &bodyLength ) != EOK ) ||
+                 ( headerLength + bodyLength < headerLength ) )
+            {
+                return EBADMSG;
+            }
+
+            len = headerLength + bodyLength;
+            if ( len > pTrace->bufSize )
+            {
+                p = realloc( pTrace->buf, len );
+                if ( p == NULL )
+                {
+                    return ENOMEM;
+                }
+
+                pTrace->buf = p;
+                pTrace->bufSize = len;
+            }
+
+            if ( fread( pTrace->buf, 1, len, pTrace->fp ) != len )
+            {
+                return EBADMSG;
+            }
+
+            pTrace->last += delta;
+
+            pRecord->timestamp = pTrace->last;
+            pRecord->pid = (uint32_t)pid;
+            pRecord->priority = (uint32_t)priority;
+            pRecord->headers = pTrace->buf;
+            pRecord->headerLength = headerLength;
+            pRecord->body = pTrace->buf + headerLength;
+            pRecord->bodyLength = bodyLength;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Trace_Close                                                               */
+/*!
+    Flush and close a trace
+
+    @param[in]
+        pTrace
+            pointer to the Trace to close
+
+==============================================================================*/
+void Trace_Close( Trace *pTrace )
+{
+    if ( pTrace != NULL )
+    {
+        fclose( pTrace->fp );
+        free( pTrace->buf );
+        free( pTrace );
+    }
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  PutVarint                                                                 */
+/*!
+    Write an unsigned LEB128 varint
+
+    @param[in]
+        fp
+            stream to write to
+
+    @param[in]
+        value
+            value to write
+
+    @retval EOK the value was written
+    @retval EIO write error
+
+==============================================================================*/
+static int PutVarint( FILE *fp, uint64_t value )
+{
+    unsigned char buf[VARINT_MAX];
+    size_t n = 0;
+
+    do
+    {
+        buf[n] = value & 0x7f;
+        value >>= 7;
+        if ( value != 0 )
+        {
+            buf[n] |= 0x80;
+        }
+        n++;
+    } while ( value != 0 );
+
+    return ( fwrite( buf, 1, n, fp ) == n ) ? EOK : EIO;
+}
+
+/*============================================================================*/
+/*  GetVarint                                                                 */
+/*!
+    Read an unsigned LEB128 varint
+
+    @param[in]
+        fp
+            stream to read from
+
+    @param[out]
+        value
+            pointer to a location to store the value
+
+    @retval EOK the value was read
+    @retval ENOENT end of file before the first byte
+    @retval EBADMSG truncated or overlong varint
+
+==============================================================================*/
+static int GetVarint( FILE *fp, uint64_t *value )
+{
+    int c;
+    int shift = 0;
+    uint64_t v = 0;
+
+    while ( ( c = getc_unlocked( fp ) ) != EOF )
+    {
+        if ( shift >= 64 )
+        {
+            return EBADMSG;
+        }
+
+        v |= (uint64_t)( c & 0x7f ) << shift;
+        shift += 7;
+
+        if ( ( c & 0x80 ) == 0 )
+        {
+            *value = v;
+            return EOK;
+        }
+    }
+
+    return ( shift == 0 ) ? ENOENT : EBADMSG;
+}
+
+/*============================================================================*/
+/*  GetTimeUs                                                                 */
+/*!
+    Get the time of the specified clock in microseconds
+
+==============================================================================*/
+static uint64_t GetTimeUs( clockid_t clock )
+{
+    struct timespec ts;
+
+    clock_gettime( clock, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*! @}
+ * end of trace group */
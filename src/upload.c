@@ -0,0 +1,531 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup upload upload
+ * @brief Streaming multi-block file upload
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file upload.c
+
+    File upload
+
+    The upload module supplies the blocks of a file to the SDK's
+    multi-block blob upload, IoTHubClient_UploadMultipleBlocksToBlobExAsync,
+    or to the hub stand-in's equivalent.  The file is mapped into memory
+    and each block is handed to the uploader as a pointer into the
+    mapping, so the file is never copied into the service's memory and
+    only the block being sent needs to be resident.  Pages of blocks
+    which have been sent are released as the upload moves on.
+
+    The client which requested the upload can name a message queue to
+    receive progress reports.  After each block is confirmed, and when
+    the upload completes or fails, a message is sent to the queue in
+    the same "key:value" header format as cloud-to-device messages:
+
+    upload:blob name
+    status:progress, done or failed
+    sent:bytes confirmed
+    size:file size
+    error:reason the upload failed (failed reports only)
+
+    The reports are sent without blocking, so a client which does not
+    read its queue only misses reports and cannot stall the upload.
+
+    The upload callbacks are invoked from the uploader's thread, not
+    the thread which created the upload.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <varserver/varserver.h>
+#include <azureiot/iothub_client.h>
+#include "upload.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! maximum length of a progress report */
+#define UPLOAD_REPORT_SIZE ( 512 )
+
+/*! file upload */
+struct upload
+{
+    /*! name of the destination blob */
+    char blobName[UPLOAD_MAX_BLOB_NAME];
+
+    /*! file mapping, or NULL for an empty file */
+    unsigned char *map;
+
+    /*! size of the file in bytes */
+    uint64_t size;
+
+    /*! size of the blocks the file is sent in */
+    size_t blockSize;
+
+    /*! offset of the next block to send */
+    uint64_t offset;
+
+    /*! number of bytes confirmed by the uploader */
+    uint64_t sent;
+
+    /*! queue to send the progress reports to, or -1 */
+    mqd_t replyQueue;
+
+    /*! function to call when the upload has finished */
+    UploadDoneFn done;
+
+    /*! argument for the done function */
+    void *arg;
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+static void Report( Upload *pUpload, const char *status, int result );
+static void Finish( Upload *pUpload, int result );
+
+/*==============================================================================
+        Public function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Upload_Create                                                             */
+/*!
+    Prepare a file for upload
+
+    The Upload_Create function opens and maps the file to upload.  The
+    file must belong to the owner, the user of the client requesting
+    the upload, unless the owner is root.  An anonymous memory file can
+    be uploaded through the /proc/pid/fd path of the client's
+    descriptor.
+
+    Once created, the upload is passed as the context of Upload_GetData
+    to the uploader, or released with Upload_Fail if the uploader could
+    not be started.  If the upload cannot be created the client is told
+    why, and the done function is called.
+
+    @param[out]
+        ppUpload
+            pointer to a location to store the new upload
+
+    @param[in]
+        path
+            path of the file to upload
+
+    @param[in]
+        blobName
+            name of the destination blob
+
+    @param[in]
+        replyTo
+            name of the message queue, without the leading '/', to send
+            the progress reports to, or NULL
+
+    @param[in]
+        owner
+            user id of the client requesting the upload
+
+    @param[in]
+        blockSize
+            size of the blocks to upload the file in
+
+    @param[in]
+        done
+            function to call when the upload has finished, or NULL
+
+    @param[in]
+        arg
+            argument for the done function
+
+    @retval EOK the upload was created
+    @retval EINVAL invalid arguments
+    @retval ENAMETOOLONG the blob name is too long
+    @retval EACCES the file does not belong to the owner
+    @retval ENOMEM out of memory
+    @retval other error as returned from open, fstat or mmap
+
+==============================================================================*/
+int Upload_Create( Upload **ppUpload,
+                   const char *path,
+                   const char *blobName,
+                   const char *replyTo,
+                   uid_t owner,
+                   size_t blockSize,
+                   UploadDoneFn done,
+                   void *arg )
+{
+    int result = EINVAL;
+    Upload *pUpload;
+    struct stat st;
+    char queueName[UPLOAD_MAX_BLOB_NAME + 1];
+    int fd;
+
+    if ( ( ppUpload == NULL ) ||
+         ( path == NULL ) ||
+         ( blobName == NULL ) ||
+         ( blockSize == 0 ) )
+    {
+        return EINVAL;
+    }
+
+    if ( strlen( blobName ) >= UPLOAD_MAX_BLOB_NAME )
+    {
+        return ENAMETOOLONG;
+    }
+
+    pUpload = calloc( 1, sizeof( Upload ) );
+    if ( pUpload == NULL )
+    {
+        return ENOMEM;
+    }
+
+    strcpy( pUpload->blobName, blobName );
+    pUpload->blockSize = blockSize;
+    pUpload->done = done;
+    pUpload->arg = arg;
+    pUpload->replyQueue = (mqd_t)-1;
+
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 )
+    {
+        result = errno;
+    }
+    else if ( fstat( fd, &st ) == -1 )
+    {
+        result = errno;
+    }
+    else if ( !S_ISREG( st.st_mode ) )
+    {
+        result = EINVAL;
+    }
+    else if ( ( owner != 0 ) && ( st.st_uid != owner ) )
+    {
+        result = EACCES;
+    }
+    else
+    {
+        pUpload->size = st.st_size;
+        result = EOK;
+
+        if ( pUpload->size > 0 )
+        {
+            pUpload->map = mmap( NULL,
+                                 pUpload->size,
+                                 PROT_READ,
+                                 MAP_SHARED,
+                                 fd,
+                                 0 );
+            if ( pUpload->map == MAP_FAILED )
+            {
+                pUpload->map = NULL;
+                result = errno;
+            }
+            else
+            {
+                /* the file is read once, front to back */
+                madvise( pUpload->map, pUpload->size, MADV_SEQUENTIAL );
+            }
+        }
+    }
+
+    if ( fd != -1 )
+    {
+        /* the mapping keeps the file open */
+        close( fd );
+    }
+
+    if ( replyTo != NULL )
+    {
+        snprintf( queueName, sizeof( queueName ), "/%s", replyTo );
+        pUpload->replyQueue = mq_open( queueName, O_WRONLY | O_NONBLOCK );
+    }
+
+    if ( result == EOK )
+    {
+        *ppUpload = pUpload;
+    }
+    else
+    {
+        /* tell the client why its upload was refused */
+        Finish( pUpload, result );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Upload_Fail                                                               */
+/*!
+    Release an upload which could not be started
+
+    The Upload_Fail function reports the failure to the client, calls
+    the done function and releases the upload.
+
+    @param[in]
+        pUpload
+            pointer to the upload
+
+    @param[in]
+        result
+            reason the upload could not be started
+
+==============================================================================*/
+void Upload_Fail( Upload *pUpload, int result )
+{
+    if ( pUpload != NULL )
+    {
+        Finish( pUpload, ( result != EOK ) ? result : EIO );
+    }
+}
+
+/*============================================================================*/
+/*  Upload_BlobName                                                           */
+/*!
+    Get the name of the destination blob
+
+    @param[in]
+        pUpload
+            pointer to the upload
+
+    @retval name of the destination blob
+    @retval NULL invalid arguments
+
+==============================================================================*/
+const char *Upload_BlobName( Upload *pUpload )
+{
+    return ( pUpload != NULL ) ? pUpload->blobName : NULL;
+}
+
+/*============================================================================*/
+/*  Upload_Size                                                               */
+/*!
+    Get the size of the file being uploaded
+
+    @param[in]
+        pUpload
+            pointer to the upload
+
+    @retval size of the file in bytes
+
+==============================================================================*/
+uint64_t Upload_Size( Upload *pUpload )
+{
+    return ( pUpload != NULL ) ? pUpload->size : 0;
+}
+
+/*============================================================================*/
+/*  Upload_GetData                                                            */
+/*!
+    Supply the next block of the file to the uploader
+
+    The Upload_GetData function is the IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA
+    _CALLBACK_EX of the upload.  The uploader calls it with data and
+    size pointers for each block, and the previous block has been sent
+    when it does.  A block size of zero marks the end of the file.
+
+    When the upload has finished the uploader calls it once more with
+    NULL data and size pointers and the result of the upload.  The
+    client is told the result, the done function is called and the
+    upload is released.
+
+    @param[in]
+        result
+            FILE_UPLOAD_OK, or FILE_UPLOAD_ERROR if the upload failed
+
+    @param[out]
+        data
+            pointer to a location to store the pointer to the block
+
+    @param[out]
+        size
+            pointer to a location to store the size of the block
+
+    @param[in]
+        context
+            pointer to the upload
+
+    @retval IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_OK continue the upload
+    @retval IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_ABORT abort the upload
+
+==============================================================================*/
+IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_RESULT Upload_GetData(
+                        IOTHUB_CLIENT_FILE_UPLOAD_RESULT result,
+                        unsigned char const **data,
+                        size_t *size,
+                        void *context )
+{
+    Upload *pUpload = (Upload *)context;
+    uint64_t left;
+    size_t len;
+
+    if ( pUpload == NULL )
+    {
+        return IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_ABORT;
+    }
+
+    if ( ( data == NULL ) || ( size == NULL ) )
+    {
+        /* the upload has finished */
+        if ( result == FILE_UPLOAD_OK )
+        {
+            pUpload->sent = pUpload->offset;
+        }
+
+        Finish( pUpload, ( result == FILE_UPLOAD_OK ) ? EOK : EIO );
+        return IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_OK;
+    }
+
+    if ( result != FILE_UPLOAD_OK )
+    {
+        return IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_ABORT;
+    }
+
+    if ( pUpload->offset > pUpload->sent )
+    {
+        /* the previous block has been sent, so its pages can go */
+        madvise( &pUpload->map[pUpload->sent],
+                 pUpload->offset - pUpload->sent,
+                 MADV_DONTNEED );
+        pUpload->sent = pUpload->offset;
+        Report( pUpload, "progress", EOK );
+    }
+
+    left = pUpload->size - pUpload->offset;
+    len = ( left < pUpload->blockSize ) ? (size_t)left : pUpload->blockSize;
+
+    *data = ( len > 0 ) ? &pUpload->map[pUpload->offset] : NULL;
+    *size = len;
+    pUpload->offset += len;
+
+    return IOTHUB_CLIENT_FILE_UPLOAD_GET_DATA_OK;
+}
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  Report                                                                    */
+/*!
+    Send a progress report to the client
+
+    The report is dropped if the client's queue is full.
+
+    @param[in]
+        pUpload
+            pointer to the upload
+
+    @param[in]
+        status
+            upload status: progress, done or failed
+
+    @param[in]
+        result
+            reason the upload failed, or EOK
+
+==============================================================================*/
+static void Report( Upload *pUpload, const char *status, int result )
+{
+    char report[UPLOAD_REPORT_SIZE];
+    int n;
+
+    if ( pUpload->replyQueue != (mqd_t)-1 )
+    {
+        n = snprintf( report,
+                      sizeof( report ),
+                      "upload:%s\nstatus:%s\nsent:%lu\nsize:%lu\n%s%s%s\n",
+                      pUpload->blobName,
+                      status,
+                      (unsigned long)pUpload->sent,
+                      (unsigned long)pUpload->size,
+                      ( result != EOK ) ? "error:" : "",
+                      ( result != EOK ) ? strerror( result ) : "",
+                      ( result != EOK ) ? "\n" : "" );
+        if ( ( n > 0 ) && ( (size_t)n < sizeof( report ) ) )
+        {
+            /* include the NUL terminator like a cloud-to-device message */
+            mq_send( pUpload->replyQueue, report, n + 1, 0 );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Finish                                                                    */
+/*!
+    Report the result of an upload and release it
+
+    @param[in]
+        pUpload
+            pointer to the upload
+
+    @param[in]
+        result
+            EOK if the upload completed, otherwise the reason it failed
+
+==============================================================================*/
+static void Finish( Upload *pUpload, int result )
+{
+    Report( pUpload, ( result == EOK ) ? "done" : "failed", result );
+
+    if ( pUpload->done != NULL )
+    {
+        pUpload->done( pUpload->arg, result, pUpload->sent );
+    }
+
+    if ( pUpload->replyQueue != (mqd_t)-1 )
+    {
+        mq_close( pUpload->replyQueue );
+    }
+
+    if ( pUpload->map != NULL )
+    {
+        munmap( pUpload->map, pUpload->size );
+    }
+
+    free( pUpload );
+}
+
+/*! @}
+ * end of upload group */
@@ -0,0 +1,1848 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup hubsim hubsim
+ * @brief Local IOT Hub stand-in for offline testing and benchmarking
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file hubsim.c
+
+    Local IOT Hub stand-in
+
+    The hubsim application accepts connections from the iothub service
+    (started with the -s option) on the local host and acknowledges each
+    device-to-cloud message frame.  It can delay acknowledgements to
+    model the cloud round trip time and reject a percentage of messages
+    to model delivery failures.
+
+    Messages are deduplicated by their message identifier so that
+    retransmissions after a reconnect are counted as duplicates rather
+    than deliveries.  The queue time carried in each frame is used to
+    build a timeline of the iothub service backlog (messages queued but
+    not yet delivered) and of the delivery delay.
+
+    It is also the blob store stand-in for file uploads.  The blocks of
+    each blob arrive on a connection of their own and are acknowledged
+    as they are received.  With the -u option the blobs are written to
+    a directory, where a blob appears under its name once its commit
+    frame has been received.
+
+    If a certificate and key are specified the stand-in accepts TLS
+    connections and issues session tickets, so the fast reconnect of
+    the iothub service can be measured.  The number of full and resumed
+    handshakes is reported.
+
+    On termination, or on SIGUSR1, it reports the number of messages
+    and bytes received, optionally as JSON to a statistics file for the
+    benchmark runners.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "hubsim.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! maximum number of simultaneous connections */
+#define MAX_CLIENTS ( 64 )
+
+/*! size of the payload discard buffer */
+#define RX_BUFFER_SIZE ( 64 * 1024 )
+
+/*! timeline slot length in milliseconds */
+#define TIMELINE_INTERVAL_MS ( 100 )
+
+/*! initial number of message identifier hash slots */
+#define ID_SET_SIZE ( 4096 )
+
+/*! acknowledgement waiting for its delivery time */
+typedef struct delayedAck
+{
+    /*! time at which the acknowledgement is due */
+    uint64_t due;
+
+    /*! acknowledgement to send */
+    HubSimAck ack;
+
+    /*! pointer to the next delayed acknowledgement */
+    struct delayedAck *pNext;
+
+} DelayedAck;
+
+/*! connection from the iothub service */
+typedef struct simClient
+{
+    /*! client socket, or -1 if unused */
+    int fd;
+
+    /*! TLS connection, or NULL for a plain TCP connection */
+    SSL *ssl;
+
+    /*! frame header being received */
+    HubSimFrame frame;
+
+    /*! number of frame header bytes received */
+    size_t frameBytes;
+
+    /*! number of payload bytes remaining for the current frame */
+    uint64_t payloadLeft;
+
+    /*! message properties of the current frame */
+    char *props;
+
+    /*! number of message property bytes received */
+    size_t propsLen;
+
+    /*! size of the message property buffer */
+    size_t propsSize;
+
+    /*! acknowledgements waiting to be written */
+    unsigned char *tx;
+
+    /*! number of bytes in the acknowledgement buffer */
+    size_t txLen;
+
+    /*! size of the acknowledgement buffer */
+    size_t txSize;
+
+    /*! blob being uploaded on the connection, or -1 */
+    int blobFd;
+
+    /*! name of the blob being uploaded */
+    char blobName[256];
+
+    /*! oldest delayed acknowledgement */
+    DelayedAck *pHead;
+
+    /*! newest delayed acknowledgement */
+    DelayedAck *pTail;
+
+} SimClient;
+
+/*! hub stand-in state */
+typedef struct hubSimState
+{
+    /*! TCP listen port */
+    int port;
+
+    /*! acknowledgement latency in milliseconds */
+    unsigned int latencyMs;
+
+    /*! percentage of messages to reject */
+    unsigned int errorPercent;
+
+    /*! verbose flag */
+    bool verbose;
+
+    /*! name of the JSON statistics file */
+    const char *statsFile;
+
+    /*! directory to store uploaded blobs in, or NULL to discard them */
+    const char *blobDir;
+
+    /*! name of the TLS certificate chain file */
+    const char *certFile;
+
+    /*! name of the TLS private key file */
+    const char *keyFile;
+
+    /*! TLS server context, or NULL to accept plain TCP connections */
+    SSL_CTX *tlsCtx;
+
+    /*! number of completed TLS handshakes */
+    uint64_t handshakes;
+
+    /*! number of TLS handshakes which resumed a session */
+    uint64_t resumed;
+
+    /*! listening socket */
+    int listenFd;
+
+    /*! connections from the iothub service */
+    SimClient clients[MAX_CLIENTS];
+
+    /*! time the stand-in was started */
+    uint64_t startTime;
+
+    /*! number of messages received */
+    uint64_t messages;
+
+    /*! number of message bytes received (headers and body) */
+    uint64_t bytes;
+
+    /*! number of messages rejected */
+    uint64_t rejected;
+
+    /*! number of connections accepted */
+    uint64_t connections;
+
+    /*! number of distinct messages received */
+    uint64_t unique;
+
+    /*! number of retransmitted messages received again */
+    uint64_t duplicates;
+
+    /*! number of blobs committed */
+    uint64_t blobs;
+
+    /*! number of blob blocks received */
+    uint64_t blocks;
+
+    /*! number of blob bytes received */
+    uint64_t blobBytes;
+
+    /*! hashes of the message identifiers received */
+    uint64_t *ids;
+
+    /*! number of message identifier hash slots */
+    size_t idSlots;
+
+    /*! wall clock start time in microseconds */
+    uint64_t startRealTime;
+
+    /*! number of distinct messages by queue time slot */
+    uint64_t *queuedCount;
+
+    /*! number of distinct messages by delivery time slot */
+    uint64_t *deliveredCount;
+
+    /*! largest delivery delay in milliseconds by delivery time slot */
+    uint64_t *maxDelay;
+
+    /*! number of timeline slots */
+    size_t slots;
+
+} HubSimState;
+
+/*==============================================================================
+        Private file scoped variables
+==============================================================================*/
+
+/*! hub stand-in state */
+static HubSimState state;
+
+/*! set by the termination handler to stop the stand-in */
+static volatile sig_atomic_t done = 0;
+
+/*! set by SIGUSR1 to request a statistics report */
+static volatile sig_atomic_t report = 0;
+
+/*! payload discard buffer */
+static unsigned char rxBuffer[RX_BUFFER_SIZE];
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+int main( int argc, char **argv );
+static int ProcessOptions( int argC, char *argV[], HubSimState *pState );
+static void usage( char *cmdname );
+static void SetupTerminationHandler( void );
+static void TerminationHandler( int signum );
+static void ReportHandler( int signum );
+static int Listen( HubSimState *pState );
+static int SetupTls( HubSimState *pState );
+static ssize_t ClientRead( HubSimState *pState,
+                           SimClient *pClient,
+                           void *buf,
+                           size_t len );
+static void Run( HubSimState *pState );
+static void Accept( HubSimState *pState );
+static int Receive( HubSimState *pState, SimClient *pClient );
+static int Acknowledge( HubSimState *pState,
+                        SimClient *pClient,
+                        uint64_t seq );
+static int QueueAck( SimClient *pClient, HubSimAck *pAck );
+static int FlushAcks( SimClient *pClient );
+static int ReleaseAcks( SimClient *pClient, uint64_t now );
+static int NextDue( HubSimState *pState, uint64_t now );
+static void CloseClient( SimClient *pClient );
+static void Deliver( HubSimState *pState, SimClient *pClient );
+static void OpenBlob( HubSimState *pState, SimClient *pClient );
+static void CommitBlob( HubSimState *pState, SimClient *pClient );
+static bool AddId( HubSimState *pState, uint64_t hash );
+static int Timeline( HubSimState *pState, size_t slot );
+static void WriteStats( HubSimState *pState );
+static void WriteTimeline( HubSimState *pState, FILE *fp );
+static uint64_t GetTimeMs( void );
+static uint64_t GetRealTimeUs( void );
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  main                                                                      */
+/*!
+    Main entry point for the hubsim application
+
+    @param[in]
+        argc
+            number of arguments on the command line
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @retval 0 the stand-in terminated normally
+    @retval 1 the stand-in could not be started
+
+==============================================================================*/
+int main( int argc, char **argv )
+{
+    int result = 1;
+    int i;
+
+    state.port = HUBSIM_DEFAULT_PORT;
+    state.listenFd = -1;
+    for ( i = 0; i < MAX_CLIENTS; i++ )
+    {
+        state.clients[i].fd = -1;
+    }
+
+    ProcessOptions( argc, argv, &state );
+
+    SetupTerminationHandler();
+    signal( SIGPIPE, SIG_IGN );
+    srand( time( NULL ) );
+
+    if ( ( SetupTls( &state ) == 0 ) &&
+         ( Listen( &state ) == 0 ) )
+    {
+        state.startTime = GetTimeMs();
+        state.startRealTime = GetRealTimeUs();
+
+        Run( &state );
+
+        WriteStats( &state );
+        result = 0;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Listen                                                                    */
+/*!
+    Create the listening socket on the loopback interface
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @retval 0 the listening socket was created
+    @retval -1 the listening socket could not be created
+
+==============================================================================*/
+static int Listen( HubSimState *pState )
+{
+    int result = -1;
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    fd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd != -1 )
+    {
+        setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons( pState->port );
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+        if ( ( bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) == 0 ) &&
+             ( listen( fd, 16 ) == 0 ) )
+        {
+            pState->listenFd = fd;
+            result = 0;
+        }
+        else
+        {
+            fprintf( stderr,
+                     "hubsim: cannot listen on port %d: %s\n",
+                     pState->port,
+                     strerror( errno ) );
+            close( fd );
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  SetupTls                                                                  */
+/*!
+    Create the TLS server context
+
+    The TLS server context is only created if a certificate was
+    specified.  OpenSSL issues stateless session tickets by default,
+    so clients can resume their sessions until the stand-in restarts.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @retval 0 the context was created, or TLS is not used
+    @retval -1 the certificate or key could not be loaded
+
+==============================================================================*/
+static int SetupTls( HubSimState *pState )
+{
+    if ( pState->certFile == NULL )
+    {
+        return 0;
+    }
+
+    pState->tlsCtx = SSL_CTX_new( TLS_server_method() );
+    if ( ( pState->tlsCtx == NULL ) ||
+         ( SSL_CTX_use_certificate_chain_file( pState->tlsCtx,
+                                               pState->certFile ) != 1 ) ||
+         ( SSL_CTX_use_PrivateKey_file(
+                pState->tlsCtx,
+                ( pState->keyFile != NULL ) ? pState->keyFile
+                                            : pState->certFile,
+                SSL_FILETYPE_PEM ) != 1 ) )
+    {
+        fprintf( stderr,
+                 "hubsim: cannot load certificate %s: %s\n",
+                 pState->certFile,
+                 ERR_reason_error_string( ERR_get_error() ) );
+        return -1;
+    }
+
+    SSL_CTX_set_mode( pState->tlsCtx,
+                      SSL_MODE_ENABLE_PARTIAL_WRITE |
+                      SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  Run                                                                       */
+/*!
+    Run the stand-in event loop
+
+    The Run function services the listening socket and the client
+    connections until the stand-in is terminated.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+==============================================================================*/
+static void Run( HubSimState *pState )
+{
+    struct pollfd fds[MAX_CLIENTS + 1];
+    SimClient *map[MAX_CLIENTS + 1];
+    nfds_t nfds;
+    int i;
+    int n;
+    int rc;
+
+    while ( !done )
+    {
+        if ( report )
+        {
+            report = 0;
+            WriteStats( pState );
+        }
+
+        nfds = 0;
+        fds[nfds].fd = pState->listenFd;
+        fds[nfds].events = POLLIN;
+        map[nfds++] = NULL;
+
+        for ( i = 0; i < MAX_CLIENTS; i++ )
+        {
+            if ( pState->clients[i].fd != -1 )
+            {
+                fds[nfds].fd = pState->clients[i].fd;
+                fds[nfds].events = POLLIN;
+                if ( ( pState->clients[i].txLen > 0 ) ||
+                     ( ( pState->clients[i].ssl != NULL ) &&
+                       ( SSL_want_write( pState->clients[i].ssl ) ) ) )
+                {
+                    fds[nfds].events |= POLLOUT;
+                }
+
+                map[nfds++] = &pState->clients[i];
+            }
+        }
+
+        n = poll( fds, nfds, NextDue( pState, GetTimeMs() ) );
+        if ( ( n < 0 ) && ( errno != EINTR ) )
+        {
+            fprintf( stderr, "hubsim: poll: %s\n", strerror( errno ) );
+            break;
+        }
+
+        if ( ( n > 0 ) && ( fds[0].revents & POLLIN ) )
+        {
+            Accept( pState );
+        }
+
+        for ( i = 1; ( n > 0 ) && ( i < (int)nfds ); i++ )
+        {
+            rc = 0;
+
+            if ( ( fds[i].revents & ( POLLIN | POLLHUP | POLLERR ) ) ||
+                 ( ( map[i]->ssl != NULL ) &&
+                   ( SSL_want_write( map[i]->ssl ) ) &&
+                   ( fds[i].revents & POLLOUT ) ) )
+            {
+                rc = Receive( pState, map[i] );
+            }
+
+            if ( ( rc == 0 ) && ( fds[i].revents & POLLOUT ) )
+            {
+                rc = FlushAcks( map[i] );
+            }
+
+            if ( rc != 0 )
+            {
+                CloseClient( map[i] );
+            }
+        }
+
+        /* release the acknowledgements which are now due */
+        for ( i = 0; i < MAX_CLIENTS; i++ )
+        {
+            if ( ( pState->clients[i].fd != -1 ) &&
+                 ( ReleaseAcks( &pState->clients[i], GetTimeMs() ) != 0 ) )
+            {
+                CloseClient( &pState->clients[i] );
+            }
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Accept                                                                    */
+/*!
+    Accept a new connection from the iothub service
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+==============================================================================*/
+static void Accept( HubSimState *pState )
+{
+    int fd;
+    int i;
+    int one = 1;
+
+    fd = accept4( pState->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if ( fd != -1 )
+    {
+        for ( i = 0; i < MAX_CLIENTS; i++ )
+        {
+            if ( pState->clients[i].fd == -1 )
+            {
+                setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+                memset( &pState->clients[i], 0, sizeof( SimClient ) );
+                pState->clients[i].fd = fd;
+                pState->clients[i].blobFd = -1;
+                pState->connections++;
+
+                if ( pState->tlsCtx != NULL )
+                {
+                    pState->clients[i].ssl = SSL_new( pState->tlsCtx );
+                    if ( ( pState->clients[i].ssl == NULL ) ||
+                         ( SSL_set_fd( pState->clients[i].ssl, fd ) != 1 ) )
+                    {
+                        CloseClient( &pState->clients[i] );
+                        break;
+                    }
+
+                    SSL_set_accept_state( pState->clients[i].ssl );
+                }
+
+                if ( pState->verbose )
+                {
+                    fprintf( stdout, "hubsim: connection accepted\n" );
+                }
+
+                break;
+            }
+        }
+
+        if ( i == MAX_CLIENTS )
+        {
+            close( fd );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Receive                                                                   */
+/*!
+    Receive frames from a client connection
+
+    The Receive function reads frame headers and discards the frame
+    payloads, acknowledging each frame once its payload has been
+    completely received.  The bodies of blob blocks are written to the
+    blob if blobs are being stored.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        pClient
+            pointer to the client connection
+
+    @retval 0 the connection is still open
+    @retval -1 the connection was closed or is invalid
+
+==============================================================================*/
+static int Receive( HubSimState *pState, SimClient *pClient )
+{
+    ssize_t n;
+    size_t len;
+
+    while ( true )
+    {
+        if ( pClient->frameBytes < sizeof( HubSimFrame ) )
+        {
+            /* receive the frame header */
+            n = ClientRead( pState,
+                            pClient,
+                            (char *)&pClient->frame + pClient->frameBytes,
+                            sizeof( HubSimFrame ) - pClient->frameBytes );
+            if ( n <= 0 )
+            {
+                break;
+            }
+
+            pClient->frameBytes += n;
+            if ( pClient->frameBytes == sizeof( HubSimFrame ) )
+            {
+                if ( pClient->frame.magic != HUBSIM_MAGIC )
+                {
+                    fprintf( stderr, "hubsim: invalid frame\n" );
+                    return -1;
+                }
+
+                pClient->payloadLeft = (uint64_t)pClient->frame.headerLength +
+                                       pClient->frame.bodyLength;
+                pClient->propsLen = 0;
+
+                if ( pClient->frame.headerLength + 1 > pClient->propsSize )
+                {
+                    free( pClient->props );
+                    pClient->propsSize = pClient->frame.headerLength + 1;
+                    pClient->props = malloc( pClient->propsSize );
+                    if ( pClient->props == NULL )
+                    {
+                        return -1;
+                    }
+                }
+            }
+        }
+        else if ( pClient->propsLen < pClient->frame.headerLength )
+        {
+            /* receive the message properties */
+            n = ClientRead( pState,
+                            pClient,
+                            &pClient->props[pClient->propsLen],
+                            pClient->frame.headerLength - pClient->propsLen );
+            if ( n <= 0 )
+            {
+                break;
+            }
+
+            pClient->propsLen += n;
+            pClient->payloadLeft -= n;
+        }
+        else if ( pClient->payloadLeft > 0 )
+        {
+            if ( ( pClient->frame.type == HUBSIM_FRAME_BLOCK ) &&
+                 ( pClient->frame.seq == 0 ) &&
+                 ( pClient->payloadLeft == pClient->frame.bodyLength ) )
+            {
+                /* the first block starts a new blob */
+                OpenBlob( pState, pClient );
+            }
+
+            /* discard the frame body */
+            len = ( pClient->payloadLeft < sizeof( rxBuffer ) )
+                  ? pClient->payloadLeft
+                  : sizeof( rxBuffer );
+
+            n = ClientRead( pState, pClient, rxBuffer, len );
+            if ( n <= 0 )
+            {
+                break;
+            }
+
+            pClient->payloadLeft -= n;
+
+            if ( ( pClient->frame.type == HUBSIM_FRAME_BLOCK ) &&
+                 ( pClient->blobFd != -1 ) &&
+                 ( write( pClient->blobFd, rxBuffer, n ) != n ) )
+            {
+                fprintf( stderr,
+                         "hubsim: cannot write blob %s: %s\n",
+                         pClient->blobName,
+                         strerror( errno ) );
+                close( pClient->blobFd );
+                pClient->blobFd = -1;
+            }
+        }
+
+        if ( ( pClient->frameBytes == sizeof( HubSimFrame ) ) &&
+             ( pClient->payloadLeft == 0 ) )
+        {
+            /* frame complete */
+            pClient->frameBytes = 0;
+
+            if ( pClient->frame.type == HUBSIM_FRAME_BLOCK )
+            {
+                pState->blocks++;
+                pState->blobBytes += pClient->frame.bodyLength;
+            }
+            else if ( pClient->frame.type == HUBSIM_FRAME_COMMIT )
+            {
+                CommitBlob( pState, pClient );
+            }
+            else
+            {
+                pState->messages++;
+                pState->bytes += (uint64_t)pClient->frame.headerLength +
+                                 pClient->frame.bodyLength;
+
+                Deliver( pState, pClient );
+            }
+
+            if ( Acknowledge( pState, pClient, pClient->frame.seq ) != 0 )
+            {
+                return -1;
+            }
+        }
+    }
+
+    if ( n == 0 )
+    {
+        /* connection closed by the iothub service */
+        return -1;
+    }
+
+    return ( ( errno == EAGAIN ) || ( errno == EINTR ) ) ? 0 : -1;
+}
+
+/*============================================================================*/
+/*  ClientRead                                                                */
+/*!
+    Read from a client connection
+
+    For a TLS connection the handshake is completed first.  TLS
+    operations which would block are reported as EAGAIN, like a read
+    from the non-blocking socket.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        pClient
+            pointer to the client connection
+
+    @param[out]
+        buf
+            pointer to the buffer to read into
+
+    @param[in]
+        len
+            maximum number of bytes to read
+
+    @retval number of bytes read
+    @retval 0 the connection was closed
+    @retval -1 an error occurred (errno is set)
+
+==============================================================================*/
+static ssize_t ClientRead( HubSimState *pState,
+                           SimClient *pClient,
+                           void *buf,
+                           size_t len )
+{
+    int n;
+
+    if ( pClient->ssl == NULL )
+    {
+        return read( pClient->fd, buf, len );
+    }
+
+    if ( !SSL_is_init_finished( pClient->ssl ) )
+    {
+        n = SSL_do_handshake( pClient->ssl );
+        if ( n != 1 )
+        {
+            switch ( SSL_get_error( pClient->ssl, n ) )
+            {
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:
+                    errno = EAGAIN;
+                    break;
+
+                default:
+                    if ( pState->verbose )
+                    {
+                        fprintf( stderr,
+                                 "hubsim: TLS handshake failed: %s\n",
+                                 ERR_reason_error_string(
+                                    ERR_get_error() ) );
+                    }
+                    ERR_clear_error();
+                    errno = EPROTO;
+                    break;
+            }
+
+            return -1;
+        }
+
+        pState->handshakes++;
+        if ( SSL_session_reused( pClient->ssl ) )
+        {
+            pState->resumed++;
+        }
+    }
+
+    n = SSL_read( pClient->ssl, buf, len );
+    if ( n > 0 )
+    {
+        return n;
+    }
+
+    switch ( SSL_get_error( pClient->ssl, n ) )
+    {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            break;
+
+        default:
+            ERR_clear_error();
+            errno = EPIPE;
+            break;
+    }
+
+    return -1;
+}
+
+/*============================================================================*/
+/*  Acknowledge                                                               */
+/*!
+    Acknowledge a received frame
+
+    The Acknowledge function decides whether the frame is accepted or
+    rejected, and either queues the acknowledgement for immediate
+    transmission or delays it by the configured latency.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        pClient
+            pointer to the client connection
+
+    @param[in]
+        seq
+            sequence number of the received frame
+
+    @retval 0 the acknowledgement was queued
+    @retval -1 out of memory
+
+==============================================================================*/
+static int Acknowledge( HubSimState *pState,
+                        SimClient *pClient,
+                        uint64_t seq )
+{
+    HubSimAck ack;
+    DelayedAck *pDelayed;
+
+    ack.magic = HUBSIM_MAGIC;
+    ack.seq = seq;
+    ack.status = HUBSIM_STATUS_OK;
+
+    if ( ( pState->errorPercent > 0 ) &&
+         ( (unsigned int)( rand() % 100 ) < pState->errorPercent ) )
+    {
+        ack.status = HUBSIM_STATUS_ERROR;
+        pState->rejected++;
+    }
+
+    if ( pState->latencyMs == 0 )
+    {
+        return QueueAck( pClient, &ack );
+    }
+
+    pDelayed = malloc( sizeof( DelayedAck ) );
+    if ( pDelayed == NULL )
+    {
+        return -1;
+    }
+
+    /* constant latency keeps the delayed list ordered by due time */
+    pDelayed->due = GetTimeMs() + pState->latencyMs;
+    pDelayed->ack = ack;
+    pDelayed->pNext = NULL;
+
+    if ( pClient->pTail != NULL )
+    {
+        pClient->pTail->pNext = pDelayed;
+    }
+    else
+    {
+        pClient->pHead = pDelayed;
+    }
+    pClient->pTail = pDelayed;
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  ReleaseAcks                                                               */
+/*!
+    Release the delayed acknowledgements which are due
+
+    @param[in]
+        pClient
+            pointer to the client connection
+
+    @param[in]
+        now
+            current time in milliseconds
+
+    @retval 0 the acknowledgements were released
+    @retval -1 the connection failed
+
+==============================================================================*/
+static int ReleaseAcks( SimClient *pClient, uint64_t now )
+{
+    DelayedAck *pDelayed;
+    int result = 0;
+
+    while ( ( pClient->pHead != NULL ) &&
+            ( pClient->pHead->due <= now ) &&
+            ( result == 0 ) )
+    {
+        pDelayed = pClient->pHead;
+        pClient->pHead = pDelayed->pNext;
+        if ( pClient->pHead == NULL )
+        {
+            pClient->pTail = NULL;
+        }
+
+        result = QueueAck( pClient, &pDelayed->ack );
+        free( pDelayed );
+    }
+
+    if ( ( result == 0 ) && ( pClient->txLen > 0 ) )
+    {
+        result = FlushAcks( pClient );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  NextDue                                                                   */
+/*!
+    Get the poll timeout until the next delayed acknowledgement is due
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        now
+            current time in milliseconds
+
+    @retval poll timeout in milliseconds, or -1 if nothing is delayed
+
+==============================================================================*/
+static int NextDue( HubSimState *pState, uint64_t now )
+{
+    int timeout = -1;
+    int t;
+    int i;
+
+    for ( i = 0; i < MAX_CLIENTS; i++ )
+    {
+        if ( ( pState->clients[i].fd != -1 ) &&
+             ( pState->clients[i].pHead != NULL ) )
+        {
+            t = ( pState->clients[i].pHead->due > now )
+                ? (int)( pState->clients[i].pHead->due - now )
+                : 0;
+
+            if ( ( timeout == -1 ) || ( t < timeout ) )
+            {
+                timeout = t;
+            }
+        }
+    }
+
+    return timeout;
+}
+
+/*============================================================================*/
+/*  QueueAck                                                                  */
+/*!
+    Append an acknowledgement to the client's transmit buffer
+
+    @param[in]
+        pClient
+            pointer to the client connection
+
+    @param[in]
+        pAck
+            pointer to the acknowledgement to queue
+
+    @retval 0 the acknowledgement was queued
+    @retval -1 out of memory
+
+==============================================================================*/
+static int QueueAck( SimClient *pClient, HubSimAck *pAck )
+{
+    unsigned char *p;
+    size_t size;
+
+    if ( pClient->txLen + sizeof( HubSimAck ) > pClient->txSize )
+    {
+        size = ( pClient->txSize > 0 ) ? 2 * pClient->txSize : 4096;
+        p = realloc( pClient->tx, size );
+        if ( p == NULL )
+        {
+            return -1;
+        }
+
+        pClient->tx = p;
+        pClient->txSize = size;
+    }
+
+    memcpy( &pClient->tx[pClient->txLen], pAck, sizeof( HubSimAck ) );
+    pClient->txLen += sizeof( HubSimAck );
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  FlushAcks                                                                 */
+/*!
+    Write as much of the transmit buffer as the socket will accept
+
+    @param[in]
+        pClient
+            pointer to the client connection
+
+    @retval 0 the connection is still open
+    @retval -1 the connection failed
+
+==============================================================================*/
+static int FlushAcks( SimClient *pClient )
+{
+    ssize_t n;
+
+    if ( pClient->ssl != NULL )
+    {
+        if ( !SSL_is_init_finished( pClient->ssl ) )
+        {
+            return 0;
+        }
+
+        n = SSL_write( pClient->ssl, pClient->tx, pClient->txLen );
+        if ( n <= 0 )
+        {
+            switch ( SSL_get_error( pClient->ssl, n ) )
+            {
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:
+                    return 0;
+
+                default:
+                    ERR_clear_error();
+                    return -1;
+            }
+        }
+    }
+    else
+    {
+        n = send( pClient->fd, pClient->tx, pClient->txLen, MSG_DONTWAIT );
+    }
+
+    if ( n > 0 )
+    {
+        memmove( pClient->tx, &pClient->tx[n], pClient->txLen - n );
+        pClient->txLen -= n;
+    }
+    else if ( ( n < 0 ) &&
+              ( errno != EAGAIN ) &&
+              ( errno != EINTR ) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  CloseClient                                                               */
+/*!
+    Close a client connection and discard its pending acknowledgements
+
+    @param[in]
+        pClient
+            pointer to the client connection
+
+==============================================================================*/
+static void CloseClient( SimClient *pClient )
+{
+    DelayedAck *pDelayed;
+
+    if ( state.verbose )
+    {
+        fprintf( stdout, "hubsim: connection closed\n" );
+    }
+
+    while ( pClient->pHead != NULL )
+    {
+        pDelayed = pClient->pHead;
+        pClient->pHead = pDelayed->pNext;
+        free( pDelayed );
+    }
+
+    if ( pClient->blobFd != -1 )
+    {
+        /* an unfinished blob is left under its temporary name */
+        close( pClient->blobFd );
+    }
+
+    SSL_free( pClient->ssl );
+    close( pClient->fd );
+    free( pClient->tx );
+    free( pClient->props );
+    memset( pClient, 0, sizeof( SimClient ) );
+    pClient->fd = -1;
+}
+
+/*============================================================================*/
+/*  Deliver                                                                   */
+/*!
+    Account for a completely received message
+
+    The message is identified by its messageId property.  The first
+    copy of each message is counted as a delivery and added to the
+    backlog timeline.  Later copies are counted as duplicates.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        pClient
+            pointer to the client connection holding the message
+            properties
+
+==============================================================================*/
+static void Deliver( HubSimState *pState, SimClient *pClient )
+{
+    uint64_t hash = 0;
+    uint64_t now;
+    uint64_t delay;
+    size_t queuedSlot;
+    size_t slot;
+    char *p;
+    char *end;
+
+    pClient->props[pClient->propsLen] = '\0';
+
+    p = strstr( pClient->props, "messageId:" );
+    if ( ( p != NULL ) &&
+         ( ( p == pClient->props ) || ( p[-1] == '\n' ) ) )
+    {
+        /* FNV-1a hash of the message identifier */
+        hash = 14695981039346656037ULL;
+        end = p + strcspn( p, "\n" );
+        for ( p += 10; p < end; p++ )
+        {
+            hash = ( hash ^ (unsigned char)*p ) * 1099511628211ULL;
+        }
+    }
+
+    if ( ( hash != 0 ) && ( AddId( pState, hash ) == false ) )
+    {
+        pState->duplicates++;
+        return;
+    }
+
+    pState->unique++;
+
+    now = GetRealTimeUs();
+    slot = ( now - pState->startRealTime ) / ( TIMELINE_INTERVAL_MS * 1000 );
+    queuedSlot = ( pClient->frame.queued > pState->startRealTime )
+                 ? ( pClient->frame.queued - pState->startRealTime ) /
+                   ( TIMELINE_INTERVAL_MS * 1000 )
+                 : 0;
+    delay = ( now > pClient->frame.queued )
+            ? ( now - pClient->frame.queued ) / 1000
+            : 0;
+
+    if ( Timeline( pState, slot ) == 0 )
+    {
+        pState->queuedCount[( queuedSlot < slot ) ? queuedSlot : slot]++;
+        pState->deliveredCount[slot]++;
+        if ( delay > pState->maxDelay[slot] )
+        {
+            pState->maxDelay[slot] = delay;
+        }
+    }
+}
+
+/*============================================================================*/
+/*  OpenBlob                                                                  */
+/*!
+    Start storing a blob
+
+    The blob is named by the blob property of its first block.  Any '/'
+    in the name is replaced so blobs are always created in the blob
+    directory.  The blob is written under a temporary ".part" name
+    until it is committed.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        pClient
+            pointer to the client connection holding the block properties
+
+==============================================================================*/
+static void OpenBlob( HubSimState *pState, SimClient *pClient )
+{
+    char path[PATH_MAX];
+    char *p;
+    size_t len;
+
+    if ( pClient->blobFd != -1 )
+    {
+        close( pClient->blobFd );
+        pClient->blobFd = -1;
+    }
+
+    pClient->props[pClient->propsLen] = '\0';
+    p = strstr( pClient->props, "blob:" );
+    if ( ( pState->blobDir == NULL ) || ( p == NULL ) )
+    {
+        return;
+    }
+
+    p += 5;
+    len = strcspn( p, "\n" );
+    if ( ( len == 0 ) || ( len >= sizeof( pClient->blobName ) ) )
+    {
+        return;
+    }
+
+    memcpy( pClient->blobName, p, len );
+    pClient->blobName[len] = '\0';
+    for ( p = pClient->blobName; *p != '\0'; p++ )
+    {
+        if ( ( *p == '/' ) ||
+             ( ( p == pClient->blobName ) && ( *p == '.' ) ) )
+        {
+            *p = '_';
+        }
+    }
+
+    snprintf( path,
+              sizeof( path ),
+              "%s/%s.part",
+              pState->blobDir,
+              pClient->blobName );
+    pClient->blobFd = open( path,
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                            0644 );
+    if ( pClient->blobFd == -1 )
+    {
+        fprintf( stderr,
+                 "hubsim: cannot create blob %s: %s\n",
+                 path,
+                 strerror( errno ) );
+    }
+}
+
+/*============================================================================*/
+/*  CommitBlob                                                                */
+/*!
+    Complete a blob
+
+    The stored blob is renamed from its temporary name to its own name.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        pClient
+            pointer to the client connection
+
+==============================================================================*/
+static void CommitBlob( HubSimState *pState, SimClient *pClient )
+{
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+
+    pState->blobs++;
+
+    if ( pClient->blobFd != -1 )
+    {
+        close( pClient->blobFd );
+        pClient->blobFd = -1;
+
+        snprintf( from,
+                  sizeof( from ),
+                  "%s/%s.part",
+                  pState->blobDir,
+                  pClient->blobName );
+        snprintf( to,
+                  sizeof( to ),
+                  "%s/%s",
+                  pState->blobDir,
+                  pClient->blobName );
+        rename( from, to );
+    }
+
+    if ( pState->verbose )
+    {
+        fprintf( stdout,
+                 "hubsim: blob %s committed\n",
+                 pClient->blobName );
+    }
+}
+
+/*============================================================================*/
+/*  AddId                                                                     */
+/*!
+    Add a message identifier hash to the set of received messages
+
+    The set is an open addressed hash table which is doubled when it
+    becomes half full.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        hash
+            non-zero message identifier hash
+
+    @retval true the hash was added
+    @retval false the hash was already present (or out of memory)
+
+==============================================================================*/
+static bool AddId( HubSimState *pState, uint64_t hash )
+{
+    uint64_t *ids;
+    size_t slots;
+    size_t i;
+    size_t j;
+
+    if ( 2 * pState->unique >= pState->idSlots )
+    {
+        slots = ( pState->idSlots > 0 ) ? 2 * pState->idSlots : ID_SET_SIZE;
+        ids = calloc( slots, sizeof( uint64_t ) );
+        if ( ids == NULL )
+        {
+            return false;
+        }
+
+        for ( i = 0; i < pState->idSlots; i++ )
+        {
+            if ( pState->ids[i] != 0 )
+            {
+                j = pState->ids[i] & ( slots - 1 );
+                while ( ids[j] != 0 )
+                {
+                    j = ( j + 1 ) & ( slots - 1 );
+                }
+
+                ids[j] = pState->ids[i];
+            }
+        }
+
+        free( pState->ids );
+        pState->ids = ids;
+        pState->idSlots = slots;
+    }
+
+    i = hash & ( pState->idSlots - 1 );
+    while ( pState->ids[i] != 0 )
+    {
+        if ( pState->ids[i] == hash )
+        {
+            return false;
+        }
+
+        i = ( i + 1 ) & ( pState->idSlots - 1 );
+    }
+
+    pState->ids[i] = hash;
+
+    return true;
+}
+
+/*============================================================================*/
+/*  Timeline                                                                  */
+/*!
+    Grow the timeline to include the specified slot
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        slot
+            timeline slot which must be available
+
+    @retval 0 the slot is available
+    @retval -1 out of memory
+
+==============================================================================*/
+static int Timeline( HubSimState *pState, size_t slot )
+{
+    size_t slots;
+    uint64_t *p[3];
+    int i;
+
+    if ( slot < pState->slots )
+    {
+        return 0;
+    }
+
+    slots = ( pState->slots > 0 ) ? 2 * pState->slots : 1024;
+    while ( slots <= slot )
+    {
+        slots *= 2;
+    }
+
+    p[0] = realloc( pState->queuedCount, slots * sizeof( uint64_t ) );
+    if ( p[0] != NULL )
+    {
+        pState->queuedCount = p[0];
+    }
+
+    p[1] = realloc( pState->deliveredCount, slots * sizeof( uint64_t ) );
+    if ( p[1] != NULL )
+    {
+        pState->deliveredCount = p[1];
+    }
+
+    p[2] = realloc( pState->maxDelay, slots * sizeof( uint64_t ) );
+    if ( p[2] != NULL )
+    {
+        pState->maxDelay = p[2];
+    }
+
+    if ( ( p[0] == NULL ) || ( p[1] == NULL ) || ( p[2] == NULL ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < 3; i++ )
+    {
+        memset( &p[i][pState->slots],
+                0,
+                ( slots - pState->slots ) * sizeof( uint64_t ) );
+    }
+
+    pState->slots = slots;
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  WriteStats                                                                */
+/*!
+    Report the stand-in statistics
+
+    The statistics are written to stdout, and as JSON to the statistics
+    file if one was specified.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+==============================================================================*/
+static void WriteStats( HubSimState *pState )
+{
+    FILE *fp;
+    double elapsed;
+
+    elapsed = ( GetTimeMs() - pState->startTime ) / 1000.0;
+
+    fprintf( stdout,
+             "hubsim: %lu messages (%lu unique, %lu duplicates) %lu bytes "
+             "%lu rejected %lu connections (%lu TLS handshakes, "
+             "%lu resumed) %lu blobs (%lu blocks, %lu bytes) in %.3fs\n",
+             (unsigned long)pState->messages,
+             (unsigned long)pState->unique,
+             (unsigned long)pState->duplicates,
+             (unsigned long)pState->bytes,
+             (unsigned long)pState->rejected,
+             (unsigned long)pState->connections,
+             (unsigned long)pState->handshakes,
+             (unsigned long)pState->resumed,
+             (unsigned long)pState->blobs,
+             (unsigned long)pState->blocks,
+             (unsigned long)pState->blobBytes,
+             elapsed );
+
+    if ( pState->statsFile != NULL )
+    {
+        fp = fopen( pState->statsFile, "w" );
+        if ( fp != NULL )
+        {
+            fprintf( fp,
+                     "{\"messages\":%lu,\"unique\":%lu,"
+                     "\"duplicates\":%lu,\"bytes\":%lu,\"rejected\":%lu,"
+                     "\"connections\":%lu,\"tls_handshakes\":%lu,"
+                     "\"tls_resumed\":%lu,\"blobs\":%lu,\"blocks\":%lu,"
+                     "\"blob_bytes\":%lu,\"elapsed\":%.3f,",
+                     (unsigned long)pState->messages,
+                     (unsigned long)pState->unique,
+                     (unsigned long)pState->duplicates,
+                     (unsigned long)pState->bytes,
+                     (unsigned long)pState->rejected,
+                     (unsigned long)pState->connections,
+                     (unsigned long)pState->handshakes,
+                     (unsigned long)pState->resumed,
+                     (unsigned long)pState->blobs,
+                     (unsigned long)pState->blocks,
+                     (unsigned long)pState->blobBytes,
+                     elapsed );
+            WriteTimeline( pState, fp );
+            fprintf( fp, "}\n" );
+            fclose( fp );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  WriteTimeline                                                             */
+/*!
+    Write the backlog timeline as a JSON "timeline" member
+
+    For each slot up to the current time the timeline reports the
+    number of messages queued by the iothub service before the end of
+    the slot but not yet delivered, and the largest delivery delay of
+    the messages delivered in the slot.  Messages which are never
+    delivered are not included in the backlog.
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state
+
+    @param[in]
+        fp
+            stream to write to
+
+==============================================================================*/
+static void WriteTimeline( HubSimState *pState, FILE *fp )
+{
+    size_t slots;
+    size_t i;
+    uint64_t queued = 0;
+    uint64_t delivered = 0;
+
+    slots = ( GetRealTimeUs() - pState->startRealTime ) /
+            ( TIMELINE_INTERVAL_MS * 1000 ) + 1;
+    if ( slots > pState->slots )
+    {
+        slots = pState->slots;
+    }
+
+    fprintf( fp,
+             "\"timeline\":{\"interval_ms\":%d,\"start\":%lu,"
+             "\"backlog\":[",
+             TIMELINE_INTERVAL_MS,
+             (unsigned long)pState->startRealTime );
+
+    for ( i = 0; i < slots; i++ )
+    {
+        queued += pState->queuedCount[i];
+        delivered += pState->deliveredCount[i];
+        fprintf( fp,
+                 "%s%lu",
+                 ( i > 0 ) ? "," : "",
+                 (unsigned long)( queued - delivered ) );
+    }
+
+    fprintf( fp, "],\"delay_ms\":[" );
+
+    for ( i = 0; i < slots; i++ )
+    {
+        fprintf( fp,
+                 "%s%lu",
+                 ( i > 0 ) ? "," : "",
+                 (unsigned long)pState->maxDelay[i] );
+    }
+
+    fprintf( fp, "]}" );
+}
+
+/*============================================================================*/
+/*  GetTimeMs                                                                 */
+/*!
+    Get the monotonic time in milliseconds
+
+==============================================================================*/
+static uint64_t GetTimeMs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*============================================================================*/
+/*  GetRealTimeUs                                                             */
+/*!
+    Get the wall clock time in microseconds
+
+==============================================================================*/
+static uint64_t GetRealTimeUs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*============================================================================*/
+/*  usage                                                                     */
+/*!
+    Display the application usage
+
+    @param[in]
+       cmdname
+            pointer to the invoked command name
+
+==============================================================================*/
+static void usage( char *cmdname )
+{
+    if( cmdname != NULL )
+    {
+        fprintf(stderr,
+                "usage: %s [-h] [-v] [-p port] [-l ms] [-e percent] "
+                "[-o statsfile]\n"
+                "          [-C certfile] [-K keyfile] [-u blobdir]\n"
+                " [-h] : display this help\n"
+                " [-v] : verbose output\n"
+                " [-p port] : TCP port to listen on (loopback only)\n"
+                " [-l ms] : acknowledgement latency\n"
+                " [-e percent] : percentage of messages to reject\n"
+                " [-o statsfile] : write JSON statistics on exit "
+                "and on SIGUSR1\n"
+                " [-C certfile] : accept TLS connections with this "
+                "certificate chain\n"
+                " [-K keyfile] : TLS private key (default certfile)\n"
+                " [-u blobdir] : store uploaded blobs in blobdir\n",
+                cmdname );
+    }
+}
+
+/*============================================================================*/
+/*  ProcessOptions                                                            */
+/*!
+    Process the command line options
+
+    @param[in]
+        argC
+            number of arguments
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @param[in]
+        pState
+            pointer to the hub stand-in state object
+
+==============================================================================*/
+static int ProcessOptions( int argC, char *argV[], HubSimState *pState )
+{
+    int c;
+    const char *options = "hvp:l:e:o:C:K:u:";
+
+    if( ( pState != NULL ) &&
+        ( argV != NULL ) )
+    {
+        while( ( c = getopt( argC, argV, options ) ) != -1 )
+        {
+            switch( c )
+            {
+                case 'h':
+                    usage( argV[0] );
+                    exit( 0 );
+                    break;
+
+                case 'v':
+                    pState->verbose = true;
+                    break;
+
+                case 'p':
+                    pState->port = atoi( optarg );
+                    break;
+
+                case 'l':
+                    pState->latencyMs = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'e':
+                    pState->errorPercent = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'o':
+                    pState->statsFile = optarg;
+                    break;
+
+                case 'C':
+                    pState->certFile = optarg;
+                    break;
+
+                case 'K':
+                    pState->keyFile = optarg;
+                    break;
+
+                case 'u':
+                    pState->blobDir = optarg;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  SetupTerminationHandler                                                   */
+/*!
+    Set up the termination handler
+
+    The SIGINT and SIGTERM signals stop the stand-in so it can report
+    its statistics.  SIGUSR1 reports the statistics without stopping.
+
+==============================================================================*/
+static void SetupTerminationHandler( void )
+{
+    static struct sigaction sigact;
+
+    memset( &sigact, 0, sizeof(sigact) );
+
+    sigact.sa_handler = TerminationHandler;
+
+    sigaction( SIGTERM, &sigact, NULL );
+    sigaction( SIGINT, &sigact, NULL );
+
+    sigact.sa_handler = ReportHandler;
+    sigaction( SIGUSR1, &sigact, NULL );
+}
+
+/*============================================================================*/
+/*  TerminationHandler                                                        */
+/*!
+    Termination handler
+
+@param[in]
+    signum
+        The signal which caused the termination (unused)
+
+==============================================================================*/
+static void TerminationHandler( int signum )
+{
+    (void)signum;
+    done = 1;
+}
+
+/*============================================================================*/
+/*  ReportHandler                                                             */
+/*!
+    Statistics report request handler
+
+@param[in]
+    signum
+        The signal which requested the report (unused)
+
+==============================================================================*/
+static void ReportHandler( int signum )
+{
+    (void)signum;
+    report = 1;
+}
+
+/*! @}
+ * end of hubsim group */
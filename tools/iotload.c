@@ -0,0 +1,1896 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup iotload iotload
+ * @brief Load generator for the iothub service
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file iotload.c
+
+    iothub load generator
+
+    The iotload application generates device-to-cloud message load on
+    the iothub service using the same IPC protocol as the IOT clients:
+    an "IOTC" header frame on the /iothub message queue followed by
+    the message body written to the client's /tmp/iothub_<pid> FIFO.
+
+    Load is generated by one or more worker processes (each worker has
+    its own pid and therefore its own FIFO), optionally rate limited.
+    Each worker records the time taken for the iothub service to accept
+    each message (queue send until the body has been consumed) in a
+    log-linear latency histogram.  The merged results are reported as
+    text or JSON for the benchmark runner.
+
+    Alternatively, iotload can replay a trace captured by the iothub
+    service (iothub -r) at the original pace, scaled, or as fast as
+    possible.  Each captured client is assigned to one worker so the
+    per-client message order is preserved.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <mqueue.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <varserver/varserver.h>
+#include "trace.h"
+#include "iotbatch.h"
+#include "iotsend.h"
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! default iothub message queue name */
+#define DEFAULT_QUEUE_NAME "/iothub"
+
+/*! number of latency histogram buckets */
+#define HISTOGRAM_BUCKETS ( 1024 )
+
+/*! number of linear sub-buckets per power of two */
+#define HISTOGRAM_SUB_BUCKETS ( 16 )
+
+/*! maximum number of worker processes */
+#define MAX_WORKERS ( 256 )
+
+/*! interval between attempts to open the iothub queue in milliseconds */
+#define IOTLOAD_OPEN_POLL_MS ( 5 )
+
+/*! maximum size of the message header frame */
+#define MAX_HEADER_SIZE ( 8192 )
+
+/*! default number of messages to send per worker */
+#define DEFAULT_COUNT ( 10000 )
+
+/*! message count which has not been set on the command line */
+#define COUNT_UNSET ( (uint64_t)-1 )
+
+/*! per-worker results passed back to the parent */
+typedef struct loadResults
+{
+    /*! number of messages accepted by the iothub service */
+    uint64_t messages;
+
+    /*! number of messages which could not be sent */
+    uint64_t errors;
+
+    /*! number of body bytes sent */
+    uint64_t bytes;
+
+    /*! largest latency in microseconds */
+    uint64_t maxLatency;
+
+    /*! largest replay delay behind the trace schedule in microseconds */
+    uint64_t maxLag;
+
+    /*! latency histogram in microseconds */
+    uint64_t histogram[HISTOGRAM_BUCKETS];
+
+} LoadResults;
+
+/*! messages collected by a worker for one batch frame */
+typedef struct loadBatch
+{
+    /*! FIFO contents of the batch */
+    char *data;
+
+    /*! length of the FIFO contents */
+    size_t length;
+
+    /*! number of messages in the batch */
+    uint32_t count;
+
+    /*! time each message was generated */
+    uint64_t *times;
+
+    /*! body length of each message */
+    size_t *bytes;
+
+} LoadBatch;
+
+/*! a message sent through the iotsend library */
+typedef struct asyncSlot
+{
+    /*! worker results to update when the message completes */
+    LoadResults *pResults;
+
+    /*! time the message was submitted */
+    uint64_t t0;
+
+    /*! body length of the message */
+    size_t bytes;
+
+} AsyncSlot;
+
+/*! load generator state */
+typedef struct loadState
+{
+    /*! scenario label for the report */
+    const char *scenario;
+
+    /*! iothub message queue name */
+    const char *queueName;
+
+    /*! header profile name */
+    const char *profile;
+
+    /*! message header block */
+    const char *headers;
+
+    /*! number of worker processes */
+    int workers;
+
+    /*! number of messages to send per worker (0 = unlimited) */
+    uint64_t count;
+
+    /*! maximum test duration in seconds (0 = unlimited) */
+    unsigned int duration;
+
+    /*! per-worker message rate limit in messages/s (0 = unlimited) */
+    unsigned int rate;
+
+    /*! minimum body size */
+    size_t minBody;
+
+    /*! maximum body size */
+    size_t maxBody;
+
+    /*! seconds to wait for the iothub message queue to appear */
+    unsigned int wait;
+
+    /*! message time to live in seconds (0 = messages do not expire) */
+    unsigned int ttl;
+
+    /*! message delivery deadline in milliseconds (0 = no deadline) */
+    unsigned int deadline;
+
+    /*! message queue priority of the generated messages */
+    unsigned int priority;
+
+    /*! mark the generated messages urgent */
+    bool urgent;
+
+    /*! number of messages sent in each batch frame (0 = no batching) */
+    unsigned int batch;
+
+    /*! send the messages through the iotsend library */
+    bool async;
+
+    /*! output the report as JSON */
+    bool json;
+
+    /*! name of the trace file to replay */
+    const char *traceFile;
+
+    /*! replay speed relative to the capture (0 = as fast as possible) */
+    double speed;
+
+} LoadState;
+
+/*==============================================================================
+        Private file scoped variables
+==============================================================================*/
+
+/*! load generator state */
+static LoadState state;
+
+/*! message header profiles */
+static const struct
+{
+    const char *name;
+    const char *headers;
+} profiles[] =
+{
+    {
+        "none",
+        "\n"
+    },
+    {
+        "small",
+        "source:iotload\n"
+        "\n"
+    },
+    {
+        "typical",
+        "source:iotload\n"
+        "content-type:application/json\n"
+        "stream:telemetry\n"
+        "units:celsius\n"
+        "\n"
+    },
+    {
+        "large",
+        "source:iotload\n"
+        "content-type:application/json\n"
+        "content-encoding:utf-8\n"
+        "stream:diagnostics\n"
+        "site:plant-07/line-3/cell-12\n"
+        "asset:compressor-0042\n"
+        "firmware:4.18.2-rc1+build.7731\n"
+        "schema:urn:example:telemetry:compressor:v3\n"
+        "priority:2\n"
+        "units:kPa\n"
+        "sampleRate:100\n"
+        "sampleCount:600\n"
+        "window:60s\n"
+        "alarmState:nominal\n"
+        "operator:shift-b\n"
+        "region:eu-west\n"
+        "tenant:contoso-industrial\n"
+        "tags:vibration,pressure,temperature\n"
+        "\n"
+    },
+};
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+int main( int argc, char **argv );
+static int ProcessOptions( int argC, char *argV[], LoadState *pState );
+static void usage( char *cmdname );
+static int RunWorker( LoadState *pState, int startFd, int resultFd );
+static int RunReplay( LoadState *pState,
+                      int worker,
+                      int startFd,
+                      int resultFd );
+static int RunAsync( LoadState *pState, int startFd, int resultFd );
+static void AsyncDone( void *arg, int result );
+static void Record( LoadResults *pResults, uint64_t latency, size_t bytes );
+static size_t BuildHeaders( LoadState *pState, char *buf, size_t size );
+static LoadBatch *CreateBatch( LoadState *pState );
+static void DestroyBatch( LoadBatch *pBatch );
+static void AddToBatch( LoadBatch *pBatch,
+                        const char *frame,
+                        size_t frameLength,
+                        const char *body,
+                        size_t bodyLength,
+                        uint64_t t0 );
+static void FlushBatch( mqd_t mq,
+                        const char *fifoName,
+                        unsigned int priority,
+                        LoadBatch *pBatch,
+                        LoadResults *pResults );
+static int WriteFifo( const char *fifoName, const char *data, size_t len );
+static int SendOne( mqd_t mq,
+                    const char *fifoName,
+                    char *frame,
+                    size_t frameLength,
+                    unsigned int priority,
+                    const char *body,
+                    size_t bodyLength );
+static mqd_t OpenQueue( LoadState *pState );
+static char *GenerateBody( size_t len );
+static void Merge( LoadResults *pTotal, LoadResults *pResults );
+static uint64_t Percentile( LoadResults *pResults, double p );
+static void Report( LoadState *pState, LoadResults *pTotal, double elapsed );
+static int Bucket( uint64_t us );
+static uint64_t BucketValue( int bucket );
+static uint64_t GetTimeUs( void );
+static int ReadAll( int fd, void *buf, size_t len );
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  main                                                                      */
+/*!
+    Main entry point for the iotload application
+
+    The main function forks the worker processes, releases them at the
+    same time, and merges their results.
+
+    @param[in]
+        argc
+            number of arguments on the command line
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @retval 0 the load test completed
+    @retval 1 the load test failed
+
+==============================================================================*/
+int main( int argc, char **argv )
+{
+    int startPipe[2];
+    int resultPipe[MAX_WORKERS][2];
+    pid_t pids[MAX_WORKERS];
+    LoadResults *pTotal;
+    LoadResults *pResults;
+    uint64_t start;
+    double elapsed;
+    int i;
+    int n = 0;
+    int status;
+    int result = 1;
+
+    state.queueName = DEFAULT_QUEUE_NAME;
+    state.profile = "typical";
+    state.workers = 1;
+    state.count = COUNT_UNSET;
+    state.minBody = 256;
+    state.maxBody = 256;
+    state.wait = 10;
+    state.speed = 1.0;
+
+    ProcessOptions( argc, argv, &state );
+
+    if ( state.count == COUNT_UNSET )
+    {
+        /* a replay sends the whole trace by default */
+        state.count = ( state.traceFile != NULL ) ? 0 : DEFAULT_COUNT;
+    }
+
+    if ( state.traceFile != NULL )
+    {
+        /* the headers come from the trace */
+        state.profile = "replay";
+        state.headers = "";
+    }
+
+    for ( i = 0; i < (int)( sizeof( profiles ) / sizeof( profiles[0] ) ); i++ )
+    {
+        if ( strcmp( profiles[i].name, state.profile ) == 0 )
+        {
+            state.headers = profiles[i].headers;
+        }
+    }
+
+    pTotal = calloc( 1, sizeof( LoadResults ) );
+    pResults = calloc( 1, sizeof( LoadResults ) );
+
+    if ( ( state.headers == NULL ) ||
+         ( pTotal == NULL ) ||
+         ( pResults == NULL ) ||
+         ( pipe( startPipe ) != 0 ) )
+    {
+        fprintf( stderr, "iotload: invalid arguments\n" );
+        return 1;
+    }
+
+    for ( i = 0; i < state.workers; i++ )
+    {
+        if ( pipe( resultPipe[i] ) != 0 )
+        {
+            break;
+        }
+
+        pids[i] = fork();
+        if ( pids[i] == 0 )
+        {
+            close( startPipe[1] );
+            close( resultPipe[i][0] );
+            exit( ( state.traceFile != NULL )
+                  ? RunReplay( &state, i, startPipe[0], resultPipe[i][1] )
+                  : ( state.async == true )
+                  ? RunAsync( &state, startPipe[0], resultPipe[i][1] )
+                  : RunWorker( &state, startPipe[0], resultPipe[i][1] ) );
+        }
+
+        close( resultPipe[i][1] );
+        if ( pids[i] == -1 )
+        {
+            close( resultPipe[i][0] );
+            break;
+        }
+
+        n++;
+    }
+
+    /* release all of the workers at once */
+    close( startPipe[0] );
+    start = GetTimeUs();
+    close( startPipe[1] );
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( ReadAll( resultPipe[i][0],
+                      pResults,
+                      sizeof( LoadResults ) ) == 0 )
+        {
+            Merge( pTotal, pResults );
+        }
+
+        close( resultPipe[i][0] );
+    }
+
+    elapsed = ( GetTimeUs() - start ) / 1000000.0;
+
+    for ( i = 0; i < n; i++ )
+    {
+        waitpid( pids[i], &status, 0 );
+    }
+
+    if ( ( n == state.workers ) && ( pTotal->messages > 0 ) )
+    {
+        Report( &state, pTotal, elapsed );
+        result = ( pTotal->errors == 0 ) ? 0 : 1;
+    }
+    else
+    {
+        fprintf( stderr, "iotload: no messages were sent\n" );
+    }
+
+    free( pTotal );
+    free( pResults );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  RunWorker                                                                 */
+/*!
+    Run a load generator worker process
+
+    The RunWorker function creates the worker's FIFO, waits for the
+    start signal, and sends messages until the message count or the
+    test duration is reached.  The results are written to the parent.
+
+    @param[in]
+        pState
+            pointer to the load generator state
+
+    @param[in]
+        startFd
+            start pipe which is closed by the parent to start the test
+
+    @param[in]
+        resultFd
+            pipe to write the worker results to
+
+    @retval 0 the worker completed
+    @retval 1 the worker failed
+
+==============================================================================*/
+static int RunWorker( LoadState *pState, int startFd, int resultFd )
+{
+    LoadResults *pResults;
+    char fifoName[64];
+    char frame[MAX_HEADER_SIZE];
+    size_t frameLength;
+    uint32_t pid = getpid();
+    char *body;
+    size_t bodyLength;
+    uint64_t start;
+    uint64_t end;
+    uint64_t t0;
+    uint64_t interval = 0;
+    uint64_t next;
+    uint64_t i;
+    char c;
+    mqd_t mq;
+    LoadBatch *pBatch = NULL;
+    int result = 1;
+
+    srand( pid );
+    signal( SIGPIPE, SIG_IGN );
+
+    pResults = calloc( 1, sizeof( LoadResults ) );
+    body = GenerateBody( pState->maxBody );
+    if ( pState->batch > 0 )
+    {
+        pBatch = CreateBatch( pState );
+    }
+
+    snprintf( fifoName, sizeof( fifoName ), "/tmp/iothub_%d", pid );
+    unlink( fifoName );
+
+    mq = OpenQueue( pState );
+
+    if ( ( pResults != NULL ) &&
+         ( body != NULL ) &&
+         ( ( pState->batch == 0 ) || ( pBatch != NULL ) ) &&
+         ( mq != (mqd_t)-1 ) &&
+         ( mkfifo( fifoName, S_IRUSR | S_IWUSR ) == 0 ) )
+    {
+        /* build the header frame: preamble, pid, headers */
+        memcpy( frame, "IOTC", 4 );
+        memcpy( &frame[4], &pid, sizeof( pid ) );
+        frameLength = 8 + BuildHeaders( pState,
+                                        &frame[8],
+                                        sizeof( frame ) - 8 ) + 1;
+
+        if ( pState->rate > 0 )
+        {
+            interval = 1000000 / pState->rate;
+        }
+
+        /* wait for the start signal */
+        (void)read( startFd, &c, 1 );
+
+        start = GetTimeUs();
+        end = start + (uint64_t)pState->duration * 1000000;
+        next = start;
+
+        for ( i = 0;
+              ( pState->count == 0 ) || ( i < pState->count );
+              i++ )
+        {
+            if ( interval > 0 )
+            {
+                /* open loop pacing */
+                t0 = GetTimeUs();
+                if ( next > t0 )
+                {
+                    usleep( next - t0 );
+                }
+
+                next += interval;
+            }
+
+            t0 = GetTimeUs();
+            if ( ( pState->duration > 0 ) && ( t0 >= end ) )
+            {
+                break;
+            }
+
+            bodyLength = pState->minBody;
+            if ( pState->maxBody > pState->minBody )
+            {
+                bodyLength += rand() % ( pState->maxBody -
+                                         pState->minBody + 1 );
+            }
+
+            if ( pBatch != NULL )
+            {
+                /* the batch is sent once it is full */
+                AddToBatch( pBatch, frame, frameLength, body, bodyLength, t0 );
+                if ( pBatch->count == pState->batch )
+                {
+                    FlushBatch( mq,
+                                fifoName,
+                                pState->priority,
+                                pBatch,
+                                pResults );
+                }
+            }
+            else if ( SendOne( mq,
+                               fifoName,
+                               frame,
+                               frameLength,
+                               pState->priority,
+                               body,
+                               bodyLength ) == 0 )
+            {
+                Record( pResults, GetTimeUs() - t0, bodyLength );
+            }
+            else
+            {
+                pResults->errors++;
+            }
+        }
+
+        if ( ( pBatch != NULL ) && ( pBatch->count > 0 ) )
+        {
+            /* send the last partial batch */
+            FlushBatch( mq, fifoName, pState->priority, pBatch, pResults );
+        }
+
+        result = 0;
+    }
+    else
+    {
+        fprintf( stderr, "iotload: worker %d cannot start\n", pid );
+    }
+
+    if ( pResults != NULL )
+    {
+        (void)write( resultFd, pResults, sizeof( LoadResults ) );
+    }
+
+    DestroyBatch( pBatch );
+    unlink( fifoName );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  RunAsync                                                                  */
+/*!
+    Run a load generator worker process using the iotsend library
+
+    The RunAsync function sends the generated messages through an
+    asynchronous iotsend sender, which batches them.  The latency of
+    each message is measured from its submission until the iothub
+    service has read it.
+
+    @param[in]
+        pState
+            pointer to the load generator state
+
+    @param[in]
+        startFd
+            start pipe which is closed by the parent to start the test
+
+    @param[in]
+        resultFd
+            pipe to write the worker results to
+
+    @retval 0 the worker completed
+    @retval 1 the worker failed
+
+==============================================================================*/
+static int RunAsync( LoadState *pState, int startFd, int resultFd )
+{
+    LoadResults *pResults;
+    IotSendConfig config;
+    IotSend *pSend = NULL;
+    AsyncSlot *pSlots;
+    size_t slots;
+    char headers[MAX_HEADER_SIZE];
+    char *body;
+    size_t bodyLength;
+    uint64_t start;
+    uint64_t end;
+    uint64_t t0;
+    uint64_t interval = 0;
+    uint64_t next;
+    uint64_t errors = 0;
+    uint64_t i;
+    AsyncSlot *pSlot;
+    char c;
+    mqd_t mq;
+    int result = 1;
+
+    srand( getpid() );
+
+    memset( &config, 0, sizeof( config ) );
+    config.queueName = pState->queueName;
+    config.batchCount = pState->batch;
+    config.queueLimit = IOTSEND_DEFAULT_QUEUE_LIMIT;
+
+    /* a slot is reused once the message two queue limits before it
+       has completed */
+    slots = 2 * config.queueLimit;
+
+    pResults = calloc( 1, sizeof( LoadResults ) );
+    pSlots = calloc( slots, sizeof( AsyncSlot ) );
+    body = GenerateBody( pState->maxBody );
+    BuildHeaders( pState, headers, sizeof( headers ) );
+
+    /* wait for the iothub service */
+    mq = OpenQueue( pState );
+    if ( mq != (mqd_t)-1 )
+    {
+        mq_close( mq );
+        pSend = IotSend_Open( &config );
+    }
+
+    if ( ( pResults != NULL ) &&
+         ( pSlots != NULL ) &&
+         ( body != NULL ) &&
+         ( pSend != NULL ) )
+    {
+        if ( pState->rate > 0 )
+        {
+            interval = 1000000 / pState->rate;
+        }
+
+        /* wait for the start signal */
+        (void)read( startFd, &c, 1 );
+
+        start = GetTimeUs();
+        end = start + (uint64_t)pState->duration * 1000000;
+        next = start;
+
+        for ( i = 0;
+              ( pState->count == 0 ) || ( i < pState->count );
+              i++ )
+        {
+            if ( interval > 0 )
+            {
+                /* open loop pacing */
+                t0 = GetTimeUs();
+                if ( next > t0 )
+                {
+                    usleep( next - t0 );
+                }
+
+                next += interval;
+            }
+
+            t0 = GetTimeUs();
+            if ( ( pState->duration > 0 ) && ( t0 >= end ) )
+            {
+                break;
+            }
+
+            bodyLength = pState->minBody;
+            if ( pState->maxBody > pState->minBody )
+            {
+                bodyLength += rand() % ( pState->maxBody -
+                                         pState->minBody + 1 );
+            }
+
+            pSlot = &pSlots[i % slots];
+            pSlot->pResults = pResults;
+            pSlot->t0 = t0;
+            pSlot->bytes = bodyLength;
+
+            if ( IotSend_Message( pSend,
+                                  pState->priority,
+                                  headers,
+                                  body,
+                                  bodyLength,
+                                  AsyncDone,
+                                  pSlot ) != EOK )
+            {
+                errors++;
+            }
+        }
+
+        /* wait for the messages to complete */
+        IotSend_Close( pSend );
+        pSend = NULL;
+
+        pResults->errors += errors;
+        result = 0;
+    }
+    else
+    {
+        fprintf( stderr, "iotload: worker %d cannot start\n", getpid() );
+    }
+
+    IotSend_Close( pSend );
+
+    if ( pResults != NULL )
+    {
+        (void)write( resultFd, pResults, sizeof( LoadResults ) );
+    }
+
+    free( pSlots );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  AsyncDone                                                                 */
+/*!
+    Record the completion of a message sent through the iotsend library
+
+    @param[in]
+        arg
+            pointer to the AsyncSlot of the message
+
+    @param[in]
+        result
+            EOK if the iothub service read the message
+
+==============================================================================*/
+static void AsyncDone( void *arg, int result )
+{
+    AsyncSlot *pSlot = arg;
+
+    if ( result == EOK )
+    {
+        Record( pSlot->pResults, GetTimeUs() - pSlot->t0, pSlot->bytes );
+    }
+    else
+    {
+        pSlot->pResults->errors++;
+    }
+}
+
+/*============================================================================*/
+/*  RunReplay                                                                 */
+/*!
+    Run a trace replay worker process
+
+    The RunReplay function reads the trace and sends the messages of
+    the captured clients assigned to this worker, each at its captured
+    arrival time divided by the replay speed.  The header frames are
+    sent with the worker's own pid so the bodies go to its FIFO.
+
+    @param[in]
+        pState
+            pointer to the load generator state
+
+    @param[in]
+        worker
+            index of this worker
+
+    @param[in]
+        startFd
+            start pipe which is closed by the parent to start the test
+
+    @param[in]
+        resultFd
+            pipe to write the worker results to
+
+    @retval 0 the worker completed
+    @retval 1 the worker failed
+
+==============================================================================*/
+static int RunReplay( LoadState *pState,
+                      int worker,
+                      int startFd,
+                      int resultFd )
+{
+    LoadResults *pResults;
+    Trace *pTrace;
+    TraceRecord record;
+    char fifoName[64];
+    char frame[MAX_HEADER_SIZE];
+    uint32_t pid = getpid();
+    uint64_t start;
+    uint64_t end;
+    uint64_t due;
+    uint64_t t0;
+    uint64_t i = 0;
+    char c;
+    mqd_t mq;
+    int rc = EOK;
+    int result = 1;
+
+    signal( SIGPIPE, SIG_IGN );
+
+    pResults = calloc( 1, sizeof( LoadResults ) );
+    pTrace = Trace_Open( pState->traceFile );
+
+    snprintf( fifoName, sizeof( fifoName ), "/tmp/iothub_%d", pid );
+    unlink( fifoName );
+
+    mq = OpenQueue( pState );
+
+    if ( ( pResults != NULL ) &&
+         ( pTrace != NULL ) &&
+         ( mq != (mqd_t)-1 ) &&
+         ( mkfifo( fifoName, S_IRUSR | S_IWUSR ) == 0 ) )
+    {
+        memcpy( frame, "IOTC", 4 );
+        memcpy( &frame[4], &pid, sizeof( pid ) );
+
+        /* wait for the start signal */
+        (void)read( startFd, &c, 1 );
+
+        start = GetTimeUs();
+        end = start + (uint64_t)pState->duration * 1000000;
+
+        while ( ( ( pState->count == 0 ) || ( i < pState->count ) ) &&
+                ( ( rc = Trace_Read( pTrace, &record ) ) == EOK ) )
+        {
+            if ( (int)( record.pid % pState->workers ) != worker )
+            {
+                continue;
+            }
+
+            t0 = GetTimeUs();
+            if ( pState->speed > 0.0 )
+            {
+                due = start + (uint64_t)( record.timestamp / pState->speed );
+                if ( due > t0 )
+                {
+                    usleep( due - t0 );
+                    t0 = GetTimeUs();
+                }
+                else if ( t0 - due > pResults->maxLag )
+                {
+                    pResults->maxLag = t0 - due;
+                }
+            }
+
+            if ( ( pState->duration > 0 ) && ( t0 >= end ) )
+            {
+                break;
+            }
+
+            i++;
+
+            if ( record.headerLength > sizeof( frame ) - 8 )
+            {
+                pResults->errors++;
+                continue;
+            }
+
+            memcpy( &frame[8], record.headers, record.headerLength );
+
+            if ( SendOne( mq,
+                          fifoName,
+                          frame,
+                          8 + record.headerLength,
+                          record.priority,
+                          record.body,
+                          record.bodyLength ) == 0 )
+            {
+                Record( pResults, GetTimeUs() - t0, record.bodyLength );
+            }
+            else
+            {
+                pResults->errors++;
+            }
+        }
+
+        if ( ( rc != EOK ) && ( rc != ENOENT ) )
+        {
+            fprintf( stderr,
+                     "iotload: %s: %s\n",
+                     pState->traceFile,
+                     strerror( rc ) );
+        }
+
+        result = 0;
+    }
+    else
+    {
+        fprintf( stderr, "iotload: worker %d cannot start replay\n", pid );
+    }
+
+    if ( pResults != NULL )
+    {
+        (void)write( resultFd, pResults, sizeof( LoadResults ) );
+    }
+
+    Trace_Close( pTrace );
+    unlink( fifoName );
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Record                                                                    */
+/*!
+    Record a message accepted by the iothub service
+
+    @param[in,out]
+        pResults
+            pointer to the worker results
+
+    @param[in]
+        latency
+            time taken for the message to be accepted in microseconds
+
+    @param[in]
+        bytes
+            length of the message body
+
+==============================================================================*/
+static void Record( LoadResults *pResults, uint64_t latency, size_t bytes )
+{
+    pResults->messages++;
+    pResults->bytes += bytes;
+    pResults->histogram[Bucket( latency )]++;
+    if ( latency > pResults->maxLatency )
+    {
+        pResults->maxLatency = latency;
+    }
+}
+
+/*============================================================================*/
+/*  BuildHeaders                                                              */
+/*!
+    Build the header block of the generated messages
+
+    The BuildHeaders function writes the ttl, deadline and urgent
+    headers selected on the command line followed by the headers of
+    the profile.
+
+    @param[in]
+        pState
+            pointer to the load generator state
+
+    @param[out]
+        buf
+            pointer to the buffer to write the NUL terminated headers to
+
+    @param[in]
+        size
+            size of the buffer
+
+    @retval length of the headers
+
+==============================================================================*/
+static size_t BuildHeaders( LoadState *pState, char *buf, size_t size )
+{
+    size_t n = 0;
+
+    if ( pState->ttl > 0 )
+    {
+        n += snprintf( &buf[n], size - n, "ttl:%u\n", pState->ttl );
+    }
+
+    if ( pState->deadline > 0 )
+    {
+        n += snprintf( &buf[n],
+                       size - n,
+                       "deadline:%u\n",
+                       pState->deadline );
+    }
+
+    if ( pState->urgent == true )
+    {
+        n += snprintf( &buf[n], size - n, "urgent:1\n" );
+    }
+
+    n += snprintf( &buf[n], size - n, "%s", pState->headers );
+
+    return n;
+}
+
+/*============================================================================*/
+/*  SendOne                                                                   */
+/*!
+    Send one message to the iothub service
+
+    The SendOne function sends the header frame on the iothub message
+    queue, then writes the body to the worker's FIFO.  It returns once
+    the body has been written and the FIFO has been replaced.
+
+    @param[in]
+        mq
+            iothub message queue
+
+    @param[in]
+        fifoName
+            name of the worker's FIFO
+
+    @param[in]
+        frame
+            pointer to the header frame
+
+    @param[in]
+        frameLength
+            length of the header frame
+
+    @param[in]
+        priority
+            message queue priority of the header frame
+
+    @param[in]
+        body
+            pointer to the message body
+
+    @param[in]
+        bodyLength
+            length of the message body
+
+    @retval 0 the message was sent
+    @retval -1 the message could not be sent
+
+==============================================================================*/
+static int SendOne( mqd_t mq,
+                    const char *fifoName,
+                    char *frame,
+                    size_t frameLength,
+                    unsigned int priority,
+                    const char *body,
+                    size_t bodyLength )
+{
+    int result = -1;
+
+    if ( mq_send( mq, frame, frameLength, priority ) == 0 )
+    {
+        result = WriteFifo( fifoName, body, bodyLength );
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  CreateBatch                                                               */
+/*!
+    Create a worker's batch
+
+    The CreateBatch function allocates room for a full batch of the
+    largest messages the worker generates.
+
+    @param[in]
+        pState
+            pointer to the load generator state
+
+    @retval pointer to the batch
+    @retval NULL out of memory
+
+==============================================================================*/
+static LoadBatch *CreateBatch( LoadState *pState )
+{
+    LoadBatch *pBatch;
+
+    pBatch = calloc( 1, sizeof( LoadBatch ) );
+    if ( pBatch != NULL )
+    {
+        pBatch->data = malloc( pState->batch *
+                               ( sizeof( IotBatchEntry ) +
+                                 MAX_HEADER_SIZE +
+                                 pState->maxBody ) );
+        pBatch->times = calloc( pState->batch, sizeof( uint64_t ) );
+        pBatch->bytes = calloc( pState->batch, sizeof( size_t ) );
+        if ( ( pBatch->data == NULL ) ||
+             ( pBatch->times == NULL ) ||
+             ( pBatch->bytes == NULL ) )
+        {
+            DestroyBatch( pBatch );
+            pBatch = NULL;
+        }
+    }
+
+    return pBatch;
+}
+
+/*============================================================================*/
+/*  DestroyBatch                                                              */
+/*!
+    Free a worker's batch
+
+    @param[in]
+        pBatch
+            pointer to the batch to free, or NULL
+
+==============================================================================*/
+static void DestroyBatch( LoadBatch *pBatch )
+{
+    if ( pBatch != NULL )
+    {
+        free( pBatch->data );
+        free( pBatch->times );
+        free( pBatch->bytes );
+        free( pBatch );
+    }
+}
+
+/*============================================================================*/
+/*  AddToBatch                                                                */
+/*!
+    Add a message to a worker's batch
+
+    The AddToBatch function appends the batch entry, the header block
+    of the header frame and the body of a message to the batch.
+
+    @param[in]
+        pBatch
+            pointer to the batch
+
+    @param[in]
+        frame
+            pointer to the IOTC header frame of the message
+
+    @param[in]
+        frameLength
+            length of the header frame
+
+    @param[in]
+        body
+            pointer to the message body
+
+    @param[in]
+        bodyLength
+            length of the message body
+
+    @param[in]
+        t0
+            time the message was generated
+
+==============================================================================*/
+static void AddToBatch( LoadBatch *pBatch,
+                        const char *frame,
+                        size_t frameLength,
+                        const char *body,
+                        size_t bodyLength,
+                        uint64_t t0 )
+{
+    IotBatchEntry entry;
+
+    /* the header block follows the preamble and pid */
+    entry.headerLength = frameLength - 8;
+    entry.bodyLength = bodyLength;
+
+    memcpy( &pBatch->data[pBatch->length], &entry, sizeof( entry ) );
+    pBatch->length += sizeof( entry );
+    memcpy( &pBatch->data[pBatch->length], &frame[8], entry.headerLength );
+    pBatch->length += entry.headerLength;
+    memcpy( &pBatch->data[pBatch->length], body, bodyLength );
+    pBatch->length += bodyLength;
+
+    pBatch->times[pBatch->count] = t0;
+    pBatch->bytes[pBatch->count] = bodyLength;
+    pBatch->count++;
+}
+
+/*============================================================================*/
+/*  FlushBatch                                                                */
+/*!
+    Send a worker's batch
+
+    The FlushBatch function sends a batch frame on the iothub message
+    queue, then writes the whole batch to the worker's FIFO.  The
+    latency of each message is measured from the time it was generated
+    until the batch has been written, so it includes the time spent
+    waiting for the batch to fill.
+
+    @param[in]
+        mq
+            iothub message queue
+
+    @param[in]
+        fifoName
+            name of the worker's FIFO
+
+    @param[in]
+        priority
+            message queue priority of the batch frame
+
+    @param[in]
+        pBatch
+            pointer to the batch, which is emptied
+
+    @param[in]
+        pResults
+            pointer to the worker results to update
+
+==============================================================================*/
+static void FlushBatch( mqd_t mq,
+                        const char *fifoName,
+                        unsigned int priority,
+                        LoadBatch *pBatch,
+                        LoadResults *pResults )
+{
+    IotBatchFrame frame;
+    uint64_t now;
+    uint32_t i;
+    int result = -1;
+
+    memcpy( frame.preamble, IOTBATCH_PREAMBLE, 4 );
+    frame.pid = getpid();
+    frame.count = pBatch->count;
+
+    if ( mq_send( mq, (char *)&frame, sizeof( frame ), priority ) == 0 )
+    {
+        result = WriteFifo( fifoName, pBatch->data, pBatch->length );
+    }
+
+    now = GetTimeUs();
+    for ( i = 0; i < pBatch->count; i++ )
+    {
+        if ( result == 0 )
+        {
+            Record( pResults, now - pBatch->times[i], pBatch->bytes[i] );
+        }
+        else
+        {
+            pResults->errors++;
+        }
+    }
+
+    pBatch->count = 0;
+    pBatch->length = 0;
+}
+
+/*============================================================================*/
+/*  WriteFifo                                                                 */
+/*!
+    Write a message body or a batch to the worker's FIFO
+
+    The WriteFifo function writes the data to the worker's FIFO once the
+    iothub service opens it, then replaces the FIFO.
+
+    @param[in]
+        fifoName
+            name of the worker's FIFO
+
+    @param[in]
+        data
+            pointer to the data to write
+
+    @param[in]
+        len
+            length of the data
+
+    @retval 0 the data was written
+    @retval -1 the data could not be written
+
+==============================================================================*/
+static int WriteFifo( const char *fifoName, const char *data, size_t len )
+{
+    int fd;
+    ssize_t n;
+    int result = -1;
+
+    fd = open( fifoName, O_WRONLY );
+    if ( fd != -1 )
+    {
+        while ( len > 0 )
+        {
+            n = write( fd, data, len );
+            if ( n <= 0 )
+            {
+                break;
+            }
+
+            data += n;
+            len -= n;
+        }
+
+        close( fd );
+
+        /* the iothub service may not have closed its end of the
+           FIFO yet.  Replace the FIFO so the next message cannot
+           be written into this one's body. */
+        unlink( fifoName );
+        if ( ( mkfifo( fifoName, S_IRUSR | S_IWUSR ) == 0 ) &&
+             ( len == 0 ) )
+        {
+            result = 0;
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  OpenQueue                                                                 */
+/*!
+    Open the iothub message queue
+
+    The OpenQueue function waits for the iothub service to create its
+    message queue, up to the configured wait time.
+
+    @param[in]
+        pState
+            pointer to the load generator state
+
+    @retval iothub message queue descriptor
+    @retval -1 the queue could not be opened
+
+==============================================================================*/
+static mqd_t OpenQueue( LoadState *pState )
+{
+    mqd_t mq;
+    unsigned int tries = pState->wait * 1000 / IOTLOAD_OPEN_POLL_MS;
+
+    do
+    {
+        mq = mq_open( pState->queueName, O_WRONLY );
+        if ( mq != (mqd_t)-1 )
+        {
+            break;
+        }
+
+        usleep( IOTLOAD_OPEN_POLL_MS * 1000 );
+    } while ( tries-- > 0 );
+
+    return mq;
+}
+
+/*============================================================================*/
+/*  GenerateBody                                                              */
+/*!
+    Generate a JSON-like message body
+
+    @param[in]
+        len
+            length of the body to generate
+
+    @retval pointer to the generated body
+    @retval NULL out of memory
+
+==============================================================================*/
+static char *GenerateBody( size_t len )
+{
+    char *p;
+    size_t n = 0;
+
+    p = malloc( len + 64 );
+    if ( p != NULL )
+    {
+        while ( n < len )
+        {
+            n += snprintf( &p[n],
+                           len + 64 - n,
+                           "{\"t\":%zu,\"v\":%zu},",
+                           1686731487 + n,
+                           n % 97 );
+        }
+    }
+
+    return p;
+}
+
+/*============================================================================*/
+/*  Merge                                                                     */
+/*!
+    Merge worker results into the total results
+
+    @param[in,out]
+        pTotal
+            pointer to the total results
+
+    @param[in]
+        pResults
+            pointer to the worker results
+
+==============================================================================*/
+static void Merge( LoadResults *pTotal, LoadResults *pResults )
+{
+    int i;
+
+    pTotal->messages += pResults->messages;
+    pTotal->errors += pResults->errors;
+    pTotal->bytes += pResults->bytes;
+
+    if ( pResults->maxLatency > pTotal->maxLatency )
+    {
+        pTotal->maxLatency = pResults->maxLatency;
+    }
+
+    if ( pResults->maxLag > pTotal->maxLag )
+    {
+        pTotal->maxLag = pResults->maxLag;
+    }
+
+    for ( i = 0; i < HISTOGRAM_BUCKETS; i++ )
+    {
+        pTotal->histogram[i] += pResults->histogram[i];
+    }
+}
+
+/*============================================================================*/
+/*  Percentile                                                                */
+/*!
+    Get a latency percentile from the histogram
+
+    @param[in]
+        pResults
+            pointer to the results containing the histogram
+
+    @param[in]
+        p
+            percentile to calculate (0-100)
+
+    @retval latency in microseconds
+
+==============================================================================*/
+static uint64_t Percentile( LoadResults *pResults, double p )
+{
+    uint64_t target;
+    uint64_t sum = 0;
+    int i;
+
+    target = (uint64_t)( ( p / 100.0 ) * pResults->messages );
+    if ( target >= pResults->messages )
+    {
+        target = pResults->messages - 1;
+    }
+
+    for ( i = 0; i < HISTOGRAM_BUCKETS; i++ )
+    {
+        sum += pResults->histogram[i];
+        if ( sum > target )
+        {
+            break;
+        }
+    }
+
+    return BucketValue( i );
+}
+
+/*============================================================================*/
+/*  Report                                                                    */
+/*!
+    Report the load test results
+
+    @param[in]
+        pState
+            pointer to the load generator state
+
+    @param[in]
+        pTotal
+            pointer to the merged results
+
+    @param[in]
+        elapsed
+            test duration in seconds
+
+==============================================================================*/
+static void Report( LoadState *pState, LoadResults *pTotal, double elapsed )
+{
+    double throughput = pTotal->messages / elapsed;
+    double mbps = ( pTotal->bytes / elapsed ) / ( 1024.0 * 1024.0 );
+
+    if ( pState->json )
+    {
+        fprintf( stdout,
+                 "{\"scenario\":\"%s\",\"profile\":\"%s\",\"workers\":%d,"
+                 "\"messages\":%lu,\"errors\":%lu,\"bytes\":%lu,"
+                 "\"elapsed\":%.3f,\"throughput\":%.1f,\"mbps\":%.3f,"
+                 "\"latency_us\":{\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,"
+                 "\"max\":%lu},\"lag_us\":%lu}\n",
+                 ( pState->scenario != NULL ) ? pState->scenario : "",
+                 pState->profile,
+                 pState->workers,
+                 (unsigned long)pTotal->messages,
+                 (unsigned long)pTotal->errors,
+                 (unsigned long)pTotal->bytes,
+                 elapsed,
+                 throughput,
+                 mbps,
+                 (unsigned long)Percentile( pTotal, 50.0 ),
+                 (unsigned long)Percentile( pTotal, 90.0 ),
+                 (unsigned long)Percentile( pTotal, 99.0 ),
+                 (unsigned long)pTotal->maxLatency,
+                 (unsigned long)pTotal->maxLag );
+    }
+    else
+    {
+        fprintf( stdout,
+                 "%lu messages (%lu errors) in %.3fs: "
+                 "%.1f msgs/s %.3f MB/s\n"
+                 "latency us: p50 %lu p90 %lu p99 %lu max %lu\n",
+                 (unsigned long)pTotal->messages,
+                 (unsigned long)pTotal->errors,
+                 elapsed,
+                 throughput,
+                 mbps,
+                 (unsigned long)Percentile( pTotal, 50.0 ),
+                 (unsigned long)Percentile( pTotal, 90.0 ),
+                 (unsigned long)Percentile( pTotal, 99.0 ),
+                 (unsigned long)pTotal->maxLatency );
+
+        if ( pState->traceFile != NULL )
+        {
+            fprintf( stdout,
+                     "replay lag us: max %lu\n",
+                     (unsigned long)pTotal->maxLag );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Bucket                                                                    */
+/*!
+    Map a latency to its log-linear histogram bucket
+
+    Values below HISTOGRAM_SUB_BUCKETS have their own bucket.  Larger
+    values are split into HISTOGRAM_SUB_BUCKETS linear buckets per
+    power of two, giving a relative error below 7%.
+
+    @param[in]
+        us
+            latency in microseconds
+
+    @retval histogram bucket index
+
+==============================================================================*/
+static int Bucket( uint64_t us )
+{
+    int msb;
+    int bucket;
+
+    if ( us < HISTOGRAM_SUB_BUCKETS )
+    {
+        return (int)us;
+    }
+
+    msb = 63 - __builtin_clzll( us );
+    bucket = ( msb - 3 ) * HISTOGRAM_SUB_BUCKETS +
+             (int)( ( us >> ( msb - 4 ) ) & ( HISTOGRAM_SUB_BUCKETS - 1 ) );
+
+    return ( bucket < HISTOGRAM_BUCKETS ) ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/*============================================================================*/
+/*  BucketValue                                                               */
+/*!
+    Get the lower bound of a histogram bucket
+
+    @param[in]
+        bucket
+            histogram bucket index
+
+    @retval lower bound of the bucket in microseconds
+
+==============================================================================*/
+static uint64_t BucketValue( int bucket )
+{
+    int msb;
+    uint64_t sub;
+
+    if ( bucket < HISTOGRAM_SUB_BUCKETS )
+    {
+        return (uint64_t)bucket;
+    }
+
+    msb = bucket / HISTOGRAM_SUB_BUCKETS + 3;
+    sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+    return ( HISTOGRAM_SUB_BUCKETS + sub ) << ( msb - 4 );
+}
+
+/*============================================================================*/
+/*  GetTimeUs                                                                 */
+/*!
+    Get the monotonic time in microseconds
+
+==============================================================================*/
+static uint64_t GetTimeUs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*============================================================================*/
+/*  ReadAll                                                                   */
+/*!
+    Read exactly len bytes from a descriptor
+
+    @retval 0 the requested bytes were read
+    @retval -1 end of file or read error
+
+==============================================================================*/
+static int ReadAll( int fd, void *buf, size_t len )
+{
+    char *p = buf;
+    ssize_t n;
+
+    while ( len > 0 )
+    {
+        n = read( fd, p, len );
+        if ( n > 0 )
+        {
+            p += n;
+            len -= n;
+        }
+        else if ( ( n < 0 ) && ( errno == EINTR ) )
+        {
+            continue;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  usage                                                                     */
+/*!
+    Display the application usage
+
+    @param[in]
+       cmdname
+            pointer to the invoked command name
+
+==============================================================================*/
+static void usage( char *cmdname )
+{
+    if( cmdname != NULL )
+    {
+        fprintf(stderr,
+                "usage: %s [-h] [-j] [-s scenario] [-q queue] [-c workers]\n"
+                "          [-n count] [-d seconds] [-r rate] [-b size]\n"
+                "          [-p profile] [-w seconds] [-t ttl] [-D deadline]\n"
+                "          [-P priority] [-R trace] [-x speed] [-u]\n"
+                "          [-B batch] [-A]\n"
+                " [-h] : display this help\n"
+                " [-j] : JSON output\n"
+                " [-s scenario] : scenario label for the report\n"
+                " [-q queue] : iothub message queue (default /iothub)\n"
+                " [-c workers] : number of worker processes\n"
+                " [-n count] : messages per worker (0 = unlimited)\n"
+                " [-d seconds] : maximum test duration\n"
+                " [-r rate] : messages/s per worker (0 = unlimited)\n"
+                " [-b size] : body size in bytes, or min:max\n"
+                " [-p profile] : header profile: none, small, typical, "
+                "large\n"
+                " [-w seconds] : time to wait for the iothub queue\n"
+                " [-t ttl] : message time to live in seconds\n"
+                " [-D deadline] : message delivery deadline in ms\n"
+                " [-P priority] : message queue priority (default 0)\n"
+                " [-R trace] : replay a trace captured with iothub -r\n"
+                " [-x speed] : replay speed multiplier "
+                "(default 1, 0 = maximum)\n"
+                " [-u] : mark the messages urgent\n"
+                " [-B batch] : messages sent in each batch frame\n"
+                " [-A] : send through the asynchronous iotsend library\n",
+                cmdname );
+    }
+}
+
+/*============================================================================*/
+/*  ProcessOptions                                                            */
+/*!
+    Process the command line options
+
+    @param[in]
+        argC
+            number of arguments
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @param[in]
+        pState
+            pointer to the load generator state object
+
+==============================================================================*/
+static int ProcessOptions( int argC, char *argV[], LoadState *pState )
+{
+    int c;
+    char *p;
+    const char *options = "hjs:q:c:n:d:r:b:p:w:t:D:P:R:x:uB:A";
+
+    if( ( pState != NULL ) &&
+        ( argV != NULL ) )
+    {
+        while( ( c = getopt( argC, argV, options ) ) != -1 )
+        {
+            switch( c )
+            {
+                case 'h':
+                    usage( argV[0] );
+                    exit( 0 );
+                    break;
+
+                case 'j':
+                    pState->json = true;
+                    break;
+
+                case 's':
+                    pState->scenario = optarg;
+                    break;
+
+                case 'q':
+                    pState->queueName = optarg;
+                    break;
+
+                case 'c':
+                    pState->workers = atoi( optarg );
+                    if ( ( pState->workers < 1 ) ||
+                         ( pState->workers > MAX_WORKERS ) )
+                    {
+                        pState->workers = 1;
+                    }
+                    break;
+
+                case 'n':
+                    pState->count = strtoull( optarg, NULL, 0 );
+                    break;
+
+                case 'd':
+                    pState->duration = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'r':
+                    pState->rate = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'b':
+                    pState->minBody = strtoul( optarg, &p, 0 );
+                    pState->maxBody = ( *p == ':' )
+                                      ? strtoul( p + 1, NULL, 0 )
+                                      : pState->minBody;
+                    if ( pState->maxBody < pState->minBody )
+                    {
+                        pState->maxBody = pState->minBody;
+                    }
+                    break;
+
+                case 'p':
+                    pState->profile = optarg;
+                    break;
+
+                case 'w':
+                    pState->wait = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 't':
+                    pState->ttl = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'D':
+                    pState->deadline = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'P':
+                    pState->priority = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'u':
+                    pState->urgent = true;
+                    break;
+
+                case 'A':
+                    pState->async = true;
+                    break;
+
+                case 'B':
+                    pState->batch = strtoul( optarg, NULL, 0 );
+                    if ( pState->batch > IOTBATCH_MAX_COUNT )
+                    {
+                        pState->batch = IOTBATCH_MAX_COUNT;
+                    }
+                    break;
+
+                case 'R':
+                    pState->traceFile = optarg;
+                    break;
+
+                case 'x':
+                    pState->speed = strtod( optarg, NULL );
+                    if ( pState->speed < 0.0 )
+                    {
+                        pState->speed = 1.0;
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*! @}
+ * end of iotload group */
@@ -0,0 +1,1455 @@
+/*==============================================================================
+MIT License
+
+Copyright (c) 2023 Trevor Monk
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+/*!
+ * @defgroup iotproxy iotproxy
+ * @brief Network impairment proxy for offline testing
+ * @{
+ */
+
+/*============================================================================*/
+/*!
+@file iotproxy.c
+
+    Network impairment proxy
+
+    The iotproxy application is a loopback TCP proxy which sits between
+    the iothub service and the local hub stand-in (hubsim) to model a
+    poor cellular link.  In each direction it can add latency and
+    jitter, cap the bandwidth, and stall all traffic periodically.
+    It can also reset connections at random intervals, and take the
+    link down periodically: during an outage all connections are reset
+    and new connections are refused.
+
+    Data is delayed in order: each chunk read from one side is released
+    to the other side no earlier than the chunk before it.
+
+    On termination it reports the connection and byte counts and the
+    outage windows, optionally as JSON to a statistics file for the
+    soak benchmark runner.
+
+*/
+/*============================================================================*/
+
+/*==============================================================================
+        Includes
+==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*==============================================================================
+        Private definitions
+==============================================================================*/
+
+/*! maximum number of simultaneous proxied connections */
+#define MAX_CONNECTIONS ( 32 )
+
+/*! size of a single read from a socket */
+#define CHUNK_SIZE ( 16 * 1024 )
+
+/*! maximum number of bytes buffered in one direction before the
+    proxy stops reading from the source */
+#define MAX_BUFFERED ( 4 * 1024 * 1024 )
+
+/*! maximum number of outage windows recorded for the report */
+#define MAX_OUTAGES ( 256 )
+
+/*! block of data in flight in one direction */
+typedef struct chunk
+{
+    /*! time the chunk may be released, in microseconds */
+    uint64_t due;
+
+    /*! number of bytes in the chunk */
+    size_t len;
+
+    /*! number of bytes already written */
+    size_t offset;
+
+    /*! pointer to the next chunk */
+    struct chunk *pNext;
+
+    /*! chunk data */
+    char data[];
+
+} Chunk;
+
+/*! one direction of a proxied connection */
+typedef struct pipeDir
+{
+    /*! socket to read from */
+    int *pSrc;
+
+    /*! socket to write to */
+    int *pDst;
+
+    /*! forwarded byte counter for this direction */
+    uint64_t *pBytes;
+
+    /*! oldest chunk in flight */
+    Chunk *pHead;
+
+    /*! newest chunk in flight */
+    Chunk *pTail;
+
+    /*! number of bytes in flight */
+    size_t buffered;
+
+    /*! available bandwidth tokens in bytes */
+    double tokens;
+
+    /*! time the tokens were last refilled, in microseconds */
+    uint64_t refill;
+
+    /*! true once the source has closed */
+    bool eof;
+
+} PipeDir;
+
+/*! proxied connection */
+typedef struct connection
+{
+    /*! socket accepted from the iothub service, or -1 if unused */
+    int client;
+
+    /*! socket connected to the upstream hub stand-in */
+    int upstream;
+
+    /*! client to upstream direction */
+    PipeDir up;
+
+    /*! upstream to client direction */
+    PipeDir down;
+
+    /*! time the connection will be reset, or 0 */
+    uint64_t resetAt;
+
+} Connection;
+
+/*! proxy state */
+typedef struct proxyState
+{
+    /*! TCP listen port */
+    int port;
+
+    /*! upstream address in host:port form */
+    const char *upstream;
+
+    /*! one way latency in milliseconds */
+    unsigned int latencyMs;
+
+    /*! maximum additional random one way delay in milliseconds */
+    unsigned int jitterMs;
+
+    /*! bandwidth cap per direction in bytes per second (0 = none) */
+    unsigned int bandwidth;
+
+    /*! stall period in milliseconds (0 = no stalls) */
+    unsigned int stallPeriodMs;
+
+    /*! stall duration in milliseconds */
+    unsigned int stallMs;
+
+    /*! mean interval between connection resets in milliseconds */
+    unsigned int resetMs;
+
+    /*! outage period in milliseconds (0 = no outages) */
+    unsigned int outagePeriodMs;
+
+    /*! outage duration in milliseconds */
+    unsigned int outageMs;
+
+    /*! verbose flag */
+    bool verbose;
+
+    /*! name of the JSON statistics file */
+    const char *statsFile;
+
+    /*! listening socket */
+    int listenFd;
+
+    /*! proxied connections */
+    Connection connections[MAX_CONNECTIONS];
+
+    /*! time the proxy was started, in microseconds */
+    uint64_t startTime;
+
+    /*! wall clock time the proxy was started, in microseconds */
+    uint64_t startRealTime;
+
+    /*! true while the link is down */
+    bool down;
+
+    /*! number of connections accepted */
+    uint64_t accepted;
+
+    /*! number of connections refused during outages */
+    uint64_t refused;
+
+    /*! number of connections reset */
+    uint64_t resets;
+
+    /*! number of bytes forwarded upstream */
+    uint64_t bytesUp;
+
+    /*! number of bytes forwarded downstream */
+    uint64_t bytesDown;
+
+    /*! outage start and end times relative to the start, in ms */
+    uint64_t outages[MAX_OUTAGES][2];
+
+    /*! number of outages recorded */
+    int outageCount;
+
+} ProxyState;
+
+/*==============================================================================
+        Private file scoped variables
+==============================================================================*/
+
+/*! proxy state */
+static ProxyState state;
+
+/*! set by the termination handler to stop the proxy */
+static volatile sig_atomic_t done = 0;
+
+/*==============================================================================
+        Private function declarations
+==============================================================================*/
+
+int main( int argc, char **argv );
+static int ProcessOptions( int argC, char *argV[], ProxyState *pState );
+static void usage( char *cmdname );
+static void SetupTerminationHandler( void );
+static void TerminationHandler( int signum );
+static int Listen( ProxyState *pState );
+static int Dial( const char *address );
+static void Run( ProxyState *pState );
+static void Accept( ProxyState *pState, uint64_t now );
+static int Fill( ProxyState *pState, PipeDir *pDir, uint64_t now );
+static int Drain( ProxyState *pState, PipeDir *pDir, uint64_t now );
+static int Forward( ProxyState *pState, Connection *pConn, short revents[2],
+                    uint64_t now );
+static void UpdateOutage( ProxyState *pState, uint64_t now );
+static bool Stalled( ProxyState *pState, uint64_t now );
+static uint64_t NextEvent( ProxyState *pState, uint64_t now );
+static uint64_t DirEvent( ProxyState *pState, PipeDir *pDir, uint64_t now );
+static void CloseConnection( ProxyState *pState,
+                             Connection *pConn,
+                             bool reset );
+static void ScheduleReset( ProxyState *pState,
+                           Connection *pConn,
+                           uint64_t now );
+static void WriteStats( ProxyState *pState );
+static uint64_t GetTimeUs( void );
+
+/*==============================================================================
+        Private function definitions
+==============================================================================*/
+
+/*============================================================================*/
+/*  main                                                                      */
+/*!
+    Main entry point for the iotproxy application
+
+    @param[in]
+        argc
+            number of arguments on the command line
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @retval 0 the proxy terminated normally
+    @retval 1 the proxy could not be started
+
+==============================================================================*/
+int main( int argc, char **argv )
+{
+    struct timespec ts;
+    int result = 1;
+    int i;
+
+    state.port = 18801;
+    state.listenFd = -1;
+    for ( i = 0; i < MAX_CONNECTIONS; i++ )
+    {
+        state.connections[i].client = -1;
+        state.connections[i].upstream = -1;
+    }
+
+    ProcessOptions( argc, argv, &state );
+
+    SetupTerminationHandler();
+    signal( SIGPIPE, SIG_IGN );
+    srand( time( NULL ) ^ getpid() );
+
+    if ( state.upstream == NULL )
+    {
+        usage( argv[0] );
+    }
+    else if ( Listen( &state ) == 0 )
+    {
+        clock_gettime( CLOCK_REALTIME, &ts );
+        state.startRealTime = (uint64_t)ts.tv_sec * 1000000 +
+                              ts.tv_nsec / 1000;
+        state.startTime = GetTimeUs();
+
+        Run( &state );
+
+        WriteStats( &state );
+        result = 0;
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Listen                                                                    */
+/*!
+    Create the listening socket on the loopback interface
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @retval 0 the listening socket was created
+    @retval -1 the listening socket could not be created
+
+==============================================================================*/
+static int Listen( ProxyState *pState )
+{
+    int result = -1;
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    fd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0 );
+    if ( fd != -1 )
+    {
+        setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons( pState->port );
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+        if ( ( bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) == 0 ) &&
+             ( listen( fd, 16 ) == 0 ) )
+        {
+            pState->listenFd = fd;
+            result = 0;
+        }
+        else
+        {
+            fprintf( stderr,
+                     "iotproxy: cannot listen on port %d: %s\n",
+                     pState->port,
+                     strerror( errno ) );
+            close( fd );
+        }
+    }
+
+    return result;
+}
+
+/*============================================================================*/
+/*  Dial                                                                      */
+/*!
+    Open a non-blocking TCP connection to the upstream address
+
+    The connection is made synchronously (the upstream is on the local
+    host) and then switched to non-blocking mode.
+
+    @param[in]
+        address
+            address in host:port form
+
+    @retval connected socket descriptor
+    @retval -1 the connection failed
+
+==============================================================================*/
+static int Dial( const char *address )
+{
+    int fd = -1;
+    char host[256];
+    const char *p;
+    size_t len;
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    struct addrinfo *ai;
+    int one = 1;
+
+    p = strrchr( address, ':' );
+    len = ( p != NULL ) ? (size_t)( p - address ) : 0;
+    if ( ( p != NULL ) && ( len < sizeof( host ) ) )
+    {
+        memcpy( host, address, len );
+        host[len] = '\0';
+
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if ( getaddrinfo( host, p + 1, &hints, &res ) == 0 )
+        {
+            for ( ai = res; ai != NULL; ai = ai->ai_next )
+            {
+                fd = socket( ai->ai_family,
+                             ai->ai_socktype | SOCK_CLOEXEC,
+                             ai->ai_protocol );
+                if ( fd != -1 )
+                {
+                    if ( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 )
+                    {
+                        setsockopt( fd,
+                                    IPPROTO_TCP,
+                                    TCP_NODELAY,
+                                    &one,
+                                    sizeof( one ) );
+                        fcntl( fd, F_SETFL, O_NONBLOCK );
+                        break;
+                    }
+
+                    close( fd );
+                    fd = -1;
+                }
+            }
+
+            freeaddrinfo( res );
+        }
+    }
+
+    return fd;
+}
+
+/*============================================================================*/
+/*  Run                                                                       */
+/*!
+    Run the proxy event loop
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+==============================================================================*/
+static void Run( ProxyState *pState )
+{
+    struct pollfd fds[2 * MAX_CONNECTIONS + 1];
+    Connection *map[2 * MAX_CONNECTIONS + 1];
+    short revents[2];
+    Connection *pConn;
+    nfds_t nfds;
+    uint64_t now;
+    uint64_t next;
+    int timeout;
+    int i;
+    int n;
+
+    while ( !done )
+    {
+        now = GetTimeUs();
+        UpdateOutage( pState, now );
+
+        nfds = 0;
+        fds[nfds].fd = pState->listenFd;
+        fds[nfds].events = POLLIN;
+        map[nfds++] = NULL;
+
+        for ( i = 0; i < MAX_CONNECTIONS; i++ )
+        {
+            pConn = &pState->connections[i];
+            if ( pConn->client != -1 )
+            {
+                /* client side */
+                fds[nfds].fd = pConn->client;
+                fds[nfds].events = 0;
+                if ( ( pConn->up.buffered < MAX_BUFFERED ) &&
+                     ( pConn->up.eof == false ) )
+                {
+                    fds[nfds].events |= POLLIN;
+                }
+                if ( pConn->down.pHead != NULL )
+                {
+                    fds[nfds].events |= POLLOUT;
+                }
+                map[nfds++] = pConn;
+
+                /* upstream side */
+                fds[nfds].fd = pConn->upstream;
+                fds[nfds].events = 0;
+                if ( ( pConn->down.buffered < MAX_BUFFERED ) &&
+                     ( pConn->down.eof == false ) )
+                {
+                    fds[nfds].events |= POLLIN;
+                }
+                if ( pConn->up.pHead != NULL )
+                {
+                    fds[nfds].events |= POLLOUT;
+                }
+                map[nfds++] = pConn;
+            }
+        }
+
+        next = NextEvent( pState, now );
+        timeout = ( next == UINT64_MAX )
+                  ? -1
+                  : (int)( ( next - now + 999 ) / 1000 );
+
+        n = poll( fds, nfds, timeout );
+        if ( ( n < 0 ) && ( errno != EINTR ) )
+        {
+            fprintf( stderr, "iotproxy: poll: %s\n", strerror( errno ) );
+            break;
+        }
+
+        now = GetTimeUs();
+        UpdateOutage( pState, now );
+
+        if ( ( n > 0 ) && ( fds[0].revents & POLLIN ) )
+        {
+            Accept( pState, now );
+        }
+
+        for ( i = 1; i < (int)nfds; i += 2 )
+        {
+            pConn = map[i];
+            if ( pConn->client == -1 )
+            {
+                /* closed by an outage */
+                continue;
+            }
+
+            revents[0] = ( n > 0 ) ? fds[i].revents : 0;
+            revents[1] = ( n > 0 ) ? fds[i + 1].revents : 0;
+
+            if ( ( pConn->resetAt != 0 ) && ( now >= pConn->resetAt ) )
+            {
+                CloseConnection( pState, pConn, true );
+            }
+            else if ( Forward( pState, pConn, revents, now ) != 0 )
+            {
+                CloseConnection( pState, pConn, false );
+            }
+        }
+    }
+}
+
+/*============================================================================*/
+/*  Accept                                                                    */
+/*!
+    Accept a connection from the iothub service
+
+    The connection is refused while the link is down.  Otherwise a
+    connection is made to the upstream hub stand-in.
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        now
+            current time in microseconds
+
+==============================================================================*/
+static void Accept( ProxyState *pState, uint64_t now )
+{
+    Connection *pConn = NULL;
+    struct linger lg = { 1, 0 };
+    int one = 1;
+    int fd;
+    int i;
+
+    fd = accept4( pState->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if ( fd == -1 )
+    {
+        return;
+    }
+
+    for ( i = 0; i < MAX_CONNECTIONS; i++ )
+    {
+        if ( pState->connections[i].client == -1 )
+        {
+            pConn = &pState->connections[i];
+            break;
+        }
+    }
+
+    if ( ( pState->down == false ) && ( pConn != NULL ) )
+    {
+        memset( pConn, 0, sizeof( Connection ) );
+        pConn->upstream = Dial( pState->upstream );
+        if ( pConn->upstream != -1 )
+        {
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+
+            pConn->client = fd;
+            pConn->up.pSrc = &pConn->client;
+            pConn->up.pDst = &pConn->upstream;
+            pConn->up.pBytes = &pState->bytesUp;
+            pConn->up.refill = now;
+            pConn->down.pSrc = &pConn->upstream;
+            pConn->down.pDst = &pConn->client;
+            pConn->down.pBytes = &pState->bytesDown;
+            pConn->down.refill = now;
+
+            ScheduleReset( pState, pConn, now );
+
+            pState->accepted++;
+            if ( pState->verbose )
+            {
+                fprintf( stdout, "iotproxy: connection accepted\n" );
+            }
+
+            return;
+        }
+
+        pConn->client = -1;
+        fprintf( stderr,
+                 "iotproxy: cannot connect to %s\n",
+                 pState->upstream );
+    }
+
+    /* refuse the connection with a reset */
+    setsockopt( fd, SOL_SOCKET, SO_LINGER, &lg, sizeof( lg ) );
+    close( fd );
+    pState->refused++;
+}
+
+/*============================================================================*/
+/*  Forward                                                                   */
+/*!
+    Move data through both directions of a connection
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        pConn
+            pointer to the connection
+
+    @param[in]
+        revents
+            poll events for the client and upstream sockets
+
+    @param[in]
+        now
+            current time in microseconds
+
+    @retval 0 the connection is still open
+    @retval -1 the connection has closed
+
+==============================================================================*/
+static int Forward( ProxyState *pState, Connection *pConn, short revents[2],
+                    uint64_t now )
+{
+    if ( ( ( revents[0] & ( POLLIN | POLLHUP | POLLERR ) ) &&
+           ( Fill( pState, &pConn->up, now ) != 0 ) ) ||
+         ( ( revents[1] & ( POLLIN | POLLHUP | POLLERR ) ) &&
+           ( Fill( pState, &pConn->down, now ) != 0 ) ) )
+    {
+        return -1;
+    }
+
+    if ( ( Drain( pState, &pConn->up, now ) != 0 ) ||
+         ( Drain( pState, &pConn->down, now ) != 0 ) )
+    {
+        return -1;
+    }
+
+    /* close once either side has closed and its data is delivered */
+    if ( ( ( pConn->up.eof == true ) && ( pConn->up.pHead == NULL ) ) ||
+         ( ( pConn->down.eof == true ) && ( pConn->down.pHead == NULL ) ) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  Fill                                                                      */
+/*!
+    Read data from the source of a direction into delayed chunks
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        pDir
+            pointer to the direction
+
+    @param[in]
+        now
+            current time in microseconds
+
+    @retval 0 the source is still open
+    @retval -1 read error
+
+==============================================================================*/
+static int Fill( ProxyState *pState, PipeDir *pDir, uint64_t now )
+{
+    Chunk *pChunk;
+    uint64_t delay;
+    ssize_t n;
+
+    pChunk = malloc( sizeof( Chunk ) + CHUNK_SIZE );
+    if ( pChunk == NULL )
+    {
+        return -1;
+    }
+
+    n = read( *pDir->pSrc, pChunk->data, CHUNK_SIZE );
+    if ( n <= 0 )
+    {
+        free( pChunk );
+
+        if ( n == 0 )
+        {
+            pDir->eof = true;
+            return 0;
+        }
+
+        return ( ( errno == EAGAIN ) || ( errno == EINTR ) ) ? 0 : -1;
+    }
+
+    delay = (uint64_t)pState->latencyMs * 1000;
+    if ( pState->jitterMs > 0 )
+    {
+        delay += (uint64_t)( rand() % ( pState->jitterMs * 1000 + 1 ) );
+    }
+
+    pChunk->due = now + delay;
+    pChunk->len = n;
+    pChunk->offset = 0;
+    pChunk->pNext = NULL;
+
+    if ( pDir->pTail != NULL )
+    {
+        /* jitter must not reorder the stream */
+        if ( pChunk->due < pDir->pTail->due )
+        {
+            pChunk->due = pDir->pTail->due;
+        }
+
+        pDir->pTail->pNext = pChunk;
+    }
+    else
+    {
+        pDir->pHead = pChunk;
+    }
+
+    pDir->pTail = pChunk;
+    pDir->buffered += n;
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  Drain                                                                     */
+/*!
+    Write the due chunks of a direction to its destination
+
+    Nothing is written during a stall.  The amount written is limited
+    by the bandwidth token bucket, which holds at most 10ms of tokens.
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        pDir
+            pointer to the direction
+
+    @param[in]
+        now
+            current time in microseconds
+
+    @retval 0 the destination is still open
+    @retval -1 write error
+
+==============================================================================*/
+static int Drain( ProxyState *pState, PipeDir *pDir, uint64_t now )
+{
+    Chunk *pChunk;
+    double burst;
+    size_t len;
+    ssize_t n;
+
+    if ( pState->bandwidth > 0 )
+    {
+        burst = pState->bandwidth / 100.0;
+        if ( burst < 1500.0 )
+        {
+            burst = 1500.0;
+        }
+
+        pDir->tokens += ( now - pDir->refill ) * pState->bandwidth / 1e6;
+        if ( pDir->tokens > burst )
+        {
+            pDir->tokens = burst;
+        }
+    }
+
+    pDir->refill = now;
+
+    if ( Stalled( pState, now ) == true )
+    {
+        return 0;
+    }
+
+    while ( ( ( pChunk = pDir->pHead ) != NULL ) &&
+            ( pChunk->due <= now ) )
+    {
+        len = pChunk->len - pChunk->offset;
+        if ( pState->bandwidth > 0 )
+        {
+            if ( pDir->tokens < 1.0 )
+            {
+                break;
+            }
+
+            if ( len > (size_t)pDir->tokens )
+            {
+                len = (size_t)pDir->tokens;
+            }
+        }
+
+        n = write( *pDir->pDst, &pChunk->data[pChunk->offset], len );
+        if ( n < 0 )
+        {
+            return ( ( errno == EAGAIN ) || ( errno == EINTR ) ) ? 0 : -1;
+        }
+
+        if ( pState->bandwidth > 0 )
+        {
+            pDir->tokens -= n;
+        }
+
+        *pDir->pBytes += n;
+        pChunk->offset += n;
+        pDir->buffered -= n;
+
+        if ( pChunk->offset == pChunk->len )
+        {
+            pDir->pHead = pChunk->pNext;
+            if ( pDir->pHead == NULL )
+            {
+                pDir->pTail = NULL;
+            }
+
+            free( pChunk );
+        }
+
+        if ( (size_t)n < len )
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  UpdateOutage                                                              */
+/*!
+    Take the link down or bring it back up
+
+    The link is down for the last outageMs of every outagePeriodMs, so
+    each period starts with a clean link.  When the link goes down all
+    connections are reset.
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        now
+            current time in microseconds
+
+==============================================================================*/
+static void UpdateOutage( ProxyState *pState, uint64_t now )
+{
+    uint64_t t;
+    bool down = false;
+    int i;
+
+    if ( pState->outagePeriodMs > 0 )
+    {
+        t = ( ( now - pState->startTime ) / 1000 ) % pState->outagePeriodMs;
+        down = ( t >= pState->outagePeriodMs - pState->outageMs );
+    }
+
+    if ( down == pState->down )
+    {
+        return;
+    }
+
+    pState->down = down;
+    t = ( now - pState->startTime ) / 1000;
+
+    if ( down == true )
+    {
+        if ( pState->outageCount < MAX_OUTAGES )
+        {
+            pState->outages[pState->outageCount][0] = t;
+            pState->outages[pState->outageCount][1] = t + pState->outageMs;
+        }
+
+        for ( i = 0; i < MAX_CONNECTIONS; i++ )
+        {
+            if ( pState->connections[i].client != -1 )
+            {
+                CloseConnection( pState, &pState->connections[i], true );
+            }
+        }
+    }
+    else if ( pState->outageCount < MAX_OUTAGES )
+    {
+        pState->outages[pState->outageCount++][1] = t;
+    }
+
+    if ( pState->verbose )
+    {
+        fprintf( stdout,
+                 "iotproxy: link %s at %lu ms\n",
+                 down ? "down" : "up",
+                 (unsigned long)t );
+    }
+}
+
+/*============================================================================*/
+/*  Stalled                                                                   */
+/*!
+    Determine if traffic is stalled
+
+    Traffic is stalled for the first stallMs of every stallPeriodMs.
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        now
+            current time in microseconds
+
+    @retval true traffic is stalled
+    @retval false traffic is flowing
+
+==============================================================================*/
+static bool Stalled( ProxyState *pState, uint64_t now )
+{
+    uint64_t t;
+
+    if ( pState->stallPeriodMs == 0 )
+    {
+        return false;
+    }
+
+    t = ( ( now - pState->startTime ) / 1000 ) % pState->stallPeriodMs;
+
+    return ( t < pState->stallMs );
+}
+
+/*============================================================================*/
+/*  NextEvent                                                                 */
+/*!
+    Get the time of the next timed event
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        now
+            current time in microseconds
+
+    @retval time of the next event in microseconds
+    @retval UINT64_MAX no timed event is pending
+
+==============================================================================*/
+static uint64_t NextEvent( ProxyState *pState, uint64_t now )
+{
+    uint64_t next = UINT64_MAX;
+    uint64_t t;
+    Connection *pConn;
+    int i;
+
+    if ( pState->outagePeriodMs > 0 )
+    {
+        /* re-evaluate the outage state at least every 10ms */
+        next = now + 10000;
+    }
+
+    for ( i = 0; i < MAX_CONNECTIONS; i++ )
+    {
+        pConn = &pState->connections[i];
+        if ( pConn->client != -1 )
+        {
+            if ( ( pConn->resetAt != 0 ) && ( pConn->resetAt < next ) )
+            {
+                next = pConn->resetAt;
+            }
+
+            t = DirEvent( pState, &pConn->up, now );
+            if ( t < next )
+            {
+                next = t;
+            }
+
+            t = DirEvent( pState, &pConn->down, now );
+            if ( t < next )
+            {
+                next = t;
+            }
+        }
+    }
+
+    return ( next < now ) ? now : next;
+}
+
+/*============================================================================*/
+/*  DirEvent                                                                  */
+/*!
+    Get the time at which a direction can next make progress
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        pDir
+            pointer to the direction
+
+    @param[in]
+        now
+            current time in microseconds
+
+    @retval time of the next event in microseconds
+    @retval UINT64_MAX nothing is in flight
+
+==============================================================================*/
+static uint64_t DirEvent( ProxyState *pState, PipeDir *pDir, uint64_t now )
+{
+    uint64_t next;
+    uint64_t t;
+
+    if ( pDir->pHead == NULL )
+    {
+        return UINT64_MAX;
+    }
+
+    next = pDir->pHead->due;
+
+    if ( Stalled( pState, now ) == true )
+    {
+        t = now + ( pState->stallMs -
+                    ( ( now - pState->startTime ) / 1000 ) %
+                    pState->stallPeriodMs ) * 1000;
+        if ( t > next )
+        {
+            next = t;
+        }
+    }
+
+    if ( ( pState->bandwidth > 0 ) && ( pDir->tokens < 1.0 ) )
+    {
+        t = now + (uint64_t)( ( 1.0 - pDir->tokens ) * 1e6 /
+                              pState->bandwidth ) + 1;
+        if ( t > next )
+        {
+            next = t;
+        }
+    }
+
+    return next;
+}
+
+/*============================================================================*/
+/*  ScheduleReset                                                             */
+/*!
+    Schedule a random reset of a connection
+
+    The reset time is chosen uniformly between 0.5 and 1.5 times the
+    mean reset interval.
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        pConn
+            pointer to the connection
+
+    @param[in]
+        now
+            current time in microseconds
+
+==============================================================================*/
+static void ScheduleReset( ProxyState *pState,
+                           Connection *pConn,
+                           uint64_t now )
+{
+    uint64_t interval;
+
+    pConn->resetAt = 0;
+
+    if ( pState->resetMs > 0 )
+    {
+        interval = (uint64_t)pState->resetMs * 500 +
+                   (uint64_t)( rand() % ( pState->resetMs + 1 ) ) * 1000;
+        pConn->resetAt = now + interval;
+    }
+}
+
+/*============================================================================*/
+/*  CloseConnection                                                           */
+/*!
+    Close both sides of a proxied connection
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+    @param[in]
+        pConn
+            pointer to the connection
+
+    @param[in]
+        reset
+            true to abort both sides with a TCP reset and discard the
+            data in flight
+
+==============================================================================*/
+static void CloseConnection( ProxyState *pState,
+                             Connection *pConn,
+                             bool reset )
+{
+    struct linger lg = { 1, 0 };
+    PipeDir *dirs[2] = { &pConn->up, &pConn->down };
+    Chunk *pChunk;
+    int i;
+
+    if ( reset == true )
+    {
+        setsockopt( pConn->client, SOL_SOCKET, SO_LINGER, &lg, sizeof( lg ) );
+        setsockopt( pConn->upstream,
+                    SOL_SOCKET,
+                    SO_LINGER,
+                    &lg,
+                    sizeof( lg ) );
+        pState->resets++;
+    }
+
+    if ( pState->verbose )
+    {
+        fprintf( stdout,
+                 "iotproxy: connection %s\n",
+                 reset ? "reset" : "closed" );
+    }
+
+    for ( i = 0; i < 2; i++ )
+    {
+        while ( ( pChunk = dirs[i]->pHead ) != NULL )
+        {
+            dirs[i]->pHead = pChunk->pNext;
+            free( pChunk );
+        }
+    }
+
+    close( pConn->client );
+    close( pConn->upstream );
+    memset( pConn, 0, sizeof( Connection ) );
+    pConn->client = -1;
+    pConn->upstream = -1;
+}
+
+/*============================================================================*/
+/*  WriteStats                                                                */
+/*!
+    Report the proxy statistics
+
+    The statistics are written to stdout, and as JSON to the statistics
+    file if one was specified.  Outage times are in milliseconds from
+    the wall clock start time.
+
+    @param[in]
+        pState
+            pointer to the proxy state
+
+==============================================================================*/
+static void WriteStats( ProxyState *pState )
+{
+    FILE *fp;
+    int i;
+
+    fprintf( stdout,
+             "iotproxy: %lu connections %lu refused %lu resets "
+             "%lu bytes up %lu bytes down %d outages\n",
+             (unsigned long)pState->accepted,
+             (unsigned long)pState->refused,
+             (unsigned long)pState->resets,
+             (unsigned long)pState->bytesUp,
+             (unsigned long)pState->bytesDown,
+             pState->outageCount );
+
+    if ( pState->statsFile != NULL )
+    {
+        fp = fopen( pState->statsFile, "w" );
+        if ( fp != NULL )
+        {
+            fprintf( fp,
+                     "{\"connections\":%lu,\"refused\":%lu,\"resets\":%lu,"
+                     "\"bytes_up\":%lu,\"bytes_down\":%lu,\"start\":%lu,"
+                     "\"outages_ms\":[",
+                     (unsigned long)pState->accepted,
+                     (unsigned long)pState->refused,
+                     (unsigned long)pState->resets,
+                     (unsigned long)pState->bytesUp,
+                     (unsigned long)pState->bytesDown,
+                     (unsigned long)pState->startRealTime );
+
+            for ( i = 0; i < pState->outageCount; i++ )
+            {
+                fprintf( fp,
+                         "%s[%lu,%lu]",
+                         ( i > 0 ) ? "," : "",
+                         (unsigned long)pState->outages[i][0],
+                         (unsigned long)pState->outages[i][1] );
+            }
+
+            fprintf( fp, "]}\n" );
+            fclose( fp );
+        }
+    }
+}
+
+/*============================================================================*/
+/*  GetTimeUs                                                                 */
+/*!
+    Get the monotonic time in microseconds
+
+==============================================================================*/
+static uint64_t GetTimeUs( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*============================================================================*/
+/*  usage                                                                     */
+/*!
+    Display the application usage
+
+    @param[in]
+       cmdname
+            pointer to the invoked command name
+
+==============================================================================*/
+static void usage( char *cmdname )
+{
+    if( cmdname != NULL )
+    {
+        fprintf(stderr,
+                "usage: %s -u host:port [-h] [-v] [-p port] [-l ms] "
+                "[-j ms] [-b bytes/s]\n"
+                "          [-s period:ms] [-r ms] [-d period:ms] "
+                "[-o statsfile]\n"
+                " [-h] : display this help\n"
+                " [-v] : verbose output\n"
+                " [-u host:port] : upstream hub stand-in address\n"
+                " [-p port] : TCP port to listen on (loopback only)\n"
+                " [-l ms] : one way latency\n"
+                " [-j ms] : maximum additional random one way delay\n"
+                " [-b bytes/s] : bandwidth cap per direction\n"
+                " [-s period:ms] : stall all traffic for ms every period\n"
+                " [-r ms] : mean interval between connection resets\n"
+                " [-d period:ms] : take the link down for ms every "
+                "period\n"
+                " [-o statsfile] : write JSON statistics on exit\n",
+                cmdname );
+    }
+}
+
+/*============================================================================*/
+/*  ProcessOptions                                                            */
+/*!
+    Process the command line options
+
+    @param[in]
+        argC
+            number of arguments
+            (including the command itself)
+
+    @param[in]
+        argv
+            array of pointers to the command line arguments
+
+    @param[in]
+        pState
+            pointer to the proxy state object
+
+==============================================================================*/
+static int ProcessOptions( int argC, char *argV[], ProxyState *pState )
+{
+    int c;
+    char *p;
+    const char *options = "hvu:p:l:j:b:s:r:d:o:";
+
+    if( ( pState != NULL ) &&
+        ( argV != NULL ) )
+    {
+        while( ( c = getopt( argC, argV, options ) ) != -1 )
+        {
+            switch( c )
+            {
+                case 'h':
+                    usage( argV[0] );
+                    exit( 0 );
+                    break;
+
+                case 'v':
+                    pState->verbose = true;
+                    break;
+
+                case 'u':
+                    pState->upstream = optarg;
+                    break;
+
+                case 'p':
+                    pState->port = atoi( optarg );
+                    break;
+
+                case 'l':
+                    pState->latencyMs = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'j':
+                    pState->jitterMs = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'b':
+                    pState->bandwidth = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 's':
+                    pState->stallPeriodMs = strtoul( optarg, &p, 0 );
+                    pState->stallMs = ( *p == ':' )
+                                      ? strtoul( p + 1, NULL, 0 )
+                                      : 0;
+                    if ( pState->stallMs >= pState->stallPeriodMs )
+                    {
+                        pState->stallPeriodMs = 0;
+                    }
+                    break;
+
+                case 'r':
+                    pState->resetMs = strtoul( optarg, NULL, 0 );
+                    break;
+
+                case 'd':
+                    pState->outagePeriodMs = strtoul( optarg, &p, 0 );
+                    pState->outageMs = ( *p == ':' )
+                                       ? strtoul( p + 1, NULL, 0 )
+                                       : 0;
+                    if ( pState->outageMs >= pState->outagePeriodMs )
+                    {
+                        pState->outagePeriodMs = 0;
+                    }
+                    break;
+
+                case 'o':
+                    pState->statsFile = optarg;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+/*  SetupTerminationHandler                                                   */
+/*!
+    Set up the termination handler
+
+    The SIGINT and SIGTERM signals stop the proxy so it can report
+    its statistics.
+
+==============================================================================*/
+static void SetupTerminationHandler( void )
+{
+    static struct sigaction sigact;
+
+    memset( &sigact, 0, sizeof(sigact) );
+
+    sigact.sa_handler = TerminationHandler;
+
+    sigaction( SIGTERM, &sigact, NULL );
+    sigaction( SIGINT, &sigact, NULL );
+}
+
+/*============================================================================*/
+/*  TerminationHandler                                                        */
+/*!
+    Termination handler
+
+@param[in]
+    signum
+        The signal which caused the termination (unused)
+
+==============================================================================*/
+static void TerminationHandler( int signum )
+{
+    (void)signum;
+    done = 1;
+}
+
+/*! @}
+ * end of iotproxy group */